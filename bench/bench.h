@@ -0,0 +1,65 @@
+/*
+ * LSFS - Log-Structured Filesystem
+ * Benchmark helpers
+ *
+ * Every benchmark prints its results as CSV with one measurement per
+ * line, so runs from different builds can be joined on the first three
+ * columns and compared with compare.sh:
+ *
+ *     benchmark,variant,metric,value
+ *
+ * Metrics ending in _per_sec are better when higher; all others (times,
+ * latencies, amplification) are better when lower.
+ */
+
+#ifndef LSFS_BENCH_H
+#define LSFS_BENCH_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+#define BENCH_CSV_HEADER    "benchmark,variant,metric,value"
+
+/*
+ * Get a monotonic time in seconds
+ */
+static inline double bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Print one measurement
+ */
+static inline void bench_report(const char *bench, const char *variant, const char *metric,
+                                double value)
+{
+    printf("%s,%s,%s,%.6g\n", bench, variant, metric, value);
+    fflush(stdout);
+}
+
+/*
+ * Print the rate and cost of ops operations that took secs seconds
+ */
+static inline void bench_report_ops(const char *bench, const char *variant, uint64_t ops,
+                                    double secs)
+{
+    bench_report(bench, variant, "ops_per_sec", secs > 0 ? ops / secs : 0.0);
+    bench_report(bench, variant, "us_per_op", ops > 0 ? secs * 1e6 / ops : 0.0);
+}
+
+/*
+ * Print the throughput of moving bytes in secs seconds
+ */
+static inline void bench_report_bytes(const char *bench, const char *variant, uint64_t bytes,
+                                      double secs)
+{
+    bench_report(bench, variant, "mb_per_sec",
+                 secs > 0 ? bytes / secs / (1024.0 * 1024.0) : 0.0);
+}
+
+#endif /* LSFS_BENCH_H */
@@ -0,0 +1,278 @@
+/*
+ * LSFS - Log-Structured Filesystem
+ * bench_checksum - CRC32C and read verification microbenchmark
+ *
+ * Measures the throughput of each CRC32C implementation and the cost of
+ * each verify-on-read mode when reading segments back from a file.
+ * Results are printed as CSV (see bench.h).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+
+#include "ondisk.h"
+#include "crc32c.h"
+#include "bench.h"
+
+#define DEFAULT_SEGMENTS    64
+#define DEFAULT_ROUNDS      8
+
+static volatile uint32_t g_sink;    /* Keeps checksums from being optimized out */
+
+/*
+ * Time a CRC32C implementation over the buffer
+ */
+static void bench_crc(const char *variant,
+                      uint32_t (*fn)(uint32_t crc, const void *data, size_t len),
+                      const uint8_t *buf, size_t len, int rounds)
+{
+    uint32_t crc = 0;
+    double start = bench_now();
+
+    for (int r = 0; r < rounds; r++) {
+        crc = fn(crc, buf, len);
+    }
+    g_sink = crc;
+    bench_report_bytes("crc32c", variant, (uint64_t)len * rounds, bench_now() - start);
+}
+
+/*
+ * Time checksumming the buffer a block at a time, as segments are sealed
+ */
+static void bench_crc_blocks(const uint8_t *buf, size_t len, int rounds)
+{
+    uint32_t count = (uint32_t)(len / LSFS_BLOCK_SIZE);
+    uint32_t *crcs = malloc(count * sizeof(uint32_t));
+    double start = bench_now();
+
+    if (!crcs) {
+        return;
+    }
+    for (int r = 0; r < rounds; r++) {
+        lsfs_crc32c_blocks(buf, count, crcs);
+        g_sink ^= crcs[r % count];
+    }
+    bench_report_bytes("crc32c", "blocks", (uint64_t)len * rounds, bench_now() - start);
+    free(crcs);
+}
+
+/*
+ * Write segments with valid summaries and block checksums to the file
+ */
+static int write_segments(int fd, uint8_t *seg, uint32_t segments)
+{
+    struct lsfs_segment_summary *summary = (struct lsfs_segment_summary *)seg;
+    uint32_t data_blocks = LSFS_SEGMENT_BLOCKS - LSFS_SUMMARY_BLOCKS;
+    uint32_t *crcs = malloc(data_blocks * sizeof(uint32_t));
+
+    if (!crcs) {
+        return -1;
+    }
+
+    for (uint32_t s = 0; s < segments; s++) {
+        for (size_t i = LSFS_SUMMARY_BLOCKS * LSFS_BLOCK_SIZE; i < LSFS_SEGMENT_SIZE; i++) {
+            seg[i] = (uint8_t)(rand() >> 7);
+        }
+
+        memset(seg, 0, LSFS_SUMMARY_BLOCKS * LSFS_BLOCK_SIZE);
+        summary->header.magic = LSFS_SEGMENT_MAGIC;
+        summary->header.segment_id = s;
+        summary->header.block_count = LSFS_SEGMENT_BLOCKS;
+        lsfs_crc32c_blocks(seg + LSFS_SUMMARY_BLOCKS * LSFS_BLOCK_SIZE, data_blocks, crcs);
+        for (uint32_t i = 0; i < data_blocks; i++) {
+            summary->blocks[i].ino = 1;
+            summary->blocks[i].offset = i;
+            summary->blocks[i].type = LSFS_BLOCK_TYPE_DATA;
+            summary->blocks[i].checksum = crcs[i];
+        }
+        summary->header.checksum = lsfs_summary_checksum(summary);
+
+        if (pwrite(fd, seg, LSFS_SEGMENT_SIZE, (off_t)s * LSFS_SEGMENT_SIZE) !=
+            LSFS_SEGMENT_SIZE) {
+            free(crcs);
+            return -1;
+        }
+    }
+
+    free(crcs);
+    return 0;
+}
+
+/*
+ * Read the segments back as the given verification mode would
+ * none reads whole segments, segment reads whole segments and checks the
+ * summary and every block against it, and block reads each block on its
+ * own and checks it against the summary, as uncached filesystem reads do.
+ * Returns the number of checksum mismatches, or -1 on a read error.
+ */
+static int read_segments(int fd, uint8_t *seg, uint32_t segments, const char *mode)
+{
+    struct lsfs_segment_summary *summary = (struct lsfs_segment_summary *)seg;
+    uint32_t data_blocks = LSFS_SEGMENT_BLOCKS - LSFS_SUMMARY_BLOCKS;
+    uint32_t crcs[LSFS_SEGMENT_BLOCKS];
+    int bad = 0;
+
+    for (uint32_t s = 0; s < segments; s++) {
+        off_t base = (off_t)s * LSFS_SEGMENT_SIZE;
+
+        if (strcmp(mode, "block") != 0) {
+            if (pread(fd, seg, LSFS_SEGMENT_SIZE, base) != LSFS_SEGMENT_SIZE) {
+                return -1;
+            }
+            if (strcmp(mode, "none") == 0) {
+                continue;
+            }
+            if (summary->header.checksum != lsfs_summary_checksum(summary)) {
+                bad++;
+                continue;
+            }
+            lsfs_crc32c_blocks(seg + LSFS_SUMMARY_BLOCKS * LSFS_BLOCK_SIZE, data_blocks, crcs);
+            for (uint32_t i = 0; i < data_blocks; i++) {
+                bad += crcs[i] != summary->blocks[i].checksum;
+            }
+            continue;
+        }
+
+        /* The summary is read once and stays cached, like the block cache
+         * keeps it for the filesystem */
+        if (pread(fd, seg, LSFS_SUMMARY_BLOCKS * LSFS_BLOCK_SIZE, base) !=
+            LSFS_SUMMARY_BLOCKS * LSFS_BLOCK_SIZE) {
+            return -1;
+        }
+        for (uint32_t i = 0; i < data_blocks; i++) {
+            uint8_t *block = seg + (size_t)(LSFS_SUMMARY_BLOCKS + i) * LSFS_BLOCK_SIZE;
+
+            if (pread(fd, block, LSFS_BLOCK_SIZE,
+                      base + (off_t)(LSFS_SUMMARY_BLOCKS + i) * LSFS_BLOCK_SIZE) !=
+                LSFS_BLOCK_SIZE) {
+                return -1;
+            }
+            bad += lsfs_crc32c(0, block, LSFS_BLOCK_SIZE) != summary->blocks[i].checksum;
+        }
+    }
+
+    return bad;
+}
+
+/*
+ * Print usage
+ */
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [options] [scratch-file]\n", prog);
+    fprintf(stderr, "\nOptions:\n");
+    fprintf(stderr, "  -n, --segments <n>  Segments written to the scratch file (default: %d)\n",
+            DEFAULT_SEGMENTS);
+    fprintf(stderr, "  -r, --rounds <n>    Passes over the data per measurement (default: %d)\n",
+            DEFAULT_ROUNDS);
+    fprintf(stderr, "  -h, --help          Show this help\n");
+    fprintf(stderr, "\nThe scratch file defaults to bench_checksum.tmp in the current\n"
+                    "directory and is removed afterwards.  Reads are served from the page\n"
+                    "cache, so the verify results show the CPU cost of each mode.\n");
+}
+
+int main(int argc, char *argv[])
+{
+    uint32_t segments = DEFAULT_SEGMENTS;
+    int rounds = DEFAULT_ROUNDS;
+    const char *path = "bench_checksum.tmp";
+    static const char *const modes[] = { "none", "segment", "block" };
+
+    static struct option long_options[] = {
+        {"segments", required_argument, NULL, 'n'},
+        {"rounds", required_argument, NULL, 'r'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "n:r:h", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'n':
+            segments = (uint32_t)strtoul(optarg, NULL, 10);
+            break;
+        case 'r':
+            rounds = atoi(optarg);
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind < argc) {
+        path = argv[optind];
+    }
+    if (segments == 0 || rounds <= 0) {
+        fprintf(stderr, "Segments and rounds must be positive\n");
+        return 1;
+    }
+
+    uint8_t *seg = malloc(LSFS_SEGMENT_SIZE);
+    if (!seg) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    srand(1);
+    for (size_t i = 0; i < LSFS_SEGMENT_SIZE; i++) {
+        seg[i] = (uint8_t)(rand() >> 7);
+    }
+
+    const char *hw = lsfs_crc32c_impl();
+    fprintf(stderr, "crc32c implementation: %s\n", hw);
+    printf("%s\n", BENCH_CSV_HEADER);
+
+    /* The bytewise loop is slow, so it gets a single pass */
+    bench_crc("bytewise", lsfs_crc32c_bytewise, seg, LSFS_SEGMENT_SIZE, 1);
+    bench_crc("slicing-by-8", lsfs_crc32c_sw, seg, LSFS_SEGMENT_SIZE, rounds * 4);
+    if (strcmp(hw, "slicing-by-8") != 0) {
+        bench_crc(hw, lsfs_crc32c, seg, LSFS_SEGMENT_SIZE, rounds * 16);
+    }
+    bench_crc_blocks(seg, LSFS_SEGMENT_SIZE, rounds * 16);
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        perror("Failed to create scratch file");
+        free(seg);
+        return 1;
+    }
+    if (write_segments(fd, seg, segments) < 0) {
+        perror("Failed to write scratch file");
+        close(fd);
+        unlink(path);
+        free(seg);
+        return 1;
+    }
+
+    int ret = 0;
+    uint64_t bytes = (uint64_t)segments * LSFS_SEGMENT_SIZE * rounds;
+    for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]) && ret == 0; m++) {
+        /* Warm the page cache before timing */
+        read_segments(fd, seg, segments, "none");
+
+        double start = bench_now();
+        for (int r = 0; r < rounds; r++) {
+            int bad = read_segments(fd, seg, segments, modes[m]);
+            if (bad != 0) {
+                fprintf(stderr, "Verify %s: %s\n", modes[m],
+                        bad < 0 ? "read failed" : "checksum mismatch");
+                ret = 1;
+                break;
+            }
+        }
+        if (ret == 0) {
+            bench_report_bytes("verify", modes[m], bytes, bench_now() - start);
+        }
+    }
+
+    close(fd);
+    unlink(path);
+    free(seg);
+    return ret;
+}
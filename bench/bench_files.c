@@ -0,0 +1,565 @@
+/*
+ * LSFS - Log-Structured Filesystem
+ * bench_files - Workloads on a mounted filesystem
+ *
+ * Runs through the kernel against a mount point: storms of small file
+ * creates, stats and unlinks, 4 KiB writes each followed by fsync, and a
+ * long random overwrite of a mostly full filesystem.  The overwrite reads
+ * the daemon's statistics from the root's LSFS_STATS_XATTR attribute to
+ * report steady-state write amplification and the share of device writes
+ * the cleaner adds.  Results are printed as CSV (see bench.h).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/xattr.h>
+
+#include "ondisk.h"
+#include "bench.h"
+
+#define DEFAULT_FILES           10000
+#define DEFAULT_FSYNC_SECS      10
+#define DEFAULT_OVERWRITE_SECS  120
+#define DEFAULT_FILL_PERCENT    70
+#define FSYNC_MAX_THREADS       64
+#define OVERWRITE_SAMPLES       10
+
+static const char *g_mount;
+static char g_dir[4096];
+static uint8_t g_data[1 << 20];
+
+/* One thread of the fsync workload */
+struct fsync_worker {
+    pthread_t thread;
+    int fd;
+    double secs;
+    double *latencies;              /* Seconds per write and fsync */
+    uint64_t count;
+    uint64_t capacity;
+    int error;
+};
+
+/* Statistics of the daemon at one point in the overwrite */
+struct overwrite_sample {
+    double time;
+    uint64_t user_bytes;            /* Written by this benchmark */
+    uint64_t device_write;
+    uint64_t log_blocks;
+    uint64_t gc_segments;
+    uint64_t gc_live;
+};
+
+/*
+ * Build a path inside the benchmark directory
+ */
+static void bench_path(char *path, size_t size, const char *name)
+{
+    snprintf(path, size, "%s/%s", g_dir, name);
+}
+
+/*
+ * Write all of a buffer at an offset
+ */
+static int write_full(int fd, const void *buf, size_t len, off_t off)
+{
+    const uint8_t *p = buf;
+
+    while (len > 0) {
+        ssize_t n = pwrite(fd, p, len, off);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += n;
+        off += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/*
+ * Compare two latencies for sorting
+ */
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ * Get a percentile of sorted latencies in microseconds
+ */
+static double percentile_us(const double *sorted, uint64_t count, double pct)
+{
+    if (count == 0) {
+        return 0.0;
+    }
+
+    uint64_t index = (uint64_t)((double)(count - 1) * pct / 100.0 + 0.5);
+    return sorted[index] * 1e6;
+}
+
+/*
+ * Create, stat and unlink files, empty and with one block of data
+ */
+static int bench_small_files(uint32_t files)
+{
+    char path[4200];
+    char name[32];
+    struct stat st;
+
+    for (int pass = 0; pass < 2; pass++) {
+        const char *variant = pass == 0 ? "create_empty" : "create_4k";
+
+        double start = bench_now();
+        for (uint32_t i = 0; i < files; i++) {
+            snprintf(name, sizeof(name), "f%07u", i);
+            bench_path(path, sizeof(path), name);
+
+            int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+            if (fd < 0 || (pass == 1 && write_full(fd, g_data, 4096, 0) != 0)) {
+                perror(path);
+                if (fd >= 0) {
+                    close(fd);
+                }
+                return -1;
+            }
+            close(fd);
+        }
+        bench_report_ops("small_files", variant, files, bench_now() - start);
+
+        if (pass == 0) {
+            start = bench_now();
+            for (uint32_t i = 0; i < files; i++) {
+                snprintf(name, sizeof(name), "f%07u", i);
+                bench_path(path, sizeof(path), name);
+                if (stat(path, &st) != 0) {
+                    perror(path);
+                    return -1;
+                }
+            }
+            bench_report_ops("small_files", "stat", files, bench_now() - start);
+        }
+
+        start = bench_now();
+        for (uint32_t i = 0; i < files; i++) {
+            snprintf(name, sizeof(name), "f%07u", i);
+            bench_path(path, sizeof(path), name);
+            if (unlink(path) != 0) {
+                perror(path);
+                return -1;
+            }
+        }
+        if (pass == 0) {
+            bench_report_ops("small_files", "unlink", files, bench_now() - start);
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Append 4 KiB and fsync until the time is up
+ */
+static void *fsync_thread(void *arg)
+{
+    struct fsync_worker *w = arg;
+    double start = bench_now();
+    double now = start;
+    off_t off = 0;
+
+    while (now - start < w->secs) {
+        if (w->count == w->capacity) {
+            uint64_t capacity = w->capacity ? w->capacity * 2 : 4096;
+            double *grown = realloc(w->latencies, capacity * sizeof(double));
+            if (!grown) {
+                w->error = ENOMEM;
+                break;
+            }
+            w->latencies = grown;
+            w->capacity = capacity;
+        }
+
+        if (write_full(w->fd, g_data, 4096, off) != 0 || fsync(w->fd) != 0) {
+            w->error = errno;
+            break;
+        }
+        off += 4096;
+
+        double end = bench_now();
+        w->latencies[w->count++] = end - now;
+        now = end;
+    }
+
+    return NULL;
+}
+
+/*
+ * Write with fsync after every block from one and from several threads,
+ * each appending to its own file
+ */
+static int bench_fsync(double secs, uint32_t max_threads)
+{
+    uint32_t counts[] = { 1, max_threads };
+    struct fsync_worker workers[FSYNC_MAX_THREADS];
+    char path[4200];
+    char name[32];
+    int ret = 0;
+
+    for (size_t c = 0; c < 2 && ret == 0; c++) {
+        uint32_t threads = counts[c];
+
+        if (c == 1 && threads == 1) {
+            break;
+        }
+
+        memset(workers, 0, sizeof(workers));
+        uint32_t opened = 0;
+        for (; opened < threads; opened++) {
+            snprintf(name, sizeof(name), "fsync%u", opened);
+            bench_path(path, sizeof(path), name);
+            workers[opened].fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            workers[opened].secs = secs;
+            if (workers[opened].fd < 0) {
+                perror(path);
+                ret = -1;
+                break;
+            }
+        }
+
+        uint32_t started = 0;
+        for (; started < opened && ret == 0; started++) {
+            if (pthread_create(&workers[started].thread, NULL, fsync_thread,
+                               &workers[started]) != 0) {
+                fprintf(stderr, "Failed to start fsync threads\n");
+                ret = -1;
+                break;
+            }
+        }
+        for (uint32_t t = 0; t < started; t++) {
+            pthread_join(workers[t].thread, NULL);
+        }
+        threads = started;
+
+        uint64_t total = 0;
+        for (uint32_t t = 0; t < threads; t++) {
+            if (workers[t].error) {
+                fprintf(stderr, "fsync workload: %s\n", strerror(workers[t].error));
+                ret = -1;
+            }
+            total += workers[t].count;
+        }
+
+        double *all = total ? malloc(total * sizeof(double)) : NULL;
+        if (ret == 0 && all) {
+            uint64_t n = 0;
+            for (uint32_t t = 0; t < threads; t++) {
+                memcpy(all + n, workers[t].latencies, workers[t].count * sizeof(double));
+                n += workers[t].count;
+            }
+            qsort(all, total, sizeof(double), compare_double);
+
+            char variant[32];
+            snprintf(variant, sizeof(variant), "%u_threads", threads);
+            bench_report("fsync_write", variant, "ops_per_sec", total / secs);
+            bench_report("fsync_write", variant, "p50_us", percentile_us(all, total, 50));
+            bench_report("fsync_write", variant, "p99_us", percentile_us(all, total, 99));
+            bench_report("fsync_write", variant, "max_us", percentile_us(all, total, 100));
+        }
+        free(all);
+
+        for (uint32_t t = 0; t < opened; t++) {
+            free(workers[t].latencies);
+            close(workers[t].fd);
+            snprintf(name, sizeof(name), "fsync%u", t);
+            bench_path(path, sizeof(path), name);
+            unlink(path);
+        }
+    }
+
+    return ret;
+}
+
+/*
+ * Get a statistic out of the rendered LSFS_STATS_XATTR text, 0 if missing
+ */
+static uint64_t stats_value(const char *text, const char *name)
+{
+    size_t len = strlen(name);
+    const char *line = text;
+
+    while (line && *line) {
+        if (strncmp(line, name, len) == 0 && line[len] == ' ') {
+            return strtoull(line + len + 1, NULL, 10);
+        }
+        line = strchr(line, '\n');
+        if (line) {
+            line++;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Read the daemon's statistics into a sample
+ * Returns false if the mount point does not provide them.
+ */
+static bool overwrite_sample(struct overwrite_sample *s, uint64_t user_bytes)
+{
+    static char text[65536];
+    ssize_t len = getxattr(g_mount, LSFS_STATS_XATTR, text, sizeof(text) - 1);
+
+    s->time = bench_now();
+    s->user_bytes = user_bytes;
+    if (len < 0) {
+        return false;
+    }
+    text[len] = '\0';
+    s->device_write = stats_value(text, "device_write_bytes");
+    s->log_blocks = stats_value(text, "log_blocks");
+    s->gc_segments = stats_value(text, "gc_segments");
+    s->gc_live = stats_value(text, "gc_live_blocks");
+    return true;
+}
+
+/*
+ * Fill the filesystem to a share of its size with one file, then
+ * overwrite random blocks of it until the time is up
+ * The cleaner has caught up with the writes by the second half of the
+ * run, so the amplification reported is that of the second half.
+ */
+static int bench_overwrite(double secs, uint32_t fill_percent, uint32_t block_size)
+{
+    struct overwrite_sample samples[OVERWRITE_SAMPLES + 1];
+    struct statvfs sv;
+    char path[4200];
+
+    if (statvfs(g_dir, &sv) != 0) {
+        perror("statvfs");
+        return -1;
+    }
+
+    uint64_t size = (uint64_t)sv.f_blocks * sv.f_frsize / 100 * fill_percent;
+    uint64_t avail = (uint64_t)sv.f_bavail * sv.f_frsize;
+    size = (size < avail ? size : avail) / sizeof(g_data) * sizeof(g_data);
+    if (size == 0) {
+        fprintf(stderr, "No room for the overwrite workload\n");
+        return -1;
+    }
+
+    bench_path(path, sizeof(path), "overwrite");
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+
+    double start = bench_now();
+    for (uint64_t off = 0; off < size; off += sizeof(g_data)) {
+        if (write_full(fd, g_data, sizeof(g_data), (off_t)off) != 0) {
+            perror("overwrite fill");
+            close(fd);
+            unlink(path);
+            return -1;
+        }
+    }
+    fsync(fd);
+    bench_report_bytes("overwrite", "fill", size, bench_now() - start);
+
+    uint64_t blocks = size / block_size;
+    uint64_t user_bytes = 0;
+    bool have_stats = overwrite_sample(&samples[0], 0);
+    int ret = 0;
+
+    if (!have_stats) {
+        fprintf(stderr, "%s has no %s attribute; reporting throughput only\n", g_mount,
+                LSFS_STATS_XATTR);
+    }
+
+    srand(1);
+    start = samples[0].time;
+    for (int s = 1; s <= OVERWRITE_SAMPLES && ret == 0; s++) {
+        double until = start + secs * s / OVERWRITE_SAMPLES;
+
+        while (bench_now() < until) {
+            for (int i = 0; i < 64; i++) {
+                uint64_t block = ((uint64_t)rand() << 16 ^ (uint64_t)rand()) % blocks;
+                if (write_full(fd, g_data + (size_t)(i * 4096) % (sizeof(g_data) - block_size),
+                               block_size, (off_t)(block * block_size)) != 0) {
+                    perror("overwrite");
+                    ret = -1;
+                    break;
+                }
+                user_bytes += block_size;
+            }
+            if (ret != 0) {
+                break;
+            }
+        }
+        overwrite_sample(&samples[s], user_bytes);
+
+        if (have_stats) {
+            struct overwrite_sample *a = &samples[s - 1], *b = &samples[s];
+            uint64_t written = b->user_bytes - a->user_bytes;
+            fprintf(stderr, "overwrite %3d%%: %.1f MB/s, write amplification %.2f\n",
+                    s * 100 / OVERWRITE_SAMPLES,
+                    written / (b->time - a->time) / (1024.0 * 1024.0),
+                    written ? (double)(b->device_write - a->device_write) / written : 0.0);
+        }
+    }
+    fsync(fd);
+    close(fd);
+    unlink(path);
+    if (ret != 0) {
+        return ret;
+    }
+
+    struct overwrite_sample *a = &samples[OVERWRITE_SAMPLES / 2];
+    struct overwrite_sample *b = &samples[OVERWRITE_SAMPLES];
+    uint64_t written = b->user_bytes - a->user_bytes;
+    double elapsed = b->time - a->time;
+    char variant[32];
+
+    snprintf(variant, sizeof(variant), "random_%uk", block_size / 1024);
+    bench_report_ops("overwrite", variant, written / block_size, elapsed);
+    bench_report_bytes("overwrite", variant, written, elapsed);
+    if (have_stats && written > 0) {
+        double device = (double)(b->device_write - a->device_write);
+        double gc = (double)(b->gc_live - a->gc_live) * LSFS_BLOCK_SIZE;
+
+        bench_report("overwrite", variant, "write_amp", device / written);
+        bench_report("overwrite", variant, "log_amp",
+                     (double)(b->log_blocks - a->log_blocks) * LSFS_BLOCK_SIZE / written);
+        bench_report("overwrite", variant, "gc_copy_ratio", gc / written);
+        bench_report("overwrite", variant, "gc_device_share", device > 0 ? gc / device : 0.0);
+        bench_report("overwrite", variant, "gc_segments_per_gb",
+                     (double)(b->gc_segments - a->gc_segments) * (1 << 30) / written);
+    }
+
+    return 0;
+}
+
+/*
+ * Print usage
+ */
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [options] <mount point>\n", prog);
+    fprintf(stderr, "\nOptions:\n");
+    fprintf(stderr, "  -n, --files <n>          Files per create storm (default: %d)\n",
+            DEFAULT_FILES);
+    fprintf(stderr, "  -s, --fsync-secs <n>     Seconds per fsync run (default: %d)\n",
+            DEFAULT_FSYNC_SECS);
+    fprintf(stderr, "  -j, --threads <n>        Threads of the second fsync run (default: 4)\n");
+    fprintf(stderr, "  -o, --overwrite-secs <n> Seconds of random overwrites (default: %d)\n",
+            DEFAULT_OVERWRITE_SECS);
+    fprintf(stderr, "  -u, --fill <percent>     Share of the filesystem overwritten\n"
+                    "                           (default: %d)\n", DEFAULT_FILL_PERCENT);
+    fprintf(stderr, "  -b, --block-size <KiB>   Size of each overwrite (default: 4)\n");
+    fprintf(stderr, "  -h, --help               Show this help\n");
+    fprintf(stderr, "\nWorkloads run in a scratch directory under the mount point, which\n"
+                    "should be the root of an otherwise idle LSFS mount.\n");
+}
+
+int main(int argc, char *argv[])
+{
+    uint32_t files = DEFAULT_FILES;
+    double fsync_secs = DEFAULT_FSYNC_SECS;
+    double overwrite_secs = DEFAULT_OVERWRITE_SECS;
+    uint32_t threads = 4;
+    uint32_t fill = DEFAULT_FILL_PERCENT;
+    uint32_t block_kb = 4;
+
+    static struct option long_options[] = {
+        {"files", required_argument, NULL, 'n'},
+        {"fsync-secs", required_argument, NULL, 's'},
+        {"threads", required_argument, NULL, 'j'},
+        {"overwrite-secs", required_argument, NULL, 'o'},
+        {"fill", required_argument, NULL, 'u'},
+        {"block-size", required_argument, NULL, 'b'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "n:s:j:o:u:b:h", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'n':
+            files = (uint32_t)strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            fsync_secs = atof(optarg);
+            break;
+        case 'j':
+            threads = (uint32_t)strtoul(optarg, NULL, 10);
+            break;
+        case 'o':
+            overwrite_secs = atof(optarg);
+            break;
+        case 'u':
+            fill = (uint32_t)strtoul(optarg, NULL, 10);
+            break;
+        case 'b':
+            block_kb = (uint32_t)strtoul(optarg, NULL, 10);
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind + 1 != argc) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (threads < 1 || threads > FSYNC_MAX_THREADS || fill < 1 || fill > 95 ||
+        block_kb < 4 || block_kb > 512 || block_kb % 4 != 0) {
+        fprintf(stderr, "Threads must be 1-%d, fill 1-95%% and the block size a multiple\n"
+                        "of 4 KiB up to 512 KiB\n", FSYNC_MAX_THREADS);
+        return 1;
+    }
+
+    g_mount = argv[optind];
+    snprintf(g_dir, sizeof(g_dir), "%s/bench_files.%d", g_mount, (int)getpid());
+    if (mkdir(g_dir, 0755) != 0) {
+        perror(g_dir);
+        return 1;
+    }
+
+    srand(1);
+    for (size_t i = 0; i < sizeof(g_data); i++) {
+        g_data[i] = (uint8_t)(rand() >> 7);
+    }
+
+    printf("%s\n", BENCH_CSV_HEADER);
+
+    int ret = 0;
+    if (files > 0 && bench_small_files(files) != 0) {
+        ret = 1;
+    }
+    if (ret == 0 && fsync_secs > 0 && bench_fsync(fsync_secs, threads) != 0) {
+        ret = 1;
+    }
+    if (ret == 0 && overwrite_secs > 0 &&
+        bench_overwrite(overwrite_secs, fill, block_kb * 1024) != 0) {
+        ret = 1;
+    }
+
+    rmdir(g_dir);
+    return ret;
+}
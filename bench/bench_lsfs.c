@@ -0,0 +1,710 @@
+/*
+ * LSFS - Log-Structured Filesystem
+ * bench_lsfs - Library-level microbenchmarks
+ *
+ * Formats a scratch image and drives lsfs_lib on it directly, without
+ * FUSE or the background threads, so each measurement is the cost of the
+ * code path alone: segment appends, inode and directory lookups, inode
+ * map updates, cleaning segments at a given utilization, and checkpoints.
+ * Results are printed as CSV (see bench.h); the library's own log goes to
+ * stderr.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include "lsfs.h"
+#include "bench.h"
+
+#ifndef LSFS_MKFS_PATH
+#define LSFS_MKFS_PATH      "mkfs.lsfs"
+#endif
+
+#define BENCH_MIN_SECS      0.5     /* Shortest timed loop of an open-ended measurement */
+
+/* Filesystem settings for a benchmark mount */
+struct bench_config {
+    uint32_t size_mb;               /* Image size when formatting */
+    uint32_t cache_mb;              /* Buffer cache, 0 disables it */
+    uint32_t inode_cache;           /* Inode cache entries */
+    uint32_t dcache_entries;        /* Dentry cache entries, 0 disables it */
+};
+
+static const char *g_mkfs = LSFS_MKFS_PATH;
+static const char *g_image = "bench_lsfs.img";
+static const char *g_filter = NULL;
+static bool g_quick = false;
+static uint8_t g_data[32 * LSFS_BLOCK_SIZE];
+
+/*
+ * Check whether a benchmark was selected with -f
+ */
+static bool bench_selected(const char *name)
+{
+    return !g_filter || strncmp(name, g_filter, strlen(g_filter)) == 0;
+}
+
+/*
+ * Mount the scratch image, formatting it first if asked
+ * Returns NULL on failure.
+ */
+static struct lsfs_context *bench_mount(const struct bench_config *config, bool format)
+{
+    if (format) {
+        char cmd[1024];
+
+        snprintf(cmd, sizeof(cmd), "'%s' -s %u '%s' >/dev/null", g_mkfs, config->size_mb,
+                 g_image);
+        if (system(cmd) != 0) {
+            fprintf(stderr, "Failed to format %s with %s\n", g_image, g_mkfs);
+            return NULL;
+        }
+    }
+
+    struct lsfs_context *ctx = calloc(1, sizeof(*ctx));
+    if (!ctx) {
+        fprintf(stderr, "Out of memory\n");
+        return NULL;
+    }
+
+    ctx->fd = -1;
+    ctx->cache_size = (uint64_t)config->cache_mb * 1024 * 1024;
+    ctx->inode_cache_size = config->inode_cache;
+    ctx->dcache_entries = config->dcache_entries;
+    ctx->entry_timeout = 1.0;
+    ctx->attr_timeout = 1.0;
+    ctx->checkpoint_secs = LSFS_CHECKPOINT_DEFAULT_SECS;
+    ctx->checkpoint_blocks = LSFS_CHECKPOINT_DEFAULT_BLOCKS;
+    ctx->segment_alloc = LSFS_ALLOC_SEQUENTIAL;
+    ctx->verify_mode = LSFS_VERIFY_SEGMENT;
+    ctx->compress_codec = LSFS_CODEC_NONE;
+    ctx->io_backend = LSFS_IO_PSYNC;
+
+    if (lsfs_io_init(ctx, g_image) != LSFS_OK) {
+        fprintf(stderr, "Failed to open %s\n", g_image);
+        free(ctx);
+        return NULL;
+    }
+    if (lsfs_init_fs(ctx) != LSFS_OK) {
+        fprintf(stderr, "Failed to mount %s\n", g_image);
+        lsfs_io_destroy(ctx);
+        free(ctx);
+        return NULL;
+    }
+    if (lsfs_segment_writer_start(ctx) != LSFS_OK) {
+        fprintf(stderr, "Failed to start the segment writer\n");
+        lsfs_cleanup_fs(ctx);
+        free(ctx);
+        return NULL;
+    }
+
+    return ctx;
+}
+
+/*
+ * Unmount the scratch image
+ */
+static void bench_unmount(struct lsfs_context *ctx)
+{
+    if (lsfs_cleanup_fs(ctx) != LSFS_OK) {
+        fprintf(stderr, "Failed to unmount %s cleanly\n", g_image);
+    }
+    free(ctx);
+}
+
+/*
+ * Write everything in memory back to the log
+ */
+static void bench_persist(struct lsfs_context *ctx)
+{
+    lsfs_inode_sync_all(ctx, true);
+    lsfs_segment_flush(ctx);
+    lsfs_checkpoint_write(ctx);
+}
+
+/*
+ * Allocate an inode and write it to the log
+ */
+static struct lsfs_inode_mem *bench_inode(struct lsfs_context *ctx, uint32_t mode)
+{
+    struct lsfs_inode_mem *inode = lsfs_inode_alloc(ctx, mode);
+
+    if (!inode) {
+        return NULL;
+    }
+    pthread_mutex_lock(&inode->lock);
+    if (S_ISDIR(mode)) {
+        lsfs_dir_init(ctx, inode, LSFS_ROOT_INO);
+    }
+    lsfs_inode_write(ctx, inode);
+    pthread_mutex_unlock(&inode->lock);
+    return inode;
+}
+
+/*
+ * Write len bytes of g_data to a file, as a FUSE write would
+ */
+static int bench_write(struct lsfs_context *ctx, struct lsfs_inode_mem *inode, uint64_t off,
+                       size_t len)
+{
+    struct fuse_bufvec src = FUSE_BUFVEC_INIT(len);
+    ssize_t n;
+
+    src.buf[0].mem = g_data;
+    pthread_mutex_lock(&inode->lock);
+    n = lsfs_inode_write_data(ctx, inode, off, len, &src, LSFS_STREAM_DATA);
+    if (n > 0 && off + (uint64_t)n > inode->disk_inode.size) {
+        inode->disk_inode.size = off + (uint64_t)n;
+    }
+    inode->dirty = true;
+    pthread_mutex_unlock(&inode->lock);
+    return n == (ssize_t)len ? LSFS_OK : LSFS_ERR_IO;
+}
+
+/*
+ * Get a random number below n
+ */
+static uint32_t bench_random(uint32_t n)
+{
+    return (uint32_t)(((uint64_t)rand() << 16 ^ (uint64_t)rand()) % n);
+}
+
+/*
+ * Append blocks to the data log one at a time and in runs of 32, the way
+ * single-block metadata and multi-block writes reach it
+ */
+static int bench_append(void)
+{
+    static const uint32_t runs[] = { 1, 32 };
+    struct bench_config config = { 512, 16, LSFS_INODE_CACHE_DEFAULT,
+                                   LSFS_DCACHE_DEFAULT_ENTRIES };
+    uint32_t blocks = g_quick ? 8192 : 32768;
+
+    for (size_t r = 0; r < sizeof(runs) / sizeof(runs[0]); r++) {
+        struct lsfs_context *ctx = bench_mount(&config, true);
+        if (!ctx) {
+            return -1;
+        }
+
+        double start = bench_now();
+        for (uint32_t done = 0; done < blocks;) {
+            uint32_t granted;
+            uint8_t *dst;
+            uint64_t addr;
+
+            if (runs[r] == 1) {
+                addr = lsfs_segment_append_block(ctx, g_data, LSFS_ROOT_INO + 1, done,
+                                                 LSFS_BLOCK_TYPE_DATA);
+                granted = 1;
+            } else {
+                addr = lsfs_segment_reserve(ctx, LSFS_STREAM_DATA,
+                                            LSFS_MIN(runs[r], blocks - done),
+                                            LSFS_ROOT_INO + 1, done, LSFS_BLOCK_TYPE_DATA,
+                                            &granted, &dst);
+                if (addr != 0) {
+                    memcpy(dst, g_data, (size_t)granted * LSFS_BLOCK_SIZE);
+                    lsfs_segment_commit(ctx, addr, granted);
+                }
+            }
+            if (addr == 0) {
+                fprintf(stderr, "Append failed after %u blocks\n", done);
+                bench_unmount(ctx);
+                return -1;
+            }
+            done += granted;
+        }
+        lsfs_segment_flush(ctx);
+        double secs = bench_now() - start;
+
+        const char *variant = runs[r] == 1 ? "block" : "run32";
+        bench_report_ops("segment_append", variant, blocks, secs);
+        bench_report_bytes("segment_append", variant, (uint64_t)blocks * LSFS_BLOCK_SIZE, secs);
+        bench_unmount(ctx);
+    }
+
+    return 0;
+}
+
+/*
+ * Time a pass of lsfs_inode_get over the inodes
+ */
+static double bench_inode_pass(struct lsfs_context *ctx, const uint32_t *inos, uint32_t count)
+{
+    double start = bench_now();
+
+    for (uint32_t i = 0; i < count; i++) {
+        struct lsfs_inode_mem *inode = lsfs_inode_get(ctx, inos[i]);
+        if (!inode) {
+            fprintf(stderr, "Inode %u not found\n", inos[i]);
+            return -1.0;
+        }
+        lsfs_inode_put(inode);
+    }
+    return bench_now() - start;
+}
+
+/*
+ * Look up inodes through the inode cache when they are cached, when they
+ * are not but their blocks are in the buffer cache, and when every miss
+ * reads its block from the image
+ */
+static int bench_inode_get(void)
+{
+    struct bench_config config = { 256, 16, LSFS_INODE_CACHE_DEFAULT,
+                                   LSFS_DCACHE_DEFAULT_ENTRIES };
+    uint32_t count = g_quick ? 2048 : 8192;
+    uint32_t rounds = 16;
+    uint32_t *inos = malloc(count * sizeof(uint32_t));
+    struct lsfs_context *ctx;
+    double secs = 0;
+
+    if (!inos || !(ctx = bench_mount(&config, true))) {
+        free(inos);
+        return -1;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        struct lsfs_inode_mem *inode = bench_inode(ctx, S_IFREG | 0644);
+        if (!inode) {
+            fprintf(stderr, "Inode allocation failed after %u inodes\n", i);
+            bench_unmount(ctx);
+            free(inos);
+            return -1;
+        }
+        inos[i] = inode->disk_inode.ino;
+        lsfs_inode_put(inode);
+    }
+    bench_persist(ctx);
+
+    for (uint32_t r = 0; r < rounds && secs >= 0; r++) {
+        double pass = bench_inode_pass(ctx, inos, count);
+        secs = pass < 0 ? pass : secs + pass;
+    }
+    if (secs >= 0) {
+        bench_report_ops("inode_get", "hit", (uint64_t)count * rounds, secs);
+    }
+    bench_unmount(ctx);
+
+    /* A cache of 64 inodes misses on every inode of a sequential pass */
+    static const uint32_t cache_mb[] = { 16, 0 };
+    for (size_t c = 0; c < sizeof(cache_mb) / sizeof(cache_mb[0]) && secs >= 0; c++) {
+        config.inode_cache = 64;
+        config.cache_mb = cache_mb[c];
+        ctx = bench_mount(&config, false);
+        if (!ctx) {
+            free(inos);
+            return -1;
+        }
+        bench_inode_pass(ctx, inos, count);     /* Warm the buffer cache */
+        secs = bench_inode_pass(ctx, inos, count);
+        if (secs >= 0) {
+            bench_report_ops("inode_get", cache_mb[c] ? "miss" : "miss_uncached", count, secs);
+        }
+        bench_unmount(ctx);
+    }
+
+    free(inos);
+    return secs >= 0 ? 0 : -1;
+}
+
+/*
+ * Look up random names of a directory for at least BENCH_MIN_SECS
+ */
+static int bench_dir_lookups(struct lsfs_context *ctx, uint32_t dir_ino, uint32_t entries,
+                             const char *variant)
+{
+    struct lsfs_inode_mem *dir = lsfs_inode_get(ctx, dir_ino);
+    uint64_t ops = 0;
+    double start = bench_now();
+    double secs = 0;
+    char name[32];
+    int ret = 0;
+
+    if (!dir) {
+        return -1;
+    }
+    while (secs < BENCH_MIN_SECS && ret == 0) {
+        for (int i = 0; i < 64; i++) {
+            uint32_t ino;
+
+            snprintf(name, sizeof(name), "f%07u", bench_random(entries));
+            pthread_mutex_lock(&dir->lock);
+            if (lsfs_dir_lookup(ctx, dir, name, &ino, NULL) != LSFS_OK) {
+                fprintf(stderr, "Lookup of %s failed\n", name);
+                ret = -1;
+            }
+            pthread_mutex_unlock(&dir->lock);
+        }
+        ops += 64;
+        secs = bench_now() - start;
+    }
+    lsfs_inode_put(dir);
+
+    if (ret == 0) {
+        bench_report_ops("dir_lookup", variant, ops, secs);
+    }
+    return ret;
+}
+
+/*
+ * Fill directories of 10, 1k and 100k entries and look names up in them,
+ * with a dentry cache large enough for all of them and without one
+ */
+static int bench_dir(void)
+{
+    static const uint32_t sizes[] = { 10, 1000, 100000 };
+    struct bench_config config = { 1024, 16, LSFS_INODE_CACHE_DEFAULT, 262144 };
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        uint32_t entries = g_quick ? LSFS_MIN(sizes[s], 10000) : sizes[s];
+        char variant[32];
+        char name[32];
+
+        config.dcache_entries = 262144;
+        struct lsfs_context *ctx = bench_mount(&config, true);
+        if (!ctx) {
+            return -1;
+        }
+        struct lsfs_inode_mem *dir = bench_inode(ctx, S_IFDIR | 0755);
+        if (!dir) {
+            bench_unmount(ctx);
+            return -1;
+        }
+        uint32_t dir_ino = dir->disk_inode.ino;
+
+        double start = bench_now();
+        int ret = LSFS_OK;
+        for (uint32_t i = 0; i < entries && ret == LSFS_OK; i++) {
+            snprintf(name, sizeof(name), "f%07u", i);
+            pthread_mutex_lock(&dir->lock);
+            ret = lsfs_dir_add(ctx, dir, name, dir_ino, LSFS_FT_REG_FILE);
+            pthread_mutex_unlock(&dir->lock);
+        }
+        double secs = bench_now() - start;
+        lsfs_inode_put(dir);
+        if (ret != LSFS_OK) {
+            fprintf(stderr, "Adding entries to a directory failed\n");
+            bench_unmount(ctx);
+            return -1;
+        }
+
+        snprintf(variant, sizeof(variant), "%u", entries);
+        bench_report_ops("dir_add", variant, entries, secs);
+
+        snprintf(variant, sizeof(variant), "%u_cached", entries);
+        ret = bench_dir_lookups(ctx, dir_ino, entries, variant);
+        bench_persist(ctx);
+        bench_unmount(ctx);
+        if (ret != 0) {
+            return -1;
+        }
+
+        config.dcache_entries = 0;
+        ctx = bench_mount(&config, false);
+        if (!ctx) {
+            return -1;
+        }
+        snprintf(variant, sizeof(variant), "%u_uncached", entries);
+        ret = bench_dir_lookups(ctx, dir_ino, entries, variant);
+        bench_unmount(ctx);
+        if (ret != 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Insert inode map entries in order and at random, and update them
+ */
+static int bench_imap(void)
+{
+    uint32_t count = g_quick ? (1u << 18) : (1u << 20);
+    uint32_t *order = malloc(count * sizeof(uint32_t));
+    static const char *const variants[] = { "sequential", "random", "update" };
+
+    if (!order) {
+        return -1;
+    }
+
+    for (size_t v = 0; v < sizeof(variants) / sizeof(variants[0]); v++) {
+        struct lsfs_imap imap;
+
+        /* Inode 0 is never used, and the map holds whole chunks */
+        if (lsfs_imap_init(&imap, count + LSFS_IMAP_CHUNK_ENTRIES) != LSFS_OK) {
+            free(order);
+            return -1;
+        }
+
+        for (uint32_t i = 0; i < count; i++) {
+            order[i] = i + 1;
+        }
+        if (v > 0) {
+            for (uint32_t i = count - 1; i > 0; i--) {
+                uint32_t j = bench_random(i + 1);
+                uint32_t t = order[i];
+                order[i] = order[j];
+                order[j] = t;
+            }
+        }
+        if (v == 2) {
+            for (uint32_t i = 0; i < count; i++) {
+                lsfs_imap_set(&imap, i + 1, 1);
+            }
+        }
+
+        double start = bench_now();
+        for (uint32_t i = 0; i < count; i++) {
+            lsfs_imap_set(&imap, order[i], (uint64_t)order[i] << 8);
+        }
+        bench_report_ops("imap_set", variants[v], count, bench_now() - start);
+        lsfs_imap_destroy(&imap);
+    }
+
+    free(order);
+    return 0;
+}
+
+/*
+ * Clean segments holding a given share of live data
+ * Data is written in runs of 8 blocks to two files, one of which is then
+ * deleted, so each data segment keeps utilization percent of its blocks.
+ * The timed part cleans every full segment and makes the result durable,
+ * as one round of the cleaner does.
+ */
+static int bench_gc_utilization(uint32_t utilization)
+{
+    struct bench_config config = { g_quick ? 128 : 256, 16, LSFS_INODE_CACHE_DEFAULT,
+                                   LSFS_DCACHE_DEFAULT_ENTRIES };
+    struct lsfs_context *ctx = bench_mount(&config, true);
+    char variant[32];
+
+    if (!ctx) {
+        return -1;
+    }
+
+    struct lsfs_segment_table *table = &ctx->segtable;
+    struct lsfs_inode_mem *keep = bench_inode(ctx, S_IFREG | 0644);
+    struct lsfs_inode_mem *drop = bench_inode(ctx, S_IFREG | 0644);
+    if (!keep || !drop) {
+        lsfs_inode_put(keep);
+        lsfs_inode_put(drop);
+        bench_unmount(ctx);
+        return -1;
+    }
+
+    /* Fill 30% of the log, leaving room for the cleaner to copy into */
+    uint64_t runs = (uint64_t)table->count * table->segment_blocks * 3 / 10 / 8;
+    uint64_t keep_off = 0, drop_off = 0;
+    int ret = LSFS_OK;
+    for (uint64_t r = 0; r < runs && ret == LSFS_OK; r++) {
+        if ((r % 10) * 10 < utilization) {
+            ret = bench_write(ctx, keep, keep_off, 8 * LSFS_BLOCK_SIZE);
+            keep_off += 8 * LSFS_BLOCK_SIZE;
+        } else {
+            ret = bench_write(ctx, drop, drop_off, 8 * LSFS_BLOCK_SIZE);
+            drop_off += 8 * LSFS_BLOCK_SIZE;
+        }
+    }
+    pthread_mutex_lock(&drop->lock);
+    lsfs_inode_free(ctx, drop);
+    pthread_mutex_unlock(&drop->lock);
+    lsfs_inode_put(drop);
+    lsfs_inode_put(keep);
+    bench_persist(ctx);
+    if (ret != LSFS_OK) {
+        fprintf(stderr, "Filling the log failed\n");
+        bench_unmount(ctx);
+        return -1;
+    }
+
+    uint32_t *victims = malloc(table->count * sizeof(uint32_t));
+    uint32_t nvictims = 0;
+    uint64_t live = 0;
+    if (!victims) {
+        bench_unmount(ctx);
+        return -1;
+    }
+    pthread_mutex_lock(&table->lock);
+    for (uint32_t s = 0; s < table->count; s++) {
+        if (table->entries[s].state == LSFS_SEG_FULL) {
+            victims[nvictims++] = s;
+            live += table->entries[s].live_blocks;
+        }
+    }
+    pthread_mutex_unlock(&table->lock);
+
+    double start = bench_now();
+    for (uint32_t i = 0; i < nvictims && ret == LSFS_OK; i++) {
+        ret = lsfs_gc_clean_segment(ctx, victims[i]);
+    }
+    bench_persist(ctx);
+    double secs = bench_now() - start;
+
+    if (ret != LSFS_OK) {
+        fprintf(stderr, "Cleaning failed at %u%% utilization\n", utilization);
+    } else {
+        uint64_t blocks = (uint64_t)nvictims * table->segment_blocks;
+
+        snprintf(variant, sizeof(variant), "util_%u", utilization);
+        bench_report("gc_clean", variant, "live_percent",
+                     blocks ? 100.0 * (double)live / (double)blocks : 0.0);
+        bench_report("gc_clean", variant, "segments_per_sec", secs > 0 ? nvictims / secs : 0.0);
+        bench_report_bytes("gc_clean", variant, (blocks - live) * LSFS_BLOCK_SIZE, secs);
+        bench_report("gc_clean", variant, "copied_blocks_per_freed_block",
+                     blocks > live ? (double)live / (double)(blocks - live) : 0.0);
+    }
+
+    free(victims);
+    bench_unmount(ctx);
+    return ret == LSFS_OK ? 0 : -1;
+}
+
+/*
+ * Clean segments at utilizations from 10% to 90%
+ */
+static int bench_gc(void)
+{
+    for (uint32_t u = 10; u <= 90; u += 20) {
+        if (bench_gc_utilization(u) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Time checkpoints with nothing changed since the last one, and after
+ * creating a batch of inodes spread over the inode map
+ */
+static int bench_checkpoint(void)
+{
+    static const uint32_t batches[] = { 0, 1000 };
+    struct bench_config config = { 256, 16, LSFS_INODE_CACHE_DEFAULT,
+                                   LSFS_DCACHE_DEFAULT_ENTRIES };
+    uint32_t rounds = g_quick ? 5 : 20;
+    char variant[32];
+
+    struct lsfs_context *ctx = bench_mount(&config, true);
+    if (!ctx) {
+        return -1;
+    }
+
+    for (size_t b = 0; b < sizeof(batches) / sizeof(batches[0]); b++) {
+        double secs = 0;
+        double max = 0;
+
+        for (uint32_t r = 0; r < rounds; r++) {
+            for (uint32_t i = 0; i < batches[b]; i++) {
+                lsfs_inode_put(bench_inode(ctx, S_IFREG | 0644));
+            }
+            lsfs_inode_sync_all(ctx, true);
+
+            double start = bench_now();
+            if (lsfs_checkpoint_write(ctx) != LSFS_OK) {
+                fprintf(stderr, "Checkpoint failed\n");
+                bench_unmount(ctx);
+                return -1;
+            }
+            double t = bench_now() - start;
+            secs += t;
+            max = LSFS_MAX(max, t);
+        }
+
+        if (batches[b] == 0) {
+            snprintf(variant, sizeof(variant), "idle");
+        } else {
+            snprintf(variant, sizeof(variant), "%u_inodes", batches[b]);
+        }
+        bench_report_ops("checkpoint_write", variant, rounds, secs);
+        bench_report("checkpoint_write", variant, "max_us", max * 1e6);
+    }
+
+    bench_unmount(ctx);
+    return 0;
+}
+
+/*
+ * Print usage
+ */
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [options] [scratch-image]\n", prog);
+    fprintf(stderr, "\nOptions:\n");
+    fprintf(stderr, "  -m, --mkfs <path>      mkfs.lsfs used to format the image\n"
+                    "                         (default: %s)\n", LSFS_MKFS_PATH);
+    fprintf(stderr, "  -f, --filter <prefix>  Run only benchmarks whose name starts with it\n");
+    fprintf(stderr, "  -q, --quick            Smaller workloads, for a quick check\n");
+    fprintf(stderr, "  -h, --help             Show this help\n");
+    fprintf(stderr, "\nBenchmarks: segment_append, inode_get, dir, imap_set, gc_clean,\n"
+                    "checkpoint_write.  The scratch image defaults to bench_lsfs.img in\n"
+                    "the current directory and is removed afterwards.\n");
+}
+
+int main(int argc, char *argv[])
+{
+    static const struct {
+        const char *name;
+        int (*run)(void);
+    } benches[] = {
+        { "segment_append", bench_append },
+        { "inode_get", bench_inode_get },
+        { "dir", bench_dir },
+        { "imap_set", bench_imap },
+        { "gc_clean", bench_gc },
+        { "checkpoint_write", bench_checkpoint },
+    };
+
+    static struct option long_options[] = {
+        {"mkfs", required_argument, NULL, 'm'},
+        {"filter", required_argument, NULL, 'f'},
+        {"quick", no_argument, NULL, 'q'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "m:f:qh", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'm':
+            g_mkfs = optarg;
+            break;
+        case 'f':
+            g_filter = optarg;
+            break;
+        case 'q':
+            g_quick = true;
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind < argc) {
+        g_image = argv[optind];
+    }
+
+    srand(1);
+    for (size_t i = 0; i < sizeof(g_data); i++) {
+        g_data[i] = (uint8_t)(rand() >> 7);
+    }
+
+    printf("%s\n", BENCH_CSV_HEADER);
+
+    int ret = 0;
+    for (size_t b = 0; b < sizeof(benches) / sizeof(benches[0]) && ret == 0; b++) {
+        if (bench_selected(benches[b].name) && benches[b].run() != 0) {
+            fprintf(stderr, "Benchmark %s failed\n", benches[b].name);
+            ret = 1;
+        }
+    }
+
+    unlink(g_image);
+    return ret;
+}
@@ -0,0 +1,79 @@
+#!/bin/bash
+#
+# LSFS Benchmark Comparison
+#
+# Compares two benchmark CSVs (benchmark,variant,metric,value) measurement
+# by measurement and exits with status 1 if any got worse by more than the
+# threshold.  Metrics ending in _per_sec are better when higher, all
+# others when lower.
+#
+
+set -e
+
+THRESHOLD=10
+
+# Print usage
+usage() {
+    echo "Usage: $0 [options] <baseline.csv> <current.csv>"
+    echo ""
+    echo "Options:"
+    echo "  -t, --threshold <percent>  Change that counts as a regression (default: $THRESHOLD)"
+    echo "  -h, --help                 Show this help"
+}
+
+# Parse arguments
+FILES=()
+while [[ $# -gt 0 ]]; do
+    case $1 in
+        -t|--threshold)
+            THRESHOLD="$2"
+            shift 2
+            ;;
+        -h|--help)
+            usage
+            exit 0
+            ;;
+        -*)
+            echo "Unknown option: $1"
+            usage
+            exit 1
+            ;;
+        *)
+            FILES+=("$1")
+            shift
+            ;;
+    esac
+done
+
+if [ ${#FILES[@]} -ne 2 ]; then
+    usage
+    exit 1
+fi
+
+awk -F',' -v threshold="$THRESHOLD" '
+    $1 == "benchmark" || NF != 4 { next }
+    NR == FNR { base[$1 "," $2 "," $3] = $4; next }
+    {
+        key = $1 "," $2 "," $3
+        if (!(key in base)) {
+            printf "%-56s %12s %12s   new\n", key, "-", $4
+            next
+        }
+        old = base[key]
+        if (old == 0) {
+            next
+        }
+        change = ($4 - old) * 100.0 / (old < 0 ? -old : old)
+        worse = $3 ~ /_per_sec$/ ? -change : change
+        flag = worse > threshold ? "   REGRESSION" : (worse < -threshold ? "   improved" : "")
+        printf "%-56s %12.6g %12.6g %+7.1f%%%s\n", key, old, $4, change, flag
+        if (worse > threshold) {
+            regressions++
+        }
+    }
+    END {
+        if (regressions > 0) {
+            printf "\n%d measurements regressed by more than %s%%\n", regressions, threshold
+            exit 1
+        }
+    }' "${FILES[0]}" "${FILES[1]}"
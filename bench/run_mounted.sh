@@ -0,0 +1,193 @@
+#!/bin/bash
+#
+# LSFS Mounted Benchmarks
+#
+# Formats a scratch image, mounts it and runs fio and bench_files against
+# the mount, then checks the image with fsck.lsfs.  All results go to one
+# CSV in the format of the other benchmarks: benchmark,variant,metric,value
+#
+
+set -eo pipefail
+
+SCRIPT_DIR="$(cd "$(dirname "$0")" && pwd)"
+PROJECT_DIR="$(dirname "$SCRIPT_DIR")"
+BUILD_DIR="$PROJECT_DIR/build"
+
+WORK_DIR="/tmp/lsfs_bench"
+SIZE_MB=2048
+RUNTIME=30
+OUTPUT=""
+LSFS_ARGS=""
+QUICK=0
+
+# Print usage
+usage() {
+    echo "Usage: $0 [options]"
+    echo ""
+    echo "Options:"
+    echo "  -b, --build-dir <dir>  Build directory (default: $BUILD_DIR)"
+    echo "  -w, --work-dir <dir>   Directory for the image and mount point"
+    echo "                         (default: $WORK_DIR)"
+    echo "  -s, --size <MB>        Filesystem size (default: $SIZE_MB)"
+    echo "  -r, --runtime <secs>   Seconds per fio job (default: $RUNTIME)"
+    echo "  -o, --output <file>    Write the CSV here instead of stdout"
+    echo "  -m, --mount-args <s>   Extra lsfs options, e.g. \"-t 4 -z lz4\""
+    echo "  -q, --quick            Short runs on a small filesystem"
+    echo "  -h, --help             Show this help"
+    echo ""
+    echo "fio jobs are skipped when fio is not installed, and the whole run"
+    echo "is skipped when FUSE is not available."
+}
+
+# Parse arguments
+while [[ $# -gt 0 ]]; do
+    case $1 in
+        -b|--build-dir)
+            BUILD_DIR="$2"
+            shift 2
+            ;;
+        -w|--work-dir)
+            WORK_DIR="$2"
+            shift 2
+            ;;
+        -s|--size)
+            SIZE_MB="$2"
+            shift 2
+            ;;
+        -r|--runtime)
+            RUNTIME="$2"
+            shift 2
+            ;;
+        -o|--output)
+            OUTPUT="$2"
+            shift 2
+            ;;
+        -m|--mount-args)
+            LSFS_ARGS="$2"
+            shift 2
+            ;;
+        -q|--quick)
+            QUICK=1
+            shift
+            ;;
+        -h|--help)
+            usage
+            exit 0
+            ;;
+        *)
+            echo "Unknown option: $1"
+            usage
+            exit 1
+            ;;
+    esac
+done
+
+if [ $QUICK -eq 1 ]; then
+    SIZE_MB=256
+    RUNTIME=5
+    FIO_SIZE=64m
+    FILES_ARGS="-n 1000 -s 2 -o 20"
+else
+    FIO_SIZE=$((SIZE_MB / 4))m
+    FILES_ARGS="-s 10 -o $((RUNTIME * 4))"
+fi
+
+DISK_IMAGE="$WORK_DIR/disk.img"
+MOUNT_POINT="$WORK_DIR/mnt"
+LSFS_PID=""
+
+# Check the build and the environment
+for prog in lsfs mkfs.lsfs fsck.lsfs bench/bench_files; do
+    if [ ! -x "$BUILD_DIR/$prog" ]; then
+        echo "Error: $BUILD_DIR/$prog not found. Build the bench target first." >&2
+        exit 1
+    fi
+done
+if [ ! -c /dev/fuse ] || { ! command -v fusermount3 >/dev/null 2>&1 &&
+                           ! command -v fusermount >/dev/null 2>&1; }; then
+    echo "FUSE is not available; skipping mounted benchmarks" >&2
+    exit 0
+fi
+FUSERMOUNT=$(command -v fusermount3 || command -v fusermount)
+
+# Unmount and remove the scratch files
+cleanup() {
+    if mountpoint -q "$MOUNT_POINT" 2>/dev/null; then
+        "$FUSERMOUNT" -u "$MOUNT_POINT" 2>/dev/null || true
+    fi
+    if [ -n "$LSFS_PID" ]; then
+        wait "$LSFS_PID" 2>/dev/null || true
+    fi
+    rm -rf "$WORK_DIR"
+}
+trap cleanup EXIT
+
+if [ -n "$OUTPUT" ]; then
+    exec 3>"$OUTPUT"
+else
+    exec 3>&1
+fi
+
+# Run one fio job and print its results
+# Fields are those of fio's terse format version 3: bandwidth (KiB/s),
+# IOPS, and completion latency mean and 99th percentile (us) of the read
+# side from field 7 and of the write side from field 48.
+run_fio() {
+    local name="$1" rw="$2" bs="$3" side="$4"
+    shift 4
+
+    fio --name="$name" --directory="$MOUNT_POINT" --filename=fio.dat --rw="$rw" \
+        --bs="$bs" --size="$FIO_SIZE" --ioengine=psync --invalidate=1 \
+        --output-format=terse --terse-version=3 "$@" |
+    awk -F';' -v name="$name" -v side="$side" '
+        $1 == "3" {
+            base = side == "read" ? 0 : 41
+            split($(30 + base), p99, "=")
+            printf "fio,%s,mb_per_sec,%.6g\n", name, $(7 + base) / 1024
+            printf "fio,%s,ops_per_sec,%.6g\n", name, $(8 + base)
+            printf "fio,%s,mean_us,%.6g\n", name, $(16 + base)
+            printf "fio,%s,p99_us,%.6g\n", name, p99[2]
+        }' >&3
+}
+
+echo "benchmark,variant,metric,value" >&3
+
+rm -rf "$WORK_DIR"
+mkdir -p "$MOUNT_POINT"
+"$BUILD_DIR/mkfs.lsfs" -s "$SIZE_MB" "$DISK_IMAGE" > /dev/null
+
+# shellcheck disable=SC2086
+"$BUILD_DIR/lsfs" -f $LSFS_ARGS "$DISK_IMAGE" "$MOUNT_POINT" 2>"$WORK_DIR/lsfs.log" &
+LSFS_PID=$!
+for _ in $(seq 50); do
+    mountpoint -q "$MOUNT_POINT" && break
+    sleep 0.2
+done
+if ! mountpoint -q "$MOUNT_POINT"; then
+    echo "Error: filesystem failed to mount" >&2
+    cat "$WORK_DIR/lsfs.log" >&2
+    exit 1
+fi
+
+if command -v fio >/dev/null 2>&1; then
+    run_fio seq_write write 1m write --end_fsync=1
+    run_fio seq_read read 1m read
+    run_fio rand_write randwrite 4k write --runtime="$RUNTIME" --time_based
+    run_fio rand_read randread 4k read --runtime="$RUNTIME" --time_based
+    rm -f "$MOUNT_POINT/fio.dat"
+else
+    echo "fio not found; skipping fio jobs" >&2
+fi
+
+# shellcheck disable=SC2086
+"$BUILD_DIR/bench/bench_files" $FILES_ARGS "$MOUNT_POINT" | tail -n +2 >&3
+
+"$FUSERMOUNT" -u "$MOUNT_POINT"
+wait "$LSFS_PID"
+LSFS_PID=""
+
+if ! "$BUILD_DIR/fsck.lsfs" "$DISK_IMAGE" > "$WORK_DIR/fsck.log" 2>&1; then
+    echo "Error: fsck.lsfs found problems after the benchmarks" >&2
+    cat "$WORK_DIR/fsck.log" >&2
+    exit 1
+fi
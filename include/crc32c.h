@@ -0,0 +1,35 @@
+/*
+ * LSFS - Log-Structured Filesystem
+ * CRC32C (Castagnoli) checksums
+ */
+
+#ifndef LSFS_CRC32C_H
+#define LSFS_CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct lsfs_segment_summary;
+struct lsfs_checkpoint_header;
+
+/*
+ * Checksums are continued by passing the previous result as crc; start
+ * with 0.  lsfs_crc32c() uses the CPU's CRC32C instructions when it has
+ * them (SSE4.2 or ARMv8 CRC) and slicing-by-8 tables otherwise.
+ */
+uint32_t lsfs_crc32c(uint32_t crc, const void *data, size_t len);
+uint32_t lsfs_crc32c_sw(uint32_t crc, const void *data, size_t len);
+uint32_t lsfs_crc32c_bytewise(uint32_t crc, const void *data, size_t len);
+
+/* Checksum count consecutive LSFS_BLOCK_SIZE blocks into crcs[] */
+void lsfs_crc32c_blocks(const void *blocks, uint32_t count, uint32_t *crcs);
+
+/* Checksums stored in a summary or checkpoint header, which they are
+ * taken over with the checksum field itself zero */
+uint32_t lsfs_summary_checksum(const struct lsfs_segment_summary *summary);
+uint32_t lsfs_checkpoint_checksum(const struct lsfs_checkpoint_header *header);
+
+/* Name of the implementation lsfs_crc32c() uses */
+const char *lsfs_crc32c_impl(void);
+
+#endif /* LSFS_CRC32C_H */
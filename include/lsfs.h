@@ -6,7 +6,9 @@
 #ifndef LSFS_H
 #define LSFS_H
 
+#ifndef FUSE_USE_VERSION
 #define FUSE_USE_VERSION 35
+#endif
 
 #include <fuse3/fuse_lowlevel.h>
 #include <stdint.h>
@@ -16,6 +18,7 @@
 #include <sys/stat.h>
 
 #include "ondisk.h"
+#include "crc32c.h"
 
 /* Error codes */
 #define LSFS_OK              0
@@ -35,95 +38,683 @@ struct lsfs_context;
 struct lsfs_inode_cache;
 struct lsfs_segment_buffer;
 
+/*
+ * Extent tree leaf in memory
+ * ext is NULL until the leaf is read.  first is the logical block of the
+ * leaf's first extent, which is also its key in the index above it.
+ */
+struct lsfs_extent_leaf {
+    uint32_t first;                 /* First file block mapped */
+    uint32_t count;                 /* Extents in the leaf */
+    uint64_t addr;                  /* Log address (0 = never written) */
+    struct lsfs_extent *ext;        /* LSFS_EXTENTS_PER_NODE slots, or NULL */
+    bool dirty;                     /* Changed since it was written */
+};
+
+/*
+ * Extent map of an inode
+ *
+ * Extents are sorted and never overlap, across leaves as well as within
+ * one, so a block is found by a binary search over the leaves and then
+ * over the leaf.  Only the leaf level is kept; the index blocks above it
+ * are few and are rebuilt from the leaf array whenever the map is written.
+ */
+struct lsfs_extent_map {
+    struct lsfs_extent_leaf *leaves;
+    uint32_t nleaves;
+    uint32_t capacity;
+    uint64_t *index;                /* Index blocks on disk, all levels */
+    uint32_t nindex;
+    bool dirty;                     /* Needs writing at the next writeback */
+};
+
+/*
+ * Blocks dropped from a file, waiting to be marked dead
+ * A block stays live in the segment table until the inode map saved by a
+ * checkpoint names an inode version that no longer points at it, so the
+ * table and the inode map written together never disagree.  Runs of
+ * consecutive blocks are merged.  Each run carries the sequence number of
+ * the segment's use it was noted in, as the segment may be cleaned and
+ * reused before the run is applied.
+ */
+struct lsfs_dead_run {
+    uint64_t block;
+    uint64_t count;
+    uint64_t sequence;              /* Segment usage sequence when noted */
+};
+
+struct lsfs_dead_list {
+    struct lsfs_dead_run *runs;
+    uint32_t count;
+    uint32_t capacity;
+};
+
 /*
  * In-memory inode structure
+ *
+ * The per-inode lock protects disk_inode, disk_location, version, dirty,
+ * the extent map and the blocks dropped since the last writeback.  refcount is only ever incremented under the lock
+ * of the inode's cache shard and is updated atomically so lsfs_inode_put()
+ * does not need that lock.
+ *
+ * The extent map is read on first use and changed in memory; it reaches
+ * the log when lsfs_inode_write() runs.  Until then disk_inode.extents
+ * keeps the map that was last written.
  */
 struct lsfs_inode_mem {
     struct lsfs_inode disk_inode;   /* On-disk inode data */
     uint64_t disk_location;         /* Where on disk this was read from */
     uint32_t version;               /* Version for stale detection */
-    uint32_t refcount;              /* Reference count */
+    uint32_t refcount;              /* Reference count (atomic) */
     bool dirty;                     /* Needs to be written */
+    struct lsfs_extent_map *map;    /* Extent map, NULL until used */
+    struct lsfs_dead_list dead;     /* Blocks the next writeback drops */
     pthread_mutex_t lock;           /* Per-inode lock */
-    struct lsfs_inode_mem *next;    /* Hash chain */
+    struct lsfs_inode_mem *next;    /* Hash chain, or shard free list */
     struct lsfs_inode_mem *lru_prev; /* LRU list */
     struct lsfs_inode_mem *lru_next; /* LRU list */
 };
 
 /*
  * Inode cache
+ * Inodes are spread over shards by inode number, each with its own lock,
+ * hash table and LRU list.  In-memory inodes are carved from slabs of
+ * LSFS_INODE_SLAB_COUNT and recycled through a per-shard free list, so
+ * a miss neither allocates nor initializes a lock once the cache is warm.
  */
-#define LSFS_INODE_CACHE_SIZE   1024
-#define LSFS_INODE_CACHE_BUCKETS 256
+#define LSFS_INODE_CACHE_SHARDS     16
+#define LSFS_INODE_CACHE_DEFAULT    16384
+#define LSFS_INODE_SLAB_COUNT       64
 
-struct lsfs_inode_cache {
-    struct lsfs_inode_mem *buckets[LSFS_INODE_CACHE_BUCKETS];
+struct lsfs_inode_slab {
+    struct lsfs_inode_slab *next;
+    struct lsfs_inode_mem inodes[LSFS_INODE_SLAB_COUNT];
+};
+
+struct lsfs_inode_shard {
+    struct lsfs_inode_mem **buckets;
+    uint32_t bucket_mask;
     struct lsfs_inode_mem *lru_head;
     struct lsfs_inode_mem *lru_tail;
+    struct lsfs_inode_mem *free;    /* Recycled inodes */
+    struct lsfs_inode_slab *slabs;
     uint32_t count;
+    uint32_t capacity;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
     pthread_mutex_t lock;
 };
 
+struct lsfs_inode_cache {
+    struct lsfs_inode_shard shards[LSFS_INODE_CACHE_SHARDS];
+    uint32_t capacity;
+};
+
+struct lsfs_inode_cache_stats {
+    uint64_t capacity;
+    uint64_t cached;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+};
+
 /*
  * In-memory inode map
+ * Entries are indexed directly by inode number through chunks of
+ * LSFS_IMAP_CHUNK_ENTRIES, allocated when the first inode in them is set.
+ * A chunk is dirty from the moment it changes until a checkpoint has
+ * appended it to the log.  The used bitmap tracks allocated inode
+ * numbers, including those not yet written, and the full bitmap marks
+ * its words with no number left, so allocation skips them 64 at a time.
+ * Each checkpoint region keeps its own copy of the chunk table, so a
+ * table block changed by moving a chunk is rewritten once in each.
  */
 struct lsfs_imap {
-    struct lsfs_imap_entry *entries;
-    uint32_t capacity;
-    uint32_t count;
-    uint32_t next_ino;              /* Next available inode number */
+    struct lsfs_imap_entry **chunks;
+    uint64_t *chunk_addr;           /* Log block of each chunk (0 = none) */
+    uint64_t *dirty;                /* Chunks changed since the last checkpoint */
+    uint64_t *table_dirty[2];       /* Chunk table blocks stale in each region */
+    uint64_t *used;                 /* Inode numbers in use */
+    uint64_t *full;                 /* Words of used with every bit set */
+    uint32_t max_inodes;            /* Inode numbers, from the superblock */
+    uint32_t chunk_count;           /* Chunks, max_inodes / LSFS_IMAP_CHUNK_ENTRIES */
+    uint32_t table_blocks;          /* Blocks of the chunk table */
+    uint32_t count;                 /* Inodes with an entry */
+    uint32_t next_ino;              /* Where the next allocation starts looking */
     pthread_rwlock_t lock;
 };
 
+/*
+ * Blocks of an on-disk table copied for a checkpoint
+ * Only the blocks that changed are copied, back to back in data, with
+ * their index in the table in blocks[].
+ */
+struct lsfs_table_copy {
+    uint8_t *data;
+    uint32_t *blocks;
+    uint32_t count;
+};
+
 /*
  * Segment buffer for writes
  */
-struct lsfs_segment_buffer {
+#define LSFS_SEGMENT_NONE       UINT32_MAX  /* No segment allocated */
+#define LSFS_FLUSH_QUEUE_DEPTH  2           /* Sealed segments in flight */
+
+/*
+ * A sealed segment waiting for the writer thread
+ * Its blocks are served from data until the write lands.  When an open
+ * segment is sealed only its summary and the blocks from first_block on
+ * are copied, and only those are written.  summary_tail says which of the
+ * segment's two summary slots the summary goes to.
+ */
+struct lsfs_segment_pending {
+    uint8_t *data;                  /* Segment image, summary included */
+    struct lsfs_block_info *block_info; /* Info for each block */
+    uint32_t segment_id;            /* Segment ID (NONE once landed) */
+    uint32_t block_count;           /* Blocks in the segment so far */
+    uint32_t first_block;           /* First block not written before */
+    bool final;                     /* The segment is full once this lands */
+    bool summary_tail;              /* Summary goes to the last blocks */
+};
+
+/*
+ * Log streams
+ * Blocks are appended to one of several open segments according to how
+ * long they are expected to live.  Metadata (inodes, extent, directory and
+ * inode map blocks) is rewritten all the time, file data less often, and
+ * data the cleaner relocates has already outlived the rest of its segment.
+ * Keeping them apart lets hot segments die off whole instead of being
+ * cleaned over and over for the sake of the cold blocks mixed into them.
+ */
+#define LSFS_STREAM_META        0           /* Inodes and index blocks */
+#define LSFS_STREAM_DATA        1           /* File data written by users */
+#define LSFS_STREAM_GC          2           /* Data relocated by the cleaner */
+#define LSFS_STREAM_COUNT       3
+
+_Static_assert(LSFS_STREAM_COUNT <= LSFS_CHECKPOINT_STREAMS,
+               "Checkpoints must record every stream's open segment");
+
+/*
+ * An open segment being filled by one stream
+ */
+struct lsfs_segment_stream {
     uint8_t *data;                  /* Buffer for segment data */
     struct lsfs_block_info *block_info; /* Info for each block */
-    uint32_t segment_id;            /* Current segment ID */
+    uint32_t segment_id;            /* Current segment ID (NONE = none yet) */
     uint32_t block_count;           /* Blocks used in buffer */
+    uint32_t flushed;               /* Blocks already handed to the writer */
+    bool summary_tail;              /* Last summary went to the last blocks */
+    uint32_t reserved;              /* Slots handed out but not yet filled */
+    uint32_t inode_block;           /* Open inode block in buffer (0 = none) */
+    uint32_t inode_slots;           /* Slots used in the open inode block */
+    uint32_t packed_block;          /* Open packed block in buffer (0 = none) */
+};
+
+/*
+ * Segments that are still (partly) in memory
+ */
+struct lsfs_segment_set {
+    uint32_t count;
+    uint32_t ids[LSFS_FLUSH_QUEUE_DEPTH + LSFS_STREAM_COUNT];
+};
+
+struct lsfs_segment_buffer {
+    struct lsfs_segment_stream streams[LSFS_STREAM_COUNT];
+    pthread_mutex_t lock;           /* Serializes appends and flushes */
+    pthread_cond_t drained;         /* Signalled when a stream's reserved drops to 0 */
+    pthread_cond_t freed;           /* Signalled when cleaned segments are reusable */
+
+    /* Flush queue, written in order by the writer thread */
+    struct lsfs_segment_pending queue[LSFS_FLUSH_QUEUE_DEPTH];
+    uint32_t queue_head;            /* Oldest pending segment */
+    uint32_t queue_len;             /* Pending segments */
+    uint64_t sealed_count;          /* Segments sealed since mount */
+    uint64_t landed_count;          /* Segments written since mount */
+    uint64_t sealed_head;           /* End of the last sealed segment */
+    uint64_t seal_seq;              /* Sequence number of the last seal */
+    bool checkpointing;             /* Checkpoint that frees segments is appending */
+    bool cutting;                   /* Checkpoint between its cut and table copies */
+    int write_error;                /* Last failed write, until one lands */
+    bool writer_running;            /* Writer thread running flag */
+    pthread_t writer;               /* Writer thread */
+    pthread_cond_t queued;          /* Signalled when a segment is queued */
+    pthread_cond_t landed;          /* Signalled when a write completes */
+};
+
+/*
+ * Group commit for fsync
+ *
+ * Every fsync takes a ticket.  One caller at a time leads a commit that
+ * covers every ticket issued before its flush started; the others wait
+ * for the commit that covers theirs.
+ */
+#define LSFS_COMMIT_WINDOW_US   100     /* Wait for company when batching */
+
+struct lsfs_group_commit {
+    uint64_t issued;                /* Last ticket handed out */
+    uint64_t committed;             /* Last ticket a commit has covered */
+    uint64_t durable;               /* Last ticket covered by a good commit */
+    uint64_t failed;                /* Last ticket covered by a failed one */
+    int error;                      /* Result of the last failed commit */
+    bool running;                   /* A leader is committing */
+    uint64_t last_batch;            /* Size of the last batch */
+
+    /* Statistics */
+    uint64_t commits;               /* Flush and sync rounds */
+    uint64_t requests;              /* fsync calls served */
+    uint64_t max_batch;
+    uint64_t total_latency_ns;
+    uint64_t max_latency_ns;
+
     pthread_mutex_t lock;
+    pthread_cond_t done;            /* Signalled when a commit finishes */
+};
+
+/*
+ * Group commit statistics
+ */
+struct lsfs_commit_stats {
+    uint64_t commits;
+    uint64_t requests;
+    uint64_t max_batch;
+    uint64_t total_latency_ns;
+    uint64_t max_latency_ns;
 };
 
 /*
  * Segment usage tracking
+ *
+ * Each checkpoint region has its own copy of the table on disk.  Every
+ * change to an entry marks the table block holding it stale in both, and
+ * a checkpoint writes back only the blocks stale in its region's copy.
+ */
+#define LSFS_SEGTABLE_ENTRIES_PER_BLOCK (LSFS_BLOCK_SIZE / sizeof(struct lsfs_segment_usage))
+
+#define LSFS_ALLOC_SEQUENTIAL   0   /* Next free segment after the last one */
+#define LSFS_ALLOC_LRF          1   /* Least recently freed segment first */
+
+/*
+ * Checksum verification on read
+ * Checksums are always written.  Summary checksums are checked whenever a
+ * summary is read; block checksums by the cleaner and recovery, which read
+ * whole segments, or on every block read from disk.
+ */
+#define LSFS_VERIFY_NONE        0   /* Summaries only */
+#define LSFS_VERIFY_SEGMENT     1   /* Blocks the cleaner and recovery read */
+#define LSFS_VERIFY_BLOCK       2   /* Every block read from the log */
+
+/*
+ * Discarding free segments
+ * Segments become free for good once a checkpoint no longer needs them.
+ * Before they go back on the free list they are punched out of an image
+ * file, or discarded on a block device, so the storage underneath can
+ * reclaim them.  A background thread does this in batches, with segments
+ * next to each other discarded as one range.
  */
+#define LSFS_DISCARD_DEFAULT    true
+
 struct lsfs_segment_table {
     struct lsfs_segment_usage *entries;
     uint32_t count;
     uint32_t free_count;
+    uint32_t segment_blocks;        /* Blocks per segment */
+    uint64_t log_start;             /* Block address of segment 0 */
+
+    /* Free segments: a bitmap for sequential allocation and a list in the
+     * order they were freed, both updated in O(1) */
+    uint32_t alloc_policy;          /* LSFS_ALLOC_* */
+    uint64_t *free_map;             /* Bit set for each free segment */
+    uint32_t *free_next;            /* Next segment on the free list */
+    uint32_t *free_prev;            /* Previous segment on the free list */
+    uint32_t free_first;            /* Least recently freed segment */
+    uint32_t free_last;             /* Most recently freed segment */
+    uint32_t alloc_cursor;          /* Where the sequential search resumes */
+
+    /* Segments the cleaner freed, in order, which are not reused until a
+     * checkpoint no longer needs them */
+    uint32_t *released;
+    uint32_t released_count;
+
+    /* Reusable segments waiting to be discarded, in order, and the
+     * thread that discards them in batches */
+    uint32_t *discard;
+    uint32_t discard_count;
+    uint32_t *discard_batch;        /* The batch being discarded */
+    uint64_t discarded;             /* Segments discarded since mount */
+    bool discard_running;
+    pthread_t discard_thread;
+    pthread_cond_t discard_wake;    /* Segments queued, or stopping */
+
+    /* Log blocks promised to preallocated files (atomic, changed under
+     * the lock) */
+    uint64_t prealloc_blocks;
+    uint64_t appended;              /* Blocks handed out since mount */
+    uint32_t table_blocks;          /* Blocks of each on-disk copy */
+    uint64_t *dirty[2];             /* Table blocks stale in each region */
+    struct lsfs_dead_list dead;     /* Dropped by written inodes, marked
+                                     * dead at the next checkpoint */
+    uint64_t staged_dead;           /* Dropped by inodes not written back
+                                     * yet (atomic) */
+
+    /* Cleaning candidates, kept by gc.c */
+    uint32_t *victims;              /* Max-heap of segment IDs on cost-benefit */
+    uint32_t *victim_pos;           /* Heap slot of each segment */
+    double *victim_key;             /* Cost-benefit of each segment when keyed */
+    uint32_t victim_count;          /* Segments in the heap */
+    uint32_t cleaning;              /* Segments taken out for cleaning */
+    uint64_t victims_keyed;         /* When every key was last refreshed */
+    uint64_t *quarantined;          /* Segments that failed their checks,
+                                     * left out until remount */
+    bool stalled;                   /* Out of room to move live blocks */
+    uint32_t stalled_free;          /* Free segments when that happened */
     pthread_mutex_t lock;
 };
 
 /*
- * Buffer pool entry
+ * Buffer cache entry
+ *
+ * The cache uses 2Q replacement: blocks seen once sit on the A1in FIFO,
+ * blocks referenced again move to the Am LRU, and blocks pushed out of
+ * A1in leave a data-less ghost on A1out so a quick re-reference is
+ * promoted straight to Am.  A single scan therefore cannot flush Am.
  */
+#define LSFS_BUF_FREE       0       /* Not in use */
+#define LSFS_BUF_A1IN       1       /* Seen once (FIFO) */
+#define LSFS_BUF_AM         2       /* Re-referenced (LRU) */
+#define LSFS_BUF_A1OUT      3       /* Ghost of an A1in eviction */
+
 struct lsfs_buffer {
-    uint8_t data[LSFS_BLOCK_SIZE];
+    uint8_t *data;                  /* Block data (NULL for ghosts) */
     uint64_t block_num;
-    bool valid;
-    bool dirty;
-    uint32_t refcount;
-    struct lsfs_buffer *hash_next;
+    uint8_t queue;                  /* LSFS_BUF_* */
+    bool prefetched;                /* Read ahead and not yet used */
+    struct lsfs_buffer *hash_next;  /* Hash chain, or free list */
     struct lsfs_buffer *lru_prev;
     struct lsfs_buffer *lru_next;
 };
 
+struct lsfs_buffer_list {
+    struct lsfs_buffer *head;       /* Oldest */
+    struct lsfs_buffer *tail;       /* Newest */
+    uint32_t count;
+};
+
 /*
- * Buffer pool
+ * Buffer cache shard
  */
-#define LSFS_BUFFER_POOL_SIZE   256
-#define LSFS_BUFFER_HASH_SIZE   64
+struct lsfs_buffer_shard {
+    struct lsfs_buffer *entries;    /* capacity data entries, then ghosts */
+    uint8_t *data;                  /* Block storage for data entries */
+    struct lsfs_buffer **hash;
+    uint32_t hash_mask;
+    uint32_t capacity;              /* Data entries */
+    uint32_t kin;                   /* Target A1in size */
+    uint32_t kout;                  /* Ghost entries */
+    struct lsfs_buffer_list a1in;
+    struct lsfs_buffer_list am;
+    struct lsfs_buffer_list a1out;
+    struct lsfs_buffer *free_data;
+    struct lsfs_buffer *free_ghost;
+    uint64_t seq;                   /* Bumped on every invalidation */
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t invalidations;
+    uint64_t prefetched;            /* Blocks inserted by readahead */
+    uint64_t prefetch_hits;         /* Of those, blocks read afterwards */
+    pthread_mutex_t lock;
+};
+
+/*
+ * Buffer cache (read cache for log blocks)
+ */
+#define LSFS_BUFFER_SHARDS      16
+#define LSFS_BUFFER_DEFAULT_MB  16
 
 struct lsfs_buffer_pool {
-    struct lsfs_buffer buffers[LSFS_BUFFER_POOL_SIZE];
-    struct lsfs_buffer *hash[LSFS_BUFFER_HASH_SIZE];
-    struct lsfs_buffer *lru_head;
-    struct lsfs_buffer *lru_tail;
+    struct lsfs_buffer_shard shards[LSFS_BUFFER_SHARDS];
+    uint64_t capacity;              /* Total data blocks (0 = disabled) */
+};
+
+/*
+ * Buffer cache statistics
+ */
+struct lsfs_buffer_stats {
+    uint64_t capacity;              /* Blocks */
+    uint64_t cached;                /* Blocks currently holding data */
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t invalidations;
+    uint64_t prefetched;
+    uint64_t prefetch_hits;
+};
+
+/*
+ * Asynchronous reads
+ *
+ * A few threads read on behalf of file readahead, which fills the buffer
+ * cache, and of the cleaner, which reads its next victim while it
+ * relocates the current one.  Readahead is advisory: runs are dropped
+ * when LSFS_PREFETCH_QUEUE of them are already waiting.
+ */
+#define LSFS_PREFETCH_THREADS       2
+#define LSFS_PREFETCH_QUEUE         64
+#define LSFS_PREFETCH_MAX_BLOCKS    256     /* Longest readahead run */
+#define LSFS_READAHEAD_MIN_BLOCKS   8       /* First window of a sequential reader */
+#define LSFS_READAHEAD_DEFAULT_KB   1024    /* Largest window */
+
+struct lsfs_read_job {
+    struct lsfs_io_req *reqs;
+    uint32_t count;
+    int result;
+    bool done;
+    bool readahead;                 /* Cache the blocks, then free the job */
+    struct lsfs_read_job *next;
+};
+
+struct lsfs_prefetch {
+    pthread_t threads[LSFS_PREFETCH_THREADS];
+    uint32_t thread_count;          /* Threads running */
+    bool running;
+    struct lsfs_read_job *head;     /* Oldest queued job */
+    struct lsfs_read_job *tail;
+    uint32_t queued_readahead;      /* Readahead jobs in the queue */
+    uint64_t dropped;               /* Readahead runs dropped */
+    pthread_cond_t wake;            /* Work queued */
+    pthread_cond_t done;            /* A job finished */
     pthread_mutex_t lock;
 };
 
+/*
+ * Dentry cache entry: parent directory and name to inode
+ * ino 0 records that the name does not exist.  Names longer than
+ * LSFS_DCACHE_NAME_MAX are not cached.
+ */
+#define LSFS_DCACHE_NAME_MAX        56
+
+struct lsfs_dentry {
+    uint32_t parent;
+    uint32_t ino;                   /* 0 = negative entry */
+    uint32_t hash;
+    uint8_t file_type;
+    uint8_t name_len;
+    struct lsfs_dentry *hash_next;  /* Hash chain, or free list */
+    struct lsfs_dentry *lru_prev;
+    struct lsfs_dentry *lru_next;
+    char name[LSFS_DCACHE_NAME_MAX];
+};
+
+/*
+ * Dentry cache shard
+ */
+struct lsfs_dcache_shard {
+    struct lsfs_dentry *entries;
+    struct lsfs_dentry **hash;
+    uint32_t hash_mask;
+    uint32_t capacity;
+    struct lsfs_dentry *lru_head;   /* Oldest */
+    struct lsfs_dentry *lru_tail;   /* Newest */
+    struct lsfs_dentry *free;
+    uint64_t hits;
+    uint64_t negative_hits;
+    uint64_t misses;
+    pthread_mutex_t lock;
+};
+
+/*
+ * Dentry cache
+ * Entries are only added and changed by directory operations, which run
+ * with the parent directory locked or with fs_lock held exclusively, so
+ * an entry never goes stale behind a directory change.
+ */
+#define LSFS_DCACHE_SHARDS          16
+#define LSFS_DCACHE_DEFAULT_ENTRIES 65536
+
+struct lsfs_dcache {
+    struct lsfs_dcache_shard shards[LSFS_DCACHE_SHARDS];
+    uint64_t capacity;              /* Total entries (0 = disabled) */
+};
+
+/*
+ * Dentry cache statistics
+ */
+struct lsfs_dcache_stats {
+    uint64_t capacity;
+    uint64_t hits;
+    uint64_t negative_hits;
+    uint64_t misses;
+};
+
+/*
+ * Block I/O backends
+ */
+#define LSFS_IO_PSYNC           0   /* pread/pwrite on the image fd */
+#define LSFS_IO_URING           1   /* io_uring, batched submission */
+#define LSFS_IO_ALIGN           LSFS_BLOCK_SIZE /* Buffer alignment for O_DIRECT */
+
+/*
+ * One contiguous transfer in a batch
+ */
+struct lsfs_io_req {
+    uint64_t block;                 /* First block */
+    uint32_t count;                 /* Number of blocks */
+    void *buf;                      /* Data (LSFS_IO_ALIGN aligned) */
+    int result;                     /* LSFS_OK or LSFS_ERR_IO when done */
+};
+
+/*
+ * Backend operations
+ * Requests passed in are already bounds checked and aligned.  submit()
+ * transfers every request and returns LSFS_OK only if all of them did;
+ * write_sync() returns once the blocks are durable.
+ */
+struct lsfs_io_ops {
+    const char *name;
+    int (*init)(struct lsfs_context *ctx);
+    void (*destroy)(struct lsfs_context *ctx);
+    int (*submit)(struct lsfs_context *ctx, struct lsfs_io_req *reqs,
+                  uint32_t count, bool write);
+    int (*write_sync)(struct lsfs_context *ctx, uint64_t start_block,
+                      uint32_t count, const void *buf);
+};
+
+extern const struct lsfs_io_ops lsfs_io_uring_ops;
+
+/*
+ * Checkpoint defaults
+ *
+ * A background thread writes a checkpoint once this many blocks have been
+ * appended, or this many seconds have passed with anything appended.
+ */
+#define LSFS_CHECKPOINT_DEFAULT_SECS    30
+#define LSFS_CHECKPOINT_DEFAULT_BLOCKS  LSFS_SEGMENT_BLOCKS
+
+/*
+ * Cleaner defaults
+ *
+ * Only the cleaner may take the last LSFS_GC_RESERVE_SEGMENTS free
+ * segments, which are kept for it to move live blocks into and to rewrite
+ * the metadata pointing at them; nothing else takes them or those
+ * promised to files preallocated with fallocate.  A writer that runs
+ * into the reserve, with data or metadata, waits up to
+ * LSFS_GC_ALLOC_WAIT_MS for the cleaner before giving up.  The last free
+ * segment is left to the inode map chunks of the checkpoint that makes
+ * the segments the cleaner freed reusable, and the cleaner waits for that
+ * checkpoint rather than taking it.
+ */
+#define LSFS_GC_DEFAULT_THREADS         1
+#define LSFS_GC_MAX_THREADS             16
+#define LSFS_GC_RESERVE_SEGMENTS        2
+#define LSFS_GC_ALLOC_WAIT_MS           1000
+
+/*
+ * Runtime statistics
+ *
+ * Always on, so updates have to be cheap: each thread adds to one of
+ * LSFS_STATS_SHARDS cache-line aligned shards with relaxed atomics, and
+ * readers sum the shards, without a consistent snapshot across values.
+ * Latencies are counted in log2 buckets: bucket 0 holds those under 1 us
+ * and bucket i those from 2^(i-1) up to 2^i us.  The root directory's
+ * LSFS_STATS_XATTR attribute renders them as text for lsfs-debug.
+ */
+#define LSFS_STATS_SHARDS       16
+#define LSFS_STATS_BUCKETS      32
+
+/* Timed operations: FUSE requests, then internal stages */
+#define LSFS_LAT_LOOKUP         0
+#define LSFS_LAT_GETATTR        1
+#define LSFS_LAT_SETATTR        2
+#define LSFS_LAT_READDIR        3
+#define LSFS_LAT_READDIRPLUS    4
+#define LSFS_LAT_OPEN           5
+#define LSFS_LAT_RELEASE        6
+#define LSFS_LAT_READ           7
+#define LSFS_LAT_WRITE          8   /* write and write_buf */
+#define LSFS_LAT_CREATE         9
+#define LSFS_LAT_MKDIR          10
+#define LSFS_LAT_UNLINK         11
+#define LSFS_LAT_RMDIR          12
+#define LSFS_LAT_RENAME         13
+#define LSFS_LAT_STATFS         14
+#define LSFS_LAT_FSYNC          15
+#define LSFS_LAT_FALLOCATE      16
+#define LSFS_LAT_APPEND         17  /* Reserving log blocks, waits for space included */
+#define LSFS_LAT_FLUSH          18  /* Flushing the segment buffer */
+#define LSFS_LAT_SEGMENT_WRITE  19  /* Writer thread writing one sealed segment */
+#define LSFS_LAT_CHECKPOINT     20
+#define LSFS_LAT_GC_CLEAN       21  /* Cleaning one segment */
+#define LSFS_LAT_READ_IO        22  /* One batch of reads from the image */
+#define LSFS_LAT_COUNT          23
+
+/* Counters */
+#define LSFS_CTR_USER_READ      0   /* Bytes returned by read */
+#define LSFS_CTR_USER_WRITE     1   /* Bytes accepted by write */
+#define LSFS_CTR_DEVICE_READ    2   /* Bytes read from the image */
+#define LSFS_CTR_DEVICE_WRITE   3   /* Bytes written to the image */
+#define LSFS_CTR_GC_SEGMENTS    4   /* Segments cleaned */
+#define LSFS_CTR_GC_LIVE        5   /* Live blocks of those when they were taken */
+#define LSFS_CTR_DISCARD        6   /* Bytes of free segments discarded */
+#define LSFS_CTR_COUNT          7
+
+struct lsfs_histogram {
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t buckets[LSFS_STATS_BUCKETS];
+};
+
+struct lsfs_stats_shard {
+    uint64_t counters[LSFS_CTR_COUNT];
+    struct lsfs_histogram latency[LSFS_LAT_COUNT];
+} __attribute__((aligned(64)));
+
+struct lsfs_stats {
+    struct lsfs_stats_shard shards[LSFS_STATS_SHARDS];
+};
+
 /*
  * Main filesystem context
  */
@@ -132,8 +723,12 @@ struct lsfs_context {
     int fd;                         /* File descriptor for disk image */
     char *disk_path;                /* Path to disk image */
     uint64_t disk_size;             /* Size of disk image */
+    bool block_device;              /* The image is a block device */
+    const struct lsfs_io_ops *io;   /* Block I/O backend */
+    void *io_private;               /* Backend state */
 
-    /* On-disk metadata */
+    /* On-disk metadata (the sb counters free_segments and inode_count
+     * are updated under segtable.lock, log_head under segbuf.lock) */
     struct lsfs_superblock sb;      /* Superblock (in memory copy) */
 
     /* In-memory structures */
@@ -141,22 +736,75 @@ struct lsfs_context {
     struct lsfs_imap imap;          /* Inode map */
     struct lsfs_segment_table segtable; /* Segment usage table */
     struct lsfs_segment_buffer segbuf; /* Current write segment */
+    struct lsfs_group_commit gcommit; /* Shared fsync commits */
     struct lsfs_buffer_pool bufpool; /* Block buffer pool */
+    struct lsfs_prefetch prefetch;  /* Asynchronous read threads */
+    struct lsfs_dcache dcache;      /* Name lookup cache */
 
-    /* Checkpoint state */
+    /* Checkpoint state (last_checkpoint and writes_since_checkpoint
+     * are protected by segbuf.lock) */
     uint64_t checkpoint_seq;        /* Current checkpoint sequence */
     uint64_t last_checkpoint;       /* Time of last checkpoint */
     uint32_t writes_since_checkpoint; /* Writes since last checkpoint */
+    pthread_t checkpoint_thread;    /* Background checkpoint thread */
+    bool checkpoint_running;        /* Checkpoint thread running flag */
+    bool checkpoint_requested;      /* A writer asked for a checkpoint */
+    pthread_cond_t checkpoint_cond; /* Checkpoint wake condition */
+    pthread_mutex_t checkpoint_lock; /* Protects the two flags above */
 
-    /* GC state */
-    pthread_t gc_thread;            /* Garbage collector thread */
+    /* GC state (the pacing fields are protected by gc_lock) */
+    pthread_t *gc_threads;          /* Cleaner threads */
+    uint32_t gc_thread_count;       /* Cleaner threads to start */
     bool gc_running;                /* GC thread running flag */
+    bool gc_urgent;                 /* Below the low watermark */
+    bool gc_idle;                   /* Budget is for idle-time cleaning */
+    uint32_t gc_budget;             /* Segments left to clean */
+    uint64_t gc_paced_at;           /* Last pacing interval (ms) */
+    uint64_t gc_paced_appended;     /* segtable.appended at that time */
+    uint32_t gc_paced_free;         /* segtable.free_count at that time */
     pthread_cond_t gc_cond;         /* GC wake condition */
     pthread_mutex_t gc_lock;        /* GC synchronization */
 
-    /* Global locks */
-    pthread_mutex_t write_lock;     /* Serialize writes */
-    pthread_rwlock_t fs_lock;       /* Filesystem-wide lock */
+    /*
+     * Global locks
+     *
+     * Lock order: fs_lock -> inode lock -> icache shard lock ->
+     * write_lock -> segbuf.lock -> gc_lock -> imap.lock /
+     * segtable.lock / checkpoint_lock / prefetch.lock.  Only
+     * holders of fs_lock in write mode may take more than one inode lock
+     * at a time.
+     */
+    pthread_mutex_t write_lock;     /* Serialize checkpoints */
+    pthread_rwlock_t fs_lock;       /* Namespace lock: shared for single
+                                     * directory operations, exclusive for
+                                     * unlink, rmdir and rename */
+
+    /* Mount options */
+    uint32_t worker_threads;        /* FUSE worker threads (1 = single) */
+    uint64_t cache_size;            /* Buffer cache size in bytes */
+    uint32_t readahead_blocks;      /* Largest readahead window (0 = off) */
+    uint32_t inode_cache_size;      /* Inodes kept in memory */
+    uint32_t dcache_entries;        /* Dentry cache size (0 = disabled) */
+    uint32_t checkpoint_secs;       /* Seconds between checkpoints */
+    uint32_t checkpoint_blocks;     /* Blocks appended between checkpoints */
+    double entry_timeout;           /* Kernel name cache timeout (s) */
+    double attr_timeout;            /* Kernel attribute cache timeout (s) */
+    double negative_timeout;        /* Kernel negative lookup timeout (s) */
+    uint32_t io_backend;            /* LSFS_IO_PSYNC or LSFS_IO_URING */
+    bool direct_io;                 /* Open the image with O_DIRECT */
+    bool discard;                   /* Discard segments that become free */
+    uint32_t segment_alloc;         /* LSFS_ALLOC_SEQUENTIAL or LSFS_ALLOC_LRF */
+    uint32_t verify_mode;           /* LSFS_VERIFY_* */
+    uint32_t compress_codec;        /* LSFS_CODEC_* for new data blocks */
+    int compress_level;             /* Codec level (0 = codec default) */
+
+    /* Runtime statistics */
+    struct lsfs_stats stats;
+
+    /* Compression statistics (updated atomically) */
+    uint64_t compressed_blocks;     /* Data blocks stored compressed */
+    uint64_t compressed_bytes;      /* Their compressed size */
+    uint64_t incompressible_blocks; /* Data blocks stored whole */
 
     /* Runtime flags */
     bool mounted;
@@ -164,7 +812,7 @@ struct lsfs_context {
     bool debug;
 };
 
-/* Global context (set during mount) */
+/* Global context (set during mount, before any worker thread starts) */
 extern struct lsfs_context *g_lsfs;
 
 /*
@@ -178,29 +826,70 @@ int lsfs_read_blocks(struct lsfs_context *ctx, uint64_t start_block,
                      uint32_t count, void *buf);
 int lsfs_write_blocks(struct lsfs_context *ctx, uint64_t start_block,
                       uint32_t count, const void *buf);
+int lsfs_write_blocks_sync(struct lsfs_context *ctx, uint64_t start_block,
+                           uint32_t count, const void *buf);
+int lsfs_read_batch(struct lsfs_context *ctx, struct lsfs_io_req *reqs, uint32_t count);
 int lsfs_sync(struct lsfs_context *ctx);
+int lsfs_io_discard(struct lsfs_context *ctx, uint64_t start_block, uint64_t count);
+void *lsfs_io_alloc(size_t size);
 
-/* Buffer pool operations */
-int lsfs_buffer_pool_init(struct lsfs_buffer_pool *pool);
+/* Buffer cache operations */
+int lsfs_buffer_pool_init(struct lsfs_buffer_pool *pool, uint64_t size);
 void lsfs_buffer_pool_destroy(struct lsfs_buffer_pool *pool);
-struct lsfs_buffer *lsfs_buffer_get(struct lsfs_context *ctx, uint64_t block_num);
-void lsfs_buffer_put(struct lsfs_buffer *buf);
-int lsfs_buffer_flush(struct lsfs_context *ctx);
+int lsfs_buffer_read(struct lsfs_context *ctx, uint64_t block_num, void *buf);
+void lsfs_buffer_invalidate(struct lsfs_context *ctx, uint64_t block_num);
+void lsfs_buffer_invalidate_range(struct lsfs_context *ctx, uint64_t start_block,
+                                  uint32_t count);
+void lsfs_buffer_stats(struct lsfs_buffer_pool *pool, struct lsfs_buffer_stats *stats);
+bool lsfs_buffer_cached(struct lsfs_context *ctx, uint64_t block_num);
+int lsfs_buffer_prefetch(struct lsfs_context *ctx, uint64_t start_block, uint32_t count);
+
+/* Asynchronous reads */
+int lsfs_prefetch_init(struct lsfs_context *ctx);
+int lsfs_prefetch_start(struct lsfs_context *ctx);
+void lsfs_prefetch_stop(struct lsfs_context *ctx);
+void lsfs_prefetch_destroy(struct lsfs_context *ctx);
+void lsfs_readahead(struct lsfs_context *ctx, uint64_t start_block, uint32_t count);
+void lsfs_read_async(struct lsfs_context *ctx, struct lsfs_read_job *job);
+int lsfs_read_wait(struct lsfs_context *ctx, struct lsfs_read_job *job);
+
+/* Dentry cache operations */
+int lsfs_dcache_init(struct lsfs_dcache *dcache, uint32_t entries);
+void lsfs_dcache_destroy(struct lsfs_dcache *dcache);
+bool lsfs_dcache_lookup(struct lsfs_dcache *dcache, uint32_t parent, const char *name,
+                        size_t name_len, uint32_t *ino, uint8_t *file_type);
+void lsfs_dcache_set(struct lsfs_dcache *dcache, uint32_t parent, const char *name,
+                     size_t name_len, uint32_t ino, uint8_t file_type);
+void lsfs_dcache_invalidate(struct lsfs_dcache *dcache, uint32_t parent,
+                            const char *name, size_t name_len);
+void lsfs_dcache_stats(struct lsfs_dcache *dcache, struct lsfs_dcache_stats *stats);
 
 /*
  * inode.c - Inode operations
  */
-int lsfs_inode_cache_init(struct lsfs_inode_cache *cache);
+int lsfs_inode_cache_init(struct lsfs_inode_cache *cache, uint32_t capacity);
 void lsfs_inode_cache_destroy(struct lsfs_inode_cache *cache);
+void lsfs_inode_cache_stats(struct lsfs_inode_cache *cache,
+                            struct lsfs_inode_cache_stats *stats);
 struct lsfs_inode_mem *lsfs_inode_get(struct lsfs_context *ctx, uint32_t ino);
 void lsfs_inode_put(struct lsfs_inode_mem *inode);
 struct lsfs_inode_mem *lsfs_inode_alloc(struct lsfs_context *ctx, uint32_t mode);
 int lsfs_inode_free(struct lsfs_context *ctx, struct lsfs_inode_mem *inode);
 int lsfs_inode_write(struct lsfs_context *ctx, struct lsfs_inode_mem *inode);
+int lsfs_inode_map_blocks(struct lsfs_context *ctx, struct lsfs_inode_mem *inode,
+                          uint64_t block_idx, uint32_t count, uint64_t *addrs);
 int lsfs_inode_read_block(struct lsfs_context *ctx, struct lsfs_inode_mem *inode,
                           uint64_t block_idx, void *buf);
 int lsfs_inode_write_block(struct lsfs_context *ctx, struct lsfs_inode_mem *inode,
                            uint64_t block_idx, const void *buf);
+int lsfs_inode_truncate(struct lsfs_context *ctx, struct lsfs_inode_mem *inode,
+                        uint64_t size);
+int lsfs_inode_move_extent_block(struct lsfs_context *ctx, struct lsfs_inode_mem *inode,
+                                 uint64_t addr);
+int lsfs_inode_sync_all(struct lsfs_context *ctx, bool wait);
+ssize_t lsfs_inode_write_data(struct lsfs_context *ctx, struct lsfs_inode_mem *inode,
+                              uint64_t off, size_t size, struct fuse_bufvec *src,
+                              uint32_t stream);
 void lsfs_inode_to_stat(struct lsfs_inode_mem *inode, struct stat *st);
 uint64_t lsfs_get_time_ns(void);
 
@@ -220,6 +909,8 @@ int lsfs_dir_iterate(struct lsfs_context *ctx, struct lsfs_inode_mem *dir,
                      void *callback_ctx, off_t offset);
 int lsfs_dir_init(struct lsfs_context *ctx, struct lsfs_inode_mem *dir,
                   uint32_t parent_ino);
+int lsfs_dir_set_parent(struct lsfs_context *ctx, struct lsfs_inode_mem *dir,
+                        uint32_t parent_ino);
 uint8_t lsfs_mode_to_type(uint32_t mode);
 
 /*
@@ -227,37 +918,110 @@ uint8_t lsfs_mode_to_type(uint32_t mode);
  */
 int lsfs_segment_init(struct lsfs_context *ctx);
 void lsfs_segment_destroy(struct lsfs_context *ctx);
+int lsfs_segment_writer_start(struct lsfs_context *ctx);
+void lsfs_segment_writer_stop(struct lsfs_context *ctx);
 int lsfs_segment_buffer_init(struct lsfs_segment_buffer *segbuf);
 void lsfs_segment_buffer_destroy(struct lsfs_segment_buffer *segbuf);
-int lsfs_segment_alloc(struct lsfs_context *ctx, uint32_t *segment_id);
+int lsfs_segment_alloc(struct lsfs_context *ctx, uint32_t *segment_id, uint32_t keep);
+void lsfs_segment_set_cleaner(bool cleaner);
+uint64_t lsfs_segment_set_promised(uint64_t blocks);
 int lsfs_segment_free(struct lsfs_context *ctx, uint32_t segment_id);
+uint64_t lsfs_segment_append_locked(struct lsfs_context *ctx, const void *data,
+                                    uint32_t ino, uint32_t offset, uint8_t type);
 uint64_t lsfs_segment_append_block(struct lsfs_context *ctx, const void *data,
                                    uint32_t ino, uint32_t offset, uint8_t type);
+uint64_t lsfs_segment_reserve(struct lsfs_context *ctx, uint32_t stream,
+                              uint32_t count, uint32_t ino, uint32_t offset,
+                              uint8_t type, uint32_t *granted, uint8_t **dst);
+void lsfs_segment_commit(struct lsfs_context *ctx, uint64_t block, uint32_t count);
+uint64_t lsfs_segment_append_inode(struct lsfs_context *ctx,
+                                   const struct lsfs_inode *inode,
+                                   uint64_t old_location);
+uint64_t lsfs_segment_append_packed(struct lsfs_context *ctx, uint32_t stream,
+                                    uint32_t ino, uint32_t offset,
+                                    const void *data, uint32_t len);
 int lsfs_segment_flush(struct lsfs_context *ctx);
-uint64_t lsfs_segment_to_block(uint32_t segment_id, uint32_t offset);
-void lsfs_block_to_segment(uint64_t block, uint32_t *segment_id, uint32_t *offset);
+int lsfs_segment_flush_locked(struct lsfs_context *ctx);
+int lsfs_segment_flush_head_locked(struct lsfs_context *ctx, uint64_t *log_head);
+void lsfs_segment_dirty(struct lsfs_segment_table *table, uint32_t segment_id);
+int lsfs_group_commit_init(struct lsfs_group_commit *gc);
+void lsfs_group_commit_destroy(struct lsfs_group_commit *gc);
+int lsfs_group_commit(struct lsfs_context *ctx);
+void lsfs_group_commit_stats(struct lsfs_group_commit *gc, struct lsfs_commit_stats *stats);
+int lsfs_segment_read_block(struct lsfs_context *ctx, uint64_t block, void *buf);
+const struct lsfs_segment_summary *
+lsfs_segment_current_summary(const struct lsfs_context *ctx, const void *head,
+                             const void *tail, uint32_t segment_id);
+int lsfs_segment_check_block(const struct lsfs_segment_summary *summary,
+                             uint32_t offset, const void *data);
+int lsfs_segment_verify_blocks(struct lsfs_context *ctx, uint64_t block, uint32_t count,
+                               const void *data);
+void lsfs_segment_buffered(struct lsfs_context *ctx, struct lsfs_segment_set *set);
+bool lsfs_segment_set_has_block(const struct lsfs_context *ctx,
+                                const struct lsfs_segment_set *set, uint64_t block);
+void lsfs_segment_wait_space(struct lsfs_context *ctx);
+void lsfs_segment_mark_used(struct lsfs_segment_table *table, uint32_t segment_id);
+void lsfs_segment_release(struct lsfs_context *ctx, uint32_t segment_id);
+void lsfs_segment_reuse(struct lsfs_context *ctx, uint32_t count);
+int lsfs_segment_discard_start(struct lsfs_context *ctx);
+void lsfs_segment_discard_stop(struct lsfs_context *ctx);
+uint32_t lsfs_segment_free_total(const struct lsfs_segment_table *table);
+uint32_t lsfs_segment_prealloc_count(const struct lsfs_segment_table *table);
+int lsfs_segment_prealloc(struct lsfs_context *ctx, uint64_t blocks);
+void lsfs_segment_prealloc_release(struct lsfs_context *ctx, uint64_t blocks);
+uint64_t lsfs_segment_to_block(const struct lsfs_context *ctx, uint32_t segment_id,
+                               uint32_t offset);
+void lsfs_block_to_segment(const struct lsfs_context *ctx, uint64_t block,
+                           uint32_t *segment_id, uint32_t *offset);
 
 /*
  * imap.c - Inode map
  */
-int lsfs_imap_init(struct lsfs_imap *imap);
+int lsfs_imap_init(struct lsfs_imap *imap, uint32_t max_inodes);
 void lsfs_imap_destroy(struct lsfs_imap *imap);
 int lsfs_imap_get(struct lsfs_imap *imap, uint32_t ino, uint64_t *location,
                   uint32_t *version);
 int lsfs_imap_set(struct lsfs_imap *imap, uint32_t ino, uint64_t location);
 int lsfs_imap_remove(struct lsfs_imap *imap, uint32_t ino);
 uint32_t lsfs_imap_alloc_ino(struct lsfs_imap *imap);
-int lsfs_imap_save(struct lsfs_context *ctx, uint64_t start_block);
-int lsfs_imap_load(struct lsfs_context *ctx, uint64_t start_block,
-                   uint32_t entry_count);
+int lsfs_imap_save_locked(struct lsfs_context *ctx, uint32_t region,
+                          struct lsfs_table_copy *copy, uint32_t *entry_count);
+void lsfs_imap_table_redirty(struct lsfs_imap *imap, uint32_t region,
+                             const struct lsfs_table_copy *copy);
+int lsfs_imap_load(struct lsfs_context *ctx, uint64_t table_block,
+                   uint32_t chunk_count);
+int lsfs_imap_move_chunk(struct lsfs_context *ctx, uint32_t chunk, uint64_t addr);
+
+/*
+ * compress.c - Data block compression
+ */
+bool lsfs_codec_available(uint32_t codec);
+const char *lsfs_codec_name(uint32_t codec);
+int lsfs_codec_parse(const char *spec, uint32_t *codec, int *level);
+uint32_t lsfs_compress_block(uint32_t codec, int level, const void *src, void *dst,
+                             uint32_t max_len);
+int lsfs_packed_read(const void *packed, uint32_t slot, void *buf);
+
+/*
+ * stats.c - Runtime statistics
+ */
+uint64_t lsfs_stats_now(void);
+void lsfs_stats_add(struct lsfs_context *ctx, uint32_t counter, uint64_t n);
+void lsfs_stats_time(struct lsfs_context *ctx, uint32_t op, uint64_t start);
+int lsfs_stats_render(struct lsfs_context *ctx, char **text, size_t *len);
 
 /*
  * checkpoint.c - Checkpoint management
  */
 int lsfs_checkpoint_init(struct lsfs_context *ctx);
+int lsfs_checkpoint_start(struct lsfs_context *ctx);
+void lsfs_checkpoint_stop(struct lsfs_context *ctx);
+void lsfs_checkpoint_kick(struct lsfs_context *ctx);
 int lsfs_checkpoint_write(struct lsfs_context *ctx);
+int lsfs_checkpoint_select(struct lsfs_context *ctx, struct lsfs_checkpoint_header *header);
 int lsfs_checkpoint_load(struct lsfs_context *ctx);
-int lsfs_checkpoint_recover(struct lsfs_context *ctx);
+int lsfs_checkpoint_recover(struct lsfs_context *ctx,
+                            const struct lsfs_checkpoint_header *header);
 bool lsfs_checkpoint_needed(struct lsfs_context *ctx);
 
 /*
@@ -269,8 +1033,26 @@ int lsfs_gc_run(struct lsfs_context *ctx);
 int lsfs_gc_clean_segment(struct lsfs_context *ctx, uint32_t segment_id);
 uint32_t lsfs_gc_select_segment(struct lsfs_context *ctx);
 void lsfs_gc_mark_block_dead(struct lsfs_context *ctx, uint64_t block);
+void lsfs_gc_mark_range_dead(struct lsfs_context *ctx, uint64_t block, uint64_t count);
+void lsfs_gc_mark_inode_dead(struct lsfs_context *ctx, uint64_t location);
+void lsfs_gc_stage_dead(struct lsfs_context *ctx, struct lsfs_inode_mem *inode,
+                        uint64_t block, uint64_t count);
+void lsfs_gc_commit_dead(struct lsfs_context *ctx, struct lsfs_inode_mem *inode);
+void lsfs_gc_defer_dead(struct lsfs_context *ctx, uint64_t block, uint64_t count);
+void lsfs_gc_apply_dead(struct lsfs_context *ctx);
+void lsfs_gc_dead_list_free(struct lsfs_dead_list *list);
 void lsfs_gc_trigger(struct lsfs_context *ctx);
 bool lsfs_gc_needed(struct lsfs_context *ctx);
+bool lsfs_gc_pending(struct lsfs_context *ctx);
+int lsfs_gc_victims_init(struct lsfs_segment_table *table);
+void lsfs_gc_victims_destroy(struct lsfs_segment_table *table);
+void lsfs_gc_victim_update(struct lsfs_segment_table *table, uint32_t segment_id);
+
+/*
+ * mount.c - Mounting and unmounting
+ */
+int lsfs_init_fs(struct lsfs_context *ctx);
+int lsfs_cleanup_fs(struct lsfs_context *ctx);
 
 /*
  * fuse_ops.c - FUSE operations
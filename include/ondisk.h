@@ -6,37 +6,90 @@
 #ifndef LSFS_ONDISK_H
 #define LSFS_ONDISK_H
 
+#include <stdbool.h>
 #include <stdint.h>
 
 /* Magic numbers */
 #define LSFS_MAGIC          0x4C534653  /* "LSFS" */
 #define LSFS_SEGMENT_MAGIC  0x5345474D  /* "SEGM" */
 #define LSFS_CHECKPOINT_MAGIC 0x43484B50 /* "CHKP" */
+#define LSFS_EXTENT_MAGIC   0x45585446  /* "EXTF" */
+#define LSFS_DIR_HASH_MAGIC 0x44495248  /* "DIRH" */
+#define LSFS_DIR_BUCKET_MAGIC 0x44495242 /* "DIRB" */
+#define LSFS_PACKED_MAGIC   0x5041434B  /* "PACK" */
 
-/* Version */
-#define LSFS_VERSION        1
+/* Version (2: extent-mapped inodes, 3: inode map chunks in the log,
+ * 4: multi-block segment summaries and live block bitmaps,
+ * 5: region sizes and inode count recorded in the superblock,
+ * 6: CRC32C checksums for summaries, blocks and checkpoints,
+ * 7: compressed data blocks packed into shared blocks,
+ * 8: small file and directory data inline in the inode,
+ * 9: write sequence numbers in segments and checkpoints,
+ * 10: a segment table copy for each checkpoint region,
+ * 11: a second summary copy in segments flushed while open) */
+#define LSFS_VERSION        11
 
 /* Size constants */
 #define LSFS_BLOCK_SIZE         4096
-#define LSFS_SEGMENT_BLOCKS     1024        /* 4 MB per segment */
+#define LSFS_SEGMENT_BLOCKS     1024        /* Largest segment, 4 MB */
+#define LSFS_SEGMENT_BLOCKS_MIN 256         /* Smallest segment, 1 MB */
 #define LSFS_SEGMENT_SIZE       (LSFS_SEGMENT_BLOCKS * LSFS_BLOCK_SIZE)
-#define LSFS_MAX_SEGMENTS       256         /* Up to 1 GB */
-#define LSFS_MAX_INODES         65536       /* 16-bit inode numbers */
+#define LSFS_SUMMARY_BLOCKS     4           /* Summary blocks at the start of a segment */
+#define LSFS_MAX_SEGMENTS       (UINT32_MAX - 1) /* Segment IDs are 32-bit */
+#define LSFS_MAX_INODES         (UINT32_MAX - 255) /* Inode numbers are 32-bit */
+#define LSFS_MIN_INODES         65536
 
-/* Disk layout constants */
+/*
+ * Disk layout
+ *
+ * The superblock is followed by the two checkpoint regions, the segment
+ * usage table and the log.  mkfs.lsfs sizes the regions from the image
+ * size and inode count and records them in the superblock: a checkpoint
+ * region holds its header and the inode map chunk table, the usage table
+ * one entry per segment, and the log starts on a segment (or erase
+ * block) boundary after them.
+ */
 #define LSFS_SUPERBLOCK_BLOCK   0
-#define LSFS_CHECKPOINT0_START  1
-#define LSFS_CHECKPOINT0_BLOCKS 256
-#define LSFS_CHECKPOINT1_START  257
-#define LSFS_CHECKPOINT1_BLOCKS 256
-#define LSFS_SEGTABLE_START     513
-#define LSFS_SEGTABLE_BLOCKS    512
-#define LSFS_LOG_START          1025
+#define LSFS_CHECKPOINT_START   1           /* First checkpoint region */
 
 /* Inode constants */
 #define LSFS_ROOT_INO           1
-#define LSFS_DIRECT_BLOCKS      12
+#define LSFS_INLINE_EXTENTS     7           /* Extents or index entries in the inode */
+#define LSFS_EXTENTS_PER_NODE   255         /* Entries in an extent tree block */
+#define LSFS_MAX_FILE_BLOCKS    UINT32_MAX  /* File blocks are 32-bit */
 #define LSFS_SYMLINK_INLINE_MAX 64
+#define LSFS_INLINE_DATA_MAX    176         /* File data bytes stored in the inode */
+#define LSFS_INODES_PER_BLOCK   (LSFS_BLOCK_SIZE / sizeof(struct lsfs_inode))
+
+/*
+ * Inode locations pack a slot index into the top byte of the block
+ * address, so slot 0 is the plain block address used by older images.
+ */
+#define LSFS_INODE_LOC(block, slot) \
+    ((uint64_t)(block) | ((uint64_t)(slot) << 56))
+#define LSFS_INODE_LOC_BLOCK(loc)   ((uint64_t)((loc) & ((1ULL << 56) - 1)))
+#define LSFS_INODE_LOC_SLOT(loc)    ((uint32_t)((loc) >> 56))
+
+/*
+ * Compressed file blocks are packed several to a log block and addressed
+ * by the packed block and their slot in it.  The slot is kept in the low
+ * bits, so the slots of a packed block have consecutive addresses and an
+ * extent maps a run of them like a run of plain blocks.  Packed addresses
+ * have the top bit set and never reach the block layer.
+ */
+#define LSFS_PACKED_FLAG            (1ULL << 63)
+#define LSFS_PACKED_SLOT_BITS       5
+#define LSFS_PACKED_SLOTS           (1U << LSFS_PACKED_SLOT_BITS)
+#define LSFS_PACKED_ADDR(block, slot) \
+    (LSFS_PACKED_FLAG | ((uint64_t)(block) << LSFS_PACKED_SLOT_BITS) | (uint64_t)(slot))
+#define LSFS_IS_PACKED(addr)        (((addr) & LSFS_PACKED_FLAG) != 0)
+#define LSFS_PACKED_BLOCK(addr)     (((addr) & ~LSFS_PACKED_FLAG) >> LSFS_PACKED_SLOT_BITS)
+#define LSFS_PACKED_SLOT(addr)      ((uint32_t)((addr) & (LSFS_PACKED_SLOTS - 1)))
+
+/* Compression codecs */
+#define LSFS_CODEC_NONE         0
+#define LSFS_CODEC_LZ4          1
+#define LSFS_CODEC_ZSTD         2
 
 /* Name lengths */
 #define LSFS_NAME_MAX           255
@@ -54,6 +107,8 @@
 /* Inode flags */
 #define LSFS_INODE_DELETED      (1 << 0)
 #define LSFS_INODE_DIRTY        (1 << 1)
+#define LSFS_INODE_HASHED_DIR   (1 << 2)    /* Directory uses the hash layout */
+#define LSFS_INODE_INLINE_DATA  (1 << 3)    /* Block 0 is stored in inline_data */
 
 /* Segment states */
 #define LSFS_SEG_FREE           0
@@ -69,11 +124,15 @@ struct lsfs_superblock {
     uint32_t magic;                 /* LSFS_MAGIC (0x4C534653) */
     uint32_t version;               /* Filesystem version */
     uint32_t block_size;            /* Block size in bytes (4096) */
-    uint32_t segment_size;          /* Segment size in blocks */
+    uint32_t segment_size;          /* Segment size in blocks (power of 2) */
     uint64_t total_blocks;          /* Total blocks in filesystem */
     uint64_t total_segments;        /* Total segments */
     uint64_t inode_count;           /* Number of allocated inodes */
     uint64_t checkpoint_region[2];  /* Alternating checkpoint locations */
+    uint64_t checkpoint_blocks;     /* Blocks in each checkpoint region */
+    uint64_t segtable_start;        /* First block of the segment usage tables */
+    uint64_t segtable_blocks;       /* Blocks in each segment usage table */
+    uint64_t max_inodes;            /* Inode numbers, a multiple of a chunk */
     uint32_t active_checkpoint;     /* Which checkpoint is current (0 or 1) */
     uint32_t padding1;              /* Alignment padding */
     uint64_t log_head;              /* Current log write position (block) */
@@ -83,11 +142,32 @@ struct lsfs_superblock {
     uint64_t mounted_at;            /* Last mount timestamp */
     uint32_t mount_count;           /* Number of mounts */
     uint32_t state;                 /* Clean/dirty state */
-    uint8_t  reserved[3960];        /* Pad to 4096 bytes */
+    uint64_t log_start;             /* First log block */
+    uint8_t  reserved[3936];        /* Pad to 4096 bytes */
+} __attribute__((packed));
+
+/*
+ * Extent - a run of file blocks stored in consecutive log blocks
+ * In index entries physical is the address of a child tree block and
+ * length the number of entries it holds.
+ */
+struct lsfs_extent {
+    uint32_t logical;               /* First file block */
+    uint32_t length;                /* Blocks (or child entries) */
+    uint64_t physical;              /* First log block (or child block) */
 } __attribute__((packed));
 
 /*
  * Inode structure - 256 bytes
+ *
+ * With extent_depth 0, extents[] maps the file directly.  Otherwise it
+ * holds the index entries at the top of an extent tree whose blocks are
+ * stored in the log: depth-0 tree blocks hold extents, higher ones hold
+ * index entries keyed by the first file block they cover.
+ *
+ * With LSFS_INODE_INLINE_DATA set the file has no blocks in the log: the
+ * extent and symlink space instead holds the start of block 0, the rest
+ * of which reads as zeros, and every other block is a hole.
  */
 struct lsfs_inode {
     uint32_t ino;                   /* Inode number */
@@ -102,16 +182,39 @@ struct lsfs_inode {
     uint32_t nlink;                 /* Hard link count */
     uint32_t flags;                 /* Inode flags */
 
-    /* Block pointers (direct + indirect) */
-    uint64_t direct[LSFS_DIRECT_BLOCKS];  /* Direct block pointers */
-    uint64_t indirect;              /* Single indirect block */
-    uint64_t double_indirect;       /* Double indirect block */
+    union {
+        struct {
+            /* Block map, sorted by logical block */
+            struct lsfs_extent extents[LSFS_INLINE_EXTENTS];
+
+            /* For symbolic links (inline if short) */
+            char symlink[LSFS_SYMLINK_INLINE_MAX]; /* Inline symlink target */
+        } __attribute__((packed));
 
-    /* For symbolic links (inline if short) */
-    char symlink[LSFS_SYMLINK_INLINE_MAX]; /* Inline symlink target */
+        /* Start of block 0 for LSFS_INODE_INLINE_DATA inodes */
+        uint8_t inline_data[LSFS_INLINE_DATA_MAX];
+    };
 
     uint64_t generation;            /* Inode generation number */
-    uint8_t reserved[48];           /* Future use, pad to 256 bytes */
+    uint16_t extent_count;          /* Entries used in extents[] */
+    uint16_t extent_depth;          /* Tree levels below the inode */
+    uint8_t reserved[4];            /* Future use, pad to 256 bytes */
+} __attribute__((packed));
+
+/*
+ * Extent tree block
+ */
+struct lsfs_extent_header {
+    uint32_t magic;                 /* LSFS_EXTENT_MAGIC */
+    uint32_t ino;                   /* Owning inode */
+    uint16_t count;                 /* Entries in use */
+    uint16_t depth;                 /* 0 = extents, else index entries */
+    uint32_t reserved;
+} __attribute__((packed));
+
+struct lsfs_extent_node {
+    struct lsfs_extent_header header;
+    struct lsfs_extent entries[LSFS_EXTENTS_PER_NODE];
 } __attribute__((packed));
 
 /*
@@ -125,24 +228,68 @@ struct lsfs_dirent {
     char     name[];                /* Filename (variable length) */
 } __attribute__((packed));
 
+/*
+ * Hashed directories
+ *
+ * A linear directory that outgrows LSFS_DIR_HASH_THRESHOLD blocks is
+ * converted to an extendible hash table.  File block 0 holds the header,
+ * blocks 1 to buckets hold the buckets, and the table of 2^depth bucket
+ * block numbers starts at file block LSFS_DIR_TABLE_BLOCK.  A name lives
+ * in the bucket found at the table slot given by the low depth bits of
+ * its hash.  Buckets are ordinary dirent blocks after a short header.
+ */
+#define LSFS_DIR_HASH_THRESHOLD 2           /* Linear blocks before converting */
+#define LSFS_DIR_TABLE_BLOCK    (1U << 24)  /* First file block of the table */
+#define LSFS_DIR_TABLE_PER_BLOCK (LSFS_BLOCK_SIZE / sizeof(uint32_t))
+#define LSFS_DIR_MAX_DEPTH      20          /* Up to 2^20 buckets */
+
+struct lsfs_dir_hash_header {
+    uint32_t magic;                 /* LSFS_DIR_HASH_MAGIC */
+    uint32_t depth;                 /* Global depth of the table */
+    uint32_t buckets;               /* Bucket blocks in use */
+    uint32_t reserved;
+} __attribute__((packed));
+
+struct lsfs_dir_bucket_header {
+    uint32_t magic;                 /* LSFS_DIR_BUCKET_MAGIC */
+    uint16_t depth;                 /* Local depth of the bucket */
+    uint16_t reserved;
+} __attribute__((packed));
+
+#define LSFS_DIR_BUCKET_START   sizeof(struct lsfs_dir_bucket_header)
+
 /*
  * Inode map entry - maps inode number to disk location
  */
 struct lsfs_imap_entry {
     uint32_t ino;                   /* Inode number */
     uint32_t version;               /* Version number (for stale detection) */
-    uint64_t location;              /* Block address of inode */
+    uint64_t location;              /* Inode block and slot (LSFS_INODE_LOC) */
 } __attribute__((packed));
 
+/*
+ * Inode map chunk - one log block of the inode map
+ * Chunk n holds the entries for inodes n * LSFS_IMAP_CHUNK_ENTRIES
+ * onwards, indexed by inode number; unused entries have ino 0.  Chunks
+ * are appended to the log when they change, and each checkpoint records
+ * where the latest copy of every chunk is.
+ */
+#define LSFS_IMAP_CHUNK_ENTRIES (LSFS_BLOCK_SIZE / sizeof(struct lsfs_imap_entry))
+#define LSFS_IMAP_TABLE_ENTRIES (LSFS_BLOCK_SIZE / sizeof(uint64_t)) /* Chunks per table block */
+
 /*
  * Segment summary block - first block of each segment
+ * Every time a segment is written its summary gets the next sequence
+ * number, so summaries left over from a segment's earlier use are told
+ * apart from writes made after the last checkpoint.
  */
 struct lsfs_segment_header {
     uint32_t magic;                 /* LSFS_SEGMENT_MAGIC */
     uint32_t segment_id;            /* Segment identifier */
     uint64_t timestamp;             /* Write timestamp */
+    uint64_t sequence;              /* Write sequence number, across the log */
     uint32_t block_count;           /* Number of blocks used in segment */
-    uint32_t checksum;              /* CRC32 of segment data */
+    uint32_t checksum;              /* CRC32C of the summary, taken with this 0 */
 } __attribute__((packed));
 
 /*
@@ -151,37 +298,94 @@ struct lsfs_segment_header {
 struct lsfs_block_info {
     uint32_t ino;                   /* Owning inode */
     uint32_t offset;                /* Offset within file (in blocks) */
-    uint8_t  type;                  /* Block type (data, inode, indirect) */
+    uint8_t  type;                  /* Block type (data, inode, extent) */
     uint8_t  reserved[3];
+    uint32_t checksum;              /* CRC32C of the block */
 } __attribute__((packed));
 
 #define LSFS_BLOCK_TYPE_DATA      0
 #define LSFS_BLOCK_TYPE_INODE     1
-#define LSFS_BLOCK_TYPE_INDIRECT  2
+#define LSFS_BLOCK_TYPE_EXTENT    2     /* Extent tree block */
 #define LSFS_BLOCK_TYPE_DIRENT    3
+#define LSFS_BLOCK_TYPE_IMAP      4     /* Inode map chunk (offset = chunk) */
+#define LSFS_BLOCK_TYPE_PACKED    5     /* Compressed data blocks (first slot's owner) */
 
 /*
- * Segment summary - follows header in first block
+ * Segment summary - the first LSFS_SUMMARY_BLOCKS blocks of a segment
+ * blocks[i] describes segment block LSFS_SUMMARY_BLOCKS + i, so every
+ * block a segment can hold has an entry.  Each entry carries the block's
+ * checksum, and the header's checksum covers all the summary blocks, so a
+ * segment that was only partly written is recognised.
+ *
+ * A segment flushed while still open for appends keeps a second copy of
+ * its summary in its last LSFS_SUMMARY_BLOCKS blocks, which are then never
+ * filled with data.  Each flush after the first writes the copy that does
+ * not hold the previous summary, so a torn write leaves that one to
+ * recover from.  The valid copy with the higher sequence number is the
+ * current one; copies agree on every block both describe.
  */
 struct lsfs_segment_summary {
     struct lsfs_segment_header header;
-    /* Array of block info follows, up to LSFS_SEGMENT_BLOCKS - 1 entries */
     struct lsfs_block_info blocks[];
 } __attribute__((packed));
 
 /*
- * Segment usage table entry
+ * Packed block - compressed file blocks sharing one log block
+ * Slot i holds file block offset of inode ino, compressed with codec into
+ * length bytes at start.  Compressed data follows the slot table, and
+ * blocks that do not compress to LSFS_PACKED_MAX_LEN are stored whole
+ * instead, so every packed block holds at least two.
+ */
+struct lsfs_packed_slot {
+    uint32_t ino;                   /* Owning inode */
+    uint32_t offset;                /* Offset within file (in blocks) */
+    uint16_t start;                 /* First byte of the compressed data */
+    uint16_t length;                /* Compressed length in bytes */
+} __attribute__((packed));
+
+struct lsfs_packed_header {
+    uint32_t magic;                 /* LSFS_PACKED_MAGIC */
+    uint8_t  codec;                 /* LSFS_CODEC_* */
+    uint8_t  count;                 /* Slots in use */
+    uint16_t end;                   /* First unused byte */
+    struct lsfs_packed_slot slots[LSFS_PACKED_SLOTS];
+} __attribute__((packed));
+
+#define LSFS_PACKED_DATA_START  sizeof(struct lsfs_packed_header)
+#define LSFS_PACKED_MAX_LEN     ((LSFS_BLOCK_SIZE - LSFS_PACKED_DATA_START) / 2)
+
+/*
+ * Segment usage table entry - 256 bytes, so entries never span blocks
+ * Bit i of live_map is set while segment block i is in use; live_blocks
+ * is the number of bits set.  Inode and packed blocks stay live while any
+ * of their slots is, so their dead slots are counted on the side.
  */
 struct lsfs_segment_usage {
     uint32_t segment_id;            /* Segment ID */
     uint32_t state;                 /* Segment state */
     uint32_t live_blocks;           /* Number of live blocks */
-    uint32_t reserved;
+    uint32_t dead_slots;            /* Dead inode slots in live inode blocks */
     uint64_t timestamp;             /* Last write timestamp */
+    uint64_t live_map[LSFS_SEGMENT_BLOCKS / 64]; /* Live block bitmap */
+    uint32_t packed_blocks;         /* Packed blocks written */
+    uint32_t packed_slots;          /* Compressed blocks written into them */
+    uint32_t dead_packed;           /* Dead compressed blocks among those */
+    uint64_t sequence;              /* Write sequence numbers from here on
+                                     * are its own, since it was allocated */
+    uint8_t  reserved[84];          /* Pad to 256 bytes */
 } __attribute__((packed));
 
+#define LSFS_CHECKPOINT_STREAMS 4   /* Open segments a checkpoint records */
+
 /*
  * Checkpoint header
+ * The block after the header starts the inode map chunk table: one
+ * uint64_t log address per chunk, 0 for chunks with no inodes.
+ *
+ * segment_seq is the last segment write before the inode map was copied,
+ * and open_segment/open_blocks say how much of each segment then open for
+ * appends was already written (open_blocks 0 for none).  Roll-forward
+ * replays segments written later than that, from those positions on.
  */
 struct lsfs_checkpoint_header {
     uint32_t magic;                 /* LSFS_CHECKPOINT_MAGIC */
@@ -189,16 +393,111 @@ struct lsfs_checkpoint_header {
     uint64_t sequence;              /* Checkpoint sequence number */
     uint64_t timestamp;             /* Creation timestamp */
     uint64_t log_head;              /* Log head at checkpoint time */
-    uint32_t imap_entries;          /* Number of inode map entries */
+    uint32_t imap_entries;          /* Inodes in use */
+    uint32_t imap_chunks;           /* Entries in the chunk table */
     uint32_t segment_entries;       /* Number of segment table entries */
-    uint32_t checksum;              /* Header checksum */
+    uint64_t segment_seq;           /* Last segment write covered */
+    uint32_t open_segment[LSFS_CHECKPOINT_STREAMS]; /* Segments open for appends */
+    uint32_t open_blocks[LSFS_CHECKPOINT_STREAMS];  /* Blocks in them then */
+    uint32_t checksum;              /* CRC32C of the header, taken with this 0 */
     uint32_t complete;              /* Completion marker */
 } __attribute__((packed));
 
 /* Static assertions for structure sizes */
 _Static_assert(sizeof(struct lsfs_superblock) == LSFS_BLOCK_SIZE,
                "Superblock must be exactly one block");
+_Static_assert(LSFS_INLINE_DATA_MAX ==
+               LSFS_INLINE_EXTENTS * sizeof(struct lsfs_extent) + LSFS_SYMLINK_INLINE_MAX,
+               "Inline data must cover the extent and symlink space");
 _Static_assert(sizeof(struct lsfs_inode) == 256,
                "Inode must be exactly 256 bytes");
+_Static_assert(sizeof(struct lsfs_extent_node) == LSFS_BLOCK_SIZE,
+               "Extent tree block must be exactly one block");
+_Static_assert(sizeof(struct lsfs_segment_header) +
+               (LSFS_SEGMENT_BLOCKS - LSFS_SUMMARY_BLOCKS) * sizeof(struct lsfs_block_info) <=
+               LSFS_SUMMARY_BLOCKS * LSFS_BLOCK_SIZE,
+               "Segment summary must describe every block of the segment");
+_Static_assert(sizeof(struct lsfs_packed_header) + 2 * LSFS_PACKED_MAX_LEN <= LSFS_BLOCK_SIZE,
+               "Packed block must hold two compressed blocks");
+_Static_assert(sizeof(struct lsfs_segment_usage) == 256,
+               "Segment usage entry must be exactly 256 bytes");
+_Static_assert(LSFS_IMAP_CHUNK_ENTRIES * sizeof(struct lsfs_imap_entry) == LSFS_BLOCK_SIZE,
+               "Inode map chunk must be exactly one block");
+_Static_assert(LSFS_MAX_INODES % LSFS_IMAP_CHUNK_ENTRIES == 0,
+               "Inode numbers must fill whole inode map chunks");
+
+/*
+ * Check that the regions recorded in a superblock fit together
+ * Returns NULL if they do, or a description of the first problem.
+ */
+static inline const char *lsfs_sb_check_layout(const struct lsfs_superblock *sb)
+{
+    uint64_t segment_entries = LSFS_BLOCK_SIZE / sizeof(struct lsfs_segment_usage);
+    uint64_t chunks = sb->max_inodes / LSFS_IMAP_CHUNK_ENTRIES;
+
+    if (sb->max_inodes < LSFS_IMAP_CHUNK_ENTRIES || sb->max_inodes > LSFS_MAX_INODES ||
+        sb->max_inodes % LSFS_IMAP_CHUNK_ENTRIES != 0) {
+        return "inode count is not a whole number of inode map chunks";
+    }
+    if (sb->checkpoint_region[0] != LSFS_CHECKPOINT_START ||
+        sb->checkpoint_region[1] != sb->checkpoint_region[0] + sb->checkpoint_blocks) {
+        return "checkpoint regions are not consecutive";
+    }
+    if (sb->checkpoint_blocks < 1 + (chunks + LSFS_IMAP_TABLE_ENTRIES - 1) / LSFS_IMAP_TABLE_ENTRIES) {
+        return "checkpoint region is too small for the inode map chunk table";
+    }
+    if (sb->segtable_start < sb->checkpoint_region[1] + sb->checkpoint_blocks) {
+        return "segment usage table overlaps the checkpoint regions";
+    }
+    if (sb->total_segments == 0 || sb->total_segments > LSFS_MAX_SEGMENTS ||
+        sb->segtable_blocks * segment_entries < sb->total_segments) {
+        return "segment usage table is too small for the segment count";
+    }
+    if (sb->log_start < sb->segtable_start + 2 * sb->segtable_blocks) {
+        return "log overlaps the segment usage tables";
+    }
+    if (sb->log_start > sb->total_blocks ||
+        sb->total_segments * sb->segment_size > sb->total_blocks - sb->log_start) {
+        return "log does not fit in the filesystem";
+    }
+    return NULL;
+}
+
+/*
+ * First block of the segment usage table a checkpoint region goes with
+ * Each region has its own copy, written before its header is complete,
+ * so a checkpoint's table always matches its inode map.
+ */
+static inline uint64_t lsfs_sb_segtable_block(const struct lsfs_superblock *sb,
+                                              uint32_t region)
+{
+    return sb->segtable_start + (uint64_t)(region & 1) * sb->segtable_blocks;
+}
+
+/*
+ * Image access shared by the filesystem and the tools (ondisk.c)
+ * Return 0, or -1 with errno set.
+ */
+int lsfs_image_size(int fd, uint64_t *size, bool *block_device);
+int lsfs_image_read(int fd, uint64_t block, uint64_t count, void *buf);
+int lsfs_image_write(int fd, uint64_t block, uint64_t count, const void *buf);
+
+/* Checks of structures read from disk, checksums included */
+bool lsfs_checkpoint_valid(const struct lsfs_checkpoint_header *header);
+bool lsfs_summary_valid(const struct lsfs_segment_summary *summary, uint32_t segment_id,
+                        uint32_t segment_blocks);
+const struct lsfs_segment_summary *
+lsfs_summary_current(const struct lsfs_segment_summary *head,
+                     const struct lsfs_segment_summary *tail,
+                     uint32_t segment_id, uint32_t segment_blocks);
+
+/* First block of a segment's second summary copy */
+#define LSFS_SUMMARY_TAIL(segment_blocks) ((segment_blocks) - LSFS_SUMMARY_BLOCKS)
+
+/*
+ * Extended attribute of the root directory holding a mounted filesystem's
+ * statistics as text, one "name value..." line each; read by lsfs-debug
+ */
+#define LSFS_STATS_XATTR        "user.lsfs.stats"
 
 #endif /* LSFS_ONDISK_H */
@@ -25,18 +25,57 @@ FAILED=0
 # Print test result
 pass() {
     echo -e "${GREEN}[PASS]${NC} $1"
-    ((PASSED++))
+    PASSED=$((PASSED + 1))
 }
 
 fail() {
     echo -e "${RED}[FAIL]${NC} $1"
-    ((FAILED++))
+    FAILED=$((FAILED + 1))
 }
 
 info() {
     echo -e "${YELLOW}[INFO]${NC} $1"
 }
 
+# Mount an image in the background: mount_fs <image> [lsfs options...]
+mount_fs() {
+    local image="$1"
+    shift
+    "$BUILD_DIR/lsfs" -f "$@" "$image" "$MOUNT_POINT" &
+    LSFS_PID=$!
+    sleep 2
+}
+
+# Unmount and wait for the daemon to exit
+unmount_fs() {
+    fusermount -u "$MOUNT_POINT"
+    wait $LSFS_PID 2>/dev/null || true
+}
+
+# Kill the daemon without unmounting, as a crash would
+crash_fs() {
+    kill -9 $LSFS_PID 2>/dev/null || true
+    wait $LSFS_PID 2>/dev/null || true
+    fusermount -u -z "$MOUNT_POINT" 2>/dev/null || true
+}
+
+# Flip bytes in the log block that starts with a marker: corrupt_block <image> <marker>
+corrupt_block() {
+    local offset
+    offset=$(grep -obUa "$2" "$1" | head -1 | cut -d: -f1)
+    [ -n "$offset" ] || return 1
+    printf 'CORRUPTED' | dd of="$1" bs=1 seek=$((offset + 100)) conv=notrunc 2>/dev/null
+}
+
+# Check an image after a test step: check_fs <image> <step>
+check_fs() {
+    if "$BUILD_DIR/fsck.lsfs" "$1" > /dev/null 2>&1; then
+        pass "fsck passed after $2"
+    else
+        fail "fsck failed after $2"
+    fi
+}
+
 # Cleanup function
 cleanup() {
     info "Cleaning up..."
@@ -200,6 +239,34 @@ else
     fail "Failed to rename file"
 fi
 
+# Moving a directory rewrites its "..", which the final fsck checks
+REN="$MOUNT_POINT/renames"
+mkdir -p "$REN/a/sub" "$REN/b" "$REN/d1" "$REN/d2/inner" "$REN/full/child" "$REN/e"
+echo "Moved file" > "$REN/a/sub/moved.txt"
+echo "Plain file" > "$REN/file.txt"
+if mv "$REN/a/sub" "$REN/b/sub2" &&
+   [ "$(cat "$REN/b/sub2/moved.txt")" = "Moved file" ] && [ ! -e "$REN/a/sub" ]; then
+    pass "Moved a directory to another parent"
+else
+    fail "Failed to move a directory"
+fi
+
+# The empty d1 is replaced and freed, and d2's contents move with it
+if mv -T "$REN/d2" "$REN/d1" && [ -d "$REN/d1/inner" ] && [ ! -e "$REN/d2" ]; then
+    pass "Renamed a directory over an empty directory"
+else
+    fail "Failed to rename a directory over an empty directory"
+fi
+
+if ! mv -T "$REN/e" "$REN/full" 2>/dev/null && [ -d "$REN/full/child" ] &&
+   ! mv -T "$REN/e" "$REN/file.txt" 2>/dev/null &&
+   ! mv -T "$REN/file.txt" "$REN/e" 2>/dev/null &&
+   [ "$(cat "$REN/file.txt")" = "Plain file" ] && [ -d "$REN/e" ]; then
+    pass "Refused renames over a non-empty directory or across types"
+else
+    fail "Allowed a rename over a non-empty directory or across types"
+fi
+
 # Test 15: File permissions
 info "Test 15: File permissions"
 if chmod 600 "$MOUNT_POINT/renamed.txt"; then
@@ -255,6 +322,598 @@ else
     fail "Final fsck failed"
 fi
 
+# Test 19: Concurrent operations
+info "Test 19: Concurrent operations (8 worker threads)"
+mount_fs "$DISK_IMAGE" -t 8
+
+# Each job works in a directory of its own and creates and renames names
+# in the shared root, so jobs contend for the root directory and the log
+MT_JOBS=""
+for job in $(seq 1 8); do
+    (
+        mkdir "$MOUNT_POINT/mt$job"
+        for i in $(seq 1 50); do
+            echo "Job $job file $i" > "$MOUNT_POINT/mt$job/f$i"
+            echo "Job $job shared $i" > "$MOUNT_POINT/shared_${job}_$i"
+        done
+        for i in $(seq 1 50); do
+            [ "$(cat "$MOUNT_POINT/mt$job/f$i")" = "Job $job file $i" ]
+            mv "$MOUNT_POINT/shared_${job}_$i" "$MOUNT_POINT/mt$job/moved$i"
+        done
+        for i in $(seq 1 25); do
+            rm "$MOUNT_POINT/mt$job/f$i"
+        done
+        dd if=/dev/urandom of="$MOUNT_POINT/mt$job/big.bin" bs=64k count=16 2>/dev/null
+    ) &
+    MT_JOBS="$MT_JOBS $!"
+done
+
+MT_OK=1
+for pid in $MT_JOBS; do
+    wait $pid || MT_OK=0
+done
+if [ $MT_OK -eq 1 ]; then
+    pass "Concurrent jobs completed"
+else
+    fail "A concurrent job failed"
+fi
+
+unmount_fs
+mount_fs "$DISK_IMAGE" -t 8
+
+MT_OK=1
+for job in $(seq 1 8); do
+    COUNT=$(ls "$MOUNT_POINT/mt$job" | wc -l)
+    if [ "$COUNT" != "76" ] ||
+       [ "$(cat "$MOUNT_POINT/mt$job/moved50")" != "Job $job shared 50" ] ||
+       [ "$(stat -c%s "$MOUNT_POINT/mt$job/big.bin")" != "1048576" ]; then
+        MT_OK=0
+    fi
+done
+if [ $MT_OK -eq 1 ] && ! ls "$MOUNT_POINT" | grep -q "^shared_"; then
+    pass "Concurrent changes persisted after remount"
+else
+    fail "Concurrent changes lost or duplicated"
+fi
+
+rm -r "$MOUNT_POINT"/mt*
+unmount_fs
+check_fs "$DISK_IMAGE" "concurrent operations"
+
+# Test 20: I/O backends
+info "Test 20: psync, io_uring and O_DIRECT backends"
+head -c 3145851 /dev/urandom > "$TEST_DIR/io.ref"
+
+# Each backend reads back the file the one before it wrote
+IO_PREV=""
+for IO_OPTS in "-i psync" "-i uring" "-i psync -D" "-i uring -D"; do
+    IO_NAME=$(echo "$IO_OPTS" | tr -d ' -')
+    mount_fs "$DISK_IMAGE" $IO_OPTS
+    if ! mountpoint -q "$MOUNT_POINT"; then
+        # tmpfs and some other filesystems refuse O_DIRECT
+        info "Could not mount with $IO_OPTS, skipped"
+        wait $LSFS_PID 2>/dev/null || true
+        continue
+    fi
+
+    if cp "$TEST_DIR/io.ref" "$MOUNT_POINT/io_$IO_NAME.bin" &&
+       cmp -s "$TEST_DIR/io.ref" "$MOUNT_POINT/io_$IO_NAME.bin" &&
+       { [ -z "$IO_PREV" ] || cmp -s "$TEST_DIR/io.ref" "$MOUNT_POINT/io_$IO_PREV.bin"; }; then
+        pass "Wrote and read back data with $IO_OPTS"
+    else
+        fail "Data mismatch with $IO_OPTS"
+    fi
+    IO_PREV=$IO_NAME
+    unmount_fs
+done
+
+mount_fs "$DISK_IMAGE"
+rm -f "$MOUNT_POINT"/io_*.bin
+unmount_fs
+check_fs "$DISK_IMAGE" "I/O backends"
+
+# Test 21: Hashed directories
+info "Test 21: Hashed directory through several bucket splits"
+mount_fs "$DISK_IMAGE"
+HASH_DIR="$MOUNT_POINT/hashed"
+mkdir "$HASH_DIR"
+
+# 3000 names fill about twenty buckets, so the table doubles several times
+(cd "$HASH_DIR" && seq -f "entry_%g_with_a_longer_name" 1 3000 | xargs touch)
+COUNT=$(ls "$HASH_DIR" | wc -l)
+if [ "$COUNT" = "3000" ] && [ -f "$HASH_DIR/entry_1_with_a_longer_name" ] &&
+   [ -f "$HASH_DIR/entry_3000_with_a_longer_name" ]; then
+    pass "Created 3000 entries in one directory"
+else
+    fail "Hashed directory holds $COUNT entries, expected 3000"
+fi
+
+(cd "$HASH_DIR" && seq -f "entry_%g_with_a_longer_name" 1 3 3000 | xargs rm)
+mv "$HASH_DIR/entry_2_with_a_longer_name" "$HASH_DIR/renamed_entry"
+unmount_fs
+mount_fs "$DISK_IMAGE"
+
+COUNT=$(ls "$HASH_DIR" | wc -l)
+if [ "$COUNT" = "2000" ] && [ ! -e "$HASH_DIR/entry_1_with_a_longer_name" ] &&
+   [ ! -e "$HASH_DIR/entry_2_with_a_longer_name" ] && [ -f "$HASH_DIR/renamed_entry" ] &&
+   [ -f "$HASH_DIR/entry_2999_with_a_longer_name" ]; then
+    pass "Removals and renames persisted in the hashed directory"
+else
+    fail "Hashed directory holds $COUNT entries after remount, expected 2000"
+fi
+
+if rm -r "$HASH_DIR" && [ ! -e "$HASH_DIR" ]; then
+    pass "Removed the hashed directory"
+else
+    fail "Failed to remove the hashed directory"
+fi
+unmount_fs
+check_fs "$DISK_IMAGE" "hashed directories"
+
+# Test 22: Dentry cache
+info "Test 22: Dentry cache, negative entries and invalidation"
+
+# Zero kernel timeouts send every lookup to the daemon's dentry cache
+for DC_OPTS in "-e 0 -a 0" "-e 0 -a 0 -C 0" "-n 5"; do
+    mount_fs "$DISK_IMAGE" $DC_OPTS
+    DC="$MOUNT_POINT/dcache"
+    mkdir "$DC"
+
+    DC_OK=1
+    # A name looked up while missing must appear once created
+    [ ! -e "$DC/a" ] || DC_OK=0
+    echo "first" > "$DC/a" || DC_OK=0
+    [ "$(cat "$DC/a" 2>/dev/null)" = "first" ] || DC_OK=0
+
+    # Rename leaves the old name missing and the new one resolved
+    [ ! -e "$DC/b" ] || DC_OK=0
+    mv "$DC/a" "$DC/b" || DC_OK=0
+    [ ! -e "$DC/a" ] && [ "$(cat "$DC/b" 2>/dev/null)" = "first" ] || DC_OK=0
+
+    # Unlink and recreate resolves to the new inode
+    rm "$DC/b" || DC_OK=0
+    [ ! -e "$DC/b" ] || DC_OK=0
+    echo "second" > "$DC/b" || DC_OK=0
+    [ "$(cat "$DC/b" 2>/dev/null)" = "second" ] || DC_OK=0
+
+    # Directories go through the same entries
+    mkdir "$DC/sub" && rmdir "$DC/sub" || DC_OK=0
+    [ ! -e "$DC/sub" ] || DC_OK=0
+    echo "file" > "$DC/sub" || DC_OK=0
+    [ -f "$DC/sub" ] || DC_OK=0
+
+    if [ $DC_OK -eq 1 ]; then
+        pass "Lookups stayed current with $DC_OPTS"
+    else
+        fail "Stale lookup with $DC_OPTS"
+    fi
+    rm -r "$DC"
+    unmount_fs
+done
+check_fs "$DISK_IMAGE" "dentry cache"
+
+# Test 23: Overwrite loop, many times the image size through the cleaner
+info "Test 23: Overwrite loop (320MB through a 64MB image)"
+mount_fs "$DISK_IMAGE"
+
+OVERWRITE_OK=1
+for round in $(seq 1 20); do
+    for i in 1 2 3 4; do
+        if ! dd if=/dev/urandom of="$MOUNT_POINT/over$i.bin" bs=1M count=4 \
+                conv=notrunc 2>/dev/null; then
+            OVERWRITE_OK=0
+            break 2
+        fi
+    done
+done
+if [ $OVERWRITE_OK -eq 1 ]; then
+    pass "Overwrote 16MB of files 20 times"
+else
+    fail "Overwrite failed in round $round"
+fi
+
+rm -f "$MOUNT_POINT"/over*.bin
+unmount_fs
+check_fs "$DISK_IMAGE" "overwrite loop"
+
+# A mostly full image, where writers wait on the cleaner's reserve and
+# checkpoints, must neither hang nor lose what it acknowledged at unmount
+FULL_IMAGE="$TEST_DIR/full.img"
+"$BUILD_DIR/mkfs.lsfs" -s 64 "$FULL_IMAGE" > /dev/null 2>&1
+mount_fs "$FULL_IMAGE"
+FULL_OK=1
+for i in $(seq 1 36); do
+    dd if=/dev/urandom of="$MOUNT_POINT/full$i.bin" bs=1M count=1 2>/dev/null || FULL_OK=0
+done
+for round in 1 2 3; do
+    for i in $(seq 1 3 36); do
+        timeout 60 dd if=/dev/urandom of="$MOUNT_POINT/full$i.bin" bs=1M count=1 \
+            conv=notrunc 2>/dev/null || FULL_OK=0
+    done
+done
+truncate -s 4096 "$MOUNT_POINT/full2.bin" || FULL_OK=0
+fusermount -u "$MOUNT_POINT"
+wait $LSFS_PID || FULL_OK=0
+mount_fs "$FULL_IMAGE"
+[ "$(stat -c%s "$MOUNT_POINT/full2.bin")" = "4096" ] || FULL_OK=0
+unmount_fs
+if [ $FULL_OK -eq 1 ]; then
+    pass "Overwrote and truncated files on a 60% full image"
+else
+    fail "Writes, truncate or unmount failed on a 60% full image"
+fi
+check_fs "$FULL_IMAGE" "writes to a mostly full image"
+rm -f "$FULL_IMAGE"
+
+# Test 24: Checksum verification modes
+info "Test 24: none, segment and block verification of a corrupted block"
+VERIFY_IMAGE="$TEST_DIR/verify.img"
+"$BUILD_DIR/mkfs.lsfs" -s 64 "$VERIFY_IMAGE" > /dev/null 2>&1
+{ printf 'LSFS-VERIFY-MARK'; head -c 262128 /dev/urandom; } > "$TEST_DIR/verify.ref"
+
+# Reads of a block check it only in block mode
+mount_fs "$VERIFY_IMAGE"
+cp "$TEST_DIR/verify.ref" "$MOUNT_POINT/verify.bin"
+unmount_fs
+if corrupt_block "$VERIFY_IMAGE" "LSFS-VERIFY-MARK"; then
+    mount_fs "$VERIFY_IMAGE" -V block
+    if ! cat "$MOUNT_POINT/verify.bin" > /dev/null 2>&1; then
+        pass "Block mode failed the read of a corrupted block"
+    else
+        fail "Block mode returned a corrupted block"
+    fi
+    unmount_fs
+
+    for VERIFY_MODE in none segment; do
+        mount_fs "$VERIFY_IMAGE" -V $VERIFY_MODE
+        if cat "$MOUNT_POINT/verify.bin" > "$TEST_DIR/verify.out" 2>/dev/null &&
+           ! cmp -s "$TEST_DIR/verify.ref" "$TEST_DIR/verify.out"; then
+            pass "$VERIFY_MODE mode read the block without checking it"
+        else
+            fail "$VERIFY_MODE mode did not read the corrupted block"
+        fi
+        unmount_fs
+    done
+else
+    fail "Could not find the block to corrupt"
+fi
+
+# Roll-forward checks the blocks it replays in segment mode; data synced
+# after the last checkpoint is only found through it
+for VERIFY_MODE in none segment; do
+    rm -f "$VERIFY_IMAGE"
+    "$BUILD_DIR/mkfs.lsfs" -s 64 "$VERIFY_IMAGE" > /dev/null 2>&1
+    mount_fs "$VERIFY_IMAGE" -k 3600
+    dd if="$TEST_DIR/verify.ref" of="$MOUNT_POINT/synced.bin" conv=fsync 2>/dev/null
+    crash_fs
+    corrupt_block "$VERIFY_IMAGE" "LSFS-VERIFY-MARK" || true
+
+    "$BUILD_DIR/lsfs" -f -V $VERIFY_MODE "$VERIFY_IMAGE" "$MOUNT_POINT" \
+        > "$TEST_DIR/verify.log" 2>&1 &
+    LSFS_PID=$!
+    sleep 2
+    if [ $VERIFY_MODE = none ] && [ -f "$MOUNT_POINT/synced.bin" ]; then
+        pass "none mode replayed the corrupted segment"
+    elif [ $VERIFY_MODE = segment ] && [ ! -e "$MOUNT_POINT/synced.bin" ] &&
+         grep -q "does not match its checksum" "$TEST_DIR/verify.log"; then
+        pass "segment mode stopped recovery at the corrupted block"
+    else
+        fail "$VERIFY_MODE mode recovery of a corrupted segment"
+    fi
+    unmount_fs
+done
+rm -f "$VERIFY_IMAGE"
+
+# Test 25: Compression
+info "Test 25: Compressed round trip with per-block codecs"
+
+# Alternate incompressible and compressible blocks
+: > "$TEST_DIR/zip.ref"
+for i in $(seq 1 64); do
+    head -c 4096 /dev/urandom >> "$TEST_DIR/zip.ref"
+    yes "LSFS compression block $i" | head -c 4096 >> "$TEST_DIR/zip.ref"
+done
+cp "$TEST_DIR/zip.ref" "$TEST_DIR/zip_shared.ref"
+
+# Every codec rewrites part of one shared file, so it ends up holding
+# blocks of each codec side by side
+ZIP_SEEK=0
+for ZIP_CODEC in lz4 zstd zstd:9; do
+    mount_fs "$DISK_IMAGE" -z $ZIP_CODEC
+    if ! mountpoint -q "$MOUNT_POINT"; then
+        info "Codec $ZIP_CODEC is not in this build, skipped"
+        wait $LSFS_PID 2>/dev/null || true
+        continue
+    fi
+
+    ZIP_NAME=$(echo "$ZIP_CODEC" | tr -d ':')
+    cp "$TEST_DIR/zip.ref" "$MOUNT_POINT/zip_$ZIP_NAME.bin"
+    [ -f "$MOUNT_POINT/zip_shared.bin" ] || cp "$TEST_DIR/zip.ref" "$MOUNT_POINT/zip_shared.bin"
+    yes "Rewritten with $ZIP_CODEC" | head -c 65536 > "$TEST_DIR/zip.patch"
+    for ZIP_FILE in "$MOUNT_POINT/zip_shared.bin" "$TEST_DIR/zip_shared.ref"; do
+        dd if="$TEST_DIR/zip.patch" of="$ZIP_FILE" bs=4096 seek=$ZIP_SEEK \
+            conv=notrunc 2>/dev/null
+    done
+    ZIP_SEEK=$((ZIP_SEEK + 24))
+
+    if cmp -s "$TEST_DIR/zip.ref" "$MOUNT_POINT/zip_$ZIP_NAME.bin" &&
+       cmp -s "$TEST_DIR/zip_shared.ref" "$MOUNT_POINT/zip_shared.bin"; then
+        pass "Wrote and read back data compressed with $ZIP_CODEC"
+    else
+        fail "Data mismatch compressed with $ZIP_CODEC"
+    fi
+    unmount_fs
+done
+
+# Without a codec of its own, a mount still reads every block back
+mount_fs "$DISK_IMAGE"
+ZIP_OK=1
+for ZIP_FILE in "$MOUNT_POINT"/zip_*.bin; do
+    [ -e "$ZIP_FILE" ] || continue
+    if [ "$ZIP_FILE" = "$MOUNT_POINT/zip_shared.bin" ]; then
+        cmp -s "$TEST_DIR/zip_shared.ref" "$ZIP_FILE" || ZIP_OK=0
+    else
+        cmp -s "$TEST_DIR/zip.ref" "$ZIP_FILE" || ZIP_OK=0
+    fi
+done
+if [ $ZIP_OK -eq 1 ]; then
+    pass "Read back compressed files after remount without compression"
+else
+    fail "Compressed files changed after remount"
+fi
+rm -f "$MOUNT_POINT"/zip_*.bin
+unmount_fs
+check_fs "$DISK_IMAGE" "compression"
+
+# Test 26: Inline data
+info "Test 26: Inline data promoted to blocks and back"
+mount_fs "$DISK_IMAGE"
+INL="$MOUNT_POINT/inline"
+mkdir "$INL"
+
+# Up to 176 bytes stay in the inode; the append moves them to block 0,
+# and a file emptied by truncation is inline again on its next write
+head -c 100 /dev/urandom > "$TEST_DIR/inline.ref"
+cp "$TEST_DIR/inline.ref" "$INL/small"
+INL_OK=1
+cmp -s "$TEST_DIR/inline.ref" "$INL/small" || INL_OK=0
+head -c 9000 /dev/urandom >> "$TEST_DIR/inline.ref"
+tail -c 9000 "$TEST_DIR/inline.ref" >> "$INL/small"
+cmp -s "$TEST_DIR/inline.ref" "$INL/small" || INL_OK=0
+truncate -s 0 "$INL/small"
+echo "inline again" > "$INL/small"
+[ "$(cat "$INL/small")" = "inline again" ] || INL_OK=0
+
+# A write past the inline area into a hole keeps the inline head
+printf 'head' > "$INL/sparse"
+dd if=/dev/zero of="$INL/sparse" bs=1 count=1 seek=100000 conv=notrunc 2>/dev/null
+[ "$(head -c 4 "$INL/sparse")" = "head" ] || INL_OK=0
+[ "$(stat -c%s "$INL/sparse")" = "100001" ] || INL_OK=0
+
+# Directories start inline and move to a block as entries are added
+mkdir "$INL/dir"
+touch "$INL/dir/a"
+for i in $(seq 1 40); do
+    touch "$INL/dir/entry_$i"
+done
+[ "$(ls "$INL/dir" | wc -l)" = "41" ] || INL_OK=0
+rm "$INL/dir"/entry_*
+[ "$(ls "$INL/dir")" = "a" ] || INL_OK=0
+
+if [ $INL_OK -eq 1 ]; then
+    pass "Inline files and directories kept their data"
+else
+    fail "Inline data changed across promotion or demotion"
+fi
+unmount_fs
+mount_fs "$DISK_IMAGE"
+
+if [ "$(cat "$INL/small")" = "inline again" ] &&
+   [ "$(head -c 4 "$INL/sparse")" = "head" ] &&
+   [ "$(ls "$INL/dir")" = "a" ]; then
+    pass "Inline data persisted after remount"
+else
+    fail "Inline data lost after remount"
+fi
+rm -r "$INL"
+unmount_fs
+check_fs "$DISK_IMAGE" "inline data"
+
+# Test 27: Crash recovery
+info "Test 27: Roll-forward after a crash"
+
+# Nothing is checkpointed after mount, so everything synced below is
+# found by rolling forward through several segments in write order
+mount_fs "$DISK_IMAGE" -k 3600 -K 1000000
+for i in $(seq 1 8); do
+    head -c 1048576 /dev/urandom > "$TEST_DIR/roll_$i.ref"
+    dd if="$TEST_DIR/roll_$i.ref" of="$MOUNT_POINT/roll_$i.bin" bs=64k conv=fsync 2>/dev/null
+done
+# Later writes to the same blocks must win
+head -c 65536 /dev/urandom > "$TEST_DIR/roll.patch"
+for i in 1 2; do
+    dd if="$TEST_DIR/roll.patch" of="$TEST_DIR/roll_1.ref" bs=4096 seek=8 conv=notrunc 2>/dev/null
+    dd if="$TEST_DIR/roll.patch" of="$MOUNT_POINT/roll_1.bin" bs=4096 seek=8 \
+        conv=notrunc,fsync 2>/dev/null
+    head -c 65536 /dev/urandom > "$TEST_DIR/roll.patch"
+done
+mv "$MOUNT_POINT/roll_2.bin" "$MOUNT_POINT/roll_2_renamed.bin"
+rm "$MOUNT_POINT/roll_3.bin"
+dd if="$TEST_DIR/roll_8.ref" of="$MOUNT_POINT/roll_last.bin" bs=64k conv=fsync 2>/dev/null
+crash_fs
+
+mount_fs "$DISK_IMAGE"
+ROLL_OK=1
+for i in 1 4 5 6 7 8; do
+    cmp -s "$TEST_DIR/roll_$i.ref" "$MOUNT_POINT/roll_$i.bin" || ROLL_OK=0
+done
+cmp -s "$TEST_DIR/roll_2.ref" "$MOUNT_POINT/roll_2_renamed.bin" || ROLL_OK=0
+cmp -s "$TEST_DIR/roll_8.ref" "$MOUNT_POINT/roll_last.bin" || ROLL_OK=0
+[ ! -e "$MOUNT_POINT/roll_2.bin" ] && [ ! -e "$MOUNT_POINT/roll_3.bin" ] || ROLL_OK=0
+if [ $ROLL_OK -eq 1 ]; then
+    pass "Recovered synced writes, renames and removals"
+else
+    fail "Synced changes lost or out of order after a crash"
+fi
+
+# A crash right after a recovery must recover the same state
+crash_fs
+mount_fs "$DISK_IMAGE"
+if cmp -s "$TEST_DIR/roll_1.ref" "$MOUNT_POINT/roll_1.bin" &&
+   cmp -s "$TEST_DIR/roll_8.ref" "$MOUNT_POINT/roll_last.bin"; then
+    pass "Recovered again after a second crash"
+else
+    fail "Data lost after a second crash"
+fi
+rm -f "$MOUNT_POINT"/roll_*.bin
+unmount_fs
+check_fs "$DISK_IMAGE" "crash recovery"
+
+# Crashes while checkpoints are taken and the cleaner runs must leave an
+# image fsck accepts as it is, with what was synced before them intact
+CRASH_IMAGE="$TEST_DIR/crash.img"
+"$BUILD_DIR/mkfs.lsfs" -s 64 "$CRASH_IMAGE" > /dev/null 2>&1
+head -c 4194304 /dev/urandom > "$TEST_DIR/crash.ref"
+CRASH_OK=1
+for round in $(seq 1 5); do
+    mount_fs "$CRASH_IMAGE" -k 1 -K 256
+    if [ $round -eq 1 ]; then
+        dd if="$TEST_DIR/crash.ref" of="$MOUNT_POINT/crash.bin" bs=1M conv=fsync 2>/dev/null
+    fi
+    cmp -s "$TEST_DIR/crash.ref" "$MOUNT_POINT/crash.bin" || CRASH_OK=0
+
+    # Overwrite 16MB several times over, so the cleaner has to free space
+    (
+        for pass in $(seq 1 4); do
+            for i in 1 2 3 4; do
+                dd if=/dev/urandom of="$MOUNT_POINT/churn$i.bin" bs=1M count=4 \
+                    conv=notrunc,fsync 2>/dev/null || exit 0
+            done
+        done
+    ) &
+    CHURN_PID=$!
+    sleep 3
+    crash_fs
+    wait $CHURN_PID 2>/dev/null || true
+
+    "$BUILD_DIR/fsck.lsfs" "$CRASH_IMAGE" > /dev/null 2>&1 || CRASH_OK=0
+done
+mount_fs "$CRASH_IMAGE"
+cmp -s "$TEST_DIR/crash.ref" "$MOUNT_POINT/crash.bin" || CRASH_OK=0
+unmount_fs
+if [ $CRASH_OK -eq 1 ]; then
+    pass "Survived repeated crashes with checkpoints and cleaning under way"
+else
+    fail "Data lost or image inconsistent after crashes during cleaning"
+fi
+check_fs "$CRASH_IMAGE" "repeated crashes"
+rm -f "$CRASH_IMAGE"
+
+# Test 28: Runtime statistics
+info "Test 28: user.lsfs.stats extended attribute"
+mount_fs "$DISK_IMAGE"
+dd if=/dev/urandom of="$MOUNT_POINT/stats.bin" bs=64k count=16 conv=fsync 2>/dev/null
+cat "$MOUNT_POINT/stats.bin" > /dev/null
+
+if "$BUILD_DIR/lsfs-debug" "$MOUNT_POINT" stats > "$TEST_DIR/stats.out" 2>&1 &&
+   grep -q "=== STATISTICS ===" "$TEST_DIR/stats.out" &&
+   grep -q "^Group commit:" "$TEST_DIR/stats.out"; then
+    pass "lsfs-debug printed statistics of the mount"
+else
+    fail "lsfs-debug could not read statistics of the mount"
+fi
+
+if command -v getfattr > /dev/null; then
+    getfattr --only-values -n user.lsfs.stats "$MOUNT_POINT" > "$TEST_DIR/stats.raw" 2>/dev/null || true
+    STATS_WRITTEN=$(awk '$1 == "user_write_bytes" { print $2 }' "$TEST_DIR/stats.raw")
+    if [ "${STATS_WRITTEN:-0}" -ge 1048576 ] &&
+       grep -q "^latency write " "$TEST_DIR/stats.raw" &&
+       grep -q "^latency fsync " "$TEST_DIR/stats.raw"; then
+        pass "Stats attribute counts the bytes written and operation latencies"
+    else
+        fail "Stats attribute is missing counters"
+    fi
+else
+    info "getfattr not installed, raw attribute not checked"
+fi
+rm "$MOUNT_POINT/stats.bin"
+unmount_fs
+
+# Test 29: Preallocation
+info "Test 29: fallocate promises log space"
+mount_fs "$DISK_IMAGE"
+PRE="$MOUNT_POINT/prealloc.bin"
+head -c 8388608 /dev/urandom > "$TEST_DIR/prealloc.ref"
+
+if fallocate -l 8M "$PRE" && [ "$(stat -c%s "$PRE")" = "8388608" ] &&
+   fallocate -n -o 8M -l 8M "$PRE" && [ "$(stat -c%s "$PRE")" = "8388608" ]; then
+    pass "Preallocated with and without keeping the size"
+else
+    fail "fallocate failed"
+fi
+if ! fallocate -p -o 0 -l 4096 "$PRE" 2>/dev/null &&
+   ! fallocate -l 1G "$MOUNT_POINT/huge.bin" 2>/dev/null; then
+    pass "Punching holes and preallocating past free space fail"
+else
+    fail "Unsupported or oversized fallocate succeeded"
+fi
+rm -f "$MOUNT_POINT/huge.bin"
+
+dd if="$TEST_DIR/prealloc.ref" of="$PRE" bs=1M conv=notrunc,fsync 2>/dev/null
+if cmp -s "$TEST_DIR/prealloc.ref" "$PRE"; then
+    pass "Wrote the preallocated range"
+else
+    fail "Data mismatch in the preallocated range"
+fi
+rm "$PRE"
+unmount_fs
+check_fs "$DISK_IMAGE" "preallocation"
+
+# Test 30: Discard
+info "Test 30: Discarding cleaned segments"
+DISCARD_IMAGE="$TEST_DIR/discard.img"
+if fallocate -p -o 0 -l 4096 "$TEST_DIR/prealloc.ref" 2>/dev/null; then
+    # With -N the image keeps every block written; otherwise the segments
+    # the cleaner empties have their blocks punched out of it
+    for DISCARD_OPTS in "" "-N"; do
+        rm -f "$DISCARD_IMAGE"
+        "$BUILD_DIR/mkfs.lsfs" -s 64 "$DISCARD_IMAGE" > /dev/null 2>&1
+        mount_fs "$DISCARD_IMAGE" -k 1 $DISCARD_OPTS
+        # Idle cleaning stops once half the segments are free, so fill
+        # most of the image before emptying it
+        for i in $(seq 1 10); do
+            dd if=/dev/urandom of="$MOUNT_POINT/discard$i.bin" bs=1M count=4 \
+                conv=fsync 2>/dev/null
+        done
+        sleep 2
+        DISCARD_PEAK=$(stat -c%b "$DISCARD_IMAGE")
+        rm "$MOUNT_POINT"/discard*.bin
+
+        # 16 MB in 512-byte units
+        DISCARD_SHRUNK=0
+        for wait in $(seq 1 20); do
+            if [ $(($(stat -c%b "$DISCARD_IMAGE") + 32768)) -lt "$DISCARD_PEAK" ]; then
+                DISCARD_SHRUNK=1
+                break
+            fi
+            sleep 1
+        done
+        unmount_fs
+
+        if [ -z "$DISCARD_OPTS" ] && [ $DISCARD_SHRUNK -eq 1 ]; then
+            pass "Cleaned segments were discarded from the image"
+        elif [ -n "$DISCARD_OPTS" ] && [ $DISCARD_SHRUNK -eq 0 ]; then
+            pass "Nothing was discarded with $DISCARD_OPTS"
+        else
+            fail "Discard ${DISCARD_OPTS:-enabled} did not behave as expected"
+        fi
+        check_fs "$DISCARD_IMAGE" "discard ${DISCARD_OPTS:-enabled}"
+    done
+    rm -f "$DISCARD_IMAGE"
+else
+    info "$TEST_DIR cannot punch holes, discard not checked"
+fi
+
 echo ""
 echo "========================================"
 echo "Test Results"
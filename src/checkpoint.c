@@ -11,33 +11,53 @@
 
 #include "lsfs.h"
 
-#define CHECKPOINT_INTERVAL     100     /* Write checkpoint every N segment writes */
-#define CHECKPOINT_TIME_SEC     30      /* Or every N seconds */
+#define CHECKPOINT_POLL_SEC     1       /* Thread wakes this often to check the clock */
 
 /*
  * Initialize checkpoint system
+ * Mount options left at 0 take the defaults.
  */
 int lsfs_checkpoint_init(struct lsfs_context *ctx)
 {
     ctx->checkpoint_seq = 0;
     ctx->last_checkpoint = (uint64_t)time(NULL);
     ctx->writes_since_checkpoint = 0;
+    ctx->checkpoint_running = false;
+    ctx->checkpoint_requested = false;
+
+    if (ctx->checkpoint_secs == 0) {
+        ctx->checkpoint_secs = LSFS_CHECKPOINT_DEFAULT_SECS;
+    }
+    if (ctx->checkpoint_blocks == 0) {
+        ctx->checkpoint_blocks = LSFS_CHECKPOINT_DEFAULT_BLOCKS;
+    }
+
+    if (pthread_mutex_init(&ctx->checkpoint_lock, NULL) != 0) {
+        return LSFS_ERR_NOMEM;
+    }
+
+    if (pthread_cond_init(&ctx->checkpoint_cond, NULL) != 0) {
+        pthread_mutex_destroy(&ctx->checkpoint_lock);
+        return LSFS_ERR_NOMEM;
+    }
 
     return LSFS_OK;
 }
 
 /*
  * Check if a checkpoint is needed
+ * Caller must hold segbuf.lock.
  */
 bool lsfs_checkpoint_needed(struct lsfs_context *ctx)
 {
     uint64_t now = (uint64_t)time(NULL);
 
-    if (ctx->writes_since_checkpoint >= CHECKPOINT_INTERVAL) {
+    if (ctx->writes_since_checkpoint >= ctx->checkpoint_blocks) {
         return true;
     }
 
-    if (now - ctx->last_checkpoint >= CHECKPOINT_TIME_SEC) {
+    if (ctx->writes_since_checkpoint > 0 &&
+        now - ctx->last_checkpoint >= ctx->checkpoint_secs) {
         return true;
     }
 
@@ -45,139 +65,466 @@ bool lsfs_checkpoint_needed(struct lsfs_context *ctx)
 }
 
 /*
- * Write a checkpoint
+ * Ask the checkpoint thread for a checkpoint
+ * Only sets a flag and signals, so it is safe to call with segbuf.lock
+ * held.  Does nothing useful before lsfs_checkpoint_start().
  */
-int lsfs_checkpoint_write(struct lsfs_context *ctx)
+void lsfs_checkpoint_kick(struct lsfs_context *ctx)
 {
-    struct lsfs_checkpoint_header header;
-    uint64_t checkpoint_block;
-    uint8_t *buf;
-    int ret;
+    pthread_mutex_lock(&ctx->checkpoint_lock);
+    ctx->checkpoint_requested = true;
+    pthread_cond_signal(&ctx->checkpoint_cond);
+    pthread_mutex_unlock(&ctx->checkpoint_lock);
+}
 
-    pthread_mutex_lock(&ctx->write_lock);
+/*
+ * Background checkpoint thread function
+ * Runs a checkpoint when a writer asks for one, and checks the clock
+ * every CHECKPOINT_POLL_SEC so a quiet filesystem still gets its periodic
+ * checkpoint.  Dirty inodes are written back before the clock check since
+ * they are not counted as appended until then.
+ */
+static void *checkpoint_thread_func(void *arg)
+{
+    struct lsfs_context *ctx = (struct lsfs_context *)arg;
 
-    /* Flush any pending segment data */
-    if (ctx->segbuf.block_count > 1) {
-        pthread_mutex_unlock(&ctx->write_lock);
-        ret = lsfs_segment_flush(ctx);
+    LSFS_INFO("Checkpoint thread started");
+
+    while (1) {
+        bool running, requested, stale, due;
+
+        pthread_mutex_lock(&ctx->checkpoint_lock);
+
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += CHECKPOINT_POLL_SEC;
+
+        if (ctx->checkpoint_running && !ctx->checkpoint_requested) {
+            pthread_cond_timedwait(&ctx->checkpoint_cond, &ctx->checkpoint_lock, &ts);
+        }
+        running = ctx->checkpoint_running;
+        requested = ctx->checkpoint_requested;
+        ctx->checkpoint_requested = false;
+
+        pthread_mutex_unlock(&ctx->checkpoint_lock);
+
+        if (!running) {
+            break;
+        }
+
+        pthread_mutex_lock(&ctx->segbuf.lock);
+        stale = (uint64_t)time(NULL) - ctx->last_checkpoint >= ctx->checkpoint_secs;
+        pthread_mutex_unlock(&ctx->segbuf.lock);
+
+        if (!requested && stale) {
+            lsfs_inode_sync_all(ctx, false);
+        }
+
+        pthread_mutex_lock(&ctx->segbuf.lock);
+        due = requested || lsfs_checkpoint_needed(ctx);
+        pthread_mutex_unlock(&ctx->segbuf.lock);
+
+        if (due) {
+            lsfs_checkpoint_write(ctx);
+        }
+    }
+
+    LSFS_INFO("Checkpoint thread stopped");
+    return NULL;
+}
+
+/*
+ * Start the background checkpoint thread
+ */
+int lsfs_checkpoint_start(struct lsfs_context *ctx)
+{
+    ctx->checkpoint_running = true;
+
+    if (pthread_create(&ctx->checkpoint_thread, NULL, checkpoint_thread_func, ctx) != 0) {
+        ctx->checkpoint_running = false;
+        return LSFS_ERR_NOMEM;
+    }
+
+    return LSFS_OK;
+}
+
+/*
+ * Stop the background checkpoint thread
+ * A checkpoint in progress is finished first.
+ */
+void lsfs_checkpoint_stop(struct lsfs_context *ctx)
+{
+    if (!ctx->checkpoint_running) {
+        return;  /* Never started */
+    }
+
+    pthread_mutex_lock(&ctx->checkpoint_lock);
+    ctx->checkpoint_running = false;
+    pthread_cond_signal(&ctx->checkpoint_cond);
+    pthread_mutex_unlock(&ctx->checkpoint_lock);
+
+    pthread_join(ctx->checkpoint_thread, NULL);
+}
+
+/*
+ * Write the blocks of a table copy to the table starting at start
+ * Copies of consecutive table blocks go out as one write.
+ */
+static int checkpoint_write_copy(struct lsfs_context *ctx, uint64_t start,
+                                 const struct lsfs_table_copy *copy)
+{
+    uint32_t i = 0;
+
+    while (i < copy->count) {
+        uint32_t run = 1;
+        while (i + run < copy->count && copy->blocks[i + run] == copy->blocks[i] + run) {
+            run++;
+        }
+
+        int ret = lsfs_write_blocks(ctx, start + copy->blocks[i], run,
+                                    copy->data + (size_t)i * LSFS_BLOCK_SIZE);
         if (ret != LSFS_OK) {
             return ret;
         }
-        pthread_mutex_lock(&ctx->write_lock);
+        i += run;
     }
 
-    /* Determine which checkpoint region to use */
-    uint32_t cp_region = ctx->sb.active_checkpoint ^ 1;  /* Alternate */
-    checkpoint_block = (cp_region == 0) ? LSFS_CHECKPOINT0_START : LSFS_CHECKPOINT1_START;
+    return LSFS_OK;
+}
 
-    ctx->checkpoint_seq++;
+/*
+ * Free a table copy
+ */
+static void checkpoint_copy_free(struct lsfs_table_copy *copy)
+{
+    free(copy->data);
+    free(copy->blocks);
+    memset(copy, 0, sizeof(*copy));
+}
 
-    /* Prepare checkpoint header */
-    memset(&header, 0, sizeof(header));
-    header.magic = LSFS_CHECKPOINT_MAGIC;
-    header.version = LSFS_VERSION;
-    header.sequence = ctx->checkpoint_seq;
-    header.timestamp = (uint64_t)time(NULL);
-    header.log_head = ctx->sb.log_head;
-    header.imap_entries = ctx->imap.count;
-    header.segment_entries = ctx->segtable.count;
-    header.checksum = 0;  /* TODO: Calculate CRC32 */
-    header.complete = 0;  /* Will set to 1 when done */
+/*
+ * Copy the segment table blocks stale in a region's copy
+ * Caller must hold table->lock.
+ */
+static int checkpoint_copy_segtable(struct lsfs_segment_table *table, uint32_t region,
+                                    struct lsfs_table_copy *copy)
+{
+    uint64_t *dirty = table->dirty[region];
+    size_t table_size = (size_t)table->count * sizeof(struct lsfs_segment_usage);
+    uint32_t words = LSFS_DIV_ROUND_UP(table->table_blocks, 64);
+    uint32_t changed = 0;
 
-    /* Allocate buffer for checkpoint data */
-    buf = calloc(1, LSFS_BLOCK_SIZE);
-    if (!buf) {
-        pthread_mutex_unlock(&ctx->write_lock);
+    memset(copy, 0, sizeof(*copy));
+    for (uint32_t w = 0; w < words; w++) {
+        changed += (uint32_t)__builtin_popcountll(dirty[w]);
+    }
+    if (changed == 0) {
+        return LSFS_OK;
+    }
+
+    copy->data = calloc(changed, LSFS_BLOCK_SIZE);
+    copy->blocks = malloc(changed * sizeof(uint32_t));
+    if (!copy->data || !copy->blocks) {
+        checkpoint_copy_free(copy);
         return LSFS_ERR_NOMEM;
     }
 
+    for (uint32_t w = 0; w < words; w++) {
+        uint64_t bits = dirty[w];
+
+        while (bits) {
+            uint32_t i = w * 64 + (uint32_t)__builtin_ctzll(bits);
+            size_t off = (size_t)i * LSFS_BLOCK_SIZE;
+
+            bits &= bits - 1;
+            memcpy(copy->data + (size_t)copy->count * LSFS_BLOCK_SIZE,
+                   (const uint8_t *)table->entries + off,
+                   LSFS_MIN(LSFS_BLOCK_SIZE, table_size - off));
+            copy->blocks[copy->count++] = i;
+        }
+        dirty[w] = 0;
+    }
+
+    return LSFS_OK;
+}
+
+/*
+ * Record where roll-forward from this checkpoint starts
+ * Notes the last segment write and how much of each open segment has
+ * been written.  Caller must hold segbuf.lock.
+ */
+static void checkpoint_note_cut(struct lsfs_context *ctx, struct lsfs_checkpoint_header *header)
+{
+    struct lsfs_segment_buffer *segbuf = &ctx->segbuf;
+
+    header->segment_seq = segbuf->seal_seq;
+    for (uint32_t i = 0; i < LSFS_STREAM_COUNT; i++) {
+        const struct lsfs_segment_stream *stream = &segbuf->streams[i];
+
+        if (stream->segment_id != LSFS_SEGMENT_NONE) {
+            header->open_segment[i] = stream->segment_id;
+            header->open_blocks[i] = stream->flushed;
+        }
+    }
+}
+
+/*
+ * Let the cleaner free segments again once the tables are copied
+ * Caller must hold segbuf.lock.
+ */
+static void checkpoint_cut_done(struct lsfs_context *ctx)
+{
+    ctx->segbuf.cutting = false;
+    pthread_cond_broadcast(&ctx->segbuf.landed);
+}
+
+/*
+ * Write a checkpoint region and the structures copied for it
+ */
+static int checkpoint_write_region(struct lsfs_context *ctx,
+                                   struct lsfs_checkpoint_header *header,
+                                   uint32_t region,
+                                   const struct lsfs_table_copy *imap_copy,
+                                   const struct lsfs_table_copy *seg_copy)
+{
+    uint64_t checkpoint_block = ctx->sb.checkpoint_region[region];
+    uint8_t buf[LSFS_BLOCK_SIZE];
+    int ret;
+
     /* Write header */
-    memcpy(buf, &header, sizeof(header));
+    header->checksum = lsfs_checkpoint_checksum(header);
+    memset(buf, 0, sizeof(buf));
+    memcpy(buf, header, sizeof(*header));
     ret = lsfs_write_block(ctx, checkpoint_block, buf);
     if (ret != LSFS_OK) {
-        free(buf);
-        pthread_mutex_unlock(&ctx->write_lock);
         return ret;
     }
 
-    /* Write inode map */
-    ret = lsfs_imap_save(ctx, checkpoint_block + 1);
+    /* Write the chunk table blocks this region holds stale copies of */
+    ret = checkpoint_write_copy(ctx, checkpoint_block + 1, imap_copy);
     if (ret != LSFS_OK) {
-        free(buf);
-        pthread_mutex_unlock(&ctx->write_lock);
         return ret;
     }
 
-    /* Write segment usage table */
-    size_t seg_table_size = ctx->segtable.count * sizeof(struct lsfs_segment_usage);
-    uint32_t seg_blocks = LSFS_DIV_ROUND_UP(seg_table_size, LSFS_BLOCK_SIZE);
-    uint64_t seg_start = LSFS_SEGTABLE_START;
-
-    uint8_t *seg_buf = calloc(seg_blocks, LSFS_BLOCK_SIZE);
-    if (seg_buf) {
-        memcpy(seg_buf, ctx->segtable.entries, seg_table_size);
-        lsfs_write_blocks(ctx, seg_start, seg_blocks, seg_buf);
-        free(seg_buf);
+    /* And the blocks of its segment usage table */
+    ret = checkpoint_write_copy(ctx, lsfs_sb_segtable_block(&ctx->sb, region), seg_copy);
+    if (ret != LSFS_OK) {
+        return ret;
     }
 
-    /* Sync to disk */
+    /* Sync to disk; until the header is complete, the previous checkpoint
+     * and its copies of both tables stay current */
     ret = lsfs_sync(ctx);
     if (ret != LSFS_OK) {
-        free(buf);
-        pthread_mutex_unlock(&ctx->write_lock);
         return ret;
     }
 
     /* Mark checkpoint as complete */
-    header.complete = 1;
-    memcpy(buf, &header, sizeof(header));
-    ret = lsfs_write_block(ctx, checkpoint_block, buf);
-    free(buf);
+    header->complete = 1;
+    header->checksum = lsfs_checkpoint_checksum(header);
+    memcpy(buf, header, sizeof(*header));
+    return lsfs_write_block(ctx, checkpoint_block, buf);
+}
+
+/*
+ * Write a checkpoint
+ *
+ * Checkpoints are incremental: inode map chunks changed since the last
+ * one are appended to the log, and only the blocks of the chunk table and
+ * the segment table that changed are rewritten, so the cost follows what
+ * was modified rather than the size of the filesystem.  Each region keeps
+ * its own copy of both tables, so a crash while one is written leaves the
+ * other region's inode map and segment table intact and paired, and a
+ * changed table block is written to both in turn.  The header and
+ * superblock are written in full.
+ *
+ * segbuf.lock is held just long enough to append the chunks, seal the
+ * segment buffer and copy the tables.  The segments sealed up to then are
+ * waited for with the lock dropped, so appends continue into the next
+ * segment, and the checkpoint names the end of the last of them as its
+ * log_head.  Everything written after the inode map was copied is found
+ * by roll-forward, which starts at the cut noted just before.  write_lock
+ * only serializes checkpoints.  Dirty inodes are written back first so the
+ * inode map points at their current versions.
+ *
+ * Segments the cleaner freed before the cut are reused once the
+ * checkpoint is on disk: their live blocks were moved before it, so
+ * neither the inode map copied here nor roll-forward needs them.  The
+ * cleaner frees no segment between the cut and the copy of the table,
+ * even while the checkpoint waits with segbuf.lock dropped.  Blocks dropped by inode versions in the
+ * inode map at the cut are marked dead there, so the table copied never
+ * drops a block that map still points at.
+ */
+int lsfs_checkpoint_write(struct lsfs_context *ctx)
+{
+    struct lsfs_segment_table *table = &ctx->segtable;
+    struct lsfs_checkpoint_header header;
+    struct lsfs_superblock sb;
+    struct lsfs_table_copy imap_copy;
+    struct lsfs_table_copy seg_copy;
+    uint64_t log_head = 0;
+    uint32_t imap_entries = 0;
+    uint32_t reusable;
+    uint32_t writes;
+    uint64_t start = lsfs_stats_now();
+    bool short_of_space;
+    int ret;
+
+    /* Write back every dirty inode, waiting for the busy ones, so the
+     * inode map saved below names their current versions.  While space is
+     * short, a writer may hold its inode lock until this checkpoint hands
+     * cleaned segments back or lets the cleaner see blocks dropped since
+     * the last one, so busy inodes are left for the next checkpoint then. */
+    pthread_mutex_lock(&table->lock);
+    short_of_space = table->released_count > 0 ||
+                     lsfs_segment_free_total(table) <=
+                     LSFS_GC_RESERVE_SEGMENTS + lsfs_segment_prealloc_count(table);
+    pthread_mutex_unlock(&table->lock);
+    lsfs_inode_sync_all(ctx, !short_of_space);
 
+    memset(&header, 0, sizeof(header));
+
+    pthread_mutex_lock(&ctx->write_lock);
+
+    /* Checkpoints alternate between the regions */
+    uint32_t cp_region = ctx->sb.active_checkpoint ^ 1;
+
+    pthread_mutex_lock(&ctx->segbuf.lock);
+
+    checkpoint_note_cut(ctx, &header);
+    ctx->segbuf.cutting = true;
+    pthread_mutex_lock(&table->lock);
+    lsfs_gc_apply_dead(ctx);
+    reusable = table->released_count;
+    pthread_mutex_unlock(&table->lock);
+
+    /* Append changed inode map chunks, then flush them with pending data.
+     * The last free segment is only spent on a checkpoint that gives
+     * cleaned segments back, or it could never be replaced. */
+    ctx->segbuf.checkpointing = reusable > 0;
+    ret = lsfs_imap_save_locked(ctx, cp_region, &imap_copy, &imap_entries);
+    ctx->segbuf.checkpointing = false;
+    writes = ctx->writes_since_checkpoint;
+    if (ret == LSFS_OK) {
+        ret = lsfs_segment_flush_head_locked(ctx, &log_head);
+        if (ret != LSFS_OK) {
+            lsfs_imap_table_redirty(&ctx->imap, cp_region, &imap_copy);
+            checkpoint_copy_free(&imap_copy);
+        }
+    }
     if (ret != LSFS_OK) {
+        checkpoint_cut_done(ctx);
+        pthread_mutex_unlock(&ctx->segbuf.lock);
         pthread_mutex_unlock(&ctx->write_lock);
         return ret;
     }
 
+    /* Copy the changed segment table blocks */
+    pthread_mutex_lock(&table->lock);
+    ret = checkpoint_copy_segtable(table, cp_region, &seg_copy);
+    sb = ctx->sb;
+    pthread_mutex_unlock(&table->lock);
+    checkpoint_cut_done(ctx);
+
+    if (ret != LSFS_OK) {
+        pthread_mutex_unlock(&ctx->segbuf.lock);
+        lsfs_imap_table_redirty(&ctx->imap, cp_region, &imap_copy);
+        checkpoint_copy_free(&imap_copy);
+        pthread_mutex_unlock(&ctx->write_lock);
+        return ret;
+    }
+
+    /* Appends made while waiting count towards the next checkpoint */
+    ctx->last_checkpoint = (uint64_t)time(NULL);
+    ctx->writes_since_checkpoint -= writes;
+
+    pthread_mutex_unlock(&ctx->segbuf.lock);
+
+    ctx->checkpoint_seq++;
+
+    /* Prepare checkpoint header */
+    header.magic = LSFS_CHECKPOINT_MAGIC;
+    header.version = LSFS_VERSION;
+    header.sequence = ctx->checkpoint_seq;
+    header.timestamp = ctx->last_checkpoint;
+    header.log_head = log_head;
+    header.imap_entries = imap_entries;
+    header.imap_chunks = ctx->imap.chunk_count;
+    header.segment_entries = table->count;
+    header.complete = 0;  /* Will set to 1 when done */
+
+    ret = checkpoint_write_region(ctx, &header, cp_region, &imap_copy, &seg_copy);
+
+    if (ret != LSFS_OK) {
+        /* The next checkpoints write these blocks again */
+        lsfs_imap_table_redirty(&ctx->imap, cp_region, &imap_copy);
+        pthread_mutex_lock(&table->lock);
+        for (uint32_t i = 0; i < seg_copy.count; i++) {
+            table->dirty[cp_region][seg_copy.blocks[i] / 64] |= 1ULL << (seg_copy.blocks[i] % 64);
+        }
+        pthread_mutex_unlock(&table->lock);
+        checkpoint_copy_free(&imap_copy);
+        checkpoint_copy_free(&seg_copy);
+        pthread_mutex_unlock(&ctx->write_lock);
+        return ret;
+    }
+    checkpoint_copy_free(&imap_copy);
+    checkpoint_copy_free(&seg_copy);
+
     /* Update superblock */
     ctx->sb.active_checkpoint = cp_region;
-    ret = lsfs_write_block(ctx, LSFS_SUPERBLOCK_BLOCK, &ctx->sb);
+    sb.active_checkpoint = cp_region;
+    sb.log_head = log_head;
+    ret = lsfs_write_block(ctx, LSFS_SUPERBLOCK_BLOCK, &sb);
     if (ret != LSFS_OK) {
         pthread_mutex_unlock(&ctx->write_lock);
         return ret;
     }
 
     /* Final sync */
-    lsfs_sync(ctx);
-
-    ctx->last_checkpoint = header.timestamp;
-    ctx->writes_since_checkpoint = 0;
+    if (lsfs_sync(ctx) == LSFS_OK) {
+        lsfs_segment_reuse(ctx, reusable);
+    }
 
     pthread_mutex_unlock(&ctx->write_lock);
+    lsfs_stats_time(ctx, LSFS_LAT_CHECKPOINT, start);
 
     LSFS_INFO("Checkpoint %lu written to region %u",
-              (unsigned long)ctx->checkpoint_seq, cp_region);
+              (unsigned long)header.sequence, cp_region);
 
     return LSFS_OK;
 }
 
 /*
- * Load checkpoint from disk
+ * Get a monotonic time in milliseconds
  */
-int lsfs_checkpoint_load(struct lsfs_context *ctx)
+static uint64_t checkpoint_clock_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+/*
+ * Find the newest complete checkpoint and make it current
+ * The header is copied to header; the inode map is not loaded.  The
+ * segment table is read from the copy of the region chosen here, so this
+ * comes before lsfs_segment_init().
+ */
+int lsfs_checkpoint_select(struct lsfs_context *ctx, struct lsfs_checkpoint_header *best_header)
 {
     struct lsfs_checkpoint_header header[2];
-    uint64_t cp_blocks[2] = { LSFS_CHECKPOINT0_START, LSFS_CHECKPOINT1_START };
+    uint64_t cp_blocks[2] = { ctx->sb.checkpoint_region[0], ctx->sb.checkpoint_region[1] };
+    uint8_t block[LSFS_BLOCK_SIZE];
     int valid[2] = { 0, 0 };
     int best = -1;
 
     /* Read both checkpoint headers */
     for (int i = 0; i < 2; i++) {
-        if (lsfs_read_block(ctx, cp_blocks[i], &header[i]) == LSFS_OK) {
-            if (header[i].magic == LSFS_CHECKPOINT_MAGIC &&
-                header[i].complete == 1) {
-                valid[i] = 1;
-            }
+        if (lsfs_read_block(ctx, cp_blocks[i], block) == LSFS_OK) {
+            memcpy(&header[i], block, sizeof(header[i]));
+            valid[i] = lsfs_checkpoint_valid(&header[i]);
         }
     }
 
@@ -196,104 +543,604 @@ int lsfs_checkpoint_load(struct lsfs_context *ctx)
     LSFS_INFO("Loading checkpoint from region %d (seq %lu)",
               best, (unsigned long)header[best].sequence);
 
-    /* Load inode map */
-    int ret = lsfs_imap_load(ctx, cp_blocks[best] + 1, header[best].imap_entries);
-    if (ret != LSFS_OK) {
-        return ret;
-    }
-
     /* Update context */
     ctx->checkpoint_seq = header[best].sequence;
     ctx->last_checkpoint = header[best].timestamp;
     ctx->sb.log_head = header[best].log_head;
     ctx->sb.active_checkpoint = best;
+    *best_header = header[best];
 
     return LSFS_OK;
 }
 
 /*
- * Recover from crash by replaying log
+ * Load checkpoint from disk
  */
-int lsfs_checkpoint_recover(struct lsfs_context *ctx)
+int lsfs_checkpoint_load(struct lsfs_context *ctx)
 {
+    struct lsfs_checkpoint_header header;
     int ret;
 
-    /* Load last valid checkpoint */
-    ret = lsfs_checkpoint_load(ctx);
+    ret = lsfs_checkpoint_select(ctx, &header);
     if (ret != LSFS_OK) {
         return ret;
     }
 
-    /* Roll forward through any segments written after checkpoint */
-    uint64_t log_head = ctx->sb.log_head;
-    uint32_t segment_id, offset;
-    lsfs_block_to_segment(log_head, &segment_id, &offset);
+    /* Load inode map */
+    return lsfs_imap_load(ctx, ctx->sb.checkpoint_region[ctx->sb.active_checkpoint] + 1,
+                          header.imap_chunks);
+}
 
-    LSFS_INFO("Rolling forward from block %" PRIu64 " (segment %u, offset %u)",
-              log_head, segment_id, offset);
+/*
+ * Crash recovery
+ *
+ * Segments written after a checkpoint can only be ones it saw free, ones
+ * allocated while it was being taken, or the segments then open for
+ * appends, past what had been written of them.  The headers of both
+ * summary copies are read in batches, several at a time on the read queue
+ * while the inode map loads, and only segments whose write sequence is
+ * past the checkpoint's have their whole summaries read.  A segment whose
+ * latest summary is torn is replayed as far as the copy before it goes.  They are then replayed in sequence
+ * order, the next few read ahead of the one replayed; inode blocks all go
+ * to the metadata stream, whose segments seal in order, so later inode
+ * versions win.  The first segment that cannot be read or that does not
+ * match its checksums ends the log.
+ */
+#define RECOVER_SCAN_BATCH      64      /* Segments whose headers one batch reads */
+#define RECOVER_SCAN_DEPTH      8       /* Batches of headers in flight */
+#define RECOVER_REPLAY_DEPTH    4       /* Segments read ahead of the one replayed */
 
-    /* Scan segments after checkpoint */
-    for (uint32_t seg = segment_id; seg < ctx->sb.total_segments; seg++) {
-        uint64_t seg_start = lsfs_segment_to_block(seg, 0);
-        struct lsfs_segment_header seg_header;
+/*
+ * A segment that may hold writes made after the checkpoint
+ */
+struct recover_segment {
+    uint32_t segment_id;
+    uint32_t first;                 /* First block written after the checkpoint */
+    uint64_t sequence;              /* From its header, 0 once ruled out */
+    struct lsfs_segment_summary *summary;
+    struct lsfs_read_job job;       /* Replay read */
+    struct lsfs_io_req *reqs;
+    uint8_t *data;                  /* Blocks first on */
+};
 
-        ret = lsfs_read_block(ctx, seg_start, &seg_header);
-        if (ret != LSFS_OK) {
+/*
+ * One batch of headers or summaries being read, two reads per segment:
+ * the start of the segment and its last blocks
+ */
+struct recover_batch {
+    struct lsfs_read_job job;
+    struct lsfs_io_req reqs[2 * RECOVER_SCAN_BATCH];
+    uint32_t start;                 /* First segment in the list */
+    uint8_t *data;
+};
+
+/*
+ * Reading both summary copies of each listed segment, RECOVER_SCAN_DEPTH
+ * batches at a time
+ */
+struct recover_scan {
+    struct recover_segment *segs;
+    uint32_t count;
+    uint32_t blocks;                /* Read per summary copy */
+    uint32_t next;                  /* Next segment to queue */
+    uint32_t done;                  /* Batches finished */
+    struct recover_batch batch[RECOVER_SCAN_DEPTH];
+};
+
+/*
+ * Queue a read of the next batch of segments into a batch slot
+ */
+static void recover_scan_queue(struct lsfs_context *ctx, struct recover_scan *scan,
+                               struct recover_batch *batch)
+{
+    batch->start = scan->next;
+    batch->job.reqs = batch->reqs;
+    batch->job.count = 0;
+
+    while (scan->next < scan->count && batch->job.count < 2 * RECOVER_SCAN_BATCH) {
+        uint32_t segment_id = scan->segs[scan->next].segment_id;
+
+        for (uint32_t copy = 0; copy < 2; copy++) {
+            struct lsfs_io_req *req = &batch->reqs[batch->job.count];
+
+            req->block = lsfs_segment_to_block(ctx, segment_id, copy == 0 ? 0 :
+                                               LSFS_SUMMARY_TAIL(ctx->segtable.segment_blocks));
+            req->count = scan->blocks;
+            req->buf = batch->data + (size_t)batch->job.count * scan->blocks * LSFS_BLOCK_SIZE;
+            req->result = LSFS_ERR_IO;  /* Until the read says otherwise */
+            batch->job.count++;
+        }
+        scan->next++;
+    }
+
+    if (batch->job.count > 0) {
+        lsfs_read_async(ctx, &batch->job);
+    }
+}
+
+/*
+ * Allocate the batch buffers and queue the first batches
+ */
+static int recover_scan_begin(struct lsfs_context *ctx, struct recover_scan *scan,
+                              struct recover_segment *segs, uint32_t count, uint32_t blocks)
+{
+    memset(scan, 0, sizeof(*scan));
+    scan->segs = segs;
+    scan->count = count;
+    scan->blocks = blocks;
+
+    for (uint32_t b = 0; b < RECOVER_SCAN_DEPTH; b++) {
+        scan->batch[b].data = lsfs_io_alloc((size_t)2 * RECOVER_SCAN_BATCH * blocks *
+                                            LSFS_BLOCK_SIZE);
+        if (!scan->batch[b].data) {
+            for (uint32_t i = 0; i < b; i++) {
+                free(scan->batch[i].data);
+            }
+            return LSFS_ERR_NOMEM;
+        }
+    }
+
+    for (uint32_t b = 0; b < RECOVER_SCAN_DEPTH; b++) {
+        recover_scan_queue(ctx, scan, &scan->batch[b]);
+    }
+    return LSFS_OK;
+}
+
+/*
+ * Check one segment's header against the checkpoint
+ * Segments last written before it, or not since the checkpoint noted how
+ * far they were written, are ruled out.  Returns the segment's sequence
+ * number, or 0 if it is ruled out.
+ */
+static uint64_t recover_check_header(const struct lsfs_context *ctx,
+                                     const struct lsfs_checkpoint_header *cp,
+                                     const struct recover_segment *seg, const void *data)
+{
+    const struct lsfs_segment_header *header = data;
+
+    if (header->magic != LSFS_SEGMENT_MAGIC || header->segment_id != seg->segment_id ||
+        header->block_count <= seg->first ||
+        header->block_count > ctx->segtable.segment_blocks ||
+        header->sequence <= cp->segment_seq) {
+        return 0;
+    }
+    return header->sequence;
+}
+
+/*
+ * Wait for every queued batch and handle each segment read
+ * With header reads, segments are kept if either copy was written after
+ * the checkpoint, and max_seq is raised to the newest sequence number
+ * seen.  With summary reads, the current copy is kept if it is still past
+ * the checkpoint.  Segments that could not be read are ruled out.
+ */
+static int recover_scan_finish(struct lsfs_context *ctx, struct recover_scan *scan,
+                               const struct lsfs_checkpoint_header *cp, uint64_t *max_seq)
+{
+    int ret = LSFS_OK;
+
+    while (1) {
+        struct recover_batch *batch = &scan->batch[scan->done % RECOVER_SCAN_DEPTH];
+
+        if (batch->job.count == 0) {
             break;
         }
+        lsfs_read_wait(ctx, &batch->job);
+
+        for (uint32_t r = 0; r < batch->job.count / 2; r++) {
+            struct recover_segment *seg = &scan->segs[batch->start + r];
+            const struct lsfs_io_req *head = &batch->reqs[2 * r];
+            const struct lsfs_io_req *tail = &batch->reqs[2 * r + 1];
+            const void *head_data = head->result == LSFS_OK ? head->buf : NULL;
+            const void *tail_data = tail->result == LSFS_OK ? tail->buf : NULL;
+
+            if (!head_data && !tail_data) {
+                LSFS_ERROR("Failed to read the summary of segment %u", seg->segment_id);
+                seg->sequence = 0;
+            } else if (scan->blocks < LSFS_SUMMARY_BLOCKS) {
+                uint64_t head_seq = head_data ? recover_check_header(ctx, cp, seg, head_data) : 0;
+                uint64_t tail_seq = tail_data ? recover_check_header(ctx, cp, seg, tail_data) : 0;
 
-        /* Check if this is a valid segment */
-        if (seg_header.magic != LSFS_SEGMENT_MAGIC) {
-            break;  /* End of log */
+                seg->sequence = LSFS_MAX(head_seq, tail_seq);
+                if (seg->sequence > *max_seq) {
+                    *max_seq = seg->sequence;
+                }
+            } else if (ret == LSFS_OK) {
+                const struct lsfs_segment_summary *summary =
+                    lsfs_segment_current_summary(ctx, head_data, tail_data, seg->segment_id);
+
+                if (!summary || recover_check_header(ctx, cp, seg, summary) == 0) {
+                    LSFS_ERROR("Summary of segment %u is torn, ignoring it", seg->segment_id);
+                    seg->sequence = 0;
+                    continue;
+                }
+                if (summary->header.sequence != seg->sequence) {
+                    LSFS_ERROR("Latest summary of segment %u is torn, replaying the "
+                               "copy before it", seg->segment_id);
+                    seg->sequence = summary->header.sequence;
+                }
+                seg->summary = malloc(LSFS_SUMMARY_BLOCKS * LSFS_BLOCK_SIZE);
+                if (!seg->summary) {
+                    ret = LSFS_ERR_NOMEM;
+                    continue;
+                }
+                memcpy(seg->summary, summary, LSFS_SUMMARY_BLOCKS * LSFS_BLOCK_SIZE);
+            }
         }
 
-        /* Verify timestamp is after checkpoint */
-        if (seg_header.timestamp < ctx->last_checkpoint) {
-            break;  /* Old segment, stop */
+        scan->done++;
+        recover_scan_queue(ctx, scan, batch);
+    }
+
+    for (uint32_t b = 0; b < RECOVER_SCAN_DEPTH; b++) {
+        free(scan->batch[b].data);
+    }
+    return ret;
+}
+
+/*
+ * Drop the segments ruled out from the list
+ */
+static uint32_t recover_compact(struct recover_segment *segs, uint32_t count)
+{
+    uint32_t kept = 0;
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (segs[i].sequence != 0) {
+            segs[kept++] = segs[i];
         }
+    }
+    return kept;
+}
 
-        LSFS_DEBUG("Recovering segment %u (%u blocks)",
-                   seg, seg_header.block_count);
+/*
+ * Order segments by sequence number
+ */
+static int recover_compare(const void *a, const void *b)
+{
+    const struct recover_segment *sa = a;
+    const struct recover_segment *sb = b;
 
-        /* Read segment summary and update inode map */
-        uint8_t summary_block[LSFS_BLOCK_SIZE];
-        ret = lsfs_read_block(ctx, seg_start, summary_block);
-        if (ret != LSFS_OK) {
-            break;
+    return (sa->sequence > sb->sequence) - (sa->sequence < sb->sequence);
+}
+
+/*
+ * List the segments that may hold writes made after the checkpoint
+ */
+static uint32_t recover_candidates(struct lsfs_context *ctx,
+                                   const struct lsfs_checkpoint_header *cp,
+                                   struct recover_segment *segs)
+{
+    struct lsfs_segment_table *table = &ctx->segtable;
+    uint32_t count = 0;
+
+    for (uint32_t seg = 0; seg < table->count; seg++) {
+        const struct lsfs_segment_usage *entry = &table->entries[seg];
+        uint32_t first = LSFS_SUMMARY_BLOCKS;
+        bool candidate = entry->state == LSFS_SEG_FREE || entry->sequence > cp->segment_seq;
+
+        for (uint32_t i = 0; i < LSFS_CHECKPOINT_STREAMS; i++) {
+            if (cp->open_blocks[i] > 0 && cp->open_segment[i] == seg) {
+                first = cp->open_blocks[i];
+                candidate = true;
+            }
+        }
+
+        if (candidate) {
+            memset(&segs[count], 0, sizeof(segs[count]));
+            segs[count].segment_id = seg;
+            segs[count].first = first;
+            count++;
+        }
+    }
+    return count;
+}
+
+/*
+ * Start reading the blocks of a segment that replay needs
+ * When reads are verified that is every block written after the
+ * checkpoint, otherwise just the runs of inode blocks among them.
+ */
+static int recover_replay_start(struct lsfs_context *ctx, struct recover_segment *seg)
+{
+    const struct lsfs_segment_summary *summary = seg->summary;
+    uint64_t seg_start = lsfs_segment_to_block(ctx, seg->segment_id, 0);
+    uint32_t count = summary->header.block_count - seg->first;
+
+    seg->job.reqs = NULL;
+    seg->job.count = 0;
+    seg->data = lsfs_io_alloc((size_t)count * LSFS_BLOCK_SIZE);
+    seg->reqs = malloc(count * sizeof(*seg->reqs));
+    if (!seg->data || !seg->reqs) {
+        free(seg->data);
+        free(seg->reqs);
+        seg->data = NULL;
+        seg->reqs = NULL;
+        return LSFS_ERR_NOMEM;
+    }
+    seg->job.reqs = seg->reqs;
+
+    for (uint32_t i = 0; i < count; i++) {
+        const struct lsfs_block_info *info =
+            &summary->blocks[seg->first + i - LSFS_SUMMARY_BLOCKS];
+        struct lsfs_io_req *last = seg->job.count > 0 ? &seg->reqs[seg->job.count - 1] : NULL;
+
+        if (ctx->verify_mode == LSFS_VERIFY_NONE && info->type != LSFS_BLOCK_TYPE_INODE) {
+            continue;
         }
+        if (last && last->block + last->count == seg_start + seg->first + i) {
+            last->count++;
+            continue;
+        }
+        last = &seg->reqs[seg->job.count++];
+        last->block = seg_start + seg->first + i;
+        last->count = 1;
+        last->buf = seg->data + (size_t)i * LSFS_BLOCK_SIZE;
+    }
 
-        struct lsfs_segment_summary *summary = (struct lsfs_segment_summary *)summary_block;
-        uint32_t max_entries = (LSFS_BLOCK_SIZE - sizeof(struct lsfs_segment_header)) /
-                               sizeof(struct lsfs_block_info);
-        uint32_t num_entries = seg_header.block_count - 1;
-        if (num_entries > max_entries) {
-            num_entries = max_entries;
+    if (seg->job.count > 0) {
+        lsfs_read_async(ctx, &seg->job);
+    }
+    return LSFS_OK;
+}
+
+/*
+ * Wait for a segment's replay read and free its buffers
+ */
+static int recover_replay_wait(struct lsfs_context *ctx, struct recover_segment *seg)
+{
+    int ret = LSFS_OK;
+
+    if (seg->job.count > 0) {
+        ret = lsfs_read_wait(ctx, &seg->job);
+    }
+    return ret;
+}
+
+/*
+ * Free the buffers of a segment's replay read
+ */
+static void recover_replay_free(struct recover_segment *seg)
+{
+    free(seg->data);
+    free(seg->reqs);
+    seg->data = NULL;
+    seg->reqs = NULL;
+    seg->job.count = 0;
+}
+
+/*
+ * Apply a segment read for replay to the inode map and segment table
+ * Returns LSFS_ERR_CORRUPT if a block does not match its checksum.
+ */
+static int recover_replay_apply(struct lsfs_context *ctx, const struct recover_segment *seg)
+{
+    const struct lsfs_segment_summary *summary = seg->summary;
+    uint64_t seg_start = lsfs_segment_to_block(ctx, seg->segment_id, 0);
+    uint32_t block_count = summary->header.block_count;
+
+    if (ctx->verify_mode != LSFS_VERIFY_NONE) {
+        for (uint32_t i = seg->first; i < block_count; i++) {
+            if (lsfs_segment_check_block(summary, i, seg->data +
+                                         (size_t)(i - seg->first) * LSFS_BLOCK_SIZE) != LSFS_OK) {
+                LSFS_ERROR("Segment %u block %u does not match its checksum, "
+                           "stopping recovery there", seg->segment_id, i);
+                return LSFS_ERR_CORRUPT;
+            }
         }
+    }
+
+    LSFS_DEBUG("Recovering segment %u (blocks %u-%u, seq %" PRIu64 ")",
+               seg->segment_id, seg->first, block_count, seg->sequence);
 
-        for (uint32_t i = 0; i < num_entries; i++) {
-            struct lsfs_block_info *info = &summary->blocks[i];
-            if (info->type == LSFS_BLOCK_TYPE_INODE && info->ino > 0) {
-                uint64_t block_addr = seg_start + i + 1;
-                lsfs_imap_set(&ctx->imap, info->ino, block_addr);
+    /* Later slots hold later writes, so scan them in order */
+    for (uint32_t i = seg->first; i < block_count; i++) {
+        const struct lsfs_block_info *info = &summary->blocks[i - LSFS_SUMMARY_BLOCKS];
+        const uint8_t *inode_block = seg->data + (size_t)(i - seg->first) * LSFS_BLOCK_SIZE;
+
+        if (info->type != LSFS_BLOCK_TYPE_INODE || info->ino == 0) {
+            continue;
+        }
+        for (uint32_t slot = 0; slot < LSFS_INODES_PER_BLOCK; slot++) {
+            const struct lsfs_inode *disk_inode = (const struct lsfs_inode *)
+                (inode_block + slot * sizeof(struct lsfs_inode));
+            if (disk_inode->ino > 0) {
+                lsfs_imap_set(&ctx->imap, disk_inode->ino,
+                              LSFS_INODE_LOC(seg_start + i, slot));
             }
         }
+    }
+
+    /* Update log head */
+    ctx->sb.log_head = seg_start + block_count;
+
+    /* Update segment table; every new block counts as live until the
+     * cleaner finds otherwise.  What was written of a segment open at the
+     * checkpoint is accounted for already.  Blocks the replayed inode
+     * versions dropped stay live as well: which ones they were is only
+     * known in memory, and the cleaner checks every live block against
+     * its owner before leaving it behind, so they just wait for it. */
+    struct lsfs_segment_table *table = &ctx->segtable;
+    struct lsfs_segment_usage *entry = &table->entries[seg->segment_id];
+    pthread_mutex_lock(&table->lock);
+    if (seg->first == LSFS_SUMMARY_BLOCKS) {
+        entry->dead_slots = 0;
+        entry->packed_blocks = 0;
+        entry->packed_slots = 0;
+        entry->dead_packed = 0;
+        memset(entry->live_map, 0, sizeof(entry->live_map));
+    }
+    entry->state = LSFS_SEG_FULL;
+    entry->segment_id = seg->segment_id;
+    entry->timestamp = summary->header.timestamp;
+    entry->sequence = seg->sequence;
+    for (uint32_t i = seg->first; i < block_count; i++) {
+        entry->live_map[i / 64] |= 1ULL << (i % 64);
+    }
+    entry->live_blocks = 0;
+    for (uint32_t w = 0; w < LSFS_SEGMENT_BLOCKS / 64; w++) {
+        entry->live_blocks += (uint32_t)__builtin_popcountll(entry->live_map[w]);
+    }
+    lsfs_segment_mark_used(table, seg->segment_id);
+    lsfs_segment_dirty(table, seg->segment_id);
+    ctx->sb.free_segments = lsfs_segment_free_total(table);
+    pthread_mutex_unlock(&table->lock);
 
-        /* Update log head */
-        ctx->sb.log_head = seg_start + seg_header.block_count;
+    return LSFS_OK;
+}
 
-        /* Update segment table */
-        pthread_mutex_lock(&ctx->segtable.lock);
-        ctx->segtable.entries[seg].state = LSFS_SEG_FULL;
-        ctx->segtable.entries[seg].live_blocks = seg_header.block_count - 1;
-        ctx->segtable.entries[seg].timestamp = seg_header.timestamp;
-        if (ctx->segtable.free_count > 0) {
-            ctx->segtable.free_count--;
+/*
+ * Replay the segments in sequence order, reading ahead of the one replayed
+ * Returns the number of segments replayed.
+ */
+static uint32_t recover_replay(struct lsfs_context *ctx, struct recover_segment *segs,
+                               uint32_t count)
+{
+    uint32_t started = 0;
+    uint32_t replayed = 0;
+    bool stop = false;
+
+    for (uint32_t i = 0; i < count; i++) {
+        while (!stop && started < count && started < i + RECOVER_REPLAY_DEPTH) {
+            if (recover_replay_start(ctx, &segs[started]) != LSFS_OK) {
+                LSFS_ERROR("Out of memory replaying segment %u, stopping recovery there",
+                           segs[started].segment_id);
+                count = started;
+                break;
+            }
+            started++;
         }
-        pthread_mutex_unlock(&ctx->segtable.lock);
+        if (i >= started) {
+            break;
+        }
+
+        int ret = recover_replay_wait(ctx, &segs[i]);
+        if (!stop && ret != LSFS_OK) {
+            LSFS_ERROR("Failed to read segment %u, stopping recovery there",
+                       segs[i].segment_id);
+            stop = true;
+        }
+        if (!stop && recover_replay_apply(ctx, &segs[i]) != LSFS_OK) {
+            stop = true;
+        }
+        if (!stop) {
+            replayed++;
+        }
+        recover_replay_free(&segs[i]);
     }
 
-    LSFS_INFO("Recovery complete, log head at %" PRIu64, ctx->sb.log_head);
+    return replayed;
+}
+
+/*
+ * Free the recovery list
+ */
+static void recover_free(struct recover_segment *segs, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; i++) {
+        free(segs[i].summary);
+    }
+    free(segs);
+}
+
+/*
+ * Load the selected checkpoint and roll forward from it
+ */
+static int recover_log(struct lsfs_context *ctx, const struct lsfs_checkpoint_header *header,
+                       uint64_t start)
+{
+    struct recover_scan scan;
+    struct recover_segment *segs;
+    uint64_t max_seq;
+    uint64_t t_imap, t_scan, t_replay;
+    uint32_t candidates, count, replayed;
+    int ret;
+
+    max_seq = header->segment_seq;
+
+    segs = malloc(LSFS_MAX(ctx->segtable.count, 1) * sizeof(*segs));
+    if (!segs) {
+        return LSFS_ERR_NOMEM;
+    }
+    candidates = recover_candidates(ctx, header, segs);
+
+    LSFS_INFO("Rolling forward past segment write %" PRIu64 ", checking %u segments",
+              header->segment_seq, candidates);
+
+    /* Read segment headers while the inode map loads */
+    ret = recover_scan_begin(ctx, &scan, segs, candidates, 1);
+    if (ret != LSFS_OK) {
+        free(segs);
+        return ret;
+    }
+    ret = lsfs_imap_load(ctx, ctx->sb.checkpoint_region[ctx->sb.active_checkpoint] + 1,
+                         header->imap_chunks);
+    t_imap = checkpoint_clock_ms();
+    recover_scan_finish(ctx, &scan, header, &max_seq);
+    count = recover_compact(segs, candidates);
+    if (ret != LSFS_OK) {
+        free(segs);
+        return ret;
+    }
+
+    /* Then the whole summaries of the segments written since */
+    ret = recover_scan_begin(ctx, &scan, segs, count, LSFS_SUMMARY_BLOCKS);
+    if (ret == LSFS_OK) {
+        ret = recover_scan_finish(ctx, &scan, header, &max_seq);
+    }
+    if (ret != LSFS_OK) {
+        recover_free(segs, count);
+        return ret;
+    }
+    uint32_t found = recover_compact(segs, count);
+    t_scan = checkpoint_clock_ms();
+
+    /* Replay in the order they were written */
+    qsort(segs, found, sizeof(*segs), recover_compare);
+    replayed = recover_replay(ctx, segs, found);
+    t_replay = checkpoint_clock_ms();
+
+    /* Sequence numbers seen may belong to segments not replayed; new
+     * writes must still come after them */
+    ctx->segbuf.seal_seq = max_seq;
+
+    recover_free(segs, found);
+
+    LSFS_INFO("Recovery replayed %u of %u segments written since the checkpoint, "
+              "log head at %" PRIu64, replayed, found, ctx->sb.log_head);
+    LSFS_INFO("Recovery took %" PRIu64 " ms: inode map %" PRIu64 " ms alongside %u "
+              "segment summaries in %" PRIu64 " ms, replay %" PRIu64 " ms",
+              t_replay - start, t_imap - start, candidates, t_scan - start,
+              t_replay - t_scan);
+
+    return LSFS_OK;
+}
+
+/*
+ * Recover from crash by replaying log
+ * header is the checkpoint lsfs_checkpoint_select() chose.  The read
+ * threads run for the duration if they are not running yet.
+ */
+int lsfs_checkpoint_recover(struct lsfs_context *ctx,
+                            const struct lsfs_checkpoint_header *header)
+{
+    uint64_t start = checkpoint_clock_ms();
+    bool own_threads = ctx->prefetch.thread_count == 0 &&
+                       lsfs_prefetch_start(ctx) == LSFS_OK;
+    int ret;
+
+    ret = recover_log(ctx, header, start);
+    if (own_threads) {
+        lsfs_prefetch_stop(ctx);
+    }
+    if (ret != LSFS_OK) {
+        return ret;
+    }
 
     /* Write a fresh checkpoint */
-    return lsfs_checkpoint_write(ctx);
+    uint64_t t_write = checkpoint_clock_ms();
+    ret = lsfs_checkpoint_write(ctx);
+    LSFS_INFO("Recovery checkpoint written in %" PRIu64 " ms",
+              checkpoint_clock_ms() - t_write);
+    return ret;
 }
@@ -0,0 +1,280 @@
+/*
+ * LSFS - Log-Structured Filesystem
+ * Data Block Compression
+ *
+ * File blocks are compressed one at a time with the codec chosen at mount
+ * and packed into shared log blocks by segment.c.  Codecs are optional at
+ * build time; a packed block written with a codec this build lacks cannot
+ * be read back, so that is reported as an I/O error rather than guessed at.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "lsfs.h"
+
+#ifdef LSFS_HAVE_LZ4
+#include <lz4.h>
+#include <lz4hc.h>
+#endif
+
+#ifdef LSFS_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#ifdef LSFS_HAVE_ZSTD
+/*
+ * zstd contexts are costly to set up for every 4 KiB block, so each
+ * thread keeps one of each, released when the thread exits
+ */
+static pthread_once_t zstd_once = PTHREAD_ONCE_INIT;
+static pthread_key_t zstd_cctx_key;
+static pthread_key_t zstd_dctx_key;
+
+/*
+ * Free a thread's compression context
+ */
+static void zstd_cctx_free(void *cctx)
+{
+    ZSTD_freeCCtx(cctx);
+}
+
+/*
+ * Free a thread's decompression context
+ */
+static void zstd_dctx_free(void *dctx)
+{
+    ZSTD_freeDCtx(dctx);
+}
+
+/*
+ * Create the thread-local context keys
+ */
+static void zstd_keys_init(void)
+{
+    pthread_key_create(&zstd_cctx_key, zstd_cctx_free);
+    pthread_key_create(&zstd_dctx_key, zstd_dctx_free);
+}
+
+/*
+ * Get the calling thread's compression context
+ */
+static ZSTD_CCtx *zstd_cctx(void)
+{
+    pthread_once(&zstd_once, zstd_keys_init);
+
+    ZSTD_CCtx *cctx = pthread_getspecific(zstd_cctx_key);
+    if (!cctx) {
+        cctx = ZSTD_createCCtx();
+        if (cctx) {
+            pthread_setspecific(zstd_cctx_key, cctx);
+        }
+    }
+    return cctx;
+}
+
+/*
+ * Get the calling thread's decompression context
+ */
+static ZSTD_DCtx *zstd_dctx(void)
+{
+    pthread_once(&zstd_once, zstd_keys_init);
+
+    ZSTD_DCtx *dctx = pthread_getspecific(zstd_dctx_key);
+    if (!dctx) {
+        dctx = ZSTD_createDCtx();
+        if (dctx) {
+            pthread_setspecific(zstd_dctx_key, dctx);
+        }
+    }
+    return dctx;
+}
+#endif
+
+/*
+ * Check whether this build supports a codec
+ */
+bool lsfs_codec_available(uint32_t codec)
+{
+    switch (codec) {
+    case LSFS_CODEC_NONE:
+        return true;
+#ifdef LSFS_HAVE_LZ4
+    case LSFS_CODEC_LZ4:
+        return true;
+#endif
+#ifdef LSFS_HAVE_ZSTD
+    case LSFS_CODEC_ZSTD:
+        return true;
+#endif
+    default:
+        return false;
+    }
+}
+
+/*
+ * Get the name of a codec
+ */
+const char *lsfs_codec_name(uint32_t codec)
+{
+    switch (codec) {
+    case LSFS_CODEC_NONE: return "none";
+    case LSFS_CODEC_LZ4: return "lz4";
+    case LSFS_CODEC_ZSTD: return "zstd";
+    default: return "unknown";
+    }
+}
+
+/*
+ * Parse a codec specification: none, lz4, zstd, or either with :level
+ * Returns LSFS_ERR_INVAL for an unknown codec or level and
+ * LSFS_ERR_NOENT for a codec this build does not support.
+ */
+int lsfs_codec_parse(const char *spec, uint32_t *codec, int *level)
+{
+    const char *colon = strchr(spec, ':');
+    size_t name_len = colon ? (size_t)(colon - spec) : strlen(spec);
+    uint32_t c;
+    int l = 0;
+
+    if (name_len == 4 && strncmp(spec, "none", 4) == 0) {
+        c = LSFS_CODEC_NONE;
+    } else if (name_len == 3 && strncmp(spec, "lz4", 3) == 0) {
+        c = LSFS_CODEC_LZ4;
+    } else if (name_len == 4 && strncmp(spec, "zstd", 4) == 0) {
+        c = LSFS_CODEC_ZSTD;
+    } else {
+        return LSFS_ERR_INVAL;
+    }
+
+    if (colon) {
+        char *end;
+        long v = strtol(colon + 1, &end, 10);
+        if (c == LSFS_CODEC_NONE || *end != '\0' || end == colon + 1 || v < 1 || v > 22) {
+            return LSFS_ERR_INVAL;
+        }
+        l = (int)v;
+    }
+
+    if (!lsfs_codec_available(c)) {
+        return LSFS_ERR_NOENT;
+    }
+
+    *codec = c;
+    *level = l;
+    return LSFS_OK;
+}
+
+/*
+ * Compress one file block into dst
+ * Level 0 picks the codec's default: LZ4's fast mode, or zstd level 3;
+ * LZ4 levels select its high-compression mode.  Returns the compressed
+ * length, or 0 if the block does not compress to max_len bytes or less.
+ */
+uint32_t lsfs_compress_block(uint32_t codec, int level, const void *src, void *dst,
+                             uint32_t max_len)
+{
+    (void)src;
+    (void)dst;
+    (void)level;
+    (void)max_len;
+
+    switch (codec) {
+#ifdef LSFS_HAVE_LZ4
+    case LSFS_CODEC_LZ4: {
+        int n = level > 0 ? LZ4_compress_HC(src, dst, LSFS_BLOCK_SIZE, (int)max_len, level)
+                          : LZ4_compress_default(src, dst, LSFS_BLOCK_SIZE, (int)max_len);
+        return n > 0 ? (uint32_t)n : 0;
+    }
+#endif
+#ifdef LSFS_HAVE_ZSTD
+    case LSFS_CODEC_ZSTD: {
+        ZSTD_CCtx *cctx = zstd_cctx();
+        if (!cctx) {
+            return 0;
+        }
+        size_t n = ZSTD_compressCCtx(cctx, dst, max_len, src, LSFS_BLOCK_SIZE,
+                                     level > 0 ? level : ZSTD_CLEVEL_DEFAULT);
+        return ZSTD_isError(n) ? 0 : (uint32_t)n;
+    }
+#endif
+    default:
+        return 0;
+    }
+}
+
+/*
+ * Decompress len bytes of src into a full block at dst
+ * Returns the decompressed length, or 0 if the data does not decompress.
+ */
+static size_t codec_decompress(uint32_t codec, const void *src, uint32_t len, void *dst)
+{
+    (void)src;
+    (void)len;
+    (void)dst;
+
+    switch (codec) {
+#ifdef LSFS_HAVE_LZ4
+    case LSFS_CODEC_LZ4: {
+        int n = LZ4_decompress_safe(src, dst, (int)len, LSFS_BLOCK_SIZE);
+        return n > 0 ? (size_t)n : 0;
+    }
+#endif
+#ifdef LSFS_HAVE_ZSTD
+    case LSFS_CODEC_ZSTD: {
+        ZSTD_DCtx *dctx = zstd_dctx();
+        if (!dctx) {
+            return 0;
+        }
+        size_t n = ZSTD_decompressDCtx(dctx, dst, LSFS_BLOCK_SIZE, src, len);
+        return ZSTD_isError(n) ? 0 : n;
+    }
+#endif
+    default:
+        return 0;
+    }
+}
+
+/*
+ * Decompress slot of a packed block into a full block
+ * Returns LSFS_ERR_CORRUPT if the block or slot is malformed or does not
+ * decompress to exactly one block, and LSFS_ERR_IO if the codec is not
+ * in this build.
+ */
+int lsfs_packed_read(const void *packed, uint32_t slot, void *buf)
+{
+    const struct lsfs_packed_header *header = packed;
+
+    if (header->magic != LSFS_PACKED_MAGIC || slot >= header->count ||
+        header->count > LSFS_PACKED_SLOTS) {
+        LSFS_ERROR("Bad packed block (magic 0x%08x, %u slots, slot %u)",
+                   header->magic, header->count, slot);
+        return LSFS_ERR_CORRUPT;
+    }
+
+    const struct lsfs_packed_slot *s = &header->slots[slot];
+    uint32_t start = s->start;
+    uint32_t length = s->length;
+
+    if (start < LSFS_PACKED_DATA_START || length == 0 || start + length > LSFS_BLOCK_SIZE) {
+        LSFS_ERROR("Bad packed slot %u (%u bytes at %u)", slot, length, start);
+        return LSFS_ERR_CORRUPT;
+    }
+
+    if (!lsfs_codec_available(header->codec) || header->codec == LSFS_CODEC_NONE) {
+        LSFS_ERROR("Packed block uses codec %s, which this build lacks",
+                   lsfs_codec_name(header->codec));
+        return LSFS_ERR_IO;
+    }
+
+    if (codec_decompress(header->codec, (const uint8_t *)packed + start, length, buf) !=
+        LSFS_BLOCK_SIZE) {
+        LSFS_ERROR("Packed slot %u of inode %u does not decompress to a block",
+                   slot, s->ino);
+        return LSFS_ERR_CORRUPT;
+    }
+
+    return LSFS_OK;
+}
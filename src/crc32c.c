@@ -0,0 +1,316 @@
+/*
+ * LSFS - Log-Structured Filesystem
+ * CRC32C (Castagnoli) checksums
+ *
+ * Segment summaries record a checksum for every block, so blocks are
+ * checksummed a segment at a time.  The hardware paths interleave three
+ * blocks to hide the latency of the CRC instruction; the software
+ * fallback uses slicing-by-8 tables built on first use.
+ */
+
+#include <pthread.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "crc32c.h"
+#include "ondisk.h"
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#define CRC32C_HW_X86 1
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+#define CRC32C_HW_ARM 1
+#endif
+
+#define CRC32C_POLY 0x82F63B78U     /* Reflected Castagnoli polynomial */
+
+static uint32_t crc32c_table[8][256];
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static uint32_t (*crc32c_fn)(uint32_t crc, const void *data, size_t len);
+static void (*crc32c_blocks_fn)(const void *blocks, uint32_t count, uint32_t *crcs);
+static const char *crc32c_name;
+
+/*
+ * Load 8 bytes in little-endian order
+ */
+static inline uint64_t crc32c_load64(const uint8_t *p)
+{
+    uint64_t v;
+
+    memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+
+/*
+ * Checksum a buffer with slicing-by-8
+ */
+static uint32_t crc32c_slice8(uint32_t crc, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+
+    crc = ~crc;
+    while (len >= 8) {
+        uint64_t v = crc32c_load64(p) ^ crc;
+
+        crc = crc32c_table[7][v & 0xff] ^
+              crc32c_table[6][(v >> 8) & 0xff] ^
+              crc32c_table[5][(v >> 16) & 0xff] ^
+              crc32c_table[4][(v >> 24) & 0xff] ^
+              crc32c_table[3][(v >> 32) & 0xff] ^
+              crc32c_table[2][(v >> 40) & 0xff] ^
+              crc32c_table[1][(v >> 48) & 0xff] ^
+              crc32c_table[0][v >> 56];
+        p += 8;
+        len -= 8;
+    }
+    while (len--) {
+        crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+/*
+ * Checksum blocks one after another through crc32c_fn
+ */
+static void crc32c_blocks_serial(const void *blocks, uint32_t count, uint32_t *crcs)
+{
+    const uint8_t *p = blocks;
+
+    for (uint32_t i = 0; i < count; i++) {
+        crcs[i] = crc32c_fn(0, p + (size_t)i * LSFS_BLOCK_SIZE, LSFS_BLOCK_SIZE);
+    }
+}
+
+#if defined(CRC32C_HW_X86)
+/*
+ * Checksum a buffer with the SSE4.2 CRC32 instruction
+ */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    uint64_t c = ~crc;
+
+    while (len >= 8) {
+        c = _mm_crc32_u64(c, crc32c_load64(p));
+        p += 8;
+        len -= 8;
+    }
+    while (len--) {
+        c = _mm_crc32_u8((uint32_t)c, *p++);
+    }
+    return ~(uint32_t)c;
+}
+
+/*
+ * Checksum blocks three at a time with independent CRC32 chains
+ */
+__attribute__((target("sse4.2")))
+static void crc32c_blocks_sse42(const void *blocks, uint32_t count, uint32_t *crcs)
+{
+    const uint8_t *p = blocks;
+    uint32_t i = 0;
+
+    for (; i + 3 <= count; i += 3) {
+        const uint8_t *p0 = p + (size_t)i * LSFS_BLOCK_SIZE;
+        const uint8_t *p1 = p0 + LSFS_BLOCK_SIZE;
+        const uint8_t *p2 = p1 + LSFS_BLOCK_SIZE;
+        uint64_t c0 = 0xFFFFFFFFU, c1 = 0xFFFFFFFFU, c2 = 0xFFFFFFFFU;
+
+        for (size_t off = 0; off < LSFS_BLOCK_SIZE; off += 8) {
+            c0 = _mm_crc32_u64(c0, crc32c_load64(p0 + off));
+            c1 = _mm_crc32_u64(c1, crc32c_load64(p1 + off));
+            c2 = _mm_crc32_u64(c2, crc32c_load64(p2 + off));
+        }
+        crcs[i] = ~(uint32_t)c0;
+        crcs[i + 1] = ~(uint32_t)c1;
+        crcs[i + 2] = ~(uint32_t)c2;
+    }
+    for (; i < count; i++) {
+        crcs[i] = crc32c_sse42(0, p + (size_t)i * LSFS_BLOCK_SIZE, LSFS_BLOCK_SIZE);
+    }
+}
+#endif
+
+#if defined(CRC32C_HW_ARM)
+/*
+ * Checksum a buffer with the ARMv8 CRC32C instructions
+ */
+__attribute__((target("+crc")))
+static uint32_t crc32c_armv8(uint32_t crc, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+
+    crc = ~crc;
+    while (len >= 8) {
+        crc = __crc32cd(crc, crc32c_load64(p));
+        p += 8;
+        len -= 8;
+    }
+    while (len--) {
+        crc = __crc32cb(crc, *p++);
+    }
+    return ~crc;
+}
+
+/*
+ * Checksum blocks three at a time with independent CRC32C chains
+ */
+__attribute__((target("+crc")))
+static void crc32c_blocks_armv8(const void *blocks, uint32_t count, uint32_t *crcs)
+{
+    const uint8_t *p = blocks;
+    uint32_t i = 0;
+
+    for (; i + 3 <= count; i += 3) {
+        const uint8_t *p0 = p + (size_t)i * LSFS_BLOCK_SIZE;
+        const uint8_t *p1 = p0 + LSFS_BLOCK_SIZE;
+        const uint8_t *p2 = p1 + LSFS_BLOCK_SIZE;
+        uint32_t c0 = 0xFFFFFFFFU, c1 = 0xFFFFFFFFU, c2 = 0xFFFFFFFFU;
+
+        for (size_t off = 0; off < LSFS_BLOCK_SIZE; off += 8) {
+            c0 = __crc32cd(c0, crc32c_load64(p0 + off));
+            c1 = __crc32cd(c1, crc32c_load64(p1 + off));
+            c2 = __crc32cd(c2, crc32c_load64(p2 + off));
+        }
+        crcs[i] = ~c0;
+        crcs[i + 1] = ~c1;
+        crcs[i + 2] = ~c2;
+    }
+    for (; i < count; i++) {
+        crcs[i] = crc32c_armv8(0, p + (size_t)i * LSFS_BLOCK_SIZE, LSFS_BLOCK_SIZE);
+    }
+}
+#endif
+
+/*
+ * Build the slicing tables and pick the fastest implementation
+ */
+static void crc32c_init(void)
+{
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t crc = n;
+        for (int k = 0; k < 8; k++) {
+            crc = (crc >> 1) ^ (CRC32C_POLY & (0U - (crc & 1)));
+        }
+        crc32c_table[0][n] = crc;
+    }
+    for (uint32_t n = 0; n < 256; n++) {
+        for (int t = 1; t < 8; t++) {
+            uint32_t prev = crc32c_table[t - 1][n];
+            crc32c_table[t][n] = crc32c_table[0][prev & 0xff] ^ (prev >> 8);
+        }
+    }
+
+    crc32c_fn = crc32c_slice8;
+    crc32c_blocks_fn = crc32c_blocks_serial;
+    crc32c_name = "slicing-by-8";
+
+#if defined(CRC32C_HW_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) {
+        crc32c_fn = crc32c_sse42;
+        crc32c_blocks_fn = crc32c_blocks_sse42;
+        crc32c_name = "sse4.2";
+    }
+#elif defined(CRC32C_HW_ARM)
+    if (getauxval(AT_HWCAP) & HWCAP_CRC32) {
+        crc32c_fn = crc32c_armv8;
+        crc32c_blocks_fn = crc32c_blocks_armv8;
+        crc32c_name = "armv8-crc";
+    }
+#endif
+}
+
+/*
+ * Checksum a buffer
+ */
+uint32_t lsfs_crc32c(uint32_t crc, const void *data, size_t len)
+{
+    pthread_once(&crc32c_once, crc32c_init);
+    return crc32c_fn(crc, data, len);
+}
+
+/*
+ * Checksum a buffer one byte at a time
+ */
+uint32_t lsfs_crc32c_bytewise(uint32_t crc, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+
+    pthread_once(&crc32c_once, crc32c_init);
+    crc = ~crc;
+    while (len--) {
+        crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+/*
+ * Checksum a buffer without the CPU's CRC instructions
+ */
+uint32_t lsfs_crc32c_sw(uint32_t crc, const void *data, size_t len)
+{
+    pthread_once(&crc32c_once, crc32c_init);
+    return crc32c_slice8(crc, data, len);
+}
+
+/*
+ * Checksum count consecutive blocks, one checksum each
+ */
+void lsfs_crc32c_blocks(const void *blocks, uint32_t count, uint32_t *crcs)
+{
+    pthread_once(&crc32c_once, crc32c_init);
+    crc32c_blocks_fn(blocks, count, crcs);
+}
+
+/*
+ * Checksum a structure of len bytes whose checksum field at field_off is
+ * taken as zero
+ */
+static uint32_t crc32c_skip_field(const void *data, size_t len, size_t field_off)
+{
+    static const uint8_t zero[sizeof(uint32_t)];
+    const uint8_t *p = data;
+    uint32_t crc;
+
+    crc = lsfs_crc32c(0, p, field_off);
+    crc = lsfs_crc32c(crc, zero, sizeof(zero));
+    return lsfs_crc32c(crc, p + field_off + sizeof(zero), len - field_off - sizeof(zero));
+}
+
+/*
+ * Checksum the LSFS_SUMMARY_BLOCKS blocks of a segment summary
+ */
+uint32_t lsfs_summary_checksum(const struct lsfs_segment_summary *summary)
+{
+    return crc32c_skip_field(summary, (size_t)LSFS_SUMMARY_BLOCKS * LSFS_BLOCK_SIZE,
+                             offsetof(struct lsfs_segment_header, checksum));
+}
+
+/*
+ * Checksum a checkpoint header
+ */
+uint32_t lsfs_checkpoint_checksum(const struct lsfs_checkpoint_header *header)
+{
+    return crc32c_skip_field(header, sizeof(*header),
+                             offsetof(struct lsfs_checkpoint_header, checksum));
+}
+
+/*
+ * Get the name of the implementation in use
+ */
+const char *lsfs_crc32c_impl(void)
+{
+    pthread_once(&crc32c_once, crc32c_init);
+    return crc32c_name;
+}
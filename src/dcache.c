@@ -0,0 +1,298 @@
+/*
+ * LSFS - Log-Structured Filesystem
+ * Dentry Cache
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "lsfs.h"
+
+/*
+ * Hash a parent directory and name (FNV-1a)
+ */
+static uint32_t dentry_hash(uint32_t parent, const char *name, size_t name_len)
+{
+    uint32_t hash = 2166136261u ^ parent;
+
+    hash *= 16777619u;
+    for (size_t i = 0; i < name_len; i++) {
+        hash ^= (uint8_t)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static inline struct lsfs_dcache_shard *dentry_shard(struct lsfs_dcache *dcache,
+                                                     uint32_t hash)
+{
+    return &dcache->shards[hash % LSFS_DCACHE_SHARDS];
+}
+
+/*
+ * Unlink an entry from the LRU list
+ */
+static void dentry_lru_remove(struct lsfs_dcache_shard *shard, struct lsfs_dentry *de)
+{
+    if (de->lru_prev) {
+        de->lru_prev->lru_next = de->lru_next;
+    } else {
+        shard->lru_head = de->lru_next;
+    }
+
+    if (de->lru_next) {
+        de->lru_next->lru_prev = de->lru_prev;
+    } else {
+        shard->lru_tail = de->lru_prev;
+    }
+
+    de->lru_prev = NULL;
+    de->lru_next = NULL;
+}
+
+/*
+ * Add an entry at the newest end of the LRU list
+ */
+static void dentry_lru_push(struct lsfs_dcache_shard *shard, struct lsfs_dentry *de)
+{
+    de->lru_prev = shard->lru_tail;
+    de->lru_next = NULL;
+
+    if (shard->lru_tail) {
+        shard->lru_tail->lru_next = de;
+    } else {
+        shard->lru_head = de;
+    }
+    shard->lru_tail = de;
+}
+
+/*
+ * Find an entry in a shard
+ */
+static struct lsfs_dentry *dentry_find(struct lsfs_dcache_shard *shard, uint32_t hash,
+                                       uint32_t parent, const char *name, size_t name_len)
+{
+    struct lsfs_dentry *de = shard->hash[(hash / LSFS_DCACHE_SHARDS) & shard->hash_mask];
+
+    while (de && !(de->hash == hash && de->parent == parent && de->name_len == name_len &&
+                   memcmp(de->name, name, name_len) == 0)) {
+        de = de->hash_next;
+    }
+    return de;
+}
+
+/*
+ * Unlink an entry from its hash chain and LRU list and free it
+ */
+static void dentry_release(struct lsfs_dcache_shard *shard, struct lsfs_dentry *de)
+{
+    struct lsfs_dentry **pp = &shard->hash[(de->hash / LSFS_DCACHE_SHARDS) & shard->hash_mask];
+
+    while (*pp) {
+        if (*pp == de) {
+            *pp = de->hash_next;
+            break;
+        }
+        pp = &(*pp)->hash_next;
+    }
+
+    dentry_lru_remove(shard, de);
+    de->hash_next = shard->free;
+    shard->free = de;
+}
+
+/*
+ * Initialize the dentry cache with room for entries names
+ */
+int lsfs_dcache_init(struct lsfs_dcache *dcache, uint32_t entries)
+{
+    uint32_t per_shard = (entries + LSFS_DCACHE_SHARDS - 1) / LSFS_DCACHE_SHARDS;
+
+    memset(dcache, 0, sizeof(*dcache));
+
+    for (int i = 0; i < LSFS_DCACHE_SHARDS; i++) {
+        struct lsfs_dcache_shard *shard = &dcache->shards[i];
+
+        if (pthread_mutex_init(&shard->lock, NULL) != 0) {
+            lsfs_dcache_destroy(dcache);
+            return LSFS_ERR_NOMEM;
+        }
+
+        if (per_shard == 0) {
+            continue;  /* Cache disabled */
+        }
+
+        uint32_t buckets = 1;
+        while (buckets < per_shard) {
+            buckets <<= 1;
+        }
+
+        shard->capacity = per_shard;
+        shard->hash_mask = buckets - 1;
+        shard->hash = calloc(buckets, sizeof(*shard->hash));
+        shard->entries = calloc(per_shard, sizeof(*shard->entries));
+        if (!shard->hash || !shard->entries) {
+            lsfs_dcache_destroy(dcache);
+            return LSFS_ERR_NOMEM;
+        }
+
+        for (uint32_t j = 0; j < per_shard; j++) {
+            shard->entries[j].hash_next = shard->free;
+            shard->free = &shard->entries[j];
+        }
+
+        dcache->capacity += per_shard;
+    }
+
+    LSFS_INFO("Dentry cache: %" PRIu64 " entries in %d shards",
+              dcache->capacity, LSFS_DCACHE_SHARDS);
+
+    return LSFS_OK;
+}
+
+/*
+ * Destroy the dentry cache
+ */
+void lsfs_dcache_destroy(struct lsfs_dcache *dcache)
+{
+    for (int i = 0; i < LSFS_DCACHE_SHARDS; i++) {
+        struct lsfs_dcache_shard *shard = &dcache->shards[i];
+
+        free(shard->hash);
+        free(shard->entries);
+        shard->hash = NULL;
+        shard->entries = NULL;
+        shard->capacity = 0;
+        pthread_mutex_destroy(&shard->lock);
+    }
+    dcache->capacity = 0;
+}
+
+/*
+ * Look up a name
+ * Returns true if the cache knows the answer; *ino is then 0 if the name
+ * does not exist.
+ */
+bool lsfs_dcache_lookup(struct lsfs_dcache *dcache, uint32_t parent, const char *name,
+                        size_t name_len, uint32_t *ino, uint8_t *file_type)
+{
+    uint32_t hash = dentry_hash(parent, name, name_len);
+    struct lsfs_dcache_shard *shard = dentry_shard(dcache, hash);
+    struct lsfs_dentry *de;
+
+    if (shard->capacity == 0 || name_len > LSFS_DCACHE_NAME_MAX) {
+        return false;
+    }
+
+    pthread_mutex_lock(&shard->lock);
+
+    de = dentry_find(shard, hash, parent, name, name_len);
+    if (!de) {
+        shard->misses++;
+        pthread_mutex_unlock(&shard->lock);
+        return false;
+    }
+
+    *ino = de->ino;
+    if (file_type) {
+        *file_type = de->file_type;
+    }
+    if (de->ino) {
+        shard->hits++;
+    } else {
+        shard->negative_hits++;
+    }
+
+    dentry_lru_remove(shard, de);
+    dentry_lru_push(shard, de);
+
+    pthread_mutex_unlock(&shard->lock);
+    return true;
+}
+
+/*
+ * Record what a name maps to (ino 0 if it does not exist)
+ */
+void lsfs_dcache_set(struct lsfs_dcache *dcache, uint32_t parent, const char *name,
+                     size_t name_len, uint32_t ino, uint8_t file_type)
+{
+    uint32_t hash = dentry_hash(parent, name, name_len);
+    struct lsfs_dcache_shard *shard = dentry_shard(dcache, hash);
+    struct lsfs_dentry *de;
+
+    if (shard->capacity == 0 || name_len > LSFS_DCACHE_NAME_MAX) {
+        return;
+    }
+
+    pthread_mutex_lock(&shard->lock);
+
+    de = dentry_find(shard, hash, parent, name, name_len);
+    if (de) {
+        dentry_lru_remove(shard, de);
+    } else {
+        if (!shard->free) {
+            dentry_release(shard, shard->lru_head);
+        }
+        de = shard->free;
+        shard->free = de->hash_next;
+
+        uint32_t bucket = (hash / LSFS_DCACHE_SHARDS) & shard->hash_mask;
+        de->hash = hash;
+        de->parent = parent;
+        de->name_len = (uint8_t)name_len;
+        memcpy(de->name, name, name_len);
+        de->hash_next = shard->hash[bucket];
+        shard->hash[bucket] = de;
+    }
+
+    de->ino = ino;
+    de->file_type = file_type;
+    dentry_lru_push(shard, de);
+
+    pthread_mutex_unlock(&shard->lock);
+}
+
+/*
+ * Forget a name
+ */
+void lsfs_dcache_invalidate(struct lsfs_dcache *dcache, uint32_t parent,
+                            const char *name, size_t name_len)
+{
+    uint32_t hash = dentry_hash(parent, name, name_len);
+    struct lsfs_dcache_shard *shard = dentry_shard(dcache, hash);
+    struct lsfs_dentry *de;
+
+    if (shard->capacity == 0 || name_len > LSFS_DCACHE_NAME_MAX) {
+        return;
+    }
+
+    pthread_mutex_lock(&shard->lock);
+
+    de = dentry_find(shard, hash, parent, name, name_len);
+    if (de) {
+        dentry_release(shard, de);
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+}
+
+/*
+ * Collect dentry cache statistics
+ */
+void lsfs_dcache_stats(struct lsfs_dcache *dcache, struct lsfs_dcache_stats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    stats->capacity = dcache->capacity;
+
+    for (int i = 0; i < LSFS_DCACHE_SHARDS; i++) {
+        struct lsfs_dcache_shard *shard = &dcache->shards[i];
+
+        pthread_mutex_lock(&shard->lock);
+        stats->hits += shard->hits;
+        stats->negative_hits += shard->negative_hits;
+        stats->misses += shard->misses;
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
@@ -7,6 +7,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <inttypes.h>
 
 #include "lsfs.h"
 
@@ -37,127 +38,115 @@ static inline uint16_t dirent_size(uint8_t name_len)
 }
 
 /*
- * Lookup a name in a directory
+ * Hash a name for the directory index (FNV-1a with a final mix, so the
+ * low bits used for the table slot depend on every byte)
  */
-int lsfs_dir_lookup(struct lsfs_context *ctx, struct lsfs_inode_mem *dir,
-                    const char *name, uint32_t *ino, uint8_t *file_type)
+static uint32_t dir_hash(const char *name, size_t name_len)
 {
-    uint8_t block[LSFS_BLOCK_SIZE];
-    size_t name_len = strlen(name);
-    uint64_t offset = 0;
-    uint64_t dir_size = dir->disk_inode.size;
+    uint32_t hash = 2166136261u;
 
-    if (!(dir->disk_inode.mode & S_IFDIR)) {
-        return LSFS_ERR_NOTDIR;
+    for (size_t i = 0; i < name_len; i++) {
+        hash ^= (uint8_t)name[i];
+        hash *= 16777619u;
     }
 
-    if (name_len > LSFS_NAME_MAX) {
-        return LSFS_ERR_INVAL;
-    }
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35u;
+    hash ^= hash >> 16;
+    return hash;
+}
 
-    /* Iterate through directory blocks */
-    while (offset < dir_size) {
-        uint64_t block_idx = offset / LSFS_BLOCK_SIZE;
-        uint32_t block_offset = offset % LSFS_BLOCK_SIZE;
+/*
+ * Record a change to the directory
+ */
+static void dir_touch(struct lsfs_inode_mem *dir)
+{
+    dir->disk_inode.mtime = lsfs_get_time_ns();
+    dir->disk_inode.ctime = dir->disk_inode.mtime;
+    dir->dirty = true;
+}
 
-        if (block_offset == 0) {
-            if (lsfs_inode_read_block(ctx, dir, block_idx, block) != LSFS_OK) {
-                return LSFS_ERR_IO;
-            }
-        }
+/*
+ * Fill in a directory entry
+ */
+static void dirent_fill(struct lsfs_dirent *de, uint32_t ino, uint16_t rec_len,
+                        const char *name, uint8_t name_len, uint8_t file_type)
+{
+    de->ino = ino;
+    de->rec_len = rec_len;
+    de->name_len = name_len;
+    de->file_type = file_type;
+    memcpy(de->name, name, name_len);
+}
 
-        struct lsfs_dirent *de = (struct lsfs_dirent *)(block + block_offset);
+/*
+ * Find a name among the entries of one block, from byte start on
+ * prev receives the entry before the match, or NULL if it is the first.
+ */
+static struct lsfs_dirent *dirent_block_find(uint8_t *block, uint32_t start,
+                                             const char *name, size_t name_len,
+                                             struct lsfs_dirent **prev)
+{
+    struct lsfs_dirent *last = NULL;
+    uint32_t pos = start;
+
+    while (pos < LSFS_BLOCK_SIZE) {
+        struct lsfs_dirent *de = (struct lsfs_dirent *)(block + pos);
 
         /* Validate entry */
-        if (de->rec_len == 0 || de->rec_len > LSFS_BLOCK_SIZE - block_offset) {
+        if (de->rec_len == 0 || de->rec_len > LSFS_BLOCK_SIZE - pos) {
             break;  /* End of valid entries */
         }
 
-        /* Check if this entry matches */
         if (de->ino != 0 && de->name_len == name_len &&
             memcmp(de->name, name, name_len) == 0) {
-            *ino = de->ino;
-            if (file_type) {
-                *file_type = de->file_type;
+            if (prev) {
+                *prev = last;
             }
-            return LSFS_OK;
+            return de;
         }
 
-        offset += de->rec_len;
+        last = de;
+        pos += de->rec_len;
     }
 
-    return LSFS_ERR_NOENT;
+    return NULL;
 }
 
 /*
- * Add an entry to a directory
+ * Place a new entry in one block, from byte start on
+ * Returns false if the block has no room for it.
  */
-int lsfs_dir_add(struct lsfs_context *ctx, struct lsfs_inode_mem *dir,
-                 const char *name, uint32_t ino, uint8_t file_type)
+static bool dirent_block_insert(uint8_t *block, uint32_t start, const char *name,
+                                uint8_t name_len, uint32_t ino, uint8_t file_type)
 {
-    uint8_t block[LSFS_BLOCK_SIZE];
-    size_t name_len = strlen(name);
-    uint16_t needed_size = dirent_size((uint8_t)name_len);
-    uint64_t offset = 0;
-    uint64_t dir_size = dir->disk_inode.size;
+    uint16_t needed_size = dirent_size(name_len);
+    uint32_t pos = start;
 
-    if (!(dir->disk_inode.mode & S_IFDIR)) {
-        return LSFS_ERR_NOTDIR;
-    }
-
-    if (name_len > LSFS_NAME_MAX) {
-        return LSFS_ERR_INVAL;
-    }
-
-    /* Check if name already exists */
-    uint32_t existing_ino;
-    if (lsfs_dir_lookup(ctx, dir, name, &existing_ino, NULL) == LSFS_OK) {
-        return LSFS_ERR_EXIST;
-    }
-
-    /* Find space for new entry */
-    while (offset < dir_size) {
-        uint64_t block_idx = offset / LSFS_BLOCK_SIZE;
-        uint32_t block_offset = offset % LSFS_BLOCK_SIZE;
-
-        if (block_offset == 0) {
-            if (lsfs_inode_read_block(ctx, dir, block_idx, block) != LSFS_OK) {
-                return LSFS_ERR_IO;
-            }
-        }
-
-        struct lsfs_dirent *de = (struct lsfs_dirent *)(block + block_offset);
+    while (pos < LSFS_BLOCK_SIZE) {
+        struct lsfs_dirent *de = (struct lsfs_dirent *)(block + pos);
 
         if (de->rec_len == 0) {
             /* Empty slot, use rest of block */
-            uint16_t space = LSFS_BLOCK_SIZE - block_offset;
-            if (space >= needed_size) {
-                de->ino = ino;
-                de->rec_len = space;
-                de->name_len = (uint8_t)name_len;
-                de->file_type = file_type;
-                memcpy(de->name, name, name_len);
-
-                if (lsfs_inode_write_block(ctx, dir, block_idx, block) != LSFS_OK) {
-                    return LSFS_ERR_IO;
-                }
-
-                dir->disk_inode.mtime = lsfs_get_time_ns();
-                dir->disk_inode.ctime = dir->disk_inode.mtime;
-                dir->dirty = true;
-                return LSFS_OK;
+            uint16_t space = LSFS_BLOCK_SIZE - pos;
+            if (space < needed_size) {
+                return false;
             }
-            break;
+            dirent_fill(de, ino, space, name, name_len, file_type);
+            return true;
+        }
+
+        if (de->rec_len > LSFS_BLOCK_SIZE - pos) {
+            return false;
         }
 
         /* Check if deleted entry has enough space */
         if (de->ino == 0 && de->rec_len >= needed_size) {
             uint16_t remaining = de->rec_len - needed_size;
 
-            de->ino = ino;
-            de->name_len = (uint8_t)name_len;
-            de->file_type = file_type;
-            memcpy(de->name, name, name_len);
+            dirent_fill(de, ino, de->rec_len, name, name_len, file_type);
 
             if (remaining >= dirent_size(1)) {
                 /* Create new empty entry with remaining space */
@@ -168,15 +157,7 @@ int lsfs_dir_add(struct lsfs_context *ctx, struct lsfs_inode_mem *dir,
                 next->name_len = 0;
                 next->file_type = 0;
             }
-
-            if (lsfs_inode_write_block(ctx, dir, block_idx, block) != LSFS_OK) {
-                return LSFS_ERR_IO;
-            }
-
-            dir->disk_inode.mtime = lsfs_get_time_ns();
-            dir->disk_inode.ctime = dir->disk_inode.mtime;
-            dir->dirty = true;
-            return LSFS_OK;
+            return true;
         }
 
         /* Check if entry can be split */
@@ -188,166 +169,744 @@ int lsfs_dir_add(struct lsfs_context *ctx, struct lsfs_inode_mem *dir,
             de->rec_len = actual_size;
 
             struct lsfs_dirent *new_de = (struct lsfs_dirent *)((uint8_t *)de + actual_size);
-            new_de->ino = ino;
-            new_de->rec_len = free_space;
-            new_de->name_len = (uint8_t)name_len;
-            new_de->file_type = file_type;
-            memcpy(new_de->name, name, name_len);
+            dirent_fill(new_de, ino, free_space, name, name_len, file_type);
+            return true;
+        }
 
-            if (lsfs_inode_write_block(ctx, dir, block_idx, block) != LSFS_OK) {
-                return LSFS_ERR_IO;
-            }
+        pos += de->rec_len;
+    }
 
-            dir->disk_inode.mtime = lsfs_get_time_ns();
-            dir->disk_inode.ctime = dir->disk_inode.mtime;
-            dir->dirty = true;
-            return LSFS_OK;
-        }
+    return false;
+}
 
-        offset += de->rec_len;
+/*
+ * Remove the entry de from its block
+ * It is merged into the entry before it when there is one.
+ */
+static void dirent_block_remove(struct lsfs_dirent *de, struct lsfs_dirent *prev)
+{
+    if (prev) {
+        prev->rec_len += de->rec_len;
+    } else {
+        de->ino = 0;
     }
+}
+
+/*
+ * Initialize an empty hash bucket
+ */
+static void dir_bucket_init(uint8_t *block, uint16_t depth)
+{
+    struct lsfs_dir_bucket_header *hdr = (struct lsfs_dir_bucket_header *)block;
+    struct lsfs_dirent *de = (struct lsfs_dirent *)(block + LSFS_DIR_BUCKET_START);
 
-    /* Need to allocate a new block */
-    uint64_t new_block_idx = dir_size / LSFS_BLOCK_SIZE;
     memset(block, 0, LSFS_BLOCK_SIZE);
+    hdr->magic = LSFS_DIR_BUCKET_MAGIC;
+    hdr->depth = depth;
+    de->rec_len = LSFS_BLOCK_SIZE - LSFS_DIR_BUCKET_START;
+}
 
-    struct lsfs_dirent *de = (struct lsfs_dirent *)block;
-    de->ino = ino;
-    de->rec_len = LSFS_BLOCK_SIZE;
-    de->name_len = (uint8_t)name_len;
-    de->file_type = file_type;
-    memcpy(de->name, name, name_len);
+/*
+ * Read the header of a hashed directory
+ */
+static int dir_hash_read_header(struct lsfs_context *ctx, struct lsfs_inode_mem *dir,
+                                struct lsfs_dir_hash_header *hdr)
+{
+    uint8_t block[LSFS_BLOCK_SIZE];
 
-    if (lsfs_inode_write_block(ctx, dir, new_block_idx, block) != LSFS_OK) {
+    if (lsfs_inode_read_block(ctx, dir, 0, block) != LSFS_OK) {
         return LSFS_ERR_IO;
     }
 
-    dir->disk_inode.size = (new_block_idx + 1) * LSFS_BLOCK_SIZE;
-    dir->disk_inode.mtime = lsfs_get_time_ns();
-    dir->disk_inode.ctime = dir->disk_inode.mtime;
-    dir->dirty = true;
-
-    LSFS_DEBUG("Added entry '%s' -> %u in directory %u",
-               name, ino, dir->disk_inode.ino);
+    memcpy(hdr, block, sizeof(*hdr));
+    if (hdr->magic != LSFS_DIR_HASH_MAGIC || hdr->depth > LSFS_DIR_MAX_DEPTH ||
+        hdr->buckets == 0) {
+        LSFS_ERROR("Bad hash header in directory %u", dir->disk_inode.ino);
+        return LSFS_ERR_CORRUPT;
+    }
 
     return LSFS_OK;
 }
 
 /*
- * Remove an entry from a directory
+ * Write the header of a hashed directory
  */
-int lsfs_dir_remove(struct lsfs_context *ctx, struct lsfs_inode_mem *dir,
-                    const char *name)
+static int dir_hash_write_header(struct lsfs_context *ctx, struct lsfs_inode_mem *dir,
+                                 const struct lsfs_dir_hash_header *hdr)
 {
     uint8_t block[LSFS_BLOCK_SIZE];
-    size_t name_len = strlen(name);
-    uint64_t offset = 0;
-    uint64_t dir_size = dir->disk_inode.size;
-    struct lsfs_dirent *prev_de = NULL;
-    uint64_t prev_block_idx = 0;
 
-    if (!(dir->disk_inode.mode & S_IFDIR)) {
-        return LSFS_ERR_NOTDIR;
+    memset(block, 0, LSFS_BLOCK_SIZE);
+    memcpy(block, hdr, sizeof(*hdr));
+    if (lsfs_inode_write_block(ctx, dir, 0, block) != LSFS_OK) {
+        return LSFS_ERR_IO;
     }
 
-    /* Find and remove the entry */
-    while (offset < dir_size) {
-        uint64_t block_idx = offset / LSFS_BLOCK_SIZE;
-        uint32_t block_offset = offset % LSFS_BLOCK_SIZE;
+    dir->disk_inode.size = (uint64_t)(hdr->buckets + 1) * LSFS_BLOCK_SIZE;
+    return LSFS_OK;
+}
 
-        if (block_offset == 0) {
-            if (lsfs_inode_read_block(ctx, dir, block_idx, block) != LSFS_OK) {
+/*
+ * Find the bucket a hash belongs to
+ */
+static int dir_hash_bucket(struct lsfs_context *ctx, struct lsfs_inode_mem *dir,
+                           const struct lsfs_dir_hash_header *hdr, uint32_t hash,
+                           uint32_t *bucket)
+{
+    uint32_t table[LSFS_DIR_TABLE_PER_BLOCK];
+    uint32_t slot = hash & ((1U << hdr->depth) - 1);
+
+    if (lsfs_inode_read_block(ctx, dir, LSFS_DIR_TABLE_BLOCK + slot / LSFS_DIR_TABLE_PER_BLOCK,
+                              table) != LSFS_OK) {
+        return LSFS_ERR_IO;
+    }
+
+    *bucket = table[slot % LSFS_DIR_TABLE_PER_BLOCK];
+    if (*bucket == 0 || *bucket > hdr->buckets) {
+        LSFS_ERROR("Bad hash table slot %u in directory %u", slot, dir->disk_inode.ino);
+        return LSFS_ERR_CORRUPT;
+    }
+
+    return LSFS_OK;
+}
+
+/*
+ * Point the table slots from first to the end of a table of 2^depth
+ * slots, every step slots, at bucket
+ */
+static int dir_table_set(struct lsfs_context *ctx, struct lsfs_inode_mem *dir,
+                         uint32_t depth, uint64_t first, uint64_t step, uint32_t bucket)
+{
+    uint32_t table[LSFS_DIR_TABLE_PER_BLOCK];
+    uint64_t loaded = UINT64_MAX;
+
+    for (uint64_t slot = first; slot < (1ULL << depth); slot += step) {
+        uint64_t table_block = LSFS_DIR_TABLE_BLOCK + slot / LSFS_DIR_TABLE_PER_BLOCK;
+
+        if (table_block != loaded) {
+            if (loaded != UINT64_MAX &&
+                lsfs_inode_write_block(ctx, dir, loaded, table) != LSFS_OK) {
                 return LSFS_ERR_IO;
             }
-            prev_de = NULL;
+            if (lsfs_inode_read_block(ctx, dir, table_block, table) != LSFS_OK) {
+                return LSFS_ERR_IO;
+            }
+            loaded = table_block;
         }
+        table[slot % LSFS_DIR_TABLE_PER_BLOCK] = bucket;
+    }
 
-        struct lsfs_dirent *de = (struct lsfs_dirent *)(block + block_offset);
+    if (loaded != UINT64_MAX && lsfs_inode_write_block(ctx, dir, loaded, table) != LSFS_OK) {
+        return LSFS_ERR_IO;
+    }
 
-        if (de->rec_len == 0) {
+    return LSFS_OK;
+}
+
+/*
+ * Double the table of a hashed directory: the new upper half repeats the
+ * lower one
+ */
+static int dir_table_double(struct lsfs_context *ctx, struct lsfs_inode_mem *dir,
+                            uint32_t depth)
+{
+    uint32_t table[LSFS_DIR_TABLE_PER_BLOCK];
+    uint64_t slots = 1ULL << depth;
+
+    if (slots < LSFS_DIR_TABLE_PER_BLOCK) {
+        if (lsfs_inode_read_block(ctx, dir, LSFS_DIR_TABLE_BLOCK, table) != LSFS_OK) {
+            return LSFS_ERR_IO;
+        }
+        memcpy(&table[slots], table, slots * sizeof(uint32_t));
+        return lsfs_inode_write_block(ctx, dir, LSFS_DIR_TABLE_BLOCK, table) == LSFS_OK ?
+               LSFS_OK : LSFS_ERR_IO;
+    }
+
+    uint64_t blocks = slots / LSFS_DIR_TABLE_PER_BLOCK;
+    for (uint64_t i = 0; i < blocks; i++) {
+        if (lsfs_inode_read_block(ctx, dir, LSFS_DIR_TABLE_BLOCK + i, table) != LSFS_OK ||
+            lsfs_inode_write_block(ctx, dir, LSFS_DIR_TABLE_BLOCK + blocks + i,
+                                   table) != LSFS_OK) {
+            return LSFS_ERR_IO;
+        }
+    }
+
+    return LSFS_OK;
+}
+
+/*
+ * Split a full bucket in two
+ * block holds the bucket's contents and hash is the hash of a name that
+ * maps to it.  The table is doubled first if the bucket is already
+ * addressed by every bit of it.
+ */
+static int dir_hash_split(struct lsfs_context *ctx, struct lsfs_inode_mem *dir,
+                          struct lsfs_dir_hash_header *hdr, uint32_t bucket,
+                          const uint8_t *block, uint32_t hash)
+{
+    const struct lsfs_dir_bucket_header *bh = (const struct lsfs_dir_bucket_header *)block;
+    uint8_t *halves;
+    uint32_t depth = bh->depth;
+    uint32_t new_bucket = hdr->buckets + 1;
+    int ret;
+
+    if (bh->magic != LSFS_DIR_BUCKET_MAGIC || depth > hdr->depth) {
+        LSFS_ERROR("Bad bucket %u in directory %u", bucket, dir->disk_inode.ino);
+        return LSFS_ERR_CORRUPT;
+    }
+
+    if (depth == hdr->depth) {
+        if (hdr->depth == LSFS_DIR_MAX_DEPTH) {
+            return LSFS_ERR_NOSPC;
+        }
+        ret = dir_table_double(ctx, dir, hdr->depth);
+        if (ret != LSFS_OK) {
+            return ret;
+        }
+        hdr->depth++;
+    }
+
+    halves = malloc(2 * LSFS_BLOCK_SIZE);
+    if (!halves) {
+        return LSFS_ERR_NOMEM;
+    }
+    dir_bucket_init(halves, (uint16_t)(depth + 1));
+    dir_bucket_init(halves + LSFS_BLOCK_SIZE, (uint16_t)(depth + 1));
+
+    /* Entries with bit depth of their hash set move to the new bucket */
+    uint32_t pos = LSFS_DIR_BUCKET_START;
+    while (pos < LSFS_BLOCK_SIZE) {
+        const struct lsfs_dirent *de = (const struct lsfs_dirent *)(block + pos);
+
+        if (de->rec_len == 0 || de->rec_len > LSFS_BLOCK_SIZE - pos) {
             break;
         }
 
-        if (de->ino != 0 && de->name_len == name_len &&
-            memcmp(de->name, name, name_len) == 0) {
-            /* Found it - mark as deleted */
-            if (prev_de && prev_block_idx == block_idx) {
-                /* Merge with previous entry */
-                prev_de->rec_len += de->rec_len;
-            } else {
-                /* Just mark as deleted */
-                de->ino = 0;
-            }
+        if (de->ino != 0) {
+            uint32_t h = dir_hash(de->name, de->name_len);
+            uint8_t *half = halves + ((h >> depth) & 1) * LSFS_BLOCK_SIZE;
+            dirent_block_insert(half, LSFS_DIR_BUCKET_START, de->name, de->name_len,
+                                de->ino, de->file_type);
+        }
 
-            if (lsfs_inode_write_block(ctx, dir, block_idx, block) != LSFS_OK) {
+        pos += de->rec_len;
+    }
+
+    ret = LSFS_OK;
+    if (lsfs_inode_write_block(ctx, dir, bucket, halves) != LSFS_OK ||
+        lsfs_inode_write_block(ctx, dir, new_bucket, halves + LSFS_BLOCK_SIZE) != LSFS_OK) {
+        ret = LSFS_ERR_IO;
+    }
+    free(halves);
+    if (ret != LSFS_OK) {
+        return ret;
+    }
+
+    /* Every slot that reached the old bucket with bit depth set */
+    uint32_t low = hash & ((1U << depth) - 1);
+    ret = dir_table_set(ctx, dir, hdr->depth, low | (1U << depth), 2ULL << depth,
+                        new_bucket);
+    if (ret != LSFS_OK) {
+        return ret;
+    }
+
+    hdr->buckets = new_bucket;
+    return dir_hash_write_header(ctx, dir, hdr);
+}
+
+/*
+ * Lookup a name in a hashed directory
+ */
+static int dir_hash_lookup(struct lsfs_context *ctx, struct lsfs_inode_mem *dir,
+                           const char *name, size_t name_len,
+                           uint32_t *ino, uint8_t *file_type)
+{
+    struct lsfs_dir_hash_header hdr;
+    uint8_t block[LSFS_BLOCK_SIZE];
+    uint32_t bucket;
+
+    int ret = dir_hash_read_header(ctx, dir, &hdr);
+    if (ret == LSFS_OK) {
+        ret = dir_hash_bucket(ctx, dir, &hdr, dir_hash(name, name_len), &bucket);
+    }
+    if (ret != LSFS_OK) {
+        return ret;
+    }
+
+    if (lsfs_inode_read_block(ctx, dir, bucket, block) != LSFS_OK) {
+        return LSFS_ERR_IO;
+    }
+
+    struct lsfs_dirent *de = dirent_block_find(block, LSFS_DIR_BUCKET_START,
+                                               name, name_len, NULL);
+    if (!de) {
+        return LSFS_ERR_NOENT;
+    }
+
+    *ino = de->ino;
+    if (file_type) {
+        *file_type = de->file_type;
+    }
+    return LSFS_OK;
+}
+
+/*
+ * Add an entry to a hashed directory, splitting its bucket while full
+ */
+static int dir_hash_add(struct lsfs_context *ctx, struct lsfs_inode_mem *dir,
+                        const char *name, size_t name_len, uint32_t ino, uint8_t file_type)
+{
+    uint32_t hash = dir_hash(name, name_len);
+    uint8_t block[LSFS_BLOCK_SIZE];
+
+    while (1) {
+        struct lsfs_dir_hash_header hdr;
+        uint32_t bucket;
+
+        int ret = dir_hash_read_header(ctx, dir, &hdr);
+        if (ret == LSFS_OK) {
+            ret = dir_hash_bucket(ctx, dir, &hdr, hash, &bucket);
+        }
+        if (ret != LSFS_OK) {
+            return ret;
+        }
+
+        if (lsfs_inode_read_block(ctx, dir, bucket, block) != LSFS_OK) {
+            return LSFS_ERR_IO;
+        }
+
+        if (dirent_block_find(block, LSFS_DIR_BUCKET_START, name, name_len, NULL)) {
+            return LSFS_ERR_EXIST;
+        }
+
+        if (dirent_block_insert(block, LSFS_DIR_BUCKET_START, name, (uint8_t)name_len,
+                                ino, file_type)) {
+            if (lsfs_inode_write_block(ctx, dir, bucket, block) != LSFS_OK) {
                 return LSFS_ERR_IO;
             }
+            dir_touch(dir);
+            return LSFS_OK;
+        }
 
-            dir->disk_inode.mtime = lsfs_get_time_ns();
-            dir->disk_inode.ctime = dir->disk_inode.mtime;
-            dir->dirty = true;
+        ret = dir_hash_split(ctx, dir, &hdr, bucket, block, hash);
+        if (ret != LSFS_OK) {
+            return ret;
+        }
+    }
+}
 
-            LSFS_DEBUG("Removed entry '%s' from directory %u", name, dir->disk_inode.ino);
-            return LSFS_OK;
+/*
+ * Remove an entry from a hashed directory
+ */
+static int dir_hash_remove(struct lsfs_context *ctx, struct lsfs_inode_mem *dir,
+                           const char *name, size_t name_len)
+{
+    struct lsfs_dir_hash_header hdr;
+    uint8_t block[LSFS_BLOCK_SIZE];
+    struct lsfs_dirent *prev;
+    uint32_t bucket;
+
+    int ret = dir_hash_read_header(ctx, dir, &hdr);
+    if (ret == LSFS_OK) {
+        ret = dir_hash_bucket(ctx, dir, &hdr, dir_hash(name, name_len), &bucket);
+    }
+    if (ret != LSFS_OK) {
+        return ret;
+    }
+
+    if (lsfs_inode_read_block(ctx, dir, bucket, block) != LSFS_OK) {
+        return LSFS_ERR_IO;
+    }
+
+    struct lsfs_dirent *de = dirent_block_find(block, LSFS_DIR_BUCKET_START,
+                                               name, name_len, &prev);
+    if (!de) {
+        return LSFS_ERR_NOENT;
+    }
+
+    dirent_block_remove(de, prev);
+    if (lsfs_inode_write_block(ctx, dir, bucket, block) != LSFS_OK) {
+        return LSFS_ERR_IO;
+    }
+
+    dir_touch(dir);
+    return LSFS_OK;
+}
+
+/*
+ * Convert a linear directory to the hashed layout
+ * The entries are spread over the fewest buckets that hold them, all
+ * built in memory before anything is written.
+ */
+static int dir_hash_convert(struct lsfs_context *ctx, struct lsfs_inode_mem *dir)
+{
+    uint64_t nblocks = LSFS_BLOCKS_FOR_SIZE(dir->disk_inode.size);
+    uint8_t *linear = malloc(nblocks * LSFS_BLOCK_SIZE);
+    uint8_t *buckets = NULL;
+    uint32_t depth;
+    uint64_t count = 0;
+    int ret = LSFS_OK;
+
+    if (!linear) {
+        return LSFS_ERR_NOMEM;
+    }
+
+    for (uint64_t i = 0; i < nblocks; i++) {
+        if (lsfs_inode_read_block(ctx, dir, i, linear + i * LSFS_BLOCK_SIZE) != LSFS_OK) {
+            free(linear);
+            return LSFS_ERR_IO;
         }
+    }
 
-        prev_de = de;
-        prev_block_idx = block_idx;
-        offset += de->rec_len;
+    for (depth = 0; depth <= LSFS_DIR_MAX_DEPTH; depth++) {
+        bool fits = true;
+
+        count = 1ULL << depth;
+        buckets = malloc(count * LSFS_BLOCK_SIZE);
+        if (!buckets) {
+            free(linear);
+            return LSFS_ERR_NOMEM;
+        }
+        for (uint64_t b = 0; b < count; b++) {
+            dir_bucket_init(buckets + b * LSFS_BLOCK_SIZE, (uint16_t)depth);
+        }
+
+        for (uint64_t i = 0; i < nblocks && fits; i++) {
+            uint8_t *block = linear + i * LSFS_BLOCK_SIZE;
+            uint32_t pos = 0;
+
+            while (pos < LSFS_BLOCK_SIZE && fits) {
+                const struct lsfs_dirent *de = (const struct lsfs_dirent *)(block + pos);
+
+                if (de->rec_len == 0 || de->rec_len > LSFS_BLOCK_SIZE - pos) {
+                    break;
+                }
+
+                if (de->ino != 0 && de->name_len > 0) {
+                    uint32_t h = dir_hash(de->name, de->name_len) & (uint32_t)(count - 1);
+                    fits = dirent_block_insert(buckets + (uint64_t)h * LSFS_BLOCK_SIZE,
+                                               LSFS_DIR_BUCKET_START, de->name,
+                                               de->name_len, de->ino, de->file_type);
+                }
+
+                pos += de->rec_len;
+            }
+        }
+
+        if (fits) {
+            break;
+        }
+        free(buckets);
+        buckets = NULL;
     }
 
-    return LSFS_ERR_NOENT;
+    free(linear);
+    if (!buckets) {
+        return LSFS_ERR_NOSPC;
+    }
+
+    /* Linear blocks past the new buckets are no longer used */
+    if (nblocks > count + 1) {
+        ret = lsfs_inode_truncate(ctx, dir, (count + 1) * LSFS_BLOCK_SIZE);
+    }
+
+    if (ret == LSFS_OK) {
+        for (uint64_t b = 0; b < count; b++) {
+            ret = dir_table_set(ctx, dir, depth, b, count, (uint32_t)(b + 1));
+            if (ret == LSFS_OK &&
+                lsfs_inode_write_block(ctx, dir, b + 1,
+                                       buckets + b * LSFS_BLOCK_SIZE) != LSFS_OK) {
+                ret = LSFS_ERR_IO;
+            }
+            if (ret != LSFS_OK) {
+                break;
+            }
+        }
+    }
+    free(buckets);
+
+    if (ret == LSFS_OK) {
+        struct lsfs_dir_hash_header hdr = {
+            .magic = LSFS_DIR_HASH_MAGIC,
+            .depth = depth,
+            .buckets = (uint32_t)count,
+        };
+        ret = dir_hash_write_header(ctx, dir, &hdr);
+    }
+    if (ret != LSFS_OK) {
+        return ret;
+    }
+
+    dir->disk_inode.flags |= LSFS_INODE_HASHED_DIR;
+    dir->dirty = true;
+
+    LSFS_DEBUG("Converted directory %u to %" PRIu64 " hash buckets",
+               dir->disk_inode.ino, count);
+    return LSFS_OK;
 }
 
 /*
- * Check if a directory is empty (only . and ..)
+ * Check whether a directory uses the hashed layout
  */
-int lsfs_dir_is_empty(struct lsfs_context *ctx, struct lsfs_inode_mem *dir)
+static inline bool dir_is_hashed(const struct lsfs_inode_mem *dir)
+{
+    return (dir->disk_inode.flags & LSFS_INODE_HASHED_DIR) != 0;
+}
+
+/*
+ * Look up an entry in the directory blocks
+ */
+static int dir_lookup_blocks(struct lsfs_context *ctx, struct lsfs_inode_mem *dir,
+                             const char *name, size_t name_len, uint32_t *ino,
+                             uint8_t *file_type)
 {
     uint8_t block[LSFS_BLOCK_SIZE];
-    uint64_t offset = 0;
-    uint64_t dir_size = dir->disk_inode.size;
-    int entry_count = 0;
+    uint64_t nblocks = LSFS_BLOCKS_FOR_SIZE(dir->disk_inode.size);
+
+    if (dir_is_hashed(dir)) {
+        return dir_hash_lookup(ctx, dir, name, name_len, ino, file_type);
+    }
+
+    /* Iterate through directory blocks */
+    for (uint64_t block_idx = 0; block_idx < nblocks; block_idx++) {
+        if (lsfs_inode_read_block(ctx, dir, block_idx, block) != LSFS_OK) {
+            return LSFS_ERR_IO;
+        }
+
+        struct lsfs_dirent *de = dirent_block_find(block, 0, name, name_len, NULL);
+        if (de) {
+            *ino = de->ino;
+            if (file_type) {
+                *file_type = de->file_type;
+            }
+            return LSFS_OK;
+        }
+    }
+
+    return LSFS_ERR_NOENT;
+}
+
+/*
+ * True for names the dentry cache does not track
+ */
+static inline bool dir_name_uncached(const char *name, size_t name_len)
+{
+    return name[0] == '.' && (name_len == 1 || (name_len == 2 && name[1] == '.'));
+}
+
+/*
+ * Lookup a name in a directory
+ * Answers come from the dentry cache when it knows the name, and misses
+ * are cached, including names found not to exist.
+ */
+int lsfs_dir_lookup(struct lsfs_context *ctx, struct lsfs_inode_mem *dir,
+                    const char *name, uint32_t *ino, uint8_t *file_type)
+{
+    size_t name_len = strlen(name);
+    uint32_t parent = dir->disk_inode.ino;
+    bool cached;
+    int ret;
 
     if (!(dir->disk_inode.mode & S_IFDIR)) {
         return LSFS_ERR_NOTDIR;
     }
 
-    while (offset < dir_size) {
-        uint64_t block_idx = offset / LSFS_BLOCK_SIZE;
-        uint32_t block_offset = offset % LSFS_BLOCK_SIZE;
+    if (name_len > LSFS_NAME_MAX) {
+        return LSFS_ERR_INVAL;
+    }
 
-        if (block_offset == 0) {
-            if (lsfs_inode_read_block(ctx, dir, block_idx, block) != LSFS_OK) {
+    cached = name_len > 0 && !dir_name_uncached(name, name_len);
+    if (cached && lsfs_dcache_lookup(&ctx->dcache, parent, name, name_len, ino, file_type)) {
+        return *ino ? LSFS_OK : LSFS_ERR_NOENT;
+    }
+
+    uint8_t type = 0;
+    ret = dir_lookup_blocks(ctx, dir, name, name_len, ino, &type);
+    if (file_type) {
+        *file_type = type;
+    }
+
+    if (cached) {
+        if (ret == LSFS_OK) {
+            lsfs_dcache_set(&ctx->dcache, parent, name, name_len, *ino, type);
+        } else if (ret == LSFS_ERR_NOENT) {
+            lsfs_dcache_set(&ctx->dcache, parent, name, name_len, 0, 0);
+        }
+    }
+
+    return ret;
+}
+
+/*
+ * Add an entry to a directory
+ * A linear directory that would need more than LSFS_DIR_HASH_THRESHOLD
+ * blocks is converted to the hashed layout first.
+ */
+static int dir_add_entry(struct lsfs_context *ctx, struct lsfs_inode_mem *dir,
+                         const char *name, size_t name_len, uint32_t ino,
+                         uint8_t file_type)
+{
+    uint8_t block[LSFS_BLOCK_SIZE];
+    uint64_t nblocks = LSFS_BLOCKS_FOR_SIZE(dir->disk_inode.size);
+
+    if (dir_is_hashed(dir)) {
+        return dir_hash_add(ctx, dir, name, name_len, ino, file_type);
+    }
+
+    /* Check if name already exists */
+    uint32_t existing_ino;
+    if (lsfs_dir_lookup(ctx, dir, name, &existing_ino, NULL) == LSFS_OK) {
+        return LSFS_ERR_EXIST;
+    }
+
+    /* Find space for new entry */
+    for (uint64_t block_idx = 0; block_idx < nblocks; block_idx++) {
+        if (lsfs_inode_read_block(ctx, dir, block_idx, block) != LSFS_OK) {
+            return LSFS_ERR_IO;
+        }
+
+        if (dirent_block_insert(block, 0, name, (uint8_t)name_len, ino, file_type)) {
+            if (lsfs_inode_write_block(ctx, dir, block_idx, block) != LSFS_OK) {
                 return LSFS_ERR_IO;
             }
+            dir_touch(dir);
+            return LSFS_OK;
         }
+    }
 
-        struct lsfs_dirent *de = (struct lsfs_dirent *)(block + block_offset);
+    if (nblocks >= LSFS_DIR_HASH_THRESHOLD) {
+        int ret = dir_hash_convert(ctx, dir);
+        if (ret != LSFS_OK) {
+            return ret;
+        }
+        return dir_hash_add(ctx, dir, name, name_len, ino, file_type);
+    }
 
-        if (de->rec_len == 0) {
-            break;
+    /* Need to allocate a new block */
+    memset(block, 0, LSFS_BLOCK_SIZE);
+    dirent_fill((struct lsfs_dirent *)block, ino, LSFS_BLOCK_SIZE,
+                name, (uint8_t)name_len, file_type);
+
+    if (lsfs_inode_write_block(ctx, dir, nblocks, block) != LSFS_OK) {
+        return LSFS_ERR_IO;
+    }
+
+    dir->disk_inode.size = (nblocks + 1) * LSFS_BLOCK_SIZE;
+    dir_touch(dir);
+
+    LSFS_DEBUG("Added entry '%s' -> %u in directory %u",
+               name, ino, dir->disk_inode.ino);
+
+    return LSFS_OK;
+}
+
+/*
+ * Remove an entry from a directory's blocks
+ */
+static int dir_remove_entry(struct lsfs_context *ctx, struct lsfs_inode_mem *dir,
+                            const char *name, size_t name_len)
+{
+    uint8_t block[LSFS_BLOCK_SIZE];
+    uint64_t nblocks = LSFS_BLOCKS_FOR_SIZE(dir->disk_inode.size);
+
+    if (dir_is_hashed(dir)) {
+        return dir_hash_remove(ctx, dir, name, name_len);
+    }
+
+    /* Find and remove the entry */
+    for (uint64_t block_idx = 0; block_idx < nblocks; block_idx++) {
+        struct lsfs_dirent *prev;
+
+        if (lsfs_inode_read_block(ctx, dir, block_idx, block) != LSFS_OK) {
+            return LSFS_ERR_IO;
         }
 
-        if (de->ino != 0) {
-            /* Skip . and .. */
-            if (de->name_len == 1 && de->name[0] == '.') {
-                /* . entry */
-            } else if (de->name_len == 2 && de->name[0] == '.' && de->name[1] == '.') {
-                /* .. entry */
-            } else {
-                entry_count++;
-            }
+        struct lsfs_dirent *de = dirent_block_find(block, 0, name, name_len, &prev);
+        if (!de) {
+            continue;
         }
 
-        offset += de->rec_len;
+        dirent_block_remove(de, prev);
+        if (lsfs_inode_write_block(ctx, dir, block_idx, block) != LSFS_OK) {
+            return LSFS_ERR_IO;
+        }
+
+        dir_touch(dir);
+
+        LSFS_DEBUG("Removed entry '%s' from directory %u", name, dir->disk_inode.ino);
+        return LSFS_OK;
+    }
+
+    return LSFS_ERR_NOENT;
+}
+
+/*
+ * Add an entry to a directory and record it in the dentry cache
+ */
+int lsfs_dir_add(struct lsfs_context *ctx, struct lsfs_inode_mem *dir,
+                 const char *name, uint32_t ino, uint8_t file_type)
+{
+    size_t name_len = strlen(name);
+    int ret;
+
+    if (!(dir->disk_inode.mode & S_IFDIR)) {
+        return LSFS_ERR_NOTDIR;
+    }
+
+    if (name_len == 0 || name_len > LSFS_NAME_MAX) {
+        return LSFS_ERR_INVAL;
+    }
+
+    ret = dir_add_entry(ctx, dir, name, name_len, ino, file_type);
+    if (dir_name_uncached(name, name_len)) {
+        return ret;
+    }
+
+    if (ret == LSFS_OK) {
+        lsfs_dcache_set(&ctx->dcache, dir->disk_inode.ino, name, name_len, ino, file_type);
+    } else if (ret != LSFS_ERR_EXIST) {
+        /* A failed write may have left the block half updated */
+        lsfs_dcache_invalidate(&ctx->dcache, dir->disk_inode.ino, name, name_len);
+    }
+
+    return ret;
+}
+
+/*
+ * Remove an entry from a directory and cache the name as absent
+ */
+int lsfs_dir_remove(struct lsfs_context *ctx, struct lsfs_inode_mem *dir,
+                    const char *name)
+{
+    size_t name_len = strlen(name);
+    int ret;
+
+    if (!(dir->disk_inode.mode & S_IFDIR)) {
+        return LSFS_ERR_NOTDIR;
+    }
+
+    if (name_len == 0 || name_len > LSFS_NAME_MAX) {
+        return LSFS_ERR_INVAL;
+    }
+
+    ret = dir_remove_entry(ctx, dir, name, name_len);
+    if (dir_name_uncached(name, name_len)) {
+        return ret;
+    }
+
+    if (ret == LSFS_OK || ret == LSFS_ERR_NOENT) {
+        lsfs_dcache_set(&ctx->dcache, dir->disk_inode.ino, name, name_len, 0, 0);
+    } else {
+        lsfs_dcache_invalidate(&ctx->dcache, dir->disk_inode.ino, name, name_len);
     }
 
-    return entry_count == 0 ? LSFS_OK : LSFS_ERR_NOTEMPTY;
+    return ret;
 }
 
 /*
  * Iterate over directory entries
+ * The callback gets the offset of the entry after the one it is given,
+ * which is where iteration resumes when that offset is passed back in.
  */
 int lsfs_dir_iterate(struct lsfs_context *ctx, struct lsfs_inode_mem *dir,
                      int (*callback)(void *ctx, const char *name, uint32_t ino,
@@ -357,33 +916,50 @@ int lsfs_dir_iterate(struct lsfs_context *ctx, struct lsfs_inode_mem *dir,
     uint8_t block[LSFS_BLOCK_SIZE];
     uint64_t offset = start_offset;
     uint64_t dir_size = dir->disk_inode.size;
+    uint64_t loaded = UINT64_MAX;
+    uint32_t block_start = 0;
     char name_buf[LSFS_NAME_MAX + 1];
 
     if (!(dir->disk_inode.mode & S_IFDIR)) {
         return LSFS_ERR_NOTDIR;
     }
 
+    /* Hashed directories list their buckets, which start at block 1 */
+    if (dir_is_hashed(dir)) {
+        block_start = LSFS_DIR_BUCKET_START;
+        offset = LSFS_MAX(offset, LSFS_BLOCK_SIZE);
+    }
+
     while (offset < dir_size) {
         uint64_t block_idx = offset / LSFS_BLOCK_SIZE;
         uint32_t block_offset = offset % LSFS_BLOCK_SIZE;
 
-        if (block_offset == 0) {
+        if (block_offset < block_start) {
+            offset += block_start - block_offset;
+            continue;
+        }
+
+        if (block_idx != loaded) {
             if (lsfs_inode_read_block(ctx, dir, block_idx, block) != LSFS_OK) {
                 return LSFS_ERR_IO;
             }
+            loaded = block_idx;
         }
 
         struct lsfs_dirent *de = (struct lsfs_dirent *)(block + block_offset);
 
-        if (de->rec_len == 0) {
-            break;
+        /* Nothing more in this block */
+        if (de->rec_len == 0 || de->rec_len > LSFS_BLOCK_SIZE - block_offset) {
+            offset = (block_idx + 1) * LSFS_BLOCK_SIZE;
+            continue;
         }
 
         if (de->ino != 0 && de->name_len > 0) {
             memcpy(name_buf, de->name, de->name_len);
             name_buf[de->name_len] = '\0';
 
-            int ret = callback(callback_ctx, name_buf, de->ino, de->file_type, offset);
+            int ret = callback(callback_ctx, name_buf, de->ino, de->file_type,
+                               (off_t)(offset + de->rec_len));
             if (ret != 0) {
                 return ret;
             }
@@ -395,6 +971,36 @@ int lsfs_dir_iterate(struct lsfs_context *ctx, struct lsfs_inode_mem *dir,
     return LSFS_OK;
 }
 
+/*
+ * Stop at the first entry other than . and ..
+ */
+static int dir_empty_callback(void *ctx, const char *name, uint32_t ino,
+                              uint8_t type, off_t offset)
+{
+    (void)ctx;
+    (void)ino;
+    (void)type;
+    (void)offset;
+
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Check if a directory is empty (only . and ..)
+ */
+int lsfs_dir_is_empty(struct lsfs_context *ctx, struct lsfs_inode_mem *dir)
+{
+    int ret = lsfs_dir_iterate(ctx, dir, dir_empty_callback, NULL, 0);
+
+    if (ret < 0) {
+        return ret;
+    }
+    return ret == 0 ? LSFS_OK : LSFS_ERR_NOTEMPTY;
+}
+
 /*
  * Initialize a new directory with . and .. entries
  */
@@ -436,3 +1042,51 @@ int lsfs_dir_init(struct lsfs_context *ctx, struct lsfs_inode_mem *dir,
 
     return LSFS_OK;
 }
+
+/*
+ * Point the .. entry of a directory at a new parent
+ * The entry is rewritten in place: block 0 of a linear directory, or
+ * the bucket its name hashes to in a hashed one.
+ */
+int lsfs_dir_set_parent(struct lsfs_context *ctx, struct lsfs_inode_mem *dir,
+                        uint32_t parent_ino)
+{
+    uint8_t block[LSFS_BLOCK_SIZE];
+    uint32_t block_idx = 0;
+    uint32_t start = 0;
+
+    if (!(dir->disk_inode.mode & S_IFDIR)) {
+        return LSFS_ERR_NOTDIR;
+    }
+
+    if (dir_is_hashed(dir)) {
+        struct lsfs_dir_hash_header hdr;
+
+        int ret = dir_hash_read_header(ctx, dir, &hdr);
+        if (ret == LSFS_OK) {
+            ret = dir_hash_bucket(ctx, dir, &hdr, dir_hash("..", 2), &block_idx);
+        }
+        if (ret != LSFS_OK) {
+            return ret;
+        }
+        start = LSFS_DIR_BUCKET_START;
+    }
+
+    if (lsfs_inode_read_block(ctx, dir, block_idx, block) != LSFS_OK) {
+        return LSFS_ERR_IO;
+    }
+
+    struct lsfs_dirent *de = dirent_block_find(block, start, "..", 2, NULL);
+    if (!de) {
+        LSFS_ERROR("Directory %u has no .. entry", dir->disk_inode.ino);
+        return LSFS_ERR_CORRUPT;
+    }
+
+    de->ino = parent_ino;
+    if (lsfs_inode_write_block(ctx, dir, block_idx, block) != LSFS_OK) {
+        return LSFS_ERR_IO;
+    }
+
+    dir_touch(dir);
+    return LSFS_OK;
+}
@@ -3,12 +3,17 @@
  * FUSE Operations Implementation
  */
 
+#ifndef FUSE_USE_VERSION
 #define FUSE_USE_VERSION 35
+#endif
+
+#define _GNU_SOURCE             /* FALLOC_FL_KEEP_SIZE */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <sys/stat.h>
 #include <fuse3/fuse_lowlevel.h>
@@ -35,7 +40,11 @@ static struct lsfs_inode_mem *get_inode(fuse_ino_t ino)
 static void lsfs_op_init(void *userdata, struct fuse_conn_info *conn)
 {
     (void)userdata;
-    (void)conn;
+
+    /* Let write payloads reach write_buf through a pipe */
+    if (conn->capable & FUSE_CAP_SPLICE_READ) {
+        conn->want |= FUSE_CAP_SPLICE_READ;
+    }
 
     LSFS_INFO("FUSE filesystem initialized");
 }
@@ -59,35 +68,57 @@ static void lsfs_op_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
     struct fuse_entry_param e;
     uint32_t child_ino;
     uint8_t file_type;
+    int ret;
+
+    /* Keeps the child from being unlinked between lookup and get */
+    pthread_rwlock_rdlock(&g_lsfs->fs_lock);
 
     parent_inode = get_inode(parent);
     if (!parent_inode) {
+        pthread_rwlock_unlock(&g_lsfs->fs_lock);
         fuse_reply_err(req, ENOENT);
         return;
     }
 
-    if (lsfs_dir_lookup(g_lsfs, parent_inode, name, &child_ino, &file_type) != LSFS_OK) {
-        lsfs_inode_put(parent_inode);
-        fuse_reply_err(req, ENOENT);
+    pthread_mutex_lock(&parent_inode->lock);
+    ret = lsfs_dir_lookup(g_lsfs, parent_inode, name, &child_ino, &file_type);
+    pthread_mutex_unlock(&parent_inode->lock);
+    lsfs_inode_put(parent_inode);
+
+    if (ret == LSFS_ERR_NOENT && g_lsfs->negative_timeout > 0) {
+        /* Let the kernel cache the name as absent */
+        pthread_rwlock_unlock(&g_lsfs->fs_lock);
+        memset(&e, 0, sizeof(e));
+        e.entry_timeout = g_lsfs->negative_timeout;
+        fuse_reply_entry(req, &e);
         return;
     }
 
-    lsfs_inode_put(parent_inode);
+    if (ret != LSFS_OK) {
+        pthread_rwlock_unlock(&g_lsfs->fs_lock);
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
 
     child_inode = lsfs_inode_get(g_lsfs, child_ino);
     if (!child_inode) {
+        pthread_rwlock_unlock(&g_lsfs->fs_lock);
         fuse_reply_err(req, ENOENT);
         return;
     }
 
     memset(&e, 0, sizeof(e));
     e.ino = child_ino;
-    e.attr_timeout = 1.0;
-    e.entry_timeout = 1.0;
+    e.attr_timeout = g_lsfs->attr_timeout;
+    e.entry_timeout = g_lsfs->entry_timeout;
+    pthread_mutex_lock(&child_inode->lock);
     lsfs_inode_to_stat(child_inode, &e.attr);
     e.generation = child_inode->disk_inode.generation;
+    pthread_mutex_unlock(&child_inode->lock);
 
     lsfs_inode_put(child_inode);
+    pthread_rwlock_unlock(&g_lsfs->fs_lock);
+
     fuse_reply_entry(req, &e);
 }
 
@@ -107,10 +138,12 @@ static void lsfs_op_getattr(fuse_req_t req, fuse_ino_t ino,
         return;
     }
 
+    pthread_mutex_lock(&inode->lock);
     lsfs_inode_to_stat(inode, &st);
+    pthread_mutex_unlock(&inode->lock);
     lsfs_inode_put(inode);
 
-    fuse_reply_attr(req, &st, 1.0);
+    fuse_reply_attr(req, &st, g_lsfs->attr_timeout);
 }
 
 /*
@@ -147,21 +180,13 @@ static void lsfs_op_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
     }
 
     if (to_set & FUSE_SET_ATTR_SIZE) {
-        /* Truncate */
-        if ((uint64_t)attr->st_size < inode->disk_inode.size) {
-            /* Mark blocks beyond new size as dead */
-            uint64_t old_blocks = LSFS_BLOCKS_FOR_SIZE(inode->disk_inode.size);
-            uint64_t new_blocks = LSFS_BLOCKS_FOR_SIZE(attr->st_size);
-
-            for (uint64_t i = new_blocks; i < old_blocks && i < LSFS_DIRECT_BLOCKS; i++) {
-                if (inode->disk_inode.direct[i]) {
-                    lsfs_gc_mark_block_dead(g_lsfs, inode->disk_inode.direct[i]);
-                    inode->disk_inode.direct[i] = 0;
-                }
-            }
+        int ret = lsfs_inode_truncate(g_lsfs, inode, (uint64_t)attr->st_size);
+        if (ret != LSFS_OK) {
+            pthread_mutex_unlock(&inode->lock);
+            lsfs_inode_put(inode);
+            fuse_reply_err(req, ret == LSFS_ERR_NOSPC ? ENOSPC : EIO);
+            return;
         }
-        inode->disk_inode.size = attr->st_size;
-        inode->dirty = true;
     }
 
     if (to_set & FUSE_SET_ATTR_ATIME) {
@@ -181,12 +206,12 @@ static void lsfs_op_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
         lsfs_inode_write(g_lsfs, inode);
     }
 
-    pthread_mutex_unlock(&inode->lock);
-
     lsfs_inode_to_stat(inode, &st);
+
+    pthread_mutex_unlock(&inode->lock);
     lsfs_inode_put(inode);
 
-    fuse_reply_attr(req, &st, 1.0);
+    fuse_reply_attr(req, &st, g_lsfs->attr_timeout);
 }
 
 /*
@@ -199,8 +224,66 @@ struct readdir_ctx {
     size_t offset;
     off_t start_offset;
     int plus;
+    void *entries;      /* readdirplus: collected entries */
+    size_t count;
+    size_t capacity;
+};
+
+struct readdirplus_entry {
+    uint32_t ino;
+    uint8_t type;
+    off_t offset;
+    char name[LSFS_NAME_MAX + 1];
 };
 
+/*
+ * Fill the type bits a directory entry carries
+ */
+static mode_t readdir_mode(uint8_t type)
+{
+    switch (type) {
+    case LSFS_FT_DIR:      return S_IFDIR;
+    case LSFS_FT_REG_FILE: return S_IFREG;
+    case LSFS_FT_SYMLINK:  return S_IFLNK;
+    default:               return 0;
+    }
+}
+
+/*
+ * Collect an entry for readdirplus
+ * Attributes are filled in once the directory lock is dropped, so only
+ * the space the entry will take is checked here.
+ */
+static int readdirplus_collect(struct readdir_ctx *rctx, const char *name,
+                               uint32_t ino, uint8_t type, off_t offset)
+{
+    struct readdirplus_entry *ents = (struct readdirplus_entry *)rctx->entries;
+    size_t entsize = fuse_add_direntry_plus(rctx->req, NULL, 0, name, NULL, 0);
+
+    if (entsize > rctx->size - rctx->offset) {
+        return 1;  /* Buffer full */
+    }
+
+    if (rctx->count == rctx->capacity) {
+        size_t capacity = rctx->capacity ? rctx->capacity * 2 : 64;
+        ents = realloc(ents, capacity * sizeof(*ents));
+        if (!ents) {
+            return 1;
+        }
+        rctx->entries = ents;
+        rctx->capacity = capacity;
+    }
+
+    ents[rctx->count].ino = ino;
+    ents[rctx->count].type = type;
+    ents[rctx->count].offset = offset;
+    snprintf(ents[rctx->count].name, sizeof(ents[rctx->count].name), "%s", name);
+    rctx->count++;
+
+    rctx->offset += entsize;
+    return 0;
+}
+
 static int readdir_callback(void *ctx, const char *name, uint32_t ino,
                             uint8_t type, off_t offset)
 {
@@ -208,20 +291,16 @@ static int readdir_callback(void *ctx, const char *name, uint32_t ino,
     struct stat st;
     size_t entsize;
 
-    (void)offset;
+    if (rctx->plus) {
+        return readdirplus_collect(rctx, name, ino, type, offset);
+    }
 
     memset(&st, 0, sizeof(st));
     st.st_ino = ino;
-
-    switch (type) {
-    case LSFS_FT_DIR:     st.st_mode = S_IFDIR; break;
-    case LSFS_FT_REG_FILE: st.st_mode = S_IFREG; break;
-    case LSFS_FT_SYMLINK: st.st_mode = S_IFLNK; break;
-    default:              st.st_mode = 0; break;
-    }
+    st.st_mode = readdir_mode(type);
 
     entsize = fuse_add_direntry(rctx->req, rctx->buf + rctx->offset,
-                                rctx->size - rctx->offset, name, &st, offset + 1);
+                                rctx->size - rctx->offset, name, &st, offset);
 
     if (entsize > rctx->size - rctx->offset) {
         return 1;  /* Buffer full */
@@ -238,32 +317,143 @@ static void lsfs_op_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
     struct readdir_ctx ctx;
     (void)fi;
 
+    ctx.req = req;
+    ctx.buf = malloc(size);
+    if (!ctx.buf) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
     inode = get_inode(ino);
     if (!inode) {
+        free(ctx.buf);
         fuse_reply_err(req, ENOENT);
         return;
     }
+    ctx.size = size;
+    ctx.offset = 0;
+    ctx.start_offset = off;
+    ctx.plus = 0;
+    ctx.entries = NULL;
+    ctx.count = 0;
+    ctx.capacity = 0;
+
+    pthread_rwlock_rdlock(&g_lsfs->fs_lock);
+    pthread_mutex_lock(&inode->lock);
+    lsfs_dir_iterate(g_lsfs, inode, readdir_callback, &ctx, off);
+    pthread_mutex_unlock(&inode->lock);
+    pthread_rwlock_unlock(&g_lsfs->fs_lock);
+
+    lsfs_inode_put(inode);
+
+    fuse_reply_buf(req, ctx.buf, ctx.offset);
+    free(ctx.buf);
+}
+
+/*
+ * FUSE readdirplus
+ * Entries are collected under the directory lock, then each child is
+ * looked up and statted without it, since only namespace changes may hold
+ * two inode locks.  The namespace lock stays held so listed children
+ * cannot be unlinked in between.
+ */
+static void lsfs_op_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size,
+                                off_t off, struct fuse_file_info *fi)
+{
+    struct lsfs_inode_mem *inode;
+    struct readdirplus_entry *ents;
+    struct readdir_ctx ctx;
+    size_t used = 0;
+    (void)fi;
 
     ctx.req = req;
     ctx.buf = malloc(size);
     if (!ctx.buf) {
-        lsfs_inode_put(inode);
         fuse_reply_err(req, ENOMEM);
         return;
     }
+
+    inode = get_inode(ino);
+    if (!inode) {
+        free(ctx.buf);
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
     ctx.size = size;
     ctx.offset = 0;
     ctx.start_offset = off;
-    ctx.plus = 0;
+    ctx.plus = 1;
+    ctx.entries = NULL;
+    ctx.count = 0;
+    ctx.capacity = 0;
 
+    pthread_rwlock_rdlock(&g_lsfs->fs_lock);
+    pthread_mutex_lock(&inode->lock);
     lsfs_dir_iterate(g_lsfs, inode, readdir_callback, &ctx, off);
-
+    pthread_mutex_unlock(&inode->lock);
     lsfs_inode_put(inode);
 
-    fuse_reply_buf(req, ctx.buf, ctx.offset);
+    ents = (struct readdirplus_entry *)ctx.entries;
+    for (size_t i = 0; i < ctx.count; i++) {
+        struct fuse_entry_param e;
+        struct lsfs_inode_mem *child = NULL;
+        const char *name = ents[i].name;
+        bool dot = strcmp(name, ".") == 0 || strcmp(name, "..") == 0;
+
+        memset(&e, 0, sizeof(e));
+        e.attr.st_ino = ents[i].ino;
+        e.attr.st_mode = readdir_mode(ents[i].type);
+
+        /* "." and ".." are not looked up, so carry no lookup count */
+        if (!dot) {
+            child = lsfs_inode_get(g_lsfs, ents[i].ino);
+        }
+        if (child) {
+            e.ino = ents[i].ino;
+            e.attr_timeout = g_lsfs->attr_timeout;
+            e.entry_timeout = g_lsfs->entry_timeout;
+            pthread_mutex_lock(&child->lock);
+            lsfs_inode_to_stat(child, &e.attr);
+            e.generation = child->disk_inode.generation;
+            pthread_mutex_unlock(&child->lock);
+            lsfs_inode_put(child);
+        }
+
+        used += fuse_add_direntry_plus(req, ctx.buf + used, size - used, name,
+                                       &e, ents[i].offset);
+    }
+    pthread_rwlock_unlock(&g_lsfs->fs_lock);
+
+    fuse_reply_buf(req, ctx.buf, used);
+    free(ctx.entries);
     free(ctx.buf);
 }
 
+/*
+ * Per-open-file state, kept in fi->fh
+ * Reads and writes of an inode are serialized by its lock, which covers
+ * this too.
+ */
+struct lsfs_file {
+    uint64_t next_block;            /* Block after the end of the last read */
+    uint64_t ra_end;                /* Blocks before this were read ahead */
+    uint32_t ra_window;             /* Readahead window (0 = not sequential) */
+    uint64_t prealloc;              /* Log blocks fallocate promised to writes */
+};
+
+/*
+ * Allocate the state for a newly opened file
+ * Returns 0, which means neither readahead nor preallocation, if
+ * readahead is off and the file is opened for reading only.
+ */
+static uint64_t file_open(int flags)
+{
+    if (g_lsfs->readahead_blocks == 0 && (flags & O_ACCMODE) == O_RDONLY) {
+        return 0;
+    }
+    return (uint64_t)(uintptr_t)calloc(1, sizeof(struct lsfs_file));
+}
+
 /*
  * FUSE open
  */
@@ -279,19 +469,137 @@ static void lsfs_op_open(fuse_req_t req, fuse_ino_t ino,
     }
 
     lsfs_inode_put(inode);
+    fi->fh = file_open(fi->flags);
     fuse_reply_open(req, fi);
 }
 
+/*
+ * FUSE release
+ * Space preallocated through the file and not written is given back.
+ */
+static void lsfs_op_release(fuse_req_t req, fuse_ino_t ino,
+                            struct fuse_file_info *fi)
+{
+    struct lsfs_file *file = (struct lsfs_file *)(uintptr_t)fi->fh;
+    (void)ino;
+
+    if (file) {
+        lsfs_segment_prealloc_release(g_lsfs, file->prealloc);
+    }
+    free(file);
+    fi->fh = 0;
+    fuse_reply_err(req, 0);
+}
+
+/*
+ * Read ahead of a sequential reader
+ * A read that starts where the last one ended, or at the start of the
+ * file, is sequential.  The first one opens a window of twice its size,
+ * and whenever the reader gets within half a window of the end of what
+ * was read ahead, the window doubles, up to readahead_blocks, and the
+ * next window is queued.  Any other read closes the window.  The blocks
+ * are mapped here, under the inode lock, and queued as runs of
+ * contiguous log blocks; for compressed data the packed blocks are read.
+ * Holes and blocks still in the segment buffer are skipped.
+ */
+static void read_ahead(struct lsfs_inode_mem *inode, struct lsfs_file *file,
+                       uint64_t first, uint32_t nblocks,
+                       const struct lsfs_segment_set *buffered)
+{
+    uint64_t end = first + nblocks;
+    uint32_t max = g_lsfs->readahead_blocks;
+    bool sequential = first <= file->next_block && file->next_block < end;
+
+    file->next_block = end;
+    if (!sequential) {
+        file->ra_window = 0;
+        file->ra_end = 0;
+        return;
+    }
+
+    if (file->ra_window == 0) {
+        file->ra_window = LSFS_MIN(LSFS_MAX(2 * nblocks, LSFS_READAHEAD_MIN_BLOCKS), max);
+        file->ra_end = end;
+    } else if (file->ra_end > end && file->ra_end - end > file->ra_window / 2) {
+        return;
+    } else {
+        file->ra_window = LSFS_MIN(file->ra_window * 2, max);
+    }
+
+    uint64_t start = LSFS_MAX(file->ra_end, end);
+    uint64_t stop = LSFS_MIN(end + file->ra_window,
+                             LSFS_BLOCKS_FOR_SIZE(inode->disk_inode.size));
+    if (start >= stop) {
+        return;
+    }
+    file->ra_end = stop;
+
+    uint32_t count = (uint32_t)(stop - start);
+    uint64_t *addrs = malloc(count * sizeof(uint64_t));
+    if (!addrs || lsfs_inode_map_blocks(g_lsfs, inode, start, count, addrs) != LSFS_OK) {
+        free(addrs);
+        return;
+    }
+
+    uint64_t run_start = 0;
+    uint32_t run_len = 0;
+
+    for (uint32_t i = 0; i < count; i++) {
+        uint64_t block = LSFS_IS_PACKED(addrs[i]) ? LSFS_PACKED_BLOCK(addrs[i]) : addrs[i];
+
+        if (block == 0 || lsfs_segment_set_has_block(g_lsfs, buffered, block)) {
+            continue;
+        }
+        if (run_len > 0 && block >= run_start && block < run_start + run_len) {
+            continue;  /* Another slot of a packed block already queued */
+        }
+        if (run_len > 0 && block == run_start + run_len && run_len < LSFS_PREFETCH_MAX_BLOCKS) {
+            run_len++;
+            continue;
+        }
+        if (run_len > 0) {
+            lsfs_readahead(g_lsfs, run_start, run_len);
+        }
+        run_start = block;
+        run_len = 1;
+    }
+    if (run_len > 0) {
+        lsfs_readahead(g_lsfs, run_start, run_len);
+    }
+
+    free(addrs);
+}
+
 /*
  * FUSE read
+ *
+ * The requested range is mapped to disk addresses up front.  Runs of at
+ * least LSFS_READ_FD_MIN_BLOCKS physically contiguous blocks are handed to
+ * libfuse as fd-backed buffers, so the kernel can splice them straight from
+ * the image; holes, unflushed blocks, compressed blocks and short runs are
+ * copied through the segment buffer and buffer cache.  With O_DIRECT the image cannot be
+ * spliced, and when every read is verified the blocks have to be seen, so
+ * on-disk runs are read into memory as one batch instead.  The reply is
+ * sent with the inode lock held so GC cannot move the blocks underneath
+ * it.  Inline data is answered straight from the inode.  Sequential
+ * readers have the blocks after the request read ahead into the buffer
+ * cache, and blocks found there are copied rather than read again.
  */
+#define LSFS_READ_FD_MIN_BLOCKS 4
+
 static void lsfs_op_read(fuse_req_t req, fuse_ino_t ino, size_t size,
                          off_t off, struct fuse_file_info *fi)
 {
     struct lsfs_inode_mem *inode;
-    char *buf;
-    size_t bytes_read = 0;
-    (void)fi;
+    struct fuse_bufvec *bufv;
+    struct lsfs_io_req *reqs = NULL;
+    uint32_t nreqs = 0;
+    uint64_t *addrs;
+    uint8_t *mem = NULL;
+    struct lsfs_segment_set buffered;
+    bool direct = g_lsfs->direct_io || g_lsfs->verify_mode == LSFS_VERIFY_BLOCK;
+    struct lsfs_file *file = (struct lsfs_file *)(uintptr_t)fi->fh;
+    bool ahead = false;
 
     inode = get_inode(ino);
     if (!inode) {
@@ -299,7 +607,10 @@ static void lsfs_op_read(fuse_req_t req, fuse_ino_t ino, size_t size,
         return;
     }
 
-    if ((uint64_t)off >= inode->disk_inode.size) {
+    pthread_mutex_lock(&inode->lock);
+
+    if ((uint64_t)off >= inode->disk_inode.size || size == 0) {
+        pthread_mutex_unlock(&inode->lock);
         lsfs_inode_put(inode);
         fuse_reply_buf(req, NULL, 0);
         return;
@@ -309,45 +620,188 @@ static void lsfs_op_read(fuse_req_t req, fuse_ino_t ino, size_t size,
         size = inode->disk_inode.size - off;
     }
 
-    buf = malloc(size);
-    if (!buf) {
+    /* Inline data came in with the inode, so no block needs reading */
+    if (inode->disk_inode.flags & LSFS_INODE_INLINE_DATA) {
+        uint8_t *data = calloc(1, size);
+        if (data && (uint64_t)off < LSFS_INLINE_DATA_MAX) {
+            memcpy(data, inode->disk_inode.inline_data + off,
+                   LSFS_MIN(size, LSFS_INLINE_DATA_MAX - (uint64_t)off));
+        }
+        inode->disk_inode.atime = lsfs_get_time_ns();
+        if (data) {
+            fuse_reply_buf(req, (const char *)data, size);
+            lsfs_stats_add(g_lsfs, LSFS_CTR_USER_READ, size);
+        } else {
+            fuse_reply_err(req, ENOMEM);
+        }
+        pthread_mutex_unlock(&inode->lock);
+        lsfs_inode_put(inode);
+        free(data);
+        return;
+    }
+
+    uint64_t first_block = off / LSFS_BLOCK_SIZE;
+    uint32_t nblocks = (uint32_t)((off + size - 1) / LSFS_BLOCK_SIZE - first_block + 1);
+
+    addrs = malloc(nblocks * sizeof(uint64_t));
+    bufv = malloc(sizeof(*bufv) + nblocks * sizeof(struct fuse_buf));
+    if (direct) {
+        reqs = malloc(nblocks * sizeof(*reqs));
+    }
+    if (!addrs || !bufv || (direct && !reqs)) {
+        free(addrs);
+        free(bufv);
+        free(reqs);
+        pthread_mutex_unlock(&inode->lock);
         lsfs_inode_put(inode);
         fuse_reply_err(req, ENOMEM);
         return;
     }
 
-    uint8_t block_buf[LSFS_BLOCK_SIZE];
+    if (lsfs_inode_map_blocks(g_lsfs, inode, first_block, nblocks, addrs) != LSFS_OK) {
+        free(addrs);
+        free(bufv);
+        free(reqs);
+        pthread_mutex_unlock(&inode->lock);
+        lsfs_inode_put(inode);
+        fuse_reply_err(req, EIO);
+        return;
+    }
+
+    lsfs_segment_buffered(g_lsfs, &buffered);
+
+    if (file && g_lsfs->readahead_blocks > 0) {
+        read_ahead(inode, file, first_block, nblocks, &buffered);
+        ahead = file->ra_window > 0;
+    }
+
+    bufv->count = 0;
+    bufv->idx = 0;
+    bufv->off = 0;
+
+    uint32_t next;
+    bool failed = false;
+
+    for (uint32_t i = 0; i < nblocks; i = next) {
+        uint64_t addr = addrs[i];
+        bool on_disk = addr != 0 && !LSFS_IS_PACKED(addr) &&
+                       !lsfs_segment_set_has_block(g_lsfs, &buffered, addr) &&
+                       !(ahead && lsfs_buffer_cached(g_lsfs, addr));
+
+        /* Extend a contiguous on-disk run */
+        next = i + 1;
+        if (on_disk) {
+            while (next < nblocks && addrs[next] == addrs[next - 1] + 1 &&
+                   !lsfs_segment_set_has_block(g_lsfs, &buffered, addrs[next]) &&
+                   !(ahead && lsfs_buffer_cached(g_lsfs, addrs[next]))) {
+                next++;
+            }
+            if (!direct && next - i < LSFS_READ_FD_MIN_BLOCKS) {
+                next = i + 1;
+                on_disk = false;
+            }
+        }
+
+        /* Byte range of blocks [i, next) that falls inside the request */
+        uint64_t lo = LSFS_MAX((first_block + i) * LSFS_BLOCK_SIZE, (uint64_t)off);
+        uint64_t hi = LSFS_MIN((first_block + next) * LSFS_BLOCK_SIZE, (uint64_t)off + size);
+        struct fuse_buf *last = bufv->count ? &bufv->buf[bufv->count - 1] : NULL;
+
+        if (on_disk && !direct) {
+            struct fuse_buf *fb = &bufv->buf[bufv->count++];
+            fb->size = hi - lo;
+            fb->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK | FUSE_BUF_FD_RETRY;
+            fb->mem = NULL;
+            fb->fd = g_lsfs->fd;
+            fb->pos = (off_t)(addr * LSFS_BLOCK_SIZE + lo % LSFS_BLOCK_SIZE);
+            continue;
+        }
+
+        /* Whole blocks are read into a block-aligned buffer */
+        if (!mem) {
+            mem = lsfs_io_alloc((size_t)nblocks * LSFS_BLOCK_SIZE);
+            if (!mem) {
+                failed = true;
+                break;
+            }
+        }
 
-    while (bytes_read < size) {
-        uint64_t block_idx = (off + bytes_read) / LSFS_BLOCK_SIZE;
-        uint32_t block_off = (off + bytes_read) % LSFS_BLOCK_SIZE;
-        size_t to_read = LSFS_MIN(LSFS_BLOCK_SIZE - block_off, size - bytes_read);
+        uint8_t *blocks = mem + (size_t)i * LSFS_BLOCK_SIZE;
+        uint8_t *dst = mem + (lo - first_block * LSFS_BLOCK_SIZE);
+        if (on_disk) {
+            reqs[nreqs].block = addr;
+            reqs[nreqs].count = next - i;
+            reqs[nreqs].buf = blocks;
+            nreqs++;
+        } else if (addr != 0) {
+            if (lsfs_segment_read_block(g_lsfs, addr, blocks) != LSFS_OK) {
+                failed = true;
+                break;
+            }
+        }
 
-        if (lsfs_inode_read_block(g_lsfs, inode, block_idx, block_buf) != LSFS_OK) {
-            break;
+        /* Merge with the previous memory buffer when adjacent */
+        if (last && !(last->flags & FUSE_BUF_IS_FD) &&
+            (uint8_t *)last->mem + last->size == dst) {
+            last->size += hi - lo;
+        } else {
+            struct fuse_buf *fb = &bufv->buf[bufv->count++];
+            fb->size = hi - lo;
+            fb->flags = 0;
+            fb->mem = dst;
+            fb->fd = -1;
+            fb->pos = 0;
         }
+    }
 
-        memcpy(buf + bytes_read, block_buf + block_off, to_read);
-        bytes_read += to_read;
+    /* A block that could not be read, or any failed batched run, fails the
+     * whole reply rather than returning it short */
+    if (!failed) {
+        failed = lsfs_read_batch(g_lsfs, reqs, nreqs) != LSFS_OK;
+    }
+    if (g_lsfs->verify_mode == LSFS_VERIFY_BLOCK) {
+        for (uint32_t r = 0; r < nreqs && !failed; r++) {
+            failed = lsfs_segment_verify_blocks(g_lsfs, reqs[r].block, reqs[r].count,
+                                                reqs[r].buf) != LSFS_OK;
+        }
     }
 
     /* Update atime */
     inode->disk_inode.atime = lsfs_get_time_ns();
 
+    if (failed || bufv->count == 0) {
+        fuse_reply_err(req, EIO);
+    } else {
+        fuse_reply_data(req, bufv, FUSE_BUF_SPLICE_MOVE);
+        lsfs_stats_add(g_lsfs, LSFS_CTR_USER_READ, size);
+    }
+
+    pthread_mutex_unlock(&inode->lock);
     lsfs_inode_put(inode);
-    fuse_reply_buf(req, buf, bytes_read);
-    free(buf);
+
+    free(mem);
+    free(reqs);
+    free(addrs);
+    free(bufv);
 }
 
 /*
- * FUSE write
+ * Write a request payload to an inode and reply
+ * The space preallocated through the file is handed to the append path
+ * as a credit for the write, so its blocks can use the segments the file
+ * holds and are taken off the promise as they are reserved; what the
+ * write does not use stays promised to the file.  If free segments are
+ * down to the reserve, the cleaner is waited for before the inode lock
+ * is taken.
  */
-static void lsfs_op_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
-                          size_t size, off_t off, struct fuse_file_info *fi)
+static void do_write(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *src,
+                     off_t off, struct fuse_file_info *fi)
 {
+    struct lsfs_file *file = (struct lsfs_file *)(uintptr_t)fi->fh;
     struct lsfs_inode_mem *inode;
-    size_t bytes_written = 0;
-    (void)fi;
+    size_t size = fuse_buf_size(src);
+    uint64_t promised = 0;
+    ssize_t bytes_written;
 
     inode = get_inode(ino);
     if (!inode) {
@@ -355,45 +809,66 @@ static void lsfs_op_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
         return;
     }
 
+    lsfs_segment_wait_space(g_lsfs);
     pthread_mutex_lock(&inode->lock);
 
-    uint8_t block_buf[LSFS_BLOCK_SIZE];
-
-    while (bytes_written < size) {
-        uint64_t block_idx = (off + bytes_written) / LSFS_BLOCK_SIZE;
-        uint32_t block_off = (off + bytes_written) % LSFS_BLOCK_SIZE;
-        size_t to_write = LSFS_MIN(LSFS_BLOCK_SIZE - block_off, size - bytes_written);
-
-        /* If partial block write, read existing block first */
-        if (to_write < LSFS_BLOCK_SIZE) {
-            if (lsfs_inode_read_block(g_lsfs, inode, block_idx, block_buf) != LSFS_OK) {
-                memset(block_buf, 0, LSFS_BLOCK_SIZE);
-            }
-        }
-
-        memcpy(block_buf + block_off, buf + bytes_written, to_write);
-
-        if (lsfs_inode_write_block(g_lsfs, inode, block_idx, block_buf) != LSFS_OK) {
-            break;
-        }
+    if (file && file->prealloc > 0 && size > 0) {
+        promised = file->prealloc;
+        file->prealloc = 0;
+        lsfs_segment_set_promised(promised);
+    }
 
-        bytes_written += to_write;
+    bytes_written = lsfs_inode_write_data(g_lsfs, inode, (uint64_t)off, size, src,
+                                          LSFS_STREAM_DATA);
+    if (promised > 0) {
+        file->prealloc = lsfs_segment_set_promised(0);
+    }
+    if (bytes_written < 0) {
+        pthread_mutex_unlock(&inode->lock);
+        lsfs_inode_put(inode);
+        fuse_reply_err(req, bytes_written == LSFS_ERR_NOSPC ? ENOSPC : EIO);
+        return;
     }
 
     /* Update size and times */
-    if ((uint64_t)(off + bytes_written) > inode->disk_inode.size) {
-        inode->disk_inode.size = off + bytes_written;
+    if ((uint64_t)off + (uint64_t)bytes_written > inode->disk_inode.size) {
+        inode->disk_inode.size = (uint64_t)off + (uint64_t)bytes_written;
     }
     inode->disk_inode.mtime = lsfs_get_time_ns();
     inode->disk_inode.ctime = inode->disk_inode.mtime;
-    inode->dirty = true;
 
-    lsfs_inode_write(g_lsfs, inode);
+    /* The inode and its extent map are written back at fsync,
+     * checkpoint or eviction rather than on every write */
+    inode->dirty = true;
 
     pthread_mutex_unlock(&inode->lock);
     lsfs_inode_put(inode);
 
-    fuse_reply_write(req, bytes_written);
+    lsfs_stats_add(g_lsfs, LSFS_CTR_USER_WRITE, (uint64_t)bytes_written);
+    fuse_reply_write(req, (size_t)bytes_written);
+}
+
+/*
+ * FUSE write
+ */
+static void lsfs_op_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
+                          size_t size, off_t off, struct fuse_file_info *fi)
+{
+    struct fuse_bufvec src = FUSE_BUFVEC_INIT(size);
+
+    src.buf[0].mem = (void *)buf;
+    do_write(req, ino, &src, off, fi);
+}
+
+/*
+ * FUSE write_buf
+ * The payload may still sit in a pipe when splicing; it is copied into the
+ * segment buffer without an intermediate request buffer.
+ */
+static void lsfs_op_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv,
+                              off_t off, struct fuse_file_info *fi)
+{
+    do_write(req, ino, bufv, off, fi);
 }
 
 /*
@@ -406,16 +881,23 @@ static void lsfs_op_create(fuse_req_t req, fuse_ino_t parent, const char *name,
     struct lsfs_inode_mem *new_inode;
     struct fuse_entry_param e;
 
+    pthread_rwlock_rdlock(&g_lsfs->fs_lock);
+
     parent_inode = get_inode(parent);
     if (!parent_inode) {
+        pthread_rwlock_unlock(&g_lsfs->fs_lock);
         fuse_reply_err(req, ENOENT);
         return;
     }
 
     /* Check if file already exists */
     uint32_t existing_ino;
-    if (lsfs_dir_lookup(g_lsfs, parent_inode, name, &existing_ino, NULL) == LSFS_OK) {
+    pthread_mutex_lock(&parent_inode->lock);
+    bool exists = lsfs_dir_lookup(g_lsfs, parent_inode, name, &existing_ino, NULL) == LSFS_OK;
+    pthread_mutex_unlock(&parent_inode->lock);
+    if (exists) {
         lsfs_inode_put(parent_inode);
+        pthread_rwlock_unlock(&g_lsfs->fs_lock);
         fuse_reply_err(req, EEXIST);
         return;
     }
@@ -424,34 +906,54 @@ static void lsfs_op_create(fuse_req_t req, fuse_ino_t parent, const char *name,
     new_inode = lsfs_inode_alloc(g_lsfs, S_IFREG | (mode & 0777));
     if (!new_inode) {
         lsfs_inode_put(parent_inode);
+        pthread_rwlock_unlock(&g_lsfs->fs_lock);
         fuse_reply_err(req, ENOSPC);
         return;
     }
 
-    /* Add to parent directory */
-    if (lsfs_dir_add(g_lsfs, parent_inode, name, new_inode->disk_inode.ino,
-                     LSFS_FT_REG_FILE) != LSFS_OK) {
-        lsfs_inode_free(g_lsfs, new_inode);
-        lsfs_inode_put(new_inode);
-        lsfs_inode_put(parent_inode);
-        fuse_reply_err(req, EIO);
-        return;
-    }
-
-    /* Write inode and parent */
+    /*
+     * Writeback can reach the inode as soon as it is cached, so it is set
+     * up under its own lock, and written before the entry that names it.
+     */
+    pthread_mutex_lock(&new_inode->lock);
     lsfs_inode_write(g_lsfs, new_inode);
-    lsfs_inode_write(g_lsfs, parent_inode);
-
     memset(&e, 0, sizeof(e));
     e.ino = new_inode->disk_inode.ino;
-    e.attr_timeout = 1.0;
-    e.entry_timeout = 1.0;
+    e.attr_timeout = g_lsfs->attr_timeout;
+    e.entry_timeout = g_lsfs->entry_timeout;
     lsfs_inode_to_stat(new_inode, &e.attr);
     e.generation = new_inode->disk_inode.generation;
+    pthread_mutex_unlock(&new_inode->lock);
+
+    /* Add to parent directory, unless someone else got there first */
+    int err = 0;
+    pthread_mutex_lock(&parent_inode->lock);
+    if (lsfs_dir_lookup(g_lsfs, parent_inode, name, &existing_ino, NULL) == LSFS_OK) {
+        err = EEXIST;
+    } else if (lsfs_dir_add(g_lsfs, parent_inode, name, (uint32_t)e.ino,
+                            LSFS_FT_REG_FILE) != LSFS_OK) {
+        err = EIO;
+    } else {
+        lsfs_inode_write(g_lsfs, parent_inode);
+    }
+    pthread_mutex_unlock(&parent_inode->lock);
+
+    if (err) {
+        pthread_mutex_lock(&new_inode->lock);
+        lsfs_inode_free(g_lsfs, new_inode);
+        pthread_mutex_unlock(&new_inode->lock);
+    }
 
     lsfs_inode_put(new_inode);
     lsfs_inode_put(parent_inode);
+    pthread_rwlock_unlock(&g_lsfs->fs_lock);
+
+    if (err) {
+        fuse_reply_err(req, err);
+        return;
+    }
 
+    fi->fh = file_open(fi->flags);
     fuse_reply_create(req, &e, fi);
 }
 
@@ -465,16 +967,23 @@ static void lsfs_op_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
     struct lsfs_inode_mem *new_inode;
     struct fuse_entry_param e;
 
+    pthread_rwlock_rdlock(&g_lsfs->fs_lock);
+
     parent_inode = get_inode(parent);
     if (!parent_inode) {
+        pthread_rwlock_unlock(&g_lsfs->fs_lock);
         fuse_reply_err(req, ENOENT);
         return;
     }
 
     /* Check if already exists */
     uint32_t existing_ino;
-    if (lsfs_dir_lookup(g_lsfs, parent_inode, name, &existing_ino, NULL) == LSFS_OK) {
+    pthread_mutex_lock(&parent_inode->lock);
+    bool exists = lsfs_dir_lookup(g_lsfs, parent_inode, name, &existing_ino, NULL) == LSFS_OK;
+    pthread_mutex_unlock(&parent_inode->lock);
+    if (exists) {
         lsfs_inode_put(parent_inode);
+        pthread_rwlock_unlock(&g_lsfs->fs_lock);
         fuse_reply_err(req, EEXIST);
         return;
     }
@@ -483,280 +992,381 @@ static void lsfs_op_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
     new_inode = lsfs_inode_alloc(g_lsfs, S_IFDIR | (mode & 0777));
     if (!new_inode) {
         lsfs_inode_put(parent_inode);
+        pthread_rwlock_unlock(&g_lsfs->fs_lock);
         fuse_reply_err(req, ENOSPC);
         return;
     }
 
-    /* Initialize directory with . and .. */
+    /* Initialize directory with . and .., under its own lock as in create */
+    int err = 0;
     uint32_t parent_ino = (parent == FUSE_ROOT_ID) ? LSFS_ROOT_INO : (uint32_t)parent;
+    pthread_mutex_lock(&new_inode->lock);
     if (lsfs_dir_init(g_lsfs, new_inode, parent_ino) != LSFS_OK) {
         lsfs_inode_free(g_lsfs, new_inode);
+        err = EIO;
+    } else {
+        lsfs_inode_write(g_lsfs, new_inode);
+        memset(&e, 0, sizeof(e));
+        e.ino = new_inode->disk_inode.ino;
+        e.attr_timeout = g_lsfs->attr_timeout;
+        e.entry_timeout = g_lsfs->entry_timeout;
+        lsfs_inode_to_stat(new_inode, &e.attr);
+        e.generation = new_inode->disk_inode.generation;
+    }
+    pthread_mutex_unlock(&new_inode->lock);
+
+    if (err) {
         lsfs_inode_put(new_inode);
         lsfs_inode_put(parent_inode);
-        fuse_reply_err(req, EIO);
+        pthread_rwlock_unlock(&g_lsfs->fs_lock);
+        fuse_reply_err(req, err);
         return;
     }
 
-    /* Add to parent directory */
-    if (lsfs_dir_add(g_lsfs, parent_inode, name, new_inode->disk_inode.ino,
-                     LSFS_FT_DIR) != LSFS_OK) {
+    /* Add to parent directory, unless someone else got there first */
+    pthread_mutex_lock(&parent_inode->lock);
+    if (lsfs_dir_lookup(g_lsfs, parent_inode, name, &existing_ino, NULL) == LSFS_OK) {
+        err = EEXIST;
+    } else if (lsfs_dir_add(g_lsfs, parent_inode, name, (uint32_t)e.ino,
+                            LSFS_FT_DIR) != LSFS_OK) {
+        err = EIO;
+    } else {
+        /* Increment parent link count for .. */
+        parent_inode->disk_inode.nlink++;
+        parent_inode->dirty = true;
+        lsfs_inode_write(g_lsfs, parent_inode);
+    }
+    pthread_mutex_unlock(&parent_inode->lock);
+
+    if (err) {
+        pthread_mutex_lock(&new_inode->lock);
         lsfs_inode_free(g_lsfs, new_inode);
-        lsfs_inode_put(new_inode);
-        lsfs_inode_put(parent_inode);
-        fuse_reply_err(req, EIO);
-        return;
+        pthread_mutex_unlock(&new_inode->lock);
     }
 
-    /* Increment parent link count for .. */
-    parent_inode->disk_inode.nlink++;
-    parent_inode->dirty = true;
+    lsfs_inode_put(new_inode);
+    lsfs_inode_put(parent_inode);
+    pthread_rwlock_unlock(&g_lsfs->fs_lock);
 
-    /* Write inodes */
-    lsfs_inode_write(g_lsfs, new_inode);
-    lsfs_inode_write(g_lsfs, parent_inode);
-
-    memset(&e, 0, sizeof(e));
-    e.ino = new_inode->disk_inode.ino;
-    e.attr_timeout = 1.0;
-    e.entry_timeout = 1.0;
-    lsfs_inode_to_stat(new_inode, &e.attr);
-    e.generation = new_inode->disk_inode.generation;
-
-    lsfs_inode_put(new_inode);
-    lsfs_inode_put(parent_inode);
+    if (err) {
+        fuse_reply_err(req, err);
+        return;
+    }
 
     fuse_reply_entry(req, &e);
 }
 
 /*
  * FUSE unlink
+ * The parent is locked before its entries are read: the cleaner and
+ * checkpoint writeback change extent maps holding only the inode lock.
  */
 static void lsfs_op_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
 {
     struct lsfs_inode_mem *parent_inode;
     struct lsfs_inode_mem *file_inode;
     uint32_t file_ino;
+    int err = 0;
+
+    pthread_rwlock_wrlock(&g_lsfs->fs_lock);
 
     parent_inode = get_inode(parent);
     if (!parent_inode) {
+        pthread_rwlock_unlock(&g_lsfs->fs_lock);
         fuse_reply_err(req, ENOENT);
         return;
     }
 
+    pthread_mutex_lock(&parent_inode->lock);
+
     if (lsfs_dir_lookup(g_lsfs, parent_inode, name, &file_ino, NULL) != LSFS_OK) {
-        lsfs_inode_put(parent_inode);
-        fuse_reply_err(req, ENOENT);
-        return;
+        err = ENOENT;
     }
 
-    file_inode = lsfs_inode_get(g_lsfs, file_ino);
-    if (!file_inode) {
-        lsfs_inode_put(parent_inode);
-        fuse_reply_err(req, ENOENT);
-        return;
+    file_inode = err ? NULL : lsfs_inode_get(g_lsfs, file_ino);
+    if (!err && !file_inode) {
+        err = ENOENT;
+    } else if (!err && S_ISDIR(file_inode->disk_inode.mode)) {
+        /* Can't unlink directories (the file type never changes) */
+        err = EISDIR;
     }
 
-    /* Can't unlink directories */
-    if (S_ISDIR(file_inode->disk_inode.mode)) {
-        lsfs_inode_put(file_inode);
+    if (err) {
+        pthread_mutex_unlock(&parent_inode->lock);
+        if (file_inode) {
+            lsfs_inode_put(file_inode);
+        }
         lsfs_inode_put(parent_inode);
-        fuse_reply_err(req, EISDIR);
+        pthread_rwlock_unlock(&g_lsfs->fs_lock);
+        fuse_reply_err(req, err);
         return;
     }
 
+    pthread_mutex_lock(&file_inode->lock);
+
     /* Remove from directory */
     if (lsfs_dir_remove(g_lsfs, parent_inode, name) != LSFS_OK) {
-        lsfs_inode_put(file_inode);
-        lsfs_inode_put(parent_inode);
-        fuse_reply_err(req, EIO);
-        return;
-    }
-
-    /* Decrement link count */
-    file_inode->disk_inode.nlink--;
-    file_inode->disk_inode.ctime = lsfs_get_time_ns();
-
-    if (file_inode->disk_inode.nlink == 0) {
-        lsfs_inode_free(g_lsfs, file_inode);
+        err = EIO;
     } else {
-        file_inode->dirty = true;
-        lsfs_inode_write(g_lsfs, file_inode);
+        /* Decrement link count */
+        file_inode->disk_inode.nlink--;
+        file_inode->disk_inode.ctime = lsfs_get_time_ns();
+
+        if (file_inode->disk_inode.nlink == 0) {
+            lsfs_inode_free(g_lsfs, file_inode);
+        } else {
+            file_inode->dirty = true;
+            lsfs_inode_write(g_lsfs, file_inode);
+        }
+
+        lsfs_inode_write(g_lsfs, parent_inode);
     }
 
-    lsfs_inode_write(g_lsfs, parent_inode);
+    pthread_mutex_unlock(&file_inode->lock);
+    pthread_mutex_unlock(&parent_inode->lock);
 
     lsfs_inode_put(file_inode);
     lsfs_inode_put(parent_inode);
+    pthread_rwlock_unlock(&g_lsfs->fs_lock);
 
-    fuse_reply_err(req, 0);
+    fuse_reply_err(req, err);
 }
 
 /*
  * FUSE rmdir
+ * Both directories are locked before their entries are read, the parent
+ * first, as in unlink.
  */
 static void lsfs_op_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
 {
     struct lsfs_inode_mem *parent_inode;
     struct lsfs_inode_mem *dir_inode;
     uint32_t dir_ino;
+    int err = 0;
+
+    pthread_rwlock_wrlock(&g_lsfs->fs_lock);
 
     parent_inode = get_inode(parent);
     if (!parent_inode) {
+        pthread_rwlock_unlock(&g_lsfs->fs_lock);
         fuse_reply_err(req, ENOENT);
         return;
     }
 
+    pthread_mutex_lock(&parent_inode->lock);
+
     if (lsfs_dir_lookup(g_lsfs, parent_inode, name, &dir_ino, NULL) != LSFS_OK) {
-        lsfs_inode_put(parent_inode);
-        fuse_reply_err(req, ENOENT);
-        return;
+        err = ENOENT;
     }
 
-    dir_inode = lsfs_inode_get(g_lsfs, dir_ino);
-    if (!dir_inode) {
-        lsfs_inode_put(parent_inode);
-        fuse_reply_err(req, ENOENT);
-        return;
+    dir_inode = err ? NULL : lsfs_inode_get(g_lsfs, dir_ino);
+    if (!err && !dir_inode) {
+        err = ENOENT;
+    } else if (!err && !S_ISDIR(dir_inode->disk_inode.mode)) {
+        err = ENOTDIR;
+    } else if (!err && dir_inode == parent_inode) {
+        err = EINVAL;  /* "." */
     }
 
-    if (!S_ISDIR(dir_inode->disk_inode.mode)) {
-        lsfs_inode_put(dir_inode);
-        lsfs_inode_put(parent_inode);
-        fuse_reply_err(req, ENOTDIR);
-        return;
+    if (!err) {
+        pthread_mutex_lock(&dir_inode->lock);
+        if (lsfs_dir_is_empty(g_lsfs, dir_inode) != LSFS_OK) {
+            pthread_mutex_unlock(&dir_inode->lock);
+            err = ENOTEMPTY;
+        }
     }
 
-    if (lsfs_dir_is_empty(g_lsfs, dir_inode) != LSFS_OK) {
-        lsfs_inode_put(dir_inode);
+    if (err) {
+        pthread_mutex_unlock(&parent_inode->lock);
+        if (dir_inode) {
+            lsfs_inode_put(dir_inode);
+        }
         lsfs_inode_put(parent_inode);
-        fuse_reply_err(req, ENOTEMPTY);
+        pthread_rwlock_unlock(&g_lsfs->fs_lock);
+        fuse_reply_err(req, err);
         return;
     }
 
     /* Remove from parent */
     if (lsfs_dir_remove(g_lsfs, parent_inode, name) != LSFS_OK) {
-        lsfs_inode_put(dir_inode);
-        lsfs_inode_put(parent_inode);
-        fuse_reply_err(req, EIO);
-        return;
-    }
+        err = EIO;
+    } else {
+        /* Decrement parent link count for .. */
+        parent_inode->disk_inode.nlink--;
+        parent_inode->dirty = true;
 
-    /* Decrement parent link count for .. */
-    parent_inode->disk_inode.nlink--;
-    parent_inode->dirty = true;
+        /* Free the directory inode */
+        lsfs_inode_free(g_lsfs, dir_inode);
 
-    /* Free the directory inode */
-    lsfs_inode_free(g_lsfs, dir_inode);
+        lsfs_inode_write(g_lsfs, parent_inode);
+    }
 
-    lsfs_inode_write(g_lsfs, parent_inode);
+    pthread_mutex_unlock(&dir_inode->lock);
+    pthread_mutex_unlock(&parent_inode->lock);
 
     lsfs_inode_put(dir_inode);
     lsfs_inode_put(parent_inode);
+    pthread_rwlock_unlock(&g_lsfs->fs_lock);
 
-    fuse_reply_err(req, 0);
+    fuse_reply_err(req, err);
 }
 
 /*
- * FUSE rename
+ * Rename helper, called with the namespace lock held exclusively and both
+ * parent inodes locked
  */
-static void lsfs_op_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
-                           fuse_ino_t newparent, const char *newname,
-                           unsigned int flags)
+static int rename_locked(struct lsfs_inode_mem *old_parent_inode, const char *name,
+                         struct lsfs_inode_mem *new_parent_inode, const char *newname)
 {
-    struct lsfs_inode_mem *old_parent_inode;
-    struct lsfs_inode_mem *new_parent_inode = NULL;
-    struct lsfs_inode_mem *target_inode;
     uint32_t target_ino;
     uint8_t file_type;
-    (void)flags;
-
-    old_parent_inode = get_inode(parent);
-    if (!old_parent_inode) {
-        fuse_reply_err(req, ENOENT);
-        return;
-    }
-
-    if (parent != newparent) {
-        new_parent_inode = get_inode(newparent);
-        if (!new_parent_inode) {
-            lsfs_inode_put(old_parent_inode);
-            fuse_reply_err(req, ENOENT);
-            return;
-        }
-    } else {
-        new_parent_inode = old_parent_inode;
-    }
+    int err = 0;
 
     /* Lookup source */
     if (lsfs_dir_lookup(g_lsfs, old_parent_inode, name, &target_ino, &file_type) != LSFS_OK) {
-        if (parent != newparent) {
-            lsfs_inode_put(new_parent_inode);
-        }
-        lsfs_inode_put(old_parent_inode);
-        fuse_reply_err(req, ENOENT);
-        return;
+        return ENOENT;
     }
 
     /* Check if destination exists */
     uint32_t dest_ino;
     uint8_t dest_type;
     if (lsfs_dir_lookup(g_lsfs, new_parent_inode, newname, &dest_ino, &dest_type) == LSFS_OK) {
-        /* Remove existing destination */
+        if (dest_ino == target_ino) {
+            return 0;  /* Same file, nothing to do */
+        }
+
+        /* Remove existing destination, locked before its entries are read.
+         * Parents are already locked; the kernel rejects renames onto them */
         struct lsfs_inode_mem *dest_inode = lsfs_inode_get(g_lsfs, dest_ino);
         if (dest_inode) {
-            if (S_ISDIR(dest_inode->disk_inode.mode)) {
-                if (lsfs_dir_is_empty(g_lsfs, dest_inode) != LSFS_OK) {
-                    lsfs_inode_put(dest_inode);
-                    if (parent != newparent) {
-                        lsfs_inode_put(new_parent_inode);
-                    }
-                    lsfs_inode_put(old_parent_inode);
-                    fuse_reply_err(req, ENOTEMPTY);
-                    return;
-                }
+            pthread_mutex_lock(&dest_inode->lock);
+            bool dest_dir = S_ISDIR(dest_inode->disk_inode.mode);
+            if (dest_dir != (file_type == LSFS_FT_DIR)) {
+                err = dest_dir ? EISDIR : ENOTDIR;
+            } else if (dest_dir && lsfs_dir_is_empty(g_lsfs, dest_inode) != LSFS_OK) {
+                err = ENOTEMPTY;
+            }
+            if (err) {
+                pthread_mutex_unlock(&dest_inode->lock);
+                lsfs_inode_put(dest_inode);
+                return err;
             }
             lsfs_dir_remove(g_lsfs, new_parent_inode, newname);
-            dest_inode->disk_inode.nlink--;
-            if (dest_inode->disk_inode.nlink == 0) {
+
+            if (dest_dir) {
+                /* Its "." link goes with it, as does its ".." link to the parent */
+                new_parent_inode->disk_inode.nlink--;
                 lsfs_inode_free(g_lsfs, dest_inode);
+            } else {
+                dest_inode->disk_inode.nlink--;
+                dest_inode->disk_inode.ctime = lsfs_get_time_ns();
+                if (dest_inode->disk_inode.nlink == 0) {
+                    lsfs_inode_free(g_lsfs, dest_inode);
+                } else {
+                    dest_inode->dirty = true;
+                    lsfs_inode_write(g_lsfs, dest_inode);
+                }
             }
+            pthread_mutex_unlock(&dest_inode->lock);
             lsfs_inode_put(dest_inode);
         }
     }
 
     /* Add new entry */
     if (lsfs_dir_add(g_lsfs, new_parent_inode, newname, target_ino, file_type) != LSFS_OK) {
-        if (parent != newparent) {
-            lsfs_inode_put(new_parent_inode);
-        }
-        lsfs_inode_put(old_parent_inode);
-        fuse_reply_err(req, EIO);
-        return;
+        return EIO;
     }
 
     /* Remove old entry */
     lsfs_dir_remove(g_lsfs, old_parent_inode, name);
 
-    /* Update .. if directory moved to different parent */
-    if (parent != newparent && file_type == LSFS_FT_DIR) {
-        target_inode = lsfs_inode_get(g_lsfs, target_ino);
-        if (target_inode) {
-            /* This is simplified - would need to update .. entry in directory */
-            old_parent_inode->disk_inode.nlink--;
-            new_parent_inode->disk_inode.nlink++;
-            lsfs_inode_put(target_inode);
+    /* Point .. at the new parent if a directory moved; the kernel never
+     * moves a directory under itself, so it is neither parent */
+    if (old_parent_inode != new_parent_inode && file_type == LSFS_FT_DIR) {
+        struct lsfs_inode_mem *moved = lsfs_inode_get(g_lsfs, target_ino);
+        if (!moved) {
+            err = EIO;
+        } else {
+            pthread_mutex_lock(&moved->lock);
+            if (lsfs_dir_set_parent(g_lsfs, moved, new_parent_inode->disk_inode.ino) != LSFS_OK) {
+                err = EIO;
+            }
+            lsfs_inode_write(g_lsfs, moved);
+            pthread_mutex_unlock(&moved->lock);
+            lsfs_inode_put(moved);
         }
+        old_parent_inode->disk_inode.nlink--;
+        new_parent_inode->disk_inode.nlink++;
     }
 
     /* Write changes */
     lsfs_inode_write(g_lsfs, old_parent_inode);
-    if (parent != newparent) {
+    if (old_parent_inode != new_parent_inode) {
         lsfs_inode_write(g_lsfs, new_parent_inode);
+    }
+
+    return err;
+}
+
+/*
+ * FUSE rename
+ */
+static void lsfs_op_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+                           fuse_ino_t newparent, const char *newname,
+                           unsigned int flags)
+{
+    struct lsfs_inode_mem *old_parent_inode;
+    struct lsfs_inode_mem *new_parent_inode = NULL;
+    int err;
+
+    /* RENAME_NOREPLACE and RENAME_EXCHANGE are not supported */
+    if (flags != 0) {
+        fuse_reply_err(req, EINVAL);
+        return;
+    }
+
+    pthread_rwlock_wrlock(&g_lsfs->fs_lock);
+
+    old_parent_inode = get_inode(parent);
+    if (!old_parent_inode) {
+        pthread_rwlock_unlock(&g_lsfs->fs_lock);
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+
+    if (parent != newparent) {
+        new_parent_inode = get_inode(newparent);
+        if (!new_parent_inode) {
+            lsfs_inode_put(old_parent_inode);
+            pthread_rwlock_unlock(&g_lsfs->fs_lock);
+            fuse_reply_err(req, ENOENT);
+            return;
+        }
+    } else {
+        new_parent_inode = old_parent_inode;
+    }
+
+    /*
+     * Holding fs_lock exclusively, nobody else can hold two inode locks,
+     * so the parents can be locked in any order.
+     */
+    pthread_mutex_lock(&old_parent_inode->lock);
+    if (new_parent_inode != old_parent_inode) {
+        pthread_mutex_lock(&new_parent_inode->lock);
+    }
+
+    err = rename_locked(old_parent_inode, name, new_parent_inode, newname);
+
+    if (new_parent_inode != old_parent_inode) {
+        pthread_mutex_unlock(&new_parent_inode->lock);
         lsfs_inode_put(new_parent_inode);
     }
+    pthread_mutex_unlock(&old_parent_inode->lock);
     lsfs_inode_put(old_parent_inode);
 
-    fuse_reply_err(req, 0);
+    pthread_rwlock_unlock(&g_lsfs->fs_lock);
+
+    fuse_reply_err(req, err);
 }
 
 /*
@@ -765,17 +1375,25 @@ static void lsfs_op_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
 static void lsfs_op_statfs(fuse_req_t req, fuse_ino_t ino)
 {
     struct statvfs st;
+    uint64_t free_segments;
+    uint64_t inode_count;
     (void)ino;
 
+    /* Both counters are updated under the segment table lock */
+    pthread_mutex_lock(&g_lsfs->segtable.lock);
+    free_segments = g_lsfs->sb.free_segments;
+    inode_count = g_lsfs->sb.inode_count;
+    pthread_mutex_unlock(&g_lsfs->segtable.lock);
+
     memset(&st, 0, sizeof(st));
 
     st.f_bsize = LSFS_BLOCK_SIZE;
     st.f_frsize = LSFS_BLOCK_SIZE;
     st.f_blocks = g_lsfs->sb.total_blocks;
-    st.f_bfree = g_lsfs->sb.free_segments * LSFS_SEGMENT_BLOCKS;
+    st.f_bfree = free_segments * g_lsfs->segtable.segment_blocks;
     st.f_bavail = st.f_bfree;
-    st.f_files = LSFS_MAX_INODES;
-    st.f_ffree = LSFS_MAX_INODES - g_lsfs->sb.inode_count;
+    st.f_files = g_lsfs->sb.max_inodes;
+    st.f_ffree = g_lsfs->sb.max_inodes - inode_count;
     st.f_favail = st.f_ffree;
     st.f_namemax = LSFS_NAME_MAX;
 
@@ -788,34 +1406,366 @@ static void lsfs_op_statfs(fuse_req_t req, fuse_ino_t ino)
 static void lsfs_op_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
                           struct fuse_file_info *fi)
 {
-    (void)ino;
+    struct lsfs_inode_mem *inode;
+    int ret = LSFS_OK;
     (void)datasync;
     (void)fi;
 
-    lsfs_segment_flush(g_lsfs);
-    lsfs_sync(g_lsfs);
+    /* Write back the inode and its pending extent blocks */
+    inode = get_inode(ino);
+    if (inode) {
+        pthread_mutex_lock(&inode->lock);
+        ret = lsfs_inode_write(g_lsfs, inode);
+        pthread_mutex_unlock(&inode->lock);
+        lsfs_inode_put(inode);
+    }
+
+    /* Concurrent fsyncs share one segment flush and device sync */
+    if (ret == LSFS_OK) {
+        ret = lsfs_group_commit(g_lsfs);
+    }
+
+    if (ret == LSFS_ERR_NOSPC) {
+        fuse_reply_err(req, ENOSPC);
+    } else {
+        fuse_reply_err(req, ret == LSFS_OK ? 0 : EIO);
+    }
+}
+
+/*
+ * Count the blocks from first up to end that have nothing in the log
+ * Inline data counts as a hole, since it moves to the log once the file
+ * outgrows the inode.  Caller must hold the inode lock.
+ */
+#define LSFS_FALLOCATE_MAP_BLOCKS 256
+
+static int count_holes(struct lsfs_inode_mem *inode, uint64_t first, uint64_t end,
+                       uint64_t *holes)
+{
+    uint64_t addrs[LSFS_FALLOCATE_MAP_BLOCKS];
+
+    *holes = 0;
+    if (inode->disk_inode.flags & LSFS_INODE_INLINE_DATA) {
+        *holes = end - first;
+        return LSFS_OK;
+    }
+
+    for (uint64_t block = first; block < end; ) {
+        uint32_t n = (uint32_t)LSFS_MIN(end - block, LSFS_FALLOCATE_MAP_BLOCKS);
+        int ret = lsfs_inode_map_blocks(g_lsfs, inode, block, n, addrs);
+        if (ret != LSFS_OK) {
+            return ret;
+        }
+        for (uint32_t i = 0; i < n; i++) {
+            *holes += addrs[i] == 0;
+        }
+        block += n;
+    }
+
+    return LSFS_OK;
+}
+
+/*
+ * FUSE fallocate
+ *
+ * Blocks are never allocated in place in a log, so preallocating a range
+ * promises log space instead: one block for every hole in it, held for
+ * writes through this open file until it is closed.  Other file data
+ * cannot use the segments promised, and the cleaner frees them before
+ * the writes arrive, so a large ingest of known size neither runs out of
+ * space nor has to wait for the cleaner halfway through.  Only plain
+ * preallocation is supported, with or without FALLOC_FL_KEEP_SIZE.
+ */
+static void lsfs_op_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset,
+                              off_t length, struct fuse_file_info *fi)
+{
+    struct lsfs_file *file = (struct lsfs_file *)(uintptr_t)fi->fh;
+    struct lsfs_inode_mem *inode;
+    uint64_t holes;
+    int ret;
+
+    if (mode & ~FALLOC_FL_KEEP_SIZE) {
+        fuse_reply_err(req, EOPNOTSUPP);
+        return;
+    }
+    if (offset < 0 || length <= 0) {
+        fuse_reply_err(req, EINVAL);
+        return;
+    }
+    if (!file) {
+        fuse_reply_err(req, EBADF);
+        return;
+    }
+
+    uint64_t end = (uint64_t)offset + (uint64_t)length;
+    if (end > (uint64_t)LSFS_MAX_FILE_BLOCKS * LSFS_BLOCK_SIZE) {
+        fuse_reply_err(req, EFBIG);
+        return;
+    }
+
+    inode = get_inode(ino);
+    if (!inode) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+
+    pthread_mutex_lock(&inode->lock);
+    if (!S_ISREG(inode->disk_inode.mode)) {
+        pthread_mutex_unlock(&inode->lock);
+        lsfs_inode_put(inode);
+        fuse_reply_err(req, ENODEV);
+        return;
+    }
+    ret = count_holes(inode, (uint64_t)offset / LSFS_BLOCK_SIZE, LSFS_BLOCKS_FOR_SIZE(end),
+                      &holes);
+    pthread_mutex_unlock(&inode->lock);
+
+    /* Waiting for the cleaner is done without the inode lock, which it
+     * may need to move the file's blocks */
+    if (ret == LSFS_OK) {
+        ret = lsfs_segment_prealloc(g_lsfs, holes);
+    }
+    if (ret != LSFS_OK) {
+        lsfs_inode_put(inode);
+        fuse_reply_err(req, ret == LSFS_ERR_NOSPC ? ENOSPC : EIO);
+        return;
+    }
+
+    pthread_mutex_lock(&inode->lock);
+    file->prealloc += holes;
+    if (!(mode & FALLOC_FL_KEEP_SIZE) && end > inode->disk_inode.size) {
+        inode->disk_inode.size = end;
+        inode->disk_inode.mtime = lsfs_get_time_ns();
+        inode->disk_inode.ctime = inode->disk_inode.mtime;
+        inode->dirty = true;
+    }
+    pthread_mutex_unlock(&inode->lock);
+    lsfs_inode_put(inode);
 
     fuse_reply_err(req, 0);
 }
 
+/*
+ * FUSE getxattr
+ * Only the root directory has an attribute, LSFS_STATS_XATTR, which holds
+ * the runtime statistics rendered afresh for every call.
+ */
+static void lsfs_op_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
+                             size_t size)
+{
+    char *text;
+    size_t len;
+
+    if (ino != FUSE_ROOT_ID || strcmp(name, LSFS_STATS_XATTR) != 0) {
+        fuse_reply_err(req, ENODATA);
+        return;
+    }
+
+    if (lsfs_stats_render(g_lsfs, &text, &len) != LSFS_OK) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    if (size == 0) {
+        fuse_reply_xattr(req, len);
+    } else if (size < len) {
+        fuse_reply_err(req, ERANGE);
+    } else {
+        fuse_reply_buf(req, text, len);
+    }
+    free(text);
+}
+
+/*
+ * FUSE listxattr
+ */
+static void lsfs_op_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size)
+{
+    static const char names[] = LSFS_STATS_XATTR;
+
+    if (ino != FUSE_ROOT_ID) {
+        if (size == 0) {
+            fuse_reply_xattr(req, 0);
+        } else {
+            fuse_reply_buf(req, NULL, 0);
+        }
+        return;
+    }
+
+    if (size == 0) {
+        fuse_reply_xattr(req, sizeof(names));
+    } else if (size < sizeof(names)) {
+        fuse_reply_err(req, ERANGE);
+    } else {
+        fuse_reply_buf(req, names, sizeof(names));
+    }
+}
+
+/*
+ * Timed entry points
+ * Every request is answered before its handler returns, so the time spent
+ * in the handler is the request's latency.
+ */
+static void timed_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    uint64_t start = lsfs_stats_now();
+    lsfs_op_lookup(req, parent, name);
+    lsfs_stats_time(g_lsfs, LSFS_LAT_LOOKUP, start);
+}
+
+static void timed_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    uint64_t start = lsfs_stats_now();
+    lsfs_op_getattr(req, ino, fi);
+    lsfs_stats_time(g_lsfs, LSFS_LAT_GETATTR, start);
+}
+
+static void timed_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+                          int to_set, struct fuse_file_info *fi)
+{
+    uint64_t start = lsfs_stats_now();
+    lsfs_op_setattr(req, ino, attr, to_set, fi);
+    lsfs_stats_time(g_lsfs, LSFS_LAT_SETATTR, start);
+}
+
+static void timed_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+                          off_t off, struct fuse_file_info *fi)
+{
+    uint64_t start = lsfs_stats_now();
+    lsfs_op_readdir(req, ino, size, off, fi);
+    lsfs_stats_time(g_lsfs, LSFS_LAT_READDIR, start);
+}
+
+static void timed_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size,
+                              off_t off, struct fuse_file_info *fi)
+{
+    uint64_t start = lsfs_stats_now();
+    lsfs_op_readdirplus(req, ino, size, off, fi);
+    lsfs_stats_time(g_lsfs, LSFS_LAT_READDIRPLUS, start);
+}
+
+static void timed_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    uint64_t start = lsfs_stats_now();
+    lsfs_op_open(req, ino, fi);
+    lsfs_stats_time(g_lsfs, LSFS_LAT_OPEN, start);
+}
+
+static void timed_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    uint64_t start = lsfs_stats_now();
+    lsfs_op_release(req, ino, fi);
+    lsfs_stats_time(g_lsfs, LSFS_LAT_RELEASE, start);
+}
+
+static void timed_read(fuse_req_t req, fuse_ino_t ino, size_t size,
+                       off_t off, struct fuse_file_info *fi)
+{
+    uint64_t start = lsfs_stats_now();
+    lsfs_op_read(req, ino, size, off, fi);
+    lsfs_stats_time(g_lsfs, LSFS_LAT_READ, start);
+}
+
+static void timed_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
+                        size_t size, off_t off, struct fuse_file_info *fi)
+{
+    uint64_t start = lsfs_stats_now();
+    lsfs_op_write(req, ino, buf, size, off, fi);
+    lsfs_stats_time(g_lsfs, LSFS_LAT_WRITE, start);
+}
+
+static void timed_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv,
+                            off_t off, struct fuse_file_info *fi)
+{
+    uint64_t start = lsfs_stats_now();
+    lsfs_op_write_buf(req, ino, bufv, off, fi);
+    lsfs_stats_time(g_lsfs, LSFS_LAT_WRITE, start);
+}
+
+static void timed_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+                         mode_t mode, struct fuse_file_info *fi)
+{
+    uint64_t start = lsfs_stats_now();
+    lsfs_op_create(req, parent, name, mode, fi);
+    lsfs_stats_time(g_lsfs, LSFS_LAT_CREATE, start);
+}
+
+static void timed_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
+{
+    uint64_t start = lsfs_stats_now();
+    lsfs_op_mkdir(req, parent, name, mode);
+    lsfs_stats_time(g_lsfs, LSFS_LAT_MKDIR, start);
+}
+
+static void timed_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    uint64_t start = lsfs_stats_now();
+    lsfs_op_unlink(req, parent, name);
+    lsfs_stats_time(g_lsfs, LSFS_LAT_UNLINK, start);
+}
+
+static void timed_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    uint64_t start = lsfs_stats_now();
+    lsfs_op_rmdir(req, parent, name);
+    lsfs_stats_time(g_lsfs, LSFS_LAT_RMDIR, start);
+}
+
+static void timed_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+                         fuse_ino_t newparent, const char *newname, unsigned int flags)
+{
+    uint64_t start = lsfs_stats_now();
+    lsfs_op_rename(req, parent, name, newparent, newname, flags);
+    lsfs_stats_time(g_lsfs, LSFS_LAT_RENAME, start);
+}
+
+static void timed_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+    uint64_t start = lsfs_stats_now();
+    lsfs_op_statfs(req, ino);
+    lsfs_stats_time(g_lsfs, LSFS_LAT_STATFS, start);
+}
+
+static void timed_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+                        struct fuse_file_info *fi)
+{
+    uint64_t start = lsfs_stats_now();
+    lsfs_op_fsync(req, ino, datasync, fi);
+    lsfs_stats_time(g_lsfs, LSFS_LAT_FSYNC, start);
+}
+
+static void timed_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset,
+                            off_t length, struct fuse_file_info *fi)
+{
+    uint64_t start = lsfs_stats_now();
+    lsfs_op_fallocate(req, ino, mode, offset, length, fi);
+    lsfs_stats_time(g_lsfs, LSFS_LAT_FALLOCATE, start);
+}
+
 /*
  * FUSE operations structure
  */
 const struct fuse_lowlevel_ops lsfs_fuse_ops = {
     .init       = lsfs_op_init,
     .destroy    = lsfs_op_destroy,
-    .lookup     = lsfs_op_lookup,
-    .getattr    = lsfs_op_getattr,
-    .setattr    = lsfs_op_setattr,
-    .readdir    = lsfs_op_readdir,
-    .open       = lsfs_op_open,
-    .read       = lsfs_op_read,
-    .write      = lsfs_op_write,
-    .create     = lsfs_op_create,
-    .mkdir      = lsfs_op_mkdir,
-    .unlink     = lsfs_op_unlink,
-    .rmdir      = lsfs_op_rmdir,
-    .rename     = lsfs_op_rename,
-    .statfs     = lsfs_op_statfs,
-    .fsync      = lsfs_op_fsync,
+    .lookup     = timed_lookup,
+    .getattr    = timed_getattr,
+    .setattr    = timed_setattr,
+    .readdir    = timed_readdir,
+    .readdirplus = timed_readdirplus,
+    .open       = timed_open,
+    .release    = timed_release,
+    .read       = timed_read,
+    .write      = timed_write,
+    .write_buf  = timed_write_buf,
+    .create     = timed_create,
+    .mkdir      = timed_mkdir,
+    .unlink     = timed_unlink,
+    .rmdir      = timed_rmdir,
+    .rename     = timed_rename,
+    .statfs     = timed_statfs,
+    .fsync      = timed_fsync,
+    .fallocate  = timed_fallocate,
+    .getxattr   = lsfs_op_getxattr,
+    .listxattr  = lsfs_op_listxattr,
 };
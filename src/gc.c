@@ -7,174 +7,491 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <errno.h>
 #include <unistd.h>
 #include <inttypes.h>
 
 #include "lsfs.h"
 
-#define GC_THRESHOLD_LOW        10      /* Start GC when free segments < 10% */
-#define GC_THRESHOLD_HIGH       20      /* Stop GC when free segments > 20% */
-#define GC_UTILIZATION_THRESHOLD 50     /* Only clean segments with < 50% live data */
+#define GC_THRESHOLD_LOW        10      /* Clean flat out when free segments < 10% */
+#define GC_THRESHOLD_HIGH       20      /* ... until free segments > 20% */
+#define GC_UTILIZATION_THRESHOLD 50     /* Only clean segments with < 50% live data, */
+#define GC_URGENT_UTILIZATION   99      /* ... or anything not full when urgent */
+#define GC_IDLE_THRESHOLD       50      /* Clean when idle while free segments < 50% */
+#define GC_IDLE_UTILIZATION     25      /* ... but only segments with < 25% live data */
+#define GC_TICK_MS              1000    /* Pacing interval */
+#define GC_BATCH                5       /* Segments cleaned between checkpoints */
+#define GC_REKEY_SECS           10      /* Refresh every victim's age this often */
+#define GC_HEAP_NONE            UINT32_MAX
+#define GC_READ_CHUNK           64      /* Blocks per request when reading a segment */
+#define GC_READ_REQS            (LSFS_SEGMENT_BLOCKS / GC_READ_CHUNK)
+#define GC_MAX_READ_REQS        (LSFS_SEGMENT_BLOCKS / 2 + GC_READ_REQS + 2)
 
 /*
- * Background GC thread function
+ * Get the time in milliseconds, for pacing
  */
-static void *gc_thread_func(void *arg)
+static uint64_t gc_now_ms(void)
 {
-    struct lsfs_context *ctx = (struct lsfs_context *)arg;
+    struct timespec ts;
 
-    LSFS_INFO("GC thread started");
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
 
-    while (ctx->gc_running) {
-        pthread_mutex_lock(&ctx->gc_lock);
+/*
+ * Estimate the live blocks in a segment
+ * Inode and packed blocks stay counted while any of their slots is live,
+ * so dead slots are credited as whole blocks' worth of free space.  This
+ * is only an estimate for choosing segments; freeing one still needs a
+ * scan.
+ */
+static uint32_t segment_live_blocks(const struct lsfs_segment_usage *seg)
+{
+    uint32_t dead = seg->dead_slots / LSFS_INODES_PER_BLOCK;
+
+    if (seg->packed_slots > 0) {
+        dead += (uint32_t)((uint64_t)seg->dead_packed * seg->packed_blocks / seg->packed_slots);
+    }
+
+    return seg->live_blocks > dead ? seg->live_blocks - dead : 0;
+}
+
+/*
+ * Get the share of a segment's blocks that are live, in percent
+ */
+static uint32_t segment_utilization(const struct lsfs_segment_table *table,
+                                    const struct lsfs_segment_usage *seg)
+{
+    return (segment_live_blocks(seg) * 100) / (table->segment_blocks - LSFS_SUMMARY_BLOCKS);
+}
+
+/*
+ * Calculate segment utility (higher = better candidate for cleaning)
+ */
+static double segment_utility(const struct lsfs_segment_table *table,
+                              const struct lsfs_segment_usage *seg, uint64_t now)
+{
+    if (seg->state != LSFS_SEG_FULL) {
+        return -1.0;  /* Not a candidate */
+    }
+
+    double utilization = (double)segment_live_blocks(seg) /
+                         (double)(table->segment_blocks - LSFS_SUMMARY_BLOCKS);
+    /* Ages are in seconds; segments sealed together still rank by utilization */
+    double age = (double)(now - seg->timestamp) + 1.0;
+
+    if (utilization >= 1.0) {
+        return -1.0;  /* Fully live, don't clean */
+    }
+
+    /* Cost-benefit formula: older and emptier segments are better candidates */
+    return (age * (1.0 - utilization)) / (1.0 + utilization);
+}
 
-        /* Wait for GC trigger or timeout */
-        struct timespec ts;
-        clock_gettime(CLOCK_REALTIME, &ts);
-        ts.tv_sec += 5;  /* Wake up every 5 seconds */
+/*
+ * Victim heap
+ *
+ * Cleaning candidates are kept in a binary max-heap on cost-benefit, so
+ * picking a victim is O(log n) instead of a scan of the segment table.
+ * A segment is repositioned whenever its usage entry changes.  The age
+ * term keeps growing while nothing changes, at different rates for
+ * different segments, so every key is also refreshed now and then.  All
+ * of this is done with segtable.lock held.
+ */
 
-        pthread_cond_timedwait(&ctx->gc_cond, &ctx->gc_lock, &ts);
+/*
+ * Swap two heap slots
+ */
+static void gc_heap_swap(struct lsfs_segment_table *table, uint32_t a, uint32_t b)
+{
+    uint32_t seg_a = table->victims[a];
+    uint32_t seg_b = table->victims[b];
 
-        pthread_mutex_unlock(&ctx->gc_lock);
+    table->victims[a] = seg_b;
+    table->victims[b] = seg_a;
+    table->victim_pos[seg_b] = a;
+    table->victim_pos[seg_a] = b;
+}
 
-        if (!ctx->gc_running) {
+/*
+ * Restore heap order around slot i after its key changed
+ */
+static void gc_heap_fix(struct lsfs_segment_table *table, uint32_t i)
+{
+    /* Move up while better than the parent */
+    while (i > 0) {
+        uint32_t parent = (i - 1) / 2;
+        if (table->victim_key[table->victims[i]] <= table->victim_key[table->victims[parent]]) {
             break;
         }
+        gc_heap_swap(table, i, parent);
+        i = parent;
+    }
+
+    /* Move down while a child is better */
+    while (1) {
+        uint32_t best = i;
+        uint32_t left = 2 * i + 1;
+        uint32_t right = left + 1;
 
-        /* Check if GC is needed */
-        if (lsfs_gc_needed(ctx)) {
-            LSFS_DEBUG("GC triggered");
-            lsfs_gc_run(ctx);
+        if (left < table->victim_count &&
+            table->victim_key[table->victims[left]] > table->victim_key[table->victims[best]]) {
+            best = left;
+        }
+        if (right < table->victim_count &&
+            table->victim_key[table->victims[right]] > table->victim_key[table->victims[best]]) {
+            best = right;
         }
+        if (best == i) {
+            break;
+        }
+        gc_heap_swap(table, i, best);
+        i = best;
     }
+}
 
-    LSFS_INFO("GC thread stopped");
-    return NULL;
+/*
+ * Check whether a segment has been left out of cleaning for failing its
+ * checks.  Caller must hold segtable.lock.
+ */
+static bool gc_quarantined(const struct lsfs_segment_table *table, uint32_t segment_id)
+{
+    return table->quarantined &&
+           (table->quarantined[segment_id / 64] & (1ULL << (segment_id % 64))) != 0;
 }
 
 /*
- * Initialize garbage collector
+ * Reposition a segment among the cleaning candidates
+ * Full segments with any dead blocks are candidates, unless they failed
+ * their checks; anything else is taken out of the heap.  Called whenever
+ * a usage entry changes.
  */
-int lsfs_gc_init(struct lsfs_context *ctx)
+void lsfs_gc_victim_update(struct lsfs_segment_table *table, uint32_t segment_id)
 {
-    ctx->gc_running = true;
+    const struct lsfs_segment_usage *seg = &table->entries[segment_id];
+    uint32_t pos;
 
-    if (pthread_mutex_init(&ctx->gc_lock, NULL) != 0) {
-        return LSFS_ERR_NOMEM;
+    if (!table->victims) {
+        return;
     }
 
-    if (pthread_cond_init(&ctx->gc_cond, NULL) != 0) {
-        pthread_mutex_destroy(&ctx->gc_lock);
-        return LSFS_ERR_NOMEM;
+    pos = table->victim_pos[segment_id];
+
+    if (seg->state != LSFS_SEG_FULL || gc_quarantined(table, segment_id) ||
+        segment_utilization(table, seg) > GC_URGENT_UTILIZATION) {
+        if (pos == GC_HEAP_NONE) {
+            return;
+        }
+
+        /* Move the last slot into the hole */
+        uint32_t last = --table->victim_count;
+        table->victim_pos[segment_id] = GC_HEAP_NONE;
+        if (pos != last) {
+            table->victims[pos] = table->victims[last];
+            table->victim_pos[table->victims[pos]] = pos;
+            gc_heap_fix(table, pos);
+        }
+        return;
     }
 
-    if (pthread_create(&ctx->gc_thread, NULL, gc_thread_func, ctx) != 0) {
-        pthread_cond_destroy(&ctx->gc_cond);
-        pthread_mutex_destroy(&ctx->gc_lock);
+    table->victim_key[segment_id] = segment_utility(table, seg, (uint64_t)time(NULL));
+    if (pos == GC_HEAP_NONE) {
+        pos = table->victim_count++;
+        table->victims[pos] = segment_id;
+        table->victim_pos[segment_id] = pos;
+    }
+    gc_heap_fix(table, pos);
+}
+
+/*
+ * Recompute every candidate's key and rebuild the heap
+ */
+static void gc_victims_rekey(struct lsfs_segment_table *table, uint64_t now)
+{
+    for (uint32_t i = 0; i < table->victim_count; i++) {
+        uint32_t seg = table->victims[i];
+        table->victim_key[seg] = segment_utility(table, &table->entries[seg], now);
+    }
+    for (uint32_t i = table->victim_count / 2; i-- > 0; ) {
+        gc_heap_fix(table, i);
+    }
+    table->victims_keyed = now;
+}
+
+/*
+ * Free the victim heap
+ */
+void lsfs_gc_victims_destroy(struct lsfs_segment_table *table)
+{
+    free(table->victims);
+    free(table->victim_pos);
+    free(table->victim_key);
+    free(table->quarantined);
+    table->victims = NULL;
+    table->victim_pos = NULL;
+    table->victim_key = NULL;
+    table->quarantined = NULL;
+    table->victim_count = 0;
+}
+
+/*
+ * Build the victim heap from the segment table
+ */
+int lsfs_gc_victims_init(struct lsfs_segment_table *table)
+{
+    table->victims = calloc(table->count, sizeof(uint32_t));
+    table->victim_pos = calloc(table->count, sizeof(uint32_t));
+    table->victim_key = calloc(table->count, sizeof(double));
+    table->quarantined = calloc(LSFS_DIV_ROUND_UP(table->count, 64), sizeof(uint64_t));
+    if (!table->victims || !table->victim_pos || !table->victim_key || !table->quarantined) {
+        lsfs_gc_victims_destroy(table);
         return LSFS_ERR_NOMEM;
     }
 
+    table->victim_count = 0;
+    table->cleaning = 0;
+    for (uint32_t i = 0; i < table->count; i++) {
+        table->victim_pos[i] = GC_HEAP_NONE;
+    }
+    for (uint32_t i = 0; i < table->count; i++) {
+        lsfs_gc_victim_update(table, i);
+    }
+    table->victims_keyed = (uint64_t)time(NULL);
+
     return LSFS_OK;
 }
 
 /*
- * Destroy garbage collector
+ * Get the best cleaning candidate without claiming it
+ * Caller must hold segtable.lock.
  */
-void lsfs_gc_destroy(struct lsfs_context *ctx)
+static uint32_t gc_victim_peek(struct lsfs_segment_table *table)
 {
-    ctx->gc_running = false;
+    uint64_t now = (uint64_t)time(NULL);
 
-    pthread_mutex_lock(&ctx->gc_lock);
-    pthread_cond_signal(&ctx->gc_cond);
-    pthread_mutex_unlock(&ctx->gc_lock);
+    if (!table->victims || table->victim_count == 0) {
+        return UINT32_MAX;
+    }
 
-    pthread_join(ctx->gc_thread, NULL);
+    if (now - table->victims_keyed >= GC_REKEY_SECS) {
+        gc_victims_rekey(table, now);
+    }
 
-    pthread_cond_destroy(&ctx->gc_cond);
-    pthread_mutex_destroy(&ctx->gc_lock);
+    return table->victims[0];
 }
 
 /*
- * Check if GC is needed
+ * Select the best segment to clean
  */
-bool lsfs_gc_needed(struct lsfs_context *ctx)
+uint32_t lsfs_gc_select_segment(struct lsfs_context *ctx)
 {
     struct lsfs_segment_table *table = &ctx->segtable;
-    uint32_t free_percent;
+    uint32_t segment_id;
 
     pthread_mutex_lock(&table->lock);
-    free_percent = (table->free_count * 100) / table->count;
+    segment_id = gc_victim_peek(table);
     pthread_mutex_unlock(&table->lock);
 
-    return free_percent < GC_THRESHOLD_LOW;
+    return segment_id;
 }
 
 /*
- * Trigger GC
+ * Take the best candidate out of the heap for cleaning
+ * Only a segment with at most max_utilization percent live data is
+ * taken.  Returns UINT32_MAX if there is none.
  */
-void lsfs_gc_trigger(struct lsfs_context *ctx)
+static uint32_t gc_claim_victim(struct lsfs_context *ctx, uint32_t max_utilization)
 {
-    pthread_mutex_lock(&ctx->gc_lock);
-    pthread_cond_signal(&ctx->gc_cond);
-    pthread_mutex_unlock(&ctx->gc_lock);
+    struct lsfs_segment_table *table = &ctx->segtable;
+    uint32_t segment_id;
+
+    pthread_mutex_lock(&table->lock);
+
+    segment_id = gc_victim_peek(table);
+    if (segment_id != UINT32_MAX &&
+        segment_utilization(table, &table->entries[segment_id]) <= max_utilization) {
+        table->entries[segment_id].state = LSFS_SEG_CLEANING;
+        table->cleaning++;
+        lsfs_gc_victim_update(table, segment_id);
+    } else {
+        segment_id = UINT32_MAX;
+    }
+
+    pthread_mutex_unlock(&table->lock);
+
+    return segment_id;
 }
 
 /*
- * Calculate segment utility (higher = better candidate for cleaning)
+ * Hand back a segment taken for cleaning
+ * A cleaned segment becomes free and writers waiting for one are woken;
+ * one that could not be cleaned goes back to the candidates.
  */
-static double segment_utility(struct lsfs_segment_usage *seg, uint64_t now)
+static void gc_release(struct lsfs_context *ctx, uint32_t segment_id, bool cleaned)
 {
-    if (seg->state != LSFS_SEG_FULL) {
-        return -1.0;  /* Not a candidate */
+    struct lsfs_segment_table *table = &ctx->segtable;
+    struct lsfs_segment_usage *entry = &table->entries[segment_id];
+
+    /* Wait while a checkpoint is between its cut and its copy of the
+     * table, so a segment freed after the cut is not free in the copy
+     * while its moved blocks are missing from the inode map saved */
+    pthread_mutex_lock(&ctx->segbuf.lock);
+    while (ctx->segbuf.cutting) {
+        pthread_cond_wait(&ctx->segbuf.landed, &ctx->segbuf.lock);
+    }
+    pthread_mutex_lock(&table->lock);
+    table->cleaning--;
+    if (cleaned) {
+        lsfs_segment_release(ctx, segment_id);
+    } else {
+        entry->state = LSFS_SEG_FULL;
+        lsfs_segment_dirty(table, segment_id);
     }
+    pthread_mutex_unlock(&table->lock);
+    pthread_mutex_unlock(&ctx->segbuf.lock);
 
-    double utilization = (double)seg->live_blocks / (double)(LSFS_SEGMENT_BLOCKS - 1);
-    double age = (double)(now - seg->timestamp);
+    if (cleaned) {
+        /* Relocated blocks now live elsewhere */
+        lsfs_buffer_invalidate_range(ctx, lsfs_segment_to_block(ctx, segment_id, 0),
+                                     table->segment_blocks);
+    }
+}
 
-    if (utilization >= 1.0) {
-        return -1.0;  /* Fully live, don't clean */
+/*
+ * Hand back a segment whose summary or blocks failed their checks
+ * Cleaning it again would fail the same way every round and hold up the
+ * candidates behind it, so it is left out of the victim heap until the
+ * next mount.
+ */
+static void gc_quarantine(struct lsfs_context *ctx, uint32_t segment_id)
+{
+    struct lsfs_segment_table *table = &ctx->segtable;
+    bool known;
+
+    pthread_mutex_lock(&table->lock);
+    known = gc_quarantined(table, segment_id);
+    table->quarantined[segment_id / 64] |= 1ULL << (segment_id % 64);
+    pthread_mutex_unlock(&table->lock);
+
+    if (!known) {
+        LSFS_ERROR("Leaving segment %u out of cleaning until remount", segment_id);
     }
+    gc_release(ctx, segment_id, false);
+}
 
-    /* Cost-benefit formula: older and emptier segments are better candidates */
-    return (age * (1.0 - utilization)) / (1.0 + utilization);
+/*
+ * Check whether cleaning is stalled for lack of room to move blocks into
+ * A stall ends once segments are freed past the count it began at, or
+ * once a checkpoint marks dropped blocks dead.  Caller must hold
+ * segtable.lock.
+ */
+static bool gc_stalled_locked(struct lsfs_segment_table *table)
+{
+    if (table->stalled && lsfs_segment_free_total(table) > table->stalled_free) {
+        table->stalled = false;
+    }
+    return table->stalled;
 }
 
 /*
- * Select the best segment to clean
+ * Check whether cleaning is stalled
  */
-uint32_t lsfs_gc_select_segment(struct lsfs_context *ctx)
+static bool gc_stalled(struct lsfs_context *ctx)
+{
+    bool stalled;
+
+    pthread_mutex_lock(&ctx->segtable.lock);
+    stalled = gc_stalled_locked(&ctx->segtable);
+    pthread_mutex_unlock(&ctx->segtable.lock);
+
+    return stalled;
+}
+
+/*
+ * Stop cleaning for lack of room to move live blocks into
+ * Trying again would read the same victims only to fail the same way, so
+ * the cleaners wait for the stall to end instead, and writers waiting
+ * for them give up.
+ */
+static void gc_stall(struct lsfs_context *ctx)
 {
     struct lsfs_segment_table *table = &ctx->segtable;
-    uint64_t now = (uint64_t)time(NULL);
-    uint32_t best_segment = UINT32_MAX;
-    double best_utility = -1.0;
 
     pthread_mutex_lock(&table->lock);
+    if (!table->stalled) {
+        table->stalled = true;
+        table->stalled_free = lsfs_segment_free_total(table);
+        LSFS_ERROR("No room left to move live blocks into, cleaning stopped "
+                   "until space is freed");
+    }
+    pthread_mutex_unlock(&table->lock);
+}
 
-    for (uint32_t i = 0; i < table->count; i++) {
-        struct lsfs_segment_usage *seg = &table->entries[i];
+/*
+ * Check whether waiting for the cleaner can free a segment
+ * True while cleaner threads run and have candidates, are cleaning, or
+ * have freed segments that the next checkpoint makes reusable, and while
+ * blocks files dropped wait for the writeback and checkpoint that let the
+ * cleaner see them.  A stalled cleaner frees nothing but what those
+ * already dropped blocks let it.
+ */
+bool lsfs_gc_pending(struct lsfs_context *ctx)
+{
+    struct lsfs_segment_table *table = &ctx->segtable;
+    bool pending;
 
-        /* Skip non-full segments */
-        if (seg->state != LSFS_SEG_FULL) {
-            continue;
-        }
+    if (!ctx->gc_threads) {
+        return false;
+    }
 
-        /* Skip segments with high utilization */
-        uint32_t utilization = (seg->live_blocks * 100) / (LSFS_SEGMENT_BLOCKS - 1);
-        if (utilization > GC_UTILIZATION_THRESHOLD) {
-            continue;
-        }
+    pthread_mutex_lock(&table->lock);
+    pending = table->released_count > 0 || table->discard_count > 0 || table->dead.count > 0 ||
+              (!gc_stalled_locked(table) &&
+               (table->victim_count > 0 || table->cleaning > 0 ||
+                __atomic_load_n(&table->staged_dead, __ATOMIC_RELAXED) > 0));
+    pthread_mutex_unlock(&table->lock);
+
+    return pending;
+}
 
-        double utility = segment_utility(seg, now);
-        if (utility > best_utility) {
-            best_utility = utility;
-            best_segment = i;
+/*
+ * Clear the live bits of count segment blocks starting at first
+ * Blocks that are already dead are not counted again, so marking an old
+ * location dead twice is harmless.  Caller must hold segtable.lock.
+ */
+static void gc_clear_live(struct lsfs_segment_usage *entry, uint32_t first, uint32_t count)
+{
+    for (uint32_t i = first; i < first + count; i++) {
+        if (entry->live_map[i / 64] & (1ULL << (i % 64))) {
+            entry->live_map[i / 64] &= ~(1ULL << (i % 64));
+            if (entry->live_blocks > 0) {
+                entry->live_blocks--;
+            }
         }
     }
+}
 
-    pthread_mutex_unlock(&table->lock);
+/*
+ * Mark count consecutive packed addresses as dead
+ * Like inode slots, the packed blocks stay live until the cleaner finds
+ * no live slot in them; the dead slots are only counted.
+ */
+static void gc_mark_packed_dead(struct lsfs_context *ctx, uint64_t addr, uint64_t count)
+{
+    for (uint64_t i = 0; i < count; i++) {
+        uint64_t block = LSFS_PACKED_BLOCK(addr + i);
+        uint32_t segment_id, offset;
+        lsfs_block_to_segment(ctx, block, &segment_id, &offset);
+
+        if (block < ctx->segtable.log_start || segment_id >= ctx->segtable.count) {
+            continue;
+        }
 
-    return best_segment;
+        pthread_mutex_lock(&ctx->segtable.lock);
+        ctx->segtable.entries[segment_id].dead_packed++;
+        lsfs_segment_dirty(&ctx->segtable, segment_id);
+        pthread_mutex_unlock(&ctx->segtable.lock);
+    }
 }
 
 /*
@@ -183,237 +500,1232 @@ uint32_t lsfs_gc_select_segment(struct lsfs_context *ctx)
 void lsfs_gc_mark_block_dead(struct lsfs_context *ctx, uint64_t block)
 {
     uint32_t segment_id, offset;
-    lsfs_block_to_segment(block, &segment_id, &offset);
 
-    if (segment_id >= ctx->segtable.count) {
+    if (LSFS_IS_PACKED(block)) {
+        gc_mark_packed_dead(ctx, block, 1);
         return;
     }
 
-    pthread_mutex_lock(&ctx->segtable.lock);
+    lsfs_block_to_segment(ctx, block, &segment_id, &offset);
 
-    if (ctx->segtable.entries[segment_id].live_blocks > 0) {
-        ctx->segtable.entries[segment_id].live_blocks--;
+    if (block < ctx->segtable.log_start || segment_id >= ctx->segtable.count) {
+        return;
     }
 
+    pthread_mutex_lock(&ctx->segtable.lock);
+    gc_clear_live(&ctx->segtable.entries[segment_id], offset, 1);
+    lsfs_segment_dirty(&ctx->segtable, segment_id);
     pthread_mutex_unlock(&ctx->segtable.lock);
 
     LSFS_DEBUG("Marked block %" PRIu64 " as dead (segment %u)", block, segment_id);
 }
 
 /*
- * Clean a single segment
+ * Mark count consecutive blocks starting at block as dead
  */
-int lsfs_gc_clean_segment(struct lsfs_context *ctx, uint32_t segment_id)
+void lsfs_gc_mark_range_dead(struct lsfs_context *ctx, uint64_t block, uint64_t count)
 {
-    struct lsfs_segment_table *table = &ctx->segtable;
-    uint8_t *segment_data;
-    int ret = LSFS_OK;
-
-    if (segment_id >= table->count) {
-        return LSFS_ERR_INVAL;
+    if (LSFS_IS_PACKED(block)) {
+        gc_mark_packed_dead(ctx, block, count);
+        return;
     }
 
-    pthread_mutex_lock(&table->lock);
+    while (count > 0) {
+        uint32_t segment_id, offset;
+        lsfs_block_to_segment(ctx, block, &segment_id, &offset);
 
-    /* Check if segment is still a good candidate */
-    if (table->entries[segment_id].state != LSFS_SEG_FULL) {
-        pthread_mutex_unlock(&table->lock);
-        return LSFS_OK;  /* Already cleaned or active */
-    }
+        if (block < ctx->segtable.log_start || segment_id >= ctx->segtable.count) {
+            return;
+        }
 
-    uint32_t live_blocks = table->entries[segment_id].live_blocks;
-    if (live_blocks == 0) {
-        /* No live data, just free the segment */
-        table->entries[segment_id].state = LSFS_SEG_FREE;
-        table->free_count++;
-        ctx->sb.free_segments = table->free_count;
-        pthread_mutex_unlock(&table->lock);
+        uint32_t n = (uint32_t)LSFS_MIN(count, ctx->segtable.segment_blocks - offset);
 
-        LSFS_DEBUG("Freed empty segment %u", segment_id);
-        return LSFS_OK;
-    }
+        pthread_mutex_lock(&ctx->segtable.lock);
+        gc_clear_live(&ctx->segtable.entries[segment_id], offset, n);
+        lsfs_segment_dirty(&ctx->segtable, segment_id);
+        pthread_mutex_unlock(&ctx->segtable.lock);
 
-    table->entries[segment_id].state = LSFS_SEG_CLEANING;
-    pthread_mutex_unlock(&table->lock);
+        block += n;
+        count -= n;
+    }
+}
 
-    LSFS_INFO("Cleaning segment %u (%u live blocks)", segment_id, live_blocks);
+/*
+ * Mark an inode slot as dead (for GC tracking)
+ * The block itself stays live until the cleaner finds no live slot in it.
+ */
+void lsfs_gc_mark_inode_dead(struct lsfs_context *ctx, uint64_t location)
+{
+    uint32_t segment_id, offset;
+    lsfs_block_to_segment(ctx, LSFS_INODE_LOC_BLOCK(location), &segment_id, &offset);
 
-    /* Read entire segment */
-    segment_data = malloc(LSFS_SEGMENT_SIZE);
-    if (!segment_data) {
-        pthread_mutex_lock(&table->lock);
-        table->entries[segment_id].state = LSFS_SEG_FULL;
-        pthread_mutex_unlock(&table->lock);
-        return LSFS_ERR_NOMEM;
+    if (segment_id >= ctx->segtable.count) {
+        return;
     }
 
-    uint64_t seg_start = lsfs_segment_to_block(segment_id, 0);
-    ret = lsfs_read_blocks(ctx, seg_start, LSFS_SEGMENT_BLOCKS, segment_data);
-    if (ret != LSFS_OK) {
-        free(segment_data);
-        pthread_mutex_lock(&table->lock);
-        table->entries[segment_id].state = LSFS_SEG_FULL;
-        pthread_mutex_unlock(&table->lock);
-        return ret;
-    }
+    pthread_mutex_lock(&ctx->segtable.lock);
+    ctx->segtable.entries[segment_id].dead_slots++;
+    lsfs_segment_dirty(&ctx->segtable, segment_id);
+    pthread_mutex_unlock(&ctx->segtable.lock);
 
-    /* Parse segment summary */
-    struct lsfs_segment_summary *summary = (struct lsfs_segment_summary *)segment_data;
+    LSFS_DEBUG("Marked inode slot %u of block %" PRIu64 " as dead (segment %u)",
+               LSFS_INODE_LOC_SLOT(location), LSFS_INODE_LOC_BLOCK(location),
+               segment_id);
+}
 
-    if (summary->header.magic != LSFS_SEGMENT_MAGIC) {
-        LSFS_ERROR("Invalid segment header in segment %u", segment_id);
-        free(segment_data);
-        pthread_mutex_lock(&table->lock);
-        table->entries[segment_id].state = LSFS_SEG_FULL;
-        pthread_mutex_unlock(&table->lock);
-        return LSFS_ERR_CORRUPT;
-    }
+/*
+ * Look up which use of its segment a block belongs to
+ * Caller must hold segtable.lock.
+ */
+static uint64_t gc_block_sequence(struct lsfs_context *ctx, uint64_t block)
+{
+    struct lsfs_segment_table *table = &ctx->segtable;
+    uint32_t segment_id, offset;
 
-    /* Process each block in the segment */
-    uint32_t num_blocks = summary->header.block_count;
-    if (num_blocks > LSFS_SEGMENT_BLOCKS) {
-        num_blocks = LSFS_SEGMENT_BLOCKS;
+    lsfs_block_to_segment(ctx, block, &segment_id, &offset);
+    if (block < table->log_start || segment_id >= table->count) {
+        return 0;
     }
+    return table->entries[segment_id].sequence;
+}
 
-    for (uint32_t i = 1; i < num_blocks; i++) {
-        struct lsfs_block_info *info = &summary->blocks[i - 1];
-        uint64_t current_loc;
-        uint32_t version;
+/*
+ * Add a run of blocks to a dead list, merging it with the last run
+ * Returns false if there is no memory for it.
+ */
+static bool gc_dead_list_add(struct lsfs_dead_list *list, uint64_t block, uint64_t count,
+                             uint64_t sequence)
+{
+    if (list->count > 0) {
+        struct lsfs_dead_run *last = &list->runs[list->count - 1];
+        if (last->block + last->count == block && last->sequence == sequence) {
+            last->count += count;
+            return true;
+        }
+    }
 
-        /* Check if this block is still live */
-        if (info->ino == 0) {
-            continue;
+    if (list->count == list->capacity) {
+        uint32_t capacity = list->capacity ? list->capacity * 2 : 16;
+        struct lsfs_dead_run *runs = realloc(list->runs, capacity * sizeof(*runs));
+        if (!runs) {
+            return false;
         }
+        list->runs = runs;
+        list->capacity = capacity;
+    }
 
-        /* For inode blocks, check if this is still the current location */
+    list->runs[list->count].block = block;
+    list->runs[list->count].count = count;
+    list->runs[list->count].sequence = sequence;
+    list->count++;
+    return true;
+}
+
+/*
+ * Free a dead list
+ */
+void lsfs_gc_dead_list_free(struct lsfs_dead_list *list)
+{
+    free(list->runs);
+    memset(list, 0, sizeof(*list));
+}
+
+/*
+ * Note count consecutive blocks an inode no longer points at
+ * They are marked dead only once a checkpoint has saved an inode map
+ * naming a version of the inode written without them: until then the
+ * last checkpoint, or roll-forward to an older version, may still need
+ * them.  Packed addresses are only counted, so they are counted at once.
+ * A run that cannot be noted for lack of memory stays live, which the
+ * cleaner finds out for itself.  Caller must hold the inode lock.
+ */
+void lsfs_gc_stage_dead(struct lsfs_context *ctx, struct lsfs_inode_mem *inode,
+                        uint64_t block, uint64_t count)
+{
+    uint64_t sequence;
+
+    if (LSFS_IS_PACKED(block)) {
+        gc_mark_packed_dead(ctx, block, count);
+        return;
+    }
+
+    pthread_mutex_lock(&ctx->segtable.lock);
+    sequence = gc_block_sequence(ctx, block);
+    pthread_mutex_unlock(&ctx->segtable.lock);
+
+    if (!gc_dead_list_add(&inode->dead, block, count, sequence)) {
+        LSFS_ERROR("Out of memory noting %" PRIu64 " dead blocks of inode %u",
+                   count, inode->disk_inode.ino);
+        return;
+    }
+    __atomic_add_fetch(&ctx->segtable.staged_dead, count, __ATOMIC_RELAXED);
+}
+
+/*
+ * Hand the blocks an inode dropped over to the next checkpoint
+ * Called once the version written without them is in the inode map.
+ * Caller must hold the inode lock.
+ */
+void lsfs_gc_commit_dead(struct lsfs_context *ctx, struct lsfs_inode_mem *inode)
+{
+    struct lsfs_segment_table *table = &ctx->segtable;
+    struct lsfs_dead_list *dead = &inode->dead;
+
+    if (dead->count == 0) {
+        return;
+    }
+
+    uint64_t staged = 0;
+
+    pthread_mutex_lock(&table->lock);
+    for (uint32_t i = 0; i < dead->count; i++) {
+        const struct lsfs_dead_run *run = &dead->runs[i];
+
+        if (!gc_dead_list_add(&table->dead, run->block, run->count, run->sequence)) {
+            LSFS_ERROR("Out of memory noting %" PRIu64 " dead blocks at %" PRIu64,
+                       run->count, run->block);
+        }
+        staged += run->count;
+    }
+    pthread_mutex_unlock(&table->lock);
+    dead->count = 0;
+    __atomic_sub_fetch(&ctx->segtable.staged_dead, staged, __ATOMIC_RELAXED);
+}
+
+/*
+ * Mark count consecutive blocks dead at the next checkpoint
+ * For blocks nothing in the current inode map points at any more.
+ */
+void lsfs_gc_defer_dead(struct lsfs_context *ctx, uint64_t block, uint64_t count)
+{
+    struct lsfs_segment_table *table = &ctx->segtable;
+    bool added;
+
+    pthread_mutex_lock(&table->lock);
+    added = gc_dead_list_add(&table->dead, block, count, gc_block_sequence(ctx, block));
+    pthread_mutex_unlock(&table->lock);
+
+    if (!added) {
+        LSFS_ERROR("Out of memory noting %" PRIu64 " dead blocks at %" PRIu64,
+                   count, block);
+    }
+}
+
+/*
+ * Mark the blocks handed over since the last checkpoint dead
+ * Called by the checkpoint at its cut, before it saves the inode map, so
+ * the table it writes drops exactly the blocks that map no longer needs.
+ * A segment freed meanwhile was cleared already.  It may even have been
+ * reused: an inode can hand over blocks it dropped after the cut of the
+ * checkpoint that freed their segment, so runs noted in an earlier use
+ * of a segment are skipped.  Ends a stall, since cleaning emptier
+ * victims may need less room.  Caller must hold segtable.lock.
+ */
+void lsfs_gc_apply_dead(struct lsfs_context *ctx)
+{
+    struct lsfs_segment_table *table = &ctx->segtable;
+
+    for (uint32_t r = 0; r < table->dead.count; r++) {
+        uint64_t block = table->dead.runs[r].block;
+        uint64_t count = table->dead.runs[r].count;
+        uint64_t sequence = table->dead.runs[r].sequence;
+
+        while (count > 0) {
+            uint32_t segment_id, offset;
+            lsfs_block_to_segment(ctx, block, &segment_id, &offset);
+
+            if (block < table->log_start || segment_id >= table->count) {
+                break;
+            }
+
+            uint32_t n = (uint32_t)LSFS_MIN(count, table->segment_blocks - offset);
+
+            if (table->entries[segment_id].state != LSFS_SEG_FREE &&
+                table->entries[segment_id].sequence == sequence) {
+                gc_clear_live(&table->entries[segment_id], offset, n);
+                lsfs_segment_dirty(table, segment_id);
+            }
+            block += n;
+            count -= n;
+        }
+    }
+    if (table->dead.count > 0) {
+        table->stalled = false;
+    }
+    table->dead.count = 0;
+}
+
+/*
+ * Move the still mapped blocks of a run of count consecutive file blocks
+ * of inode ino, starting at file block first, out of the segment
+ * The run is stored at addr and its contents are in data.  Blocks that
+ * are still mapped where the run put them are rewritten together, so a
+ * live extent stays one extent after the move.  They go to the cleaner's
+ * own log stream, away from freshly written data.
+ */
+static int gc_move_data(struct lsfs_context *ctx, uint32_t ino, uint32_t first,
+                        uint64_t addr, uint32_t count, uint8_t *data)
+{
+    struct lsfs_inode_mem *inode;
+    uint64_t *mapped;
+    uint32_t moved = 0;
+    int ret = LSFS_OK;
+
+    inode = lsfs_inode_get(ctx, ino);
+    if (!inode) {
+        return LSFS_OK;
+    }
+
+    mapped = malloc(count * sizeof(*mapped));
+    if (!mapped) {
+        lsfs_inode_put(inode);
+        return LSFS_ERR_NOMEM;
+    }
+
+    pthread_mutex_lock(&inode->lock);
+
+    if (lsfs_inode_map_blocks(ctx, inode, first, count, mapped) == LSFS_OK) {
+        uint32_t i = 0;
+
+        while (i < count) {
+            uint32_t n = 0;
+
+            while (i + n < count && mapped[i + n] == addr + i + n) {
+                n++;
+            }
+            if (n == 0) {
+                i++;
+                continue;
+            }
+
+            struct fuse_bufvec src = FUSE_BUFVEC_INIT((size_t)n * LSFS_BLOCK_SIZE);
+            src.buf[0].mem = data + (size_t)i * LSFS_BLOCK_SIZE;
+            if (lsfs_inode_write_data(ctx, inode, (uint64_t)(first + i) * LSFS_BLOCK_SIZE,
+                                      (size_t)n * LSFS_BLOCK_SIZE, &src,
+                                      LSFS_STREAM_GC) !=
+                (ssize_t)n * LSFS_BLOCK_SIZE) {
+                ret = LSFS_ERR_NOSPC;
+                break;
+            }
+
+            moved += n;
+            i += n;
+        }
+    }
+
+    /* Persist the new mapping before the segment is reused.  Blocks left
+     * behind may still be mapped by the version last written, so that is
+     * written over even when nothing moved. */
+    if (lsfs_inode_write(ctx, inode) != LSFS_OK) {
+        ret = LSFS_ERR_NOSPC;
+    }
+
+    if (ret != LSFS_OK) {
+        LSFS_ERROR("Failed to relocate block during GC");
+    } else if (moved > 0) {
+        LSFS_DEBUG("Relocated %u data blocks (ino %u, off %u) from %" PRIu64,
+                   moved, ino, first, addr);
+    }
+
+    pthread_mutex_unlock(&inode->lock);
+    lsfs_inode_put(inode);
+    free(mapped);
+
+    return ret;
+}
+
+/*
+ * Move the still mapped slots of the packed block at block out of the
+ * segment
+ * packed holds the block as read from the segment.
+ */
+static int gc_move_packed(struct lsfs_context *ctx, uint64_t block, const uint8_t *packed)
+{
+    const struct lsfs_packed_header *header = (const struct lsfs_packed_header *)packed;
+    uint8_t *data;
+    int ret = LSFS_OK;
+
+    if (header->magic != LSFS_PACKED_MAGIC || header->count > LSFS_PACKED_SLOTS) {
+        LSFS_ERROR("Bad packed block %" PRIu64 " during GC", block);
+        return LSFS_ERR_CORRUPT;
+    }
+
+    data = malloc((size_t)LSFS_PACKED_SLOTS * LSFS_BLOCK_SIZE);
+    if (!data) {
+        return LSFS_ERR_NOMEM;
+    }
+
+    uint32_t count = header->count;
+    uint32_t slot = 0;
+
+    while (slot < count && ret == LSFS_OK) {
+        const struct lsfs_packed_slot *first = &header->slots[slot];
+        uint32_t n = 1;
+
+        while (slot + n < count && header->slots[slot + n].ino == first->ino &&
+               header->slots[slot + n].offset == first->offset + n) {
+            n++;
+        }
+
+        for (uint32_t k = 0; k < n && ret == LSFS_OK; k++) {
+            ret = lsfs_packed_read(packed, slot + k, data + (size_t)k * LSFS_BLOCK_SIZE);
+        }
+        if (ret == LSFS_OK && first->ino != 0) {
+            ret = gc_move_data(ctx, first->ino, first->offset,
+                               LSFS_PACKED_ADDR(block, slot), n, data);
+        }
+        slot += n;
+    }
+
+    free(data);
+    return ret;
+}
+
+/*
+ * Check a segment block's bit in a live bitmap
+ */
+static bool gc_block_live(const uint64_t *live_map, uint32_t block)
+{
+    return (live_map[block / 64] & (1ULL << (block % 64))) != 0;
+}
+
+/*
+ * Check whether a block of a segment is read for cleaning: the live ones
+ * and both places its summary may be
+ */
+static bool gc_block_wanted(const uint64_t *live_map, uint32_t blocks, uint32_t block)
+{
+    return block < LSFS_SUMMARY_BLOCKS || block >= LSFS_SUMMARY_TAIL(blocks) ||
+           gc_block_live(live_map, block);
+}
+
+/*
+ * Build the reads for a segment's summary and its live blocks
+ * Runs are split every GC_READ_CHUNK blocks, and dead blocks are not
+ * read at all.  Fills reqs, which must have room for GC_MAX_READ_REQS
+ * entries, and returns the number of requests.
+ */
+static uint32_t gc_build_reads(uint64_t seg_start, uint32_t blocks, const uint64_t *live_map,
+                               uint8_t *data, struct lsfs_io_req *reqs)
+{
+    uint32_t count = 0;
+    uint32_t i = 0;
+
+    while (i < blocks) {
+        if (!gc_block_wanted(live_map, blocks, i)) {
+            i++;
+            continue;
+        }
+
+        uint32_t n = 1;
+        while (i + n < blocks && n < GC_READ_CHUNK &&
+               gc_block_wanted(live_map, blocks, i + n)) {
+            n++;
+        }
+
+        reqs[count].block = seg_start + i;
+        reqs[count].count = n;
+        reqs[count].buf = data + (size_t)i * LSFS_BLOCK_SIZE;
+        count++;
+        i += n;
+    }
+
+    return count;
+}
+
+/*
+ * A segment taken for cleaning and the read of its live blocks
+ */
+struct gc_read {
+    uint32_t segment_id;
+    uint32_t live_blocks;
+    uint64_t live_map[LSFS_SEGMENT_BLOCKS / 64];
+    uint8_t *data;                  /* Summary and live blocks */
+    struct lsfs_io_req *reqs;
+    struct lsfs_read_job job;
+};
+
+/*
+ * Start reading the summary and live blocks of a segment taken for
+ * cleaning, as one batch on the read queue
+ * The live bitmap is copied here and decides which blocks are read.  If
+ * the buffers cannot be allocated the segment is handed back.
+ */
+static int gc_read_start(struct lsfs_context *ctx, uint32_t segment_id, struct gc_read *rd)
+{
+    struct lsfs_segment_table *table = &ctx->segtable;
+
+    rd->segment_id = segment_id;
+    rd->data = NULL;
+    rd->reqs = NULL;
+
+    pthread_mutex_lock(&table->lock);
+    rd->live_blocks = table->entries[segment_id].live_blocks;
+    memcpy(rd->live_map, table->entries[segment_id].live_map, sizeof(rd->live_map));
+    pthread_mutex_unlock(&table->lock);
+
+    if (rd->live_blocks == 0) {
+        return LSFS_OK;
+    }
+
+    rd->data = lsfs_io_alloc(LSFS_SEGMENT_SIZE);
+    rd->reqs = malloc(GC_MAX_READ_REQS * sizeof(*rd->reqs));
+    if (!rd->data || !rd->reqs) {
+        free(rd->data);
+        free(rd->reqs);
+        gc_release(ctx, segment_id, false);
+        return LSFS_ERR_NOMEM;
+    }
+
+    rd->job.reqs = rd->reqs;
+    rd->job.count = gc_build_reads(lsfs_segment_to_block(ctx, segment_id, 0),
+                                   table->segment_blocks, rd->live_map, rd->data, rd->reqs);
+    lsfs_read_async(ctx, &rd->job);
+    return LSFS_OK;
+}
+
+/*
+ * Claim the best remaining victim and start reading it
+ */
+static bool gc_read_next(struct lsfs_context *ctx, uint32_t max_utilization,
+                         struct gc_read *rd)
+{
+    uint32_t segment_id = gc_claim_victim(ctx, max_utilization);
+
+    return segment_id != UINT32_MAX && gc_read_start(ctx, segment_id, rd) == LSFS_OK;
+}
+
+/*
+ * Hand back a segment that was read but will not be cleaned after all
+ */
+static void gc_read_cancel(struct lsfs_context *ctx, struct gc_read *rd)
+{
+    if (rd->live_blocks > 0) {
+        lsfs_read_wait(ctx, &rd->job);
+        free(rd->reqs);
+        free(rd->data);
+    }
+    gc_release(ctx, rd->segment_id, false);
+}
+
+/*
+ * Clean a segment once gc_read_start() has been called for it
+ * The live bitmap decides which blocks are looked at: dead blocks are
+ * neither read nor checked against their owners, so the cost of cleaning
+ * follows the live data.  Live blocks are still checked against the owner
+ * as they are moved, since they may have died after the bitmap was read.
+ * Several cleaners may run this at once on different segments.
+ */
+static int gc_clean_read(struct lsfs_context *ctx, struct gc_read *rd)
+{
+    uint32_t segment_id = rd->segment_id;
+    const uint64_t *live_map = rd->live_map;
+    uint8_t *segment_data = rd->data;
+    uint64_t start = lsfs_stats_now();
+    int ret = LSFS_OK;
+
+    if (rd->live_blocks == 0) {
+        /* No live data, just free the segment */
+        gc_release(ctx, segment_id, true);
+        lsfs_stats_add(ctx, LSFS_CTR_GC_SEGMENTS, 1);
+        lsfs_stats_time(ctx, LSFS_LAT_GC_CLEAN, start);
+        LSFS_DEBUG("Freed empty segment %u", segment_id);
+        return LSFS_OK;
+    }
+
+    LSFS_INFO("Cleaning segment %u (%u live blocks)", segment_id, rd->live_blocks);
+
+    uint64_t seg_start = lsfs_segment_to_block(ctx, segment_id, 0);
+    ret = lsfs_read_wait(ctx, &rd->job);
+    free(rd->reqs);
+    if (ret != LSFS_OK) {
+        free(segment_data);
+        gc_release(ctx, segment_id, false);
+        return ret;
+    }
+
+    /* Parse segment summary, whichever copy is current */
+    uint32_t tail = LSFS_SUMMARY_TAIL(ctx->segtable.segment_blocks);
+    const struct lsfs_segment_summary *summary =
+        lsfs_segment_current_summary(ctx, segment_data,
+                                     segment_data + (size_t)tail * LSFS_BLOCK_SIZE, segment_id);
+
+    if (!summary) {
+        LSFS_ERROR("Invalid segment summary in segment %u", segment_id);
+        free(segment_data);
+        gc_quarantine(ctx, segment_id);
+        return LSFS_ERR_CORRUPT;
+    }
+
+    /* Process each block in the segment */
+    uint32_t num_blocks = summary->header.block_count;
+
+    /* Refuse to move live blocks that do not match their checksums */
+    if (ctx->verify_mode != LSFS_VERIFY_NONE) {
+        for (uint32_t i = LSFS_SUMMARY_BLOCKS; i < num_blocks; i++) {
+            if (gc_block_live(live_map, i) &&
+                lsfs_segment_check_block(summary, i,
+                                         segment_data + (size_t)i * LSFS_BLOCK_SIZE) != LSFS_OK) {
+                LSFS_ERROR("Checksum mismatch in segment %u block %u, not cleaning it",
+                           segment_id, i);
+                free(segment_data);
+                gc_quarantine(ctx, segment_id);
+                return LSFS_ERR_CORRUPT;
+            }
+        }
+    }
+
+    /* What is moved, and whatever is rewritten for it, may use the
+     * segments reserved for the cleaner */
+    lsfs_segment_set_cleaner(true);
+
+    for (uint32_t i = LSFS_SUMMARY_BLOCKS; i < num_blocks; i++) {
+        const struct lsfs_block_info *info = &summary->blocks[i - LSFS_SUMMARY_BLOCKS];
+        uint64_t current_loc;
+        uint32_t version;
+
+        if (!gc_block_live(live_map, i)) {
+            continue;
+        }
+
+        /* Inode map chunks are live while the inode map points at them */
+        if (info->type == LSFS_BLOCK_TYPE_IMAP) {
+            ret = lsfs_imap_move_chunk(ctx, info->offset, seg_start + i);
+            if (ret != LSFS_OK) {
+                LSFS_ERROR("Failed to relocate block during GC");
+                break;
+            }
+            continue;
+        }
+
+        /* Check if this block is still live */
+        if (info->ino == 0) {
+            continue;
+        }
+
+        /*
+         * For inode blocks, check each slot against the inode's current
+         * location.  The check and the rewrite happen under the inode lock
+         * so a concurrent update cannot be overwritten by the stale copy.
+         */
         if (info->type == LSFS_BLOCK_TYPE_INODE) {
-            if (lsfs_imap_get(&ctx->imap, info->ino, &current_loc, &version) == LSFS_OK) {
-                if (current_loc == seg_start + i) {
-                    /* Still live, copy to new location */
-                    uint8_t *block_data = segment_data + i * LSFS_BLOCK_SIZE;
-                    uint64_t new_loc = lsfs_segment_append_block(ctx, block_data,
-                                                                  info->ino, info->offset,
-                                                                  info->type);
-                    if (new_loc == 0) {
+            uint8_t *block_data = segment_data + i * LSFS_BLOCK_SIZE;
+
+            for (uint32_t slot = 0; slot < LSFS_INODES_PER_BLOCK; slot++) {
+                const struct lsfs_inode *disk_inode =
+                    (const struct lsfs_inode *)(block_data + slot * sizeof(struct lsfs_inode));
+                uint64_t location = LSFS_INODE_LOC(seg_start + i, slot);
+                uint32_t ino = disk_inode->ino;
+
+                if (ino == 0 ||
+                    lsfs_imap_get(&ctx->imap, ino, &current_loc, &version) != LSFS_OK ||
+                    current_loc != location) {
+                    continue;
+                }
+
+                struct lsfs_inode_mem *inode = lsfs_inode_get(ctx, ino);
+                if (!inode) {
+                    continue;
+                }
+
+                pthread_mutex_lock(&inode->lock);
+                if (lsfs_imap_get(&ctx->imap, ino, &current_loc, &version) == LSFS_OK &&
+                    current_loc == location) {
+                    /* Still live, write the current version elsewhere */
+                    inode->dirty = true;
+                    if (lsfs_inode_write(ctx, inode) != LSFS_OK) {
                         LSFS_ERROR("Failed to relocate block during GC");
                         ret = LSFS_ERR_NOSPC;
-                        break;
+                    } else {
+                        LSFS_DEBUG("Relocated inode %u from %" PRIu64 " slot %u",
+                                   ino, seg_start + i, slot);
                     }
+                }
+                pthread_mutex_unlock(&inode->lock);
+                lsfs_inode_put(inode);
 
-                    /* Update inode map */
-                    lsfs_imap_set(&ctx->imap, info->ino, new_loc);
-
-                    LSFS_DEBUG("Relocated inode %u from %" PRIu64 " to %" PRIu64,
-                               info->ino, seg_start + i, new_loc);
+                if (ret != LSFS_OK) {
+                    break;
                 }
             }
+
+            if (ret != LSFS_OK) {
+                break;
+            }
+        }
+        /*
+         * Data and directory blocks are moved a run at a time: blocks the
+         * same inode wrote to consecutive file offsets are handled together
+         */
+        else if (info->type == LSFS_BLOCK_TYPE_DATA ||
+                 info->type == LSFS_BLOCK_TYPE_DIRENT) {
+            uint32_t n = 1;
+
+            while (i + n < num_blocks && gc_block_live(live_map, i + n) &&
+                   info[n].ino == info->ino &&
+                   info[n].type == info->type &&
+                   info[n].offset == info->offset + n) {
+                n++;
+            }
+
+            ret = gc_move_data(ctx, info->ino, info->offset, seg_start + i, n,
+                               segment_data + (size_t)i * LSFS_BLOCK_SIZE);
+            if (ret != LSFS_OK) {
+                break;
+            }
+            i += n - 1;
+        }
+        /*
+         * Packed blocks are moved a slot run at a time: slots the same
+         * inode filled with consecutive file blocks are decompressed and
+         * rewritten together, and compressed again on the way out
+         */
+        else if (info->type == LSFS_BLOCK_TYPE_PACKED) {
+            ret = gc_move_packed(ctx, seg_start + i, segment_data + (size_t)i * LSFS_BLOCK_SIZE);
+            if (ret != LSFS_OK) {
+                break;
+            }
         }
-        /* For data blocks, need to check if inode still references this location */
-        else if (info->type == LSFS_BLOCK_TYPE_DATA) {
+        /* Extent blocks move with the next writeback of their inode */
+        else if (info->type == LSFS_BLOCK_TYPE_EXTENT) {
             struct lsfs_inode_mem *inode = lsfs_inode_get(ctx, info->ino);
             if (inode) {
-                bool is_live = false;
-
-                /* Check if this block is still referenced */
-                if (info->offset < LSFS_DIRECT_BLOCKS) {
-                    if (inode->disk_inode.direct[info->offset] == seg_start + i) {
-                        is_live = true;
-                    }
+                pthread_mutex_lock(&inode->lock);
+
+                /* Written even if the block is no longer used, as the
+                 * version last written may still use it */
+                lsfs_inode_move_extent_block(ctx, inode, seg_start + i);
+                if (lsfs_inode_write(ctx, inode) != LSFS_OK) {
+                    LSFS_ERROR("Failed to relocate block during GC");
+                    ret = LSFS_ERR_NOSPC;
                 }
-                /* TODO: Check indirect blocks */
-
-                if (is_live) {
-                    uint8_t *block_data = segment_data + i * LSFS_BLOCK_SIZE;
-                    uint64_t new_loc = lsfs_segment_append_block(ctx, block_data,
-                                                                  info->ino, info->offset,
-                                                                  info->type);
-                    if (new_loc == 0) {
-                        lsfs_inode_put(inode);
-                        ret = LSFS_ERR_NOSPC;
-                        break;
-                    }
 
-                    /* Update inode block pointer */
-                    if (info->offset < LSFS_DIRECT_BLOCKS) {
-                        inode->disk_inode.direct[info->offset] = new_loc;
-                        inode->dirty = true;
-                    }
+                pthread_mutex_unlock(&inode->lock);
+                lsfs_inode_put(inode);
 
-                    LSFS_DEBUG("Relocated data block (ino %u, off %u) from %" PRIu64 " to %" PRIu64,
-                               info->ino, info->offset, seg_start + i, new_loc);
+                if (ret != LSFS_OK) {
+                    break;
                 }
-
-                lsfs_inode_put(inode);
             }
         }
     }
 
+    lsfs_segment_set_cleaner(false);
     free(segment_data);
 
-    /* Mark segment as free */
+    /* Blocks that could not be moved still live here */
+    if (ret == LSFS_ERR_CORRUPT) {
+        gc_quarantine(ctx, segment_id);
+    } else {
+        gc_release(ctx, segment_id, ret == LSFS_OK);
+    }
+    if (ret == LSFS_ERR_NOSPC) {
+        gc_stall(ctx);
+    }
+    if (ret != LSFS_OK) {
+        return ret;
+    }
+
+    lsfs_stats_add(ctx, LSFS_CTR_GC_SEGMENTS, 1);
+    lsfs_stats_add(ctx, LSFS_CTR_GC_LIVE, rd->live_blocks);
+    lsfs_stats_time(ctx, LSFS_LAT_GC_CLEAN, start);
+    LSFS_INFO("Cleaned segment %u", segment_id);
+
+    return LSFS_OK;
+}
+
+/*
+ * Clean a segment taken for cleaning
+ */
+static int gc_clean_claimed(struct lsfs_context *ctx, uint32_t segment_id)
+{
+    struct gc_read rd;
+    int ret = gc_read_start(ctx, segment_id, &rd);
+
+    return ret == LSFS_OK ? gc_clean_read(ctx, &rd) : ret;
+}
+
+/*
+ * Clean a single segment
+ */
+int lsfs_gc_clean_segment(struct lsfs_context *ctx, uint32_t segment_id)
+{
+    struct lsfs_segment_table *table = &ctx->segtable;
+
+    if (segment_id >= table->count) {
+        return LSFS_ERR_INVAL;
+    }
+
     pthread_mutex_lock(&table->lock);
-    table->entries[segment_id].state = LSFS_SEG_FREE;
-    table->entries[segment_id].live_blocks = 0;
-    table->free_count++;
-    ctx->sb.free_segments = table->free_count;
+
+    /* Check if segment is still a good candidate */
+    if (table->entries[segment_id].state != LSFS_SEG_FULL) {
+        pthread_mutex_unlock(&table->lock);
+        return LSFS_OK;  /* Already cleaned, active or being cleaned */
+    }
+    if (gc_quarantined(table, segment_id)) {
+        pthread_mutex_unlock(&table->lock);
+        return LSFS_ERR_CORRUPT;
+    }
+
+    table->entries[segment_id].state = LSFS_SEG_CLEANING;
+    table->cleaning++;
+    lsfs_gc_victim_update(table, segment_id);
     pthread_mutex_unlock(&table->lock);
 
-    LSFS_INFO("Cleaned segment %u", segment_id);
+    return gc_clean_claimed(ctx, segment_id);
+}
 
-    return ret;
+/*
+ * Make the work of a cleaning round durable
+ */
+static void gc_persist(struct lsfs_context *ctx)
+{
+    /* Relocated blocks went out with their inodes already.  The segments
+     * cleaned come back with the checkpoint below, which a writer short of
+     * space may be waiting for with its inode lock held, so busy inodes
+     * are not waited for. */
+    lsfs_inode_sync_all(ctx, false);
+
+    /* Flush segment buffer */
+    lsfs_segment_flush(ctx);
+
+    /* Write checkpoint to persist inode map changes */
+    lsfs_checkpoint_write(ctx);
+}
+
+/*
+ * Have the blocks files dropped marked dead, so they can be cleaned
+ * Idle dirty inodes are written back, and if that or earlier writebacks
+ * handed any blocks over, a checkpoint marks them dead.  Returns whether
+ * it did.  For when the cleaner runs out of victims while short of space.
+ */
+static bool gc_expose_dropped(struct lsfs_context *ctx)
+{
+    struct lsfs_segment_table *table = &ctx->segtable;
+    bool dropped;
+
+    lsfs_inode_sync_all(ctx, false);
+
+    pthread_mutex_lock(&table->lock);
+    dropped = table->dead.count > 0;
+    pthread_mutex_unlock(&table->lock);
+
+    if (dropped) {
+        lsfs_segment_flush(ctx);
+        lsfs_checkpoint_write(ctx);
+    }
+    return dropped;
+}
+
+/*
+ * Count the free segments that are not promised to preallocated files
+ * Segments waiting for a checkpoint are left out unless released is set;
+ * those being discarded are back in a moment and count as free.  Caller
+ * must hold segtable.lock.
+ */
+static uint32_t gc_free_segments(const struct lsfs_segment_table *table, bool released)
+{
+    uint32_t free_count = table->free_count + table->discard_count +
+                          (released ? table->released_count : 0);
+    uint32_t promised = lsfs_segment_prealloc_count(table);
+
+    return free_count > promised ? free_count - promised : 0;
+}
+
+/*
+ * Get the percentage of segments that are free, counting extra of them
+ * as freed already
+ */
+static uint32_t gc_free_percent(struct lsfs_context *ctx, uint32_t extra)
+{
+    struct lsfs_segment_table *table = &ctx->segtable;
+    uint32_t free_percent;
+
+    pthread_mutex_lock(&table->lock);
+    free_percent = ((gc_free_segments(table, true) + extra) * 100) / table->count;
+    pthread_mutex_unlock(&table->lock);
+
+    return free_percent;
+}
+
+/*
+ * Check whether cleaning should stop for a checkpoint
+ * Segments cleaned become reusable only once a checkpoint is written, so
+ * a batch ends early when the relocations may need them.
+ */
+static bool gc_reuse_due(struct lsfs_context *ctx)
+{
+    struct lsfs_segment_table *table = &ctx->segtable;
+    bool due;
+
+    pthread_mutex_lock(&table->lock);
+    due = table->released_count > 0 && table->free_count <= LSFS_GC_RESERVE_SEGMENTS + 1;
+    pthread_mutex_unlock(&table->lock);
+
+    return due;
 }
 
 /*
  * Run garbage collection
+ * Cleans up to a batch of segments until enough are free, from the
+ * caller's thread.  The next victim is read while the current one is
+ * relocated.  A checkpoint is written first whenever free segments run
+ * out while cleaned ones wait for it.  Returns LSFS_ERR_NOSPC once there
+ * is no room left to move live blocks into.
  */
 int lsfs_gc_run(struct lsfs_context *ctx)
 {
-    struct lsfs_segment_table *table = &ctx->segtable;
+    struct gc_read rd[2];
+    uint32_t cur = 0;
+    bool have = false;
     int cleaned = 0;
     int ret = LSFS_OK;
 
     /* Clean segments until we have enough free space */
-    while (1) {
-        uint32_t free_percent;
-
-        pthread_mutex_lock(&table->lock);
-        free_percent = (table->free_count * 100) / table->count;
-        pthread_mutex_unlock(&table->lock);
-
-        if (free_percent >= GC_THRESHOLD_HIGH) {
-            break;  /* Enough free space */
+    while (cleaned < GC_BATCH) {
+        if (!have) {
+            if (gc_free_percent(ctx, 0) >= GC_THRESHOLD_HIGH) {
+                break;  /* Enough free space */
+            }
+            if (gc_stalled(ctx)) {
+                ret = LSFS_ERR_NOSPC;
+                break;
+            }
+            if (gc_reuse_due(ctx)) {
+                gc_persist(ctx);
+            }
+            have = gc_read_next(ctx, GC_UTILIZATION_THRESHOLD, &rd[cur]);
+            if (!have) {
+                LSFS_DEBUG("No suitable segments for GC");
+                break;
+            }
         }
 
-        /* Select a segment to clean */
-        uint32_t segment_id = lsfs_gc_select_segment(ctx);
-        if (segment_id == UINT32_MAX) {
-            LSFS_DEBUG("No suitable segments for GC");
-            break;
+        /* The segment about to be cleaned counts as free already */
+        bool next = cleaned + 1 < GC_BATCH && !gc_reuse_due(ctx) &&
+                    gc_free_percent(ctx, 1) < GC_THRESHOLD_HIGH &&
+                    gc_read_next(ctx, GC_UTILIZATION_THRESHOLD, &rd[cur ^ 1]);
+
+        ret = gc_clean_read(ctx, &rd[cur]);
+        cur ^= 1;
+        have = next;
+        if (ret == LSFS_ERR_CORRUPT) {
+            /* Left out of cleaning; go on with the next candidate */
+            ret = LSFS_OK;
+            continue;
         }
-
-        /* Clean the segment */
-        ret = lsfs_gc_clean_segment(ctx, segment_id);
         if (ret != LSFS_OK) {
             break;
         }
 
         cleaned++;
+    }
 
-        /* Limit number of segments cleaned in one run */
-        if (cleaned >= 5) {
-            break;
-        }
+    if (have) {
+        gc_read_cancel(ctx, &rd[cur]);
     }
 
     if (cleaned > 0) {
         LSFS_INFO("GC completed: cleaned %d segments", cleaned);
+        gc_persist(ctx);
+    }
 
-        /* Flush segment buffer */
-        lsfs_segment_flush(ctx);
+    return ret;
+}
 
-        /* Write checkpoint to persist inode map changes */
-        lsfs_checkpoint_write(ctx);
+/*
+ * Work out how many more segments the cleaners should clean
+ * Below the low watermark they clean flat out until the high watermark
+ * is reached again, and so they do once file data is down to the
+ * reserve, which on a small image is well above the low watermark: a
+ * writer held off the reserve appends nothing, so pacing alone would
+ * never give the cleaners budget to let it through.  In between, each
+ * pacing interval adds what the free count fell by during the last one,
+ * plus one segment if anything was written, so cleaning follows the
+ * foreground write rate without racing ahead of it.  Above the high
+ * watermark a cleaner only runs when nothing was written for a whole
+ * interval, and then only on cheap segments.
+ * Segments waiting for a checkpoint do not count as free, since nothing
+ * can be written to them yet, and neither do those promised to
+ * preallocated files.  Caller must hold gc_lock.
+ */
+static void gc_pace_locked(struct lsfs_context *ctx)
+{
+    struct lsfs_segment_table *table = &ctx->segtable;
+    uint64_t now = gc_now_ms();
+    uint32_t free_count, free_percent;
+    uint64_t appended;
+
+    pthread_mutex_lock(&table->lock);
+    free_count = gc_free_segments(table, false);
+    free_percent = (free_count * 100) / table->count;
+    appended = table->appended;
+    pthread_mutex_unlock(&table->lock);
+
+    if (free_percent < GC_THRESHOLD_LOW || free_count <= LSFS_GC_RESERVE_SEGMENTS) {
+        ctx->gc_urgent = true;
+    } else if (free_percent >= GC_THRESHOLD_HIGH) {
+        ctx->gc_urgent = false;
     }
 
-    return ret;
+    if (ctx->gc_urgent) {
+        ctx->gc_idle = false;
+        ctx->gc_budget = LSFS_MAX(ctx->gc_budget, ctx->gc_thread_count);
+        return;
+    }
+
+    if (now - ctx->gc_paced_at < GC_TICK_MS) {
+        return;
+    }
+
+    bool written = appended != ctx->gc_paced_appended;
+    uint32_t fallen = ctx->gc_paced_free > free_count ? ctx->gc_paced_free - free_count : 0;
+
+    ctx->gc_paced_at = now;
+    ctx->gc_paced_appended = appended;
+    ctx->gc_paced_free = free_count;
+    ctx->gc_idle = false;
+
+    if (free_percent < GC_THRESHOLD_HIGH) {
+        ctx->gc_budget += fallen + (written ? 1 : 0);
+    } else if (!written && free_percent < GC_IDLE_THRESHOLD && ctx->gc_budget == 0) {
+        ctx->gc_idle = true;
+        ctx->gc_budget = 1;
+    }
+
+    ctx->gc_budget = LSFS_MIN(ctx->gc_budget, GC_BATCH * ctx->gc_thread_count);
+}
+
+/*
+ * Background GC thread function
+ * Cleaners share the budget worked out by gc_pace_locked() and each
+ * cleans its own victims, so segments are read in parallel.  While there
+ * is budget for another segment, a cleaner claims its next victim and
+ * reads it while relocating the current one.  A checkpoint is written
+ * after every batch and whenever a cleaner runs out of work, and a batch
+ * ends early once free segments run out while cleaned ones wait for it.
+ * Cleaners out of room to move blocks into wait for the stall to end.
+ */
+static void *gc_thread_func(void *arg)
+{
+    struct lsfs_context *ctx = (struct lsfs_context *)arg;
+    struct gc_read rd[2];
+    uint32_t cur = 0;
+    bool ahead = false;
+    uint32_t cleaned = 0;
+
+    LSFS_INFO("GC thread started");
+
+    pthread_mutex_lock(&ctx->gc_lock);
+
+    while (ctx->gc_running) {
+        uint32_t segment_id = UINT32_MAX;
+
+        gc_pace_locked(ctx);
+        if (ahead || (ctx->gc_budget > 0 && !gc_stalled(ctx))) {
+            uint32_t max_utilization = ctx->gc_urgent ? GC_URGENT_UTILIZATION :
+                                       ctx->gc_idle ? GC_IDLE_UTILIZATION :
+                                       GC_UTILIZATION_THRESHOLD;
+
+            if (!ahead) {
+                ctx->gc_budget--;
+            }
+            bool next = ctx->gc_budget > 0 && cleaned + 1 < GC_BATCH && !gc_reuse_due(ctx);
+            if (next) {
+                ctx->gc_budget--;
+            }
+            pthread_mutex_unlock(&ctx->gc_lock);
+
+            bool have = ahead || gc_read_next(ctx, max_utilization, &rd[cur]);
+            bool skipped = false;
+            ahead = have && next && gc_read_next(ctx, max_utilization, &rd[cur ^ 1]);
+            if (have) {
+                int ret = gc_clean_read(ctx, &rd[cur]);
+
+                if (ret == LSFS_OK) {
+                    segment_id = rd[cur].segment_id;
+                    cleaned++;
+                }
+                skipped = ret == LSFS_ERR_CORRUPT;
+                cur ^= 1;
+            }
+
+            pthread_mutex_lock(&ctx->gc_lock);
+            if (skipped) {
+                /* Left out of cleaning; its budget goes to the next candidate */
+                ctx->gc_budget++;
+                continue;
+            }
+            if (segment_id != UINT32_MAX && (ahead || (cleaned < GC_BATCH && !gc_reuse_due(ctx)))) {
+                continue;
+            }
+            if (segment_id == UINT32_MAX) {
+                ctx->gc_budget = 0;  /* Nothing worth cleaning */
+
+                /* Unless blocks dropped since the last checkpoint are */
+                if (ctx->gc_urgent && cleaned == 0) {
+                    pthread_mutex_unlock(&ctx->gc_lock);
+                    bool exposed = gc_expose_dropped(ctx);
+                    pthread_mutex_lock(&ctx->gc_lock);
+                    if (exposed) {
+                        continue;
+                    }
+                }
+            }
+        }
+
+        if (cleaned > 0) {
+            pthread_mutex_unlock(&ctx->gc_lock);
+            LSFS_INFO("GC completed: cleaned %u segments", cleaned);
+
+            gc_persist(ctx);
+            cleaned = 0;
+            pthread_mutex_lock(&ctx->gc_lock);
+            continue;
+        }
+
+        /* Wait for the next interval or a trigger, unless a victim is
+         * already claimed */
+        if (ctx->gc_running && !ahead) {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_sec += GC_TICK_MS / 1000;
+            pthread_cond_timedwait(&ctx->gc_cond, &ctx->gc_lock, &ts);
+        }
+    }
+
+    pthread_mutex_unlock(&ctx->gc_lock);
+
+    if (ahead) {
+        gc_read_cancel(ctx, &rd[cur]);
+    }
+
+    LSFS_INFO("GC thread stopped");
+    return NULL;
+}
+
+/*
+ * Initialize garbage collector
+ * Starts gc_thread_count cleaner threads (LSFS_GC_DEFAULT_THREADS if
+ * unset).
+ */
+int lsfs_gc_init(struct lsfs_context *ctx)
+{
+    if (ctx->gc_thread_count == 0) {
+        ctx->gc_thread_count = LSFS_GC_DEFAULT_THREADS;
+    }
+
+    ctx->gc_threads = calloc(ctx->gc_thread_count, sizeof(pthread_t));
+    if (!ctx->gc_threads) {
+        return LSFS_ERR_NOMEM;
+    }
+
+    ctx->gc_running = true;
+    ctx->gc_urgent = false;
+    ctx->gc_idle = false;
+    ctx->gc_budget = 0;
+    ctx->gc_paced_at = gc_now_ms();
+    pthread_mutex_lock(&ctx->segtable.lock);
+    ctx->gc_paced_appended = ctx->segtable.appended;
+    ctx->gc_paced_free = gc_free_segments(&ctx->segtable, false);
+    pthread_mutex_unlock(&ctx->segtable.lock);
+
+    if (pthread_mutex_init(&ctx->gc_lock, NULL) != 0) {
+        free(ctx->gc_threads);
+        ctx->gc_threads = NULL;
+        ctx->gc_running = false;
+        return LSFS_ERR_NOMEM;
+    }
+
+    if (pthread_cond_init(&ctx->gc_cond, NULL) != 0) {
+        pthread_mutex_destroy(&ctx->gc_lock);
+        free(ctx->gc_threads);
+        ctx->gc_threads = NULL;
+        ctx->gc_running = false;
+        return LSFS_ERR_NOMEM;
+    }
+
+    for (uint32_t i = 0; i < ctx->gc_thread_count; i++) {
+        if (pthread_create(&ctx->gc_threads[i], NULL, gc_thread_func, ctx) != 0) {
+            /* Stop the ones already started */
+            pthread_mutex_lock(&ctx->gc_lock);
+            ctx->gc_running = false;
+            pthread_cond_broadcast(&ctx->gc_cond);
+            pthread_mutex_unlock(&ctx->gc_lock);
+            for (uint32_t j = 0; j < i; j++) {
+                pthread_join(ctx->gc_threads[j], NULL);
+            }
+            pthread_cond_destroy(&ctx->gc_cond);
+            pthread_mutex_destroy(&ctx->gc_lock);
+            free(ctx->gc_threads);
+            ctx->gc_threads = NULL;
+            return LSFS_ERR_NOMEM;
+        }
+    }
+
+    if (ctx->gc_thread_count > 1) {
+        LSFS_INFO("Using %u cleaner threads", ctx->gc_thread_count);
+    }
+
+    return LSFS_OK;
+}
+
+/*
+ * Destroy garbage collector
+ */
+void lsfs_gc_destroy(struct lsfs_context *ctx)
+{
+    if (!ctx->gc_running) {
+        return;  /* Never started */
+    }
+
+    pthread_mutex_lock(&ctx->gc_lock);
+    ctx->gc_running = false;
+    pthread_cond_broadcast(&ctx->gc_cond);
+    pthread_mutex_unlock(&ctx->gc_lock);
+
+    for (uint32_t i = 0; i < ctx->gc_thread_count; i++) {
+        pthread_join(ctx->gc_threads[i], NULL);
+    }
+    free(ctx->gc_threads);
+    ctx->gc_threads = NULL;
+
+    pthread_cond_destroy(&ctx->gc_cond);
+    pthread_mutex_destroy(&ctx->gc_lock);
+}
+
+/*
+ * Check if GC is needed
+ */
+bool lsfs_gc_needed(struct lsfs_context *ctx)
+{
+    struct lsfs_segment_table *table = &ctx->segtable;
+    uint32_t free_percent;
+
+    pthread_mutex_lock(&table->lock);
+    free_percent = (gc_free_segments(table, true) * 100) / table->count;
+    pthread_mutex_unlock(&table->lock);
+
+    return free_percent < GC_THRESHOLD_LOW;
+}
+
+/*
+ * Trigger GC
+ * Callers are short of free segments, so the cleaners start cleaning
+ * flat out at once instead of waiting for pacing to give them budget.
+ * Safe to call before the cleaners are started or after they stopped.
+ */
+void lsfs_gc_trigger(struct lsfs_context *ctx)
+{
+    if (!ctx->gc_threads) {
+        return;
+    }
+
+    pthread_mutex_lock(&ctx->gc_lock);
+    ctx->gc_urgent = true;
+    ctx->gc_idle = false;
+    ctx->gc_budget = LSFS_MAX(ctx->gc_budget, ctx->gc_thread_count);
+    pthread_cond_broadcast(&ctx->gc_cond);
+    pthread_mutex_unlock(&ctx->gc_lock);
 }
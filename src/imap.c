@@ -6,122 +6,158 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <inttypes.h>
 
 #include "lsfs.h"
 
-#define IMAP_INITIAL_CAPACITY   1024
-#define IMAP_GROWTH_FACTOR      2
+#define IMAP_CHUNK(ino)         ((ino) / LSFS_IMAP_CHUNK_ENTRIES)
+#define IMAP_SLOT(ino)          ((ino) % LSFS_IMAP_CHUNK_ENTRIES)
+#define IMAP_LOAD_BATCH         256     /* Chunks read per batch at mount */
 
 /*
- * Initialize inode map
+ * Bitmap helpers
  */
-int lsfs_imap_init(struct lsfs_imap *imap)
+static inline bool imap_bit_test(const uint64_t *map, uint32_t bit)
 {
-    imap->entries = calloc(IMAP_INITIAL_CAPACITY, sizeof(struct lsfs_imap_entry));
-    if (!imap->entries) {
-        return LSFS_ERR_NOMEM;
-    }
-
-    imap->capacity = IMAP_INITIAL_CAPACITY;
-    imap->count = 0;
-    imap->next_ino = LSFS_ROOT_INO + 1;  /* Start after root inode */
+    return (map[bit / 64] >> (bit % 64)) & 1;
+}
 
-    if (pthread_rwlock_init(&imap->lock, NULL) != 0) {
-        free(imap->entries);
-        return LSFS_ERR_NOMEM;
-    }
+static inline void imap_bit_set(uint64_t *map, uint32_t bit)
+{
+    map[bit / 64] |= 1ULL << (bit % 64);
+}
 
-    return LSFS_OK;
+static inline void imap_bit_clear(uint64_t *map, uint32_t bit)
+{
+    map[bit / 64] &= ~(1ULL << (bit % 64));
 }
 
 /*
- * Destroy inode map
+ * Mark an inode number in use
  */
-void lsfs_imap_destroy(struct lsfs_imap *imap)
+static void imap_use(struct lsfs_imap *imap, uint32_t ino)
 {
-    if (imap->entries) {
-        free(imap->entries);
-        imap->entries = NULL;
+    imap_bit_set(imap->used, ino);
+    if (imap->used[ino / 64] == ~0ULL) {
+        imap_bit_set(imap->full, ino / 64);
     }
-    pthread_rwlock_destroy(&imap->lock);
 }
 
 /*
- * Find entry index for inode number using binary search
- * Returns index if found, or -1 if not found
+ * Mark an inode number free
  */
-static int imap_find(struct lsfs_imap *imap, uint32_t ino)
+static void imap_unuse(struct lsfs_imap *imap, uint32_t ino)
 {
-    if (imap->count == 0) {
-        return -1;
-    }
+    imap_bit_clear(imap->used, ino);
+    imap_bit_clear(imap->full, ino / 64);
+}
 
-    int left = 0;
-    int right = (int)imap->count - 1;
+/*
+ * Record that a chunk's log address changed
+ * Both checkpoint regions hold a stale copy of its table block until
+ * they are next written.
+ */
+static void imap_table_changed(struct lsfs_imap *imap, uint32_t chunk)
+{
+    imap_bit_set(imap->table_dirty[0], chunk / LSFS_IMAP_TABLE_ENTRIES);
+    imap_bit_set(imap->table_dirty[1], chunk / LSFS_IMAP_TABLE_ENTRIES);
+}
 
-    while (left <= right) {
-        int mid = left + (right - left) / 2;
-        if (imap->entries[mid].ino == ino) {
-            return mid;
-        }
-        if (imap->entries[mid].ino < ino) {
-            left = mid + 1;
-        } else {
-            right = mid - 1;
+/*
+ * Destroy inode map
+ */
+void lsfs_imap_destroy(struct lsfs_imap *imap)
+{
+    if (imap->chunks) {
+        for (uint32_t i = 0; i < imap->chunk_count; i++) {
+            free(imap->chunks[i]);
         }
     }
-
-    return -1;
+    free(imap->chunks);
+    free(imap->chunk_addr);
+    free(imap->dirty);
+    free(imap->table_dirty[0]);
+    free(imap->table_dirty[1]);
+    free(imap->used);
+    free(imap->full);
+    imap->chunks = NULL;
+    imap->chunk_addr = NULL;
+    imap->dirty = NULL;
+    imap->table_dirty[0] = NULL;
+    imap->table_dirty[1] = NULL;
+    imap->used = NULL;
+    imap->full = NULL;
+    pthread_rwlock_destroy(&imap->lock);
 }
 
 /*
- * Find insertion point for inode number
- * Returns index where entry should be inserted
+ * Initialize inode map for max_inodes inode numbers
+ * max_inodes must be a multiple of LSFS_IMAP_CHUNK_ENTRIES.  Every block
+ * of the chunk table starts out stale in both checkpoint regions.
  */
-static uint32_t imap_find_insert_pos(struct lsfs_imap *imap, uint32_t ino)
+int lsfs_imap_init(struct lsfs_imap *imap, uint32_t max_inodes)
 {
-    if (imap->count == 0) {
-        return 0;
+    memset(imap, 0, sizeof(*imap));
+    imap->next_ino = LSFS_ROOT_INO + 1;  /* Start after root inode */
+    imap->max_inodes = max_inodes;
+    imap->chunk_count = max_inodes / LSFS_IMAP_CHUNK_ENTRIES;
+    imap->table_blocks = LSFS_DIV_ROUND_UP(imap->chunk_count, LSFS_IMAP_TABLE_ENTRIES);
+
+    if (pthread_rwlock_init(&imap->lock, NULL) != 0) {
+        return LSFS_ERR_NOMEM;
+    }
+
+    uint32_t words = max_inodes / 64;
+    uint32_t full_words = LSFS_DIV_ROUND_UP(words, 64);
+    uint32_t table_words = LSFS_DIV_ROUND_UP(imap->table_blocks, 64);
+
+    imap->chunks = calloc(imap->chunk_count, sizeof(*imap->chunks));
+    imap->chunk_addr = calloc(imap->chunk_count, sizeof(uint64_t));
+    imap->dirty = calloc(LSFS_DIV_ROUND_UP(imap->chunk_count, 64), sizeof(uint64_t));
+    imap->table_dirty[0] = calloc(table_words, sizeof(uint64_t));
+    imap->table_dirty[1] = calloc(table_words, sizeof(uint64_t));
+    imap->used = calloc(words, sizeof(uint64_t));
+    imap->full = calloc(full_words, sizeof(uint64_t));
+    if (!imap->chunks || !imap->chunk_addr || !imap->dirty || !imap->table_dirty[0] ||
+        !imap->table_dirty[1] || !imap->used || !imap->full) {
+        lsfs_imap_destroy(imap);
+        return LSFS_ERR_NOMEM;
     }
 
-    uint32_t left = 0;
-    uint32_t right = imap->count;
+    for (uint32_t i = 0; i < imap->table_blocks; i++) {
+        imap_bit_set(imap->table_dirty[0], i);
+        imap_bit_set(imap->table_dirty[1], i);
+    }
 
-    while (left < right) {
-        uint32_t mid = left + (right - left) / 2;
-        if (imap->entries[mid].ino < ino) {
-            left = mid + 1;
-        } else {
-            right = mid;
-        }
+    /* Words past the end count as full, so the search never lands there */
+    for (uint32_t w = words; w < full_words * 64; w++) {
+        imap_bit_set(imap->full, w);
     }
 
-    return left;
+    /* Inode 0 is never handed out */
+    imap_use(imap, 0);
+
+    return LSFS_OK;
 }
 
 /*
- * Grow inode map capacity
+ * Find the entry for an inode number
+ * Returns NULL if the inode has no entry.  Caller must hold imap->lock.
  */
-static int imap_grow(struct lsfs_imap *imap)
+static struct lsfs_imap_entry *imap_find(struct lsfs_imap *imap, uint32_t ino)
 {
-    uint32_t new_capacity = imap->capacity * IMAP_GROWTH_FACTOR;
-    struct lsfs_imap_entry *new_entries;
+    struct lsfs_imap_entry *chunk;
 
-    if (new_capacity > LSFS_MAX_INODES) {
-        new_capacity = LSFS_MAX_INODES;
-        if (new_capacity <= imap->capacity) {
-            return LSFS_ERR_NOSPC;
-        }
+    if (ino >= imap->max_inodes) {
+        return NULL;
     }
 
-    new_entries = realloc(imap->entries, new_capacity * sizeof(struct lsfs_imap_entry));
-    if (!new_entries) {
-        return LSFS_ERR_NOMEM;
+    chunk = imap->chunks[IMAP_CHUNK(ino)];
+    if (!chunk || chunk[IMAP_SLOT(ino)].ino != ino) {
+        return NULL;
     }
 
-    imap->entries = new_entries;
-    imap->capacity = new_capacity;
-    return LSFS_OK;
+    return &chunk[IMAP_SLOT(ino)];
 }
 
 /*
@@ -134,11 +170,11 @@ int lsfs_imap_get(struct lsfs_imap *imap, uint32_t ino, uint64_t *location,
 
     pthread_rwlock_rdlock(&imap->lock);
 
-    int idx = imap_find(imap, ino);
-    if (idx >= 0) {
-        *location = imap->entries[idx].location;
+    struct lsfs_imap_entry *entry = imap_find(imap, ino);
+    if (entry) {
+        *location = entry->location;
         if (version) {
-            *version = imap->entries[idx].version;
+            *version = entry->version;
         }
         ret = LSFS_OK;
     }
@@ -152,90 +188,124 @@ int lsfs_imap_get(struct lsfs_imap *imap, uint32_t ino, uint64_t *location,
  */
 int lsfs_imap_set(struct lsfs_imap *imap, uint32_t ino, uint64_t location)
 {
-    int ret = LSFS_OK;
+    struct lsfs_imap_entry *chunk;
+    struct lsfs_imap_entry *entry;
 
-    pthread_rwlock_wrlock(&imap->lock);
-
-    int idx = imap_find(imap, ino);
-    if (idx >= 0) {
-        /* Update existing entry */
-        imap->entries[idx].location = location;
-        imap->entries[idx].version++;
-    } else {
-        /* Insert new entry */
-        if (imap->count >= imap->capacity) {
-            ret = imap_grow(imap);
-            if (ret != LSFS_OK) {
-                pthread_rwlock_unlock(&imap->lock);
-                return ret;
-            }
-        }
+    if (ino == 0 || ino >= imap->max_inodes) {
+        return LSFS_ERR_INVAL;
+    }
 
-        uint32_t pos = imap_find_insert_pos(imap, ino);
+    pthread_rwlock_wrlock(&imap->lock);
 
-        /* Shift entries to make room */
-        if (pos < imap->count) {
-            memmove(&imap->entries[pos + 1], &imap->entries[pos],
-                    (imap->count - pos) * sizeof(struct lsfs_imap_entry));
+    chunk = imap->chunks[IMAP_CHUNK(ino)];
+    if (!chunk) {
+        chunk = calloc(LSFS_IMAP_CHUNK_ENTRIES, sizeof(*chunk));
+        if (!chunk) {
+            pthread_rwlock_unlock(&imap->lock);
+            return LSFS_ERR_NOMEM;
         }
+        imap->chunks[IMAP_CHUNK(ino)] = chunk;
+    }
 
-        /* Insert new entry */
-        imap->entries[pos].ino = ino;
-        imap->entries[pos].location = location;
-        imap->entries[pos].version = 1;
+    entry = &chunk[IMAP_SLOT(ino)];
+    if (entry->ino == ino) {
+        /* Update existing entry */
+        entry->location = location;
+        entry->version++;
+    } else {
+        /* New entry */
+        entry->ino = ino;
+        entry->location = location;
+        entry->version = 1;
         imap->count++;
+        imap_use(imap, ino);
     }
 
+    imap_bit_set(imap->dirty, IMAP_CHUNK(ino));
+
     pthread_rwlock_unlock(&imap->lock);
-    return ret;
+    return LSFS_OK;
 }
 
 /*
  * Remove inode from map
+ * The inode number becomes free for allocation even if it was never set.
  */
 int lsfs_imap_remove(struct lsfs_imap *imap, uint32_t ino)
 {
+    if (ino == 0 || ino >= imap->max_inodes) {
+        return LSFS_ERR_NOENT;
+    }
+
     pthread_rwlock_wrlock(&imap->lock);
 
-    int idx = imap_find(imap, ino);
-    if (idx < 0) {
+    imap_unuse(imap, ino);
+
+    struct lsfs_imap_entry *entry = imap_find(imap, ino);
+    if (!entry) {
         pthread_rwlock_unlock(&imap->lock);
         return LSFS_ERR_NOENT;
     }
 
-    /* Shift entries to fill gap */
-    if ((uint32_t)idx < imap->count - 1) {
-        memmove(&imap->entries[idx], &imap->entries[idx + 1],
-                (imap->count - idx - 1) * sizeof(struct lsfs_imap_entry));
-    }
-
+    memset(entry, 0, sizeof(*entry));
     imap->count--;
+    imap_bit_set(imap->dirty, IMAP_CHUNK(ino));
 
     pthread_rwlock_unlock(&imap->lock);
     return LSFS_OK;
 }
 
+/*
+ * Find the first word of the used bitmap at or after start with a free
+ * number, wrapping around
+ * Returns UINT32_MAX if every word is full.  Caller must hold imap->lock.
+ */
+static uint32_t imap_next_open_word(const struct lsfs_imap *imap, uint32_t start)
+{
+    uint32_t groups = LSFS_DIV_ROUND_UP(imap->max_inodes / 64, 64);
+    uint32_t g = start / 64;
+    uint64_t open = ~imap->full[g] & (~0ULL << (start % 64));
+
+    for (uint32_t n = 0; n <= groups; n++) {
+        if (open) {
+            return g * 64 + (uint32_t)__builtin_ctzll(open);
+        }
+        g = (g + 1) % groups;
+        open = ~imap->full[g];
+    }
+
+    return UINT32_MAX;
+}
+
 /*
  * Allocate a new inode number
+ * Numbers are handed out in increasing order from next_ino and wrap
+ * around, so a freed number is not reused until the others have been.
+ * Full words of the used bitmap are skipped through the full bitmap, so
+ * the search stays short however many inodes are in use.  Returns 0 if
+ * every inode number is in use.
  */
 uint32_t lsfs_imap_alloc_ino(struct lsfs_imap *imap)
 {
-    uint32_t ino;
+    uint32_t ino = 0;
 
     pthread_rwlock_wrlock(&imap->lock);
 
-    if (imap->next_ino >= LSFS_MAX_INODES) {
-        /* Try to find a free inode number */
-        ino = 0;
-        for (uint32_t i = LSFS_ROOT_INO + 1; i < LSFS_MAX_INODES; i++) {
-            int idx = imap_find(imap, i);
-            if (idx < 0) {
-                ino = i;
-                break;
-            }
+    uint32_t word = imap->next_ino / 64;
+    uint64_t free_bits = ~imap->used[word] & (~0ULL << (imap->next_ino % 64));
+
+    /* Coming back round to the first word picks up the numbers below next_ino */
+    if (!free_bits) {
+        word = imap_next_open_word(imap, (word + 1) % (imap->max_inodes / 64));
+        if (word != UINT32_MAX) {
+            free_bits = ~imap->used[word];
         }
-    } else {
-        ino = imap->next_ino++;
+    }
+
+    if (free_bits) {
+        ino = word * 64 + (uint32_t)__builtin_ctzll(free_bits);
+        imap_use(imap, ino);
+        imap->next_ino = (ino + 1) % imap->max_inodes;
     }
 
     pthread_rwlock_unlock(&imap->lock);
@@ -243,42 +313,254 @@ uint32_t lsfs_imap_alloc_ino(struct lsfs_imap *imap)
 }
 
 /*
- * Save inode map to disk
+ * Append one dirty chunk to the log
+ * Chunks left empty are dropped from the chunk table.
  */
-int lsfs_imap_save(struct lsfs_context *ctx, uint64_t start_block)
+static int imap_save_chunk(struct lsfs_context *ctx, uint32_t chunk, uint32_t *written)
 {
     struct lsfs_imap *imap = &ctx->imap;
-    uint8_t *buf;
-    uint32_t blocks_needed;
-    uint32_t entries_per_block;
+    uint8_t block[LSFS_BLOCK_SIZE];
+    uint64_t old_addr;
+    uint64_t addr = 0;
+    bool empty = true;
 
-    pthread_rwlock_rdlock(&imap->lock);
+    /* Clear the bit as the chunk is copied, so later changes set it again */
+    pthread_rwlock_wrlock(&imap->lock);
+    if (!imap_bit_test(imap->dirty, chunk)) {
+        pthread_rwlock_unlock(&imap->lock);
+        return LSFS_OK;
+    }
+    for (uint32_t slot = 0; slot < LSFS_IMAP_CHUNK_ENTRIES; slot++) {
+        if (imap->chunks[chunk][slot].ino != 0) {
+            empty = false;
+            break;
+        }
+    }
+    if (!empty) {
+        memcpy(block, imap->chunks[chunk], LSFS_BLOCK_SIZE);
+    }
+    imap_bit_clear(imap->dirty, chunk);
+    pthread_rwlock_unlock(&imap->lock);
 
-    entries_per_block = LSFS_BLOCK_SIZE / sizeof(struct lsfs_imap_entry);
-    blocks_needed = LSFS_DIV_ROUND_UP(imap->count, entries_per_block);
+    if (!empty) {
+        addr = lsfs_segment_append_locked(ctx, block, 0, chunk, LSFS_BLOCK_TYPE_IMAP);
+        if (addr == 0) {
+            LSFS_ERROR("Failed to write inode map chunk %u", chunk);
+            pthread_rwlock_wrlock(&imap->lock);
+            imap_bit_set(imap->dirty, chunk);
+            pthread_rwlock_unlock(&imap->lock);
+            return LSFS_ERR_NOSPC;
+        }
+        (*written)++;
+    }
 
-    if (blocks_needed > LSFS_CHECKPOINT0_BLOCKS - 1) {
-        pthread_rwlock_unlock(&imap->lock);
-        LSFS_ERROR("Inode map too large");
-        return LSFS_ERR_NOSPC;
+    pthread_rwlock_wrlock(&imap->lock);
+    old_addr = imap->chunk_addr[chunk];
+    imap->chunk_addr[chunk] = addr;
+    if (addr != old_addr) {
+        imap_table_changed(imap, chunk);
+    }
+    pthread_rwlock_unlock(&imap->lock);
+
+    if (old_addr) {
+        lsfs_gc_mark_block_dead(ctx, old_addr);
     }
 
-    buf = calloc(blocks_needed, LSFS_BLOCK_SIZE);
-    if (!buf) {
+    return LSFS_OK;
+}
+
+/*
+ * Append the dirty chunks of the inode map to the log and copy the chunk
+ * table blocks that region holds stale copies of into copy
+ * The caller holds segbuf.lock, so nothing else is appended until it
+ * flushes, and frees copy->data and copy->blocks.  The dirty bitmap is
+ * walked a word at a time, so the cost follows the chunks that changed.
+ */
+int lsfs_imap_save_locked(struct lsfs_context *ctx, uint32_t region,
+                          struct lsfs_table_copy *copy, uint32_t *entry_count)
+{
+    struct lsfs_imap *imap = &ctx->imap;
+    uint32_t written = 0;
+    int ret;
+
+    memset(copy, 0, sizeof(*copy));
+
+    for (uint32_t w = 0; w < LSFS_DIV_ROUND_UP(imap->chunk_count, 64); w++) {
+        pthread_rwlock_rdlock(&imap->lock);
+        uint64_t bits = imap->dirty[w];
         pthread_rwlock_unlock(&imap->lock);
-        return LSFS_ERR_NOMEM;
+
+        while (bits) {
+            uint32_t chunk = w * 64 + (uint32_t)__builtin_ctzll(bits);
+            bits &= bits - 1;
+
+            ret = imap_save_chunk(ctx, chunk, &written);
+            if (ret != LSFS_OK) {
+                return ret;
+            }
+        }
+    }
+
+    pthread_rwlock_wrlock(&imap->lock);
+
+    uint32_t stale = 0;
+    for (uint32_t w = 0; w < LSFS_DIV_ROUND_UP(imap->table_blocks, 64); w++) {
+        stale += (uint32_t)__builtin_popcountll(imap->table_dirty[region][w]);
+    }
+
+    if (stale > 0) {
+        copy->data = calloc(stale, LSFS_BLOCK_SIZE);
+        copy->blocks = malloc(stale * sizeof(uint32_t));
+        if (!copy->data || !copy->blocks) {
+            pthread_rwlock_unlock(&imap->lock);
+            free(copy->data);
+            free(copy->blocks);
+            memset(copy, 0, sizeof(*copy));
+            return LSFS_ERR_NOMEM;
+        }
+    }
+
+    for (uint32_t i = 0; i < imap->table_blocks && copy->count < stale; i++) {
+        if (!imap_bit_test(imap->table_dirty[region], i)) {
+            continue;
+        }
+
+        uint32_t first = i * LSFS_IMAP_TABLE_ENTRIES;
+        uint32_t n = LSFS_MIN(LSFS_IMAP_TABLE_ENTRIES, imap->chunk_count - first);
+        memcpy(copy->data + (size_t)copy->count * LSFS_BLOCK_SIZE,
+               &imap->chunk_addr[first], n * sizeof(uint64_t));
+        copy->blocks[copy->count++] = i;
+        imap_bit_clear(imap->table_dirty[region], i);
+    }
+    *entry_count = imap->count;
+
+    pthread_rwlock_unlock(&imap->lock);
+
+    if (written > 0) {
+        LSFS_DEBUG("Saved %u inode map chunks", written);
     }
 
-    memcpy(buf, imap->entries, imap->count * sizeof(struct lsfs_imap_entry));
+    return LSFS_OK;
+}
 
+/*
+ * Mark chunk table blocks stale again after a checkpoint failed to write them
+ */
+void lsfs_imap_table_redirty(struct lsfs_imap *imap, uint32_t region,
+                             const struct lsfs_table_copy *copy)
+{
+    pthread_rwlock_wrlock(&imap->lock);
+    for (uint32_t i = 0; i < copy->count; i++) {
+        imap_bit_set(imap->table_dirty[region], copy->blocks[i]);
+    }
     pthread_rwlock_unlock(&imap->lock);
+}
+
+/*
+ * A batch of inode map chunks being read at mount
+ */
+struct imap_load_batch {
+    struct lsfs_read_job job;
+    struct lsfs_io_req reqs[IMAP_LOAD_BATCH];
+    uint32_t chunks[IMAP_LOAD_BATCH];   /* Chunk read into each block of data */
+    uint32_t count;
+    uint8_t *data;
+};
+
+/*
+ * Start reading the next batch of chunks, from chunk *next on
+ * Chunks stored in consecutive blocks, as a checkpoint appends them, are
+ * read with one request.
+ */
+static void imap_load_start(struct lsfs_context *ctx, const uint64_t *table,
+                            uint32_t chunk_count, uint32_t *next,
+                            struct imap_load_batch *batch)
+{
+    batch->count = 0;
+    batch->job.reqs = batch->reqs;
+    batch->job.count = 0;
+
+    while (*next < chunk_count && batch->count < IMAP_LOAD_BATCH) {
+        uint32_t i = (*next)++;
 
-    int ret = lsfs_write_blocks(ctx, start_block, blocks_needed, buf);
-    free(buf);
+        if (table[i] == 0) {
+            continue;
+        }
+
+        struct lsfs_io_req *req = batch->job.count > 0 ? &batch->reqs[batch->job.count - 1]
+                                                       : NULL;
+        if (!req || req->block + req->count != table[i]) {
+            req = &batch->reqs[batch->job.count++];
+            req->block = table[i];
+            req->count = 0;
+            req->buf = batch->data + (size_t)batch->count * LSFS_BLOCK_SIZE;
+        }
+        req->count++;
+        batch->chunks[batch->count++] = i;
+    }
 
-    if (ret == LSFS_OK) {
-        LSFS_DEBUG("Saved inode map: %u entries in %u blocks",
-                   imap->count, blocks_needed);
+    if (batch->count > 0) {
+        lsfs_read_async(ctx, &batch->job);
+    }
+}
+
+/*
+ * Install a batch of chunks once it has been read
+ * Caller must hold imap->lock for writing.
+ */
+static int imap_load_finish(struct lsfs_context *ctx, const uint64_t *table,
+                            struct imap_load_batch *batch)
+{
+    struct lsfs_imap *imap = &ctx->imap;
+    int ret = lsfs_read_wait(ctx, &batch->job);
+
+    for (uint32_t b = 0; b < batch->count && ret == LSFS_OK; b++) {
+        uint32_t i = batch->chunks[b];
+        const uint8_t *data = batch->data + (size_t)b * LSFS_BLOCK_SIZE;
+        struct lsfs_imap_entry *chunk;
+
+        if (ctx->verify_mode == LSFS_VERIFY_BLOCK) {
+            ret = lsfs_segment_verify_blocks(ctx, table[i], 1, data);
+            if (ret != LSFS_OK) {
+                break;
+            }
+        }
+
+        chunk = malloc(LSFS_BLOCK_SIZE);
+        if (!chunk) {
+            ret = LSFS_ERR_NOMEM;
+            break;
+        }
+        memcpy(chunk, data, LSFS_BLOCK_SIZE);
+
+        /* Entries must be where their inode number says */
+        for (uint32_t slot = 0; slot < LSFS_IMAP_CHUNK_ENTRIES; slot++) {
+            uint32_t ino = i * LSFS_IMAP_CHUNK_ENTRIES + slot;
+
+            if (chunk[slot].ino == 0) {
+                continue;
+            }
+            if (chunk[slot].ino != ino) {
+                LSFS_ERROR("Inode map chunk %u holds inode %u in slot %u",
+                           i, chunk[slot].ino, slot);
+                ret = LSFS_ERR_CORRUPT;
+                break;
+            }
+
+            imap_use(imap, ino);
+            imap->count++;
+            if (ino >= imap->next_ino) {
+                imap->next_ino = ino + 1;
+            }
+        }
+        if (ret != LSFS_OK) {
+            free(chunk);
+            break;
+        }
+
+        free(imap->chunks[i]);
+        imap->chunks[i] = chunk;
+        imap->chunk_addr[i] = table[i];
     }
 
     return ret;
@@ -286,60 +568,139 @@ int lsfs_imap_save(struct lsfs_context *ctx, uint64_t start_block)
 
 /*
  * Load inode map from disk
+ * table_block is the first block of the chunk table of a checkpoint.
+ * Chunks are read in batches on the read queue, the next batch being read
+ * while the last one is installed.
  */
-int lsfs_imap_load(struct lsfs_context *ctx, uint64_t start_block,
-                   uint32_t entry_count)
+int lsfs_imap_load(struct lsfs_context *ctx, uint64_t table_block,
+                   uint32_t chunk_count)
 {
     struct lsfs_imap *imap = &ctx->imap;
-    uint8_t *buf;
-    uint32_t blocks_needed;
-    uint32_t entries_per_block;
-
-    entries_per_block = LSFS_BLOCK_SIZE / sizeof(struct lsfs_imap_entry);
-    blocks_needed = LSFS_DIV_ROUND_UP(entry_count, entries_per_block);
+    struct imap_load_batch *batch;
+    uint64_t *table;
+    uint32_t next = 0;
+    int ret;
+
+    if (chunk_count > imap->chunk_count) {
+        LSFS_ERROR("Inode map has %u chunks (at most %u)", chunk_count, imap->chunk_count);
+        return LSFS_ERR_CORRUPT;
+    }
 
-    buf = calloc(blocks_needed, LSFS_BLOCK_SIZE);
-    if (!buf) {
+    uint32_t table_blocks = LSFS_DIV_ROUND_UP(chunk_count, LSFS_IMAP_TABLE_ENTRIES);
+    table = calloc(LSFS_MAX(table_blocks, 1), LSFS_BLOCK_SIZE);
+    batch = calloc(2, sizeof(*batch));
+    if (!table || !batch) {
+        free(table);
+        free(batch);
+        return LSFS_ERR_NOMEM;
+    }
+    for (int b = 0; b < 2; b++) {
+        batch[b].data = lsfs_io_alloc((size_t)IMAP_LOAD_BATCH * LSFS_BLOCK_SIZE);
+    }
+    if (!batch[0].data || !batch[1].data) {
+        free(batch[0].data);
+        free(batch[1].data);
+        free(batch);
+        free(table);
         return LSFS_ERR_NOMEM;
     }
 
-    int ret = lsfs_read_blocks(ctx, start_block, blocks_needed, buf);
+    ret = lsfs_read_blocks(ctx, table_block, table_blocks, table);
     if (ret != LSFS_OK) {
-        free(buf);
+        free(batch[0].data);
+        free(batch[1].data);
+        free(batch);
+        free(table);
         return ret;
     }
 
     pthread_rwlock_wrlock(&imap->lock);
 
-    /* Ensure capacity */
-    if (entry_count > imap->capacity) {
-        struct lsfs_imap_entry *new_entries = realloc(imap->entries,
-                                                       entry_count * sizeof(struct lsfs_imap_entry));
-        if (!new_entries) {
-            pthread_rwlock_unlock(&imap->lock);
-            free(buf);
-            return LSFS_ERR_NOMEM;
+    imap->count = 0;
+    imap->next_ino = LSFS_ROOT_INO + 1;
+
+    uint32_t cur = 0;
+    imap_load_start(ctx, table, chunk_count, &next, &batch[cur]);
+    while (batch[cur].count > 0) {
+        imap_load_start(ctx, table, chunk_count, &next, &batch[cur ^ 1]);
+        ret = imap_load_finish(ctx, table, &batch[cur]);
+        cur ^= 1;
+        if (ret != LSFS_OK) {
+            /* The batch read ahead may still be in flight */
+            if (batch[cur].count > 0) {
+                lsfs_read_wait(ctx, &batch[cur].job);
+            }
+            break;
         }
-        imap->entries = new_entries;
-        imap->capacity = entry_count;
     }
 
-    memcpy(imap->entries, buf, entry_count * sizeof(struct lsfs_imap_entry));
-    imap->count = entry_count;
+    imap->next_ino %= imap->max_inodes;
 
-    /* Find highest inode number for next allocation */
-    imap->next_ino = LSFS_ROOT_INO + 1;
-    for (uint32_t i = 0; i < entry_count; i++) {
-        if (imap->entries[i].ino >= imap->next_ino) {
-            imap->next_ino = imap->entries[i].ino + 1;
-        }
+    pthread_rwlock_unlock(&imap->lock);
+    free(batch[0].data);
+    free(batch[1].data);
+    free(batch);
+    free(table);
+
+    if (ret != LSFS_OK) {
+        return ret;
+    }
+
+    LSFS_DEBUG("Loaded inode map: %u entries, next_ino=%u",
+               imap->count, imap->next_ino);
+
+    return LSFS_OK;
+}
+
+/*
+ * Move an inode map chunk out of a segment being cleaned
+ * Nothing happens if addr no longer holds the chunk's latest copy.
+ */
+int lsfs_imap_move_chunk(struct lsfs_context *ctx, uint32_t chunk, uint64_t addr)
+{
+    struct lsfs_imap *imap = &ctx->imap;
+    uint8_t block[LSFS_BLOCK_SIZE];
+    uint64_t new_addr;
+
+    if (chunk >= imap->chunk_count) {
+        return LSFS_OK;
     }
 
+    pthread_rwlock_rdlock(&imap->lock);
+    if (imap->chunk_addr[chunk] != addr || !imap->chunks[chunk]) {
+        pthread_rwlock_unlock(&imap->lock);
+        return LSFS_OK;
+    }
+    memcpy(block, imap->chunks[chunk], LSFS_BLOCK_SIZE);
     pthread_rwlock_unlock(&imap->lock);
-    free(buf);
 
-    LSFS_DEBUG("Loaded inode map: %u entries, next_ino=%u",
-               entry_count, imap->next_ino);
+    new_addr = lsfs_segment_append_block(ctx, block, 0, chunk, LSFS_BLOCK_TYPE_IMAP);
+    if (new_addr == 0) {
+        return LSFS_ERR_NOSPC;
+    }
+
+    /*
+     * If a checkpoint wrote the chunk meanwhile, the new copy is already
+     * dead.  Otherwise a change made since the copy leaves the chunk dirty,
+     * so the next checkpoint writes it again.  The old copy stays live
+     * until a checkpoint has saved the chunk table without it.
+     */
+    bool moved = false;
+
+    pthread_rwlock_wrlock(&imap->lock);
+    if (imap->chunk_addr[chunk] == addr) {
+        imap->chunk_addr[chunk] = new_addr;
+        imap_table_changed(imap, chunk);
+        moved = true;
+    }
+    pthread_rwlock_unlock(&imap->lock);
+
+    if (moved) {
+        lsfs_gc_defer_dead(ctx, addr, 1);
+    } else {
+        lsfs_gc_mark_block_dead(ctx, new_addr);
+    }
 
+    LSFS_DEBUG("Relocated inode map chunk %u from %" PRIu64, chunk, addr);
     return LSFS_OK;
 }
@@ -6,6 +6,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <time.h>
 #include <errno.h>
 #include <inttypes.h>
@@ -14,11 +15,21 @@
 #include "lsfs.h"
 
 /*
- * Hash function for inode number
+ * Shard holding an inode number
  */
-static inline uint32_t inode_hash(uint32_t ino)
+static inline struct lsfs_inode_shard *inode_shard(struct lsfs_inode_cache *cache,
+                                                   uint32_t ino)
 {
-    return ino % LSFS_INODE_CACHE_BUCKETS;
+    return &cache->shards[ino % LSFS_INODE_CACHE_SHARDS];
+}
+
+/*
+ * Hash chain an inode number lives on within its shard
+ */
+static inline struct lsfs_inode_mem **inode_bucket(struct lsfs_inode_shard *shard,
+                                                   uint32_t ino)
+{
+    return &shard->buckets[(ino / LSFS_INODE_CACHE_SHARDS) & shard->bucket_mask];
 }
 
 /*
@@ -32,54 +43,161 @@ uint64_t lsfs_get_time_ns(void)
 }
 
 /*
- * Initialize inode cache
+ * Initialize inode cache with room for capacity inodes
  */
-int lsfs_inode_cache_init(struct lsfs_inode_cache *cache)
+int lsfs_inode_cache_init(struct lsfs_inode_cache *cache, uint32_t capacity)
 {
+    uint32_t per_shard = LSFS_MAX((capacity + LSFS_INODE_CACHE_SHARDS - 1) /
+                                  LSFS_INODE_CACHE_SHARDS, 1);
+    uint32_t buckets = 1;
+
     memset(cache, 0, sizeof(*cache));
 
-    if (pthread_mutex_init(&cache->lock, NULL) != 0) {
-        return LSFS_ERR_NOMEM;
+    while (buckets < per_shard) {
+        buckets <<= 1;
+    }
+
+    for (int i = 0; i < LSFS_INODE_CACHE_SHARDS; i++) {
+        struct lsfs_inode_shard *shard = &cache->shards[i];
+
+        if (pthread_mutex_init(&shard->lock, NULL) != 0) {
+            lsfs_inode_cache_destroy(cache);
+            return LSFS_ERR_NOMEM;
+        }
+
+        shard->buckets = calloc(buckets, sizeof(*shard->buckets));
+        if (!shard->buckets) {
+            lsfs_inode_cache_destroy(cache);
+            return LSFS_ERR_NOMEM;
+        }
+        shard->bucket_mask = buckets - 1;
+        shard->capacity = per_shard;
+        cache->capacity += per_shard;
     }
 
+    LSFS_INFO("Inode cache: %u inodes in %d shards",
+              cache->capacity, LSFS_INODE_CACHE_SHARDS);
+
     return LSFS_OK;
 }
 
+/*
+ * Free an extent map
+ */
+static void extent_map_free(struct lsfs_extent_map *map)
+{
+    for (uint32_t i = 0; i < map->nleaves; i++) {
+        free(map->leaves[i].ext);
+    }
+    free(map->leaves);
+    free(map->index);
+    free(map);
+}
+
+/*
+ * Free the inode's extent map without writing it
+ */
+static void inode_drop_maps(struct lsfs_inode_mem *inode)
+{
+    if (inode->map) {
+        extent_map_free(inode->map);
+        inode->map = NULL;
+    }
+}
+
 /*
  * Destroy inode cache
+ * Every slab inode had its lock initialized when the slab was carved.
  */
 void lsfs_inode_cache_destroy(struct lsfs_inode_cache *cache)
 {
-    /* Free all cached inodes */
-    for (int i = 0; i < LSFS_INODE_CACHE_BUCKETS; i++) {
-        struct lsfs_inode_mem *inode = cache->buckets[i];
-        while (inode) {
-            struct lsfs_inode_mem *next = inode->next;
-            pthread_mutex_destroy(&inode->lock);
-            free(inode);
-            inode = next;
+    for (int i = 0; i < LSFS_INODE_CACHE_SHARDS; i++) {
+        struct lsfs_inode_shard *shard = &cache->shards[i];
+
+        while (shard->slabs) {
+            struct lsfs_inode_slab *slab = shard->slabs;
+
+            shard->slabs = slab->next;
+            for (int j = 0; j < LSFS_INODE_SLAB_COUNT; j++) {
+                inode_drop_maps(&slab->inodes[j]);
+                lsfs_gc_dead_list_free(&slab->inodes[j].dead);
+                pthread_mutex_destroy(&slab->inodes[j].lock);
+            }
+            free(slab);
+        }
+
+        free(shard->buckets);
+        shard->buckets = NULL;
+        pthread_mutex_destroy(&shard->lock);
+    }
+}
+
+/*
+ * Take a clean in-memory inode from the shard's free list
+ * The free list is refilled a slab at a time; the lock of a recycled
+ * inode is kept initialized.
+ */
+static struct lsfs_inode_mem *inode_slot_get(struct lsfs_inode_shard *shard)
+{
+    struct lsfs_inode_mem *inode;
+
+    if (!shard->free) {
+        struct lsfs_inode_slab *slab = calloc(1, sizeof(*slab));
+        if (!slab) {
+            return NULL;
+        }
+
+        for (int i = LSFS_INODE_SLAB_COUNT - 1; i >= 0; i--) {
+            pthread_mutex_init(&slab->inodes[i].lock, NULL);
+            slab->inodes[i].next = shard->free;
+            shard->free = &slab->inodes[i];
         }
+
+        slab->next = shard->slabs;
+        shard->slabs = slab;
     }
 
-    pthread_mutex_destroy(&cache->lock);
+    inode = shard->free;
+    shard->free = inode->next;
+    inode->next = NULL;
+    return inode;
+}
+
+/*
+ * Return an in-memory inode to the shard's free list
+ */
+static void inode_slot_put(struct lsfs_inode_shard *shard, struct lsfs_inode_mem *inode)
+{
+    inode_drop_maps(inode);
+    lsfs_gc_dead_list_free(&inode->dead);
+    memset(&inode->disk_inode, 0, sizeof(inode->disk_inode));
+    inode->disk_location = 0;
+    inode->version = 0;
+    inode->refcount = 0;
+    inode->dirty = false;
+    inode->lru_prev = NULL;
+    inode->lru_next = NULL;
+
+    inode->next = shard->free;
+    shard->free = inode;
 }
 
 /*
  * Remove inode from LRU list
  */
-static void inode_lru_remove(struct lsfs_inode_cache *cache,
+static void inode_lru_remove(struct lsfs_inode_shard *shard,
                              struct lsfs_inode_mem *inode)
 {
     if (inode->lru_prev) {
         inode->lru_prev->lru_next = inode->lru_next;
     } else {
-        cache->lru_head = inode->lru_next;
+        shard->lru_head = inode->lru_next;
     }
 
     if (inode->lru_next) {
         inode->lru_next->lru_prev = inode->lru_prev;
     } else {
-        cache->lru_tail = inode->lru_prev;
+        shard->lru_tail = inode->lru_prev;
     }
 
     inode->lru_prev = NULL;
@@ -89,34 +207,46 @@ static void inode_lru_remove(struct lsfs_inode_cache *cache,
 /*
  * Add inode to end of LRU list (most recently used)
  */
-static void inode_lru_add(struct lsfs_inode_cache *cache,
+static void inode_lru_add(struct lsfs_inode_shard *shard,
                           struct lsfs_inode_mem *inode)
 {
-    inode->lru_prev = cache->lru_tail;
+    inode->lru_prev = shard->lru_tail;
     inode->lru_next = NULL;
 
-    if (cache->lru_tail) {
-        cache->lru_tail->lru_next = inode;
+    if (shard->lru_tail) {
+        shard->lru_tail->lru_next = inode;
     }
-    cache->lru_tail = inode;
+    shard->lru_tail = inode;
 
-    if (!cache->lru_head) {
-        cache->lru_head = inode;
+    if (!shard->lru_head) {
+        shard->lru_head = inode;
     }
 }
 
 /*
- * Evict least recently used inode if cache is full
+ * Add a new inode to its shard
  */
-static void inode_cache_evict(struct lsfs_context *ctx)
+static void inode_cache_insert(struct lsfs_inode_shard *shard,
+                               struct lsfs_inode_mem *inode)
 {
-    struct lsfs_inode_cache *cache = &ctx->icache;
+    struct lsfs_inode_mem **bucket = inode_bucket(shard, inode->disk_inode.ino);
+
+    inode->next = *bucket;
+    *bucket = inode;
+    inode_lru_add(shard, inode);
+    shard->count++;
+}
 
-    while (cache->count >= LSFS_INODE_CACHE_SIZE) {
-        struct lsfs_inode_mem *victim = cache->lru_head;
+/*
+ * Evict least recently used inodes while the shard is full
+ */
+static void inode_cache_evict(struct lsfs_context *ctx, struct lsfs_inode_shard *shard)
+{
+    while (shard->count >= shard->capacity) {
+        struct lsfs_inode_mem *victim = shard->lru_head;
 
         /* Find an inode with refcount 0 */
-        while (victim && victim->refcount > 0) {
+        while (victim && __atomic_load_n(&victim->refcount, __ATOMIC_ACQUIRE) > 0) {
             victim = victim->lru_next;
         }
 
@@ -130,8 +260,7 @@ static void inode_cache_evict(struct lsfs_context *ctx)
         }
 
         /* Remove from hash chain */
-        uint32_t hash = inode_hash(victim->disk_inode.ino);
-        struct lsfs_inode_mem **pp = &cache->buckets[hash];
+        struct lsfs_inode_mem **pp = inode_bucket(shard, victim->disk_inode.ino);
         while (*pp) {
             if (*pp == victim) {
                 *pp = victim->next;
@@ -141,12 +270,11 @@ static void inode_cache_evict(struct lsfs_context *ctx)
         }
 
         /* Remove from LRU */
-        inode_lru_remove(cache, victim);
+        inode_lru_remove(shard, victim);
 
-        /* Free */
-        pthread_mutex_destroy(&victim->lock);
-        free(victim);
-        cache->count--;
+        inode_slot_put(shard, victim);
+        shard->count--;
+        shard->evictions++;
     }
 }
 
@@ -155,61 +283,63 @@ static void inode_cache_evict(struct lsfs_context *ctx)
  */
 struct lsfs_inode_mem *lsfs_inode_get(struct lsfs_context *ctx, uint32_t ino)
 {
-    struct lsfs_inode_cache *cache = &ctx->icache;
+    struct lsfs_inode_shard *shard = inode_shard(&ctx->icache, ino);
     struct lsfs_inode_mem *inode;
-    uint32_t hash;
     uint64_t location;
     uint32_t version;
 
-    pthread_mutex_lock(&cache->lock);
+    pthread_mutex_lock(&shard->lock);
 
     /* Check cache first */
-    hash = inode_hash(ino);
-    inode = cache->buckets[hash];
+    inode = *inode_bucket(shard, ino);
     while (inode) {
         if (inode->disk_inode.ino == ino) {
-            inode->refcount++;
-            inode_lru_remove(cache, inode);
-            inode_lru_add(cache, inode);
-            pthread_mutex_unlock(&cache->lock);
+            __atomic_add_fetch(&inode->refcount, 1, __ATOMIC_RELAXED);
+            inode_lru_remove(shard, inode);
+            inode_lru_add(shard, inode);
+            shard->hits++;
+            pthread_mutex_unlock(&shard->lock);
             return inode;
         }
         inode = inode->next;
     }
+    shard->misses++;
 
     /* Not in cache, look up in inode map */
     if (lsfs_imap_get(&ctx->imap, ino, &location, &version) != LSFS_OK) {
-        pthread_mutex_unlock(&cache->lock);
+        pthread_mutex_unlock(&shard->lock);
         return NULL;
     }
 
     /* Evict if necessary */
-    inode_cache_evict(ctx);
+    inode_cache_evict(ctx, shard);
 
-    /* Allocate new cache entry */
-    inode = calloc(1, sizeof(*inode));
+    /* Take a cache entry */
+    inode = inode_slot_get(shard);
     if (!inode) {
-        pthread_mutex_unlock(&cache->lock);
+        pthread_mutex_unlock(&shard->lock);
         return NULL;
     }
 
     /* Read inode from disk */
     uint8_t block[LSFS_BLOCK_SIZE];
-    if (lsfs_read_block(ctx, location, block) != LSFS_OK) {
-        free(inode);
-        pthread_mutex_unlock(&cache->lock);
+    uint32_t slot = LSFS_INODE_LOC_SLOT(location);
+    if (slot >= LSFS_INODES_PER_BLOCK ||
+        lsfs_segment_read_block(ctx, LSFS_INODE_LOC_BLOCK(location), block) != LSFS_OK) {
+        inode_slot_put(shard, inode);
+        pthread_mutex_unlock(&shard->lock);
         return NULL;
     }
 
-    /* Find inode within block (16 inodes per block) */
-    uint32_t offset = (ino % 16) * sizeof(struct lsfs_inode);
-    memcpy(&inode->disk_inode, block + offset, sizeof(struct lsfs_inode));
+    /* Inode blocks hold up to LSFS_INODES_PER_BLOCK inodes, one per slot */
+    memcpy(&inode->disk_inode, block + slot * sizeof(struct lsfs_inode),
+           sizeof(struct lsfs_inode));
 
     /* Verify inode number matches */
     if (inode->disk_inode.ino != ino) {
         LSFS_ERROR("Inode mismatch: expected %u, got %u", ino, inode->disk_inode.ino);
-        free(inode);
-        pthread_mutex_unlock(&cache->lock);
+        inode_slot_put(shard, inode);
+        pthread_mutex_unlock(&shard->lock);
         return NULL;
     }
 
@@ -217,25 +347,23 @@ struct lsfs_inode_mem *lsfs_inode_get(struct lsfs_context *ctx, uint32_t ino)
     inode->version = version;
     inode->refcount = 1;
     inode->dirty = false;
-    pthread_mutex_init(&inode->lock, NULL);
 
     /* Add to cache */
-    inode->next = cache->buckets[hash];
-    cache->buckets[hash] = inode;
-    inode_lru_add(cache, inode);
-    cache->count++;
+    inode_cache_insert(shard, inode);
 
-    pthread_mutex_unlock(&cache->lock);
+    pthread_mutex_unlock(&shard->lock);
     return inode;
 }
 
 /*
  * Release reference to an inode
+ * The count is only raised under the shard lock, so dropping it atomically
+ * is enough to keep eviction from freeing an inode still in use.
  */
 void lsfs_inode_put(struct lsfs_inode_mem *inode)
 {
-    if (inode && inode->refcount > 0) {
-        inode->refcount--;
+    if (inode) {
+        __atomic_sub_fetch(&inode->refcount, 1, __ATOMIC_RELEASE);
     }
 }
 
@@ -244,7 +372,7 @@ void lsfs_inode_put(struct lsfs_inode_mem *inode)
  */
 struct lsfs_inode_mem *lsfs_inode_alloc(struct lsfs_context *ctx, uint32_t mode)
 {
-    struct lsfs_inode_cache *cache = &ctx->icache;
+    struct lsfs_inode_shard *shard;
     struct lsfs_inode_mem *inode;
     uint32_t ino;
     uint64_t now;
@@ -255,15 +383,16 @@ struct lsfs_inode_mem *lsfs_inode_alloc(struct lsfs_context *ctx, uint32_t mode)
         return NULL;
     }
 
-    pthread_mutex_lock(&cache->lock);
+    shard = inode_shard(&ctx->icache, ino);
+    pthread_mutex_lock(&shard->lock);
 
     /* Evict if necessary */
-    inode_cache_evict(ctx);
+    inode_cache_evict(ctx, shard);
 
-    /* Allocate cache entry */
-    inode = calloc(1, sizeof(*inode));
+    /* Take a cache entry */
+    inode = inode_slot_get(shard);
     if (!inode) {
-        pthread_mutex_unlock(&cache->lock);
+        pthread_mutex_unlock(&shard->lock);
         return NULL;
     }
 
@@ -287,23 +416,41 @@ struct lsfs_inode_mem *lsfs_inode_alloc(struct lsfs_context *ctx, uint32_t mode)
     inode->version = 0;
     inode->refcount = 1;
     inode->dirty = true;
-    pthread_mutex_init(&inode->lock, NULL);
 
     /* Add to cache */
-    uint32_t hash = inode_hash(ino);
-    inode->next = cache->buckets[hash];
-    cache->buckets[hash] = inode;
-    inode_lru_add(cache, inode);
-    cache->count++;
+    inode_cache_insert(shard, inode);
 
+    pthread_mutex_lock(&ctx->segtable.lock);
     ctx->sb.inode_count++;
+    pthread_mutex_unlock(&ctx->segtable.lock);
 
-    pthread_mutex_unlock(&cache->lock);
+    pthread_mutex_unlock(&shard->lock);
 
     LSFS_DEBUG("Allocated inode %u, mode 0%o", ino, mode);
     return inode;
 }
 
+/*
+ * Collect inode cache statistics
+ */
+void lsfs_inode_cache_stats(struct lsfs_inode_cache *cache,
+                            struct lsfs_inode_cache_stats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    stats->capacity = cache->capacity;
+
+    for (int i = 0; i < LSFS_INODE_CACHE_SHARDS; i++) {
+        struct lsfs_inode_shard *shard = &cache->shards[i];
+
+        pthread_mutex_lock(&shard->lock);
+        stats->cached += shard->count;
+        stats->hits += shard->hits;
+        stats->misses += shard->misses;
+        stats->evictions += shard->evictions;
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
 /*
  * Free an inode
  */
@@ -312,215 +459,1455 @@ int lsfs_inode_free(struct lsfs_context *ctx, struct lsfs_inode_mem *inode)
     uint32_t ino = inode->disk_inode.ino;
 
     /* Mark all blocks as dead for GC */
-    for (int i = 0; i < LSFS_DIRECT_BLOCKS; i++) {
-        if (inode->disk_inode.direct[i]) {
-            lsfs_gc_mark_block_dead(ctx, inode->disk_inode.direct[i]);
-            inode->disk_inode.direct[i] = 0;
-        }
-    }
-
-    if (inode->disk_inode.indirect) {
-        lsfs_gc_mark_block_dead(ctx, inode->disk_inode.indirect);
-        /* TODO: Mark indirect block contents as dead */
-        inode->disk_inode.indirect = 0;
-    }
-
-    if (inode->disk_inode.double_indirect) {
-        lsfs_gc_mark_block_dead(ctx, inode->disk_inode.double_indirect);
-        /* TODO: Mark double indirect block contents as dead */
-        inode->disk_inode.double_indirect = 0;
+    if (lsfs_inode_truncate(ctx, inode, 0) != LSFS_OK) {
+        LSFS_ERROR("Failed to release blocks of inode %u", ino);
     }
+    inode_drop_maps(inode);
 
     /* Mark inode location as dead */
     if (inode->disk_location) {
-        lsfs_gc_mark_block_dead(ctx, inode->disk_location);
+        lsfs_gc_mark_inode_dead(ctx, inode->disk_location);
     }
 
-    /* Remove from inode map */
+    /* Remove from inode map, after which nothing needs its blocks */
     lsfs_imap_remove(&ctx->imap, ino);
+    lsfs_gc_commit_dead(ctx, inode);
 
     /* Mark as deleted */
     inode->disk_inode.flags |= LSFS_INODE_DELETED;
     inode->dirty = false;
 
+    pthread_mutex_lock(&ctx->segtable.lock);
     if (ctx->sb.inode_count > 0) {
         ctx->sb.inode_count--;
     }
+    pthread_mutex_unlock(&ctx->segtable.lock);
 
     LSFS_DEBUG("Freed inode %u", ino);
     return LSFS_OK;
 }
 
 /*
- * Write inode to log
+ * Insert an empty leaf at position pos of the leaf array
  */
-int lsfs_inode_write(struct lsfs_context *ctx, struct lsfs_inode_mem *inode)
+static struct lsfs_extent_leaf *extent_leaf_insert(struct lsfs_extent_map *map, uint32_t pos)
 {
-    uint64_t new_location;
+    if (map->nleaves == map->capacity) {
+        uint32_t capacity = map->capacity ? map->capacity * 2 : 4;
+        struct lsfs_extent_leaf *leaves = realloc(map->leaves, capacity * sizeof(*leaves));
+        if (!leaves) {
+            return NULL;
+        }
+        map->leaves = leaves;
+        map->capacity = capacity;
+    }
 
-    if (!inode->dirty) {
-        return LSFS_OK;
+    memmove(&map->leaves[pos + 1], &map->leaves[pos],
+            (map->nleaves - pos) * sizeof(*map->leaves));
+    map->nleaves++;
+    memset(&map->leaves[pos], 0, sizeof(map->leaves[pos]));
+    return &map->leaves[pos];
+}
+
+/*
+ * Remove the leaf at position pos of the leaf array
+ */
+static void extent_leaf_delete(struct lsfs_extent_map *map, uint32_t pos)
+{
+    free(map->leaves[pos].ext);
+    memmove(&map->leaves[pos], &map->leaves[pos + 1],
+            (map->nleaves - pos - 1) * sizeof(*map->leaves));
+    map->nleaves--;
+}
+
+/*
+ * Remember the address of an index block of the tree on disk
+ */
+static int extent_index_add(struct lsfs_extent_map *map, uint64_t addr)
+{
+    uint64_t *index = realloc(map->index, (map->nindex + 1) * sizeof(*index));
+    if (!index) {
+        return LSFS_ERR_NOMEM;
     }
 
-    /* Mark old location as dead */
-    if (inode->disk_location) {
-        lsfs_gc_mark_block_dead(ctx, inode->disk_location);
+    index[map->nindex++] = addr;
+    map->index = index;
+    return LSFS_OK;
+}
+
+/*
+ * Read an extent tree block and check it against what its parent expects
+ */
+static int extent_node_read(struct lsfs_context *ctx, struct lsfs_inode_mem *inode,
+                            uint64_t addr, uint16_t depth, struct lsfs_extent_node *node)
+{
+    if (lsfs_segment_read_block(ctx, addr, node) != LSFS_OK) {
+        return LSFS_ERR_IO;
     }
 
-    /* Append inode to log */
-    new_location = lsfs_segment_append_block(ctx, &inode->disk_inode,
-                                             inode->disk_inode.ino, 0,
-                                             LSFS_BLOCK_TYPE_INODE);
-    if (new_location == 0) {
-        return LSFS_ERR_NOSPC;
+    if (node->header.magic != LSFS_EXTENT_MAGIC ||
+        node->header.ino != inode->disk_inode.ino ||
+        node->header.depth != depth ||
+        node->header.count == 0 ||
+        node->header.count > LSFS_EXTENTS_PER_NODE) {
+        LSFS_ERROR("Bad extent block %" PRIu64 " for inode %u",
+                   addr, inode->disk_inode.ino);
+        return LSFS_ERR_CORRUPT;
     }
 
-    /* Update inode map */
-    lsfs_imap_set(&ctx->imap, inode->disk_inode.ino, new_location);
+    return LSFS_OK;
+}
 
-    inode->disk_location = new_location;
-    inode->version++;
-    inode->dirty = false;
+/*
+ * Collect the leaves below a level of index entries
+ * depth is the level the entries live at; depth 1 entries point at leaves.
+ */
+static int extent_map_load_level(struct lsfs_context *ctx, struct lsfs_inode_mem *inode,
+                                 struct lsfs_extent_map *map,
+                                 const struct lsfs_extent *entries, uint32_t count,
+                                 uint16_t depth)
+{
+    for (uint32_t i = 0; i < count; i++) {
+        if (depth == 1) {
+            if (entries[i].length == 0 || entries[i].length > LSFS_EXTENTS_PER_NODE) {
+                return LSFS_ERR_CORRUPT;
+            }
+
+            struct lsfs_extent_leaf *leaf = extent_leaf_insert(map, map->nleaves);
+            if (!leaf) {
+                return LSFS_ERR_NOMEM;
+            }
+            leaf->first = entries[i].logical;
+            leaf->count = entries[i].length;
+            leaf->addr = entries[i].physical;
+            continue;
+        }
 
-    LSFS_DEBUG("Wrote inode %u to block %" PRIu64,
-               inode->disk_inode.ino, new_location);
+        struct lsfs_extent_node node;
+        int ret = extent_node_read(ctx, inode, entries[i].physical, depth - 1, &node);
+        if (ret == LSFS_OK) {
+            ret = extent_index_add(map, entries[i].physical);
+        }
+        if (ret == LSFS_OK) {
+            ret = extent_map_load_level(ctx, inode, map, node.entries,
+                                        node.header.count, depth - 1);
+        }
+        if (ret != LSFS_OK) {
+            return ret;
+        }
+    }
 
     return LSFS_OK;
 }
 
 /*
- * Read a data block from an inode
+ * Get the inode's extent map
+ * On first use the index part of the tree is read; leaves are read when
+ * they are first needed.
  */
-int lsfs_inode_read_block(struct lsfs_context *ctx, struct lsfs_inode_mem *inode,
-                          uint64_t block_idx, void *buf)
+static struct lsfs_extent_map *inode_extents(struct lsfs_context *ctx,
+                                             struct lsfs_inode_mem *inode)
 {
-    uint64_t block_addr = 0;
-    uint64_t blocks_per_indirect = LSFS_BLOCK_SIZE / sizeof(uint64_t);
+    struct lsfs_inode *di = &inode->disk_inode;
+    struct lsfs_extent_map *map;
+    int ret = LSFS_OK;
 
-    /* Direct blocks */
-    if (block_idx < LSFS_DIRECT_BLOCKS) {
-        block_addr = inode->disk_inode.direct[block_idx];
+    if (inode->map) {
+        return inode->map;
     }
-    /* Single indirect */
-    else if (block_idx < LSFS_DIRECT_BLOCKS + blocks_per_indirect) {
-        if (inode->disk_inode.indirect == 0) {
-            memset(buf, 0, LSFS_BLOCK_SIZE);
-            return LSFS_OK;
-        }
 
-        uint64_t indirect_block[LSFS_BLOCK_SIZE / sizeof(uint64_t)];
-        if (lsfs_read_block(ctx, inode->disk_inode.indirect, indirect_block) != LSFS_OK) {
-            return LSFS_ERR_IO;
+    if (di->extent_count > LSFS_INLINE_EXTENTS) {
+        LSFS_ERROR("Inode %u has %u inline extents", di->ino, di->extent_count);
+        return NULL;
+    }
+
+    map = calloc(1, sizeof(*map));
+    if (!map) {
+        return NULL;
+    }
+
+    if (di->flags & LSFS_INODE_INLINE_DATA) {
+        /* Nothing is mapped; the extent space holds file data */
+    } else if (di->extent_depth > 0) {
+        ret = extent_map_load_level(ctx, inode, map, di->extents, di->extent_count,
+                                    di->extent_depth);
+    } else if (di->extent_count > 0) {
+        struct lsfs_extent_leaf *leaf = extent_leaf_insert(map, 0);
+        if (leaf) {
+            leaf->ext = malloc(LSFS_EXTENTS_PER_NODE * sizeof(struct lsfs_extent));
+        }
+        if (!leaf || !leaf->ext) {
+            ret = LSFS_ERR_NOMEM;
+        } else {
+            memcpy(leaf->ext, di->extents, di->extent_count * sizeof(struct lsfs_extent));
+            leaf->first = di->extents[0].logical;
+            leaf->count = di->extent_count;
         }
+    }
 
-        block_addr = indirect_block[block_idx - LSFS_DIRECT_BLOCKS];
+    if (ret != LSFS_OK) {
+        LSFS_ERROR("Failed to load extent map of inode %u", di->ino);
+        extent_map_free(map);
+        return NULL;
     }
-    /* Double indirect */
-    else if (block_idx < LSFS_DIRECT_BLOCKS + blocks_per_indirect +
-             blocks_per_indirect * blocks_per_indirect) {
-        if (inode->disk_inode.double_indirect == 0) {
-            memset(buf, 0, LSFS_BLOCK_SIZE);
-            return LSFS_OK;
+
+    inode->map = map;
+    return map;
+}
+
+/*
+ * Read a leaf's extents unless they are already in memory
+ */
+static int extent_leaf_load(struct lsfs_context *ctx, struct lsfs_inode_mem *inode,
+                            struct lsfs_extent_leaf *leaf)
+{
+    struct lsfs_extent_node node;
+
+    if (leaf->ext) {
+        return LSFS_OK;
+    }
+
+    int ret = extent_node_read(ctx, inode, leaf->addr, 0, &node);
+    if (ret != LSFS_OK) {
+        return ret;
+    }
+    if (node.header.count != leaf->count || node.entries[0].logical != leaf->first) {
+        LSFS_ERROR("Extent block %" PRIu64 " of inode %u does not match its index",
+                   leaf->addr, inode->disk_inode.ino);
+        return LSFS_ERR_CORRUPT;
+    }
+
+    leaf->ext = malloc(LSFS_EXTENTS_PER_NODE * sizeof(struct lsfs_extent));
+    if (!leaf->ext) {
+        return LSFS_ERR_NOMEM;
+    }
+    memcpy(leaf->ext, node.entries, leaf->count * sizeof(struct lsfs_extent));
+
+    return LSFS_OK;
+}
+
+/*
+ * Position of the last leaf starting at or before block (0 if none does)
+ */
+static uint32_t extent_leaf_find(const struct lsfs_extent_map *map, uint64_t block)
+{
+    uint32_t lo = 0;
+    uint32_t hi = map->nleaves;
+
+    while (hi - lo > 1) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (map->leaves[mid].first <= block) {
+            lo = mid;
+        } else {
+            hi = mid;
         }
+    }
 
-        uint64_t d_indirect_block[LSFS_BLOCK_SIZE / sizeof(uint64_t)];
-        if (lsfs_read_block(ctx, inode->disk_inode.double_indirect, d_indirect_block) != LSFS_OK) {
-            return LSFS_ERR_IO;
+    return lo;
+}
+
+/*
+ * Position of the first extent of a leaf starting after block
+ */
+static uint32_t extent_upper(const struct lsfs_extent_leaf *leaf, uint64_t block)
+{
+    uint32_t lo = 0;
+    uint32_t hi = leaf->count;
+
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (leaf->ext[mid].logical <= block) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
         }
+    }
+
+    return lo;
+}
+
+/*
+ * Map a file block to its disk address (0 for a hole)
+ * run receives the number of blocks from block on that are mapped the same
+ * way: to consecutive disk blocks, or as one hole.
+ */
+static int extent_lookup(struct lsfs_context *ctx, struct lsfs_inode_mem *inode,
+                         uint64_t block, uint64_t *addr, uint64_t *run)
+{
+    struct lsfs_extent_map *map = inode_extents(ctx, inode);
+
+    *addr = 0;
+    *run = UINT64_MAX;
+
+    if (!map) {
+        return LSFS_ERR_IO;
+    }
+    if (map->nleaves == 0) {
+        return LSFS_OK;
+    }
 
-        uint64_t idx = block_idx - LSFS_DIRECT_BLOCKS - blocks_per_indirect;
-        uint64_t d_idx = idx / blocks_per_indirect;
-        uint64_t i_idx = idx % blocks_per_indirect;
+    uint32_t li = extent_leaf_find(map, block);
+    struct lsfs_extent_leaf *leaf = &map->leaves[li];
+    if (block < leaf->first) {
+        *run = leaf->first - block;
+        return LSFS_OK;
+    }
+
+    int ret = extent_leaf_load(ctx, inode, leaf);
+    if (ret != LSFS_OK) {
+        return ret;
+    }
 
-        if (d_indirect_block[d_idx] == 0) {
-            memset(buf, 0, LSFS_BLOCK_SIZE);
+    uint32_t j = extent_upper(leaf, block);
+    if (j > 0) {
+        const struct lsfs_extent *e = &leaf->ext[j - 1];
+        if (block < (uint64_t)e->logical + e->length) {
+            *addr = e->physical + (block - e->logical);
+            *run = (uint64_t)e->logical + e->length - block;
             return LSFS_OK;
         }
+    }
 
-        uint64_t indirect_block[LSFS_BLOCK_SIZE / sizeof(uint64_t)];
-        if (lsfs_read_block(ctx, d_indirect_block[d_idx], indirect_block) != LSFS_OK) {
-            return LSFS_ERR_IO;
+    /* A hole up to the next extent */
+    if (j < leaf->count) {
+        *run = leaf->ext[j].logical - block;
+    } else if (li + 1 < map->nleaves) {
+        *run = map->leaves[li + 1].first - block;
+    }
+
+    return LSFS_OK;
+}
+
+/*
+ * Replace the extents of leaf li with the n sorted extents in ext
+ * An emptied leaf is dropped and one that overflows is split in two, so n
+ * may exceed LSFS_EXTENTS_PER_NODE by one.
+ */
+static int extent_leaf_store(struct lsfs_context *ctx, struct lsfs_inode_mem *inode,
+                             uint32_t li, const struct lsfs_extent *ext, uint32_t n)
+{
+    struct lsfs_extent_map *map = inode->map;
+    uint32_t keep = n > LSFS_EXTENTS_PER_NODE ? n / 2 : n;
+
+    map->dirty = true;
+
+    if (n == 0) {
+        if (map->leaves[li].addr) {
+            lsfs_gc_stage_dead(ctx, inode, map->leaves[li].addr, 1);
         }
+        extent_leaf_delete(map, li);
+        return LSFS_OK;
+    }
 
-        block_addr = indirect_block[i_idx];
-    } else {
-        return LSFS_ERR_INVAL;
+    if (keep < n) {
+        struct lsfs_extent_leaf *right = extent_leaf_insert(map, li + 1);
+        if (!right) {
+            return LSFS_ERR_NOMEM;
+        }
+        right->ext = malloc(LSFS_EXTENTS_PER_NODE * sizeof(struct lsfs_extent));
+        if (!right->ext) {
+            extent_leaf_delete(map, li + 1);
+            return LSFS_ERR_NOMEM;
+        }
+        memcpy(right->ext, ext + keep, (n - keep) * sizeof(struct lsfs_extent));
+        right->count = n - keep;
+        right->first = right->ext[0].logical;
+        right->dirty = true;
     }
 
-    if (block_addr == 0) {
-        memset(buf, 0, LSFS_BLOCK_SIZE);
+    struct lsfs_extent_leaf *leaf = &map->leaves[li];
+    memcpy(leaf->ext, ext, keep * sizeof(struct lsfs_extent));
+    leaf->count = keep;
+    leaf->first = ext[0].logical;
+    leaf->dirty = true;
+
+    return LSFS_OK;
+}
+
+/*
+ * Unmap file blocks [start, end) and mark the disk blocks they used dead
+ */
+static int extent_punch(struct lsfs_context *ctx, struct lsfs_inode_mem *inode,
+                        uint64_t start, uint64_t end)
+{
+    struct lsfs_extent_map *map = inode_extents(ctx, inode);
+    struct lsfs_extent tmp[LSFS_EXTENTS_PER_NODE + 1];
+
+    if (!map) {
+        return LSFS_ERR_IO;
+    }
+    if (map->nleaves == 0) {
         return LSFS_OK;
     }
 
-    return lsfs_read_block(ctx, block_addr, buf);
+    uint32_t li = extent_leaf_find(map, start);
+    while (li < map->nleaves && map->leaves[li].first < end) {
+        struct lsfs_extent_leaf *leaf = &map->leaves[li];
+        uint32_t n = 0;
+        bool changed = false;
+
+        int ret = extent_leaf_load(ctx, inode, leaf);
+        if (ret != LSFS_OK) {
+            return ret;
+        }
+
+        for (uint32_t j = 0; j < leaf->count; j++) {
+            const struct lsfs_extent *e = &leaf->ext[j];
+            uint64_t e_start = e->logical;
+            uint64_t e_end = e_start + e->length;
+
+            if (e_end <= start || e_start >= end) {
+                tmp[n++] = *e;
+                continue;
+            }
+
+            uint64_t lo = LSFS_MAX(e_start, start);
+            uint64_t hi = LSFS_MIN(e_end, end);
+            lsfs_gc_stage_dead(ctx, inode, e->physical + (lo - e_start), hi - lo);
+            changed = true;
+
+            if (e_start < start) {
+                tmp[n++] = (struct lsfs_extent) {
+                    .logical = e->logical,
+                    .length = (uint32_t)(start - e_start),
+                    .physical = e->physical,
+                };
+            }
+            if (e_end > end) {
+                tmp[n++] = (struct lsfs_extent) {
+                    .logical = (uint32_t)end,
+                    .length = (uint32_t)(e_end - end),
+                    .physical = e->physical + (end - e_start),
+                };
+            }
+        }
+
+        if (!changed) {
+            li++;
+            continue;
+        }
+
+        /* Step past the leaf, or both halves if it split */
+        uint32_t before = map->nleaves;
+        ret = extent_leaf_store(ctx, inode, li, tmp, n);
+        if (ret != LSFS_OK) {
+            return ret;
+        }
+        li = li + 1 + map->nleaves - before;
+    }
+
+    return LSFS_OK;
 }
 
 /*
- * Write a data block to an inode
+ * Map the unmapped file blocks [first, first + count) to the consecutive
+ * disk blocks starting at addr
+ * The new extent is merged with its neighbours in the leaf when they are
+ * contiguous on disk too.
  */
-int lsfs_inode_write_block(struct lsfs_context *ctx, struct lsfs_inode_mem *inode,
-                           uint64_t block_idx, const void *buf)
+static int extent_insert(struct lsfs_context *ctx, struct lsfs_inode_mem *inode,
+                         uint64_t first, uint32_t count, uint64_t addr)
 {
-    uint64_t blocks_per_indirect = LSFS_BLOCK_SIZE / sizeof(uint64_t);
-    uint64_t old_addr = 0;
-    uint64_t new_addr;
+    struct lsfs_extent_map *map = inode_extents(ctx, inode);
+    struct lsfs_extent tmp[LSFS_EXTENTS_PER_NODE + 1];
+    uint32_t n = 0;
 
-    /* Get current block address */
-    if (block_idx < LSFS_DIRECT_BLOCKS) {
-        old_addr = inode->disk_inode.direct[block_idx];
+    if (!map) {
+        return LSFS_ERR_IO;
     }
 
-    /* Mark old block as dead */
-    if (old_addr) {
-        lsfs_gc_mark_block_dead(ctx, old_addr);
+    if (map->nleaves == 0) {
+        struct lsfs_extent_leaf *leaf = extent_leaf_insert(map, 0);
+        if (!leaf) {
+            return LSFS_ERR_NOMEM;
+        }
+        leaf->ext = malloc(LSFS_EXTENTS_PER_NODE * sizeof(struct lsfs_extent));
+        if (!leaf->ext) {
+            extent_leaf_delete(map, 0);
+            return LSFS_ERR_NOMEM;
+        }
+        leaf->first = (uint32_t)first;
     }
 
-    /* Append new block to log */
-    new_addr = lsfs_segment_append_block(ctx, buf, inode->disk_inode.ino,
-                                         (uint32_t)block_idx, LSFS_BLOCK_TYPE_DATA);
-    if (new_addr == 0) {
-        return LSFS_ERR_NOSPC;
+    uint32_t li = extent_leaf_find(map, first);
+    struct lsfs_extent_leaf *leaf = &map->leaves[li];
+    int ret = extent_leaf_load(ctx, inode, leaf);
+    if (ret != LSFS_OK) {
+        return ret;
     }
 
-    /* Update block pointer */
-    if (block_idx < LSFS_DIRECT_BLOCKS) {
-        inode->disk_inode.direct[block_idx] = new_addr;
+    uint32_t j = extent_upper(leaf, first);
+    memcpy(tmp, leaf->ext, j * sizeof(struct lsfs_extent));
+    n = j;
+
+    struct lsfs_extent *prev = n > 0 ? &tmp[n - 1] : NULL;
+    if (prev && (uint64_t)prev->logical + prev->length == first &&
+        prev->physical + prev->length == addr) {
+        prev->length += count;
+    } else {
+        tmp[n++] = (struct lsfs_extent) {
+            .logical = (uint32_t)first, .length = count, .physical = addr,
+        };
     }
-    /* Single indirect */
-    else if (block_idx < LSFS_DIRECT_BLOCKS + blocks_per_indirect) {
-        uint64_t indirect_block[LSFS_BLOCK_SIZE / sizeof(uint64_t)];
 
-        if (inode->disk_inode.indirect == 0) {
-            memset(indirect_block, 0, LSFS_BLOCK_SIZE);
-        } else {
-            if (lsfs_read_block(ctx, inode->disk_inode.indirect, indirect_block) != LSFS_OK) {
-                return LSFS_ERR_IO;
-            }
-            lsfs_gc_mark_block_dead(ctx, inode->disk_inode.indirect);
+    if (j < leaf->count) {
+        const struct lsfs_extent *next = &leaf->ext[j];
+        struct lsfs_extent *last = &tmp[n - 1];
+        uint32_t rest = leaf->count - j;
+
+        if (next->logical == first + count && next->physical == addr + count) {
+            last->length += next->length;
+            next++;
+            rest--;
         }
+        memcpy(&tmp[n], next, rest * sizeof(struct lsfs_extent));
+        n += rest;
+    }
+
+    return extent_leaf_store(ctx, inode, li, tmp, n);
+}
 
-        indirect_block[block_idx - LSFS_DIRECT_BLOCKS] = new_addr;
+/*
+ * Append one extent tree block
+ * Returns the new address, or 0 on failure
+ */
+static uint64_t extent_node_write(struct lsfs_context *ctx, struct lsfs_inode_mem *inode,
+                                  const struct lsfs_extent *entries, uint32_t count,
+                                  uint16_t depth)
+{
+    struct lsfs_extent_node node;
+
+    memset(&node, 0, sizeof(node));
+    node.header.magic = LSFS_EXTENT_MAGIC;
+    node.header.ino = inode->disk_inode.ino;
+    node.header.count = (uint16_t)count;
+    node.header.depth = depth;
+    memcpy(node.entries, entries, count * sizeof(struct lsfs_extent));
+
+    /* Tagged with the first file block it covers */
+    return lsfs_segment_append_block(ctx, &node, inode->disk_inode.ino,
+                                     entries[0].logical, LSFS_BLOCK_TYPE_EXTENT);
+}
 
-        uint64_t new_indirect = lsfs_segment_append_block(ctx, indirect_block,
-                                                          inode->disk_inode.ino, 0,
-                                                          LSFS_BLOCK_TYPE_INDIRECT);
-        if (new_indirect == 0) {
-            return LSFS_ERR_NOSPC;
+/*
+ * Merge neighbouring leaves that fit in one block, if one of them changed
+ */
+static void extent_map_compact(struct lsfs_context *ctx, struct lsfs_inode_mem *inode)
+{
+    struct lsfs_extent_map *map = inode->map;
+    uint32_t i = 0;
+
+    while (i + 1 < map->nleaves) {
+        struct lsfs_extent_leaf *a = &map->leaves[i];
+        struct lsfs_extent_leaf *b = &map->leaves[i + 1];
+
+        if (!a->ext || !b->ext || !(a->dirty || b->dirty) ||
+            a->count + b->count > LSFS_EXTENTS_PER_NODE) {
+            i++;
+            continue;
         }
-        inode->disk_inode.indirect = new_indirect;
-    }
-    /* Double indirect - simplified, full implementation would be similar */
-    else {
-        LSFS_ERROR("Double indirect blocks not fully implemented");
-        return LSFS_ERR_NOSPC;
+
+        memcpy(a->ext + a->count, b->ext, b->count * sizeof(struct lsfs_extent));
+        a->count += b->count;
+        a->dirty = true;
+        if (b->addr) {
+            lsfs_gc_stage_dead(ctx, inode, b->addr, 1);
+        }
+        extent_leaf_delete(map, i + 1);
     }
+}
 
-    inode->disk_inode.blocks = LSFS_MAX(inode->disk_inode.blocks, block_idx + 1);
+/*
+ * Move a map small enough to fit in the inode back into it
+ */
+static int extent_map_write_inline(struct lsfs_context *ctx, struct lsfs_inode_mem *inode)
+{
+    struct lsfs_extent_map *map = inode->map;
+    struct lsfs_inode *di = &inode->disk_inode;
+    uint32_t n = 0;
+
+    for (uint32_t i = 0; i < map->nleaves; i++) {
+        struct lsfs_extent_leaf *leaf = &map->leaves[i];
+        int ret = extent_leaf_load(ctx, inode, leaf);
+        if (ret != LSFS_OK) {
+            return ret;
+        }
+        memcpy(&di->extents[n], leaf->ext, leaf->count * sizeof(struct lsfs_extent));
+        n += leaf->count;
+    }
+
+    /* Fold everything into the first leaf, which now lives in the inode */
+    while (map->nleaves > 1) {
+        struct lsfs_extent_leaf *last = &map->leaves[map->nleaves - 1];
+        if (last->addr) {
+            lsfs_gc_stage_dead(ctx, inode, last->addr, 1);
+        }
+        extent_leaf_delete(map, map->nleaves - 1);
+    }
+    if (map->nleaves == 1) {
+        struct lsfs_extent_leaf *leaf = &map->leaves[0];
+        if (leaf->addr) {
+            lsfs_gc_stage_dead(ctx, inode, leaf->addr, 1);
+        }
+        memcpy(leaf->ext, di->extents, n * sizeof(struct lsfs_extent));
+        leaf->count = n;
+        leaf->addr = 0;
+        leaf->dirty = false;
+    }
+
+    for (uint32_t i = 0; i < map->nindex; i++) {
+        lsfs_gc_stage_dead(ctx, inode, map->index[i], 1);
+    }
+    map->nindex = 0;
+
+    memset(&di->extents[n], 0, (LSFS_INLINE_EXTENTS - n) * sizeof(struct lsfs_extent));
+    di->extent_count = (uint16_t)n;
+    di->extent_depth = 0;
+    return LSFS_OK;
+}
+
+/*
+ * Write the changed leaves of a map and rebuild the index above them
+ */
+static int extent_map_write_tree(struct lsfs_context *ctx, struct lsfs_inode_mem *inode)
+{
+    struct lsfs_extent_map *map = inode->map;
+    struct lsfs_inode *di = &inode->disk_inode;
+    uint32_t n = map->nleaves;
+    uint32_t nindex = 0;
+    uint16_t depth = 1;
+
+    for (uint32_t i = 0; i < n; i++) {
+        struct lsfs_extent_leaf *leaf = &map->leaves[i];
+        if (!leaf->dirty && leaf->addr) {
+            continue;
+        }
+
+        uint64_t addr = extent_node_write(ctx, inode, leaf->ext, leaf->count, 0);
+        if (addr == 0) {
+            return LSFS_ERR_NOSPC;
+        }
+        if (leaf->addr) {
+            lsfs_gc_stage_dead(ctx, inode, leaf->addr, 1);
+        }
+        leaf->addr = addr;
+        leaf->dirty = false;
+    }
+
+    struct lsfs_extent *level = malloc(n * sizeof(*level));
+    uint64_t *index = malloc((n / LSFS_EXTENTS_PER_NODE + 1) * 2 * sizeof(*index));
+    if (!level || !index) {
+        free(level);
+        free(index);
+        return LSFS_ERR_NOMEM;
+    }
+
+    for (uint32_t i = 0; i < n; i++) {
+        level[i] = (struct lsfs_extent) {
+            .logical = map->leaves[i].first,
+            .length = map->leaves[i].count,
+            .physical = map->leaves[i].addr,
+        };
+    }
+
+    /* Add index levels until the top one fits in the inode */
+    while (n > LSFS_INLINE_EXTENTS) {
+        uint32_t m = 0;
+
+        for (uint32_t i = 0; i < n; i += LSFS_EXTENTS_PER_NODE) {
+            uint32_t count = LSFS_MIN(LSFS_EXTENTS_PER_NODE, n - i);
+            uint64_t addr = extent_node_write(ctx, inode, &level[i], count, depth);
+            if (addr == 0) {
+                for (uint32_t k = 0; k < nindex; k++) {
+                    lsfs_gc_mark_block_dead(ctx, index[k]);
+                }
+                free(level);
+                free(index);
+                return LSFS_ERR_NOSPC;
+            }
+            index[nindex++] = addr;
+            level[m++] = (struct lsfs_extent) {
+                .logical = level[i].logical, .length = count, .physical = addr,
+            };
+        }
+
+        n = m;
+        depth++;
+    }
+
+    for (uint32_t i = 0; i < map->nindex; i++) {
+        lsfs_gc_stage_dead(ctx, inode, map->index[i], 1);
+    }
+    free(map->index);
+    map->index = index;
+    map->nindex = nindex;
+
+    memset(di->extents, 0, sizeof(di->extents));
+    memcpy(di->extents, level, n * sizeof(*level));
+    di->extent_count = (uint16_t)n;
+    di->extent_depth = depth;
+
+    free(level);
+    return LSFS_OK;
+}
+
+/*
+ * Write the inode's changed extent map
+ * Small maps go back into the inode; larger ones are written as a tree of
+ * which only the changed leaves and the index are appended.
+ */
+static int inode_write_maps(struct lsfs_context *ctx, struct lsfs_inode_mem *inode)
+{
+    struct lsfs_extent_map *map = inode->map;
+    uint32_t total = 0;
+    int ret;
+
+    if (!map || !map->dirty || (inode->disk_inode.flags & LSFS_INODE_INLINE_DATA)) {
+        return LSFS_OK;
+    }
+
+    extent_map_compact(ctx, inode);
+
+    for (uint32_t i = 0; i < map->nleaves; i++) {
+        total += map->leaves[i].count;
+    }
+
+    if (total <= LSFS_INLINE_EXTENTS) {
+        ret = extent_map_write_inline(ctx, inode);
+    } else {
+        ret = extent_map_write_tree(ctx, inode);
+    }
+
+    if (ret == LSFS_OK) {
+        map->dirty = false;
+    }
+    return ret;
+}
+
+/*
+ * Write inode to log
+ */
+int lsfs_inode_write(struct lsfs_context *ctx, struct lsfs_inode_mem *inode)
+{
+    uint64_t new_location;
+
+    if (!inode->dirty) {
+        return LSFS_OK;
+    }
+
+    /* The inode records where its extent blocks land, so they go first */
+    int ret = inode_write_maps(ctx, inode);
+    if (ret != LSFS_OK) {
+        return ret;
+    }
+
+    /* Append inode to log, sharing a block with other inodes */
+    new_location = lsfs_segment_append_inode(ctx, &inode->disk_inode,
+                                             inode->disk_location);
+    if (new_location == 0) {
+        return LSFS_ERR_NOSPC;
+    }
+
+    /* Mark old location as dead unless it was updated in place */
+    if (inode->disk_location && inode->disk_location != new_location) {
+        lsfs_gc_mark_inode_dead(ctx, inode->disk_location);
+    }
+
+    /* Update inode map; the blocks this version dropped can go once a
+     * checkpoint has saved it */
+    lsfs_imap_set(&ctx->imap, inode->disk_inode.ino, new_location);
+    lsfs_gc_commit_dead(ctx, inode);
+
+    inode->disk_location = new_location;
+    inode->version++;
+    inode->dirty = false;
+
+    LSFS_DEBUG("Wrote inode %u to block %" PRIu64 " slot %u",
+               inode->disk_inode.ino, LSFS_INODE_LOC_BLOCK(new_location),
+               LSFS_INODE_LOC_SLOT(new_location));
+
+    return LSFS_OK;
+}
+
+/*
+ * Write back the dirty inodes of one cache shard
+ */
+static int inode_shard_sync(struct lsfs_context *ctx, struct lsfs_inode_shard *shard,
+                            bool wait)
+{
+    struct lsfs_inode_mem **list;
+    uint32_t count = 0;
+    int ret = LSFS_OK;
+
+    if (wait) {
+        pthread_mutex_lock(&shard->lock);
+    } else if (pthread_mutex_trylock(&shard->lock) != 0) {
+        return LSFS_OK;
+    }
+
+    if (shard->count == 0) {
+        pthread_mutex_unlock(&shard->lock);
+        return LSFS_OK;
+    }
+
+    list = malloc(shard->count * sizeof(*list));
+    if (!list) {
+        pthread_mutex_unlock(&shard->lock);
+        return LSFS_ERR_NOMEM;
+    }
+
+    /* Pin every cached inode so none is evicted while we work */
+    for (struct lsfs_inode_mem *inode = shard->lru_head; inode; inode = inode->lru_next) {
+        __atomic_add_fetch(&inode->refcount, 1, __ATOMIC_RELAXED);
+        list[count++] = inode;
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+
+    for (uint32_t i = 0; i < count; i++) {
+        struct lsfs_inode_mem *inode = list[i];
+
+        if (wait) {
+            pthread_mutex_lock(&inode->lock);
+        } else if (pthread_mutex_trylock(&inode->lock) != 0) {
+            lsfs_inode_put(inode);
+            continue;
+        }
+
+        if (inode->dirty) {
+            int write_ret = lsfs_inode_write(ctx, inode);
+            if (write_ret != LSFS_OK) {
+                ret = write_ret;
+            }
+        }
+
+        pthread_mutex_unlock(&inode->lock);
+        lsfs_inode_put(inode);
+    }
+
+    free(list);
+    return ret;
+}
+
+/*
+ * Write back every dirty cached inode
+ * With wait false nothing is waited for: inodes locked by someone else are
+ * skipped, and so are shards whose lock is busy.  Callers that may already
+ * hold an inode or a shard lock must use that mode.
+ */
+int lsfs_inode_sync_all(struct lsfs_context *ctx, bool wait)
+{
+    int ret = LSFS_OK;
+
+    for (int i = 0; i < LSFS_INODE_CACHE_SHARDS; i++) {
+        int shard_ret = inode_shard_sync(ctx, &ctx->icache.shards[i], wait);
+        if (shard_ret != LSFS_OK) {
+            ret = shard_ret;
+        }
+    }
+
+    return ret;
+}
+
+/*
+ * Resolve count consecutive logical blocks to disk addresses (0 for holes)
+ */
+int lsfs_inode_map_blocks(struct lsfs_context *ctx, struct lsfs_inode_mem *inode,
+                          uint64_t block_idx, uint32_t count, uint64_t *addrs)
+{
+    uint32_t i = 0;
+
+    while (i < count) {
+        uint64_t addr, run;
+        int ret = extent_lookup(ctx, inode, block_idx + i, &addr, &run);
+        if (ret != LSFS_OK) {
+            return ret;
+        }
+
+        run = LSFS_MIN(run, count - i);
+        for (uint64_t k = 0; k < run; k++) {
+            addrs[i + k] = addr ? addr + k : 0;
+        }
+        i += (uint32_t)run;
+    }
+
+    return LSFS_OK;
+}
+
+/*
+ * Read a data block from an inode
+ */
+int lsfs_inode_read_block(struct lsfs_context *ctx, struct lsfs_inode_mem *inode,
+                          uint64_t block_idx, void *buf)
+{
+    uint64_t block_addr, run;
+    int ret;
+
+    if (inode->disk_inode.flags & LSFS_INODE_INLINE_DATA) {
+        memset(buf, 0, LSFS_BLOCK_SIZE);
+        if (block_idx == 0) {
+            memcpy(buf, inode->disk_inode.inline_data, LSFS_INLINE_DATA_MAX);
+        }
+        return LSFS_OK;
+    }
+
+    ret = extent_lookup(ctx, inode, block_idx, &block_addr, &run);
+    if (ret != LSFS_OK) {
+        return ret;
+    }
+
+    if (block_addr == 0) {
+        memset(buf, 0, LSFS_BLOCK_SIZE);
+        return LSFS_OK;
+    }
+
+    return lsfs_segment_read_block(ctx, block_addr, buf);
+}
+
+/*
+ * Pull the extent tree block stored at addr into memory if the inode
+ * still uses it
+ * The next lsfs_inode_write() appends it elsewhere, which is how the
+ * cleaner moves a live extent block.  Returns LSFS_ERR_NOENT if the block
+ * is no longer referenced.
+ */
+int lsfs_inode_move_extent_block(struct lsfs_context *ctx, struct lsfs_inode_mem *inode,
+                                 uint64_t addr)
+{
+    struct lsfs_extent_map *map;
+
+    if (addr == 0 || inode->disk_inode.extent_depth == 0) {
+        return LSFS_ERR_NOENT;
+    }
+
+    map = inode_extents(ctx, inode);
+    if (!map) {
+        return LSFS_ERR_IO;
+    }
+
+    /* Index blocks are rebuilt whenever the map is written */
+    for (uint32_t i = 0; i < map->nindex; i++) {
+        if (map->index[i] == addr) {
+            map->dirty = true;
+            inode->dirty = true;
+            return LSFS_OK;
+        }
+    }
+
+    for (uint32_t i = 0; i < map->nleaves; i++) {
+        struct lsfs_extent_leaf *leaf = &map->leaves[i];
+        if (leaf->addr != addr) {
+            continue;
+        }
+
+        int ret = extent_leaf_load(ctx, inode, leaf);
+        if (ret != LSFS_OK) {
+            return ret;
+        }
+        leaf->dirty = true;
+        map->dirty = true;
+        inode->dirty = true;
+        return LSFS_OK;
+    }
+
+    return LSFS_ERR_NOENT;
+}
+
+/*
+ * Point count consecutive logical blocks starting at first to the
+ * consecutive log blocks starting at addr
+ * The blocks being replaced are marked dead.  The extent map is only
+ * changed in memory and reaches the log at the next lsfs_inode_write().
+ */
+static int inode_set_blocks(struct lsfs_context *ctx, struct lsfs_inode_mem *inode,
+                            uint64_t first, uint32_t count, uint64_t addr)
+{
+    int ret = extent_punch(ctx, inode, first, first + count);
+    if (ret == LSFS_OK) {
+        ret = extent_insert(ctx, inode, first, count, addr);
+    }
+    if (ret != LSFS_OK) {
+        return ret;
+    }
+
+    inode->disk_inode.blocks = LSFS_MAX(inode->disk_inode.blocks, first + count);
+    inode->dirty = true;
+    return LSFS_OK;
+}
+
+/*
+ * Check whether len bytes at buf are all zero
+ */
+static bool bytes_zero(const uint8_t *buf, size_t len)
+{
+    for (size_t i = 0; i < len; i++) {
+        if (buf[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Switch an inode to inline data if it can be
+ * Only regular files and directories with nothing mapped qualify; an
+ * inode that is already inline trivially does.
+ */
+static bool inode_inline_begin(struct lsfs_context *ctx, struct lsfs_inode_mem *inode)
+{
+    struct lsfs_inode *di = &inode->disk_inode;
+
+    if (di->flags & LSFS_INODE_INLINE_DATA) {
+        return true;
+    }
+    if ((!S_ISREG(di->mode) && !S_ISDIR(di->mode)) || di->blocks > 0) {
+        return false;
+    }
+
+    /* An emptied map still has to release its tree blocks */
+    if (inode->map) {
+        if (inode->map->nleaves > 0 || inode_write_maps(ctx, inode) != LSFS_OK) {
+            return false;
+        }
+    }
+    if (di->extent_count > 0 || di->extent_depth > 0) {
+        return false;
+    }
+
+    inode_drop_maps(inode);
+    memset(di->inline_data, 0, LSFS_INLINE_DATA_MAX);
+    di->flags |= LSFS_INODE_INLINE_DATA;
+    inode->dirty = true;
+    return true;
+}
+
+/*
+ * Append block block_idx of an inode to the log and map it
+ * Directory blocks are tagged as such, which keeps them with the rest of
+ * the metadata in the log.
+ */
+static int inode_append_block(struct lsfs_context *ctx, struct lsfs_inode_mem *inode,
+                              uint64_t block_idx, const void *buf)
+{
+    uint8_t type = S_ISDIR(inode->disk_inode.mode) ? LSFS_BLOCK_TYPE_DIRENT
+                                                   : LSFS_BLOCK_TYPE_DATA;
+    uint64_t new_addr;
+
+    new_addr = lsfs_segment_append_block(ctx, buf, inode->disk_inode.ino,
+                                         (uint32_t)block_idx, type);
+    if (new_addr == 0) {
+        return LSFS_ERR_NOSPC;
+    }
+
+    return inode_set_blocks(ctx, inode, block_idx, 1, new_addr);
+}
+
+/*
+ * Move an inline inode's data out to block 0 in the log
+ * keep is false when the caller is about to overwrite all of block 0, so
+ * the old contents need not be written; the caller keeps a copy and puts
+ * it back with inode_reinline() if the new block 0 cannot be written.  An
+ * all-zero block is left as a hole.  On failure the inode is left inline.
+ */
+static int inode_uninline(struct lsfs_context *ctx, struct lsfs_inode_mem *inode, bool keep)
+{
+    struct lsfs_inode *di = &inode->disk_inode;
+    uint8_t block[LSFS_BLOCK_SIZE];
+
+    if (!(di->flags & LSFS_INODE_INLINE_DATA)) {
+        return LSFS_OK;
+    }
+
+    memset(block, 0, LSFS_BLOCK_SIZE);
+    memcpy(block, di->inline_data, LSFS_INLINE_DATA_MAX);
+    memset(di->inline_data, 0, LSFS_INLINE_DATA_MAX);
+    di->flags &= ~LSFS_INODE_INLINE_DATA;
+    inode->dirty = true;
+
+    if (!keep || bytes_zero(block, LSFS_INLINE_DATA_MAX)) {
+        return LSFS_OK;
+    }
+
+    int ret = inode_append_block(ctx, inode, 0, block);
+    if (ret != LSFS_OK) {
+        memcpy(di->inline_data, block, LSFS_INLINE_DATA_MAX);
+        di->flags |= LSFS_INODE_INLINE_DATA;
+    }
+    return ret;
+}
+
+/*
+ * Put back inline data saved before inode_uninline(keep=false)
+ * Only done while nothing has been mapped since, which is the case when
+ * the write that was to replace block 0 failed before mapping it.
+ */
+static void inode_reinline(struct lsfs_inode_mem *inode, const uint8_t *saved)
+{
+    struct lsfs_inode *di = &inode->disk_inode;
+
+    if (di->blocks > 0 || di->extent_count > 0 || di->extent_depth > 0 ||
+        (inode->map && inode->map->nleaves > 0)) {
+        return;
+    }
+
+    inode_drop_maps(inode);
+    memcpy(di->inline_data, saved, LSFS_INLINE_DATA_MAX);
+    di->flags |= LSFS_INODE_INLINE_DATA;
+    inode->dirty = true;
+}
+
+/*
+ * Write a data block to an inode
+ * A block 0 whose contents fit in the inode is kept inline when nothing
+ * else is mapped; any other write moves inline data out to the log first.
+ */
+int lsfs_inode_write_block(struct lsfs_context *ctx, struct lsfs_inode_mem *inode,
+                           uint64_t block_idx, const void *buf)
+{
+    struct lsfs_inode *di = &inode->disk_inode;
+    const uint8_t *data = buf;
+    uint8_t saved[LSFS_INLINE_DATA_MAX];
+    bool was_inline = (di->flags & LSFS_INODE_INLINE_DATA) != 0;
+    int ret;
+
+    if (block_idx == 0 &&
+        bytes_zero(data + LSFS_INLINE_DATA_MAX, LSFS_BLOCK_SIZE - LSFS_INLINE_DATA_MAX) &&
+        inode_inline_begin(ctx, inode)) {
+        memcpy(di->inline_data, data, LSFS_INLINE_DATA_MAX);
+        inode->dirty = true;
+        return LSFS_OK;
+    }
+
+    if (was_inline && block_idx == 0) {
+        memcpy(saved, di->inline_data, LSFS_INLINE_DATA_MAX);
+    }
+    ret = inode_uninline(ctx, inode, block_idx != 0);
+    if (ret != LSFS_OK) {
+        return ret;
+    }
+
+    ret = inode_append_block(ctx, inode, block_idx, buf);
+    if (ret != LSFS_OK && was_inline && block_idx == 0) {
+        inode_reinline(inode, saved);
+    }
+    return ret;
+}
+
+/*
+ * Set the size of an inode
+ * When shrinking, every block past the new end is released, including
+ * extent blocks that no longer map anything, and the tail of a partial
+ * last block is zeroed so that growing the file again reads back zeros.
+ */
+int lsfs_inode_truncate(struct lsfs_context *ctx, struct lsfs_inode_mem *inode,
+                        uint64_t size)
+{
+    uint64_t first = LSFS_BLOCKS_FOR_SIZE(size);
+    struct lsfs_extent_map *map;
+    int ret;
+
+    if (size >= inode->disk_inode.size) {
+        inode->disk_inode.size = size;
+        inode->dirty = true;
+        return LSFS_OK;
+    }
+
+    /* Inline data has no blocks to release, only bytes to clear */
+    if (inode->disk_inode.flags & LSFS_INODE_INLINE_DATA) {
+        if (size < LSFS_INLINE_DATA_MAX) {
+            memset(inode->disk_inode.inline_data + size, 0, LSFS_INLINE_DATA_MAX - size);
+        }
+        inode->disk_inode.size = size;
+        inode->dirty = true;
+        return LSFS_OK;
+    }
+
+    /* Zero the tail of the new last block */
+    if (size % LSFS_BLOCK_SIZE) {
+        uint64_t block_idx = size / LSFS_BLOCK_SIZE;
+        uint64_t block_addr, run;
+
+        ret = extent_lookup(ctx, inode, block_idx, &block_addr, &run);
+        if (ret == LSFS_OK && block_addr) {
+            uint8_t block[LSFS_BLOCK_SIZE];
+            uint32_t keep = size % LSFS_BLOCK_SIZE;
+
+            ret = lsfs_segment_read_block(ctx, block_addr, block);
+            if (ret != LSFS_OK) {
+                return ret;
+            }
+            memset(block + keep, 0, LSFS_BLOCK_SIZE - keep);
+            ret = lsfs_inode_write_block(ctx, inode, block_idx, block);
+        }
+        if (ret != LSFS_OK) {
+            return ret;
+        }
+    }
+
+    ret = extent_punch(ctx, inode, first, (uint64_t)LSFS_MAX_FILE_BLOCKS + 1);
+    if (ret != LSFS_OK) {
+        return ret;
+    }
+
+    /* An empty tree needs no index; drop it now in case the inode is
+     * being freed and never written again */
+    map = inode->map;
+    if (map && map->nleaves == 0 && map->nindex > 0) {
+        for (uint32_t i = 0; i < map->nindex; i++) {
+            lsfs_gc_stage_dead(ctx, inode, map->index[i], 1);
+        }
+        map->nindex = 0;
+        map->dirty = true;
+    }
+
+    inode->disk_inode.blocks = LSFS_MIN(inode->disk_inode.blocks, first);
+    inode->disk_inode.size = size;
     inode->dirty = true;
 
     return LSFS_OK;
 }
 
+/*
+ * Write size bytes of file data from src at byte offset off, compressed
+ * Each block is compressed on its own.  Blocks that shrink to at most
+ * LSFS_PACKED_MAX_LEN bytes go into the stream's open packed block and
+ * the rest are appended whole.  Blocks that land at consecutive addresses
+ * are mapped as one run, as lsfs_inode_write_data() does.
+ */
+static ssize_t inode_write_compressed(struct lsfs_context *ctx, struct lsfs_inode_mem *inode,
+                                      uint64_t off, size_t size, struct fuse_bufvec *src,
+                                      uint32_t stream)
+{
+    uint32_t ino = inode->disk_inode.ino;
+    uint64_t block_idx = off / LSFS_BLOCK_SIZE;
+    uint32_t block_off = off % LSFS_BLOCK_SIZE;
+    uint8_t block[LSFS_BLOCK_SIZE];
+    uint8_t packed[LSFS_PACKED_MAX_LEN];
+    size_t bytes_written = 0;
+    size_t run_bytes = 0;
+    uint64_t run_first = block_idx;
+    uint64_t run_addr = 0;
+    uint32_t run_len = 0;
+    int ret = LSFS_OK;
+
+    while (bytes_written + run_bytes < size) {
+        size_t to_write = LSFS_MIN(LSFS_BLOCK_SIZE - block_off,
+                                   size - bytes_written - run_bytes);
+        uint64_t addr;
+        uint32_t len;
+
+        if (block_idx >= LSFS_MAX_FILE_BLOCKS) {
+            ret = LSFS_ERR_NOSPC;
+            break;
+        }
+
+        /* If partial block write, read existing block first */
+        if (to_write < LSFS_BLOCK_SIZE &&
+            lsfs_inode_read_block(ctx, inode, block_idx, block) != LSFS_OK) {
+            memset(block, 0, LSFS_BLOCK_SIZE);
+        }
+
+        struct fuse_bufvec dst_vec = FUSE_BUFVEC_INIT(to_write);
+        dst_vec.buf[0].mem = block + block_off;
+        if (fuse_buf_copy(&dst_vec, src, 0) != (ssize_t)to_write) {
+            LSFS_ERROR("Short copy of write payload for inode %u", ino);
+            ret = LSFS_ERR_IO;
+            break;
+        }
+
+        len = lsfs_compress_block(ctx->compress_codec, ctx->compress_level, block, packed,
+                                  LSFS_PACKED_MAX_LEN);
+        if (len > 0) {
+            addr = lsfs_segment_append_packed(ctx, stream, ino, (uint32_t)block_idx,
+                                              packed, len);
+        } else {
+            uint32_t granted;
+            uint8_t *dst;
+
+            __atomic_add_fetch(&ctx->incompressible_blocks, 1, __ATOMIC_RELAXED);
+            addr = lsfs_segment_reserve(ctx, stream, 1, ino, (uint32_t)block_idx,
+                                        LSFS_BLOCK_TYPE_DATA, &granted, &dst);
+            if (addr != 0) {
+                memcpy(dst, block, LSFS_BLOCK_SIZE);
+                lsfs_segment_commit(ctx, addr, granted);
+            }
+        }
+        if (addr == 0) {
+            ret = LSFS_ERR_NOSPC;
+            break;
+        }
+
+        /* Map the run so far once the block does not continue it */
+        if (run_len > 0 && addr != run_addr + run_len) {
+            ret = inode_set_blocks(ctx, inode, run_first, run_len, run_addr);
+            if (ret != LSFS_OK) {
+                run_len = 0;
+                break;
+            }
+            bytes_written += run_bytes;
+            run_bytes = 0;
+            run_len = 0;
+        }
+        if (run_len == 0) {
+            run_first = block_idx;
+            run_addr = addr;
+        }
+
+        run_len++;
+        run_bytes += to_write;
+        block_idx++;
+        block_off = 0;
+    }
+
+    if (run_len > 0) {
+        int map_ret = inode_set_blocks(ctx, inode, run_first, run_len, run_addr);
+        if (map_ret == LSFS_OK) {
+            bytes_written += run_bytes;
+        } else {
+            ret = map_ret;
+        }
+    }
+
+    if (bytes_written == 0 && ret != LSFS_OK) {
+        return ret;
+    }
+
+    return (ssize_t)bytes_written;
+}
+
+/*
+ * Write size bytes from src at byte offset off
+ * A write that ends within LSFS_INLINE_DATA_MAX bytes of a file with
+ * nothing mapped is stored in the inode.  Otherwise the range is
+ * appended as runs of contiguous log blocks and the block maps are
+ * patched once per run.  Blocks the range covers entirely are copied
+ * straight from src into the segment buffer; only the partial blocks at
+ * either end are read first.  The blocks go to the given log stream.
+ * File data is compressed first when the mount asks for it.
+ * Returns the number of bytes written, or a negative error if nothing
+ * could be written.
+ */
+ssize_t lsfs_inode_write_data(struct lsfs_context *ctx, struct lsfs_inode_mem *inode,
+                              uint64_t off, size_t size, struct fuse_bufvec *src,
+                              uint32_t stream)
+{
+    uint8_t type = S_ISDIR(inode->disk_inode.mode) ? LSFS_BLOCK_TYPE_DIRENT
+                                                   : LSFS_BLOCK_TYPE_DATA;
+    uint64_t max_blocks = LSFS_MAX_FILE_BLOCKS;
+    uint64_t block_idx = off / LSFS_BLOCK_SIZE;
+    uint32_t block_off = off % LSFS_BLOCK_SIZE;
+    size_t bytes_written = 0;
+    uint8_t saved[LSFS_INLINE_DATA_MAX];
+    bool replace;
+    int ret = LSFS_OK;
+
+    if (off + size <= LSFS_INLINE_DATA_MAX && inode_inline_begin(ctx, inode)) {
+        struct fuse_bufvec dst_vec = FUSE_BUFVEC_INIT(size);
+        dst_vec.buf[0].mem = inode->disk_inode.inline_data + off;
+        if (fuse_buf_copy(&dst_vec, src, 0) != (ssize_t)size) {
+            LSFS_ERROR("Short copy of write payload for inode %u",
+                       inode->disk_inode.ino);
+            return LSFS_ERR_IO;
+        }
+        inode->dirty = true;
+        return (ssize_t)size;
+    }
+
+    /* Block 0 is about to be overwritten whole; keep a copy of its inline
+     * contents until the write has mapped its replacement */
+    replace = off == 0 && size >= LSFS_BLOCK_SIZE &&
+              (inode->disk_inode.flags & LSFS_INODE_INLINE_DATA);
+    if (replace) {
+        memcpy(saved, inode->disk_inode.inline_data, LSFS_INLINE_DATA_MAX);
+    }
+    ret = inode_uninline(ctx, inode, !replace);
+    if (ret != LSFS_OK) {
+        return ret;
+    }
+
+    if (type == LSFS_BLOCK_TYPE_DATA && ctx->compress_codec != LSFS_CODEC_NONE) {
+        ssize_t written = inode_write_compressed(ctx, inode, off, size, src, stream);
+        if (written <= 0 && replace) {
+            inode_reinline(inode, saved);
+        }
+        return written;
+    }
+
+    while (bytes_written < size && ret == LSFS_OK) {
+        uint64_t remaining = size - bytes_written;
+        uint64_t want = (block_off + remaining + LSFS_BLOCK_SIZE - 1) / LSFS_BLOCK_SIZE;
+        uint32_t granted, filled;
+        uint8_t *dst;
+        uint64_t addr;
+        size_t run_bytes = 0;
+
+        /* Keep runs inside what the block map can address */
+        if (block_idx >= max_blocks) {
+            ret = LSFS_ERR_NOSPC;
+            break;
+        }
+        want = LSFS_MIN(want, max_blocks - block_idx);
+
+        addr = lsfs_segment_reserve(ctx, stream, (uint32_t)LSFS_MIN(want, LSFS_SEGMENT_BLOCKS),
+                                    inode->disk_inode.ino, (uint32_t)block_idx,
+                                    type, &granted, &dst);
+        if (addr == 0) {
+            ret = LSFS_ERR_NOSPC;
+            break;
+        }
+
+        for (filled = 0; filled < granted; filled++) {
+            uint8_t *block_buf = dst + (size_t)filled * LSFS_BLOCK_SIZE;
+            size_t to_write = LSFS_MIN(LSFS_BLOCK_SIZE - block_off,
+                                       size - bytes_written - run_bytes);
+
+            /* If partial block write, read existing block first */
+            if (to_write < LSFS_BLOCK_SIZE &&
+                lsfs_inode_read_block(ctx, inode, block_idx + filled, block_buf) != LSFS_OK) {
+                memset(block_buf, 0, LSFS_BLOCK_SIZE);
+            }
+
+            struct fuse_bufvec dst_vec = FUSE_BUFVEC_INIT(to_write);
+            dst_vec.buf[0].mem = block_buf + block_off;
+            if (fuse_buf_copy(&dst_vec, src, 0) != (ssize_t)to_write) {
+                LSFS_ERROR("Short copy of write payload for inode %u",
+                           inode->disk_inode.ino);
+                ret = LSFS_ERR_IO;
+                break;
+            }
+
+            run_bytes += to_write;
+            block_off = 0;
+        }
+
+        lsfs_segment_commit(ctx, addr, granted);
+
+        /* Slots that were reserved but not filled hold nothing live */
+        for (uint32_t i = filled; i < granted; i++) {
+            lsfs_gc_mark_block_dead(ctx, addr + i);
+        }
+
+        if (filled > 0) {
+            int map_ret = inode_set_blocks(ctx, inode, block_idx, filled, addr);
+            if (map_ret != LSFS_OK) {
+                ret = map_ret;
+                break;
+            }
+            bytes_written += run_bytes;
+            block_idx += filled;
+        }
+    }
+
+    if (bytes_written == 0 && ret != LSFS_OK) {
+        if (replace) {
+            inode_reinline(inode, saved);
+        }
+        return ret;
+    }
+
+    return (ssize_t)bytes_written;
+}
+
 /*
  * Convert inode to stat structure
  */
@@ -3,6 +3,8 @@
  * Block I/O Layer
  */
 
+#define _GNU_SOURCE             /* O_DIRECT, fallocate() */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -11,15 +13,94 @@
 #include <errno.h>
 #include <inttypes.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <pthread.h>
 
 #include "lsfs.h"
 
+/*
+ * Transfer a batch with pread/pwrite, one call per request
+ */
+static int psync_submit(struct lsfs_context *ctx, struct lsfs_io_req *reqs,
+                        uint32_t count, bool write)
+{
+    int ret = LSFS_OK;
+
+    for (uint32_t i = 0; i < count; i++) {
+        struct lsfs_io_req *req = &reqs[i];
+        off_t offset = (off_t)req->block * LSFS_BLOCK_SIZE;
+        size_t size = (size_t)req->count * LSFS_BLOCK_SIZE;
+        ssize_t done;
+
+        if (write) {
+            done = pwrite(ctx->fd, req->buf, size, offset);
+        } else {
+            done = pread(ctx->fd, req->buf, size, offset);
+        }
+
+        req->result = (done == (ssize_t)size) ? LSFS_OK : LSFS_ERR_IO;
+        if (req->result != LSFS_OK) {
+            LSFS_ERROR("Failed to %s %u blocks at %" PRIu64 ": %s",
+                       write ? "write" : "read", req->count, req->block,
+                       done < 0 ? strerror(errno) : "short transfer");
+            ret = LSFS_ERR_IO;
+        }
+    }
+
+    return ret;
+}
+
+/*
+ * Write blocks and wait until they are durable
+ */
+static int psync_write_sync(struct lsfs_context *ctx, uint64_t start_block,
+                            uint32_t count, const void *buf)
+{
+    struct lsfs_io_req req = {
+        .block = start_block, .count = count, .buf = (void *)buf,
+    };
+
+    if (psync_submit(ctx, &req, 1, true) != LSFS_OK) {
+        return LSFS_ERR_IO;
+    }
+
+    if (fdatasync(ctx->fd) < 0) {
+        LSFS_ERROR("Failed to sync: %s", strerror(errno));
+        return LSFS_ERR_IO;
+    }
+
+    return LSFS_OK;
+}
+
+static const struct lsfs_io_ops io_psync_ops = {
+    .name = "psync",
+    .submit = psync_submit,
+    .write_sync = psync_write_sync,
+};
+
+/*
+ * Allocate a zeroed buffer aligned for O_DIRECT transfers
+ */
+void *lsfs_io_alloc(size_t size)
+{
+    void *buf;
+
+    if (posix_memalign(&buf, LSFS_IO_ALIGN, size) != 0) {
+        return NULL;
+    }
+    memset(buf, 0, size);
+    return buf;
+}
+
 /*
  * Initialize I/O layer - open the disk image file
+ * The backend is chosen by ctx->io_backend; io_uring falls back to psync
+ * when the kernel does not support it.
  */
 int lsfs_io_init(struct lsfs_context *ctx, const char *path)
 {
-    struct stat st;
+    int flags = O_RDWR;
 
     ctx->disk_path = strdup(path);
     if (!ctx->disk_path) {
@@ -27,27 +108,42 @@ int lsfs_io_init(struct lsfs_context *ctx, const char *path)
         return LSFS_ERR_NOMEM;
     }
 
-    /* Open disk image */
-    ctx->fd = open(path, O_RDWR);
+    /* Open disk image, bypassing the host page cache if asked to */
+    if (ctx->direct_io) {
+        flags |= O_DIRECT;
+    }
+    ctx->fd = open(path, flags);
     if (ctx->fd < 0) {
-        LSFS_ERROR("Failed to open disk image: %s", strerror(errno));
+        LSFS_ERROR("Failed to open disk image%s: %s",
+                   ctx->direct_io ? " with O_DIRECT" : "", strerror(errno));
         free(ctx->disk_path);
         ctx->disk_path = NULL;
         return LSFS_ERR_IO;
     }
 
     /* Get disk size */
-    if (fstat(ctx->fd, &st) < 0) {
-        LSFS_ERROR("Failed to stat disk image: %s", strerror(errno));
+    if (lsfs_image_size(ctx->fd, &ctx->disk_size, &ctx->block_device) < 0) {
+        LSFS_ERROR("Failed to get disk image size: %s", strerror(errno));
         close(ctx->fd);
         free(ctx->disk_path);
         ctx->disk_path = NULL;
         return LSFS_ERR_IO;
     }
 
-    ctx->disk_size = st.st_size;
-    LSFS_INFO("Opened disk image: %s (%" PRIu64 " bytes)",
-              path, ctx->disk_size);
+    /* Select backend */
+    ctx->io = &io_psync_ops;
+    ctx->io_private = NULL;
+    if (ctx->io_backend == LSFS_IO_URING) {
+        if (lsfs_io_uring_ops.init(ctx) == LSFS_OK) {
+            ctx->io = &lsfs_io_uring_ops;
+        } else {
+            LSFS_ERROR("io_uring unavailable, falling back to psync");
+        }
+    }
+
+    LSFS_INFO("Opened disk image: %s (%" PRIu64 " bytes, %s%s)",
+              path, ctx->disk_size, ctx->io->name,
+              ctx->direct_io ? ", O_DIRECT" : "");
 
     return LSFS_OK;
 }
@@ -59,6 +155,9 @@ void lsfs_io_destroy(struct lsfs_context *ctx)
 {
     if (ctx->fd >= 0) {
         fsync(ctx->fd);
+        if (ctx->io && ctx->io->destroy) {
+            ctx->io->destroy(ctx);
+        }
         close(ctx->fd);
         ctx->fd = -1;
     }
@@ -70,78 +169,141 @@ void lsfs_io_destroy(struct lsfs_context *ctx)
 }
 
 /*
- * Read a single block
+ * Check that a batch stays inside the image
  */
-int lsfs_read_block(struct lsfs_context *ctx, uint64_t block_num, void *buf)
+static int io_check(struct lsfs_context *ctx, const struct lsfs_io_req *reqs,
+                    uint32_t count, bool write)
 {
-    off_t offset = (off_t)block_num * LSFS_BLOCK_SIZE;
-    ssize_t ret;
-
-    if (offset + LSFS_BLOCK_SIZE > (off_t)ctx->disk_size) {
-        LSFS_ERROR("Read beyond end of disk: block %" PRIu64, block_num);
+    if (write && ctx->readonly) {
+        LSFS_ERROR("Filesystem is read-only");
         return LSFS_ERR_IO;
     }
 
-    ret = pread(ctx->fd, buf, LSFS_BLOCK_SIZE, offset);
-    if (ret != LSFS_BLOCK_SIZE) {
-        LSFS_ERROR("Failed to read block %" PRIu64 ": %s",
-                   block_num, strerror(errno));
-        return LSFS_ERR_IO;
+    for (uint32_t i = 0; i < count; i++) {
+        uint64_t end = (reqs[i].block + reqs[i].count) * LSFS_BLOCK_SIZE;
+        if (end > ctx->disk_size) {
+            LSFS_ERROR("%s beyond end of disk: block %" PRIu64,
+                       write ? "Write" : "Read", reqs[i].block + reqs[i].count - 1);
+            return LSFS_ERR_IO;
+        }
     }
 
     return LSFS_OK;
 }
 
 /*
- * Write a single block
+ * Count the bytes a batch transfers
  */
-int lsfs_write_block(struct lsfs_context *ctx, uint64_t block_num, const void *buf)
+static void io_account(struct lsfs_context *ctx, const struct lsfs_io_req *reqs,
+                       uint32_t count, bool write)
 {
-    off_t offset = (off_t)block_num * LSFS_BLOCK_SIZE;
-    ssize_t ret;
+    uint64_t blocks = 0;
 
-    if (ctx->readonly) {
-        LSFS_ERROR("Filesystem is read-only");
-        return LSFS_ERR_IO;
+    for (uint32_t i = 0; i < count; i++) {
+        blocks += reqs[i].count;
     }
+    lsfs_stats_add(ctx, write ? LSFS_CTR_DEVICE_WRITE : LSFS_CTR_DEVICE_READ,
+                   blocks * LSFS_BLOCK_SIZE);
+}
 
-    if (offset + LSFS_BLOCK_SIZE > (off_t)ctx->disk_size) {
-        LSFS_ERROR("Write beyond end of disk: block %" PRIu64, block_num);
-        return LSFS_ERR_IO;
+/*
+ * Submit a batch to the backend, bouncing unaligned buffers
+ * With O_DIRECT, requests whose buffer is not aligned go through an
+ * aligned bounce buffer; hot paths allocate with lsfs_io_alloc() instead.
+ */
+static int io_submit_bounce(struct lsfs_context *ctx, struct lsfs_io_req *reqs,
+                            uint32_t count, bool write)
+{
+    int ret = LSFS_OK;
+
+    uint32_t unaligned = 0;
+    if (ctx->direct_io) {
+        for (uint32_t i = 0; i < count; i++) {
+            unaligned += (uintptr_t)reqs[i].buf % LSFS_IO_ALIGN != 0;
+        }
+    }
+    if (unaligned == 0) {
+        return ctx->io->submit(ctx, reqs, count, write);
     }
 
-    ret = pwrite(ctx->fd, buf, LSFS_BLOCK_SIZE, offset);
-    if (ret != LSFS_BLOCK_SIZE) {
-        LSFS_ERROR("Failed to write block %" PRIu64 ": %s",
-                   block_num, strerror(errno));
-        return LSFS_ERR_IO;
+    for (uint32_t i = 0; i < count; i++) {
+        struct lsfs_io_req *req = &reqs[i];
+        size_t size = (size_t)req->count * LSFS_BLOCK_SIZE;
+
+        if ((uintptr_t)req->buf % LSFS_IO_ALIGN == 0) {
+            int r = ctx->io->submit(ctx, req, 1, write);
+            ret = (r != LSFS_OK) ? r : ret;
+            continue;
+        }
+
+        struct lsfs_io_req bounce = *req;
+        bounce.buf = lsfs_io_alloc(size);
+        if (!bounce.buf) {
+            req->result = LSFS_ERR_NOMEM;
+            ret = LSFS_ERR_NOMEM;
+            continue;
+        }
+        if (write) {
+            memcpy(bounce.buf, req->buf, size);
+        }
+        req->result = ctx->io->submit(ctx, &bounce, 1, write);
+        if (!write && req->result == LSFS_OK) {
+            memcpy(req->buf, bounce.buf, size);
+        }
+        ret = (req->result != LSFS_OK) ? req->result : ret;
+        free(bounce.buf);
     }
 
-    return LSFS_OK;
+    return ret;
 }
 
 /*
- * Read multiple contiguous blocks
+ * Submit a batch to the backend
+ * Reads are timed as one operation, however many requests they hold.
  */
-int lsfs_read_blocks(struct lsfs_context *ctx, uint64_t start_block,
-                     uint32_t count, void *buf)
+static int io_submit(struct lsfs_context *ctx, struct lsfs_io_req *reqs,
+                     uint32_t count, bool write)
 {
-    off_t offset = (off_t)start_block * LSFS_BLOCK_SIZE;
-    size_t size = (size_t)count * LSFS_BLOCK_SIZE;
-    ssize_t ret;
-
-    if (offset + (off_t)size > (off_t)ctx->disk_size) {
-        LSFS_ERROR("Read beyond end of disk");
-        return LSFS_ERR_IO;
+    int ret = io_check(ctx, reqs, count, write);
+    if (ret != LSFS_OK) {
+        return ret;
     }
 
-    ret = pread(ctx->fd, buf, size, offset);
-    if (ret != (ssize_t)size) {
-        LSFS_ERROR("Failed to read blocks: %s", strerror(errno));
-        return LSFS_ERR_IO;
+    uint64_t start = lsfs_stats_now();
+    io_account(ctx, reqs, count, write);
+    ret = io_submit_bounce(ctx, reqs, count, write);
+    if (!write) {
+        lsfs_stats_time(ctx, LSFS_LAT_READ_IO, start);
     }
 
-    return LSFS_OK;
+    return ret;
+}
+
+/*
+ * Read a single block
+ */
+int lsfs_read_block(struct lsfs_context *ctx, uint64_t block_num, void *buf)
+{
+    return lsfs_read_blocks(ctx, block_num, 1, buf);
+}
+
+/*
+ * Write a single block
+ */
+int lsfs_write_block(struct lsfs_context *ctx, uint64_t block_num, const void *buf)
+{
+    return lsfs_write_blocks(ctx, block_num, 1, buf);
+}
+
+/*
+ * Read multiple contiguous blocks
+ */
+int lsfs_read_blocks(struct lsfs_context *ctx, uint64_t start_block,
+                     uint32_t count, void *buf)
+{
+    struct lsfs_io_req req = { .block = start_block, .count = count, .buf = buf };
+
+    return io_submit(ctx, &req, 1, false);
 }
 
 /*
@@ -150,27 +312,47 @@ int lsfs_read_blocks(struct lsfs_context *ctx, uint64_t start_block,
 int lsfs_write_blocks(struct lsfs_context *ctx, uint64_t start_block,
                       uint32_t count, const void *buf)
 {
-    off_t offset = (off_t)start_block * LSFS_BLOCK_SIZE;
-    size_t size = (size_t)count * LSFS_BLOCK_SIZE;
-    ssize_t ret;
+    struct lsfs_io_req req = { .block = start_block, .count = count, .buf = (void *)buf };
 
-    if (ctx->readonly) {
-        LSFS_ERROR("Filesystem is read-only");
-        return LSFS_ERR_IO;
+    return io_submit(ctx, &req, 1, true);
+}
+
+/*
+ * Write multiple contiguous blocks and make them durable
+ * The io_uring backend links the write and the flush in one submission.
+ */
+int lsfs_write_blocks_sync(struct lsfs_context *ctx, uint64_t start_block,
+                           uint32_t count, const void *buf)
+{
+    struct lsfs_io_req req = { .block = start_block, .count = count, .buf = (void *)buf };
+    int ret = io_check(ctx, &req, 1, true);
+
+    if (ret != LSFS_OK) {
+        return ret;
     }
 
-    if (offset + (off_t)size > (off_t)ctx->disk_size) {
-        LSFS_ERROR("Write beyond end of disk");
-        return LSFS_ERR_IO;
+    if (ctx->direct_io && (uintptr_t)buf % LSFS_IO_ALIGN != 0) {
+        ret = io_submit(ctx, &req, 1, true);
+        return (ret == LSFS_OK) ? lsfs_sync(ctx) : ret;
     }
 
-    ret = pwrite(ctx->fd, buf, size, offset);
-    if (ret != (ssize_t)size) {
-        LSFS_ERROR("Failed to write blocks: %s", strerror(errno));
-        return LSFS_ERR_IO;
+    io_account(ctx, &req, 1, true);
+    return ctx->io->write_sync(ctx, start_block, count, buf);
+}
+
+/*
+ * Read a batch of block runs
+ * All requests are submitted together, so the io_uring backend keeps
+ * them in flight at once.  Returns LSFS_OK only if every request succeeded;
+ * per-request status is left in result.
+ */
+int lsfs_read_batch(struct lsfs_context *ctx, struct lsfs_io_req *reqs, uint32_t count)
+{
+    if (count == 0) {
+        return LSFS_OK;
     }
 
-    return LSFS_OK;
+    return io_submit(ctx, reqs, count, false);
 }
 
 /*
@@ -186,218 +368,783 @@ int lsfs_sync(struct lsfs_context *ctx)
 }
 
 /*
- * Buffer Pool Implementation
+ * Tell the storage under the image that a range of blocks holds no data
+ * Image files have the range punched out, keeping their size, and block
+ * devices get a discard.  The range reads back as zeros afterwards.
+ * Returns LSFS_ERR_INVAL if the host file system or device cannot do
+ * either.
+ */
+int lsfs_io_discard(struct lsfs_context *ctx, uint64_t start_block, uint64_t count)
+{
+    uint64_t range[2] = { start_block * LSFS_BLOCK_SIZE, count * LSFS_BLOCK_SIZE };
+    int ret;
+
+    if (ctx->readonly) {
+        return LSFS_ERR_IO;
+    }
+    if (count == 0 || range[0] + range[1] > ctx->disk_size) {
+        return LSFS_ERR_INVAL;
+    }
+
+    if (ctx->block_device) {
+        ret = ioctl(ctx->fd, BLKDISCARD, range);
+    } else {
+        ret = fallocate(ctx->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                        (off_t)range[0], (off_t)range[1]);
+    }
+    if (ret < 0) {
+        if (errno == EOPNOTSUPP || errno == ENOTTY || errno == ENOSYS) {
+            return LSFS_ERR_INVAL;
+        }
+        LSFS_ERROR("Failed to discard blocks %" PRIu64 "-%" PRIu64 ": %s",
+                   start_block, start_block + count - 1, strerror(errno));
+        return LSFS_ERR_IO;
+    }
+
+    lsfs_stats_add(ctx, LSFS_CTR_DISCARD, range[1]);
+    return LSFS_OK;
+}
+
+/*
+ * Buffer Cache Implementation
  */
 
-static inline uint32_t buffer_hash(uint64_t block_num)
+static inline uint64_t buffer_hash(uint64_t block_num)
+{
+    return block_num * 0x9E3779B97F4A7C15ULL;
+}
+
+static inline struct lsfs_buffer_shard *buffer_shard(struct lsfs_buffer_pool *pool,
+                                                     uint64_t block_num)
 {
-    return (uint32_t)(block_num % LSFS_BUFFER_HASH_SIZE);
+    return &pool->shards[(buffer_hash(block_num) >> 60) % LSFS_BUFFER_SHARDS];
+}
+
+static inline uint32_t buffer_bucket(struct lsfs_buffer_shard *shard, uint64_t block_num)
+{
+    return (uint32_t)(buffer_hash(block_num) >> 20) & shard->hash_mask;
 }
 
 /*
- * Initialize buffer pool
+ * Append buffer to the newest end of a queue
  */
-int lsfs_buffer_pool_init(struct lsfs_buffer_pool *pool)
+static void buffer_list_push(struct lsfs_buffer_list *list, struct lsfs_buffer *buf)
 {
-    memset(pool, 0, sizeof(*pool));
+    buf->lru_prev = list->tail;
+    buf->lru_next = NULL;
+    if (list->tail) {
+        list->tail->lru_next = buf;
+    } else {
+        list->head = buf;
+    }
+    list->tail = buf;
+    list->count++;
+}
 
-    if (pthread_mutex_init(&pool->lock, NULL) != 0) {
-        return LSFS_ERR_NOMEM;
+/*
+ * Remove buffer from a queue
+ */
+static void buffer_list_remove(struct lsfs_buffer_list *list, struct lsfs_buffer *buf)
+{
+    if (buf->lru_prev) {
+        buf->lru_prev->lru_next = buf->lru_next;
+    } else {
+        list->head = buf->lru_next;
+    }
+
+    if (buf->lru_next) {
+        buf->lru_next->lru_prev = buf->lru_prev;
+    } else {
+        list->tail = buf->lru_prev;
+    }
+
+    buf->lru_prev = NULL;
+    buf->lru_next = NULL;
+    list->count--;
+}
+
+static struct lsfs_buffer_list *buffer_queue(struct lsfs_buffer_shard *shard,
+                                             struct lsfs_buffer *buf)
+{
+    switch (buf->queue) {
+    case LSFS_BUF_A1IN:  return &shard->a1in;
+    case LSFS_BUF_AM:    return &shard->am;
+    case LSFS_BUF_A1OUT: return &shard->a1out;
+    default:             return NULL;
+    }
+}
+
+/*
+ * Find a block in a shard (data or ghost entry)
+ */
+static struct lsfs_buffer *buffer_lookup(struct lsfs_buffer_shard *shard,
+                                         uint64_t block_num)
+{
+    struct lsfs_buffer *buf = shard->hash[buffer_bucket(shard, block_num)];
+
+    while (buf && buf->block_num != block_num) {
+        buf = buf->hash_next;
+    }
+    return buf;
+}
+
+/*
+ * Unlink an entry from its hash chain and queue and put it on a free list
+ */
+static void buffer_release(struct lsfs_buffer_shard *shard, struct lsfs_buffer *buf)
+{
+    struct lsfs_buffer **pp = &shard->hash[buffer_bucket(shard, buf->block_num)];
+
+    while (*pp) {
+        if (*pp == buf) {
+            *pp = buf->hash_next;
+            break;
+        }
+        pp = &(*pp)->hash_next;
+    }
+
+    buffer_list_remove(buffer_queue(shard, buf), buf);
+    buf->queue = LSFS_BUF_FREE;
+
+    if (buf->data) {
+        buf->hash_next = shard->free_data;
+        shard->free_data = buf;
+    } else {
+        buf->hash_next = shard->free_ghost;
+        shard->free_ghost = buf;
+    }
+}
+
+/*
+ * Insert an entry into the hash and onto a queue
+ */
+static void buffer_insert(struct lsfs_buffer_shard *shard, struct lsfs_buffer *buf,
+                          uint64_t block_num, uint8_t queue)
+{
+    uint32_t bucket = buffer_bucket(shard, block_num);
+
+    buf->block_num = block_num;
+    buf->queue = queue;
+    buf->prefetched = false;
+    buf->hash_next = shard->hash[bucket];
+    shard->hash[bucket] = buf;
+    buffer_list_push(buffer_queue(shard, buf), buf);
+}
+
+/*
+ * Get a data entry for a new block, evicting if needed (2Q reclaim)
+ */
+static struct lsfs_buffer *buffer_reclaim(struct lsfs_buffer_shard *shard)
+{
+    struct lsfs_buffer *victim;
+
+    if (shard->free_data) {
+        victim = shard->free_data;
+        shard->free_data = victim->hash_next;
+        return victim;
     }
 
-    /* Initialize LRU list */
-    for (int i = 0; i < LSFS_BUFFER_POOL_SIZE; i++) {
-        pool->buffers[i].valid = false;
-        pool->buffers[i].dirty = false;
-        pool->buffers[i].refcount = 0;
+    if (shard->a1in.count > shard->kin || !shard->am.head) {
+        /* Demote the oldest A1in block to a ghost */
+        victim = shard->a1in.head;
+        uint64_t block_num = victim->block_num;
+        buffer_release(shard, victim);
 
-        /* Add to LRU list */
-        if (i == 0) {
-            pool->lru_head = &pool->buffers[i];
-            pool->buffers[i].lru_prev = NULL;
+        struct lsfs_buffer *ghost = shard->free_ghost;
+        if (ghost) {
+            shard->free_ghost = ghost->hash_next;
         } else {
-            pool->buffers[i].lru_prev = &pool->buffers[i - 1];
-            pool->buffers[i - 1].lru_next = &pool->buffers[i];
+            ghost = shard->a1out.head;
+            buffer_release(shard, ghost);
+            shard->free_ghost = ghost->hash_next;
+        }
+        buffer_insert(shard, ghost, block_num, LSFS_BUF_A1OUT);
+    } else {
+        victim = shard->am.head;
+        buffer_release(shard, victim);
+    }
+
+    /* buffer_release() put the victim on the free list */
+    shard->free_data = victim->hash_next;
+    shard->evictions++;
+
+    return victim;
+}
+
+/*
+ * Initialize buffer cache with room for size bytes of blocks
+ */
+int lsfs_buffer_pool_init(struct lsfs_buffer_pool *pool, uint64_t size)
+{
+    uint64_t blocks = size / LSFS_BLOCK_SIZE;
+    uint32_t per_shard = (uint32_t)LSFS_DIV_ROUND_UP(blocks, LSFS_BUFFER_SHARDS);
+
+    memset(pool, 0, sizeof(*pool));
+
+    for (int i = 0; i < LSFS_BUFFER_SHARDS; i++) {
+        struct lsfs_buffer_shard *shard = &pool->shards[i];
+
+        if (pthread_mutex_init(&shard->lock, NULL) != 0) {
+            lsfs_buffer_pool_destroy(pool);
+            return LSFS_ERR_NOMEM;
+        }
+
+        if (per_shard == 0) {
+            continue;  /* Cache disabled */
+        }
+
+        shard->capacity = per_shard;
+        shard->kin = LSFS_MAX(per_shard / 4, 1);
+        shard->kout = LSFS_MAX(per_shard / 2, 1);
+
+        uint32_t buckets = 1;
+        while (buckets < shard->capacity + shard->kout) {
+            buckets <<= 1;
         }
+        shard->hash_mask = buckets - 1;
 
-        if (i == LSFS_BUFFER_POOL_SIZE - 1) {
-            pool->lru_tail = &pool->buffers[i];
-            pool->buffers[i].lru_next = NULL;
+        shard->hash = calloc(buckets, sizeof(*shard->hash));
+        shard->entries = calloc(shard->capacity + shard->kout, sizeof(*shard->entries));
+        if (!shard->hash || !shard->entries ||
+            posix_memalign((void **)&shard->data, LSFS_BLOCK_SIZE,
+                           (size_t)shard->capacity * LSFS_BLOCK_SIZE) != 0) {
+            shard->data = NULL;
+            lsfs_buffer_pool_destroy(pool);
+            return LSFS_ERR_NOMEM;
         }
+
+        /* Build free lists */
+        for (uint32_t j = 0; j < shard->capacity + shard->kout; j++) {
+            struct lsfs_buffer *buf = &shard->entries[j];
+            if (j < shard->capacity) {
+                buf->data = shard->data + (size_t)j * LSFS_BLOCK_SIZE;
+                buf->hash_next = shard->free_data;
+                shard->free_data = buf;
+            } else {
+                buf->hash_next = shard->free_ghost;
+                shard->free_ghost = buf;
+            }
+        }
+
+        pool->capacity += shard->capacity;
     }
 
+    LSFS_INFO("Buffer cache: %" PRIu64 " blocks in %d shards",
+              pool->capacity, LSFS_BUFFER_SHARDS);
+
     return LSFS_OK;
 }
 
 /*
- * Destroy buffer pool
+ * Destroy buffer cache
  */
 void lsfs_buffer_pool_destroy(struct lsfs_buffer_pool *pool)
 {
-    pthread_mutex_destroy(&pool->lock);
+    for (int i = 0; i < LSFS_BUFFER_SHARDS; i++) {
+        struct lsfs_buffer_shard *shard = &pool->shards[i];
+
+        free(shard->hash);
+        free(shard->entries);
+        free(shard->data);
+        shard->hash = NULL;
+        shard->entries = NULL;
+        shard->data = NULL;
+        pthread_mutex_destroy(&shard->lock);
+    }
+    pool->capacity = 0;
+}
+
+/*
+ * Read a block from disk, checking it against its summary if every read
+ * is verified
+ */
+static int buffer_read_disk(struct lsfs_context *ctx, uint64_t block_num, void *buf)
+{
+    int ret = lsfs_read_block(ctx, block_num, buf);
+
+    if (ret == LSFS_OK && ctx->verify_mode == LSFS_VERIFY_BLOCK) {
+        ret = lsfs_segment_verify_blocks(ctx, block_num, 1, buf);
+    }
+    return ret;
+}
+
+/*
+ * Read a block through the buffer cache
+ * Blocks are verified as they come from disk, so cached copies are not
+ * checked again.
+ */
+int lsfs_buffer_read(struct lsfs_context *ctx, uint64_t block_num, void *buf)
+{
+    struct lsfs_buffer_shard *shard = buffer_shard(&ctx->bufpool, block_num);
+    struct lsfs_buffer *entry;
+    uint64_t seq;
+    int ret;
+
+    if (shard->capacity == 0) {
+        return buffer_read_disk(ctx, block_num, buf);
+    }
+
+    pthread_mutex_lock(&shard->lock);
+
+    entry = buffer_lookup(shard, block_num);
+    if (entry && entry->data) {
+        memcpy(buf, entry->data, LSFS_BLOCK_SIZE);
+        if (entry->queue == LSFS_BUF_AM) {
+            buffer_list_remove(&shard->am, entry);
+            buffer_list_push(&shard->am, entry);
+        }
+        if (entry->prefetched) {
+            entry->prefetched = false;
+            shard->prefetch_hits++;
+        }
+        shard->hits++;
+        pthread_mutex_unlock(&shard->lock);
+        return LSFS_OK;
+    }
+
+    shard->misses++;
+    seq = shard->seq;
+    pthread_mutex_unlock(&shard->lock);
+
+    /* Read outside the shard lock */
+    ret = buffer_read_disk(ctx, block_num, buf);
+    if (ret != LSFS_OK) {
+        return ret;
+    }
+
+    pthread_mutex_lock(&shard->lock);
+
+    /* Skip caching if the block may have been rewritten meanwhile */
+    if (shard->seq == seq) {
+        entry = buffer_lookup(shard, block_num);
+        if (!entry || !entry->data) {
+            uint8_t queue = LSFS_BUF_A1IN;
+
+            if (entry) {
+                /* Ghost hit: referenced again soon after leaving A1in */
+                buffer_release(shard, entry);
+                queue = LSFS_BUF_AM;
+            }
+
+            entry = buffer_reclaim(shard);
+            memcpy(entry->data, buf, LSFS_BLOCK_SIZE);
+            buffer_insert(shard, entry, block_num, queue);
+        }
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+
+    return LSFS_OK;
 }
 
 /*
- * Move buffer to end of LRU list (most recently used)
+ * Drop a block from the buffer cache
  */
-static void buffer_touch(struct lsfs_buffer_pool *pool, struct lsfs_buffer *buf)
+void lsfs_buffer_invalidate(struct lsfs_context *ctx, uint64_t block_num)
 {
-    /* Already at tail */
-    if (buf == pool->lru_tail) {
+    struct lsfs_buffer_shard *shard = buffer_shard(&ctx->bufpool, block_num);
+    struct lsfs_buffer *entry;
+
+    if (shard->capacity == 0) {
         return;
     }
 
-    /* Remove from current position */
-    if (buf->lru_prev) {
-        buf->lru_prev->lru_next = buf->lru_next;
-    } else {
-        pool->lru_head = buf->lru_next;
+    pthread_mutex_lock(&shard->lock);
+
+    shard->seq++;
+    entry = buffer_lookup(shard, block_num);
+    if (entry) {
+        buffer_release(shard, entry);
+        shard->invalidations++;
     }
 
-    if (buf->lru_next) {
-        buf->lru_next->lru_prev = buf->lru_prev;
+    pthread_mutex_unlock(&shard->lock);
+}
+
+/*
+ * Drop a range of blocks from the buffer cache
+ */
+void lsfs_buffer_invalidate_range(struct lsfs_context *ctx, uint64_t start_block,
+                                  uint32_t count)
+{
+    for (uint32_t i = 0; i < count; i++) {
+        lsfs_buffer_invalidate(ctx, start_block + i);
     }
+}
 
-    /* Add to tail */
-    buf->lru_prev = pool->lru_tail;
-    buf->lru_next = NULL;
-    if (pool->lru_tail) {
-        pool->lru_tail->lru_next = buf;
+/*
+ * Collect buffer cache statistics
+ */
+void lsfs_buffer_stats(struct lsfs_buffer_pool *pool, struct lsfs_buffer_stats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    stats->capacity = pool->capacity;
+
+    for (int i = 0; i < LSFS_BUFFER_SHARDS; i++) {
+        struct lsfs_buffer_shard *shard = &pool->shards[i];
+
+        pthread_mutex_lock(&shard->lock);
+        stats->cached += shard->a1in.count + shard->am.count;
+        stats->hits += shard->hits;
+        stats->misses += shard->misses;
+        stats->evictions += shard->evictions;
+        stats->invalidations += shard->invalidations;
+        stats->prefetched += shard->prefetched;
+        stats->prefetch_hits += shard->prefetch_hits;
+        pthread_mutex_unlock(&shard->lock);
     }
-    pool->lru_tail = buf;
+}
 
-    if (!pool->lru_head) {
-        pool->lru_head = buf;
+/*
+ * Check whether a block's data is in the buffer cache
+ */
+bool lsfs_buffer_cached(struct lsfs_context *ctx, uint64_t block_num)
+{
+    struct lsfs_buffer_shard *shard = buffer_shard(&ctx->bufpool, block_num);
+    struct lsfs_buffer *entry;
+    bool cached;
+
+    if (shard->capacity == 0) {
+        return false;
     }
+
+    pthread_mutex_lock(&shard->lock);
+    entry = buffer_lookup(shard, block_num);
+    cached = entry && entry->data;
+    pthread_mutex_unlock(&shard->lock);
+
+    return cached;
 }
 
 /*
- * Find a buffer to evict (LRU with refcount 0)
+ * Read a run of blocks into the buffer cache
+ * Blocks already cached are not read again; the rest are read as one
+ * transfer spanning the first to the last missing block.  They join
+ * A1in like any block seen once, so readahead cannot push out blocks
+ * that are in use.  As in lsfs_buffer_read(), a block whose shard was
+ * invalidated while it was being read is not cached.
  */
-static struct lsfs_buffer *buffer_evict(struct lsfs_context *ctx,
-                                        struct lsfs_buffer_pool *pool)
+int lsfs_buffer_prefetch(struct lsfs_context *ctx, uint64_t start_block, uint32_t count)
 {
-    struct lsfs_buffer *buf = pool->lru_head;
+    uint64_t seqs[LSFS_PREFETCH_MAX_BLOCKS];
+    bool missing[LSFS_PREFETCH_MAX_BLOCKS];
+    uint32_t first = count, last = 0;
+    uint8_t *data;
+    int ret;
 
-    while (buf) {
-        if (buf->refcount == 0) {
-            /* If dirty, write back first */
-            if (buf->dirty && buf->valid) {
-                if (lsfs_write_block(ctx, buf->block_num, buf->data) == LSFS_OK) {
-                    buf->dirty = false;
-                }
-            }
+    if (ctx->bufpool.capacity == 0 || count == 0) {
+        return LSFS_OK;
+    }
+    count = LSFS_MIN(count, LSFS_PREFETCH_MAX_BLOCKS);
+
+    for (uint32_t i = 0; i < count; i++) {
+        struct lsfs_buffer_shard *shard = buffer_shard(&ctx->bufpool, start_block + i);
+        struct lsfs_buffer *entry;
+
+        pthread_mutex_lock(&shard->lock);
+        entry = buffer_lookup(shard, start_block + i);
+        missing[i] = !entry || !entry->data;
+        seqs[i] = shard->seq;
+        pthread_mutex_unlock(&shard->lock);
+
+        if (missing[i]) {
+            first = LSFS_MIN(first, i);
+            last = i;
+        }
+    }
+    if (first == count) {
+        return LSFS_OK;
+    }
 
-            /* Remove from hash chain */
-            if (buf->valid) {
-                uint32_t hash = buffer_hash(buf->block_num);
-                struct lsfs_buffer **pp = &pool->hash[hash];
-                while (*pp) {
-                    if (*pp == buf) {
-                        *pp = buf->hash_next;
-                        break;
-                    }
-                    pp = &(*pp)->hash_next;
-                }
+    uint32_t n = last - first + 1;
+    data = lsfs_io_alloc((size_t)n * LSFS_BLOCK_SIZE);
+    if (!data) {
+        return LSFS_ERR_NOMEM;
+    }
+
+    ret = lsfs_read_blocks(ctx, start_block + first, n, data);
+    if (ret == LSFS_OK && ctx->verify_mode == LSFS_VERIFY_BLOCK) {
+        ret = lsfs_segment_verify_blocks(ctx, start_block + first, n, data);
+    }
+    if (ret != LSFS_OK) {
+        free(data);
+        return ret;
+    }
+
+    for (uint32_t i = first; i <= last; i++) {
+        struct lsfs_buffer_shard *shard = buffer_shard(&ctx->bufpool, start_block + i);
+        struct lsfs_buffer *entry;
+
+        if (!missing[i]) {
+            continue;
+        }
+
+        pthread_mutex_lock(&shard->lock);
+        entry = buffer_lookup(shard, start_block + i);
+        if (shard->seq == seqs[i] && (!entry || !entry->data)) {
+            if (entry) {
+                buffer_release(shard, entry);
             }
+            entry = buffer_reclaim(shard);
+            memcpy(entry->data, data + (size_t)(i - first) * LSFS_BLOCK_SIZE, LSFS_BLOCK_SIZE);
+            buffer_insert(shard, entry, start_block + i, LSFS_BUF_A1IN);
+            entry->prefetched = true;
+            shard->prefetched++;
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+
+    free(data);
+    return LSFS_OK;
+}
+
+/*
+ * Asynchronous Reads
+ */
+
+/*
+ * Carry out one job
+ */
+static void prefetch_run(struct lsfs_context *ctx, struct lsfs_read_job *job)
+{
+    if (job->readahead) {
+        lsfs_buffer_prefetch(ctx, job->reqs[0].block, job->reqs[0].count);
+    } else {
+        job->result = lsfs_read_batch(ctx, job->reqs, job->count);
+    }
+}
+
+/*
+ * Read thread function
+ */
+static void *prefetch_thread_func(void *arg)
+{
+    struct lsfs_context *ctx = (struct lsfs_context *)arg;
+    struct lsfs_prefetch *pf = &ctx->prefetch;
+
+    pthread_mutex_lock(&pf->lock);
+
+    while (pf->running) {
+        struct lsfs_read_job *job = pf->head;
+
+        if (!job) {
+            pthread_cond_wait(&pf->wake, &pf->lock);
+            continue;
+        }
 
-            buf->valid = false;
-            buf->dirty = false;
-            buf->hash_next = NULL;
-            return buf;
+        pf->head = job->next;
+        if (!pf->head) {
+            pf->tail = NULL;
+        }
+        if (job->readahead) {
+            pf->queued_readahead--;
+        }
+        pthread_mutex_unlock(&pf->lock);
+
+        prefetch_run(ctx, job);
+
+        pthread_mutex_lock(&pf->lock);
+        if (job->readahead) {
+            free(job);
+        } else {
+            job->done = true;
+            pthread_cond_broadcast(&pf->done);
         }
-        buf = buf->lru_next;
     }
 
+    pthread_mutex_unlock(&pf->lock);
     return NULL;
 }
 
 /*
- * Get a buffer for a block
+ * Initialize the read queue
+ * Until lsfs_prefetch_start() is called readahead is dropped and other
+ * reads are carried out by the caller.
+ */
+int lsfs_prefetch_init(struct lsfs_context *ctx)
+{
+    struct lsfs_prefetch *pf = &ctx->prefetch;
+
+    memset(pf, 0, sizeof(*pf));
+    if (pthread_mutex_init(&pf->lock, NULL) != 0) {
+        return LSFS_ERR_NOMEM;
+    }
+    if (pthread_cond_init(&pf->wake, NULL) != 0) {
+        pthread_mutex_destroy(&pf->lock);
+        return LSFS_ERR_NOMEM;
+    }
+    if (pthread_cond_init(&pf->done, NULL) != 0) {
+        pthread_cond_destroy(&pf->wake);
+        pthread_mutex_destroy(&pf->lock);
+        return LSFS_ERR_NOMEM;
+    }
+    return LSFS_OK;
+}
+
+/*
+ * Start the read threads
  */
-struct lsfs_buffer *lsfs_buffer_get(struct lsfs_context *ctx, uint64_t block_num)
+int lsfs_prefetch_start(struct lsfs_context *ctx)
 {
-    struct lsfs_buffer_pool *pool = &ctx->bufpool;
-    struct lsfs_buffer *buf;
-    uint32_t hash;
+    struct lsfs_prefetch *pf = &ctx->prefetch;
 
-    pthread_mutex_lock(&pool->lock);
+    pthread_mutex_lock(&pf->lock);
+    pf->running = true;
+    pthread_mutex_unlock(&pf->lock);
 
-    /* Check if already in cache */
-    hash = buffer_hash(block_num);
-    buf = pool->hash[hash];
-    while (buf) {
-        if (buf->valid && buf->block_num == block_num) {
-            buf->refcount++;
-            buffer_touch(pool, buf);
-            pthread_mutex_unlock(&pool->lock);
-            return buf;
+    for (uint32_t i = 0; i < LSFS_PREFETCH_THREADS; i++) {
+        if (pthread_create(&pf->threads[i], NULL, prefetch_thread_func, ctx) != 0) {
+            LSFS_ERROR("Failed to create read thread");
+            if (i == 0) {
+                pthread_mutex_lock(&pf->lock);
+                pf->running = false;
+                pthread_mutex_unlock(&pf->lock);
+                return LSFS_ERR_NOMEM;
+            }
+            break;
         }
-        buf = buf->hash_next;
+        pf->thread_count++;
     }
 
-    /* Not in cache, find a buffer to use */
-    buf = buffer_evict(ctx, pool);
-    if (!buf) {
-        LSFS_ERROR("No free buffers available");
-        pthread_mutex_unlock(&pool->lock);
-        return NULL;
-    }
+    return LSFS_OK;
+}
 
-    /* Read block from disk */
-    if (lsfs_read_block(ctx, block_num, buf->data) != LSFS_OK) {
-        pthread_mutex_unlock(&pool->lock);
-        return NULL;
+/*
+ * Stop the read threads
+ * Jobs still queued are readahead, which is dropped, or reads somebody
+ * waits for, which are carried out here.  The threads can be started
+ * again.
+ */
+void lsfs_prefetch_stop(struct lsfs_context *ctx)
+{
+    struct lsfs_prefetch *pf = &ctx->prefetch;
+
+    pthread_mutex_lock(&pf->lock);
+    pf->running = false;
+    pthread_cond_broadcast(&pf->wake);
+    pthread_mutex_unlock(&pf->lock);
+
+    for (uint32_t i = 0; i < pf->thread_count; i++) {
+        pthread_join(pf->threads[i], NULL);
     }
+    pf->thread_count = 0;
 
-    /* Set up buffer */
-    buf->block_num = block_num;
-    buf->valid = true;
-    buf->dirty = false;
-    buf->refcount = 1;
+    while (pf->head) {
+        struct lsfs_read_job *job = pf->head;
 
-    /* Add to hash chain */
-    buf->hash_next = pool->hash[hash];
-    pool->hash[hash] = buf;
+        pf->head = job->next;
+        if (job->readahead) {
+            free(job);
+        } else {
+            prefetch_run(ctx, job);
+            job->done = true;
+        }
+    }
+    pf->tail = NULL;
+    pf->queued_readahead = 0;
+}
 
-    buffer_touch(pool, buf);
-    pthread_mutex_unlock(&pool->lock);
+/*
+ * Stop the read threads and release the queue
+ */
+void lsfs_prefetch_destroy(struct lsfs_context *ctx)
+{
+    struct lsfs_prefetch *pf = &ctx->prefetch;
 
-    return buf;
+    lsfs_prefetch_stop(ctx);
+    pthread_cond_destroy(&pf->done);
+    pthread_cond_destroy(&pf->wake);
+    pthread_mutex_destroy(&pf->lock);
 }
 
 /*
- * Release a buffer
+ * Append a job to the queue
+ * Caller must hold prefetch.lock.
  */
-void lsfs_buffer_put(struct lsfs_buffer *buf)
+static void prefetch_queue_locked(struct lsfs_prefetch *pf, struct lsfs_read_job *job)
 {
-    if (buf && buf->refcount > 0) {
-        buf->refcount--;
+    job->next = NULL;
+    if (pf->tail) {
+        pf->tail->next = job;
+    } else {
+        pf->head = job;
     }
+    pf->tail = job;
+    pthread_cond_signal(&pf->wake);
 }
 
 /*
- * Flush all dirty buffers
+ * Queue a run of blocks to be read into the buffer cache
  */
-int lsfs_buffer_flush(struct lsfs_context *ctx)
+void lsfs_readahead(struct lsfs_context *ctx, uint64_t start_block, uint32_t count)
 {
-    struct lsfs_buffer_pool *pool = &ctx->bufpool;
-    int ret = LSFS_OK;
+    struct lsfs_prefetch *pf = &ctx->prefetch;
+    struct lsfs_read_job *job;
 
-    pthread_mutex_lock(&pool->lock);
+    if (ctx->bufpool.capacity == 0 || count == 0) {
+        return;
+    }
 
-    for (int i = 0; i < LSFS_BUFFER_POOL_SIZE; i++) {
-        struct lsfs_buffer *buf = &pool->buffers[i];
-        if (buf->valid && buf->dirty) {
-            if (lsfs_write_block(ctx, buf->block_num, buf->data) == LSFS_OK) {
-                buf->dirty = false;
-            } else {
-                ret = LSFS_ERR_IO;
-            }
-        }
+    job = calloc(1, sizeof(*job) + sizeof(struct lsfs_io_req));
+    if (!job) {
+        return;
+    }
+    job->reqs = (struct lsfs_io_req *)(job + 1);
+    job->reqs[0].block = start_block;
+    job->reqs[0].count = LSFS_MIN(count, LSFS_PREFETCH_MAX_BLOCKS);
+    job->count = 1;
+    job->readahead = true;
+
+    pthread_mutex_lock(&pf->lock);
+    if (!pf->running || pf->queued_readahead >= LSFS_PREFETCH_QUEUE) {
+        pf->dropped++;
+        pthread_mutex_unlock(&pf->lock);
+        free(job);
+        return;
     }
+    pf->queued_readahead++;
+    prefetch_queue_locked(pf, job);
+    pthread_mutex_unlock(&pf->lock);
+}
 
-    pthread_mutex_unlock(&pool->lock);
+/*
+ * Start reading a batch of block runs
+ * The reads are carried out right away if no read thread is running.
+ * lsfs_read_wait() must be called before the buffers are used.
+ */
+void lsfs_read_async(struct lsfs_context *ctx, struct lsfs_read_job *job)
+{
+    struct lsfs_prefetch *pf = &ctx->prefetch;
 
-    return ret;
+    job->done = false;
+    job->readahead = false;
+    job->result = LSFS_OK;
+
+    pthread_mutex_lock(&pf->lock);
+    if (pf->running) {
+        prefetch_queue_locked(pf, job);
+        pthread_mutex_unlock(&pf->lock);
+        return;
+    }
+    pthread_mutex_unlock(&pf->lock);
+
+    job->result = lsfs_read_batch(ctx, job->reqs, job->count);
+    job->done = true;
+}
+
+/*
+ * Wait for a batch started with lsfs_read_async()
+ * Returns LSFS_OK only if every request succeeded.
+ */
+int lsfs_read_wait(struct lsfs_context *ctx, struct lsfs_read_job *job)
+{
+    struct lsfs_prefetch *pf = &ctx->prefetch;
+
+    pthread_mutex_lock(&pf->lock);
+    while (!job->done) {
+        pthread_cond_wait(&pf->done, &pf->lock);
+    }
+    pthread_mutex_unlock(&pf->lock);
+
+    return job->result;
 }
@@ -0,0 +1,406 @@
+/*
+ * LSFS - Log-Structured Filesystem
+ * io_uring Block I/O Backend
+ *
+ * Talks to the kernel interface directly, so there is no library
+ * dependency.  A small set of rings is shared by all threads; a caller
+ * takes one ring for the duration of its batch, queues every request of
+ * the batch and waits for all of them, which keeps the device queue full
+ * for large reads and GC passes.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "lsfs.h"
+
+#define URING_RINGS     4       /* Rings shared by concurrent callers */
+#define URING_ENTRIES   64      /* Submission queue entries per ring */
+
+struct uring {
+    int fd;
+    pthread_mutex_t lock;
+
+    /* Shared ring memory */
+    void *sq_ptr;
+    size_t sq_size;
+    void *cq_ptr;
+    size_t cq_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+
+    /* Submission queue */
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+
+    /* Completion queue */
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+};
+
+struct uring_pool {
+    struct uring rings[URING_RINGS];
+    uint32_t next;              /* Round-robin start for ring selection */
+};
+
+static int uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                        IORING_ENTER_GETEVENTS, NULL, 0);
+}
+
+/*
+ * Check that the kernel supports every opcode the backend needs
+ */
+static bool uring_probe(int fd)
+{
+    size_t size = sizeof(struct io_uring_probe) +
+                  IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, size);
+    bool ok;
+
+    if (!probe) {
+        return false;
+    }
+
+    ok = syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE,
+                 probe, IORING_OP_LAST) == 0 &&
+         probe->last_op >= IORING_OP_WRITE &&
+         (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) &&
+         (probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED) &&
+         (probe->ops[IORING_OP_FSYNC].flags & IO_URING_OP_SUPPORTED);
+
+    free(probe);
+    return ok;
+}
+
+/*
+ * Unmap and close a ring
+ */
+static void uring_close(struct uring *ring)
+{
+    if (ring->sqes) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_ptr && ring->cq_ptr != ring->sq_ptr) {
+        munmap(ring->cq_ptr, ring->cq_size);
+    }
+    if (ring->sq_ptr) {
+        munmap(ring->sq_ptr, ring->sq_size);
+    }
+    if (ring->fd >= 0) {
+        close(ring->fd);
+    }
+    pthread_mutex_destroy(&ring->lock);
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+/*
+ * Create a ring and map its queues
+ */
+static int uring_open(struct uring *ring)
+{
+    struct io_uring_params p;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&p, 0, sizeof(p));
+
+    ring->fd = uring_setup(URING_ENTRIES, &p);
+    if (ring->fd < 0) {
+        LSFS_DEBUG("io_uring_setup failed: %s", strerror(errno));
+        return LSFS_ERR_IO;
+    }
+
+    if (pthread_mutex_init(&ring->lock, NULL) != 0) {
+        close(ring->fd);
+        ring->fd = -1;
+        return LSFS_ERR_NOMEM;
+    }
+
+    if (!uring_probe(ring->fd)) {
+        LSFS_DEBUG("io_uring lacks read, write or fsync support");
+        uring_close(ring);
+        return LSFS_ERR_IO;
+    }
+
+    ring->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->sq_size = LSFS_MAX(ring->sq_size, ring->cq_size);
+        ring->cq_size = ring->sq_size;
+    }
+
+    ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED) {
+        ring->sq_ptr = NULL;
+        uring_close(ring);
+        return LSFS_ERR_IO;
+    }
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ptr = ring->sq_ptr;
+    } else {
+        ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ptr == MAP_FAILED) {
+            ring->cq_ptr = NULL;
+            uring_close(ring);
+            return LSFS_ERR_IO;
+        }
+    }
+
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        uring_close(ring);
+        return LSFS_ERR_IO;
+    }
+
+    uint8_t *sq = ring->sq_ptr;
+    uint8_t *cq = ring->cq_ptr;
+    ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+    ring->sq_entries = p.sq_entries;
+    ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    return LSFS_OK;
+}
+
+/*
+ * Take a ring, preferring one that is idle
+ */
+static struct uring *uring_get(struct uring_pool *pool)
+{
+    uint32_t start = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED);
+
+    for (uint32_t i = 0; i < URING_RINGS; i++) {
+        struct uring *ring = &pool->rings[(start + i) % URING_RINGS];
+        if (pthread_mutex_trylock(&ring->lock) == 0) {
+            return ring;
+        }
+    }
+
+    struct uring *ring = &pool->rings[start % URING_RINGS];
+    pthread_mutex_lock(&ring->lock);
+    return ring;
+}
+
+/*
+ * Queue one sqe; the caller makes sure the queue has room
+ */
+static struct io_uring_sqe *uring_sqe(struct uring *ring, unsigned queued)
+{
+    unsigned tail = *ring->sq_tail + queued;
+    unsigned idx = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[idx];
+
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[idx] = idx;
+    return sqe;
+}
+
+/*
+ * Submit the queued sqes and collect one completion for each
+ * res[i] receives the result of the sqe with user_data i.
+ */
+static int uring_run(struct uring *ring, unsigned queued, int *res)
+{
+    unsigned submitted = 0;
+    unsigned completed = 0;
+
+    __atomic_store_n(ring->sq_tail, *ring->sq_tail + queued, __ATOMIC_RELEASE);
+
+    while (completed < queued) {
+        int ret = uring_enter(ring->fd, queued - submitted, 1);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            LSFS_ERROR("io_uring_enter failed: %s", strerror(errno));
+            return LSFS_ERR_IO;
+        }
+        submitted += (unsigned)ret;
+
+        unsigned head = *ring->cq_head;
+        unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            if (cqe->user_data < queued) {
+                res[cqe->user_data] = cqe->res;
+            }
+            head++;
+            completed++;
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    return LSFS_OK;
+}
+
+/*
+ * Initialize the backend
+ */
+static int uring_init(struct lsfs_context *ctx)
+{
+    struct uring_pool *pool = calloc(1, sizeof(*pool));
+    if (!pool) {
+        return LSFS_ERR_NOMEM;
+    }
+
+    for (uint32_t i = 0; i < URING_RINGS; i++) {
+        pool->rings[i].fd = -1;
+    }
+
+    for (uint32_t i = 0; i < URING_RINGS; i++) {
+        if (uring_open(&pool->rings[i]) != LSFS_OK) {
+            for (uint32_t j = 0; j < i; j++) {
+                uring_close(&pool->rings[j]);
+            }
+            free(pool);
+            return LSFS_ERR_IO;
+        }
+    }
+
+    ctx->io_private = pool;
+    return LSFS_OK;
+}
+
+/*
+ * Destroy the backend
+ */
+static void uring_destroy(struct lsfs_context *ctx)
+{
+    struct uring_pool *pool = ctx->io_private;
+
+    if (!pool) {
+        return;
+    }
+
+    for (uint32_t i = 0; i < URING_RINGS; i++) {
+        uring_close(&pool->rings[i]);
+    }
+    free(pool);
+    ctx->io_private = NULL;
+}
+
+/*
+ * Transfer a batch, keeping up to a ring's worth of requests in flight
+ */
+static int uring_submit(struct lsfs_context *ctx, struct lsfs_io_req *reqs,
+                        uint32_t count, bool write)
+{
+    struct uring *ring = uring_get(ctx->io_private);
+    int res[URING_ENTRIES];
+    int ret = LSFS_OK;
+
+    for (uint32_t base = 0; base < count; base += ring->sq_entries) {
+        unsigned n = (unsigned)LSFS_MIN(count - base, ring->sq_entries);
+
+        for (unsigned i = 0; i < n; i++) {
+            struct lsfs_io_req *req = &reqs[base + i];
+            struct io_uring_sqe *sqe = uring_sqe(ring, i);
+
+            sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+            sqe->fd = ctx->fd;
+            sqe->addr = (uint64_t)(uintptr_t)req->buf;
+            sqe->len = req->count * LSFS_BLOCK_SIZE;
+            sqe->off = req->block * LSFS_BLOCK_SIZE;
+            sqe->user_data = i;
+            res[i] = -EIO;
+        }
+
+        if (uring_run(ring, n, res) != LSFS_OK) {
+            pthread_mutex_unlock(&ring->lock);
+            return LSFS_ERR_IO;
+        }
+
+        for (unsigned i = 0; i < n; i++) {
+            struct lsfs_io_req *req = &reqs[base + i];
+            bool ok = res[i] == (int)(req->count * LSFS_BLOCK_SIZE);
+
+            req->result = ok ? LSFS_OK : LSFS_ERR_IO;
+            if (!ok) {
+                LSFS_ERROR("Failed to %s %u blocks at %" PRIu64 ": %s",
+                           write ? "write" : "read", req->count, req->block,
+                           res[i] < 0 ? strerror(-res[i]) : "short transfer");
+                ret = LSFS_ERR_IO;
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&ring->lock);
+    return ret;
+}
+
+/*
+ * Write blocks and flush them with a linked fdatasync
+ */
+static int uring_write_sync(struct lsfs_context *ctx, uint64_t start_block,
+                            uint32_t count, const void *buf)
+{
+    struct uring *ring = uring_get(ctx->io_private);
+    struct io_uring_sqe *sqe;
+    int res[2] = { -EIO, -EIO };
+
+    sqe = uring_sqe(ring, 0);
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->fd = ctx->fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = count * LSFS_BLOCK_SIZE;
+    sqe->off = start_block * LSFS_BLOCK_SIZE;
+    sqe->user_data = 0;
+
+    sqe = uring_sqe(ring, 1);
+    sqe->opcode = IORING_OP_FSYNC;
+    sqe->fd = ctx->fd;
+    sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+    sqe->user_data = 1;
+
+    int ret = uring_run(ring, 2, res);
+    pthread_mutex_unlock(&ring->lock);
+
+    if (ret != LSFS_OK) {
+        return ret;
+    }
+    if (res[0] != (int)(count * LSFS_BLOCK_SIZE) || res[1] < 0) {
+        LSFS_ERROR("Failed to write %u blocks at %" PRIu64 ": %s", count, start_block,
+                   res[0] < 0 ? strerror(-res[0]) :
+                   res[1] < 0 ? strerror(-res[1]) : "short transfer");
+        return LSFS_ERR_IO;
+    }
+
+    return LSFS_OK;
+}
+
+const struct lsfs_io_ops lsfs_io_uring_ops = {
+    .name = "io_uring",
+    .init = uring_init,
+    .destroy = uring_destroy,
+    .submit = uring_submit,
+    .write_sync = uring_write_sync,
+};
@@ -3,7 +3,9 @@
  * Main Entry Point
  */
 
+#ifndef FUSE_USE_VERSION
 #define FUSE_USE_VERSION 35
+#endif
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -14,6 +16,9 @@
 
 #include "lsfs.h"
 
+#define LSFS_DEFAULT_THREADS    1
+#define LSFS_MAX_THREADS        64
+
 static struct lsfs_context lsfs_ctx;
 static struct fuse_session *fuse_se = NULL;
 
@@ -29,149 +34,78 @@ static void signal_handler(int sig)
 }
 
 /*
- * Initialize the filesystem
+ * Run the FUSE session loop
+ * The segment writer, garbage collector and checkpoint threads are
+ * started here rather than in lsfs_init_fs() so that they are not lost
+ * when fuse_daemonize() forks.
  */
-static int lsfs_init_fs(struct lsfs_context *ctx)
+static int lsfs_run_session(struct lsfs_context *ctx, struct fuse_session *se)
 {
     int ret;
 
-    /* Initialize buffer pool */
-    ret = lsfs_buffer_pool_init(&ctx->bufpool);
-    if (ret != LSFS_OK) {
-        LSFS_ERROR("Failed to initialize buffer pool");
-        return ret;
-    }
-
-    /* Read superblock */
-    ret = lsfs_read_block(ctx, LSFS_SUPERBLOCK_BLOCK, &ctx->sb);
-    if (ret != LSFS_OK) {
-        LSFS_ERROR("Failed to read superblock");
-        return ret;
-    }
-
-    /* Validate superblock */
-    if (ctx->sb.magic != LSFS_MAGIC) {
-        LSFS_ERROR("Invalid filesystem magic: 0x%08x (expected 0x%08x)",
-                   ctx->sb.magic, LSFS_MAGIC);
-        return LSFS_ERR_CORRUPT;
-    }
-
-    if (ctx->sb.version != LSFS_VERSION) {
-        LSFS_ERROR("Unsupported filesystem version: %u", ctx->sb.version);
-        return LSFS_ERR_CORRUPT;
-    }
-
-    LSFS_INFO("LSFS version %u, %lu blocks, %lu segments",
-              ctx->sb.version,
-              (unsigned long)ctx->sb.total_blocks,
-              (unsigned long)ctx->sb.total_segments);
-
-    /* Initialize inode cache */
-    ret = lsfs_inode_cache_init(&ctx->icache);
+    ret = lsfs_segment_writer_start(ctx);
     if (ret != LSFS_OK) {
-        LSFS_ERROR("Failed to initialize inode cache");
-        return ret;
+        LSFS_ERROR("Failed to start segment writer");
+        return 1;
     }
 
-    /* Initialize inode map */
-    ret = lsfs_imap_init(&ctx->imap);
+    ret = lsfs_prefetch_start(ctx);
     if (ret != LSFS_OK) {
-        LSFS_ERROR("Failed to initialize inode map");
-        return ret;
+        LSFS_ERROR("Failed to start read threads");
+        return 1;
     }
 
-    /* Initialize segment management */
-    ret = lsfs_segment_init(ctx);
+    ret = lsfs_segment_discard_start(ctx);
     if (ret != LSFS_OK) {
-        LSFS_ERROR("Failed to initialize segment management");
-        return ret;
+        LSFS_ERROR("Failed to start discard thread");
+        return 1;
     }
 
-    /* Initialize checkpoint system */
-    ret = lsfs_checkpoint_init(ctx);
+    ret = lsfs_gc_init(ctx);
     if (ret != LSFS_OK) {
-        LSFS_ERROR("Failed to initialize checkpoint system");
-        return ret;
+        LSFS_ERROR("Failed to initialize garbage collector");
+        return 1;
     }
 
-    /* Recover from last checkpoint */
-    ret = lsfs_checkpoint_recover(ctx);
+    ret = lsfs_checkpoint_start(ctx);
     if (ret != LSFS_OK) {
-        LSFS_ERROR("Failed to recover filesystem");
-        return ret;
-    }
-
-    /* Initialize locks */
-    if (pthread_mutex_init(&ctx->write_lock, NULL) != 0) {
-        LSFS_ERROR("Failed to initialize write lock");
-        return LSFS_ERR_NOMEM;
+        LSFS_ERROR("Failed to start checkpoint thread");
+        return 1;
     }
 
-    if (pthread_rwlock_init(&ctx->fs_lock, NULL) != 0) {
-        LSFS_ERROR("Failed to initialize fs lock");
-        return LSFS_ERR_NOMEM;
+    if (ctx->worker_threads <= 1) {
+        return fuse_session_loop(se);
     }
 
-    /* Initialize garbage collector */
-    ret = lsfs_gc_init(ctx);
-    if (ret != LSFS_OK) {
-        LSFS_ERROR("Failed to initialize garbage collector");
-        return ret;
-    }
-
-    /* Update mount information */
-    ctx->sb.mounted_at = (uint64_t)time(NULL);
-    ctx->sb.mount_count++;
-    ctx->sb.state = 1;  /* Dirty */
-    lsfs_write_block(ctx, LSFS_SUPERBLOCK_BLOCK, &ctx->sb);
-
-    ctx->mounted = true;
-    g_lsfs = ctx;
-
-    LSFS_INFO("Filesystem mounted successfully");
-    return LSFS_OK;
-}
-
-/*
- * Cleanup the filesystem
- */
-static void lsfs_cleanup_fs(struct lsfs_context *ctx)
-{
-    if (!ctx->mounted) {
-        return;
+    /*
+     * libfuse starts workers on demand.  From 3.12 the pool is capped at
+     * the requested count; older versions only take the number of idle
+     * workers to keep, and start more under load up to their own limit.
+     */
+#if FUSE_USE_VERSION >= FUSE_MAKE_VERSION(3, 12)
+    struct fuse_loop_config *config = fuse_loop_cfg_create();
+    if (!config) {
+        LSFS_ERROR("Failed to allocate FUSE loop configuration");
+        return 1;
     }
+    fuse_loop_cfg_set_clone_fd(config, 0);
+    fuse_loop_cfg_set_max_threads(config, ctx->worker_threads);
+    fuse_loop_cfg_set_idle_threads(config, ctx->worker_threads);
+
+    LSFS_INFO("Using up to %u worker threads", ctx->worker_threads);
+    ret = fuse_session_loop_mt(se, config);
+    fuse_loop_cfg_destroy(config);
+    return ret;
+#else
+    struct fuse_loop_config config = {
+        .clone_fd = 0,
+        .max_idle_threads = ctx->worker_threads,
+    };
 
-    LSFS_INFO("Unmounting filesystem...");
-
-    /* Stop garbage collector */
-    lsfs_gc_destroy(ctx);
-
-    /* Flush pending writes */
-    lsfs_segment_flush(ctx);
-
-    /* Write final checkpoint */
-    lsfs_checkpoint_write(ctx);
-
-    /* Update superblock */
-    ctx->sb.state = 0;  /* Clean */
-    lsfs_write_block(ctx, LSFS_SUPERBLOCK_BLOCK, &ctx->sb);
-    lsfs_sync(ctx);
-
-    /* Cleanup */
-    lsfs_segment_destroy(ctx);
-    lsfs_imap_destroy(&ctx->imap);
-    lsfs_inode_cache_destroy(&ctx->icache);
-    lsfs_buffer_pool_destroy(&ctx->bufpool);
-
-    pthread_mutex_destroy(&ctx->write_lock);
-    pthread_rwlock_destroy(&ctx->fs_lock);
-
-    lsfs_io_destroy(ctx);
-
-    ctx->mounted = false;
-    g_lsfs = NULL;
-
-    LSFS_INFO("Filesystem unmounted");
+    LSFS_INFO("Keeping %u idle worker threads (libfuse before 3.12 cannot cap the pool)",
+              ctx->worker_threads);
+    return fuse_session_loop_mt(se, &config);
+#endif
 }
 
 /*
@@ -183,6 +117,40 @@ static void usage(const char *progname)
     fprintf(stderr, "Options:\n");
     fprintf(stderr, "  -f, --foreground    Run in foreground\n");
     fprintf(stderr, "  -d, --debug         Enable debug output\n");
+    fprintf(stderr, "  -t, --threads <n>   Worker threads for FUSE requests (default: %d)\n",
+            LSFS_DEFAULT_THREADS);
+    fprintf(stderr, "  -c, --cache-size <MB>  Buffer cache size, 0 disables (default: %d)\n",
+            LSFS_BUFFER_DEFAULT_MB);
+    fprintf(stderr, "  -r, --readahead <KB>  Largest readahead window for sequential reads,\n"
+                    "                      0 disables (default: %d)\n", LSFS_READAHEAD_DEFAULT_KB);
+    fprintf(stderr, "  -I, --inode-cache <n>  Inodes kept in memory (default: %d)\n",
+            LSFS_INODE_CACHE_DEFAULT);
+    fprintf(stderr, "  -C, --dcache-entries <n>  Dentry cache size, 0 disables (default: %d)\n",
+            LSFS_DCACHE_DEFAULT_ENTRIES);
+    fprintf(stderr, "  -e, --entry-timeout <s>   Kernel name cache timeout (default: 1.0)\n");
+    fprintf(stderr, "  -a, --attr-timeout <s>    Kernel attribute cache timeout (default: 1.0)\n");
+    fprintf(stderr, "  -n, --negative-timeout <s>  Kernel cache timeout for missing names,\n"
+                    "                      0 disables (default: 0)\n");
+    fprintf(stderr, "  -k, --checkpoint-secs <s>  Seconds between checkpoints (default: %d)\n",
+            LSFS_CHECKPOINT_DEFAULT_SECS);
+    fprintf(stderr, "  -K, --checkpoint-blocks <n>  Blocks written between checkpoints\n"
+                    "                      (default: %d)\n", LSFS_CHECKPOINT_DEFAULT_BLOCKS);
+    fprintf(stderr, "  -g, --gc-threads <n>  Cleaner threads (default: %d)\n",
+            LSFS_GC_DEFAULT_THREADS);
+    fprintf(stderr, "  -s, --segment-alloc <policy>  Free segment order: seq (next after the\n"
+                    "                      last one, wrapping) or lrf (least recently freed)\n"
+                    "                      (default: seq)\n");
+    fprintf(stderr, "  -V, --verify <mode>  Checksum verification on read: none (summaries\n"
+                    "                      only), segment (blocks the cleaner and recovery\n"
+                    "                      read) or block (every block read from disk)\n"
+                    "                      (default: segment)\n");
+    fprintf(stderr, "  -z, --compress <codec[:level]>  Compress file data: none, lz4 or\n"
+                    "                      zstd, with an optional level (default: none)\n");
+    fprintf(stderr, "  -i, --io <backend>  Block I/O backend: psync or uring (default: psync)\n");
+    fprintf(stderr, "  -D, --direct        Open the disk image with O_DIRECT\n");
+    fprintf(stderr, "  -N, --no-discard    Keep segments allocated on the device when they\n"
+                    "                      become free, instead of punching them out of the\n"
+                    "                      image or discarding them\n");
     fprintf(stderr, "  -o <options>        FUSE mount options\n");
     fprintf(stderr, "  -h, --help          Show this help\n");
     fprintf(stderr, "\n");
@@ -200,18 +168,54 @@ int main(int argc, char *argv[])
     char *mount_point = NULL;
     int foreground = 0;
     int debug = 0;
+    long threads = LSFS_DEFAULT_THREADS;
+    long long cache_mb = LSFS_BUFFER_DEFAULT_MB;
+    long long readahead_kb = LSFS_READAHEAD_DEFAULT_KB;
+    long long inode_cache = LSFS_INODE_CACHE_DEFAULT;
+    long long dcache_entries = LSFS_DCACHE_DEFAULT_ENTRIES;
+    double entry_timeout = 1.0;
+    double attr_timeout = 1.0;
+    double negative_timeout = 0.0;
+    long long checkpoint_secs = LSFS_CHECKPOINT_DEFAULT_SECS;
+    long long checkpoint_blocks = LSFS_CHECKPOINT_DEFAULT_BLOCKS;
+    long long gc_threads = LSFS_GC_DEFAULT_THREADS;
+    uint32_t segment_alloc = LSFS_ALLOC_SEQUENTIAL;
+    uint32_t verify_mode = LSFS_VERIFY_SEGMENT;
+    uint32_t compress_codec = LSFS_CODEC_NONE;
+    int compress_level = 0;
+    uint32_t io_backend = LSFS_IO_PSYNC;
+    bool direct_io = false;
+    bool discard = LSFS_DISCARD_DEFAULT;
+    char *endptr;
     int ret = 1;
     int opt;
 
     static struct option long_options[] = {
         {"foreground", no_argument, NULL, 'f'},
         {"debug", no_argument, NULL, 'd'},
+        {"threads", required_argument, NULL, 't'},
+        {"cache-size", required_argument, NULL, 'c'},
+        {"readahead", required_argument, NULL, 'r'},
+        {"inode-cache", required_argument, NULL, 'I'},
+        {"dcache-entries", required_argument, NULL, 'C'},
+        {"entry-timeout", required_argument, NULL, 'e'},
+        {"attr-timeout", required_argument, NULL, 'a'},
+        {"negative-timeout", required_argument, NULL, 'n'},
+        {"checkpoint-secs", required_argument, NULL, 'k'},
+        {"checkpoint-blocks", required_argument, NULL, 'K'},
+        {"gc-threads", required_argument, NULL, 'g'},
+        {"segment-alloc", required_argument, NULL, 's'},
+        {"verify", required_argument, NULL, 'V'},
+        {"compress", required_argument, NULL, 'z'},
+        {"io", required_argument, NULL, 'i'},
+        {"direct", no_argument, NULL, 'D'},
+        {"no-discard", no_argument, NULL, 'N'},
         {"help", no_argument, NULL, 'h'},
         {NULL, 0, NULL, 0}
     };
 
     /* Parse options */
-    while ((opt = getopt_long(argc, argv, "fdo:h", long_options, NULL)) != -1) {
+    while ((opt = getopt_long(argc, argv, "fdt:c:r:I:C:e:a:n:k:K:g:s:V:z:i:DNo:h", long_options, NULL)) != -1) {
         switch (opt) {
         case 'f':
             foreground = 1;
@@ -220,6 +224,133 @@ int main(int argc, char *argv[])
             debug = 1;
             foreground = 1;
             break;
+        case 't':
+            threads = strtol(optarg, &endptr, 10);
+            if (*endptr != '\0' || threads < 1 || threads > LSFS_MAX_THREADS) {
+                fprintf(stderr, "Invalid thread count: %s (1-%d)\n",
+                        optarg, LSFS_MAX_THREADS);
+                return 1;
+            }
+            break;
+        case 'c':
+            cache_mb = strtoll(optarg, &endptr, 10);
+            if (*endptr != '\0' || cache_mb < 0) {
+                fprintf(stderr, "Invalid cache size: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'r':
+            readahead_kb = strtoll(optarg, &endptr, 10);
+            if (*endptr != '\0' || readahead_kb < 0 || readahead_kb > 1024 * 1024) {
+                fprintf(stderr, "Invalid readahead window: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'I':
+            inode_cache = strtoll(optarg, &endptr, 10);
+            if (*endptr != '\0' || inode_cache < 1 || inode_cache > UINT32_MAX) {
+                fprintf(stderr, "Invalid inode cache size: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'C':
+            dcache_entries = strtoll(optarg, &endptr, 10);
+            if (*endptr != '\0' || dcache_entries < 0 || dcache_entries > UINT32_MAX) {
+                fprintf(stderr, "Invalid dentry cache size: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'e':
+        case 'a':
+        case 'n': {
+            double timeout = strtod(optarg, &endptr);
+            if (*endptr != '\0' || !(timeout >= 0.0)) {
+                fprintf(stderr, "Invalid timeout: %s\n", optarg);
+                return 1;
+            }
+            if (opt == 'e') {
+                entry_timeout = timeout;
+            } else if (opt == 'a') {
+                attr_timeout = timeout;
+            } else {
+                negative_timeout = timeout;
+            }
+            break;
+        }
+        case 'k':
+            checkpoint_secs = strtoll(optarg, &endptr, 10);
+            if (*endptr != '\0' || checkpoint_secs < 1 || checkpoint_secs > UINT32_MAX) {
+                fprintf(stderr, "Invalid checkpoint interval: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'K':
+            checkpoint_blocks = strtoll(optarg, &endptr, 10);
+            if (*endptr != '\0' || checkpoint_blocks < 1 || checkpoint_blocks > UINT32_MAX) {
+                fprintf(stderr, "Invalid checkpoint block count: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'g':
+            gc_threads = strtoll(optarg, &endptr, 10);
+            if (*endptr != '\0' || gc_threads < 1 || gc_threads > LSFS_GC_MAX_THREADS) {
+                fprintf(stderr, "Invalid cleaner thread count: %s (1-%d)\n", optarg,
+                        LSFS_GC_MAX_THREADS);
+                return 1;
+            }
+            break;
+        case 's':
+            if (strcmp(optarg, "seq") == 0) {
+                segment_alloc = LSFS_ALLOC_SEQUENTIAL;
+            } else if (strcmp(optarg, "lrf") == 0) {
+                segment_alloc = LSFS_ALLOC_LRF;
+            } else {
+                fprintf(stderr, "Invalid segment allocation policy: %s (seq or lrf)\n", optarg);
+                return 1;
+            }
+            break;
+        case 'V':
+            if (strcmp(optarg, "none") == 0) {
+                verify_mode = LSFS_VERIFY_NONE;
+            } else if (strcmp(optarg, "segment") == 0) {
+                verify_mode = LSFS_VERIFY_SEGMENT;
+            } else if (strcmp(optarg, "block") == 0) {
+                verify_mode = LSFS_VERIFY_BLOCK;
+            } else {
+                fprintf(stderr, "Invalid verification mode: %s (none, segment or block)\n",
+                        optarg);
+                return 1;
+            }
+            break;
+        case 'z':
+            ret = lsfs_codec_parse(optarg, &compress_codec, &compress_level);
+            if (ret == LSFS_ERR_NOENT) {
+                fprintf(stderr, "Compression codec not available in this build: %s\n", optarg);
+                return 1;
+            }
+            if (ret != LSFS_OK) {
+                fprintf(stderr, "Invalid compression: %s (none, lz4 or zstd[:level])\n",
+                        optarg);
+                return 1;
+            }
+            ret = 1;
+            break;
+        case 'i':
+            if (strcmp(optarg, "psync") == 0) {
+                io_backend = LSFS_IO_PSYNC;
+            } else if (strcmp(optarg, "uring") == 0) {
+                io_backend = LSFS_IO_URING;
+            } else {
+                fprintf(stderr, "Invalid I/O backend: %s (psync or uring)\n", optarg);
+                return 1;
+            }
+            break;
+        case 'D':
+            direct_io = true;
+            break;
+        case 'N':
+            discard = false;
+            break;
         case 'o':
             fuse_opt_add_arg(&args, "-o");
             fuse_opt_add_arg(&args, optarg);
@@ -246,6 +377,24 @@ int main(int argc, char *argv[])
     memset(&lsfs_ctx, 0, sizeof(lsfs_ctx));
     lsfs_ctx.fd = -1;
     lsfs_ctx.debug = debug;
+    lsfs_ctx.worker_threads = (uint32_t)threads;
+    lsfs_ctx.cache_size = (uint64_t)cache_mb * 1024 * 1024;
+    lsfs_ctx.readahead_blocks = (uint32_t)(readahead_kb * 1024 / LSFS_BLOCK_SIZE);
+    lsfs_ctx.inode_cache_size = (uint32_t)inode_cache;
+    lsfs_ctx.dcache_entries = (uint32_t)dcache_entries;
+    lsfs_ctx.entry_timeout = entry_timeout;
+    lsfs_ctx.attr_timeout = attr_timeout;
+    lsfs_ctx.negative_timeout = negative_timeout;
+    lsfs_ctx.checkpoint_secs = (uint32_t)checkpoint_secs;
+    lsfs_ctx.checkpoint_blocks = (uint32_t)checkpoint_blocks;
+    lsfs_ctx.gc_thread_count = (uint32_t)gc_threads;
+    lsfs_ctx.segment_alloc = segment_alloc;
+    lsfs_ctx.verify_mode = verify_mode;
+    lsfs_ctx.compress_codec = compress_codec;
+    lsfs_ctx.compress_level = compress_level;
+    lsfs_ctx.io_backend = io_backend;
+    lsfs_ctx.direct_io = direct_io;
+    lsfs_ctx.discard = discard;
 
     /* Open disk image */
     ret = lsfs_io_init(&lsfs_ctx, disk_path);
@@ -297,18 +446,21 @@ int main(int argc, char *argv[])
 
     /* Enter main loop */
     if (foreground) {
-        ret = fuse_session_loop(fuse_se);
+        ret = lsfs_run_session(&lsfs_ctx, fuse_se);
     } else {
         ret = fuse_daemonize(0);
         if (ret == 0) {
-            ret = fuse_session_loop(fuse_se);
+            ret = lsfs_run_session(&lsfs_ctx, fuse_se);
         }
     }
 
     /* Cleanup */
     fuse_session_unmount(fuse_se);
     fuse_session_destroy(fuse_se);
-    lsfs_cleanup_fs(&lsfs_ctx);
+    if (lsfs_cleanup_fs(&lsfs_ctx) != LSFS_OK) {
+        fprintf(stderr, "Failed to unmount cleanly, run fsck.lsfs\n");
+        ret = 1;
+    }
     fuse_opt_free_args(&args);
 
     return ret ? 1 : 0;
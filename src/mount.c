@@ -0,0 +1,352 @@
+/*
+ * LSFS - Log-Structured Filesystem
+ * Mounting and Unmounting
+ *
+ * Brings a filesystem image up from its superblock and last checkpoint,
+ * and writes it back cleanly on the way down.  The daemon runs these
+ * around its FUSE session, and the benchmarks call them directly.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "lsfs.h"
+
+/*
+ * Get a monotonic time in milliseconds
+ */
+static uint64_t mount_clock_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+/*
+ * Initialize the filesystem
+ */
+int lsfs_init_fs(struct lsfs_context *ctx)
+{
+    struct lsfs_checkpoint_header checkpoint;
+    uint64_t start = mount_clock_ms();
+    uint64_t t_table, t_recover;
+    int ret;
+
+    /* Initialize buffer pool */
+    ret = lsfs_buffer_pool_init(&ctx->bufpool, ctx->cache_size);
+    if (ret != LSFS_OK) {
+        LSFS_ERROR("Failed to initialize buffer pool");
+        return ret;
+    }
+
+    /* Readahead lands in the buffer cache, so it may use an eighth of it */
+    ret = lsfs_prefetch_init(ctx);
+    if (ret != LSFS_OK) {
+        LSFS_ERROR("Failed to initialize read queue");
+        return ret;
+    }
+    ctx->readahead_blocks = (uint32_t)LSFS_MIN(ctx->readahead_blocks,
+                                               ctx->bufpool.capacity / 8);
+    if (ctx->readahead_blocks > 0) {
+        LSFS_INFO("Sequential readahead up to %u KB",
+                  ctx->readahead_blocks * (LSFS_BLOCK_SIZE / 1024));
+    }
+
+    /* Read superblock */
+    ret = lsfs_read_block(ctx, LSFS_SUPERBLOCK_BLOCK, &ctx->sb);
+    if (ret != LSFS_OK) {
+        LSFS_ERROR("Failed to read superblock");
+        return ret;
+    }
+
+    /* Validate superblock */
+    if (ctx->sb.magic != LSFS_MAGIC) {
+        LSFS_ERROR("Invalid filesystem magic: 0x%08x (expected 0x%08x)",
+                   ctx->sb.magic, LSFS_MAGIC);
+        return LSFS_ERR_CORRUPT;
+    }
+
+    if (ctx->sb.version != LSFS_VERSION) {
+        LSFS_ERROR("Unsupported filesystem version: %u", ctx->sb.version);
+        return LSFS_ERR_CORRUPT;
+    }
+
+    uint32_t segment_size = ctx->sb.segment_size;
+    if (segment_size < LSFS_SEGMENT_BLOCKS_MIN || segment_size > LSFS_SEGMENT_BLOCKS ||
+        (segment_size & (segment_size - 1)) != 0) {
+        LSFS_ERROR("Unsupported segment size: %u blocks", segment_size);
+        return LSFS_ERR_CORRUPT;
+    }
+
+    const char *layout_error = lsfs_sb_check_layout(&ctx->sb);
+    if (layout_error) {
+        LSFS_ERROR("Invalid disk layout: %s", layout_error);
+        return LSFS_ERR_CORRUPT;
+    }
+
+    LSFS_INFO("LSFS version %u, %lu blocks, %lu segments of %u blocks, %lu inodes",
+              ctx->sb.version,
+              (unsigned long)ctx->sb.total_blocks,
+              (unsigned long)ctx->sb.total_segments, segment_size,
+              (unsigned long)ctx->sb.max_inodes);
+
+    static const char *const verify_names[] = { "summaries", "segment reads", "every read" };
+    LSFS_INFO("CRC32C checksums (%s), verifying %s", lsfs_crc32c_impl(),
+              verify_names[ctx->verify_mode <= LSFS_VERIFY_BLOCK ? ctx->verify_mode : 0]);
+    if (ctx->compress_codec != LSFS_CODEC_NONE) {
+        LSFS_INFO("Compressing file data with %s (level %d)",
+                  lsfs_codec_name(ctx->compress_codec), ctx->compress_level);
+    }
+    if (ctx->discard) {
+        LSFS_INFO("Discarding segments as they become free");
+    }
+
+    /* Initialize inode cache */
+    ret = lsfs_inode_cache_init(&ctx->icache, ctx->inode_cache_size);
+    if (ret != LSFS_OK) {
+        LSFS_ERROR("Failed to initialize inode cache");
+        return ret;
+    }
+
+    /* Initialize dentry cache */
+    ret = lsfs_dcache_init(&ctx->dcache, ctx->dcache_entries);
+    if (ret != LSFS_OK) {
+        LSFS_ERROR("Failed to initialize dentry cache");
+        return ret;
+    }
+
+    /* Initialize inode map */
+    ret = lsfs_imap_init(&ctx->imap, (uint32_t)ctx->sb.max_inodes);
+    if (ret != LSFS_OK) {
+        LSFS_ERROR("Failed to initialize inode map");
+        return ret;
+    }
+
+    /* Initialize checkpoint system */
+    ret = lsfs_checkpoint_init(ctx);
+    if (ret != LSFS_OK) {
+        LSFS_ERROR("Failed to initialize checkpoint system");
+        return ret;
+    }
+
+    /* Initialize segment management from the table copy of the newest
+     * checkpoint, which recovery then rolls forward from */
+    t_table = mount_clock_ms();
+    ret = lsfs_checkpoint_select(ctx, &checkpoint);
+    if (ret != LSFS_OK) {
+        return ret;
+    }
+    ret = lsfs_segment_init(ctx);
+    if (ret != LSFS_OK) {
+        LSFS_ERROR("Failed to initialize segment management");
+        return ret;
+    }
+
+    /* Initialize locks (recovery already writes a checkpoint) */
+    if (pthread_mutex_init(&ctx->write_lock, NULL) != 0) {
+        LSFS_ERROR("Failed to initialize write lock");
+        return LSFS_ERR_NOMEM;
+    }
+
+    if (pthread_rwlock_init(&ctx->fs_lock, NULL) != 0) {
+        LSFS_ERROR("Failed to initialize fs lock");
+        return LSFS_ERR_NOMEM;
+    }
+
+    if (lsfs_group_commit_init(&ctx->gcommit) != LSFS_OK) {
+        LSFS_ERROR("Failed to initialize group commit");
+        return LSFS_ERR_NOMEM;
+    }
+
+    /* Recover from last checkpoint; the checkpoint written after
+     * roll-forward needs the segment writer */
+    t_table = mount_clock_ms() - t_table;
+    t_recover = mount_clock_ms();
+    ret = lsfs_segment_writer_start(ctx);
+    if (ret != LSFS_OK) {
+        LSFS_ERROR("Failed to start segment writer");
+        return ret;
+    }
+    ret = lsfs_checkpoint_recover(ctx, &checkpoint);
+    if (ret != LSFS_OK) {
+        LSFS_ERROR("Failed to recover filesystem");
+        lsfs_segment_writer_stop(ctx);
+        return ret;
+    }
+    t_recover = mount_clock_ms() - t_recover;
+
+    /* Update mount information */
+    ctx->sb.mounted_at = (uint64_t)time(NULL);
+    ctx->sb.mount_count++;
+    ctx->sb.state = 1;  /* Dirty */
+    lsfs_write_block(ctx, LSFS_SUPERBLOCK_BLOCK, &ctx->sb);
+
+    /* The writer is started again with the session, which may run in a
+     * child forked by fuse_daemonize() that would not have it */
+    lsfs_segment_writer_stop(ctx);
+
+    ctx->mounted = true;
+    g_lsfs = ctx;
+
+    LSFS_INFO("Filesystem mounted in %lu ms (segment table %lu ms, recovery %lu ms)",
+              (unsigned long)(mount_clock_ms() - start), (unsigned long)t_table,
+              (unsigned long)t_recover);
+    return LSFS_OK;
+}
+
+/*
+ * Write back every dirty inode and pending block, then checkpoint them
+ * Returns the first error, after doing as much as it can.
+ */
+static int mount_write_back(struct lsfs_context *ctx)
+{
+    int ret = lsfs_inode_sync_all(ctx, true);
+    int flush_ret = lsfs_segment_flush(ctx);
+    int checkpoint_ret = lsfs_checkpoint_write(ctx);
+
+    if (ret == LSFS_OK) {
+        ret = flush_ret;
+    }
+    if (ret == LSFS_OK) {
+        ret = checkpoint_ret;
+    }
+    return ret;
+}
+
+/*
+ * Cleanup the filesystem
+ * Returns an error if not everything written to it could be persisted;
+ * the superblock is then left dirty.
+ */
+int lsfs_cleanup_fs(struct lsfs_context *ctx)
+{
+    int ret;
+
+    if (!ctx->mounted) {
+        return LSFS_OK;
+    }
+
+    LSFS_INFO("Unmounting filesystem...");
+
+    lsfs_checkpoint_stop(ctx);
+
+    /* The session may never have restarted the writer */
+    ret = lsfs_segment_writer_start(ctx);
+    if (ret != LSFS_OK) {
+        lsfs_gc_destroy(ctx);
+        lsfs_prefetch_destroy(ctx);
+        LSFS_ERROR("Failed to start segment writer, unwritten data is lost");
+        return ret;
+    }
+
+    /* Write back while the cleaner still runs, as it may have to free
+     * space for that, then once more for what it moved meanwhile */
+    ret = mount_write_back(ctx);
+
+    /* Stop background threads; the cleaner reads through the read queue */
+    lsfs_gc_destroy(ctx);
+    lsfs_prefetch_destroy(ctx);
+
+    int final_ret = mount_write_back(ctx);
+    if (ret == LSFS_OK) {
+        ret = final_ret;
+    }
+
+    /* Update superblock */
+    if (ret == LSFS_OK) {
+        ctx->sb.state = 0;  /* Clean */
+        ret = lsfs_write_block(ctx, LSFS_SUPERBLOCK_BLOCK, &ctx->sb);
+    } else {
+        LSFS_ERROR("Failed to write everything back, leaving the filesystem dirty");
+    }
+    int sync_ret = lsfs_sync(ctx);
+    if (ret == LSFS_OK) {
+        ret = sync_ret;
+    }
+
+    /* Cleanup */
+    lsfs_segment_destroy(ctx);
+
+    struct lsfs_buffer_stats stats;
+    lsfs_buffer_stats(&ctx->bufpool, &stats);
+    if (stats.hits + stats.misses > 0) {
+        LSFS_INFO("Buffer cache: %lu hits, %lu misses (%.1f%% hit rate), "
+                  "%lu evictions, %lu invalidations",
+                  (unsigned long)stats.hits, (unsigned long)stats.misses,
+                  100.0 * (double)stats.hits / (double)(stats.hits + stats.misses),
+                  (unsigned long)stats.evictions, (unsigned long)stats.invalidations);
+    }
+    if (stats.prefetched > 0) {
+        LSFS_INFO("Readahead: %lu blocks read ahead, %lu used (%.1f%%), %lu runs dropped",
+                  (unsigned long)stats.prefetched, (unsigned long)stats.prefetch_hits,
+                  100.0 * (double)stats.prefetch_hits / (double)stats.prefetched,
+                  (unsigned long)ctx->prefetch.dropped);
+    }
+
+    struct lsfs_inode_cache_stats istats;
+    lsfs_inode_cache_stats(&ctx->icache, &istats);
+    if (istats.hits + istats.misses > 0) {
+        LSFS_INFO("Inode cache: %lu hits, %lu misses (%.1f%% hit rate), "
+                  "%lu evictions, %lu of %lu cached",
+                  (unsigned long)istats.hits, (unsigned long)istats.misses,
+                  100.0 * (double)istats.hits / (double)(istats.hits + istats.misses),
+                  (unsigned long)istats.evictions, (unsigned long)istats.cached,
+                  (unsigned long)istats.capacity);
+    }
+
+    struct lsfs_dcache_stats dstats;
+    lsfs_dcache_stats(&ctx->dcache, &dstats);
+    uint64_t dlookups = dstats.hits + dstats.negative_hits + dstats.misses;
+    if (dlookups > 0) {
+        LSFS_INFO("Dentry cache: %lu hits, %lu negative hits, %lu misses "
+                  "(%.1f%% hit rate)",
+                  (unsigned long)dstats.hits, (unsigned long)dstats.negative_hits,
+                  (unsigned long)dstats.misses,
+                  100.0 * (double)(dstats.hits + dstats.negative_hits) / (double)dlookups);
+    }
+
+    struct lsfs_commit_stats commit;
+    lsfs_group_commit_stats(&ctx->gcommit, &commit);
+    if (commit.requests > 0) {
+        LSFS_INFO("Group commit: %lu fsyncs in %lu commits (%.1f per commit, max %lu), "
+                  "latency %.1f us average, %.1f us max",
+                  (unsigned long)commit.requests, (unsigned long)commit.commits,
+                  (double)commit.requests / (double)LSFS_MAX(commit.commits, 1),
+                  (unsigned long)commit.max_batch,
+                  (double)commit.total_latency_ns / 1000.0 / (double)commit.requests,
+                  (double)commit.max_latency_ns / 1000.0);
+    }
+
+    uint64_t compressed = __atomic_load_n(&ctx->compressed_blocks, __ATOMIC_RELAXED);
+    uint64_t incompressible = __atomic_load_n(&ctx->incompressible_blocks, __ATOMIC_RELAXED);
+    if (compressed + incompressible > 0) {
+        uint64_t bytes = __atomic_load_n(&ctx->compressed_bytes, __ATOMIC_RELAXED);
+        LSFS_INFO("Compression: %lu blocks stored in %lu bytes (%.2fx), "
+                  "%lu incompressible",
+                  (unsigned long)compressed, (unsigned long)bytes,
+                  bytes > 0 ? (double)compressed * LSFS_BLOCK_SIZE / (double)bytes : 0.0,
+                  (unsigned long)incompressible);
+    }
+
+    lsfs_imap_destroy(&ctx->imap);
+    lsfs_inode_cache_destroy(&ctx->icache);
+    lsfs_dcache_destroy(&ctx->dcache);
+    lsfs_buffer_pool_destroy(&ctx->bufpool);
+
+    lsfs_group_commit_destroy(&ctx->gcommit);
+    pthread_cond_destroy(&ctx->checkpoint_cond);
+    pthread_mutex_destroy(&ctx->checkpoint_lock);
+    pthread_mutex_destroy(&ctx->write_lock);
+    pthread_rwlock_destroy(&ctx->fs_lock);
+
+    lsfs_io_destroy(ctx);
+
+    ctx->mounted = false;
+    g_lsfs = NULL;
+
+    LSFS_INFO("Filesystem unmounted");
+    return ret;
+}
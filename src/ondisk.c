@@ -0,0 +1,147 @@
+/*
+ * LSFS - Log-Structured Filesystem
+ * On-disk Structure Helpers
+ *
+ * Reading an image and telling whether the structures in it are intact
+ * are needed by the filesystem and by the offline tools alike, which
+ * only have a file descriptor, so these helpers take no context.
+ */
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+
+#include "ondisk.h"
+#include "crc32c.h"
+
+/*
+ * Get the size of an image file or block device
+ * Block devices report theirs through an ioctl, fstat() gives 0.
+ */
+int lsfs_image_size(int fd, uint64_t *size, bool *block_device)
+{
+    struct stat st;
+
+    if (fstat(fd, &st) < 0) {
+        return -1;
+    }
+
+    *size = (uint64_t)st.st_size;
+    if (block_device) {
+        *block_device = S_ISBLK(st.st_mode);
+    }
+    if (S_ISBLK(st.st_mode) && ioctl(fd, BLKGETSIZE64, size) < 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Read count blocks from block on
+ * Short reads are continued; reading past the end of the image fails
+ * with errno EIO.
+ */
+int lsfs_image_read(int fd, uint64_t block, uint64_t count, void *buf)
+{
+    uint8_t *p = buf;
+    size_t left = count * LSFS_BLOCK_SIZE;
+    off_t offset = (off_t)(block * LSFS_BLOCK_SIZE);
+
+    while (left > 0) {
+        ssize_t done = pread(fd, p, left, offset);
+        if (done < 0 && errno == EINTR) {
+            continue;
+        }
+        if (done <= 0) {
+            if (done == 0) {
+                errno = EIO;
+            }
+            return -1;
+        }
+        p += done;
+        left -= (size_t)done;
+        offset += done;
+    }
+
+    return 0;
+}
+
+/*
+ * Write count blocks from block on
+ */
+int lsfs_image_write(int fd, uint64_t block, uint64_t count, const void *buf)
+{
+    const uint8_t *p = buf;
+    size_t left = count * LSFS_BLOCK_SIZE;
+    off_t offset = (off_t)(block * LSFS_BLOCK_SIZE);
+
+    while (left > 0) {
+        ssize_t done = pwrite(fd, p, left, offset);
+        if (done < 0 && errno == EINTR) {
+            continue;
+        }
+        if (done <= 0) {
+            if (done == 0) {
+                errno = EIO;
+            }
+            return -1;
+        }
+        p += done;
+        left -= (size_t)done;
+        offset += done;
+    }
+
+    return 0;
+}
+
+/*
+ * Check that a checkpoint header was written completely
+ */
+bool lsfs_checkpoint_valid(const struct lsfs_checkpoint_header *header)
+{
+    return header->magic == LSFS_CHECKPOINT_MAGIC && header->complete == 1 &&
+           header->checksum == lsfs_checkpoint_checksum(header);
+}
+
+/*
+ * Check a segment summary read from disk
+ * True if it belongs to segment_id, describes a possible number of blocks
+ * for segments of segment_blocks and matches its checksum.
+ */
+bool lsfs_summary_valid(const struct lsfs_segment_summary *summary, uint32_t segment_id,
+                        uint32_t segment_blocks)
+{
+    const struct lsfs_segment_header *header = &summary->header;
+
+    return header->magic == LSFS_SEGMENT_MAGIC && header->segment_id == segment_id &&
+           header->block_count >= LSFS_SUMMARY_BLOCKS &&
+           header->block_count <= segment_blocks &&
+           header->checksum == lsfs_summary_checksum(summary);
+}
+
+/*
+ * Pick the current copy of a segment summary
+ * head and tail are the copies read from the start and the last blocks of
+ * the segment, NULL if they could not be read.  A copy in the tail never
+ * describes the blocks it occupies.  Returns the valid copy with the
+ * higher sequence number, or NULL if neither is valid.
+ */
+const struct lsfs_segment_summary *
+lsfs_summary_current(const struct lsfs_segment_summary *head,
+                     const struct lsfs_segment_summary *tail,
+                     uint32_t segment_id, uint32_t segment_blocks)
+{
+    if (head && !lsfs_summary_valid(head, segment_id, segment_blocks)) {
+        head = NULL;
+    }
+    if (tail && !lsfs_summary_valid(tail, segment_id, LSFS_SUMMARY_TAIL(segment_blocks))) {
+        tail = NULL;
+    }
+    if (head && tail) {
+        return tail->header.sequence > head->header.sequence ? tail : head;
+    }
+    return head ? head : tail;
+}
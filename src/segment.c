@@ -7,57 +7,174 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <errno.h>
 #include <inttypes.h>
+#include <stddef.h>
 
 #include "lsfs.h"
 
+/* Set while the calling thread moves blocks for the cleaner */
+static __thread bool segment_cleaner;
+
+/* Blocks promised to the file the calling thread is writing, not yet used */
+static __thread uint64_t segment_promised;
+
+/*
+ * Let the calling thread's appends use the segments reserved for the cleaner
+ * Set while the cleaner moves live blocks out of a segment, which covers
+ * the inodes, extent blocks and inode map chunks it rewrites for them as
+ * well as the blocks themselves.
+ */
+void lsfs_segment_set_cleaner(bool cleaner)
+{
+    segment_cleaner = cleaner;
+}
+
+/*
+ * Hand the calling thread's appends blocks promised to the file it writes
+ * File data reserved from then on is taken off the promise as it is
+ * reserved, and the segments the credit holds back may be opened for it,
+ * so the promise keeps covering the write until its blocks are in the
+ * log.  Returns what was left of the previous credit, which is still
+ * promised and belongs back with the file.
+ */
+uint64_t lsfs_segment_set_promised(uint64_t blocks)
+{
+    uint64_t left = segment_promised;
+
+    segment_promised = blocks;
+    return left;
+}
+
 /*
  * Convert segment ID and offset to absolute block number
  */
-uint64_t lsfs_segment_to_block(uint32_t segment_id, uint32_t offset)
+uint64_t lsfs_segment_to_block(const struct lsfs_context *ctx, uint32_t segment_id,
+                               uint32_t offset)
 {
-    return LSFS_LOG_START + (uint64_t)segment_id * LSFS_SEGMENT_BLOCKS + offset;
+    const struct lsfs_segment_table *table = &ctx->segtable;
+
+    return table->log_start + (uint64_t)segment_id * table->segment_blocks + offset;
 }
 
 /*
  * Convert absolute block number to segment ID and offset
  */
-void lsfs_block_to_segment(uint64_t block, uint32_t *segment_id, uint32_t *offset)
+void lsfs_block_to_segment(const struct lsfs_context *ctx, uint64_t block,
+                           uint32_t *segment_id, uint32_t *offset)
 {
-    if (block < LSFS_LOG_START) {
+    const struct lsfs_segment_table *table = &ctx->segtable;
+
+    if (block < table->log_start) {
         *segment_id = 0;
         *offset = 0;
         return;
     }
 
-    uint64_t log_block = block - LSFS_LOG_START;
-    *segment_id = (uint32_t)(log_block / LSFS_SEGMENT_BLOCKS);
-    *offset = (uint32_t)(log_block % LSFS_SEGMENT_BLOCKS);
+    uint64_t log_block = block - table->log_start;
+    *segment_id = (uint32_t)(log_block / table->segment_blocks);
+    *offset = (uint32_t)(log_block % table->segment_blocks);
+}
+
+/*
+ * Free the open and queued segment images
+ */
+static void segment_buffer_free(struct lsfs_segment_buffer *segbuf)
+{
+    for (uint32_t i = 0; i < LSFS_STREAM_COUNT; i++) {
+        free(segbuf->streams[i].data);
+        free(segbuf->streams[i].block_info);
+        segbuf->streams[i].data = NULL;
+        segbuf->streams[i].block_info = NULL;
+    }
+
+    for (uint32_t i = 0; i < LSFS_FLUSH_QUEUE_DEPTH; i++) {
+        free(segbuf->queue[i].data);
+        free(segbuf->queue[i].block_info);
+        segbuf->queue[i].data = NULL;
+        segbuf->queue[i].block_info = NULL;
+    }
 }
 
 /*
  * Initialize segment buffer
+ * One image is allocated for each stream and one for each flush queue
+ * slot; sealing a segment swaps the stream's image with a free queue slot.
+ * Images are aligned so they can be written with O_DIRECT unbounced.
+ * Streams get a segment on their first append.
  */
 int lsfs_segment_buffer_init(struct lsfs_segment_buffer *segbuf)
 {
-    segbuf->data = calloc(1, LSFS_SEGMENT_SIZE);
-    if (!segbuf->data) {
+    for (uint32_t i = 0; i < LSFS_STREAM_COUNT; i++) {
+        struct lsfs_segment_stream *stream = &segbuf->streams[i];
+
+        stream->data = lsfs_io_alloc(LSFS_SEGMENT_SIZE);
+        stream->block_info = calloc(LSFS_SEGMENT_BLOCKS, sizeof(struct lsfs_block_info));
+        stream->segment_id = LSFS_SEGMENT_NONE;
+        stream->block_count = LSFS_SUMMARY_BLOCKS;  /* Reserve the summary blocks */
+        stream->flushed = LSFS_SUMMARY_BLOCKS;
+        stream->summary_tail = false;
+        stream->reserved = 0;
+        stream->inode_block = 0;
+        stream->inode_slots = 0;
+        stream->packed_block = 0;
+        if (!stream->data || !stream->block_info) {
+            segment_buffer_free(segbuf);
+            return LSFS_ERR_NOMEM;
+        }
+    }
+    for (uint32_t i = 0; i < LSFS_FLUSH_QUEUE_DEPTH; i++) {
+        segbuf->queue[i].data = lsfs_io_alloc(LSFS_SEGMENT_SIZE);
+        segbuf->queue[i].block_info = calloc(LSFS_SEGMENT_BLOCKS,
+                                             sizeof(struct lsfs_block_info));
+        segbuf->queue[i].segment_id = LSFS_SEGMENT_NONE;
+        segbuf->queue[i].block_count = 0;
+        if (!segbuf->queue[i].data || !segbuf->queue[i].block_info) {
+            segment_buffer_free(segbuf);
+            return LSFS_ERR_NOMEM;
+        }
+    }
+
+    segbuf->queue_head = 0;
+    segbuf->queue_len = 0;
+    segbuf->seal_seq = 0;
+    segbuf->checkpointing = false;
+    segbuf->cutting = false;
+    segbuf->write_error = LSFS_OK;
+    segbuf->writer_running = false;
+
+    if (pthread_mutex_init(&segbuf->lock, NULL) != 0) {
+        segment_buffer_free(segbuf);
+        return LSFS_ERR_NOMEM;
+    }
+
+    if (pthread_cond_init(&segbuf->drained, NULL) != 0) {
+        pthread_mutex_destroy(&segbuf->lock);
+        segment_buffer_free(segbuf);
         return LSFS_ERR_NOMEM;
     }
 
-    segbuf->block_info = calloc(LSFS_SEGMENT_BLOCKS, sizeof(struct lsfs_block_info));
-    if (!segbuf->block_info) {
-        free(segbuf->data);
-        segbuf->data = NULL;
+    if (pthread_cond_init(&segbuf->queued, NULL) != 0) {
+        pthread_cond_destroy(&segbuf->drained);
+        pthread_mutex_destroy(&segbuf->lock);
+        segment_buffer_free(segbuf);
         return LSFS_ERR_NOMEM;
     }
 
-    segbuf->segment_id = 0;
-    segbuf->block_count = 1;  /* Reserve first block for segment header */
+    if (pthread_cond_init(&segbuf->landed, NULL) != 0) {
+        pthread_cond_destroy(&segbuf->queued);
+        pthread_cond_destroy(&segbuf->drained);
+        pthread_mutex_destroy(&segbuf->lock);
+        segment_buffer_free(segbuf);
+        return LSFS_ERR_NOMEM;
+    }
 
-    if (pthread_mutex_init(&segbuf->lock, NULL) != 0) {
-        free(segbuf->block_info);
-        free(segbuf->data);
+    if (pthread_cond_init(&segbuf->freed, NULL) != 0) {
+        pthread_cond_destroy(&segbuf->landed);
+        pthread_cond_destroy(&segbuf->queued);
+        pthread_cond_destroy(&segbuf->drained);
+        pthread_mutex_destroy(&segbuf->lock);
+        segment_buffer_free(segbuf);
         return LSFS_ERR_NOMEM;
     }
 
@@ -69,299 +186,2013 @@ int lsfs_segment_buffer_init(struct lsfs_segment_buffer *segbuf)
  */
 void lsfs_segment_buffer_destroy(struct lsfs_segment_buffer *segbuf)
 {
-    if (segbuf->data) {
-        free(segbuf->data);
-        segbuf->data = NULL;
-    }
-    if (segbuf->block_info) {
-        free(segbuf->block_info);
-        segbuf->block_info = NULL;
-    }
+    segment_buffer_free(segbuf);
+    pthread_cond_destroy(&segbuf->freed);
+    pthread_cond_destroy(&segbuf->landed);
+    pthread_cond_destroy(&segbuf->queued);
+    pthread_cond_destroy(&segbuf->drained);
     pthread_mutex_destroy(&segbuf->lock);
 }
 
 /*
- * Initialize segment table from disk
+ * Segment writer thread
+ * Writes sealed segments in the order they were queued.  A segment stays
+ * readable from its queue slot until it has landed; only then is it
+ * marked full in the segment table, if it was closed, and the log head
+ * moved past it.  The new blocks of a segment that stays open are synced
+ * before the summary that covers them is written, into the copy slot not
+ * holding the last one.  A failed write is retried, and reported to
+ * flushers meanwhile.
  */
-int lsfs_segment_init(struct lsfs_context *ctx)
+static void *segment_writer_func(void *arg)
 {
+    struct lsfs_context *ctx = (struct lsfs_context *)arg;
+    struct lsfs_segment_buffer *segbuf = &ctx->segbuf;
     struct lsfs_segment_table *table = &ctx->segtable;
-    uint32_t num_segments = (uint32_t)ctx->sb.total_segments;
 
-    /* Initialize segment buffer */
-    if (lsfs_segment_buffer_init(&ctx->segbuf) != LSFS_OK) {
-        return LSFS_ERR_NOMEM;
-    }
+    pthread_mutex_lock(&segbuf->lock);
 
-    /* Allocate segment table */
-    table->entries = calloc(num_segments, sizeof(struct lsfs_segment_usage));
-    if (!table->entries) {
-        lsfs_segment_buffer_destroy(&ctx->segbuf);
-        return LSFS_ERR_NOMEM;
-    }
+    while (1) {
+        while (segbuf->writer_running && segbuf->queue_len == 0) {
+            pthread_cond_wait(&segbuf->queued, &segbuf->lock);
+        }
+        if (segbuf->queue_len == 0) {
+            break;
+        }
 
-    table->count = num_segments;
-    table->free_count = num_segments;
+        struct lsfs_segment_pending *pending = &segbuf->queue[segbuf->queue_head];
+        uint64_t start_block = lsfs_segment_to_block(ctx, pending->segment_id, 0);
+        uint32_t block_count = pending->block_count;
+        uint32_t first = pending->first_block;
+        uint64_t summary_block = start_block +
+            (pending->summary_tail ? LSFS_SUMMARY_TAIL(table->segment_blocks) : 0);
+        int ret = LSFS_OK;
 
-    if (pthread_mutex_init(&table->lock, NULL) != 0) {
-        free(table->entries);
-        lsfs_segment_buffer_destroy(&ctx->segbuf);
-        return LSFS_ERR_NOMEM;
-    }
+        /* The slot is not reused until it is popped, so write it unlocked */
+        pthread_mutex_unlock(&segbuf->lock);
+        uint64_t start = lsfs_stats_now();
+        if (first == LSFS_SUMMARY_BLOCKS) {
+            ret = lsfs_write_blocks_sync(ctx, start_block, block_count, pending->data);
+        } else {
+            if (first < block_count) {
+                ret = lsfs_write_blocks_sync(ctx, start_block + first, block_count - first,
+                                             pending->data + (size_t)first * LSFS_BLOCK_SIZE);
+            }
+            if (ret == LSFS_OK) {
+                ret = lsfs_write_blocks_sync(ctx, summary_block, LSFS_SUMMARY_BLOCKS,
+                                             pending->data);
+            }
+        }
+        if (ret == LSFS_OK) {
+            lsfs_stats_time(ctx, LSFS_LAT_SEGMENT_WRITE, start);
+        }
+        pthread_mutex_lock(&segbuf->lock);
 
-    /* Read segment usage table from disk */
-    uint8_t *buf = calloc(LSFS_SEGTABLE_BLOCKS, LSFS_BLOCK_SIZE);
-    if (!buf) {
-        pthread_mutex_destroy(&table->lock);
-        free(table->entries);
-        lsfs_segment_buffer_destroy(&ctx->segbuf);
-        return LSFS_ERR_NOMEM;
-    }
+        if (ret != LSFS_OK) {
+            LSFS_ERROR("Failed to write segment %u", pending->segment_id);
+            segbuf->write_error = ret;
+            pthread_cond_broadcast(&segbuf->landed);
+            if (!segbuf->writer_running) {
+                break;
+            }
 
-    if (lsfs_read_blocks(ctx, LSFS_SEGTABLE_START, LSFS_SEGTABLE_BLOCKS, buf) == LSFS_OK) {
-        size_t table_size = num_segments * sizeof(struct lsfs_segment_usage);
-        if (table_size <= LSFS_SEGTABLE_BLOCKS * LSFS_BLOCK_SIZE) {
-            memcpy(table->entries, buf, table_size);
+            /* Retry after a pause, or when a flusher asks again */
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_sec += 1;
+            pthread_cond_timedwait(&segbuf->queued, &segbuf->lock, &ts);
+            continue;
         }
 
-        /* Count free segments */
-        table->free_count = 0;
-        for (uint32_t i = 0; i < num_segments; i++) {
-            if (table->entries[i].state == LSFS_SEG_FREE) {
-                table->free_count++;
-            }
+        /* Drop anything cached from the segment's previous use */
+        lsfs_buffer_invalidate_range(ctx, summary_block, LSFS_SUMMARY_BLOCKS);
+        lsfs_buffer_invalidate_range(ctx, start_block + first, block_count - first);
+
+        /* Update segment table */
+        struct lsfs_segment_summary *summary = (struct lsfs_segment_summary *)pending->data;
+        pthread_mutex_lock(&table->lock);
+        if (pending->final) {
+            table->entries[pending->segment_id].state = LSFS_SEG_FULL;
         }
-    }
+        table->entries[pending->segment_id].timestamp = summary->header.timestamp;
+        lsfs_segment_dirty(table, pending->segment_id);
+        pthread_mutex_unlock(&table->lock);
 
-    free(buf);
+        /* Update log head */
+        ctx->sb.log_head = start_block + block_count;
+        segbuf->write_error = LSFS_OK;
 
-    /* Allocate initial segment for writes */
-    if (lsfs_segment_alloc(ctx, &ctx->segbuf.segment_id) != LSFS_OK) {
-        LSFS_ERROR("Failed to allocate initial segment");
-        /* Continue anyway, will fail on first write */
-    }
+        LSFS_DEBUG("Flushed segment %u (%u blocks)", pending->segment_id, block_count);
 
-    LSFS_INFO("Segment table initialized: %u segments, %u free",
-              table->count, table->free_count);
+        /* Reads go to disk from here on; clear the image for reuse */
+        pending->segment_id = LSFS_SEGMENT_NONE;
+        pthread_mutex_unlock(&segbuf->lock);
+        if (pending->final) {
+            memset(pending->data, 0, LSFS_SEGMENT_SIZE);
+            memset(pending->block_info, 0, LSFS_SEGMENT_BLOCKS * sizeof(struct lsfs_block_info));
+        } else {
+            memset(pending->data, 0, (size_t)LSFS_SUMMARY_BLOCKS * LSFS_BLOCK_SIZE);
+            memset(pending->data + (size_t)first * LSFS_BLOCK_SIZE, 0,
+                   (size_t)(block_count - first) * LSFS_BLOCK_SIZE);
+        }
+        pthread_mutex_lock(&segbuf->lock);
 
-    return LSFS_OK;
+        segbuf->queue_head = (segbuf->queue_head + 1) % LSFS_FLUSH_QUEUE_DEPTH;
+        segbuf->queue_len--;
+        segbuf->landed_count++;
+        pthread_cond_broadcast(&segbuf->landed);
+    }
+
+    pthread_mutex_unlock(&segbuf->lock);
+    return NULL;
 }
 
 /*
- * Destroy segment table
+ * Add a segment to the tail of the free list
  */
-void lsfs_segment_destroy(struct lsfs_context *ctx)
+static void segment_free_push(struct lsfs_segment_table *table, uint32_t segment_id)
 {
-    /* Flush current segment buffer */
-    if (ctx->segbuf.block_count > 1) {
-        lsfs_segment_flush(ctx);
+    table->free_map[segment_id / 64] |= 1ULL << (segment_id % 64);
+    table->free_next[segment_id] = LSFS_SEGMENT_NONE;
+    table->free_prev[segment_id] = table->free_last;
+    if (table->free_last != LSFS_SEGMENT_NONE) {
+        table->free_next[table->free_last] = segment_id;
+    } else {
+        table->free_first = segment_id;
     }
+    table->free_last = segment_id;
+    table->free_count++;
+}
 
-    lsfs_segment_buffer_destroy(&ctx->segbuf);
-
-    if (ctx->segtable.entries) {
-        /* Save segment table to disk */
-        uint8_t *buf = calloc(LSFS_SEGTABLE_BLOCKS, LSFS_BLOCK_SIZE);
-        if (buf) {
-            size_t table_size = ctx->segtable.count * sizeof(struct lsfs_segment_usage);
-            memcpy(buf, ctx->segtable.entries, table_size);
-            lsfs_write_blocks(ctx, LSFS_SEGTABLE_START, LSFS_SEGTABLE_BLOCKS, buf);
-            free(buf);
-        }
+/*
+ * Take a segment off the free list
+ */
+static void segment_free_unlink(struct lsfs_segment_table *table, uint32_t segment_id)
+{
+    uint32_t next = table->free_next[segment_id];
+    uint32_t prev = table->free_prev[segment_id];
 
-        free(ctx->segtable.entries);
-        ctx->segtable.entries = NULL;
+    table->free_map[segment_id / 64] &= ~(1ULL << (segment_id % 64));
+    if (prev != LSFS_SEGMENT_NONE) {
+        table->free_next[prev] = next;
+    } else {
+        table->free_first = next;
     }
-
-    pthread_mutex_destroy(&ctx->segtable.lock);
+    if (next != LSFS_SEGMENT_NONE) {
+        table->free_prev[next] = prev;
+    } else {
+        table->free_last = prev;
+    }
+    table->free_count--;
 }
 
 /*
- * Allocate a free segment
+ * Check whether a segment is on the free list
  */
-int lsfs_segment_alloc(struct lsfs_context *ctx, uint32_t *segment_id)
+static bool segment_is_free(const struct lsfs_segment_table *table, uint32_t segment_id)
 {
-    struct lsfs_segment_table *table = &ctx->segtable;
+    return (table->free_map[segment_id / 64] >> (segment_id % 64)) & 1;
+}
 
-    pthread_mutex_lock(&table->lock);
+/*
+ * Find the first free segment at or after start, wrapping around
+ */
+static uint32_t segment_free_next(const struct lsfs_segment_table *table, uint32_t start)
+{
+    uint32_t words = (table->count + 63) / 64;
 
-    if (table->free_count == 0) {
-        pthread_mutex_unlock(&table->lock);
-        return LSFS_ERR_NOSPC;
+    if (start >= table->count) {
+        start = 0;
     }
 
-    /* Find a free segment */
-    for (uint32_t i = 0; i < table->count; i++) {
-        if (table->entries[i].state == LSFS_SEG_FREE) {
-            table->entries[i].state = LSFS_SEG_ACTIVE;
-            table->entries[i].segment_id = i;
-            table->entries[i].live_blocks = 0;
-            table->entries[i].timestamp = (uint64_t)time(NULL);
-            table->free_count--;
-            ctx->sb.free_segments = table->free_count;
-
-            *segment_id = i;
-            pthread_mutex_unlock(&table->lock);
-
-            LSFS_DEBUG("Allocated segment %u (free: %u)", i, table->free_count);
-            return LSFS_OK;
+    /* Finish the starting word, then whole words, then the wrapped part */
+    uint32_t w = start / 64;
+    uint64_t bits = table->free_map[w] & (~0ULL << (start % 64));
+    for (uint32_t n = 0; n <= words; n++) {
+        if (bits != 0) {
+            return w * 64 + (uint32_t)__builtin_ctzll(bits);
         }
+        w = (w + 1) % words;
+        bits = table->free_map[w];
     }
 
-    pthread_mutex_unlock(&table->lock);
-    return LSFS_ERR_NOSPC;
+    return LSFS_SEGMENT_NONE;
 }
 
 /*
- * Free a segment
+ * Count the free segments, including those waiting for a checkpoint or a
+ * discard
+ * Call with the table lock held.
  */
-int lsfs_segment_free(struct lsfs_context *ctx, uint32_t segment_id)
+uint32_t lsfs_segment_free_total(const struct lsfs_segment_table *table)
+{
+    return table->free_count + table->released_count + table->discard_count;
+}
+
+/*
+ * Check whether blocks files dropped wait for a checkpoint to be marked
+ * dead
+ * Caller must hold table->lock.
+ */
+static bool segment_dropped(const struct lsfs_segment_table *table)
+{
+    return table->dead.count > 0 || __atomic_load_n(&table->staged_dead, __ATOMIC_RELAXED) > 0;
+}
+
+/*
+ * Mark an emptied segment free
+ * Its usage entry is cleared at once, but the segment goes back on the
+ * free list only once a checkpoint taken after this has been written:
+ * until then the last checkpoint may still point into it, and
+ * roll-forward only looks for new writes in segments a checkpoint saw
+ * free.  Call with the table lock held.  Freeing a free segment does
+ * nothing.
+ */
+void lsfs_segment_release(struct lsfs_context *ctx, uint32_t segment_id)
 {
     struct lsfs_segment_table *table = &ctx->segtable;
+    struct lsfs_segment_usage *entry = &table->entries[segment_id];
 
-    if (segment_id >= table->count) {
-        return LSFS_ERR_INVAL;
+    if (entry->state == LSFS_SEG_FREE) {
+        return;
     }
 
-    pthread_mutex_lock(&table->lock);
+    entry->state = LSFS_SEG_FREE;
+    entry->live_blocks = 0;
+    entry->dead_slots = 0;
+    entry->packed_blocks = 0;
+    entry->packed_slots = 0;
+    entry->dead_packed = 0;
+    memset(entry->live_map, 0, sizeof(entry->live_map));
+    table->released[table->released_count++] = segment_id;
+    lsfs_segment_dirty(table, segment_id);
+    ctx->sb.free_segments = lsfs_segment_free_total(table);
+}
 
-    table->entries[segment_id].state = LSFS_SEG_FREE;
-    table->entries[segment_id].live_blocks = 0;
-    table->free_count++;
-    ctx->sb.free_segments = table->free_count;
+/*
+ * Wake writers waiting for a free segment
+ */
+static void segment_wake_writers(struct lsfs_context *ctx)
+{
+    pthread_mutex_lock(&ctx->segbuf.lock);
+    pthread_cond_broadcast(&ctx->segbuf.freed);
+    pthread_mutex_unlock(&ctx->segbuf.lock);
+}
 
-    pthread_mutex_unlock(&table->lock);
+/*
+ * Order segment IDs for qsort()
+ */
+static int segment_id_cmp(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
 
-    LSFS_DEBUG("Freed segment %u (free: %u)", segment_id, table->free_count);
-    return LSFS_OK;
+    return (x > y) - (x < y);
 }
 
 /*
- * Append a block to the current segment
- * Returns the absolute block address, or 0 on failure
+ * Discard the segments queued so far and put them on the free list
+ * The batch is sorted so neighbours go to the device as one range.  A
+ * failed discard only costs the space; one the image does not support
+ * turns discarding off.  Segments queued meanwhile are left for the next
+ * batch.  Runs in the discard thread, or in the caller while it is not
+ * running.
  */
-uint64_t lsfs_segment_append_block(struct lsfs_context *ctx, const void *data,
-                                   uint32_t ino, uint32_t offset, uint8_t type)
+static void segment_discard_batch(struct lsfs_context *ctx)
 {
-    struct lsfs_segment_buffer *segbuf = &ctx->segbuf;
-    uint64_t block_addr;
+    struct lsfs_segment_table *table = &ctx->segtable;
+    uint32_t *batch = table->discard_batch;
+    uint32_t count;
 
-    pthread_mutex_lock(&segbuf->lock);
+    pthread_mutex_lock(&table->lock);
+    count = table->discard_count;
+    memcpy(batch, table->discard, count * sizeof(uint32_t));
+    pthread_mutex_unlock(&table->lock);
 
-    /* Check if segment is full */
-    if (segbuf->block_count >= LSFS_SEGMENT_BLOCKS) {
-        /* Flush current segment */
-        pthread_mutex_unlock(&segbuf->lock);
-        if (lsfs_segment_flush(ctx) != LSFS_OK) {
-            return 0;
-        }
-        pthread_mutex_lock(&segbuf->lock);
+    if (count == 0) {
+        return;
     }
 
-    /* Copy data to segment buffer */
-    uint32_t block_idx = segbuf->block_count;
-    memcpy(segbuf->data + block_idx * LSFS_BLOCK_SIZE, data, LSFS_BLOCK_SIZE);
+    qsort(batch, count, sizeof(uint32_t), segment_id_cmp);
 
-    /* Record block info */
-    segbuf->block_info[block_idx].ino = ino;
-    segbuf->block_info[block_idx].offset = offset;
-    segbuf->block_info[block_idx].type = type;
-
-    /* Calculate block address */
-    block_addr = lsfs_segment_to_block(segbuf->segment_id, block_idx);
+    bool supported = true;
+    uint32_t ranges = 0;
+    for (uint32_t i = 0; i < count && supported; ranges++) {
+        uint32_t run = 1;
+        while (i + run < count && batch[i + run] == batch[i] + run) {
+            run++;
+        }
 
-    segbuf->block_count++;
-    ctx->writes_since_checkpoint++;
+        if (lsfs_io_discard(ctx, lsfs_segment_to_block(ctx, batch[i], 0),
+                            (uint64_t)run * table->segment_blocks) == LSFS_ERR_INVAL) {
+            LSFS_INFO("Disk image does not support discard, turning it off");
+            supported = false;
+        }
+        i += run;
+    }
 
-    pthread_mutex_unlock(&segbuf->lock);
+    pthread_mutex_lock(&table->lock);
+    for (uint32_t i = 0; i < count; i++) {
+        segment_free_push(table, table->discard[i]);
+    }
+    table->discard_count -= count;
+    memmove(table->discard, table->discard + count, table->discard_count * sizeof(uint32_t));
+    table->discarded += count;
+    if (!supported) {
+        ctx->discard = false;
+    }
+    ctx->sb.free_segments = lsfs_segment_free_total(table);
+    pthread_mutex_unlock(&table->lock);
 
-    LSFS_DEBUG("Appended block %" PRIu64 " (seg %u, off %u, ino %u)",
-               block_addr, segbuf->segment_id, block_idx, ino);
+    segment_wake_writers(ctx);
 
-    return block_addr;
+    LSFS_DEBUG("Discarded %u segments in %u ranges", count, ranges);
 }
 
 /*
- * Flush the segment buffer to disk
+ * Discard thread
+ * Sleeps until segments are queued and discards everything queued by the
+ * time it wakes as one batch.  Drains the queue before it stops.
  */
-int lsfs_segment_flush(struct lsfs_context *ctx)
+static void *segment_discard_func(void *arg)
 {
-    struct lsfs_segment_buffer *segbuf = &ctx->segbuf;
+    struct lsfs_context *ctx = (struct lsfs_context *)arg;
     struct lsfs_segment_table *table = &ctx->segtable;
-    int ret;
 
-    pthread_mutex_lock(&segbuf->lock);
-    pthread_mutex_lock(&ctx->write_lock);
+    pthread_mutex_lock(&table->lock);
+    while (1) {
+        while (table->discard_running && table->discard_count == 0) {
+            pthread_cond_wait(&table->discard_wake, &table->lock);
+        }
+        if (table->discard_count == 0) {
+            break;
+        }
+        pthread_mutex_unlock(&table->lock);
+        segment_discard_batch(ctx);
+        pthread_mutex_lock(&table->lock);
+    }
+    pthread_mutex_unlock(&table->lock);
 
-    if (segbuf->block_count <= 1) {
-        /* Nothing to flush (only header block) */
-        pthread_mutex_unlock(&ctx->write_lock);
-        pthread_mutex_unlock(&segbuf->lock);
+    return NULL;
+}
+
+/*
+ * Start the discard thread
+ * Until it runs, segments are discarded by whoever makes them reusable.
+ */
+int lsfs_segment_discard_start(struct lsfs_context *ctx)
+{
+    struct lsfs_segment_table *table = &ctx->segtable;
+
+    if (!ctx->discard) {
         return LSFS_OK;
     }
 
-    /* Prepare segment header */
-    struct lsfs_segment_summary *summary = (struct lsfs_segment_summary *)segbuf->data;
-    summary->header.magic = LSFS_SEGMENT_MAGIC;
-    summary->header.segment_id = segbuf->segment_id;
-    summary->header.timestamp = (uint64_t)time(NULL);
-    summary->header.block_count = segbuf->block_count;
-    summary->header.checksum = 0;  /* TODO: Calculate CRC32 */
+    pthread_mutex_lock(&table->lock);
+    table->discard_running = true;
+    pthread_mutex_unlock(&table->lock);
 
-    /* Copy block info to segment header */
-    size_t info_size = (segbuf->block_count - 1) * sizeof(struct lsfs_block_info);
-    if (sizeof(struct lsfs_segment_header) + info_size <= LSFS_BLOCK_SIZE) {
-        memcpy(summary->blocks, segbuf->block_info + 1, info_size);
+    if (pthread_create(&table->discard_thread, NULL, segment_discard_func, ctx) != 0) {
+        pthread_mutex_lock(&table->lock);
+        table->discard_running = false;
+        pthread_mutex_unlock(&table->lock);
+        return LSFS_ERR_NOMEM;
     }
 
-    /* Write segment to disk */
-    uint64_t start_block = lsfs_segment_to_block(segbuf->segment_id, 0);
-    ret = lsfs_write_blocks(ctx, start_block, segbuf->block_count, segbuf->data);
+    return LSFS_OK;
+}
 
-    if (ret != LSFS_OK) {
-        LSFS_ERROR("Failed to write segment %u", segbuf->segment_id);
-        pthread_mutex_unlock(&ctx->write_lock);
-        pthread_mutex_unlock(&segbuf->lock);
-        return ret;
+/*
+ * Stop the discard thread once it has discarded everything queued
+ */
+void lsfs_segment_discard_stop(struct lsfs_context *ctx)
+{
+    struct lsfs_segment_table *table = &ctx->segtable;
+
+    pthread_mutex_lock(&table->lock);
+    bool running = table->discard_running;
+    table->discard_running = false;
+    pthread_cond_signal(&table->discard_wake);
+    pthread_mutex_unlock(&table->lock);
+
+    if (running) {
+        pthread_join(table->discard_thread, NULL);
+    }
+}
+
+/*
+ * Put the first count released segments back on the free list
+ * Called once a checkpoint that saw them free is on disk.  With discard
+ * on they are queued for the discard thread instead, which frees them
+ * once the device has been told, or discarded here while it is not
+ * running.  Writers waiting for a segment are woken.
+ */
+void lsfs_segment_reuse(struct lsfs_context *ctx, uint32_t count)
+{
+    struct lsfs_segment_table *table = &ctx->segtable;
+
+    if (count == 0) {
+        return;
     }
 
-    /* Update segment table */
     pthread_mutex_lock(&table->lock);
-    table->entries[segbuf->segment_id].state = LSFS_SEG_FULL;
-    table->entries[segbuf->segment_id].live_blocks = segbuf->block_count - 1;
-    table->entries[segbuf->segment_id].timestamp = summary->header.timestamp;
+    bool discard = ctx->discard;
+    for (uint32_t i = 0; i < count; i++) {
+        if (discard) {
+            table->discard[table->discard_count++] = table->released[i];
+        } else {
+            segment_free_push(table, table->released[i]);
+        }
+    }
+    table->released_count -= count;
+    memmove(table->released, table->released + count,
+            table->released_count * sizeof(uint32_t));
+    ctx->sb.free_segments = lsfs_segment_free_total(table);
+    bool queued = discard && table->discard_running;
+    if (queued) {
+        pthread_cond_signal(&table->discard_wake);
+    }
     pthread_mutex_unlock(&table->lock);
 
-    /* Update log head */
-    ctx->sb.log_head = start_block + segbuf->block_count;
+    if (!discard) {
+        segment_wake_writers(ctx);
+    } else if (!queued) {
+        segment_discard_batch(ctx);
+    }
 
-    LSFS_DEBUG("Flushed segment %u (%u blocks)", segbuf->segment_id, segbuf->block_count);
+    LSFS_DEBUG("Reusing %u cleaned segments", count);
+}
 
-    /* Allocate new segment */
-    uint32_t new_segment_id;
-    if (lsfs_segment_alloc(ctx, &new_segment_id) != LSFS_OK) {
-        LSFS_ERROR("Failed to allocate new segment after flush");
-        /* Trigger GC */
-        lsfs_gc_trigger(ctx);
-    } else {
-        segbuf->segment_id = new_segment_id;
+/*
+ * Take a segment off the free list without allocating it
+ * Call with the table lock held; the caller sets the new state.
+ */
+void lsfs_segment_mark_used(struct lsfs_segment_table *table, uint32_t segment_id)
+{
+    if (segment_is_free(table, segment_id)) {
+        segment_free_unlink(table, segment_id);
     }
+}
 
-    /* Reset buffer */
-    memset(segbuf->data, 0, LSFS_SEGMENT_SIZE);
-    memset(segbuf->block_info, 0, LSFS_SEGMENT_BLOCKS * sizeof(struct lsfs_block_info));
-    segbuf->block_count = 1;
+/*
+ * Free the free segment list
+ */
+static void segment_free_set_destroy(struct lsfs_segment_table *table)
+{
+    free(table->free_map);
+    free(table->free_next);
+    free(table->free_prev);
+    free(table->released);
+    free(table->discard);
+    free(table->discard_batch);
+    table->free_map = NULL;
+    table->free_next = NULL;
+    table->free_prev = NULL;
+    table->released = NULL;
+    table->discard = NULL;
+    table->discard_batch = NULL;
+}
 
-    /* Check if checkpoint is needed */
-    if (lsfs_checkpoint_needed(ctx)) {
-        pthread_mutex_unlock(&ctx->write_lock);
-        pthread_mutex_unlock(&segbuf->lock);
-        lsfs_checkpoint_write(ctx);
-        return LSFS_OK;
+/*
+ * Build the free segment list from the loaded table
+ * Free segments are listed in ID order, and sequential allocation
+ * resumes after the segment holding the log head.
+ */
+static int segment_free_set_init(struct lsfs_context *ctx)
+{
+    struct lsfs_segment_table *table = &ctx->segtable;
+
+    table->free_map = calloc((table->count + 63) / 64, sizeof(uint64_t));
+    table->free_next = malloc(table->count * sizeof(uint32_t));
+    table->free_prev = malloc(table->count * sizeof(uint32_t));
+    table->released = malloc(table->count * sizeof(uint32_t));
+    table->discard = malloc(table->count * sizeof(uint32_t));
+    table->discard_batch = malloc(table->count * sizeof(uint32_t));
+    if (!table->free_map || !table->free_next || !table->free_prev || !table->released ||
+        !table->discard || !table->discard_batch) {
+        segment_free_set_destroy(table);
+        return LSFS_ERR_NOMEM;
     }
 
-    pthread_mutex_unlock(&ctx->write_lock);
-    pthread_mutex_unlock(&segbuf->lock);
+    table->free_first = LSFS_SEGMENT_NONE;
+    table->free_last = LSFS_SEGMENT_NONE;
+    table->free_count = 0;
+    table->released_count = 0;
+    table->discard_count = 0;
+    table->discarded = 0;
+    table->discard_running = false;
+    table->prealloc_blocks = 0;
+    for (uint32_t i = 0; i < table->count; i++) {
+        if (table->entries[i].state == LSFS_SEG_FREE) {
+            segment_free_push(table, i);
+        }
+    }
+
+    uint32_t head_segment, offset;
+    lsfs_block_to_segment(ctx, ctx->sb.log_head, &head_segment, &offset);
+    table->alloc_cursor = (head_segment + 1) % table->count;
 
     return LSFS_OK;
 }
+
+/*
+ * Free the usage entries and their dirty bitmaps
+ */
+static void segment_table_free(struct lsfs_segment_table *table)
+{
+    free(table->entries);
+    free(table->dirty[0]);
+    free(table->dirty[1]);
+    lsfs_gc_dead_list_free(&table->dead);
+    table->entries = NULL;
+    table->dirty[0] = NULL;
+    table->dirty[1] = NULL;
+}
+
+/*
+ * Initialize segment table from disk
+ * The copy read is the one of the checkpoint lsfs_checkpoint_select()
+ * made current.  The other region's copy is older, so every block of it
+ * is stale.
+ */
+int lsfs_segment_init(struct lsfs_context *ctx)
+{
+    struct lsfs_segment_table *table = &ctx->segtable;
+    uint32_t num_segments = (uint32_t)ctx->sb.total_segments;
+
+    /* Initialize segment buffer */
+    if (lsfs_segment_buffer_init(&ctx->segbuf) != LSFS_OK) {
+        return LSFS_ERR_NOMEM;
+    }
+
+    /* Allocate segment table, rounded up to whole blocks of the region */
+    table->count = num_segments;
+    table->free_count = 0;
+    table->segment_blocks = ctx->sb.segment_size;
+    table->log_start = ctx->sb.log_start;
+    table->table_blocks = (uint32_t)ctx->sb.segtable_blocks;
+    table->alloc_policy = ctx->segment_alloc;
+
+    uint32_t region = ctx->sb.active_checkpoint & 1;
+    uint32_t dirty_words = LSFS_DIV_ROUND_UP(table->table_blocks, 64);
+
+    table->entries = calloc(table->table_blocks, LSFS_BLOCK_SIZE);
+    table->dirty[0] = calloc(dirty_words, sizeof(uint64_t));
+    table->dirty[1] = calloc(dirty_words, sizeof(uint64_t));
+    if (!table->entries || !table->dirty[0] || !table->dirty[1]) {
+        segment_table_free(table);
+        lsfs_segment_buffer_destroy(&ctx->segbuf);
+        return LSFS_ERR_NOMEM;
+    }
+
+    if (pthread_mutex_init(&table->lock, NULL) != 0) {
+        segment_table_free(table);
+        lsfs_segment_buffer_destroy(&ctx->segbuf);
+        return LSFS_ERR_NOMEM;
+    }
+
+    if (pthread_cond_init(&table->discard_wake, NULL) != 0) {
+        pthread_mutex_destroy(&table->lock);
+        segment_table_free(table);
+        lsfs_segment_buffer_destroy(&ctx->segbuf);
+        return LSFS_ERR_NOMEM;
+    }
+
+    for (uint32_t i = 0; i < table->table_blocks; i++) {
+        table->dirty[region ^ 1][i / 64] |= 1ULL << (i % 64);
+    }
+
+    /* Read segment usage table from disk */
+    if (lsfs_read_blocks(ctx, lsfs_sb_segtable_block(&ctx->sb, region), table->table_blocks,
+                         table->entries) == LSFS_OK) {
+        /* Segments that were still open or being cleaned are closed, and
+         * freed if nothing in them is live */
+        for (uint32_t i = 0; i < num_segments; i++) {
+            struct lsfs_segment_usage *entry = &table->entries[i];
+
+            if (entry->state == LSFS_SEG_ACTIVE || entry->state == LSFS_SEG_CLEANING) {
+                entry->state = entry->live_blocks > 0 ? LSFS_SEG_FULL : LSFS_SEG_FREE;
+                lsfs_segment_dirty(table, i);
+            }
+        }
+    } else {
+        memset(table->entries, 0, (size_t)table->table_blocks * LSFS_BLOCK_SIZE);
+        for (uint32_t i = 0; i < num_segments; i++) {
+            table->entries[i].segment_id = i;
+        }
+    }
+
+    /* List the free segments */
+    if (segment_free_set_init(ctx) != LSFS_OK) {
+        pthread_cond_destroy(&table->discard_wake);
+        pthread_mutex_destroy(&table->lock);
+        segment_table_free(table);
+        lsfs_segment_buffer_destroy(&ctx->segbuf);
+        return LSFS_ERR_NOMEM;
+    }
+    ctx->sb.free_segments = table->free_count;
+
+    /* Rank the full segments for the cleaner */
+    if (lsfs_gc_victims_init(table) != LSFS_OK) {
+        segment_free_set_destroy(table);
+        pthread_cond_destroy(&table->discard_wake);
+        pthread_mutex_destroy(&table->lock);
+        segment_table_free(table);
+        lsfs_segment_buffer_destroy(&ctx->segbuf);
+        return LSFS_ERR_NOMEM;
+    }
+
+    LSFS_INFO("Segment table initialized: %u segments, %u free",
+              table->count, table->free_count);
+
+    return LSFS_OK;
+}
+
+/*
+ * Start the writer that persists sealed segments
+ * Kept apart from lsfs_segment_init() so that it can be started again
+ * after fuse_daemonize() forks, which keeps only the calling thread.  Does
+ * nothing if the writer is running already.
+ */
+int lsfs_segment_writer_start(struct lsfs_context *ctx)
+{
+    struct lsfs_segment_buffer *segbuf = &ctx->segbuf;
+
+    if (segbuf->writer_running) {
+        return LSFS_OK;
+    }
+
+    segbuf->writer_running = true;
+    if (pthread_create(&segbuf->writer, NULL, segment_writer_func, ctx) != 0) {
+        segbuf->writer_running = false;
+        return LSFS_ERR_NOMEM;
+    }
+
+    return LSFS_OK;
+}
+
+/*
+ * Stop the writer once everything queued has been written
+ * Segments still being filled stay in the buffer; flushing them first is
+ * up to the caller.
+ */
+void lsfs_segment_writer_stop(struct lsfs_context *ctx)
+{
+    struct lsfs_segment_buffer *segbuf = &ctx->segbuf;
+
+    pthread_mutex_lock(&segbuf->lock);
+    if (!segbuf->writer_running) {
+        pthread_mutex_unlock(&segbuf->lock);
+        return;
+    }
+    segbuf->writer_running = false;
+    pthread_cond_signal(&segbuf->queued);
+    pthread_mutex_unlock(&segbuf->lock);
+    pthread_join(segbuf->writer, NULL);
+}
+
+/*
+ * Destroy segment table
+ */
+void lsfs_segment_destroy(struct lsfs_context *ctx)
+{
+    struct lsfs_segment_buffer *segbuf = &ctx->segbuf;
+
+    /* Let the last discards land */
+    lsfs_segment_discard_stop(ctx);
+
+    /* Flush current segment buffer and wait for the queue to drain */
+    lsfs_segment_flush(ctx);
+    lsfs_segment_writer_stop(ctx);
+
+    if (segbuf->queue_len > 0) {
+        LSFS_ERROR("%u sealed segments could not be written", segbuf->queue_len);
+    }
+
+    /* The table went to disk with the last checkpoint, paired with the
+     * inode map; one written apart from it could be newer than the map */
+    lsfs_segment_buffer_destroy(segbuf);
+    segment_table_free(&ctx->segtable);
+
+    lsfs_gc_victims_destroy(&ctx->segtable);
+    segment_free_set_destroy(&ctx->segtable);
+
+    pthread_cond_destroy(&ctx->segtable.discard_wake);
+    pthread_mutex_destroy(&ctx->segtable.lock);
+}
+
+/*
+ * Record a change to a segment's usage entry
+ * Marks the segment table block holding it for the next checkpoint into
+ * each region and repositions the segment among the cleaner's
+ * candidates.  Caller must hold table->lock.
+ */
+void lsfs_segment_dirty(struct lsfs_segment_table *table, uint32_t segment_id)
+{
+    uint32_t block = segment_id / LSFS_SEGTABLE_ENTRIES_PER_BLOCK;
+
+    table->dirty[0][block / 64] |= 1ULL << (block % 64);
+    table->dirty[1][block / 64] |= 1ULL << (block % 64);
+    lsfs_gc_victim_update(table, segment_id);
+}
+
+/*
+ * Mark count blocks of a segment live, starting at segment block first
+ * Blocks count as live from the moment they are handed out, so a block
+ * that dies while its segment is still buffered is accounted for.
+ */
+static void segment_mark_live(struct lsfs_context *ctx, uint32_t segment_id,
+                              uint32_t first, uint32_t count)
+{
+    struct lsfs_segment_table *table = &ctx->segtable;
+    struct lsfs_segment_usage *entry = &table->entries[segment_id];
+
+    pthread_mutex_lock(&table->lock);
+    for (uint32_t i = first; i < first + count; i++) {
+        if (!(entry->live_map[i / 64] & (1ULL << (i % 64)))) {
+            entry->live_map[i / 64] |= 1ULL << (i % 64);
+            entry->live_blocks++;
+        }
+    }
+    table->appended += count;
+    lsfs_segment_dirty(table, segment_id);
+    pthread_mutex_unlock(&table->lock);
+}
+
+/*
+ * Allocate a free segment, leaving at least keep segments free
+ * The cleaner is woken once free segments run low.  Caller must hold
+ * segbuf.lock, so every write to the segment comes after seal_seq.
+ */
+int lsfs_segment_alloc(struct lsfs_context *ctx, uint32_t *segment_id, uint32_t keep)
+{
+    struct lsfs_segment_table *table = &ctx->segtable;
+
+    pthread_mutex_lock(&table->lock);
+
+    if (table->free_count <= keep) {
+        pthread_mutex_unlock(&table->lock);
+        return LSFS_ERR_NOSPC;
+    }
+
+    /* Take the next segment the allocation policy asks for */
+    uint32_t i;
+    if (table->alloc_policy == LSFS_ALLOC_LRF) {
+        i = table->free_first;
+    } else {
+        i = segment_free_next(table, table->alloc_cursor);
+        table->alloc_cursor = (i + 1) % table->count;
+    }
+    segment_free_unlink(table, i);
+
+    table->entries[i].state = LSFS_SEG_ACTIVE;
+    table->entries[i].segment_id = i;
+    table->entries[i].live_blocks = 0;
+    table->entries[i].dead_slots = 0;
+    table->entries[i].packed_blocks = 0;
+    table->entries[i].packed_slots = 0;
+    table->entries[i].dead_packed = 0;
+    table->entries[i].timestamp = (uint64_t)time(NULL);
+    table->entries[i].sequence = ctx->segbuf.seal_seq + 1;
+    memset(table->entries[i].live_map, 0, sizeof(table->entries[i].live_map));
+    lsfs_segment_dirty(table, i);
+    ctx->sb.free_segments = lsfs_segment_free_total(table);
+
+    *segment_id = i;
+    pthread_mutex_unlock(&table->lock);
+
+    LSFS_DEBUG("Allocated segment %u (free: %u)", i, table->free_count);
+    if (lsfs_gc_needed(ctx)) {
+        lsfs_gc_trigger(ctx);
+    }
+    return LSFS_OK;
+}
+
+/*
+ * Free a segment
+ */
+int lsfs_segment_free(struct lsfs_context *ctx, uint32_t segment_id)
+{
+    struct lsfs_segment_table *table = &ctx->segtable;
+
+    if (segment_id >= table->count) {
+        return LSFS_ERR_INVAL;
+    }
+
+    pthread_mutex_lock(&table->lock);
+    lsfs_segment_release(ctx, segment_id);
+    pthread_mutex_unlock(&table->lock);
+
+    lsfs_buffer_invalidate_range(ctx, lsfs_segment_to_block(ctx, segment_id, 0),
+                                 table->segment_blocks);
+
+    LSFS_DEBUG("Freed segment %u (free: %u)", segment_id, table->free_count);
+    return LSFS_OK;
+}
+
+/*
+ * Work out when a writer waiting for the cleaner gives up
+ */
+static void segment_wait_deadline(struct timespec *deadline)
+{
+    clock_gettime(CLOCK_REALTIME, deadline);
+    deadline->tv_sec += LSFS_GC_ALLOC_WAIT_MS / 1000;
+    deadline->tv_nsec += (LSFS_GC_ALLOC_WAIT_MS % 1000) * 1000000L;
+    if (deadline->tv_nsec >= 1000000000L) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000L;
+    }
+}
+
+/*
+ * Count the segments promised to preallocated files
+ * Rounded up, so a promise partly written still holds a whole segment.
+ */
+uint32_t lsfs_segment_prealloc_count(const struct lsfs_segment_table *table)
+{
+    uint64_t blocks = __atomic_load_n(&table->prealloc_blocks, __ATOMIC_RELAXED);
+
+    return (uint32_t)LSFS_DIV_ROUND_UP(blocks, table->segment_blocks - LSFS_SUMMARY_BLOCKS);
+}
+
+/*
+ * Count the segments promised to files other than the calling thread's
+ */
+static uint32_t segment_prealloc_others(const struct lsfs_segment_table *table)
+{
+    uint64_t blocks = __atomic_load_n(&table->prealloc_blocks, __ATOMIC_RELAXED);
+
+    blocks -= LSFS_MIN(blocks, segment_promised);
+    return (uint32_t)LSFS_DIV_ROUND_UP(blocks, table->segment_blocks - LSFS_SUMMARY_BLOCKS);
+}
+
+/*
+ * Wait until file data could open a segment with the reserve and every
+ * promise held back
+ * Segments the cleaner freed count, since the next checkpoint gives them
+ * back.  Waits for as long as the cleaners make progress, and returns
+ * LSFS_ERR_NOSPC once they cannot free enough.  Caller must hold
+ * segbuf.lock and no inode lock, which the cleaner may need.
+ */
+static int segment_wait_space_locked(struct lsfs_context *ctx)
+{
+    struct lsfs_segment_table *table = &ctx->segtable;
+    struct lsfs_segment_buffer *segbuf = &ctx->segbuf;
+    uint32_t last = 0;
+    bool waited = false;
+    int ret = LSFS_OK;
+
+    while (1) {
+        pthread_mutex_lock(&table->lock);
+        uint32_t free_count = lsfs_segment_free_total(table);
+        uint32_t needed = LSFS_GC_RESERVE_SEGMENTS + lsfs_segment_prealloc_count(table);
+        bool kick = table->released_count > 0 || segment_dropped(table);
+        pthread_mutex_unlock(&table->lock);
+
+        if (free_count > needed) {
+            break;
+        }
+        if (needed >= table->count || (waited && free_count <= last) ||
+            !lsfs_gc_pending(ctx)) {
+            ret = LSFS_ERR_NOSPC;
+            break;
+        }
+
+        /* Cleaned segments come back with the next checkpoint, and dropped
+         * blocks become cleanable with it */
+        lsfs_gc_trigger(ctx);
+        if (kick) {
+            lsfs_checkpoint_kick(ctx);
+        }
+
+        struct timespec deadline;
+        segment_wait_deadline(&deadline);
+        pthread_cond_timedwait(&segbuf->freed, &segbuf->lock, &deadline);
+        last = free_count;
+        waited = true;
+    }
+
+    return ret;
+}
+
+/*
+ * Wait for the cleaner before writing file data, if it is short of space
+ * Writers call this before taking the inode lock: a writer that runs into
+ * the reserve while appending waits with the lock held, and the cleaner
+ * then cannot move that file's blocks, which may be the very ones it has
+ * to move to free a segment.  Only advisory; a write that still finds no
+ * space fails on its own.
+ */
+void lsfs_segment_wait_space(struct lsfs_context *ctx)
+{
+    struct lsfs_segment_table *table = &ctx->segtable;
+    bool low;
+
+    pthread_mutex_lock(&table->lock);
+    low = lsfs_segment_free_total(table) <=
+          LSFS_GC_RESERVE_SEGMENTS + lsfs_segment_prealloc_count(table);
+    pthread_mutex_unlock(&table->lock);
+
+    if (low) {
+        pthread_mutex_lock(&ctx->segbuf.lock);
+        segment_wait_space_locked(ctx);
+        pthread_mutex_unlock(&ctx->segbuf.lock);
+    }
+}
+
+/*
+ * Promise blocks of log space to a file about to be written
+ * Succeeds once file data could still open a segment with every promise
+ * made so far held back, so the writes it covers cannot run out of
+ * space.  The promise counts from the start, which has the cleaners free
+ * segments for it before the writes instead of in the middle of them, and
+ * the caller waits for as long as they make progress.  Returns
+ * LSFS_ERR_NOSPC, promising nothing, if they cannot free enough.  The
+ * caller must not hold an inode lock, which the cleaner may need.
+ */
+int lsfs_segment_prealloc(struct lsfs_context *ctx, uint64_t blocks)
+{
+    struct lsfs_segment_table *table = &ctx->segtable;
+    int ret;
+
+    if (blocks == 0) {
+        return LSFS_OK;
+    }
+
+    __atomic_add_fetch(&table->prealloc_blocks, blocks, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&ctx->segbuf.lock);
+    ret = segment_wait_space_locked(ctx);
+    pthread_mutex_unlock(&ctx->segbuf.lock);
+
+    if (ret != LSFS_OK) {
+        __atomic_sub_fetch(&table->prealloc_blocks, blocks, __ATOMIC_RELAXED);
+    }
+    return ret;
+}
+
+/*
+ * Give back blocks promised by lsfs_segment_prealloc()
+ * Writers held back by the promise are woken once it stops holding a
+ * segment.
+ */
+void lsfs_segment_prealloc_release(struct lsfs_context *ctx, uint64_t blocks)
+{
+    struct lsfs_segment_table *table = &ctx->segtable;
+
+    if (blocks == 0) {
+        return;
+    }
+
+    uint32_t before = lsfs_segment_prealloc_count(table);
+    __atomic_sub_fetch(&table->prealloc_blocks, blocks, __ATOMIC_RELAXED);
+    if (lsfs_segment_prealloc_count(table) < before) {
+        segment_wake_writers(ctx);
+    }
+}
+
+/*
+ * Pick the stream a block of the given type is appended to
+ * File data has a stream of its own, compressed or not; everything else
+ * is metadata.
+ */
+static uint32_t segment_stream_for(uint8_t type)
+{
+    return type == LSFS_BLOCK_TYPE_DATA || type == LSFS_BLOCK_TYPE_PACKED ? LSFS_STREAM_DATA
+                                                                           : LSFS_STREAM_META;
+}
+
+/*
+ * Find the stream whose open segment holds a block
+ * Returns NULL if the block is not in an open segment.  Caller must hold
+ * segbuf->lock.
+ */
+static struct lsfs_segment_stream *segment_stream_of(struct lsfs_context *ctx,
+                                                     uint64_t block)
+{
+    struct lsfs_segment_buffer *segbuf = &ctx->segbuf;
+    uint32_t segment_id, offset;
+
+    lsfs_block_to_segment(ctx, block, &segment_id, &offset);
+    for (uint32_t i = 0; i < LSFS_STREAM_COUNT; i++) {
+        if (segbuf->streams[i].segment_id == segment_id) {
+            return &segbuf->streams[i];
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Get the number of blocks a stream's open segment can be filled to
+ * Once a summary has been written while the segment is open, its last
+ * LSFS_SUMMARY_BLOCKS blocks are kept for the other copy of the summary.
+ */
+static uint32_t segment_stream_limit(const struct lsfs_context *ctx,
+                                     const struct lsfs_segment_stream *stream)
+{
+    uint32_t blocks = ctx->segtable.segment_blocks;
+
+    return stream->flushed > LSFS_SUMMARY_BLOCKS ? LSFS_SUMMARY_TAIL(blocks) : blocks;
+}
+
+/*
+ * Find a stream other than the given one whose open segment has room
+ * Used when no free segment is left to open a stream with, so the last
+ * segments can still be filled.  The metadata segment is left to
+ * metadata, which the checkpoint that frees cleaned segments needs room
+ * for, and the cleaner's segment to the cleaner.  Caller must hold
+ * segbuf->lock.
+ */
+static struct lsfs_segment_stream *segment_stream_spare(struct lsfs_context *ctx,
+                                                        uint32_t stream_id, bool cleaner)
+{
+    for (uint32_t i = 0; i < LSFS_STREAM_COUNT; i++) {
+        struct lsfs_segment_stream *stream = &ctx->segbuf.streams[i];
+
+        if (i != stream_id && i != LSFS_STREAM_META && (cleaner || i != LSFS_STREAM_GC) &&
+            stream->segment_id != LSFS_SEGMENT_NONE &&
+            stream->block_count < segment_stream_limit(ctx, stream)) {
+            return stream;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Find a stream other than metadata with blocks not handed to the writer
+ * Caller must hold segbuf->lock.
+ */
+static int segment_stream_unsealed(struct lsfs_segment_buffer *segbuf)
+{
+    for (uint32_t i = 0; i < LSFS_STREAM_COUNT; i++) {
+        if (i != LSFS_STREAM_META &&
+            segbuf->streams[i].segment_id != LSFS_SEGMENT_NONE &&
+            segbuf->streams[i].block_count > segbuf->streams[i].flushed) {
+            return (int)i;
+        }
+    }
+
+    return -1;
+}
+
+/*
+ * Hand a stream's new blocks to the writer thread
+ * Waits for outstanding reservations and for a free queue slot, which is
+ * where writers feel backpressure when the device falls behind.  The
+ * metadata stream is only sealed once every other stream has been, so
+ * inodes and extent blocks never land ahead of the data they point at.
+ *
+ * A full segment, or one the caller wants closed, is swapped into the
+ * queue whole and the stream opens a fresh segment on its next append.
+ * Otherwise only the summary and the blocks added since the last seal are
+ * copied to the queue and the stream keeps filling the same segment, so a
+ * flush does not cost a segment per stream.  Blocks already written are
+ * never changed again: the open inode and packed blocks are given up
+ * here.  Nor is a summary that may be on disk: the first one goes to the
+ * start of the segment, and later ones alternate between its last blocks
+ * and its start, so a torn write leaves the previous copy intact.  Caller
+ * must hold segbuf->lock.
+ */
+static int segment_seal_locked(struct lsfs_context *ctx, uint32_t stream_id, bool close)
+{
+    struct lsfs_segment_buffer *segbuf = &ctx->segbuf;
+    struct lsfs_segment_stream *stream = &segbuf->streams[stream_id];
+    int other;
+
+    while (1) {
+        /* Wait for reserved slots to be filled before sealing */
+        while (stream->reserved > 0) {
+            pthread_cond_wait(&segbuf->drained, &segbuf->lock);
+        }
+
+        if (stream->segment_id == LSFS_SEGMENT_NONE ||
+            stream->block_count <= LSFS_SUMMARY_BLOCKS ||
+            (stream->block_count <= stream->flushed && !close)) {
+            /* Nothing to flush */
+            return LSFS_OK;
+        }
+
+        /* Waiting drops the lock, so check again after every seal */
+        if (stream_id == LSFS_STREAM_META &&
+            (other = segment_stream_unsealed(segbuf)) >= 0) {
+            int ret = segment_seal_locked(ctx, (uint32_t)other, false);
+            if (ret != LSFS_OK) {
+                return ret;
+            }
+            continue;
+        }
+
+        if (segbuf->queue_len < LSFS_FLUSH_QUEUE_DEPTH) {
+            break;
+        }
+        pthread_cond_wait(&segbuf->landed, &segbuf->lock);
+    }
+
+    /* A segment too full to keep its last blocks for the other summary
+     * copy is closed */
+    close = close ||
+            stream->block_count >= LSFS_SUMMARY_TAIL(ctx->segtable.segment_blocks);
+    bool tail = stream->flushed > LSFS_SUMMARY_BLOCKS && !stream->summary_tail;
+
+    /* Checksum the blocks added since the last seal, which are final now */
+    uint32_t crcs[LSFS_SEGMENT_BLOCKS];
+    uint32_t added = stream->block_count - stream->flushed;
+
+    lsfs_crc32c_blocks(stream->data + (size_t)stream->flushed * LSFS_BLOCK_SIZE, added, crcs);
+    for (uint32_t i = 0; i < added; i++) {
+        stream->block_info[stream->flushed + i].checksum = crcs[i];
+    }
+
+    /* Prepare segment header */
+    struct lsfs_segment_summary *summary = (struct lsfs_segment_summary *)stream->data;
+    summary->header.magic = LSFS_SEGMENT_MAGIC;
+    summary->header.segment_id = stream->segment_id;
+    summary->header.timestamp = (uint64_t)time(NULL);
+    summary->header.sequence = ++segbuf->seal_seq;
+    summary->header.block_count = stream->block_count;
+
+    /* Copy block info to the summary, which has room for every block */
+    memcpy(summary->blocks, stream->block_info + LSFS_SUMMARY_BLOCKS,
+           (stream->block_count - LSFS_SUMMARY_BLOCKS) * sizeof(struct lsfs_block_info));
+    summary->header.checksum = lsfs_summary_checksum(summary);
+
+    /* The next queue slot is clean */
+    struct lsfs_segment_pending *pending =
+        &segbuf->queue[(segbuf->queue_head + segbuf->queue_len) % LSFS_FLUSH_QUEUE_DEPTH];
+
+    pending->segment_id = stream->segment_id;
+    pending->block_count = stream->block_count;
+    pending->first_block = stream->flushed;
+    pending->final = close;
+    pending->summary_tail = tail;
+
+    if (close) {
+        uint8_t *data = pending->data;
+        struct lsfs_block_info *block_info = pending->block_info;
+
+        pending->data = stream->data;
+        pending->block_info = stream->block_info;
+        stream->data = data;
+        stream->block_info = block_info;
+    } else {
+        size_t first = (size_t)stream->flushed * LSFS_BLOCK_SIZE;
+
+        memcpy(pending->data, stream->data, (size_t)LSFS_SUMMARY_BLOCKS * LSFS_BLOCK_SIZE);
+        memcpy(pending->data + first, stream->data + first,
+               (size_t)stream->block_count * LSFS_BLOCK_SIZE - first);
+    }
+
+    segbuf->queue_len++;
+    segbuf->sealed_count++;
+    segbuf->sealed_head = lsfs_segment_to_block(ctx, stream->segment_id, stream->block_count);
+    pthread_cond_signal(&segbuf->queued);
+
+    LSFS_DEBUG("Sealed segment %u (blocks %u-%u, stream %u%s)", stream->segment_id,
+               stream->flushed, stream->block_count, stream_id, close ? ", closed" : "");
+
+    /* Reset buffer */
+    if (close) {
+        stream->segment_id = LSFS_SEGMENT_NONE;
+        stream->block_count = LSFS_SUMMARY_BLOCKS;
+        stream->flushed = LSFS_SUMMARY_BLOCKS;
+        stream->summary_tail = false;
+    } else {
+        stream->flushed = stream->block_count;
+        stream->summary_tail = tail;
+    }
+    stream->inode_block = 0;
+    stream->inode_slots = 0;
+    stream->packed_block = 0;
+
+    return LSFS_OK;
+}
+
+/*
+ * Make sure a stream has an open segment with room for a block
+ * Seals the stream's segment if it is full and opens a new one if it has
+ * none.  Only the cleaner may open the segments reserved for it, data or
+ * metadata; anything else waits for the cleaner to free a segment
+ * instead, for a while.  The cleaner waits likewise for segments it
+ * cleaned already to come back with the checkpoint.  Only a checkpoint
+ * that makes cleaned segments reusable may open the last free segment, so
+ * that checkpoint can always be written.  checkpoint says whether the
+ * caller is a checkpoint appending with segbuf->lock held since its cut;
+ * it never waits, as the cleaner frees nothing until it is done.  When no
+ * segment can be opened, another stream's open segment is filled instead.
+ * Returns the stream to append to, or NULL if there is no room anywhere.
+ * Caller must hold segbuf->lock, which is dropped while waiting.
+ */
+static struct lsfs_segment_stream *segment_stream_open(struct lsfs_context *ctx,
+                                                       uint32_t stream_id, bool checkpoint)
+{
+    struct lsfs_segment_buffer *segbuf = &ctx->segbuf;
+    struct lsfs_segment_stream *stream = &segbuf->streams[stream_id];
+    struct timespec deadline = { 0, 0 };
+    uint32_t last = 0;
+    bool cleaner = stream_id == LSFS_STREAM_GC || segment_cleaner;
+
+    while (1) {
+        /* Let whoever filled the segment seal it once its slots are released */
+        while (stream->block_count >= segment_stream_limit(ctx, stream) &&
+               stream->reserved > 0) {
+            pthread_cond_wait(&segbuf->drained, &segbuf->lock);
+        }
+
+        /* Check if segment is full; the writer thread persists it */
+        if (stream->block_count >= segment_stream_limit(ctx, stream)) {
+            if (segment_seal_locked(ctx, stream_id, true) != LSFS_OK) {
+                return NULL;
+            }
+            if (lsfs_checkpoint_needed(ctx)) {
+                lsfs_checkpoint_kick(ctx);
+            }
+        }
+
+        if (stream->segment_id != LSFS_SEGMENT_NONE) {
+            return stream;
+        }
+
+        /* Everything but the cleaner leaves the segments promised to
+         * preallocated files as well, other than its own */
+        uint32_t keep = checkpoint && segbuf->checkpointing ? 0 :
+                        cleaner ? 1 :
+                        LSFS_GC_RESERVE_SEGMENTS + segment_prealloc_others(&ctx->segtable);
+        if (lsfs_segment_alloc(ctx, &stream->segment_id, keep) == LSFS_OK) {
+            return stream;
+        }
+        stream->segment_id = LSFS_SEGMENT_NONE;
+        lsfs_gc_trigger(ctx);
+
+        /* Segments cleaned already come back with the next checkpoint, and
+         * blocks dropped since the last one only become cleanable with it */
+        pthread_mutex_lock(&ctx->segtable.lock);
+        bool released = ctx->segtable.released_count > 0;
+        bool dropped = segment_dropped(&ctx->segtable);
+        uint32_t free_count = lsfs_segment_free_total(&ctx->segtable);
+        pthread_mutex_unlock(&ctx->segtable.lock);
+        if (released || dropped) {
+            lsfs_checkpoint_kick(ctx);
+        }
+
+        if (checkpoint || (cleaner ? !released : !lsfs_gc_pending(ctx))) {
+            break;
+        }
+
+        /* Give the cleaner or the checkpoint a chance before failing, for
+         * as long as they keep freeing segments */
+        if (deadline.tv_sec == 0 || free_count > last) {
+            segment_wait_deadline(&deadline);
+            last = free_count;
+        }
+        if (pthread_cond_timedwait(&segbuf->freed, &segbuf->lock, &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+
+    return segment_stream_spare(ctx, stream_id, cleaner);
+}
+
+/*
+ * Append a block to the open segment of the stream for its type
+ * Returns the absolute block address, or 0 on failure
+ */
+uint64_t lsfs_segment_append_block(struct lsfs_context *ctx, const void *data,
+                                   uint32_t ino, uint32_t offset, uint8_t type)
+{
+    uint64_t block_addr;
+    uint32_t granted;
+    uint8_t *dst;
+
+    block_addr = lsfs_segment_reserve(ctx, segment_stream_for(type), 1, ino, offset,
+                                      type, &granted, &dst);
+    if (block_addr == 0) {
+        return 0;
+    }
+
+    memcpy(dst, data, LSFS_BLOCK_SIZE);
+    lsfs_segment_commit(ctx, block_addr, granted);
+
+    return block_addr;
+}
+
+/*
+ * Append a block to the open segment of its stream with segbuf->lock held
+ * Checkpoints use this to add blocks and flush them without letting other
+ * appends in between.  Returns the absolute block address, or 0 on
+ * failure.
+ */
+uint64_t lsfs_segment_append_locked(struct lsfs_context *ctx, const void *data,
+                                    uint32_t ino, uint32_t offset, uint8_t type)
+{
+    struct lsfs_segment_stream *stream;
+    uint32_t block_idx;
+
+    stream = segment_stream_open(ctx, segment_stream_for(type), true);
+    if (!stream) {
+        return 0;
+    }
+
+    block_idx = stream->block_count++;
+    stream->block_info[block_idx].ino = ino;
+    stream->block_info[block_idx].offset = offset;
+    stream->block_info[block_idx].type = type;
+    memcpy(stream->data + (size_t)block_idx * LSFS_BLOCK_SIZE, data, LSFS_BLOCK_SIZE);
+    segment_mark_live(ctx, stream->segment_id, block_idx, 1);
+    ctx->writes_since_checkpoint++;
+
+    return lsfs_segment_to_block(ctx, stream->segment_id, block_idx);
+}
+
+/*
+ * Reserve up to count contiguous blocks in the open segment of a stream
+ * Block i of the run is recorded as (ino, offset + i, type).  On success
+ * *granted is set to the number of slots handed out (at least one), *dst
+ * points at the first slot in the segment buffer and the address of the
+ * first block is returned; 0 is returned on failure.  The caller fills the
+ * slots without holding any lock and must call lsfs_segment_commit()
+ * before it reserves or appends again, since the segment cannot be sealed
+ * while slots are outstanding.
+ */
+uint64_t lsfs_segment_reserve(struct lsfs_context *ctx, uint32_t stream_id,
+                              uint32_t count, uint32_t ino, uint32_t offset,
+                              uint8_t type, uint32_t *granted, uint8_t **dst)
+{
+    struct lsfs_segment_buffer *segbuf = &ctx->segbuf;
+    struct lsfs_segment_stream *stream;
+    uint64_t block_addr;
+    uint64_t used = 0;
+    uint32_t block_idx;
+    uint32_t n;
+
+    if (count == 0 || stream_id >= LSFS_STREAM_COUNT) {
+        return 0;
+    }
+
+    uint64_t start = lsfs_stats_now();
+    pthread_mutex_lock(&segbuf->lock);
+
+    stream = segment_stream_open(ctx, stream_id, false);
+    if (!stream) {
+        pthread_mutex_unlock(&segbuf->lock);
+        return 0;
+    }
+
+    block_idx = stream->block_count;
+    n = LSFS_MIN(count, segment_stream_limit(ctx, stream) - block_idx);
+
+    /* Record block info */
+    for (uint32_t i = 0; i < n; i++) {
+        stream->block_info[block_idx + i].ino = ino;
+        stream->block_info[block_idx + i].offset = offset + i;
+        stream->block_info[block_idx + i].type = type;
+    }
+
+    /* Calculate block address */
+    block_addr = lsfs_segment_to_block(ctx, stream->segment_id, block_idx);
+
+    stream->block_count += n;
+    stream->reserved += n;
+    segment_mark_live(ctx, stream->segment_id, block_idx, n);
+    ctx->writes_since_checkpoint += n;
+
+    *granted = n;
+    *dst = stream->data + (size_t)block_idx * LSFS_BLOCK_SIZE;
+
+    LSFS_DEBUG("Reserved %u blocks at %" PRIu64 " (seg %u, off %u, ino %u)",
+               n, block_addr, stream->segment_id, block_idx, ino);
+
+    /* File data takes its blocks off the writer's promise */
+    if (stream_id == LSFS_STREAM_DATA) {
+        used = LSFS_MIN(n, segment_promised);
+        segment_promised -= used;
+    }
+
+    pthread_mutex_unlock(&segbuf->lock);
+    lsfs_segment_prealloc_release(ctx, used);
+    lsfs_stats_time(ctx, LSFS_LAT_APPEND, start);
+
+    return block_addr;
+}
+
+/*
+ * Release slots obtained from lsfs_segment_reserve() once they are filled
+ * block is the address the reservation returned; its segment cannot be
+ * sealed until then, so it still identifies the stream.
+ */
+void lsfs_segment_commit(struct lsfs_context *ctx, uint64_t block, uint32_t count)
+{
+    struct lsfs_segment_buffer *segbuf = &ctx->segbuf;
+    struct lsfs_segment_stream *stream;
+
+    pthread_mutex_lock(&segbuf->lock);
+
+    stream = segment_stream_of(ctx, block);
+    if (stream) {
+        stream->reserved -= count;
+        if (stream->reserved == 0) {
+            pthread_cond_broadcast(&segbuf->drained);
+        }
+    }
+
+    pthread_mutex_unlock(&segbuf->lock);
+}
+
+/*
+ * Append an inode to the log
+ * Inodes share blocks: each one goes into the next free slot of the inode
+ * block currently open in the metadata stream, and a new block is opened
+ * when there is none or it is full.  An inode whose old_location is still
+ * in the open block is updated in place.  Returns the new location
+ * (LSFS_INODE_LOC), or 0 on failure.
+ */
+uint64_t lsfs_segment_append_inode(struct lsfs_context *ctx,
+                                   const struct lsfs_inode *inode,
+                                   uint64_t old_location)
+{
+    struct lsfs_segment_buffer *segbuf = &ctx->segbuf;
+    struct lsfs_segment_stream *stream = &segbuf->streams[LSFS_STREAM_META];
+    uint64_t block_addr;
+    uint32_t segment_id, block_idx;
+    uint32_t granted;
+    uint32_t slot;
+    uint8_t *dst;
+
+    pthread_mutex_lock(&segbuf->lock);
+
+    if (stream->inode_block != 0) {
+        block_addr = lsfs_segment_to_block(ctx, stream->segment_id, stream->inode_block);
+        dst = stream->data + (size_t)stream->inode_block * LSFS_BLOCK_SIZE;
+
+        if (old_location != 0 && LSFS_INODE_LOC_BLOCK(old_location) == block_addr) {
+            slot = LSFS_INODE_LOC_SLOT(old_location);
+            memcpy(dst + slot * sizeof(struct lsfs_inode), inode, sizeof(*inode));
+            pthread_mutex_unlock(&segbuf->lock);
+            return old_location;
+        }
+
+        if (stream->inode_slots < LSFS_INODES_PER_BLOCK) {
+            slot = stream->inode_slots++;
+            memcpy(dst + slot * sizeof(struct lsfs_inode), inode, sizeof(*inode));
+            pthread_mutex_unlock(&segbuf->lock);
+            return LSFS_INODE_LOC(block_addr, slot);
+        }
+    }
+
+    pthread_mutex_unlock(&segbuf->lock);
+
+    /* Open a new inode block; the summary names its first inode */
+    block_addr = lsfs_segment_reserve(ctx, LSFS_STREAM_META, 1, inode->ino, 0,
+                                      LSFS_BLOCK_TYPE_INODE, &granted, &dst);
+    if (block_addr == 0) {
+        return 0;
+    }
+
+    memset(dst, 0, LSFS_BLOCK_SIZE);
+    memcpy(dst, inode, sizeof(*inode));
+
+    /* The block cannot be sealed while it is reserved, so this is still
+     * ours; one that had to go into another stream is not shared */
+    lsfs_block_to_segment(ctx, block_addr, &segment_id, &block_idx);
+    pthread_mutex_lock(&segbuf->lock);
+    if (stream->segment_id == segment_id) {
+        stream->inode_block = block_idx;
+        stream->inode_slots = 1;
+    }
+    pthread_mutex_unlock(&segbuf->lock);
+
+    lsfs_segment_commit(ctx, block_addr, granted);
+
+    return LSFS_INODE_LOC(block_addr, 0);
+}
+
+/*
+ * Count packed blocks and the compressed blocks put into them
+ */
+static void segment_count_packed(struct lsfs_context *ctx, uint64_t block_addr,
+                                 uint32_t blocks, uint32_t len)
+{
+    struct lsfs_segment_table *table = &ctx->segtable;
+    uint32_t segment_id, offset;
+
+    lsfs_block_to_segment(ctx, block_addr, &segment_id, &offset);
+
+    pthread_mutex_lock(&table->lock);
+    table->entries[segment_id].packed_blocks += blocks;
+    table->entries[segment_id].packed_slots++;
+    lsfs_segment_dirty(table, segment_id);
+    pthread_mutex_unlock(&table->lock);
+
+    __atomic_add_fetch(&ctx->compressed_blocks, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&ctx->compressed_bytes, len, __ATOMIC_RELAXED);
+}
+
+/*
+ * Append a compressed file block to the log
+ * Compressed blocks share blocks like inodes do: each one goes into the
+ * next free slot of the packed block open in the stream, and a new one is
+ * opened when there is none or the block does not fit.  The summary names
+ * the owner of the first slot; the packed header names every slot's.
+ * Returns the packed address (LSFS_PACKED_ADDR), or 0 on failure.
+ */
+uint64_t lsfs_segment_append_packed(struct lsfs_context *ctx, uint32_t stream_id,
+                                    uint32_t ino, uint32_t offset,
+                                    const void *data, uint32_t len)
+{
+    struct lsfs_segment_buffer *segbuf = &ctx->segbuf;
+    struct lsfs_segment_stream *stream;
+    struct lsfs_packed_header *header;
+    uint64_t block_addr;
+    uint32_t segment_id, block_idx;
+    uint32_t granted;
+    uint32_t slot;
+    uint8_t *dst;
+
+    if (stream_id >= LSFS_STREAM_COUNT || len == 0 || len > LSFS_PACKED_MAX_LEN) {
+        return 0;
+    }
+    stream = &segbuf->streams[stream_id];
+
+    pthread_mutex_lock(&segbuf->lock);
+
+    if (stream->packed_block != 0) {
+        dst = stream->data + (size_t)stream->packed_block * LSFS_BLOCK_SIZE;
+        header = (struct lsfs_packed_header *)dst;
+
+        if (header->count < LSFS_PACKED_SLOTS && header->end + len <= LSFS_BLOCK_SIZE) {
+            slot = header->count++;
+            header->slots[slot].ino = ino;
+            header->slots[slot].offset = offset;
+            header->slots[slot].start = header->end;
+            header->slots[slot].length = (uint16_t)len;
+            memcpy(dst + header->end, data, len);
+            header->end += len;
+
+            block_addr = lsfs_segment_to_block(ctx, stream->segment_id, stream->packed_block);
+            segment_count_packed(ctx, block_addr, 0, len);
+            pthread_mutex_unlock(&segbuf->lock);
+            return LSFS_PACKED_ADDR(block_addr, slot);
+        }
+    }
+
+    pthread_mutex_unlock(&segbuf->lock);
+
+    /* Open a new packed block; the summary names its first slot */
+    block_addr = lsfs_segment_reserve(ctx, stream_id, 1, ino, offset,
+                                      LSFS_BLOCK_TYPE_PACKED, &granted, &dst);
+    if (block_addr == 0) {
+        return 0;
+    }
+
+    memset(dst, 0, LSFS_BLOCK_SIZE);
+    header = (struct lsfs_packed_header *)dst;
+    header->magic = LSFS_PACKED_MAGIC;
+    header->codec = (uint8_t)ctx->compress_codec;
+    header->count = 1;
+    header->slots[0].ino = ino;
+    header->slots[0].offset = offset;
+    header->slots[0].start = LSFS_PACKED_DATA_START;
+    header->slots[0].length = (uint16_t)len;
+    memcpy(dst + LSFS_PACKED_DATA_START, data, len);
+    header->end = (uint16_t)(LSFS_PACKED_DATA_START + len);
+    segment_count_packed(ctx, block_addr, 1, len);
+
+    /* As with inode blocks, one that had to go into another stream is
+     * not shared */
+    lsfs_block_to_segment(ctx, block_addr, &segment_id, &block_idx);
+    pthread_mutex_lock(&segbuf->lock);
+    if (stream->segment_id == segment_id) {
+        stream->packed_block = block_idx;
+    }
+    pthread_mutex_unlock(&segbuf->lock);
+
+    lsfs_segment_commit(ctx, block_addr, granted);
+
+    return LSFS_PACKED_ADDR(block_addr, 0);
+}
+
+/*
+ * Read a log block
+ * Blocks appended since the last flush only exist in the segment buffer,
+ * so they are copied from there; everything else goes through the buffer
+ * cache.  A packed address reads its packed block and decompresses the
+ * slot.
+ */
+int lsfs_segment_read_block(struct lsfs_context *ctx, uint64_t block, void *buf)
+{
+    struct lsfs_segment_buffer *segbuf = &ctx->segbuf;
+    struct lsfs_segment_stream *stream;
+    uint32_t segment_id, offset;
+
+    if (LSFS_IS_PACKED(block)) {
+        uint8_t packed[LSFS_BLOCK_SIZE];
+        int ret = lsfs_segment_read_block(ctx, LSFS_PACKED_BLOCK(block), packed);
+
+        return ret == LSFS_OK ? lsfs_packed_read(packed, LSFS_PACKED_SLOT(block), buf) : ret;
+    }
+
+    lsfs_block_to_segment(ctx, block, &segment_id, &offset);
+
+    if (block < ctx->segtable.log_start || offset < LSFS_SUMMARY_BLOCKS) {
+        return lsfs_buffer_read(ctx, block, buf);
+    }
+
+    pthread_mutex_lock(&segbuf->lock);
+    stream = segment_stream_of(ctx, block);
+    if (stream && offset < stream->block_count) {
+        memcpy(buf, stream->data + (size_t)offset * LSFS_BLOCK_SIZE, LSFS_BLOCK_SIZE);
+        pthread_mutex_unlock(&segbuf->lock);
+        return LSFS_OK;
+    }
+    for (uint32_t i = 0; i < segbuf->queue_len; i++) {
+        struct lsfs_segment_pending *pending =
+            &segbuf->queue[(segbuf->queue_head + i) % LSFS_FLUSH_QUEUE_DEPTH];
+        if (segment_id == pending->segment_id && offset < pending->block_count &&
+            (pending->final || offset >= pending->first_block)) {
+            memcpy(buf, pending->data + (size_t)offset * LSFS_BLOCK_SIZE, LSFS_BLOCK_SIZE);
+            pthread_mutex_unlock(&segbuf->lock);
+            return LSFS_OK;
+        }
+    }
+    pthread_mutex_unlock(&segbuf->lock);
+
+    return lsfs_buffer_read(ctx, block, buf);
+}
+
+/*
+ * Pick the current copy of a segment summary read from disk
+ * head and tail are the copies read from the start and the last blocks of
+ * the segment, NULL if a read failed.  Returns the one that belongs to
+ * segment_id, describes a possible number of blocks, matches its checksum
+ * and is newer, or NULL if neither does.
+ */
+const struct lsfs_segment_summary *
+lsfs_segment_current_summary(const struct lsfs_context *ctx, const void *head,
+                             const void *tail, uint32_t segment_id)
+{
+    return lsfs_summary_current(head, tail, segment_id, ctx->segtable.segment_blocks);
+}
+
+/*
+ * Check a segment block against the checksum its summary records
+ * offset is the block's position in the segment, past the summary and
+ * below the summary's block count.
+ */
+int lsfs_segment_check_block(const struct lsfs_segment_summary *summary,
+                             uint32_t offset, const void *data)
+{
+    uint32_t crc = lsfs_crc32c(0, data, LSFS_BLOCK_SIZE);
+
+    return crc == summary->blocks[offset - LSFS_SUMMARY_BLOCKS].checksum ?
+           LSFS_OK : LSFS_ERR_CORRUPT;
+}
+
+/*
+ * Check blocks read from disk against the checksums in their summary
+ * Summary blocks and blocks outside the log are not checked.  The summary is read
+ * through the buffer cache, where it stays for the segment's next blocks.
+ * Returns LSFS_ERR_CORRUPT if a block does not match.
+ */
+int lsfs_segment_verify_blocks(struct lsfs_context *ctx, uint64_t block, uint32_t count,
+                               const void *data)
+{
+    uint8_t summary_block[LSFS_BLOCK_SIZE];
+    uint32_t crcs[LSFS_SEGMENT_BLOCKS];
+    struct lsfs_segment_header header;
+    uint32_t segment_id, offset;
+    uint32_t loaded;
+    int ret;
+
+    if (block < ctx->segtable.log_start || count == 0) {
+        return LSFS_OK;
+    }
+
+    lsfs_block_to_segment(ctx, block, &segment_id, &offset);
+    if (offset < LSFS_SUMMARY_BLOCKS) {
+        uint32_t skip = LSFS_MIN(count, LSFS_SUMMARY_BLOCKS - offset);
+
+        data = (const uint8_t *)data + (size_t)skip * LSFS_BLOCK_SIZE;
+        block += skip;
+        offset += skip;
+        count -= skip;
+        if (count == 0) {
+            return LSFS_OK;
+        }
+    }
+
+    /* A run reaching into the next segment is checked against its summary */
+    uint32_t in_segment = ctx->segtable.segment_blocks - offset;
+    if (count > in_segment) {
+        ret = lsfs_segment_verify_blocks(ctx, block + in_segment, count - in_segment,
+                                         (const uint8_t *)data +
+                                         (size_t)in_segment * LSFS_BLOCK_SIZE);
+        if (ret != LSFS_OK) {
+            return ret;
+        }
+        count = in_segment;
+    }
+
+    uint64_t seg_start = lsfs_segment_to_block(ctx, segment_id, 0);
+    uint64_t summary_start = seg_start;
+
+    ret = lsfs_buffer_read(ctx, seg_start, summary_block);
+    if (ret != LSFS_OK) {
+        return ret;
+    }
+    memcpy(&header, summary_block, sizeof(header));
+    loaded = 0;
+
+    /* Blocks the first summary copy does not describe yet are in the
+     * second one, if the segment was flushed again while open */
+    if (header.magic == LSFS_SEGMENT_MAGIC && offset + count > header.block_count) {
+        uint64_t tail_start = seg_start + LSFS_SUMMARY_TAIL(ctx->segtable.segment_blocks);
+        struct lsfs_segment_header tail;
+
+        ret = lsfs_buffer_read(ctx, tail_start, summary_block);
+        if (ret != LSFS_OK) {
+            return ret;
+        }
+        memcpy(&tail, summary_block, sizeof(tail));
+        if (tail.magic == LSFS_SEGMENT_MAGIC && tail.segment_id == segment_id &&
+            tail.sequence > header.sequence) {
+            header = tail;
+            summary_start = tail_start;
+        } else {
+            loaded = UINT32_MAX;
+        }
+    }
+
+    if (header.magic != LSFS_SEGMENT_MAGIC || offset + count > header.block_count) {
+        LSFS_ERROR("Segment %u summary does not cover blocks %u-%u",
+                   segment_id, offset, offset + count - 1);
+        return LSFS_ERR_CORRUPT;
+    }
+
+    lsfs_crc32c_blocks(data, count, crcs);
+
+    for (uint32_t i = 0; i < count; i++) {
+        /* Checksums are 4-byte aligned, so none spans summary blocks */
+        size_t pos = sizeof(struct lsfs_segment_header) +
+                     (size_t)(offset + i - LSFS_SUMMARY_BLOCKS) * sizeof(struct lsfs_block_info) +
+                     offsetof(struct lsfs_block_info, checksum);
+        uint32_t summary_idx = (uint32_t)(pos / LSFS_BLOCK_SIZE);
+        uint32_t expected;
+
+        if (summary_idx != loaded) {
+            ret = lsfs_buffer_read(ctx, summary_start + summary_idx, summary_block);
+            if (ret != LSFS_OK) {
+                return ret;
+            }
+            loaded = summary_idx;
+        }
+
+        memcpy(&expected, summary_block + pos % LSFS_BLOCK_SIZE, sizeof(expected));
+        if (expected != crcs[i]) {
+            LSFS_ERROR("Checksum mismatch in block %" PRIu64 " (segment %u, offset %u)",
+                       block + i, segment_id, offset + i);
+            return LSFS_ERR_CORRUPT;
+        }
+    }
+
+    return LSFS_OK;
+}
+
+/*
+ * Get the segments whose blocks so far only exist in memory: those being
+ * filled by the streams and those waiting for the writer.  Blocks can
+ * leave this set (when their segment lands) but never enter it once they
+ * have been handed out, so a snapshot is safe to act on.
+ */
+void lsfs_segment_buffered(struct lsfs_context *ctx, struct lsfs_segment_set *set)
+{
+    struct lsfs_segment_buffer *segbuf = &ctx->segbuf;
+
+    set->count = 0;
+
+    pthread_mutex_lock(&segbuf->lock);
+    for (uint32_t i = 0; i < LSFS_STREAM_COUNT; i++) {
+        if (segbuf->streams[i].segment_id != LSFS_SEGMENT_NONE) {
+            set->ids[set->count++] = segbuf->streams[i].segment_id;
+        }
+    }
+    for (uint32_t i = 0; i < segbuf->queue_len; i++) {
+        const struct lsfs_segment_pending *pending =
+            &segbuf->queue[(segbuf->queue_head + i) % LSFS_FLUSH_QUEUE_DEPTH];
+        if (pending->segment_id != LSFS_SEGMENT_NONE) {
+            set->ids[set->count++] = pending->segment_id;
+        }
+    }
+    pthread_mutex_unlock(&segbuf->lock);
+}
+
+/*
+ * Check whether a block belongs to a segment in the set
+ */
+bool lsfs_segment_set_has_block(const struct lsfs_context *ctx,
+                                const struct lsfs_segment_set *set, uint64_t block)
+{
+    uint32_t segment_id, offset;
+
+    if (block < ctx->segtable.log_start) {
+        return false;
+    }
+
+    lsfs_block_to_segment(ctx, block, &segment_id, &offset);
+    for (uint32_t i = 0; i < set->count; i++) {
+        if (set->ids[i] == segment_id) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/*
+ * Flush the segment buffer to disk and report where the log ends
+ * Seals every stream and waits until their segments and every segment
+ * sealed before them have landed; segments sealed by others while this
+ * waits are not waited for.  *log_head is set to the end of the last
+ * segment covered, which is where roll-forward must start for everything
+ * flushed here to be reachable.  Caller must hold segbuf->lock, which is
+ * dropped while waiting.
+ */
+int lsfs_segment_flush_head_locked(struct lsfs_context *ctx, uint64_t *log_head)
+{
+    struct lsfs_segment_buffer *segbuf = &ctx->segbuf;
+    uint64_t target;
+    int ret;
+
+    /* Metadata comes first and seals the other streams ahead of itself */
+    for (uint32_t i = 0; i < LSFS_STREAM_COUNT; i++) {
+        ret = segment_seal_locked(ctx, i, false);
+        if (ret != LSFS_OK) {
+            return ret;
+        }
+    }
+
+    target = segbuf->sealed_count;
+    *log_head = segbuf->landed_count < target ? segbuf->sealed_head : ctx->sb.log_head;
+
+    /* Kick a writer that is waiting to retry a failed write */
+    if (segbuf->queue_len > 0 && segbuf->write_error != LSFS_OK) {
+        pthread_cond_signal(&segbuf->queued);
+    }
+    segbuf->write_error = LSFS_OK;
+
+    while (segbuf->landed_count < target && segbuf->write_error == LSFS_OK) {
+        pthread_cond_wait(&segbuf->landed, &segbuf->lock);
+    }
+
+    return segbuf->landed_count < target ? segbuf->write_error : LSFS_OK;
+}
+
+/*
+ * Flush the segment buffer to disk
+ * Caller must hold segbuf->lock.
+ */
+int lsfs_segment_flush_locked(struct lsfs_context *ctx)
+{
+    uint64_t log_head;
+
+    return lsfs_segment_flush_head_locked(ctx, &log_head);
+}
+
+/*
+ * Flush the segment buffer to disk
+ * Wakes the checkpoint thread if enough has been written since the last
+ * checkpoint.
+ */
+int lsfs_segment_flush(struct lsfs_context *ctx)
+{
+    struct lsfs_segment_buffer *segbuf = &ctx->segbuf;
+    uint64_t start = lsfs_stats_now();
+    int ret;
+
+    pthread_mutex_lock(&segbuf->lock);
+    ret = lsfs_segment_flush_locked(ctx);
+    if (ret == LSFS_OK && lsfs_checkpoint_needed(ctx)) {
+        lsfs_checkpoint_kick(ctx);
+    }
+    pthread_mutex_unlock(&segbuf->lock);
+    lsfs_stats_time(ctx, LSFS_LAT_FLUSH, start);
+
+    return ret;
+}
+
+/*
+ * Initialize group commit state
+ */
+int lsfs_group_commit_init(struct lsfs_group_commit *gc)
+{
+    memset(gc, 0, sizeof(*gc));
+
+    if (pthread_mutex_init(&gc->lock, NULL) != 0) {
+        return LSFS_ERR_NOMEM;
+    }
+
+    if (pthread_cond_init(&gc->done, NULL) != 0) {
+        pthread_mutex_destroy(&gc->lock);
+        return LSFS_ERR_NOMEM;
+    }
+
+    return LSFS_OK;
+}
+
+/*
+ * Destroy group commit state
+ */
+void lsfs_group_commit_destroy(struct lsfs_group_commit *gc)
+{
+    pthread_cond_destroy(&gc->done);
+    pthread_mutex_destroy(&gc->lock);
+}
+
+/*
+ * Monotonic clock in nanoseconds, for commit latency
+ */
+static uint64_t commit_clock_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/*
+ * Make everything appended so far durable
+ *
+ * Callers that find no commit running lead one: the segment buffer is
+ * flushed and the device synced once for every ticket issued before the
+ * flush started.  Callers arriving while it runs wait and are covered by
+ * the next commit.  If the previous batch had company, the leader first
+ * gives concurrent callers LSFS_COMMIT_WINDOW_US to join.
+ */
+int lsfs_group_commit(struct lsfs_context *ctx)
+{
+    struct lsfs_group_commit *gc = &ctx->gcommit;
+    uint64_t start = commit_clock_ns();
+    int ret;
+
+    pthread_mutex_lock(&gc->lock);
+    uint64_t ticket = ++gc->issued;
+
+    while (gc->durable < ticket && gc->failed < ticket) {
+        if (gc->running) {
+            pthread_cond_wait(&gc->done, &gc->lock);
+            continue;
+        }
+
+        gc->running = true;
+        if (gc->last_batch > 1) {
+            struct timespec window = { 0, LSFS_COMMIT_WINDOW_US * 1000L };
+            pthread_mutex_unlock(&gc->lock);
+            nanosleep(&window, NULL);
+            pthread_mutex_lock(&gc->lock);
+        }
+        uint64_t target = gc->issued;
+        pthread_mutex_unlock(&gc->lock);
+
+        ret = lsfs_segment_flush(ctx);
+        if (ret == LSFS_OK) {
+            ret = lsfs_sync(ctx);
+        }
+
+        pthread_mutex_lock(&gc->lock);
+        gc->last_batch = target - gc->committed;
+        gc->committed = target;
+        if (ret == LSFS_OK) {
+            gc->durable = target;
+        } else {
+            gc->failed = target;
+            gc->error = ret;
+        }
+        gc->commits++;
+        gc->max_batch = LSFS_MAX(gc->max_batch, gc->last_batch);
+        gc->running = false;
+        pthread_cond_broadcast(&gc->done);
+    }
+
+    ret = (gc->durable >= ticket) ? LSFS_OK : gc->error;
+
+    uint64_t latency = commit_clock_ns() - start;
+    gc->requests++;
+    gc->total_latency_ns += latency;
+    gc->max_latency_ns = LSFS_MAX(gc->max_latency_ns, latency);
+    pthread_mutex_unlock(&gc->lock);
+
+    return ret;
+}
+
+/*
+ * Collect group commit statistics
+ */
+void lsfs_group_commit_stats(struct lsfs_group_commit *gc, struct lsfs_commit_stats *stats)
+{
+    pthread_mutex_lock(&gc->lock);
+    stats->commits = gc->commits;
+    stats->requests = gc->requests;
+    stats->max_batch = gc->max_batch;
+    stats->total_latency_ns = gc->total_latency_ns;
+    stats->max_latency_ns = gc->max_latency_ns;
+    pthread_mutex_unlock(&gc->lock);
+}
@@ -0,0 +1,289 @@
+/*
+ * LSFS - Log-Structured Filesystem
+ * Runtime Statistics
+ *
+ * Counters and latency histograms are kept in shards so threads updating
+ * them at once rarely share a cache line.  A thread picks its shard the
+ * first time it records anything and keeps it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include "lsfs.h"
+
+/* Names of the timed operations, as rendered */
+static const char *const stats_lat_names[LSFS_LAT_COUNT] = {
+    [LSFS_LAT_LOOKUP]        = "lookup",
+    [LSFS_LAT_GETATTR]       = "getattr",
+    [LSFS_LAT_SETATTR]       = "setattr",
+    [LSFS_LAT_READDIR]       = "readdir",
+    [LSFS_LAT_READDIRPLUS]   = "readdirplus",
+    [LSFS_LAT_OPEN]          = "open",
+    [LSFS_LAT_RELEASE]       = "release",
+    [LSFS_LAT_READ]          = "read",
+    [LSFS_LAT_WRITE]         = "write",
+    [LSFS_LAT_CREATE]        = "create",
+    [LSFS_LAT_MKDIR]         = "mkdir",
+    [LSFS_LAT_UNLINK]        = "unlink",
+    [LSFS_LAT_RMDIR]         = "rmdir",
+    [LSFS_LAT_RENAME]        = "rename",
+    [LSFS_LAT_STATFS]        = "statfs",
+    [LSFS_LAT_FSYNC]         = "fsync",
+    [LSFS_LAT_FALLOCATE]     = "fallocate",
+    [LSFS_LAT_APPEND]        = "segment_append",
+    [LSFS_LAT_FLUSH]         = "segment_flush",
+    [LSFS_LAT_SEGMENT_WRITE] = "segment_write",
+    [LSFS_LAT_CHECKPOINT]    = "checkpoint",
+    [LSFS_LAT_GC_CLEAN]      = "gc_clean",
+    [LSFS_LAT_READ_IO]       = "read_io",
+};
+
+/* Names of the counters, as rendered */
+static const char *const stats_ctr_names[LSFS_CTR_COUNT] = {
+    [LSFS_CTR_USER_READ]    = "user_read_bytes",
+    [LSFS_CTR_USER_WRITE]   = "user_write_bytes",
+    [LSFS_CTR_DEVICE_READ]  = "device_read_bytes",
+    [LSFS_CTR_DEVICE_WRITE] = "device_write_bytes",
+    [LSFS_CTR_GC_SEGMENTS]  = "gc_segments",
+    [LSFS_CTR_GC_LIVE]      = "gc_live_blocks",
+    [LSFS_CTR_DISCARD]      = "discard_bytes",
+};
+
+/* Segment utilization is rendered in tenths of a segment */
+#define STATS_UTIL_BUCKETS      10
+
+static __thread uint32_t stats_slot = UINT32_MAX;
+static uint32_t stats_next_slot;
+
+/*
+ * Get the calling thread's shard
+ */
+static struct lsfs_stats_shard *stats_shard(struct lsfs_context *ctx)
+{
+    if (stats_slot == UINT32_MAX) {
+        stats_slot = __atomic_fetch_add(&stats_next_slot, 1, __ATOMIC_RELAXED) %
+                     LSFS_STATS_SHARDS;
+    }
+    return &ctx->stats.shards[stats_slot];
+}
+
+/*
+ * Get a monotonic time in nanoseconds for timing an operation
+ */
+uint64_t lsfs_stats_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/*
+ * Add n to a counter
+ */
+void lsfs_stats_add(struct lsfs_context *ctx, uint32_t counter, uint64_t n)
+{
+    __atomic_add_fetch(&stats_shard(ctx)->counters[counter], n, __ATOMIC_RELAXED);
+}
+
+/*
+ * Record an operation that started at start, from lsfs_stats_now()
+ */
+void lsfs_stats_time(struct lsfs_context *ctx, uint32_t op, uint64_t start)
+{
+    struct lsfs_histogram *hist = &stats_shard(ctx)->latency[op];
+    uint64_t ns = lsfs_stats_now() - start;
+    uint64_t us = ns / 1000;
+    uint32_t bucket = us == 0 ? 0 : 64 - (uint32_t)__builtin_clzll(us);
+
+    if (bucket >= LSFS_STATS_BUCKETS) {
+        bucket = LSFS_STATS_BUCKETS - 1;
+    }
+
+    __atomic_add_fetch(&hist->count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&hist->total_ns, ns, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&hist->buckets[bucket], 1, __ATOMIC_RELAXED);
+
+    uint64_t max = __atomic_load_n(&hist->max_ns, __ATOMIC_RELAXED);
+    while (ns > max && !__atomic_compare_exchange_n(&hist->max_ns, &max, ns, true,
+                                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+/*
+ * Sum a histogram over the shards
+ */
+static void stats_histogram(struct lsfs_context *ctx, uint32_t op, struct lsfs_histogram *out)
+{
+    memset(out, 0, sizeof(*out));
+
+    for (uint32_t s = 0; s < LSFS_STATS_SHARDS; s++) {
+        struct lsfs_histogram *hist = &ctx->stats.shards[s].latency[op];
+        uint64_t max = __atomic_load_n(&hist->max_ns, __ATOMIC_RELAXED);
+
+        out->count += __atomic_load_n(&hist->count, __ATOMIC_RELAXED);
+        out->total_ns += __atomic_load_n(&hist->total_ns, __ATOMIC_RELAXED);
+        out->max_ns = LSFS_MAX(out->max_ns, max);
+        for (uint32_t b = 0; b < LSFS_STATS_BUCKETS; b++) {
+            out->buckets[b] += __atomic_load_n(&hist->buckets[b], __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/*
+ * Sum a counter over the shards
+ */
+static uint64_t stats_counter(struct lsfs_context *ctx, uint32_t counter)
+{
+    uint64_t total = 0;
+
+    for (uint32_t s = 0; s < LSFS_STATS_SHARDS; s++) {
+        total += __atomic_load_n(&ctx->stats.shards[s].counters[counter], __ATOMIC_RELAXED);
+    }
+    return total;
+}
+
+/*
+ * Render the segment table: segments by state, live blocks and how full
+ * the segments in use are
+ */
+static void stats_render_segments(struct lsfs_context *ctx, FILE *out)
+{
+    struct lsfs_segment_table *table = &ctx->segtable;
+    uint64_t util[STATS_UTIL_BUCKETS] = { 0 };
+    uint64_t state_count[4] = { 0 };
+    uint64_t live = 0;
+
+    pthread_mutex_lock(&table->lock);
+    for (uint32_t i = 0; i < table->count; i++) {
+        const struct lsfs_segment_usage *entry = &table->entries[i];
+
+        if (entry->state < 4) {
+            state_count[entry->state]++;
+        }
+        if (entry->state == LSFS_SEG_FREE) {
+            continue;
+        }
+        live += entry->live_blocks;
+        uint32_t b = (uint32_t)((uint64_t)entry->live_blocks * STATS_UTIL_BUCKETS /
+                                table->segment_blocks);
+        util[LSFS_MIN(b, STATS_UTIL_BUCKETS - 1)]++;
+    }
+
+    fprintf(out, "segments %u\n", table->count);
+    fprintf(out, "segment_blocks %u\n", table->segment_blocks);
+    fprintf(out, "segments_free %u\n", table->free_count);
+    fprintf(out, "segments_released %u\n", table->released_count);
+    fprintf(out, "segments_discarding %u\n", table->discard_count);
+    fprintf(out, "segments_discarded %" PRIu64 "\n", table->discarded);
+    fprintf(out, "prealloc_blocks %" PRIu64 "\n",
+            __atomic_load_n(&table->prealloc_blocks, __ATOMIC_RELAXED));
+    fprintf(out, "segments_active %" PRIu64 "\n", state_count[LSFS_SEG_ACTIVE]);
+    fprintf(out, "segments_full %" PRIu64 "\n", state_count[LSFS_SEG_FULL]);
+    fprintf(out, "segments_cleaning %" PRIu64 "\n", state_count[LSFS_SEG_CLEANING]);
+    fprintf(out, "gc_victims %u\n", table->victim_count);
+    fprintf(out, "live_blocks %" PRIu64 "\n", live);
+    fprintf(out, "log_blocks %" PRIu64 "\n", table->appended);
+    pthread_mutex_unlock(&table->lock);
+
+    fprintf(out, "segment_utilization");
+    for (uint32_t b = 0; b < STATS_UTIL_BUCKETS; b++) {
+        fprintf(out, " %" PRIu64, util[b]);
+    }
+    fprintf(out, "\n");
+}
+
+/*
+ * Render the cache, commit and compression statistics kept elsewhere
+ */
+static void stats_render_caches(struct lsfs_context *ctx, FILE *out)
+{
+    struct lsfs_buffer_stats bstats;
+    struct lsfs_inode_cache_stats istats;
+    struct lsfs_dcache_stats dstats;
+    struct lsfs_commit_stats commit;
+
+    lsfs_buffer_stats(&ctx->bufpool, &bstats);
+    fprintf(out, "buffer_cache_hits %" PRIu64 "\n", bstats.hits);
+    fprintf(out, "buffer_cache_misses %" PRIu64 "\n", bstats.misses);
+    fprintf(out, "buffer_cache_evictions %" PRIu64 "\n", bstats.evictions);
+    fprintf(out, "buffer_cache_cached %" PRIu64 "\n", bstats.cached);
+    fprintf(out, "buffer_cache_capacity %" PRIu64 "\n", bstats.capacity);
+    fprintf(out, "readahead_blocks %" PRIu64 "\n", bstats.prefetched);
+    fprintf(out, "readahead_used %" PRIu64 "\n", bstats.prefetch_hits);
+
+    pthread_mutex_lock(&ctx->prefetch.lock);
+    fprintf(out, "readahead_dropped %" PRIu64 "\n", ctx->prefetch.dropped);
+    pthread_mutex_unlock(&ctx->prefetch.lock);
+
+    lsfs_inode_cache_stats(&ctx->icache, &istats);
+    fprintf(out, "inode_cache_hits %" PRIu64 "\n", istats.hits);
+    fprintf(out, "inode_cache_misses %" PRIu64 "\n", istats.misses);
+    fprintf(out, "inode_cache_evictions %" PRIu64 "\n", istats.evictions);
+    fprintf(out, "inode_cache_cached %" PRIu64 "\n", istats.cached);
+    fprintf(out, "inode_cache_capacity %" PRIu64 "\n", istats.capacity);
+
+    lsfs_dcache_stats(&ctx->dcache, &dstats);
+    fprintf(out, "dentry_cache_hits %" PRIu64 "\n", dstats.hits);
+    fprintf(out, "dentry_cache_negative_hits %" PRIu64 "\n", dstats.negative_hits);
+    fprintf(out, "dentry_cache_misses %" PRIu64 "\n", dstats.misses);
+
+    lsfs_group_commit_stats(&ctx->gcommit, &commit);
+    fprintf(out, "commit_requests %" PRIu64 "\n", commit.requests);
+    fprintf(out, "commit_rounds %" PRIu64 "\n", commit.commits);
+    fprintf(out, "commit_max_batch %" PRIu64 "\n", commit.max_batch);
+
+    fprintf(out, "compressed_blocks %" PRIu64 "\n",
+            __atomic_load_n(&ctx->compressed_blocks, __ATOMIC_RELAXED));
+    fprintf(out, "compressed_bytes %" PRIu64 "\n",
+            __atomic_load_n(&ctx->compressed_bytes, __ATOMIC_RELAXED));
+    fprintf(out, "incompressible_blocks %" PRIu64 "\n",
+            __atomic_load_n(&ctx->incompressible_blocks, __ATOMIC_RELAXED));
+}
+
+/*
+ * Render every statistic as text
+ * Each line is a name and one or more values.  Latency lines are
+ * "latency <op> <count> <total ns> <max ns>" followed by the
+ * LSFS_STATS_BUCKETS bucket counts.  On success *text is a malloc'd,
+ * NUL-terminated string of *len bytes, not counting the NUL.
+ */
+int lsfs_stats_render(struct lsfs_context *ctx, char **text, size_t *len)
+{
+    FILE *out = open_memstream(text, len);
+
+    if (!out) {
+        return LSFS_ERR_NOMEM;
+    }
+
+    fprintf(out, "version 1\n");
+    for (uint32_t c = 0; c < LSFS_CTR_COUNT; c++) {
+        fprintf(out, "%s %" PRIu64 "\n", stats_ctr_names[c], stats_counter(ctx, c));
+    }
+    stats_render_segments(ctx, out);
+    stats_render_caches(ctx, out);
+
+    for (uint32_t op = 0; op < LSFS_LAT_COUNT; op++) {
+        struct lsfs_histogram hist;
+
+        stats_histogram(ctx, op, &hist);
+        fprintf(out, "latency %s %" PRIu64 " %" PRIu64 " %" PRIu64, stats_lat_names[op],
+                hist.count, hist.total_ns, hist.max_ns);
+        for (uint32_t b = 0; b < LSFS_STATS_BUCKETS; b++) {
+            fprintf(out, " %" PRIu64, hist.buckets[b]);
+        }
+        fprintf(out, "\n");
+    }
+
+    if (fclose(out) != 0) {
+        free(*text);
+        *text = NULL;
+        return LSFS_ERR_NOMEM;
+    }
+
+    return LSFS_OK;
+}
@@ -1,35 +1,181 @@
 /*
  * LSFS - Log-Structured Filesystem
  * fsck.lsfs - Filesystem check and repair utility
+ *
+ * Segments are scanned by a pool of threads, each reading a whole segment
+ * at a time and checking every block in it against its summary.  The
+ * scan, the inode map walk and the directory walk record what they find
+ * in bitmaps over the log and over inode numbers, so the usage table,
+ * the summaries, the inode map and the directory tree are cross-checked
+ * without going back to disk for every block.
  */
 
 #include <stdio.h>
+#include <stdarg.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
 
 #include "ondisk.h"
+#include "crc32c.h"
+
+#define FSCK_MAX_JOBS           64
+#define FSCK_PROGRESS_NS        1000000000ULL   /* Progress line every second */
+#define FSCK_POLL_NS            50000000L       /* Main thread wakeups while waiting */
+#define FSCK_LIST_MAX           10              /* Problems of one kind listed in full */
+#define FSCK_BLOCK_TYPES        (LSFS_BLOCK_TYPE_PACKED + 1)
+
+/* A directory waiting to be walked */
+struct fsck_dir {
+    uint32_t ino;
+    uint32_t parent;
+};
 
 struct fsck_context {
     int fd;
     uint64_t size;
     struct lsfs_superblock sb;
-    int errors;
+    int errors;                     /* Updated atomically by the workers */
     int warnings;
     int repair;
     int verbose;
+    int progress;
+    int jobs;
+
+    /* Active checkpoint and its inode map */
+    struct lsfs_checkpoint_header cp;
+    uint64_t *imap_table;           /* Chunk addresses, cp.imap_chunks of them */
+    struct lsfs_imap_entry **chunks; /* Chunks read, NULL where none is */
+
+    /* Segment usage table, one entry per segment */
+    struct lsfs_segment_usage *usage;
+
+    /*
+     * Bitmaps over the log, bit 0 at log_start.  typed[t] has the blocks
+     * a summary describes as type t, and mapped those the inode map,
+     * inodes and extent trees point at.  Each segment covers whole words,
+     * so the segment scan sets typed bits without atomics.
+     */
+    uint64_t log_blocks;
+    uint64_t *typed[FSCK_BLOCK_TYPES];
+    uint64_t *mapped;
+
+    /* Bitmaps over inode numbers: in the inode map, directories, and
+     * named by some directory */
+    uint64_t inode_bits;
+    uint64_t *inodes;
+    uint64_t *dirs;
+    uint64_t *reached;
+
+    /* Totals of the passes, updated atomically */
+    uint64_t bytes_read;
+    uint64_t free_segments;
+    uint64_t valid_segments;
+    uint64_t checked_blocks;
+    uint64_t valid_inodes;
+    uint64_t chunks_read;
+    uint64_t dirents;
+
+    /* Directories still to walk, under walk_lock */
+    pthread_mutex_t walk_lock;
+    pthread_cond_t walk_cond;
+    struct fsck_dir *walk_queue;
+    uint64_t walk_len;
+    uint64_t walk_cap;
+    uint64_t walk_next;
+    int walk_busy;
+    bool walk_failed;
+};
+
+struct fsck_worker;
+
+/*
+ * A pass run by the worker pool
+ * Items are handed out in order, so workers scanning segments read the
+ * image front to back between them.  items is 0 for the directory walk,
+ * which finds its work as it goes.
+ */
+struct fsck_pass {
+    struct fsck_context *ctx;
+    const char *what;               /* Items, for progress lines */
+    uint64_t items;
+    uint64_t next;                  /* Next item to hand out */
+    uint64_t done;                  /* Items finished */
+    int running;                    /* Workers not yet finished */
+    void (*work)(struct fsck_worker *w, uint64_t item);
+    void *(*thread)(void *arg);
+};
+
+/* State of one worker thread */
+struct fsck_worker {
+    struct fsck_pass *pass;
+    struct fsck_context *ctx;
+    pthread_t thread;
+    uint8_t *buf;                   /* A segment's worth of blocks */
+    uint32_t *crcs;                 /* Their checksums */
+    uint64_t inode_block;           /* Block held in inode_buf, 0 for none */
+    uint8_t inode_buf[LSFS_BLOCK_SIZE];
 };
 
+/*
+ * Report an error
+ */
+static void __attribute__((format(printf, 2, 3)))
+fsck_error(struct fsck_context *ctx, const char *fmt, ...)
+{
+    char msg[512];
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(msg, sizeof(msg), fmt, ap);
+    va_end(ap);
+
+    fprintf(stderr, "ERROR: %s\n", msg);
+    __atomic_add_fetch(&ctx->errors, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Report a warning
+ */
+static void __attribute__((format(printf, 2, 3)))
+fsck_warning(struct fsck_context *ctx, const char *fmt, ...)
+{
+    char msg[512];
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(msg, sizeof(msg), fmt, ap);
+    va_end(ap);
+
+    fprintf(stderr, "WARNING: %s\n", msg);
+    __atomic_add_fetch(&ctx->warnings, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Read count blocks, counting them for the throughput report
+ */
+static int read_blocks(struct fsck_context *ctx, uint64_t block, uint64_t count, void *buf)
+{
+    if (lsfs_image_read(ctx->fd, block, count, buf) < 0) {
+        return -1;
+    }
+    __atomic_add_fetch(&ctx->bytes_read, count * LSFS_BLOCK_SIZE, __ATOMIC_RELAXED);
+    return 0;
+}
+
 /*
  * Read a block
  */
 static int read_block(struct fsck_context *ctx, uint64_t block_num, void *buf)
 {
-    off_t offset = (off_t)block_num * LSFS_BLOCK_SIZE;
-    ssize_t ret = pread(ctx->fd, buf, LSFS_BLOCK_SIZE, offset);
-    return (ret == LSFS_BLOCK_SIZE) ? 0 : -1;
+    return read_blocks(ctx, block_num, 1, buf);
 }
 
 /*
@@ -37,9 +183,186 @@ static int read_block(struct fsck_context *ctx, uint64_t block_num, void *buf)
  */
 static int write_block(struct fsck_context *ctx, uint64_t block_num, const void *buf)
 {
-    off_t offset = (off_t)block_num * LSFS_BLOCK_SIZE;
-    ssize_t ret = pwrite(ctx->fd, buf, LSFS_BLOCK_SIZE, offset);
-    return (ret == LSFS_BLOCK_SIZE) ? 0 : -1;
+    return lsfs_image_write(ctx->fd, block_num, 1, buf);
+}
+
+/*
+ * Get the monotonic clock in nanoseconds
+ */
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/*
+ * Bitmap helpers
+ * bit_set() is for words only one thread writes; bit_test_and_set() may
+ * race with other threads and returns whether the bit was set before.
+ */
+static inline bool bit_test(const uint64_t *map, uint64_t bit)
+{
+    return (map[bit / 64] >> (bit % 64)) & 1;
+}
+
+static inline void bit_set(uint64_t *map, uint64_t bit)
+{
+    map[bit / 64] |= 1ULL << (bit % 64);
+}
+
+static inline bool bit_test_and_set(uint64_t *map, uint64_t bit)
+{
+    uint64_t mask = 1ULL << (bit % 64);
+
+    return (__atomic_fetch_or(&map[bit / 64], mask, __ATOMIC_RELAXED) & mask) != 0;
+}
+
+static uint64_t *bitmap_alloc(uint64_t bits)
+{
+    return calloc((bits + 63) / 64 + 1, sizeof(uint64_t));
+}
+
+/*
+ * Check that blocks start to end - 1 lie in the log
+ */
+static inline bool in_log(const struct fsck_context *ctx, uint64_t start, uint64_t end)
+{
+    return start >= ctx->sb.log_start && end > start &&
+           end <= ctx->sb.log_start + ctx->log_blocks;
+}
+
+/*
+ * Check whether the usage table marks a log block live
+ */
+static bool block_live(const struct fsck_context *ctx, uint64_t block)
+{
+    uint64_t bit = block - ctx->sb.log_start;
+    uint64_t seg = bit / ctx->sb.segment_size;
+    uint32_t offset = (uint32_t)(bit % ctx->sb.segment_size);
+
+    return (ctx->usage[seg].live_map[offset / 64] >> (offset % 64)) & 1;
+}
+
+/*
+ * Worker thread of a pass over numbered items
+ */
+static void *pass_thread(void *arg)
+{
+    struct fsck_worker *w = arg;
+    struct fsck_pass *pass = w->pass;
+
+    while (1) {
+        uint64_t item = __atomic_fetch_add(&pass->next, 1, __ATOMIC_RELAXED);
+        if (item >= pass->items) {
+            break;
+        }
+        pass->work(w, item);
+        __atomic_add_fetch(&pass->done, 1, __ATOMIC_RELAXED);
+    }
+
+    __atomic_sub_fetch(&pass->running, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/*
+ * Print a progress line for a pass
+ */
+static void pass_progress(const struct fsck_pass *pass, uint64_t start, bool last)
+{
+    uint64_t done = __atomic_load_n(&pass->done, __ATOMIC_RELAXED);
+    uint64_t bytes = __atomic_load_n(&pass->ctx->bytes_read, __ATOMIC_RELAXED);
+    double secs = (double)(now_ns() - start) / 1e9;
+
+    if (pass->items > 0) {
+        fprintf(stderr, "\r  %lu/%lu %s (%lu%%), %.1f MB read, %.1f MB/s   ",
+                (unsigned long)done, (unsigned long)pass->items, pass->what,
+                (unsigned long)(done * 100 / pass->items), bytes / 1048576.0,
+                secs > 0 ? bytes / 1048576.0 / secs : 0.0);
+    } else {
+        fprintf(stderr, "\r  %lu %s, %.1f MB read, %.1f MB/s   ",
+                (unsigned long)done, pass->what, bytes / 1048576.0,
+                secs > 0 ? bytes / 1048576.0 / secs : 0.0);
+    }
+    if (last) {
+        fprintf(stderr, "\n");
+    }
+}
+
+/*
+ * Run a pass on ctx->jobs worker threads
+ * The calling thread reports progress while they work, and how fast the
+ * pass read the image once they are done.
+ */
+static int pass_run(struct fsck_context *ctx, struct fsck_pass *pass)
+{
+    struct fsck_worker *workers = calloc((size_t)ctx->jobs, sizeof(*workers));
+    uint64_t start = now_ns();
+    uint64_t bytes_before = ctx->bytes_read;
+    uint64_t reported = start;
+    int started = 0;
+
+    if (!workers) {
+        fsck_error(ctx, "Out of memory for %d worker threads", ctx->jobs);
+        return -1;
+    }
+
+    pass->ctx = ctx;
+    pass->running = ctx->jobs;
+    for (int i = 0; i < ctx->jobs; i++) {
+        struct fsck_worker *w = &workers[i];
+
+        w->pass = pass;
+        w->ctx = ctx;
+        w->buf = malloc((size_t)ctx->sb.segment_size * LSFS_BLOCK_SIZE);
+        w->crcs = malloc((size_t)ctx->sb.segment_size * sizeof(uint32_t));
+        if (!w->buf || !w->crcs ||
+            pthread_create(&w->thread, NULL, pass->thread, w) != 0) {
+            break;
+        }
+        started++;
+    }
+
+    /* Threads that did not start are not waited for */
+    __atomic_sub_fetch(&pass->running, ctx->jobs - started, __ATOMIC_RELEASE);
+    if (started == 0) {
+        fsck_error(ctx, "Cannot start worker threads");
+    }
+
+    while (__atomic_load_n(&pass->running, __ATOMIC_ACQUIRE) > 0) {
+        struct timespec poll = { 0, FSCK_POLL_NS };
+        nanosleep(&poll, NULL);
+
+        if (ctx->progress && now_ns() - reported >= FSCK_PROGRESS_NS) {
+            pass_progress(pass, start, false);
+            reported = now_ns();
+        }
+    }
+    if (ctx->progress && reported != start) {
+        pass_progress(pass, start, true);
+    }
+
+    for (int i = 0; i < ctx->jobs; i++) {
+        if (i < started) {
+            pthread_join(workers[i].thread, NULL);
+        }
+        free(workers[i].buf);
+        free(workers[i].crcs);
+    }
+    free(workers);
+
+    /* Small passes are reported in KB, and the rate is worked out from
+     * the amount as printed so that the two agree */
+    double secs = (double)(now_ns() - start) / 1e9;
+    uint64_t bytes = ctx->bytes_read - bytes_before;
+    const char *unit = bytes >= 1048576 ? "MB" : "KB";
+    double amount = (double)(uint64_t)(bytes / (bytes >= 1048576 ? 1048576.0 : 1024.0) * 10 + 0.5) / 10;
+    printf("  %lu %s, %.1f %s in %.2f s (%.1f %s/s) on %d thread%s\n",
+           (unsigned long)pass->done, pass->what, amount, unit, secs,
+           secs > 0 ? amount / secs : 0.0, unit, started, started == 1 ? "" : "s");
+
+    return started > 0 ? 0 : -1;
 }
 
 /*
@@ -50,52 +373,62 @@ static int check_superblock(struct fsck_context *ctx)
     printf("Checking superblock...\n");
 
     if (read_block(ctx, LSFS_SUPERBLOCK_BLOCK, &ctx->sb) < 0) {
-        fprintf(stderr, "ERROR: Cannot read superblock\n");
-        ctx->errors++;
+        fsck_error(ctx, "Cannot read superblock");
         return -1;
     }
 
     if (ctx->sb.magic != LSFS_MAGIC) {
-        fprintf(stderr, "ERROR: Invalid magic number: 0x%08x (expected 0x%08x)\n",
-                ctx->sb.magic, LSFS_MAGIC);
-        ctx->errors++;
+        fsck_error(ctx, "Invalid magic number: 0x%08x (expected 0x%08x)",
+                   ctx->sb.magic, LSFS_MAGIC);
         return -1;
     }
 
     if (ctx->sb.version != LSFS_VERSION) {
-        fprintf(stderr, "ERROR: Unsupported version: %u\n", ctx->sb.version);
-        ctx->errors++;
+        fsck_error(ctx, "Unsupported version: %u", ctx->sb.version);
         return -1;
     }
 
     if (ctx->sb.block_size != LSFS_BLOCK_SIZE) {
-        fprintf(stderr, "ERROR: Invalid block size: %u\n", ctx->sb.block_size);
-        ctx->errors++;
+        fsck_error(ctx, "Invalid block size: %u", ctx->sb.block_size);
         return -1;
     }
 
-    if (ctx->sb.segment_size != LSFS_SEGMENT_BLOCKS) {
-        fprintf(stderr, "ERROR: Invalid segment size: %u\n", ctx->sb.segment_size);
-        ctx->errors++;
+    if (ctx->sb.segment_size < LSFS_SEGMENT_BLOCKS_MIN ||
+        ctx->sb.segment_size > LSFS_SEGMENT_BLOCKS ||
+        (ctx->sb.segment_size & (ctx->sb.segment_size - 1)) != 0) {
+        fsck_error(ctx, "Invalid segment size: %u", ctx->sb.segment_size);
+        return -1;
+    }
+
+    const char *layout_error = lsfs_sb_check_layout(&ctx->sb);
+    if (layout_error) {
+        fsck_error(ctx, "Invalid disk layout: %s", layout_error);
         return -1;
     }
 
     uint64_t expected_blocks = ctx->size / LSFS_BLOCK_SIZE;
     if (ctx->sb.total_blocks > expected_blocks) {
-        fprintf(stderr, "WARNING: Superblock claims more blocks than file size\n");
-        ctx->warnings++;
+        fsck_warning(ctx, "Superblock claims more blocks than file size");
     }
 
     if (ctx->sb.state != 0) {
-        fprintf(stderr, "WARNING: Filesystem was not cleanly unmounted\n");
-        ctx->warnings++;
+        fsck_warning(ctx, "Filesystem was not cleanly unmounted");
     }
 
     if (ctx->verbose) {
         printf("  Version: %u\n", ctx->sb.version);
         printf("  Total blocks: %lu\n", (unsigned long)ctx->sb.total_blocks);
         printf("  Total segments: %lu\n", (unsigned long)ctx->sb.total_segments);
-        printf("  Inode count: %lu\n", (unsigned long)ctx->sb.inode_count);
+        printf("  Segment size: %u blocks\n", ctx->sb.segment_size);
+        printf("  Checkpoint regions: %lu and %lu, %lu blocks each\n",
+               (unsigned long)ctx->sb.checkpoint_region[0],
+               (unsigned long)ctx->sb.checkpoint_region[1],
+               (unsigned long)ctx->sb.checkpoint_blocks);
+        printf("  Segment tables: two of %lu blocks from %lu\n",
+               (unsigned long)ctx->sb.segtable_blocks, (unsigned long)ctx->sb.segtable_start);
+        printf("  Log start: %lu\n", (unsigned long)ctx->sb.log_start);
+        printf("  Inode count: %lu of %lu\n", (unsigned long)ctx->sb.inode_count,
+               (unsigned long)ctx->sb.max_inodes);
         printf("  Free segments: %lu\n", (unsigned long)ctx->sb.free_segments);
         printf("  Active checkpoint: %u\n", ctx->sb.active_checkpoint);
         printf("  Log head: %lu\n", (unsigned long)ctx->sb.log_head);
@@ -115,42 +448,27 @@ static int check_checkpoints(struct fsck_context *ctx)
 
     printf("Checking checkpoints...\n");
 
-    /* Read checkpoint 0 */
-    if (read_block(ctx, LSFS_CHECKPOINT0_START, block) == 0) {
-        memcpy(&cp[0], block, sizeof(cp[0]));
-        if (cp[0].magic == LSFS_CHECKPOINT_MAGIC && cp[0].complete == 1) {
-            valid[0] = 1;
-            if (ctx->verbose) {
-                printf("  Checkpoint 0: sequence %lu, timestamp %lu\n",
-                       (unsigned long)cp[0].sequence,
-                       (unsigned long)cp[0].timestamp);
-            }
-        }
-    }
-
-    /* Read checkpoint 1 */
-    if (read_block(ctx, LSFS_CHECKPOINT1_START, block) == 0) {
-        memcpy(&cp[1], block, sizeof(cp[1]));
-        if (cp[1].magic == LSFS_CHECKPOINT_MAGIC && cp[1].complete == 1) {
-            valid[1] = 1;
-            if (ctx->verbose) {
-                printf("  Checkpoint 1: sequence %lu, timestamp %lu\n",
-                       (unsigned long)cp[1].sequence,
-                       (unsigned long)cp[1].timestamp);
+    for (int i = 0; i < 2; i++) {
+        if (read_block(ctx, ctx->sb.checkpoint_region[i], block) == 0) {
+            memcpy(&cp[i], block, sizeof(cp[i]));
+            if (lsfs_checkpoint_valid(&cp[i])) {
+                valid[i] = 1;
+                if (ctx->verbose) {
+                    printf("  Checkpoint %d: sequence %lu, timestamp %lu\n", i,
+                           (unsigned long)cp[i].sequence,
+                           (unsigned long)cp[i].timestamp);
+                }
             }
         }
     }
 
     if (!valid[0] && !valid[1]) {
-        fprintf(stderr, "ERROR: No valid checkpoints found\n");
-        ctx->errors++;
+        fsck_error(ctx, "No valid checkpoints found");
         return -1;
     }
 
     if (!valid[ctx->sb.active_checkpoint]) {
-        fprintf(stderr, "WARNING: Active checkpoint %u is invalid\n",
-                ctx->sb.active_checkpoint);
-        ctx->warnings++;
+        fsck_warning(ctx, "Active checkpoint %u is invalid", ctx->sb.active_checkpoint);
 
         if (ctx->repair) {
             /* Switch to other checkpoint */
@@ -165,56 +483,287 @@ static int check_checkpoints(struct fsck_context *ctx)
 }
 
 /*
- * Check segments
+ * Read the segment usage table and the inode map chunk table of the
+ * active checkpoint, and allocate the bitmaps
+ * Both tables are read in one piece.
  */
-static int check_segments(struct fsck_context *ctx)
+static int load_tables(struct fsck_context *ctx)
 {
+    uint64_t per_block = LSFS_BLOCK_SIZE / sizeof(struct lsfs_segment_usage);
+    uint64_t table_blocks = (ctx->sb.total_segments + per_block - 1) / per_block;
+    uint64_t cp_block = ctx->sb.checkpoint_region[ctx->sb.active_checkpoint & 1];
+    uint64_t max_chunks = ctx->sb.max_inodes / LSFS_IMAP_CHUNK_ENTRIES;
     uint8_t block[LSFS_BLOCK_SIZE];
-    uint32_t valid_segments = 0;
-    uint32_t free_segments = 0;
 
-    printf("Checking segments...\n");
+    ctx->usage = malloc(table_blocks * LSFS_BLOCK_SIZE);
+    if (!ctx->usage) {
+        fsck_error(ctx, "Out of memory for the segment table");
+        return -1;
+    }
+    if (read_blocks(ctx, lsfs_sb_segtable_block(&ctx->sb, ctx->sb.active_checkpoint),
+                    table_blocks, ctx->usage) < 0) {
+        fsck_error(ctx, "Cannot read segment table");
+        return -1;
+    }
 
-    for (uint64_t seg = 0; seg < ctx->sb.total_segments; seg++) {
-        uint64_t seg_start = LSFS_LOG_START + seg * LSFS_SEGMENT_BLOCKS;
+    if (read_block(ctx, cp_block, block) < 0) {
+        fsck_error(ctx, "Cannot read checkpoint header");
+        return -1;
+    }
+    memcpy(&ctx->cp, block, sizeof(ctx->cp));
 
-        if (read_block(ctx, seg_start, block) < 0) {
-            continue;
+    if (ctx->cp.imap_chunks == 0 || ctx->cp.imap_chunks > max_chunks) {
+        fsck_error(ctx, "Checkpoint has %u inode map chunks (max %lu)",
+                   ctx->cp.imap_chunks, (unsigned long)max_chunks);
+        return -1;
+    }
+
+    uint32_t chunk_blocks = (ctx->cp.imap_chunks + LSFS_IMAP_TABLE_ENTRIES - 1) /
+                            LSFS_IMAP_TABLE_ENTRIES;
+    ctx->imap_table = malloc((size_t)chunk_blocks * LSFS_BLOCK_SIZE);
+    ctx->chunks = calloc(ctx->cp.imap_chunks, sizeof(*ctx->chunks));
+    if (!ctx->imap_table || !ctx->chunks) {
+        fsck_error(ctx, "Out of memory for the inode map chunk table");
+        return -1;
+    }
+    if (read_blocks(ctx, cp_block + 1, chunk_blocks, ctx->imap_table) < 0) {
+        fsck_error(ctx, "Cannot read inode map chunk table");
+        return -1;
+    }
+
+    ctx->log_blocks = ctx->sb.total_segments * ctx->sb.segment_size;
+    ctx->inode_bits = (uint64_t)ctx->cp.imap_chunks * LSFS_IMAP_CHUNK_ENTRIES;
+    for (int t = 0; t < FSCK_BLOCK_TYPES; t++) {
+        ctx->typed[t] = bitmap_alloc(ctx->log_blocks);
+    }
+    ctx->mapped = bitmap_alloc(ctx->log_blocks);
+    ctx->inodes = bitmap_alloc(ctx->inode_bits);
+    ctx->dirs = bitmap_alloc(ctx->inode_bits);
+    ctx->reached = bitmap_alloc(ctx->inode_bits);
+    for (int t = 0; t < FSCK_BLOCK_TYPES; t++) {
+        if (!ctx->typed[t]) {
+            ctx->mapped = NULL;
         }
+    }
+    if (!ctx->mapped || !ctx->inodes || !ctx->dirs || !ctx->reached) {
+        fsck_error(ctx, "Out of memory for the block and inode bitmaps");
+        return -1;
+    }
 
-        struct lsfs_segment_header *header = (struct lsfs_segment_header *)block;
+    return 0;
+}
 
-        if (header->magic == LSFS_SEGMENT_MAGIC) {
-            valid_segments++;
+/*
+ * Check a segment's usage table entry against its summary
+ * live_blocks must match the live bitmap, and only blocks the summary
+ * describes can be live.  block_count is 0 for a segment never written.
+ * The table is written at checkpoints, so a mismatch after a crash is
+ * only a warning.
+ */
+static void check_segment_usage(struct fsck_context *ctx, uint64_t seg,
+                                const struct lsfs_segment_usage *usage, uint32_t block_count)
+{
+    uint32_t live = 0;
+    uint32_t stray = 0;
+
+    for (uint32_t i = 0; i < LSFS_SEGMENT_BLOCKS; i++) {
+        if (usage->live_map[i / 64] & (1ULL << (i % 64))) {
+            live++;
+            if (i < LSFS_SUMMARY_BLOCKS || i >= block_count) {
+                stray++;
+            }
+        }
+    }
+
+    if (live != usage->live_blocks) {
+        fsck_warning(ctx, "Segment %lu counts %u live blocks, bitmap has %u",
+                     (unsigned long)seg, usage->live_blocks, live);
+    }
+
+    if (usage->state == LSFS_SEG_FREE && live > 0) {
+        fsck_warning(ctx, "Segment %lu is free but has %u live blocks",
+                     (unsigned long)seg, live);
+    } else if (usage->state != LSFS_SEG_FREE && stray > 0) {
+        fsck_warning(ctx, "Segment %lu has %u live blocks outside its summary",
+                     (unsigned long)seg, stray);
+    }
+}
 
-            if (header->segment_id != seg) {
-                fprintf(stderr, "WARNING: Segment %lu has wrong ID %u\n",
-                        (unsigned long)seg, header->segment_id);
-                ctx->warnings++;
+/*
+ * Check the contents of a live block against the type its summary gives
+ * Extent tree and packed blocks carry headers of their own, and inode
+ * map chunks hold the inodes their position says.
+ */
+static void check_block_contents(struct fsck_context *ctx, uint64_t block,
+                                 const struct lsfs_block_info *info, const uint8_t *data)
+{
+    if (info->type == LSFS_BLOCK_TYPE_EXTENT) {
+        const struct lsfs_extent_header *hdr = (const struct lsfs_extent_header *)data;
+        if (hdr->magic != LSFS_EXTENT_MAGIC || hdr->ino != info->ino ||
+            hdr->count == 0 || hdr->count > LSFS_EXTENTS_PER_NODE) {
+            fsck_error(ctx, "Block %lu is not an extent block of inode %u",
+                       (unsigned long)block, info->ino);
+        }
+    } else if (info->type == LSFS_BLOCK_TYPE_PACKED) {
+        const struct lsfs_packed_header *hdr = (const struct lsfs_packed_header *)data;
+        if (hdr->magic != LSFS_PACKED_MAGIC || hdr->count == 0 ||
+            hdr->count > LSFS_PACKED_SLOTS || hdr->end > LSFS_BLOCK_SIZE) {
+            fsck_error(ctx, "Block %lu is not a packed block", (unsigned long)block);
+        }
+    } else if (info->type == LSFS_BLOCK_TYPE_IMAP) {
+        const struct lsfs_imap_entry *entries = (const struct lsfs_imap_entry *)data;
+        for (uint32_t i = 0; i < LSFS_IMAP_CHUNK_ENTRIES; i++) {
+            uint64_t ino = (uint64_t)info->offset * LSFS_IMAP_CHUNK_ENTRIES + i;
+            if (entries[i].ino != 0 && entries[i].ino != ino) {
+                fsck_error(ctx, "Inode map chunk %u at block %lu holds inode %u in slot %u",
+                           info->offset, (unsigned long)block, entries[i].ino, i);
+                break;
             }
+        }
+    }
+}
+
+/*
+ * Check one segment
+ * The summary is read first, then every block it describes in one read,
+ * and each block is checked against its checksum.  A bad checksum in a
+ * live block is an error; in a dead one it only costs the cleaner a
+ * block it would have discarded anyway.  Free segments are not read
+ * past their summary, which may be left over from an earlier use.
+ */
+static void check_segment(struct fsck_worker *w, uint64_t seg)
+{
+    struct fsck_context *ctx = w->ctx;
+    struct lsfs_segment_usage *usage = &ctx->usage[seg];
+    const struct lsfs_segment_summary *summary = (const struct lsfs_segment_summary *)w->buf;
+    const struct lsfs_segment_summary *current;
+    uint32_t tail = LSFS_SUMMARY_TAIL(ctx->sb.segment_size);
+    uint8_t *tail_buf = w->buf + (size_t)tail * LSFS_BLOCK_SIZE;
+    uint64_t seg_start = ctx->sb.log_start + seg * ctx->sb.segment_size;
+    uint64_t first_bit = seg * ctx->sb.segment_size;
+    uint32_t block_count = 0;
+
+    if (usage->state == LSFS_SEG_FREE) {
+        __atomic_add_fetch(&ctx->free_segments, 1, __ATOMIC_RELAXED);
+        check_segment_usage(ctx, seg, usage, 0);
+        return;
+    }
+
+    if (read_blocks(ctx, seg_start, LSFS_SUMMARY_BLOCKS, w->buf) < 0 ||
+        read_blocks(ctx, seg_start + tail, LSFS_SUMMARY_BLOCKS, tail_buf) < 0) {
+        fsck_error(ctx, "Cannot read segment %lu summary", (unsigned long)seg);
+        return;
+    }
+
+    /* A segment flushed while open may have its current summary at the end */
+    current = lsfs_summary_current(summary, (const struct lsfs_segment_summary *)tail_buf,
+                                   (uint32_t)seg, ctx->sb.segment_size);
+    if (current) {
+        summary = current;
+    }
+
+    if (summary->header.magic != LSFS_SEGMENT_MAGIC) {
+        /* An open segment nothing has been flushed to yet */
+        check_segment_usage(ctx, seg, usage, 0);
+        return;
+    }
 
-            if (header->block_count > LSFS_SEGMENT_BLOCKS) {
-                fprintf(stderr, "ERROR: Segment %lu has invalid block count %u\n",
-                        (unsigned long)seg, header->block_count);
-                ctx->errors++;
+    if (!lsfs_summary_valid(summary, (uint32_t)seg, ctx->sb.segment_size)) {
+        if (summary->header.checksum != lsfs_summary_checksum(summary)) {
+            fsck_error(ctx, "Segment %lu summary checksum mismatch", (unsigned long)seg);
+            return;
+        }
+        if (summary->header.segment_id != seg) {
+            fsck_warning(ctx, "Segment %lu has wrong ID %u",
+                         (unsigned long)seg, summary->header.segment_id);
+        }
+        if (summary->header.block_count < LSFS_SUMMARY_BLOCKS ||
+            summary->header.block_count > ctx->sb.segment_size) {
+            fsck_error(ctx, "Segment %lu has invalid block count %u",
+                       (unsigned long)seg, summary->header.block_count);
+            check_segment_usage(ctx, seg, usage, 0);
+            return;
+        }
+    }
+
+    __atomic_add_fetch(&ctx->valid_segments, 1, __ATOMIC_RELAXED);
+    block_count = summary->header.block_count;
+    uint32_t count = block_count - LSFS_SUMMARY_BLOCKS;
+    uint8_t *data = w->buf + (size_t)LSFS_SUMMARY_BLOCKS * LSFS_BLOCK_SIZE;
+
+    if (count > 0 && read_blocks(ctx, seg_start + LSFS_SUMMARY_BLOCKS, count, data) < 0) {
+        fsck_error(ctx, "Cannot read segment %lu", (unsigned long)seg);
+        return;
+    }
+    lsfs_crc32c_blocks(data, count, w->crcs);
+
+    uint32_t dead_mismatch = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        const struct lsfs_block_info *info = &summary->blocks[i];
+        uint32_t offset = LSFS_SUMMARY_BLOCKS + i;
+        bool live = (usage->live_map[offset / 64] >> (offset % 64)) & 1;
+
+        if (info->type >= FSCK_BLOCK_TYPES) {
+            fsck_error(ctx, "Segment %lu block %u has unknown type %u",
+                       (unsigned long)seg, offset, info->type);
+            continue;
+        }
+        bit_set(ctx->typed[info->type], first_bit + offset);
+
+        if (w->crcs[i] != info->checksum) {
+            if (live) {
+                fsck_error(ctx, "Segment %lu block %u checksum mismatch",
+                           (unsigned long)seg, offset);
+            } else {
+                dead_mismatch++;
             }
-        } else if (header->magic == 0) {
-            free_segments++;
+            continue;
+        }
+        if (live) {
+            check_block_contents(ctx, seg_start + offset, info,
+                                 data + (size_t)i * LSFS_BLOCK_SIZE);
         }
     }
+    if (dead_mismatch > 0) {
+        fsck_warning(ctx, "Segment %lu has %u dead blocks that fail their checksum",
+                     (unsigned long)seg, dead_mismatch);
+    }
+    __atomic_add_fetch(&ctx->checked_blocks, count, __ATOMIC_RELAXED);
+
+    check_segment_usage(ctx, seg, usage, block_count);
+}
+
+/*
+ * Check segments
+ */
+static int check_segments(struct fsck_context *ctx)
+{
+    struct fsck_pass pass = {
+        .what = "segments",
+        .items = ctx->sb.total_segments,
+        .work = check_segment,
+        .thread = pass_thread,
+    };
+
+    printf("Checking segments...\n");
+
+    if (pass_run(ctx, &pass) < 0) {
+        return -1;
+    }
 
     if (ctx->verbose) {
-        printf("  Valid segments: %u\n", valid_segments);
-        printf("  Free segments: %u\n", free_segments);
+        printf("  Valid segments: %lu\n", (unsigned long)ctx->valid_segments);
+        printf("  Free segments: %lu\n", (unsigned long)ctx->free_segments);
+        printf("  Blocks checked: %lu\n", (unsigned long)ctx->checked_blocks);
     }
 
-    if (free_segments != ctx->sb.free_segments) {
-        fprintf(stderr, "WARNING: Free segment count mismatch: sb=%lu, actual=%u\n",
-                (unsigned long)ctx->sb.free_segments, free_segments);
-        ctx->warnings++;
+    if (ctx->free_segments != ctx->sb.free_segments) {
+        fsck_warning(ctx, "Free segment count mismatch: sb=%lu, actual=%lu",
+                     (unsigned long)ctx->sb.free_segments,
+                     (unsigned long)ctx->free_segments);
 
         if (ctx->repair) {
-            ctx->sb.free_segments = free_segments;
+            ctx->sb.free_segments = ctx->free_segments;
             write_block(ctx, LSFS_SUPERBLOCK_BLOCK, &ctx->sb);
             printf("  REPAIRED: Updated free segment count\n");
         }
@@ -224,136 +773,357 @@ static int check_segments(struct fsck_context *ctx)
 }
 
 /*
- * Check inode map
+ * Record that the inode map points at blocks start to end - 1
+ * A summary must describe each as type, and the usage table must keep it
+ * live: a checkpoint's table only drops blocks its inode map no longer
+ * needs, crash or not.  Each block may be mapped once, unless shared is
+ * set for blocks holding several inodes or compressed blocks.  Returns -1
+ * after reporting the first error.
  */
-static int check_inode_map(struct fsck_context *ctx)
+static int map_blocks(struct fsck_context *ctx, uint32_t ino, uint64_t start, uint64_t end,
+                      uint8_t type, bool shared)
 {
-    uint8_t block[LSFS_BLOCK_SIZE];
-    struct lsfs_checkpoint_header cp;
-    uint64_t cp_block;
-    uint32_t valid_inodes = 0;
+    for (uint64_t block = start; block < end; block++) {
+        uint64_t bit = block - ctx->sb.log_start;
 
-    printf("Checking inode map...\n");
+        if (!bit_test(ctx->typed[type], bit)) {
+            fsck_error(ctx, "Inode %u maps block %lu, which no summary describes as "
+                       "type %u", ino, (unsigned long)block, type);
+            return -1;
+        }
+        if (!block_live(ctx, block)) {
+            fsck_error(ctx, "Inode %u maps block %lu, which is not live",
+                       ino, (unsigned long)block);
+            return -1;
+        }
+        if (bit_test_and_set(ctx->mapped, bit) && !shared) {
+            fsck_error(ctx, "Inode %u maps block %lu, which is mapped already",
+                       ino, (unsigned long)block);
+            return -1;
+        }
+    }
 
-    /* Read active checkpoint header */
-    cp_block = (ctx->sb.active_checkpoint == 0) ?
-               LSFS_CHECKPOINT0_START : LSFS_CHECKPOINT1_START;
+    return 0;
+}
 
-    if (read_block(ctx, cp_block, block) < 0) {
-        fprintf(stderr, "ERROR: Cannot read checkpoint header\n");
-        ctx->errors++;
-        return -1;
+/*
+ * Check one level of an inode's extent tree
+ * entries are the extents (depth 0) or index entries found at depth, and
+ * data blocks are expected to be of type.  Returns -1 after reporting the
+ * first problem.
+ */
+static int check_extent_level(struct fsck_context *ctx, uint32_t ino,
+                              const struct lsfs_extent *entries, uint32_t count,
+                              uint16_t depth, uint8_t type)
+{
+    struct lsfs_extent_node node;
+    uint64_t next = 0;
+
+    for (uint32_t i = 0; i < count; i++) {
+        const struct lsfs_extent *e = &entries[i];
+        uint64_t start = e->physical;
+        uint64_t end = depth == 0 ? e->physical + e->length : e->physical + 1;
+        bool packed = depth == 0 && LSFS_IS_PACKED(e->physical) && e->length > 0;
+
+        /* Compressed runs map slots; check the packed blocks they are in */
+        if (packed) {
+            start = LSFS_PACKED_BLOCK(e->physical);
+            end = LSFS_PACKED_BLOCK(e->physical + e->length - 1) + 1;
+        }
+
+        if (e->length == 0 || e->logical < next || (depth > 0 && LSFS_IS_PACKED(start)) ||
+            !in_log(ctx, start, end)) {
+            fsck_error(ctx, "Inode %u has bad extent %u+%u -> %lu at depth %u",
+                       ino, e->logical, e->length, (unsigned long)e->physical, depth);
+            return -1;
+        }
+        next = depth == 0 ? (uint64_t)e->logical + e->length : (uint64_t)e->logical + 1;
+
+        if (depth == 0) {
+            if (map_blocks(ctx, ino, start, end,
+                           packed ? LSFS_BLOCK_TYPE_PACKED : type, packed) < 0) {
+                return -1;
+            }
+            continue;
+        }
+
+        if (read_block(ctx, e->physical, &node) < 0 ||
+            node.header.magic != LSFS_EXTENT_MAGIC ||
+            node.header.ino != ino ||
+            node.header.depth != depth - 1 ||
+            node.header.count != e->length ||
+            node.entries[0].logical != e->logical) {
+            fsck_error(ctx, "Inode %u has bad extent block %lu",
+                       ino, (unsigned long)e->physical);
+            return -1;
+        }
+
+        if (map_blocks(ctx, ino, start, end, LSFS_BLOCK_TYPE_EXTENT, false) < 0 ||
+            check_extent_level(ctx, ino, node.entries, node.header.count, depth - 1,
+                               type) < 0) {
+            return -1;
+        }
     }
 
-    memcpy(&cp, block, sizeof(cp));
+    return 0;
+}
 
-    if (ctx->verbose) {
-        printf("  Inode map entries: %u\n", cp.imap_entries);
+/*
+ * Read the inode stored at location
+ * The block stays in the worker's buffer, where the next inode usually
+ * is too.  Returns NULL if it cannot be read.
+ */
+static const struct lsfs_inode *read_inode(struct fsck_worker *w, uint64_t location)
+{
+    uint64_t block = LSFS_INODE_LOC_BLOCK(location);
+
+    if (w->inode_block != block) {
+        w->inode_block = 0;
+        if (read_block(w->ctx, block, w->inode_buf) < 0) {
+            return NULL;
+        }
+        w->inode_block = block;
     }
 
-    /* Read and validate inode map entries */
-    uint32_t entries_per_block = LSFS_BLOCK_SIZE / sizeof(struct lsfs_imap_entry);
-    uint32_t blocks_needed = (cp.imap_entries + entries_per_block - 1) / entries_per_block;
+    return (const struct lsfs_inode *)(w->inode_buf + LSFS_INODE_LOC_SLOT(location) *
+                                       sizeof(struct lsfs_inode));
+}
 
-    for (uint32_t b = 0; b < blocks_needed; b++) {
-        if (read_block(ctx, cp_block + 1 + b, block) < 0) {
-            fprintf(stderr, "ERROR: Cannot read inode map block %u\n", b);
-            ctx->errors++;
-            continue;
+/*
+ * Check an inode and record the blocks it maps
+ */
+static void check_inode(struct fsck_worker *w, uint32_t ino, uint64_t location)
+{
+    struct fsck_context *ctx = w->ctx;
+    uint64_t block = LSFS_INODE_LOC_BLOCK(location);
+    const struct lsfs_inode *inode = read_inode(w, location);
+
+    if (!inode) {
+        fsck_error(ctx, "Cannot read inode %u", ino);
+        return;
+    }
+    if (inode->ino != ino) {
+        fsck_error(ctx, "Inode %u found as %u", ino, inode->ino);
+        return;
+    }
+    if (map_blocks(ctx, ino, block, block + 1, LSFS_BLOCK_TYPE_INODE, true) < 0) {
+        return;
+    }
+
+    uint8_t type = LSFS_BLOCK_TYPE_DATA;
+    if ((inode->mode & S_IFMT) == S_IFDIR) {
+        bit_set(ctx->dirs, ino);
+        type = LSFS_BLOCK_TYPE_DIRENT;
+    }
+
+    /* Inline data takes the place of the extents */
+    if (inode->flags & LSFS_INODE_INLINE_DATA) {
+        if (inode->extent_count || inode->extent_depth || inode->blocks) {
+            fsck_error(ctx, "Inode %u has inline data and mapped blocks", ino);
         }
+        return;
+    }
 
-        struct lsfs_imap_entry *entries = (struct lsfs_imap_entry *)block;
-        uint32_t entries_in_block = (b == blocks_needed - 1) ?
-                                    (cp.imap_entries - b * entries_per_block) :
-                                    entries_per_block;
+    if (inode->extent_count > LSFS_INLINE_EXTENTS) {
+        fsck_error(ctx, "Inode %u has %u inline extents", ino, inode->extent_count);
+        return;
+    }
 
-        for (uint32_t i = 0; i < entries_in_block; i++) {
-            struct lsfs_imap_entry *entry = &entries[i];
+    /* The tree is walked from a copy, as reading it reuses the buffer */
+    struct lsfs_extent extents[LSFS_INLINE_EXTENTS];
+    uint16_t count = inode->extent_count;
+    uint16_t depth = inode->extent_depth;
 
-            if (entry->ino == 0) {
-                continue;
-            }
+    memcpy(extents, inode->extents, sizeof(extents));
+    check_extent_level(ctx, ino, extents, count, depth, type);
+}
 
-            if (entry->location < LSFS_LOG_START ||
-                entry->location >= ctx->sb.total_blocks) {
-                fprintf(stderr, "ERROR: Inode %u has invalid location %lu\n",
-                        entry->ino, (unsigned long)entry->location);
-                ctx->errors++;
-                continue;
-            }
+/*
+ * Check one inode map chunk and every inode in it
+ * A chunk covers whole words of the inode bitmaps, so they are set
+ * without atomics.
+ */
+static void check_chunk(struct fsck_worker *w, uint64_t c)
+{
+    struct fsck_context *ctx = w->ctx;
+    uint64_t location = ctx->imap_table[c];
+    struct lsfs_imap_entry *entries;
 
-            valid_inodes++;
+    if (location == 0) {
+        return;
+    }
+
+    entries = malloc(LSFS_BLOCK_SIZE);
+    if (!entries) {
+        fsck_error(ctx, "Out of memory for inode map chunk %lu", (unsigned long)c);
+        return;
+    }
+
+    if (!in_log(ctx, location, location + 1) || read_block(ctx, location, entries) < 0) {
+        fsck_error(ctx, "Cannot read inode map chunk %lu at %lu",
+                   (unsigned long)c, (unsigned long)location);
+        free(entries);
+        return;
+    }
+    __atomic_add_fetch(&ctx->chunks_read, 1, __ATOMIC_RELAXED);
+    map_blocks(ctx, 0, location, location + 1, LSFS_BLOCK_TYPE_IMAP, false);
+
+    for (uint32_t i = 0; i < LSFS_IMAP_CHUNK_ENTRIES; i++) {
+        struct lsfs_imap_entry *entry = &entries[i];
+        uint32_t ino = (uint32_t)(c * LSFS_IMAP_CHUNK_ENTRIES + i);
+
+        if (entry->ino == 0) {
+            continue;
+        }
+
+        if (entry->ino != ino) {
+            fsck_error(ctx, "Inode map slot for inode %u holds inode %u", ino, entry->ino);
+            entry->ino = 0;
+            continue;
+        }
+
+        uint64_t block = LSFS_INODE_LOC_BLOCK(entry->location);
+        if (!in_log(ctx, block, block + 1) ||
+            LSFS_INODE_LOC_SLOT(entry->location) >= LSFS_INODES_PER_BLOCK) {
+            fsck_error(ctx, "Inode %u has invalid location %lu",
+                       entry->ino, (unsigned long)entry->location);
+            entry->ino = 0;
+            continue;
         }
+
+        bit_set(ctx->inodes, ino);
+        check_inode(w, ino, entry->location);
+        __atomic_add_fetch(&ctx->valid_inodes, 1, __ATOMIC_RELAXED);
     }
 
-    if (ctx->verbose) {
-        printf("  Valid inodes: %u\n", valid_inodes);
+    ctx->chunks[c] = entries;
+}
+
+/*
+ * Look for live blocks nothing maps
+ * The cleaner keeps moving them, so they only waste space.  Inode and
+ * packed blocks stay live until the cleaner finds all their slots dead,
+ * so only blocks of other types count.  Segments cover whole words of
+ * the bitmaps, so they are compared a word at a time against the live
+ * maps.
+ */
+static void check_unmapped(struct fsck_context *ctx)
+{
+    uint32_t words = ctx->sb.segment_size / 64;
+    uint64_t unmapped = 0;
+    uint64_t segments = 0;
+
+    for (uint64_t seg = 0; seg < ctx->sb.total_segments; seg++) {
+        const struct lsfs_segment_usage *usage = &ctx->usage[seg];
+        const uint64_t *mapped = ctx->mapped + seg * words;
+        uint32_t count = 0;
+
+        if (usage->state == LSFS_SEG_FREE) {
+            continue;
+        }
+        for (uint32_t i = 0; i < words; i++) {
+            uint64_t word = seg * words + i;
+            uint64_t shared = ctx->typed[LSFS_BLOCK_TYPE_INODE][word] |
+                              ctx->typed[LSFS_BLOCK_TYPE_PACKED][word];
+            count += (uint32_t)__builtin_popcountll(usage->live_map[i] & ~mapped[i] & ~shared);
+        }
+        if (count > 0) {
+            if (ctx->verbose && segments < FSCK_LIST_MAX) {
+                printf("  Segment %lu: %u live blocks not mapped\n",
+                       (unsigned long)seg, count);
+            }
+            unmapped += count;
+            segments++;
+        }
     }
 
-    return 0;
+    if (unmapped > 0) {
+        fsck_warning(ctx, "%lu live blocks in %lu segments are not mapped by any inode",
+                     (unsigned long)unmapped, (unsigned long)segments);
+    }
 }
 
 /*
- * Check root directory
+ * Check inode map
  */
-static int check_root(struct fsck_context *ctx)
+static int check_inode_map(struct fsck_context *ctx)
 {
-    uint8_t block[LSFS_BLOCK_SIZE];
-    struct lsfs_inode *root;
+    struct fsck_pass pass = {
+        .what = "inode map chunks",
+        .items = ctx->cp.imap_chunks,
+        .work = check_chunk,
+        .thread = pass_thread,
+    };
 
-    printf("Checking root directory...\n");
+    printf("Checking inode map...\n");
 
-    /* Find root inode location from checkpoint */
-    uint64_t cp_block = (ctx->sb.active_checkpoint == 0) ?
-                        LSFS_CHECKPOINT0_START : LSFS_CHECKPOINT1_START;
+    if (ctx->verbose) {
+        printf("  Inode map entries: %u\n", ctx->cp.imap_entries);
+    }
 
-    struct lsfs_checkpoint_header cp;
-    if (read_block(ctx, cp_block, block) < 0) {
-        ctx->errors++;
+    if (pass_run(ctx, &pass) < 0) {
         return -1;
     }
-    memcpy(&cp, block, sizeof(cp));
 
-    /* Read first inode map block */
-    if (read_block(ctx, cp_block + 1, block) < 0) {
-        ctx->errors++;
-        return -1;
+    if (ctx->valid_inodes != ctx->cp.imap_entries) {
+        fsck_warning(ctx, "Inode map holds %lu inodes, checkpoint says %u",
+                     (unsigned long)ctx->valid_inodes, ctx->cp.imap_entries);
     }
 
-    struct lsfs_imap_entry *entries = (struct lsfs_imap_entry *)block;
-    uint64_t root_location = 0;
+    if (ctx->verbose) {
+        printf("  Inode map chunks: %lu\n", (unsigned long)ctx->chunks_read);
+        printf("  Valid inodes: %lu\n", (unsigned long)ctx->valid_inodes);
+    }
 
-    for (uint32_t i = 0; i < cp.imap_entries; i++) {
-        if (entries[i].ino == LSFS_ROOT_INO) {
-            root_location = entries[i].location;
-            break;
-        }
+    check_unmapped(ctx);
+
+    return 0;
+}
+
+/*
+ * Find where the inode map puts an inode
+ * Returns 0 for inodes not in it.
+ */
+static uint64_t inode_location(const struct fsck_context *ctx, uint32_t ino)
+{
+    if (ino >= ctx->inode_bits || !bit_test(ctx->inodes, ino)) {
+        return 0;
     }
+    return ctx->chunks[ino / LSFS_IMAP_CHUNK_ENTRIES][ino % LSFS_IMAP_CHUNK_ENTRIES].location;
+}
+
+/*
+ * Check root directory
+ */
+static int check_root(struct fsck_context *ctx)
+{
+    uint8_t block[LSFS_BLOCK_SIZE];
+    struct lsfs_inode *root;
 
+    printf("Checking root directory...\n");
+
+    uint64_t root_location = inode_location(ctx, LSFS_ROOT_INO);
     if (root_location == 0) {
-        fprintf(stderr, "ERROR: Root inode not found in inode map\n");
-        ctx->errors++;
+        fsck_error(ctx, "Root inode not found in inode map");
         return -1;
     }
 
     /* Read root inode */
-    if (read_block(ctx, root_location, block) < 0) {
-        fprintf(stderr, "ERROR: Cannot read root inode\n");
-        ctx->errors++;
+    if (read_block(ctx, LSFS_INODE_LOC_BLOCK(root_location), block) < 0) {
+        fsck_error(ctx, "Cannot read root inode");
         return -1;
     }
 
-    root = (struct lsfs_inode *)block;
+    root = (struct lsfs_inode *)(block + LSFS_INODE_LOC_SLOT(root_location) *
+                                 sizeof(struct lsfs_inode));
 
     if (root->ino != LSFS_ROOT_INO) {
-        fprintf(stderr, "ERROR: Root inode number mismatch: %u\n", root->ino);
-        ctx->errors++;
+        fsck_error(ctx, "Root inode number mismatch: %u", root->ino);
         return -1;
     }
 
     if ((root->mode & S_IFMT) != S_IFDIR) {
-        fprintf(stderr, "ERROR: Root is not a directory\n");
-        ctx->errors++;
+        fsck_error(ctx, "Root is not a directory");
         return -1;
     }
 
@@ -367,18 +1137,325 @@ static int check_root(struct fsck_context *ctx)
     return 0;
 }
 
+/*
+ * Queue a directory for the walk
+ */
+static void walk_push(struct fsck_context *ctx, uint32_t ino, uint32_t parent)
+{
+    pthread_mutex_lock(&ctx->walk_lock);
+    if (ctx->walk_len == ctx->walk_cap) {
+        uint64_t cap = ctx->walk_cap ? ctx->walk_cap * 2 : 1024;
+        struct fsck_dir *queue = realloc(ctx->walk_queue, cap * sizeof(*queue));
+        if (!queue) {
+            ctx->walk_failed = true;
+            pthread_mutex_unlock(&ctx->walk_lock);
+            return;
+        }
+        ctx->walk_queue = queue;
+        ctx->walk_cap = cap;
+    }
+    ctx->walk_queue[ctx->walk_len++] = (struct fsck_dir){ ino, parent };
+    pthread_cond_signal(&ctx->walk_cond);
+    pthread_mutex_unlock(&ctx->walk_lock);
+}
+
+/*
+ * Check the entries of one directory block, from byte start on
+ * Subdirectories found are queued and counted in subdirs.  Returns -1 if
+ * the block is malformed.
+ */
+static int check_dirent_block(struct fsck_context *ctx, const struct fsck_dir *dir,
+                              uint64_t file_block, const uint8_t *block, uint32_t start,
+                              uint32_t *subdirs)
+{
+    uint32_t pos = start;
+
+    while (pos < LSFS_BLOCK_SIZE) {
+        const struct lsfs_dirent *de = (const struct lsfs_dirent *)(block + pos);
+
+        /* Nothing more in this block */
+        if (de->rec_len == 0 || de->rec_len > LSFS_BLOCK_SIZE - pos) {
+            break;
+        }
+        if (de->rec_len < sizeof(*de) + de->name_len) {
+            fsck_error(ctx, "Directory %u has a bad entry at byte %u of block %lu",
+                       dir->ino, pos, (unsigned long)file_block);
+            return -1;
+        }
+        pos += de->rec_len;
+
+        if (de->ino == 0 || de->name_len == 0) {
+            continue;
+        }
+        __atomic_add_fetch(&ctx->dirents, 1, __ATOMIC_RELAXED);
+
+        bool dot = de->name_len == 1 && de->name[0] == '.';
+        bool dotdot = de->name_len == 2 && de->name[0] == '.' && de->name[1] == '.';
+        if (dot || dotdot) {
+            uint32_t expected = dot ? dir->ino : dir->parent;
+            if (de->ino != expected) {
+                fsck_error(ctx, "Directory %u has %s pointing to %u, expected %u",
+                           dir->ino, dot ? "." : "..", de->ino, expected);
+            }
+            continue;
+        }
+
+        if (de->ino >= ctx->inode_bits || !bit_test(ctx->inodes, de->ino)) {
+            fsck_error(ctx, "Directory %u entry %.*s names free inode %u",
+                       dir->ino, de->name_len, de->name, de->ino);
+            continue;
+        }
+
+        bool is_dir = bit_test(ctx->dirs, de->ino);
+        if (is_dir != (de->file_type == LSFS_FT_DIR)) {
+            fsck_error(ctx, "Directory %u entry %.*s has file type %u for inode %u",
+                       dir->ino, de->name_len, de->name, de->file_type, de->ino);
+        }
+
+        if (bit_test_and_set(ctx->reached, de->ino)) {
+            fsck_error(ctx, "Inode %u is named more than once, last as %.*s in "
+                       "directory %u", de->ino, de->name_len, de->name, dir->ino);
+            continue;
+        }
+        if (is_dir) {
+            (*subdirs)++;
+            walk_push(ctx, de->ino, dir->ino);
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Visit the directory blocks mapped at one level of an extent tree
+ * Runs of blocks are read in one piece.  The imap pass has reported any
+ * problem with the tree already, so a bad entry just ends the walk.
+ */
+static int walk_dir_extents(struct fsck_worker *w, const struct fsck_dir *dir,
+                            const struct lsfs_extent *entries, uint32_t count,
+                            uint16_t depth, uint64_t nblocks, bool hashed,
+                            uint32_t *subdirs)
+{
+    struct fsck_context *ctx = w->ctx;
+    struct lsfs_extent_node node;
+
+    for (uint32_t i = 0; i < count; i++) {
+        const struct lsfs_extent *e = &entries[i];
+
+        if (e->logical >= nblocks) {
+            break;
+        }
+        if (depth > 0) {
+            if (!in_log(ctx, e->physical, e->physical + 1) ||
+                read_block(ctx, e->physical, &node) < 0 ||
+                node.header.magic != LSFS_EXTENT_MAGIC ||
+                node.header.count > LSFS_EXTENTS_PER_NODE ||
+                walk_dir_extents(w, dir, node.entries, node.header.count, depth - 1,
+                                 nblocks, hashed, subdirs) < 0) {
+                return -1;
+            }
+            continue;
+        }
+
+        uint64_t length = e->length;
+        if (e->logical + length > nblocks) {
+            length = nblocks - e->logical;
+        }
+        if (LSFS_IS_PACKED(e->physical) || !in_log(ctx, e->physical, e->physical + length)) {
+            return -1;
+        }
+
+        for (uint64_t done = 0; done < length; ) {
+            uint64_t run = length - done;
+            if (run > ctx->sb.segment_size) {
+                run = ctx->sb.segment_size;
+            }
+            if (read_blocks(ctx, e->physical + done, run, w->buf) < 0) {
+                fsck_error(ctx, "Cannot read block %lu of directory %u",
+                           (unsigned long)(e->physical + done), dir->ino);
+                return -1;
+            }
+            for (uint64_t b = 0; b < run; b++) {
+                uint64_t file_block = e->logical + done + b;
+
+                /* Hashed directories keep their header in block 0 and
+                 * start each bucket with one */
+                if (hashed && file_block == 0) {
+                    continue;
+                }
+                if (check_dirent_block(ctx, dir, file_block,
+                                       w->buf + b * LSFS_BLOCK_SIZE,
+                                       hashed ? LSFS_DIR_BUCKET_START : 0, subdirs) < 0) {
+                    return -1;
+                }
+            }
+            done += run;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Walk one directory
+ * Its subdirectories are queued for the workers, and its link count is
+ * checked against them: one for its entry in its parent, one for "." and
+ * one for the ".." of each subdirectory.
+ */
+static void walk_directory(struct fsck_worker *w, const struct fsck_dir *dir)
+{
+    struct fsck_context *ctx = w->ctx;
+    const struct lsfs_inode *inode = read_inode(w, inode_location(ctx, dir->ino));
+    uint32_t subdirs = 0;
+
+    if (!inode) {
+        fsck_error(ctx, "Cannot read directory %u", dir->ino);
+        return;
+    }
+
+    struct lsfs_inode copy = *inode;
+    uint64_t nblocks = (copy.size + LSFS_BLOCK_SIZE - 1) / LSFS_BLOCK_SIZE;
+    bool hashed = (copy.flags & LSFS_INODE_HASHED_DIR) != 0;
+
+    if (copy.flags & LSFS_INODE_INLINE_DATA) {
+        /* The rest of block 0 reads as zeros */
+        memset(w->buf, 0, LSFS_BLOCK_SIZE);
+        memcpy(w->buf, copy.inline_data, LSFS_INLINE_DATA_MAX);
+        check_dirent_block(ctx, dir, 0, w->buf, 0, &subdirs);
+    } else if (walk_dir_extents(w, dir, copy.extents, copy.extent_count, copy.extent_depth,
+                                nblocks, hashed, &subdirs) < 0) {
+        fsck_error(ctx, "Directory %u could not be read to the end", dir->ino);
+        return;
+    }
+
+    if (copy.nlink != 2 + subdirs) {
+        fsck_warning(ctx, "Directory %u has %u links, expected %u",
+                     dir->ino, copy.nlink, 2 + subdirs);
+    }
+}
+
+/*
+ * Worker thread of the directory walk
+ * The walk is over once the queue is empty and no worker is walking a
+ * directory that could add to it.
+ */
+static void *walk_thread(void *arg)
+{
+    struct fsck_worker *w = arg;
+    struct fsck_context *ctx = w->ctx;
+
+    pthread_mutex_lock(&ctx->walk_lock);
+    while (1) {
+        while (ctx->walk_next == ctx->walk_len && ctx->walk_busy > 0) {
+            pthread_cond_wait(&ctx->walk_cond, &ctx->walk_lock);
+        }
+        if (ctx->walk_next == ctx->walk_len) {
+            break;
+        }
+
+        struct fsck_dir dir = ctx->walk_queue[ctx->walk_next++];
+        ctx->walk_busy++;
+        pthread_mutex_unlock(&ctx->walk_lock);
+
+        walk_directory(w, &dir);
+        __atomic_add_fetch(&w->pass->done, 1, __ATOMIC_RELAXED);
+
+        pthread_mutex_lock(&ctx->walk_lock);
+        ctx->walk_busy--;
+    }
+    pthread_cond_broadcast(&ctx->walk_cond);
+    pthread_mutex_unlock(&ctx->walk_lock);
+
+    __atomic_sub_fetch(&w->pass->running, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/*
+ * Check the directory tree
+ * Every directory is walked from the root, checking that each name
+ * points at an inode in use with the right file type and that no inode
+ * has two names.  Inodes no directory names are reported afterwards.
+ */
+static int check_tree(struct fsck_context *ctx)
+{
+    struct fsck_pass pass = {
+        .what = "directories",
+        .thread = walk_thread,
+    };
+
+    printf("Checking directory tree...\n");
+
+    bit_set(ctx->reached, LSFS_ROOT_INO);
+    walk_push(ctx, LSFS_ROOT_INO, LSFS_ROOT_INO);
+
+    if (pass_run(ctx, &pass) < 0) {
+        return -1;
+    }
+    if (ctx->walk_failed) {
+        fsck_error(ctx, "Out of memory for the directory walk");
+        return -1;
+    }
+
+    uint64_t orphans = 0;
+    for (uint64_t ino = 0; ino < ctx->inode_bits; ino++) {
+        if (bit_test(ctx->inodes, ino) && !bit_test(ctx->reached, ino)) {
+            if (orphans < FSCK_LIST_MAX) {
+                fsck_warning(ctx, "Inode %lu is not in any directory", (unsigned long)ino);
+            }
+            orphans++;
+        }
+    }
+    if (orphans > FSCK_LIST_MAX) {
+        fsck_warning(ctx, "%lu more inodes are not in any directory",
+                     (unsigned long)(orphans - FSCK_LIST_MAX));
+    }
+
+    if (ctx->verbose) {
+        printf("  Directory entries: %lu\n", (unsigned long)ctx->dirents);
+        printf("  Unnamed inodes: %lu\n", (unsigned long)orphans);
+    }
+
+    return 0;
+}
+
+/*
+ * Free what the checks loaded
+ */
+static void free_tables(struct fsck_context *ctx)
+{
+    if (ctx->chunks) {
+        for (uint32_t c = 0; c < ctx->cp.imap_chunks; c++) {
+            free(ctx->chunks[c]);
+        }
+    }
+    free(ctx->chunks);
+    free(ctx->imap_table);
+    free(ctx->usage);
+    for (int t = 0; t < FSCK_BLOCK_TYPES; t++) {
+        free(ctx->typed[t]);
+    }
+    free(ctx->mapped);
+    free(ctx->inodes);
+    free(ctx->dirs);
+    free(ctx->reached);
+    free(ctx->walk_queue);
+}
+
 /*
  * Run filesystem check
  */
-static int run_fsck(const char *path, int repair, int verbose)
+static int run_fsck(const char *path, int repair, int verbose, int progress, int jobs)
 {
     struct fsck_context ctx;
-    struct stat st;
     int ret = 0;
 
     memset(&ctx, 0, sizeof(ctx));
     ctx.repair = repair;
     ctx.verbose = verbose;
+    ctx.progress = progress;
+    ctx.jobs = jobs;
+    pthread_mutex_init(&ctx.walk_lock, NULL);
+    pthread_cond_init(&ctx.walk_cond, NULL);
 
     /* Open file */
     ctx.fd = open(path, repair ? O_RDWR : O_RDONLY);
@@ -388,44 +1465,43 @@ static int run_fsck(const char *path, int repair, int verbose)
     }
 
     /* Get file size */
-    if (fstat(ctx.fd, &st) < 0) {
+    if (lsfs_image_size(ctx.fd, &ctx.size, NULL) < 0) {
         perror("Failed to stat filesystem");
         close(ctx.fd);
         return 1;
     }
-    ctx.size = st.st_size;
 
     printf("Checking LSFS filesystem: %s (%lu MB)\n\n",
            path, (unsigned long)(ctx.size / (1024 * 1024)));
 
     /* Run checks */
-    if (check_superblock(&ctx) < 0) {
+    if (check_superblock(&ctx) < 0 || check_checkpoints(&ctx) < 0 ||
+        load_tables(&ctx) < 0) {
         ret = 1;
-        goto done;
-    }
-
-    if (check_checkpoints(&ctx) < 0) {
-        ret = 1;
-        goto done;
+    } else {
+        /* The inode map needs the block types the scan finds, and the
+         * tree the inodes the map holds */
+        bool tree = check_segments(&ctx) == 0 && check_inode_map(&ctx) == 0;
+        if (check_root(&ctx) == 0 && tree) {
+            check_tree(&ctx);
+        }
     }
 
-    check_segments(&ctx);
-    check_inode_map(&ctx);
-    check_root(&ctx);
-
-done:
     if (ctx.repair && (ctx.errors > 0 || ctx.warnings > 0)) {
         fsync(ctx.fd);
     }
 
     close(ctx.fd);
+    free_tables(&ctx);
+    pthread_cond_destroy(&ctx.walk_cond);
+    pthread_mutex_destroy(&ctx.walk_lock);
 
     printf("\n");
     printf("Filesystem check complete.\n");
     printf("  Errors: %d\n", ctx.errors);
     printf("  Warnings: %d\n", ctx.warnings);
 
-    if (ctx.errors > 0) {
+    if (ret != 0 || ctx.errors > 0) {
         return 1;
     }
 
@@ -441,6 +1517,9 @@ static void usage(const char *progname)
     fprintf(stderr, "Options:\n");
     fprintf(stderr, "  -r, --repair        Attempt to repair errors\n");
     fprintf(stderr, "  -v, --verbose       Verbose output\n");
+    fprintf(stderr, "  -j, --jobs=N        Check with N threads (default: one per CPU, "
+                    "up to %d)\n", FSCK_MAX_JOBS);
+    fprintf(stderr, "  -p, --progress      Report progress once a second\n");
     fprintf(stderr, "  -h, --help          Show this help\n");
 }
 
@@ -448,17 +1527,22 @@ int main(int argc, char *argv[])
 {
     int repair = 0;
     int verbose = 0;
+    int progress = 0;
+    long jobs = sysconf(_SC_NPROCESSORS_ONLN);
     char *path = NULL;
+    char *end;
     int opt;
 
     static struct option long_options[] = {
         {"repair", no_argument, NULL, 'r'},
         {"verbose", no_argument, NULL, 'v'},
+        {"jobs", required_argument, NULL, 'j'},
+        {"progress", no_argument, NULL, 'p'},
         {"help", no_argument, NULL, 'h'},
         {NULL, 0, NULL, 0}
     };
 
-    while ((opt = getopt_long(argc, argv, "rvh", long_options, NULL)) != -1) {
+    while ((opt = getopt_long(argc, argv, "rvj:ph", long_options, NULL)) != -1) {
         switch (opt) {
         case 'r':
             repair = 1;
@@ -466,6 +1550,16 @@ int main(int argc, char *argv[])
         case 'v':
             verbose = 1;
             break;
+        case 'j':
+            jobs = strtol(optarg, &end, 10);
+            if (*end != '\0' || jobs < 1 || jobs > FSCK_MAX_JOBS) {
+                fprintf(stderr, "Invalid job count: %s (1-%d)\n", optarg, FSCK_MAX_JOBS);
+                return 1;
+            }
+            break;
+        case 'p':
+            progress = 1;
+            break;
         case 'h':
             usage(argv[0]);
             return 0;
@@ -481,6 +1575,12 @@ int main(int argc, char *argv[])
     }
 
     path = argv[optind];
+    if (jobs < 1) {
+        jobs = 1;
+    }
+    if (jobs > FSCK_MAX_JOBS) {
+        jobs = FSCK_MAX_JOBS;
+    }
 
-    return run_fsck(path, repair, verbose);
+    return run_fsck(path, repair, verbose, progress, (int)jobs);
 }
@@ -5,24 +5,34 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <getopt.h>
 #include <time.h>
+#include <errno.h>
+#include <sys/xattr.h>
 
 #include "ondisk.h"
+#include "crc32c.h"
 
 static int g_fd = -1;
 
+/*
+ * Read count blocks
+ */
+static int read_blocks(uint64_t block_num, uint64_t count, void *buf)
+{
+    return lsfs_image_read(g_fd, block_num, count, buf);
+}
+
 /*
  * Read a block
  */
 static int read_block(uint64_t block_num, void *buf)
 {
-    off_t offset = (off_t)block_num * LSFS_BLOCK_SIZE;
-    ssize_t ret = pread(g_fd, buf, LSFS_BLOCK_SIZE, offset);
-    return (ret == LSFS_BLOCK_SIZE) ? 0 : -1;
+    return read_blocks(block_num, 1, buf);
 }
 
 /*
@@ -72,9 +82,16 @@ static void dump_superblock(void)
     printf("Version:          %u\n", sb.version);
     printf("Block size:       %u bytes\n", sb.block_size);
     printf("Segment size:     %u blocks\n", sb.segment_size);
+    printf("Checkpoints:      %lu and %lu, %lu blocks each\n",
+           (unsigned long)sb.checkpoint_region[0], (unsigned long)sb.checkpoint_region[1],
+           (unsigned long)sb.checkpoint_blocks);
+    printf("Segment tables:   two of %lu blocks from %lu\n",
+           (unsigned long)sb.segtable_blocks, (unsigned long)sb.segtable_start);
+    printf("Log start:        %lu\n", (unsigned long)sb.log_start);
     printf("Total blocks:     %lu\n", (unsigned long)sb.total_blocks);
     printf("Total segments:   %lu\n", (unsigned long)sb.total_segments);
-    printf("Inode count:      %lu\n", (unsigned long)sb.inode_count);
+    printf("Inode count:      %lu of %lu\n", (unsigned long)sb.inode_count,
+           (unsigned long)sb.max_inodes);
     printf("Free segments:    %lu\n", (unsigned long)sb.free_segments);
     printf("Active checkpoint: %u\n", sb.active_checkpoint);
     printf("Log head:         %lu\n", (unsigned long)sb.log_head);
@@ -100,12 +117,18 @@ static void dump_superblock(void)
  */
 static void dump_checkpoint(int which)
 {
+    struct lsfs_superblock sb;
     struct lsfs_checkpoint_header cp;
     uint8_t block[LSFS_BLOCK_SIZE];
     uint64_t cp_block;
     char time_str[32];
 
-    cp_block = (which == 0) ? LSFS_CHECKPOINT0_START : LSFS_CHECKPOINT1_START;
+    if (read_block(LSFS_SUPERBLOCK_BLOCK, &sb) < 0) {
+        fprintf(stderr, "Failed to read superblock\n");
+        return;
+    }
+
+    cp_block = sb.checkpoint_region[which & 1];
 
     if (read_block(cp_block, block) < 0) {
         fprintf(stderr, "Failed to read checkpoint %d\n", which);
@@ -130,9 +153,19 @@ static void dump_checkpoint(int which)
     printf("Timestamp:        %s\n", time_str);
 
     printf("Log head:         %lu\n", (unsigned long)cp.log_head);
+    printf("Segment writes:   %lu\n", (unsigned long)cp.segment_seq);
+    for (int i = 0; i < LSFS_CHECKPOINT_STREAMS; i++) {
+        if (cp.open_blocks[i] > 0) {
+            printf("Open segment:     %u (stream %d, %u blocks written)\n",
+                   cp.open_segment[i], i, cp.open_blocks[i]);
+        }
+    }
     printf("Imap entries:     %u\n", cp.imap_entries);
+    printf("Imap chunks:      %u\n", cp.imap_chunks);
     printf("Segment entries:  %u\n", cp.segment_entries);
     printf("Complete:         %s\n", cp.complete ? "yes" : "no");
+    printf("Checksum:         0x%08X (%s)\n", cp.checksum,
+           cp.checksum == lsfs_checkpoint_checksum(&cp) ? "ok" : "MISMATCH");
     printf("\n");
 }
 
@@ -150,6 +183,11 @@ static void dump_inode(uint64_t block_num, uint32_t offset)
         return;
     }
 
+    if (offset >= LSFS_INODES_PER_BLOCK) {
+        fprintf(stderr, "Invalid inode slot %u\n", offset);
+        return;
+    }
+
     inode = (struct lsfs_inode *)(block + offset * sizeof(struct lsfs_inode));
 
     printf("=== INODE %u ===\n", inode->ino);
@@ -176,19 +214,28 @@ static void dump_inode(uint64_t block_num, uint32_t offset)
     format_time(inode->ctime / 1000000000ULL, time_str);
     printf("Change time:      %s\n", time_str);
 
-    printf("Direct blocks:    ");
-    for (int i = 0; i < LSFS_DIRECT_BLOCKS; i++) {
-        if (inode->direct[i]) {
-            printf("%lu ", (unsigned long)inode->direct[i]);
-        }
+    if (inode->flags & LSFS_INODE_INLINE_DATA) {
+        printf("Inline data:      %lu bytes\n",
+               (unsigned long)(inode->size < LSFS_INLINE_DATA_MAX ? inode->size
+                                                                : LSFS_INLINE_DATA_MAX));
+        printf("\n");
+        return;
     }
-    printf("\n");
 
-    if (inode->indirect) {
-        printf("Indirect:         %lu\n", (unsigned long)inode->indirect);
-    }
-    if (inode->double_indirect) {
-        printf("Double indirect:  %lu\n", (unsigned long)inode->double_indirect);
+    printf("Extent depth:     %u\n", inode->extent_depth);
+    for (int i = 0; i < inode->extent_count && i < LSFS_INLINE_EXTENTS; i++) {
+        const struct lsfs_extent *e = &inode->extents[i];
+        if (inode->extent_depth == 0 && LSFS_IS_PACKED(e->physical)) {
+            printf("Extent:           %u+%u -> %lu slot %u (compressed)\n",
+                   e->logical, e->length, (unsigned long)LSFS_PACKED_BLOCK(e->physical),
+                   LSFS_PACKED_SLOT(e->physical));
+        } else if (inode->extent_depth == 0) {
+            printf("Extent:           %u+%u -> %lu\n",
+                   e->logical, e->length, (unsigned long)e->physical);
+        } else {
+            printf("Index:            %u (%u entries) -> %lu\n",
+                   e->logical, e->length, (unsigned long)e->physical);
+        }
     }
 
     if ((inode->mode & S_IFMT) == S_IFLNK && inode->symlink[0]) {
@@ -203,20 +250,44 @@ static void dump_inode(uint64_t block_num, uint32_t offset)
  */
 static void dump_segment(uint32_t segment_id)
 {
-    uint8_t block[LSFS_BLOCK_SIZE];
-    uint64_t seg_start = LSFS_LOG_START + (uint64_t)segment_id * LSFS_SEGMENT_BLOCKS;
-    struct lsfs_segment_summary *summary;
+    struct lsfs_superblock sb;
+    uint8_t block[LSFS_SUMMARY_BLOCKS * LSFS_BLOCK_SIZE];
+    uint8_t tail_block[LSFS_SUMMARY_BLOCKS * LSFS_BLOCK_SIZE];
+    uint8_t table_block[LSFS_BLOCK_SIZE];
+    uint32_t per_block = LSFS_BLOCK_SIZE / sizeof(struct lsfs_segment_usage);
+    const struct lsfs_segment_summary *summary;
+    const struct lsfs_segment_summary *current = NULL;
     char time_str[32];
 
-    if (read_block(seg_start, block) < 0) {
+    if (read_block(LSFS_SUPERBLOCK_BLOCK, &sb) < 0) {
+        fprintf(stderr, "Failed to read superblock\n");
+        return;
+    }
+
+    uint64_t seg_start = sb.log_start + (uint64_t)segment_id * sb.segment_size;
+
+    if (read_blocks(seg_start, LSFS_SUMMARY_BLOCKS, block) < 0) {
         fprintf(stderr, "Failed to read segment %u\n", segment_id);
         return;
     }
 
-    summary = (struct lsfs_segment_summary *)block;
+    summary = (const struct lsfs_segment_summary *)block;
+
+    /* The current summary may be the copy in the last blocks */
+    if (read_blocks(seg_start + LSFS_SUMMARY_TAIL(sb.segment_size), LSFS_SUMMARY_BLOCKS,
+                    tail_block) == 0) {
+        current = lsfs_summary_current(summary, (const struct lsfs_segment_summary *)tail_block,
+                                       segment_id, sb.segment_size);
+    }
+    if (current) {
+        summary = current;
+    }
 
     printf("=== SEGMENT %u ===\n", segment_id);
     printf("Start block:      %lu\n", (unsigned long)seg_start);
+    if (summary == (const struct lsfs_segment_summary *)tail_block) {
+        printf("Summary copy:     last %u blocks\n", LSFS_SUMMARY_BLOCKS);
+    }
     printf("Magic:            0x%08X", summary->header.magic);
 
     if (summary->header.magic == LSFS_SEGMENT_MAGIC) {
@@ -234,36 +305,63 @@ static void dump_segment(uint32_t segment_id)
     format_time(summary->header.timestamp, time_str);
     printf("Timestamp:        %s\n", time_str);
 
+    printf("Sequence:         %lu\n", (unsigned long)summary->header.sequence);
     printf("Block count:      %u\n", summary->header.block_count);
+    printf("Checksum:         0x%08X (%s)\n", summary->header.checksum,
+           summary->header.checksum == lsfs_summary_checksum(summary) ? "ok" : "MISMATCH");
+
+    if (read_block(lsfs_sb_segtable_block(&sb, sb.active_checkpoint) + segment_id / per_block,
+                   table_block) == 0) {
+        const struct lsfs_segment_usage *usage =
+            (const struct lsfs_segment_usage *)table_block + segment_id % per_block;
+        printf("Live blocks:      %u\n", usage->live_blocks);
+    }
 
     printf("Block contents:\n");
-    uint32_t max_entries = (LSFS_BLOCK_SIZE - sizeof(struct lsfs_segment_header)) /
-                           sizeof(struct lsfs_block_info);
-    uint32_t num_entries = summary->header.block_count - 1;
-    if (num_entries > max_entries) {
-        num_entries = max_entries;
+    uint32_t num_entries = 0;
+    if (summary->header.block_count > LSFS_SUMMARY_BLOCKS &&
+        summary->header.block_count <= sb.segment_size) {
+        num_entries = summary->header.block_count - LSFS_SUMMARY_BLOCKS;
     }
 
     for (uint32_t i = 0; i < num_entries && i < 10; i++) {
-        struct lsfs_block_info *info = &summary->blocks[i];
+        const struct lsfs_block_info *info = &summary->blocks[i];
         const char *type_str;
 
         switch (info->type) {
         case LSFS_BLOCK_TYPE_DATA: type_str = "data"; break;
         case LSFS_BLOCK_TYPE_INODE: type_str = "inode"; break;
-        case LSFS_BLOCK_TYPE_INDIRECT: type_str = "indirect"; break;
+        case LSFS_BLOCK_TYPE_EXTENT: type_str = "extent"; break;
         case LSFS_BLOCK_TYPE_DIRENT: type_str = "dirent"; break;
+        case LSFS_BLOCK_TYPE_IMAP: type_str = "imap"; break;
+        case LSFS_BLOCK_TYPE_PACKED: type_str = "packed"; break;
         default: type_str = "unknown"; break;
         }
 
-        printf("  Block %u: ino=%u offset=%u type=%s\n",
-               i + 1, info->ino, info->offset, type_str);
+        printf("  Block %u: ino=%u offset=%u type=%s crc=0x%08X\n",
+               i + LSFS_SUMMARY_BLOCKS, info->ino, info->offset, type_str, info->checksum);
     }
 
     if (num_entries > 10) {
         printf("  ... and %u more blocks\n", num_entries - 10);
     }
 
+    /* The blocks are read in one piece to check them against the summary */
+    uint8_t *data = malloc((size_t)num_entries * LSFS_BLOCK_SIZE);
+    uint32_t *crcs = malloc((size_t)num_entries * sizeof(uint32_t));
+    if (num_entries > 0 && data && crcs &&
+        read_blocks(seg_start + LSFS_SUMMARY_BLOCKS, num_entries, data) == 0) {
+        uint32_t intact = 0;
+
+        lsfs_crc32c_blocks(data, num_entries, crcs);
+        for (uint32_t i = 0; i < num_entries; i++) {
+            intact += crcs[i] == summary->blocks[i].checksum;
+        }
+        printf("Intact blocks:    %u of %u\n", intact, num_entries);
+    }
+    free(data);
+    free(crcs);
+
     printf("\n");
 }
 
@@ -275,6 +373,7 @@ static void dump_imap(void)
     struct lsfs_superblock sb;
     struct lsfs_checkpoint_header cp;
     uint8_t block[LSFS_BLOCK_SIZE];
+    uint64_t *table;
     uint64_t cp_block;
 
     if (read_block(LSFS_SUPERBLOCK_BLOCK, &sb) < 0) {
@@ -282,8 +381,7 @@ static void dump_imap(void)
         return;
     }
 
-    cp_block = (sb.active_checkpoint == 0) ?
-               LSFS_CHECKPOINT0_START : LSFS_CHECKPOINT1_START;
+    cp_block = sb.checkpoint_region[sb.active_checkpoint & 1];
 
     if (read_block(cp_block, block) < 0) {
         fprintf(stderr, "Failed to read checkpoint\n");
@@ -294,31 +392,309 @@ static void dump_imap(void)
     printf("=== INODE MAP ===\n");
     printf("Entries: %u\n\n", cp.imap_entries);
 
-    uint32_t entries_per_block = LSFS_BLOCK_SIZE / sizeof(struct lsfs_imap_entry);
-    uint32_t blocks_needed = (cp.imap_entries + entries_per_block - 1) / entries_per_block;
+    uint64_t max_chunks = sb.max_inodes / LSFS_IMAP_CHUNK_ENTRIES;
+    uint32_t chunks = cp.imap_chunks < max_chunks ? cp.imap_chunks : (uint32_t)max_chunks;
+
+    /* The chunk table is read in one piece */
+    uint32_t table_blocks = (chunks + LSFS_IMAP_TABLE_ENTRIES - 1) / LSFS_IMAP_TABLE_ENTRIES;
+    table = malloc((size_t)table_blocks * LSFS_BLOCK_SIZE);
+    if (chunks > 0 && (!table || read_blocks(cp_block + 1, table_blocks, table) < 0)) {
+        fprintf(stderr, "Failed to read inode map chunk table\n");
+        free(table);
+        return;
+    }
 
-    for (uint32_t b = 0; b < blocks_needed; b++) {
-        if (read_block(cp_block + 1 + b, block) < 0) {
+    for (uint32_t c = 0; c < chunks; c++) {
+        uint64_t chunk_block = table[c];
+        if (chunk_block == 0 || read_block(chunk_block, block) < 0) {
             continue;
         }
 
+        printf("  Chunk %u at block %lu\n", c, (unsigned long)chunk_block);
+
         struct lsfs_imap_entry *entries = (struct lsfs_imap_entry *)block;
-        uint32_t entries_in_block = (b == blocks_needed - 1) ?
-                                    (cp.imap_entries - b * entries_per_block) :
-                                    entries_per_block;
 
-        for (uint32_t i = 0; i < entries_in_block; i++) {
+        for (uint32_t i = 0; i < LSFS_IMAP_CHUNK_ENTRIES; i++) {
             struct lsfs_imap_entry *entry = &entries[i];
             if (entry->ino > 0) {
-                printf("  Inode %u: block %lu, version %u\n",
+                printf("  Inode %u: block %lu slot %u, version %u\n",
                        entry->ino,
-                       (unsigned long)entry->location,
+                       (unsigned long)LSFS_INODE_LOC_BLOCK(entry->location),
+                       LSFS_INODE_LOC_SLOT(entry->location),
                        entry->version);
             }
         }
     }
+    free(table);
+
+    printf("\n");
+}
+
+/*
+ * Find a statistics line by name
+ * Returns the text after the name, or NULL if there is no such line.
+ */
+static const char *stat_line(const char *text, const char *name)
+{
+    size_t len = strlen(name);
+    const char *line = text;
+
+    while (line && *line) {
+        if (strncmp(line, name, len) == 0 && line[len] == ' ') {
+            return line + len + 1;
+        }
+        line = strchr(line, '\n');
+        if (line) {
+            line++;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Get a single-valued statistic, 0 if it is missing
+ */
+static uint64_t stat_value(const char *text, const char *name)
+{
+    const char *value = stat_line(text, name);
+    return value ? strtoull(value, NULL, 10) : 0;
+}
+
+/*
+ * Format a byte count with a binary unit
+ */
+static void format_bytes(uint64_t bytes, char *str)
+{
+    static const char *const units[] = { "B", "KB", "MB", "GB", "TB" };
+    double value = (double)bytes;
+    int unit = 0;
+
+    while (value >= 1024.0 && unit < 4) {
+        value /= 1024.0;
+        unit++;
+    }
+    sprintf(str, unit == 0 ? "%.0f %s" : "%.1f %s", value, units[unit]);
+}
+
+/*
+ * Print a hit rate line for a cache
+ */
+static void print_hit_rate(const char *label, uint64_t hits, uint64_t misses)
+{
+    uint64_t total = hits + misses;
+
+    printf("%-18s%lu hits, %lu misses", label, (unsigned long)hits, (unsigned long)misses);
+    if (total > 0) {
+        printf(" (%.1f%%)", 100.0 * (double)hits / (double)total);
+    }
+    printf("\n");
+}
+
+/*
+ * Get the upper bound in microseconds of the bucket holding a percentile
+ * No bound is reported above the slowest operation seen.
+ */
+static double latency_percentile(const uint64_t *buckets, uint32_t nbuckets,
+                                 uint64_t count, uint64_t max_ns, double pct)
+{
+    double max_us = (double)max_ns / 1000.0;
+    uint64_t target = (uint64_t)((double)count * pct / 100.0 + 0.5);
+    uint64_t seen = 0;
+
+    if (target == 0) {
+        target = 1;
+    }
+    for (uint32_t b = 0; b < nbuckets; b++) {
+        seen += buckets[b];
+        if (seen >= target) {
+            double bound = (double)(1ULL << b);
+            return bound < max_us ? bound : max_us;
+        }
+    }
+    return max_us;
+}
+
+/*
+ * Print the latency table
+ * Percentiles are the upper bound of their log2 bucket, so they are
+ * accurate to a factor of two.
+ */
+static void print_latencies(const char *text)
+{
+    const char *line = text;
+    bool header = false;
+
+    while ((line = strstr(line, "latency ")) != NULL) {
+        if (line != text && line[-1] != '\n') {
+            line++;
+            continue;
+        }
+
+        char name[32];
+        int consumed = 0;
+        unsigned long count, total_ns, max_ns;
+        if (sscanf(line, "latency %31s %lu %lu %lu%n", name, &count, &total_ns,
+                   &max_ns, &consumed) != 4) {
+            break;
+        }
+
+        uint64_t buckets[64] = { 0 };
+        uint32_t nbuckets = 0;
+        const char *p = line + consumed;
+        while (*p == ' ' && nbuckets < 64) {
+            char *end;
+            buckets[nbuckets++] = strtoull(p, &end, 10);
+            p = end;
+        }
+        line = p;
+
+        if (count == 0 || nbuckets == 0) {
+            continue;
+        }
+        if (!header) {
+            printf("\n%-16s %10s %10s %8s %8s %8s %10s\n", "Latency (us)", "count",
+                   "avg", "p50", "p90", "p99", "max");
+            header = true;
+        }
+        printf("%-16s %10lu %10.1f %8.1f %8.1f %8.1f %10.1f\n", name, count,
+               (double)total_ns / 1000.0 / (double)count,
+               latency_percentile(buckets, nbuckets, count, max_ns, 50),
+               latency_percentile(buckets, nbuckets, count, max_ns, 90),
+               latency_percentile(buckets, nbuckets, count, max_ns, 99),
+               (double)max_ns / 1000.0);
+    }
+}
+
+/*
+ * Print the statistics of a mounted filesystem
+ * They are read from the root directory's LSFS_STATS_XATTR attribute,
+ * which is rendered again on every read, so the buffer is grown until
+ * one read fits.
+ */
+static int dump_stats(void)
+{
+    size_t size = 16384;
+    char *text = NULL;
+    ssize_t len;
+
+    while (1) {
+        char *grown = realloc(text, size + 1);
+        if (!grown) {
+            free(text);
+            fprintf(stderr, "Out of memory\n");
+            return -1;
+        }
+        text = grown;
+        len = fgetxattr(g_fd, LSFS_STATS_XATTR, text, size);
+        if (len >= 0) {
+            break;
+        }
+        if (errno != ERANGE) {
+            perror("Failed to read statistics (is this an LSFS mount point?)");
+            free(text);
+            return -1;
+        }
+        size *= 2;
+    }
+    text[len] = '\0';
+
+    char user_read[32], user_write[32], dev_read[32], dev_write[32], log_bytes[32];
+    uint64_t user_written = stat_value(text, "user_write_bytes");
+    uint64_t device_written = stat_value(text, "device_write_bytes");
+    uint64_t log_blocks = stat_value(text, "log_blocks");
+    uint64_t segments = stat_value(text, "segments");
+    uint64_t segment_blocks = stat_value(text, "segment_blocks");
+    uint64_t in_use = stat_value(text, "segments_active") + stat_value(text, "segments_full") +
+                      stat_value(text, "segments_cleaning");
+
+    format_bytes(stat_value(text, "user_read_bytes"), user_read);
+    format_bytes(user_written, user_write);
+    format_bytes(stat_value(text, "device_read_bytes"), dev_read);
+    format_bytes(device_written, dev_write);
+    format_bytes(log_blocks * LSFS_BLOCK_SIZE, log_bytes);
+
+    printf("=== STATISTICS ===\n");
+    printf("User reads:       %s\n", user_read);
+    printf("User writes:      %s\n", user_write);
+    printf("Device reads:     %s\n", dev_read);
+    printf("Device writes:    %s\n", dev_write);
+    printf("Log appended:     %s (%lu blocks)\n", log_bytes, (unsigned long)log_blocks);
+    if (user_written > 0) {
+        printf("Write amp:        %.2f device, %.2f log\n",
+               (double)device_written / (double)user_written,
+               (double)log_blocks * LSFS_BLOCK_SIZE / (double)user_written);
+    }
+
+    printf("\nSegments:         %lu (%lu free, %lu awaiting checkpoint, %lu open, "
+           "%lu full, %lu cleaning)\n",
+           (unsigned long)segments, (unsigned long)stat_value(text, "segments_free"),
+           (unsigned long)stat_value(text, "segments_released"),
+           (unsigned long)stat_value(text, "segments_active"),
+           (unsigned long)stat_value(text, "segments_full"),
+           (unsigned long)stat_value(text, "segments_cleaning"));
+    if (in_use > 0 && segment_blocks > 0) {
+        uint64_t live = stat_value(text, "live_blocks");
+        printf("Live blocks:      %lu (%.1f%% of segments in use)\n", (unsigned long)live,
+               100.0 * (double)live / (double)(in_use * segment_blocks));
+    }
+    const char *util = stat_line(text, "segment_utilization");
+    if (util && in_use > 0) {
+        printf("Utilization:\n");
+        for (int b = 0; b < 10; b++) {
+            char *end;
+            uint64_t n = strtoull(util, &end, 10);
+            util = end;
+            int bar = (int)(n * 40 / in_use);
+            printf("  %3d-%3d%%  %6lu  %.*s\n", b * 10, b * 10 + 10, (unsigned long)n, bar,
+                   "########################################");
+        }
+    }
+    printf("Cleaner:          %lu segments cleaned, %lu live blocks in them, "
+           "%lu candidates\n",
+           (unsigned long)stat_value(text, "gc_segments"),
+           (unsigned long)stat_value(text, "gc_live_blocks"),
+           (unsigned long)stat_value(text, "gc_victims"));
+    char discarded[32];
+    format_bytes(stat_value(text, "discard_bytes"), discarded);
+    printf("Discard:          %s in %lu segments, %lu waiting; %lu blocks preallocated\n",
+           discarded, (unsigned long)stat_value(text, "segments_discarded"),
+           (unsigned long)stat_value(text, "segments_discarding"),
+           (unsigned long)stat_value(text, "prealloc_blocks"));
 
     printf("\n");
+    print_hit_rate("Buffer cache:", stat_value(text, "buffer_cache_hits"),
+                   stat_value(text, "buffer_cache_misses"));
+    uint64_t ahead = stat_value(text, "readahead_blocks");
+    printf("Readahead:        %lu blocks, %lu used", (unsigned long)ahead,
+           (unsigned long)stat_value(text, "readahead_used"));
+    if (ahead > 0) {
+        printf(" (%.1f%%)", 100.0 * (double)stat_value(text, "readahead_used") / (double)ahead);
+    }
+    printf(", %lu runs dropped\n", (unsigned long)stat_value(text, "readahead_dropped"));
+    print_hit_rate("Inode cache:", stat_value(text, "inode_cache_hits"),
+                   stat_value(text, "inode_cache_misses"));
+    print_hit_rate("Dentry cache:", stat_value(text, "dentry_cache_hits") +
+                   stat_value(text, "dentry_cache_negative_hits"),
+                   stat_value(text, "dentry_cache_misses"));
+
+    printf("Group commit:     %lu fsyncs in %lu commits (max batch %lu)\n",
+           (unsigned long)stat_value(text, "commit_requests"),
+           (unsigned long)stat_value(text, "commit_rounds"),
+           (unsigned long)stat_value(text, "commit_max_batch"));
+
+    uint64_t compressed = stat_value(text, "compressed_blocks");
+    if (compressed + stat_value(text, "incompressible_blocks") > 0) {
+        uint64_t bytes = stat_value(text, "compressed_bytes");
+        printf("Compression:      %lu blocks in %lu bytes (%.2fx), %lu incompressible\n",
+               (unsigned long)compressed, (unsigned long)bytes,
+               bytes > 0 ? (double)compressed * LSFS_BLOCK_SIZE / (double)bytes : 0.0,
+               (unsigned long)stat_value(text, "incompressible_blocks"));
+    }
+
+    print_latencies(text);
+
+    free(text);
+    return 0;
 }
 
 /*
@@ -326,7 +702,8 @@ static void dump_imap(void)
  */
 static void usage(const char *progname)
 {
-    fprintf(stderr, "Usage: %s <disk_image> <command> [args]\n\n", progname);
+    fprintf(stderr, "Usage: %s <disk_image> <command> [args]\n", progname);
+    fprintf(stderr, "       %s <mount_point> stats\n\n", progname);
     fprintf(stderr, "Commands:\n");
     fprintf(stderr, "  superblock              Dump superblock\n");
     fprintf(stderr, "  checkpoint [0|1]        Dump checkpoint (default: both)\n");
@@ -334,6 +711,7 @@ static void usage(const char *progname)
     fprintf(stderr, "  inode <block> [offset]  Dump inode at block (offset 0-15)\n");
     fprintf(stderr, "  imap                    Dump inode map\n");
     fprintf(stderr, "  all                     Dump all structures\n");
+    fprintf(stderr, "  stats                   Print statistics of a mounted filesystem\n");
 }
 
 int main(int argc, char *argv[])
@@ -355,7 +733,11 @@ int main(int argc, char *argv[])
         return 1;
     }
 
-    if (strcmp(command, "superblock") == 0) {
+    if (strcmp(command, "stats") == 0) {
+        int ret = dump_stats();
+        close(g_fd);
+        return ret < 0 ? 1 : 0;
+    } else if (strcmp(command, "superblock") == 0) {
         dump_superblock();
     } else if (strcmp(command, "checkpoint") == 0) {
         if (argc > 3) {
@@ -14,8 +14,11 @@
 #include <sys/random.h>
 
 #include "ondisk.h"
+#include "crc32c.h"
 
 #define DEFAULT_SIZE_MB     256
+#define DEFAULT_SEGMENT_KB  (LSFS_SEGMENT_SIZE / 1024)
+#define DEFAULT_BLOCKS_PER_INODE 4  /* One inode per 16 KB by default */
 
 /*
  * Generate UUID
@@ -58,25 +61,67 @@ static int write_block(int fd, uint64_t block_num, const void *buf)
     return (ret == LSFS_BLOCK_SIZE) ? 0 : -1;
 }
 
+/*
+ * Check that a count is a power of two
+ */
+static int is_power_of_two(uint64_t n)
+{
+    return n != 0 && (n & (n - 1)) == 0;
+}
+
 /*
  * Create and format filesystem
+ * Segments are segment_blocks long, and the log starts on a multiple of
+ * align_blocks and of the segment size, so no segment straddles an erase
+ * block or zone of that size.  The checkpoint regions are sized for an
+ * inode map of max_inodes entries and the usage table for every segment
+ * that fits after them.
  */
-static int format_filesystem(const char *path, uint64_t size_bytes)
+static int format_filesystem(const char *path, uint64_t size_bytes,
+                             uint32_t segment_blocks, uint32_t align_blocks,
+                             uint64_t max_inodes)
 {
     int fd;
     struct lsfs_superblock sb;
     struct lsfs_checkpoint_header cp;
     struct lsfs_inode root_inode;
     struct lsfs_imap_entry root_imap;
-    struct lsfs_segment_header seg_header;
     uint8_t block[LSFS_BLOCK_SIZE];
     uint8_t dir_block[LSFS_BLOCK_SIZE];
+    uint32_t crcs[3];           /* Root inode, directory and imap blocks */
     char uuid_str[40];
     uint64_t now;
 
-    /* Calculate filesystem parameters */
     uint64_t total_blocks = size_bytes / LSFS_BLOCK_SIZE;
-    uint64_t total_segments = (total_blocks - LSFS_LOG_START) / LSFS_SEGMENT_BLOCKS;
+
+    /* Each checkpoint region holds its header and the chunk table */
+    uint64_t imap_chunks = max_inodes / LSFS_IMAP_CHUNK_ENTRIES;
+    uint64_t checkpoint_blocks = 1 + (imap_chunks + LSFS_IMAP_TABLE_ENTRIES - 1) /
+                                     LSFS_IMAP_TABLE_ENTRIES;
+    uint64_t segtable_start = LSFS_CHECKPOINT_START + 2 * checkpoint_blocks;
+
+    /* Size the usage table for every segment that could follow it, then
+     * place the log on the alignment boundary after the table's two
+     * copies, one for each checkpoint region */
+    uint32_t per_block = LSFS_BLOCK_SIZE / sizeof(struct lsfs_segment_usage);
+    uint64_t max_segments = total_blocks > segtable_start ?
+                            (total_blocks - segtable_start) / segment_blocks : 0;
+    if (max_segments > LSFS_MAX_SEGMENTS) {
+        max_segments = LSFS_MAX_SEGMENTS;
+    }
+    uint64_t segtable_blocks = (max_segments + per_block - 1) / per_block;
+    uint64_t align = align_blocks > segment_blocks ? align_blocks : segment_blocks;
+    uint64_t log_start = (segtable_start + 2 * segtable_blocks + align - 1) / align * align;
+
+    /* The first segment holds the root inode, its directory block and the
+     * inode map chunk, right after the segment summary */
+    uint64_t inode_block = log_start + LSFS_SUMMARY_BLOCKS;
+    uint64_t root_dir_block = inode_block + 1;
+    uint64_t imap_block = inode_block + 2;
+
+    /* Calculate filesystem parameters */
+    uint64_t total_segments = total_blocks > log_start ?
+                              (total_blocks - log_start) / segment_blocks : 0;
 
     if (total_segments < 4) {
         fprintf(stderr, "Error: Filesystem too small, need at least 4 segments\n");
@@ -85,14 +130,17 @@ static int format_filesystem(const char *path, uint64_t size_bytes)
 
     if (total_segments > LSFS_MAX_SEGMENTS) {
         total_segments = LSFS_MAX_SEGMENTS;
-        total_blocks = LSFS_LOG_START + total_segments * LSFS_SEGMENT_BLOCKS;
+        total_blocks = log_start + total_segments * segment_blocks;
         size_bytes = total_blocks * LSFS_BLOCK_SIZE;
     }
 
     printf("Creating LSFS filesystem:\n");
     printf("  Size: %lu MB\n", (unsigned long)(size_bytes / (1024 * 1024)));
     printf("  Blocks: %lu\n", (unsigned long)total_blocks);
-    printf("  Segments: %lu\n", (unsigned long)total_segments);
+    printf("  Segments: %lu of %u KB, starting at block %lu\n",
+           (unsigned long)total_segments, segment_blocks * (LSFS_BLOCK_SIZE / 1024),
+           (unsigned long)log_start);
+    printf("  Inodes: %lu\n", (unsigned long)max_inodes);
 
     /* Create/open file */
     fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
@@ -115,20 +163,25 @@ static int format_filesystem(const char *path, uint64_t size_bytes)
     sb.magic = LSFS_MAGIC;
     sb.version = LSFS_VERSION;
     sb.block_size = LSFS_BLOCK_SIZE;
-    sb.segment_size = LSFS_SEGMENT_BLOCKS;
+    sb.segment_size = segment_blocks;
     sb.total_blocks = total_blocks;
     sb.total_segments = total_segments;
     sb.inode_count = 1;  /* Root inode */
-    sb.checkpoint_region[0] = LSFS_CHECKPOINT0_START;
-    sb.checkpoint_region[1] = LSFS_CHECKPOINT1_START;
+    sb.checkpoint_region[0] = LSFS_CHECKPOINT_START;
+    sb.checkpoint_region[1] = LSFS_CHECKPOINT_START + checkpoint_blocks;
+    sb.checkpoint_blocks = checkpoint_blocks;
+    sb.segtable_start = segtable_start;
+    sb.segtable_blocks = segtable_blocks;
+    sb.max_inodes = max_inodes;
     sb.active_checkpoint = 0;
-    sb.log_head = LSFS_LOG_START + 2;  /* After first segment header and root inode */
+    sb.log_head = imap_block + 1;  /* After the first segment's blocks */
     sb.free_segments = total_segments - 1;  /* First segment used */
     generate_uuid(sb.uuid);
     sb.created_at = now;
     sb.mounted_at = 0;
     sb.mount_count = 0;
     sb.state = 0;  /* Clean */
+    sb.log_start = log_start;
 
     format_uuid(sb.uuid, uuid_str);
     printf("  UUID: %s\n", uuid_str);
@@ -153,7 +206,11 @@ static int format_filesystem(const char *path, uint64_t size_bytes)
     root_inode.ctime = root_inode.atime;
     root_inode.nlink = 2;  /* . and from parent (root's parent is itself) */
     root_inode.flags = 0;
-    root_inode.direct[0] = LSFS_LOG_START + 2;  /* First data block after header and inode */
+    /* First data block after the summary and inode */
+    root_inode.extents[0].logical = 0;
+    root_inode.extents[0].length = 1;
+    root_inode.extents[0].physical = root_dir_block;
+    root_inode.extent_count = 1;
     root_inode.generation = (uint64_t)rand();
 
     /* Create root directory content */
@@ -176,48 +233,82 @@ static int format_filesystem(const char *path, uint64_t size_bytes)
     de->name[0] = '.';
     de->name[1] = '.';
 
-    /* Write first segment with root inode and directory */
-    /* Segment header */
+    /* Write root inode block */
+    memset(block, 0, LSFS_BLOCK_SIZE);
+    memcpy(block, &root_inode, sizeof(root_inode));
+    crcs[0] = lsfs_crc32c(0, block, LSFS_BLOCK_SIZE);
+    if (write_block(fd, inode_block, block) < 0) {
+        fprintf(stderr, "Failed to write root inode\n");
+        close(fd);
+        return -1;
+    }
+
+    /* Write root directory data */
+    crcs[1] = lsfs_crc32c(0, dir_block, LSFS_BLOCK_SIZE);
+    if (write_block(fd, root_dir_block, dir_block) < 0) {
+        fprintf(stderr, "Failed to write root directory\n");
+        close(fd);
+        return -1;
+    }
+
+    /* Write inode map chunk 0 (just root inode) */
+    memset(&root_imap, 0, sizeof(root_imap));
+    root_imap.ino = LSFS_ROOT_INO;
+    root_imap.location = inode_block;
+    root_imap.version = 1;
+
     memset(block, 0, LSFS_BLOCK_SIZE);
-    struct lsfs_segment_summary *summary = (struct lsfs_segment_summary *)block;
+    memcpy(block + LSFS_ROOT_INO * sizeof(root_imap), &root_imap, sizeof(root_imap));
+    crcs[2] = lsfs_crc32c(0, block, LSFS_BLOCK_SIZE);
+    if (write_block(fd, imap_block, block) < 0) {
+        fprintf(stderr, "Failed to write inode map\n");
+        close(fd);
+        return -1;
+    }
+
+    /* Write the first segment's summary now that its blocks are known;
+     * the image is new, so the rest of the summary blocks are zero */
+    struct lsfs_segment_summary *summary = calloc(LSFS_SUMMARY_BLOCKS, LSFS_BLOCK_SIZE);
+    if (!summary) {
+        fprintf(stderr, "Failed to allocate segment summary\n");
+        close(fd);
+        return -1;
+    }
     summary->header.magic = LSFS_SEGMENT_MAGIC;
     summary->header.segment_id = 0;
     summary->header.timestamp = now;
-    summary->header.block_count = 3;  /* Header + inode + dir data */
-    summary->header.checksum = 0;
+    summary->header.sequence = 1;   /* The first segment write */
+    summary->header.block_count = LSFS_SUMMARY_BLOCKS + 3;  /* Inode, dir data, imap */
 
     /* Block info for inode */
     summary->blocks[0].ino = LSFS_ROOT_INO;
     summary->blocks[0].offset = 0;
     summary->blocks[0].type = LSFS_BLOCK_TYPE_INODE;
+    summary->blocks[0].checksum = crcs[0];
 
     /* Block info for directory data */
     summary->blocks[1].ino = LSFS_ROOT_INO;
     summary->blocks[1].offset = 0;
     summary->blocks[1].type = LSFS_BLOCK_TYPE_DIRENT;
-
-    /* Write segment header */
-    if (write_block(fd, LSFS_LOG_START, block) < 0) {
-        fprintf(stderr, "Failed to write segment header\n");
-        close(fd);
-        return -1;
-    }
-
-    /* Write root inode block */
-    memset(block, 0, LSFS_BLOCK_SIZE);
-    memcpy(block, &root_inode, sizeof(root_inode));
-    if (write_block(fd, LSFS_LOG_START + 1, block) < 0) {
-        fprintf(stderr, "Failed to write root inode\n");
-        close(fd);
-        return -1;
-    }
-
-    /* Write root directory data */
-    if (write_block(fd, LSFS_LOG_START + 2, dir_block) < 0) {
-        fprintf(stderr, "Failed to write root directory\n");
-        close(fd);
-        return -1;
+    summary->blocks[1].checksum = crcs[1];
+
+    /* Block info for the inode map chunk holding the root inode */
+    summary->blocks[2].ino = 0;
+    summary->blocks[2].offset = 0;
+    summary->blocks[2].type = LSFS_BLOCK_TYPE_IMAP;
+    summary->blocks[2].checksum = crcs[2];
+
+    summary->header.checksum = lsfs_summary_checksum(summary);
+
+    for (uint32_t i = 0; i < LSFS_SUMMARY_BLOCKS; i++) {
+        if (write_block(fd, log_start + i, (uint8_t *)summary + i * LSFS_BLOCK_SIZE) < 0) {
+            fprintf(stderr, "Failed to write segment summary\n");
+            free(summary);
+            close(fd);
+            return -1;
+        }
     }
+    free(summary);
 
     /* Initialize checkpoint region 0 */
     memset(&cp, 0, sizeof(cp));
@@ -225,56 +316,61 @@ static int format_filesystem(const char *path, uint64_t size_bytes)
     cp.version = LSFS_VERSION;
     cp.sequence = 1;
     cp.timestamp = now;
-    cp.log_head = LSFS_LOG_START + 3;
+    cp.log_head = imap_block + 1;
+    cp.segment_seq = 1;             /* Covers the first segment; nothing is open */
     cp.imap_entries = 1;
+    cp.imap_chunks = (uint32_t)imap_chunks;
     cp.segment_entries = total_segments;
-    cp.checksum = 0;
     cp.complete = 1;
+    cp.checksum = lsfs_checkpoint_checksum(&cp);
 
     memset(block, 0, LSFS_BLOCK_SIZE);
     memcpy(block, &cp, sizeof(cp));
-    if (write_block(fd, LSFS_CHECKPOINT0_START, block) < 0) {
+    if (write_block(fd, sb.checkpoint_region[0], block) < 0) {
         fprintf(stderr, "Failed to write checkpoint header\n");
         close(fd);
         return -1;
     }
 
-    /* Write inode map (just root inode) */
-    memset(&root_imap, 0, sizeof(root_imap));
-    root_imap.ino = LSFS_ROOT_INO;
-    root_imap.location = LSFS_LOG_START + 1;
-    root_imap.version = 1;
-
+    /* Write the first block of the inode map chunk table; only chunk 0
+     * holds an inode, and the rest of the table is still zero */
     memset(block, 0, LSFS_BLOCK_SIZE);
-    memcpy(block, &root_imap, sizeof(root_imap));
-    if (write_block(fd, LSFS_CHECKPOINT0_START + 1, block) < 0) {
-        fprintf(stderr, "Failed to write inode map\n");
+    ((uint64_t *)block)[0] = imap_block;
+    if (write_block(fd, sb.checkpoint_region[0] + 1, block) < 0) {
+        fprintf(stderr, "Failed to write inode map chunk table\n");
         close(fd);
         return -1;
     }
 
-    /* Initialize segment usage table */
-    memset(block, 0, LSFS_BLOCK_SIZE);
+    /* Initialize segment usage table; the rest of the segments are free */
     struct lsfs_segment_usage *seg_usage = (struct lsfs_segment_usage *)block;
 
-    /* First segment is used */
-    seg_usage[0].segment_id = 0;
-    seg_usage[0].state = LSFS_SEG_FULL;
-    seg_usage[0].live_blocks = 2;
-    seg_usage[0].timestamp = now;
-
-    /* Rest are free */
-    for (uint32_t i = 1; i < total_segments && i < (LSFS_BLOCK_SIZE / sizeof(struct lsfs_segment_usage)); i++) {
-        seg_usage[i].segment_id = i;
-        seg_usage[i].state = LSFS_SEG_FREE;
-        seg_usage[i].live_blocks = 0;
-        seg_usage[i].timestamp = 0;
-    }
+    for (uint64_t first = 0; first < total_segments; first += per_block) {
+        memset(block, 0, LSFS_BLOCK_SIZE);
+        for (uint64_t i = first; i < total_segments && i < first + per_block; i++) {
+            seg_usage[i - first].segment_id = (uint32_t)i;
+            seg_usage[i - first].state = LSFS_SEG_FREE;
+        }
 
-    if (write_block(fd, LSFS_SEGTABLE_START, block) < 0) {
-        fprintf(stderr, "Failed to write segment table\n");
-        close(fd);
-        return -1;
+        /* First segment is used */
+        if (first == 0) {
+            seg_usage[0].state = LSFS_SEG_FULL;
+            seg_usage[0].live_blocks = 3;
+            seg_usage[0].timestamp = now;
+            seg_usage[0].sequence = 1;
+            for (uint32_t i = LSFS_SUMMARY_BLOCKS; i < LSFS_SUMMARY_BLOCKS + 3; i++) {
+                seg_usage[0].live_map[i / 64] |= 1ULL << (i % 64);
+            }
+        }
+
+        for (uint32_t region = 0; region < 2; region++) {
+            if (write_block(fd, lsfs_sb_segtable_block(&sb, region) + first / per_block,
+                            block) < 0) {
+                fprintf(stderr, "Failed to write segment table\n");
+                close(fd);
+                return -1;
+            }
+        }
     }
 
     /* Sync to disk */
@@ -295,29 +391,61 @@ static void usage(const char *progname)
     fprintf(stderr, "Usage: %s [options] <disk_image>\n\n", progname);
     fprintf(stderr, "Options:\n");
     fprintf(stderr, "  -s, --size <MB>     Filesystem size in MB (default: %d)\n", DEFAULT_SIZE_MB);
+    fprintf(stderr, "  -S, --segment-size <KB>  Segment size, a power of two from %d to %d\n"
+                    "                      (default: %d)\n",
+            LSFS_SEGMENT_BLOCKS_MIN * (LSFS_BLOCK_SIZE / 1024), DEFAULT_SEGMENT_KB,
+            DEFAULT_SEGMENT_KB);
+    fprintf(stderr, "  -A, --align <KB>    Start segments on multiples of the device's erase\n"
+                    "                      block or zone size, a power of two\n"
+                    "                      (default: the segment size)\n");
+    fprintf(stderr, "  -N, --inodes <count> Number of inodes, rounded up to a multiple of %u\n"
+                    "                      (default: one per %d KB, at least %u)\n",
+            (unsigned)LSFS_IMAP_CHUNK_ENTRIES, DEFAULT_BLOCKS_PER_INODE * (LSFS_BLOCK_SIZE / 1024),
+            (unsigned)LSFS_MIN_INODES);
     fprintf(stderr, "  -h, --help          Show this help\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "Example:\n");
     fprintf(stderr, "  %s -s 512 disk.img\n", progname);
+    fprintf(stderr, "  %s -s 1024 -S 2048 -A 8192 disk.img\n", progname);
+    fprintf(stderr, "  %s -s 65536 -N 4000000 disk.img\n", progname);
 }
 
 int main(int argc, char *argv[])
 {
     uint64_t size_mb = DEFAULT_SIZE_MB;
+    uint64_t segment_kb = DEFAULT_SEGMENT_KB;
+    uint64_t align_kb = 0;
+    uint64_t inodes = 0;
     char *path = NULL;
     int opt;
 
     static struct option long_options[] = {
         {"size", required_argument, NULL, 's'},
+        {"segment-size", required_argument, NULL, 'S'},
+        {"align", required_argument, NULL, 'A'},
+        {"inodes", required_argument, NULL, 'N'},
         {"help", no_argument, NULL, 'h'},
         {NULL, 0, NULL, 0}
     };
 
-    while ((opt = getopt_long(argc, argv, "s:h", long_options, NULL)) != -1) {
+    while ((opt = getopt_long(argc, argv, "s:S:A:N:h", long_options, NULL)) != -1) {
         switch (opt) {
         case 's':
             size_mb = strtoull(optarg, NULL, 10);
             break;
+        case 'S':
+            segment_kb = strtoull(optarg, NULL, 10);
+            break;
+        case 'A':
+            align_kb = strtoull(optarg, NULL, 10);
+            break;
+        case 'N':
+            inodes = strtoull(optarg, NULL, 10);
+            if (inodes == 0) {
+                fprintf(stderr, "Error: Invalid inode count: %s\n", optarg);
+                return 1;
+            }
+            break;
         case 'h':
             usage(argv[0]);
             return 0;
@@ -340,10 +468,43 @@ int main(int argc, char *argv[])
         return 1;
     }
 
-    if (size_mb > 1024) {
-        fprintf(stderr, "Error: Maximum size is 1024 MB (1 GB)\n");
+    if (size_mb > (uint64_t)INT64_MAX / (1024 * 1024)) {
+        fprintf(stderr, "Error: Size is too large\n");
+        return 1;
+    }
+
+    uint64_t segment_blocks = segment_kb / (LSFS_BLOCK_SIZE / 1024);
+    if (segment_kb % (LSFS_BLOCK_SIZE / 1024) != 0 || !is_power_of_two(segment_blocks) ||
+        segment_blocks < LSFS_SEGMENT_BLOCKS_MIN || segment_blocks > LSFS_SEGMENT_BLOCKS) {
+        fprintf(stderr, "Error: Segment size must be a power of two from %d to %d KB\n",
+                LSFS_SEGMENT_BLOCKS_MIN * (LSFS_BLOCK_SIZE / 1024), DEFAULT_SEGMENT_KB);
+        return 1;
+    }
+
+    uint64_t align_blocks = align_kb / (LSFS_BLOCK_SIZE / 1024);
+    if (align_kb != 0 && (align_kb % (LSFS_BLOCK_SIZE / 1024) != 0 ||
+                          !is_power_of_two(align_blocks) || align_blocks > UINT32_MAX)) {
+        fprintf(stderr, "Error: Alignment must be a power of two multiple of %d KB\n",
+                LSFS_BLOCK_SIZE / 1024);
+        return 1;
+    }
+
+    if (inodes == 0) {
+        inodes = size_mb * 1024 * 1024 / LSFS_BLOCK_SIZE / DEFAULT_BLOCKS_PER_INODE;
+        if (inodes < LSFS_MIN_INODES) {
+            inodes = LSFS_MIN_INODES;
+        }
+        if (inodes > LSFS_MAX_INODES) {
+            inodes = LSFS_MAX_INODES;
+        }
+    }
+    if (inodes > LSFS_MAX_INODES) {
+        fprintf(stderr, "Error: Maximum inode count is %lu\n", (unsigned long)LSFS_MAX_INODES);
         return 1;
     }
+    inodes = (inodes + LSFS_IMAP_CHUNK_ENTRIES - 1) / LSFS_IMAP_CHUNK_ENTRIES *
+             LSFS_IMAP_CHUNK_ENTRIES;
 
-    return format_filesystem(path, size_mb * 1024 * 1024);
+    return format_filesystem(path, size_mb * 1024 * 1024, (uint32_t)segment_blocks,
+                             (uint32_t)align_blocks, inodes);
 }